@@ -23,6 +23,12 @@ camera {
         texture { pigment {color rgb Color / 255} }
     }
 #end
+#macro VoxRun(Pos, Len, Color)
+    box {
+        Pos, Pos + <Len, 1, 1>
+        texture { pigment {color rgb Color / 255} }
+    }
+#end
 
 {{#light}}
 global_settings { ambient_light rgb<1, 1, 1> * {{ambient}} }
@@ -34,7 +40,5 @@ light_source {
 {{/light}}
 
 union {
-{{#voxels}}
-    Vox({{pos}}, {{color}})
-{{/voxels}}
+{{voxels}}
 }
@@ -0,0 +1,57 @@
+/* Goxel 3D voxels editor
+ *
+ * copyright (c) 2024 Guillaume Chereau <guillaume@noctua-software.com>
+ *
+ * Goxel is free software: you can redistribute it and/or modify it under the
+ * terms of the GNU General Public License as published by the Free Software
+ * Foundation, either version 3 of the License, or (at your option) any later
+ * version.
+
+ * Goxel is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+
+ * You should have received a copy of the GNU General Public License along with
+ * goxel.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Composite the order independent transparency buffers over the frame.
+ *
+ * The output alpha is the revealage, and should be blended with
+ * (ONE_MINUS_SRC_ALPHA, SRC_ALPHA) for the colors.
+ */
+
+uniform mediump sampler2D u_accum_tex;
+uniform mediump sampler2D u_weight_tex;
+
+varying mediump vec2 v_uv;
+
+#ifdef VERTEX_SHADER
+
+/************************************************************************/
+attribute highp vec3 a_pos;
+
+void main()
+{
+    v_uv = a_pos.xy * 0.5 + 0.5;
+    gl_Position = vec4(a_pos.xy, 0.0, 1.0);
+}
+/************************************************************************/
+
+#endif
+
+#ifdef FRAGMENT_SHADER
+
+/************************************************************************/
+void main()
+{
+    mediump vec4 accum = texture2D(u_accum_tex, v_uv);
+    mediump float weight = texture2D(u_weight_tex, v_uv).r;
+    if (accum.a >= 1.0) discard;
+    gl_FragColor = vec4(accum.rgb / max(weight, 1e-5), accum.a);
+}
+/************************************************************************/
+
+#endif
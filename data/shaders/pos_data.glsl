@@ -1,14 +1,16 @@
-varying lowp  vec2 v_pos_data;
+varying lowp  vec3 v_pos_data;
 uniform highp mat4 u_model;
 uniform highp mat4 u_view;
 uniform highp mat4 u_proj;
-uniform lowp  vec2 u_tile_id;
+// Tile id part of the RGBA picking value, its bits don't overlap with the
+// pos data ones.
+uniform lowp  vec4 u_tile_id;
 
 #ifdef VERTEX_SHADER
 
 /************************************************************************/
 attribute highp vec3 a_pos;
-attribute lowp  vec2 a_pos_data;
+attribute lowp  vec3 a_pos_data; // Only two bytes with 16^3 tiles.
 
 void main()
 {
@@ -25,8 +27,12 @@ void main()
 /************************************************************************/
 void main()
 {
-    gl_FragColor.rg = u_tile_id;
-    gl_FragColor.ba = v_pos_data;
+    gl_FragColor = u_tile_id;
+#ifdef POS_DATA_3_BYTES
+    gl_FragColor.gba += v_pos_data;
+#else
+    gl_FragColor.ba += v_pos_data.xy;
+#endif
 }
 /************************************************************************/
 
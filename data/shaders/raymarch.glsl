@@ -0,0 +1,239 @@
+/* Goxel 3D voxels editor
+ *
+ * copyright (c) 2026 Guillaume Chereau <guillaume@noctua-software.com>
+ *
+ * Goxel is free software: you can redistribute it and/or modify it under the
+ * terms of the GNU General Public License as published by the Free Software
+ * Foundation, either version 3 of the License, or (at your option) any later
+ * version.
+
+ * Goxel is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+
+ * You should have received a copy of the GNU General Public License along with
+ * goxel.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Render the tiles of a volume by raymarching their voxels, uploaded into
+ * a 3D texture atlas, instead of meshing them.
+ *
+ * We render the back faces of each tile box, and for each fragment walk
+ * the tile voxels grid along the view ray, like the shape shader, until we
+ * find a filled voxel.  The walk is done in the volume space, the camera
+ * position and direction are given in it.
+ */
+
+#if defined(GL_ES) && defined(FRAGMENT_SHADER)
+#extension GL_EXT_frag_depth : enable
+#endif
+
+// Must be at least three times the tiles size.
+#define MAX_STEPS 96
+
+const mediump float M_PI = 3.141592653589793;
+
+uniform highp mat4  u_model;
+uniform highp mat4  u_view;
+uniform highp mat4  u_proj;
+uniform highp vec3  u_camera;
+uniform highp vec3  u_camera_dir;
+uniform lowp  float u_ortho;
+
+uniform highp float u_tile_size;
+uniform highp vec3  u_tile_pos;
+uniform mediump sampler3D u_atlas;
+// Position of the tile slot and size of the atlas, in texels.
+uniform highp vec3  u_atlas_ofs;
+uniform highp vec3  u_atlas_size;
+
+uniform lowp  vec4  u_m_base_color;
+uniform lowp  vec3  u_m_emissive_factor;
+uniform lowp  vec3  u_l_dir;
+uniform lowp  float u_l_int;
+uniform lowp  float u_l_amb;
+
+#ifdef PICK
+// Same picking value as the pos_data shader.
+uniform lowp  vec4  u_tile_id;
+uniform highp float u_pick_scale; // 2^PICK_DATA_SHIFT.
+#endif
+
+#ifdef SHADOW
+uniform highp   mat4      u_shadow_mvp;
+uniform mediump sampler2D u_shadow_tex;
+uniform mediump float     u_shadow_strength;
+#endif
+
+varying highp vec3 v_pos;
+
+#ifdef VERTEX_SHADER
+
+/************************************************************************/
+attribute highp vec3 a_pos;
+
+void main()
+{
+    v_pos = u_tile_pos + (a_pos * 0.5 + 0.5) * u_tile_size;
+    gl_Position = u_proj * u_view * u_model * vec4(v_pos, 1.0);
+}
+/************************************************************************/
+
+#endif
+
+#ifdef FRAGMENT_SHADER
+
+/************************************************************************/
+
+#ifdef SHADOW
+float get_shadow(highp vec3 p, highp vec3 n)
+{
+    lowp vec2 PS[4]; // Poisson offsets used for the shadow map.
+    mediump float visibility = 1.0;
+    mediump float NdotL = clamp(dot(n, u_l_dir), 0.0, 1.0);
+    mediump vec4 coord = u_shadow_mvp * u_model * vec4(p, 1.0);
+    lowp float bias = clamp(0.005 * tan(acos(NdotL)), 0.0015, 0.015);
+    int i;
+
+    coord /= coord.w;
+    coord.z -= bias;
+    PS[0] = vec2(-0.94201624, -0.39906216) / 1024.0;
+    PS[1] = vec2(+0.94558609, -0.76890725) / 1024.0;
+    PS[2] = vec2(-0.09418410, -0.92938870) / 1024.0;
+    PS[3] = vec2(+0.34495938, +0.29387760) / 1024.0;
+    for (i = 0; i < 4; i++)
+        if (texture2D(u_shadow_tex, coord.xy + PS[i]).z < coord.z)
+            visibility -= 0.2;
+    if (NdotL <= 0.0) visibility = 0.5;
+    return mix(1.0, visibility, u_shadow_strength);
+}
+#endif
+
+// Same color conversions as the volume shader.
+mediump float gamma_to_linear(mediump float v)
+{
+    return (v <= 0.04045) ? (v / 12.92) : pow((v + 0.055) / 1.055, 2.4);
+}
+
+mediump float linear_to_gamma(mediump float v)
+{
+    return (v <= 0.0031308) ? 12.92 * v : (1.055) * pow(v, 1.0 / 2.4) - 0.055;
+}
+
+#ifdef PICK
+// Byte i of a picking value, as a color channel.
+lowp float pick_byte(highp float v, highp float i)
+{
+    return mod(floor(v / pow(256.0, i)), 256.0) / 255.0;
+}
+#endif
+
+void main()
+{
+    highp vec3 ro, rd, t0, t1, tmax, tdelta, v, n, p;
+    highp float tin, tout, t;
+    highp vec4 clip;
+    lowp vec4 color;
+    mediump vec3 wn, base, light;
+    bool hit = false;
+
+    // View ray, going away from the camera.
+    rd = (u_ortho > 0.0) ? u_camera_dir : normalize(v_pos - u_camera);
+    rd = mix(rd, vec3(1e-6), vec3(equal(rd, vec3(0.0))));
+    ro = v_pos;
+
+    // Clip the ray to the tile box.
+    t0 = (u_tile_pos - ro) / rd;
+    t1 = (u_tile_pos + u_tile_size - ro) / rd;
+    tin = max(max(min(t0.x, t1.x), min(t0.y, t1.y)), min(t0.z, t1.z));
+    tout = min(min(max(t0.x, t1.x), max(t0.y, t1.y)), max(t0.z, t1.z));
+    if (u_ortho <= 0.0) tin = max(tin, -length(v_pos - u_camera));
+    if (tin >= tout) discard;
+
+    // Normal of the entry face.
+    n = -sign(rd) * vec3(equal(vec3(tin), min(t0, t1)));
+
+    // Walk the tile voxels, in the tile space.
+    v = clamp(floor(ro + rd * (tin + 1e-4) - u_tile_pos),
+              0.0, u_tile_size - 1.0);
+    tdelta = abs(1.0 / rd);
+    tmax = (u_tile_pos + v + max(sign(rd), 0.0) - ro) / rd;
+    t = tin;
+    for (int i = 0; i < MAX_STEPS; i++) {
+        color = texture3D(u_atlas, (u_atlas_ofs + v + 0.5) / u_atlas_size);
+        if (color.a > 0.0) {
+            hit = true;
+            break;
+        }
+        if (tmax.x < tmax.y && tmax.x < tmax.z) {
+            t = tmax.x;
+            v.x += sign(rd.x);
+            tmax.x += tdelta.x;
+            n = vec3(-sign(rd.x), 0.0, 0.0);
+        } else if (tmax.y < tmax.z) {
+            t = tmax.y;
+            v.y += sign(rd.y);
+            tmax.y += tdelta.y;
+            n = vec3(0.0, -sign(rd.y), 0.0);
+        } else {
+            t = tmax.z;
+            v.z += sign(rd.z);
+            tmax.z += tdelta.z;
+            n = vec3(0.0, 0.0, -sign(rd.z));
+        }
+        if (t >= tout) break;
+        if (any(lessThan(v, vec3(0.0))) ||
+            any(greaterThanEqual(v, vec3(u_tile_size)))) break;
+    }
+    if (!hit) discard;
+    p = ro + rd * t;
+
+#if defined(PICK)
+    // Same as get_pos_data, with the face index of the normal.
+    highp float f = (n.y < 0.0) ? 0.0 : (n.y > 0.0) ? 1.0 :
+                    (n.z < 0.0) ? 2.0 : (n.z > 0.0) ? 3.0 :
+                    (n.x > 0.0) ? 4.0 : 5.0;
+    highp float d = (((v.x * u_tile_size + v.y) * u_tile_size + v.z) * 16.0
+                     + f) * u_pick_scale;
+    gl_FragColor = u_tile_id;
+#ifdef POS_DATA_3_BYTES
+    gl_FragColor.gba += vec3(pick_byte(d, 0.0), pick_byte(d, 1.0),
+                             pick_byte(d, 2.0));
+#else
+    gl_FragColor.ba += vec2(pick_byte(d, 0.0), pick_byte(d, 1.0));
+#endif
+#else
+    base = u_m_base_color.rgb * vec3(gamma_to_linear(color.r),
+                                     gamma_to_linear(color.g),
+                                     gamma_to_linear(color.b));
+#ifdef MATERIAL_UNLIT
+    light = sqrt(base);
+#else
+    // The diffuse part of the volume shader lighting.
+    wn = mat3(u_model[0].xyz, u_model[1].xyz, u_model[2].xyz) * n;
+    wn = normalize(wn);
+    light = base * 0.96 / M_PI * u_l_int * max(0.0, dot(u_l_dir, wn)) +
+            base * u_l_amb;
+#ifdef SHADOW
+    light *= get_shadow(p, wn);
+#endif
+    light += u_m_emissive_factor;
+    light = vec3(linear_to_gamma(light.r), linear_to_gamma(light.g),
+                 linear_to_gamma(light.b));
+#endif
+    gl_FragColor = vec4(light, u_m_base_color.a);
+#endif
+
+    // Write the depth of the voxel face.
+    clip = u_proj * u_view * u_model * vec4(p, 1.0);
+#if defined(GL_ES) && defined(GL_EXT_frag_depth)
+    gl_FragDepthEXT = clip.z / clip.w * 0.5 + 0.5;
+#elif !defined(GL_ES)
+    gl_FragDepth = clip.z / clip.w * 0.5 + 0.5;
+#endif
+}
+/************************************************************************/
+
+#endif
@@ -0,0 +1,182 @@
+/* Goxel 3D voxels editor
+ *
+ * copyright (c) 2024 Guillaume Chereau <guillaume@noctua-software.com>
+ *
+ * Goxel is free software: you can redistribute it and/or modify it under the
+ * terms of the GNU General Public License as published by the Free Software
+ * Foundation, either version 3 of the License, or (at your option) any later
+ * version.
+
+ * Goxel is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+
+ * You should have received a copy of the GNU General Public License along with
+ * goxel.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Render a shape layer directly from its shape function, without
+ * voxelizing it first.
+ *
+ * We render the back faces of the shape box, and for each fragment walk
+ * the voxels grid along the view ray, testing the voxels centers with the
+ * same function as volume_op, until we find a filled voxel.
+ */
+
+#if defined(GL_ES) && defined(FRAGMENT_SHADER)
+#extension GL_EXT_frag_depth : enable
+#endif
+
+// Must be at least the sum of the sizes of the voxels box.
+#define MAX_STEPS 1024
+
+uniform highp mat4  u_model;
+uniform highp mat4  u_view;
+uniform highp mat4  u_proj;
+uniform highp vec3  u_camera;
+uniform highp vec3  u_camera_dir;
+uniform lowp  float u_ortho;
+
+// Voxels position to shape space transformation.
+uniform highp mat4  u_shape_mat;
+uniform highp vec3  u_shape_size;
+// Voxels box, as its min (included) and max (excluded) corners.
+uniform highp vec3  u_aabb_min;
+uniform highp vec3  u_aabb_max;
+
+uniform lowp  vec4  u_color;
+uniform lowp  vec3  u_l_dir;
+uniform lowp  float u_l_int;
+uniform lowp  float u_l_amb;
+
+varying highp vec3 v_pos;
+
+#ifdef VERTEX_SHADER
+
+/************************************************************************/
+attribute highp vec3 a_pos;
+
+void main()
+{
+    v_pos = (u_model * vec4(a_pos, 1.0)).xyz;
+    gl_Position = u_proj * u_view * vec4(v_pos, 1.0);
+}
+/************************************************************************/
+
+#endif
+
+#ifdef FRAGMENT_SHADER
+
+/************************************************************************/
+
+// Same functions as in shape.c, with a smoothness of zero.
+
+#ifdef SHAPE_SPHERE
+bool shape_test(highp vec3 p, highp vec3 s)
+{
+    highp float d = length(p);
+    highp float r;
+    if (d == 0.0) return true;
+    r = s.x * s.y * s.z / length(vec3(s.y * s.z * p.x / d,
+                                      s.x * s.z * p.y / d,
+                                      s.x * s.y * p.z / d));
+    return r - d >= 0.0;
+}
+#endif
+
+#ifdef SHAPE_CUBE
+bool shape_test(highp vec3 p, highp vec3 s)
+{
+    return all(greaterThanEqual(p, -s)) && all(lessThan(p, s));
+}
+#endif
+
+#ifdef SHAPE_CYLINDER
+bool shape_test(highp vec3 p, highp vec3 s)
+{
+    highp float d = length(p.xy);
+    highp float rz = s.z - abs(p.z);
+    highp float r;
+    if (d == 0.0) return rz >= 0.0;
+    r = s.x * s.y / length(vec2(s.y * p.x / d, s.x * p.y / d));
+    return min(rz, r - d) >= 0.0;
+}
+#endif
+
+bool voxel_test(highp vec3 v)
+{
+    highp vec3 p = (u_shape_mat * vec4(v + 0.5, 1.0)).xyz;
+    return shape_test(p, u_shape_size);
+}
+
+void main()
+{
+    highp vec3 ro, rd, t0, t1, tmax, tdelta, v, n;
+    highp float tin, tout, t;
+    highp vec4 clip;
+    mediump float diffuse;
+    bool hit = false;
+
+    // View ray, going away from the camera.
+    rd = (u_ortho > 0.0) ? u_camera_dir : normalize(v_pos - u_camera);
+    rd = mix(rd, vec3(1e-6), vec3(equal(rd, vec3(0.0))));
+    ro = v_pos;
+
+    // Clip the ray to the voxels box.
+    t0 = (u_aabb_min - ro) / rd;
+    t1 = (u_aabb_max - ro) / rd;
+    tin = max(max(min(t0.x, t1.x), min(t0.y, t1.y)), min(t0.z, t1.z));
+    tout = min(min(max(t0.x, t1.x), max(t0.y, t1.y)), max(t0.z, t1.z));
+    if (u_ortho <= 0.0) tin = max(tin, -length(v_pos - u_camera));
+    if (tin >= tout) discard;
+
+    // Normal of the entry face.
+    n = -sign(rd) * vec3(equal(vec3(tin), min(t0, t1)));
+
+    // Walk the voxels grid.
+    v = clamp(floor(ro + rd * (tin + 1e-4)), u_aabb_min, u_aabb_max - 1.0);
+    tdelta = abs(1.0 / rd);
+    tmax = (v + max(sign(rd), 0.0) - ro) / rd;
+    t = tin;
+    for (int i = 0; i < MAX_STEPS; i++) {
+        if (voxel_test(v)) {
+            hit = true;
+            break;
+        }
+        if (tmax.x < tmax.y && tmax.x < tmax.z) {
+            t = tmax.x;
+            v.x += sign(rd.x);
+            tmax.x += tdelta.x;
+            n = vec3(-sign(rd.x), 0.0, 0.0);
+        } else if (tmax.y < tmax.z) {
+            t = tmax.y;
+            v.y += sign(rd.y);
+            tmax.y += tdelta.y;
+            n = vec3(0.0, -sign(rd.y), 0.0);
+        } else {
+            t = tmax.z;
+            v.z += sign(rd.z);
+            tmax.z += tdelta.z;
+            n = vec3(0.0, 0.0, -sign(rd.z));
+        }
+        if (t >= tout) break;
+    }
+    if (!hit) discard;
+
+    diffuse = max(0.0, dot(u_l_dir, n));
+    gl_FragColor = vec4(u_color.rgb * (u_l_amb + u_l_int * diffuse),
+                        u_color.a);
+
+    // Write the depth of the voxel face.
+    clip = u_proj * u_view * vec4(ro + rd * t, 1.0);
+#if defined(GL_ES) && defined(GL_EXT_frag_depth)
+    gl_FragDepthEXT = clip.z / clip.w * 0.5 + 0.5;
+#elif !defined(GL_ES)
+    gl_FragDepth = clip.z / clip.w * 0.5 + 0.5;
+#endif
+}
+/************************************************************************/
+
+#endif
@@ -21,7 +21,7 @@
 uniform highp mat4  u_model;
 uniform highp mat4  u_view;
 uniform highp mat4  u_proj;
-uniform lowp  float u_pos_scale;
+uniform mediump float u_pos_scale;
 uniform highp vec3  u_camera;
 uniform highp float u_z_ofs; // Used for line rendering.
 
@@ -36,6 +36,7 @@ uniform lowp float u_m_roughness;
 uniform lowp float u_m_smoothness;
 uniform lowp vec4  u_m_base_color;
 uniform lowp vec3  u_m_emissive_factor;
+uniform lowp float u_alpha; // Only used for OIT.
 
 uniform mediump sampler2D u_normal_sampler;
 uniform lowp    float     u_normal_scale;
@@ -58,6 +59,9 @@ varying lowp    vec4 v_color;
 varying mediump vec2 v_occlusion_uv;
 varying mediump vec2 v_UVCoord1;
 varying mediump vec3 v_gradient;
+#ifdef BAKED_AO
+varying lowp    float v_ao;
+#endif
 
 #ifdef HAS_TANGENTS
 varying mediump mat3 v_TBN;
@@ -163,17 +167,61 @@ mediump vec3 getNormal()
 
 /************************************************************************/
 attribute highp   vec3 a_pos;
-attribute mediump vec3 a_normal;
-attribute mediump vec3 a_tangent;
 attribute mediump vec3 a_gradient;
 attribute lowp    vec4 a_color;
+#ifdef PACKED_VERTEX
+attribute mediump float a_face;     // face * 4 + quad corner.
+attribute mediump vec2 a_masks;     // occlusion and borders masks.
+#ifdef BAKED_AO
+attribute lowp    float a_ao;       // Baked occlusion [0,1].
+#endif
+#else
+attribute mediump vec3 a_normal;
+attribute mediump vec3 a_tangent;
 attribute mediump vec2 a_occlusion_uv;
 attribute mediump vec2 a_bump_uv;   // bump tex base coordinates [0,255]
 attribute mediump vec2 a_uv;        // uv coordinates [0,1]
+#endif
 
 // Must match the value in goxel.h
 #define VOXEL_TEXTURE_SIZE 8.0
 
+#ifdef PACKED_VERTEX
+/*
+ * Function: unpack_vertex
+ * Compute the quad vertex attributes from the face and masks attributes.
+ *
+ * Must match FACES_NORMALS, FACES_TANGENTS and VERTICE_UV in block_def.h,
+ * and pack_vertices in render.c.
+ */
+void unpack_vertex(out mediump vec3 normal, out mediump vec3 tangent,
+                   out mediump vec2 uv, out mediump vec2 occlusion_uv,
+                   out mediump vec2 bump_uv)
+{
+    mediump float f = floor(a_face / 4.0);
+    mediump float c = a_face - f * 4.0;
+    mediump float ts = VOXEL_TEXTURE_SIZE;
+
+    if (f < 0.5) {
+        normal = vec3(0.0, -1.0, 0.0); tangent = vec3(1.0, 0.0, 0.0);
+    } else if (f < 1.5) {
+        normal = vec3(0.0, 1.0, 0.0); tangent = vec3(-1.0, 0.0, 0.0);
+    } else if (f < 2.5) {
+        normal = vec3(0.0, 0.0, -1.0); tangent = vec3(0.0, 1.0, 0.0);
+    } else if (f < 3.5) {
+        normal = vec3(0.0, 0.0, 1.0); tangent = vec3(0.0, 1.0, 0.0);
+    } else if (f < 4.5) {
+        normal = vec3(1.0, 0.0, 0.0); tangent = vec3(0.0, 1.0, 0.0);
+    } else {
+        normal = vec3(-1.0, 0.0, 0.0); tangent = vec3(0.0, 0.0, 1.0);
+    }
+    uv = vec2(step(0.5, c) * step(c, 2.5), step(1.5, c));
+    occlusion_uv = vec2(mod(a_masks.x, 16.0), floor(a_masks.x / 16.0)) * ts +
+                   uv * (ts - 1.0);
+    bump_uv = vec2(mod(a_masks.y, 16.0), floor(a_masks.y / 16.0)) * 16.0;
+}
+#endif
+
 float gamma_to_linear(float v)
 {
     return (v <= 0.04045) ? (v / 12.92) : pow((v + 0.055) / 1.055, 2.4);
@@ -188,12 +236,27 @@ vec3 srgb_to_linear(vec3 c)
 
 void main()
 {
+    mediump vec3 normal, tangent;
+    mediump vec2 uv, occlusion_uv, bump_uv;
+#ifdef PACKED_VERTEX
+    unpack_vertex(normal, tangent, uv, occlusion_uv, bump_uv);
+#else
+    normal = a_normal;
+    tangent = a_tangent;
+    uv = a_uv;
+    occlusion_uv = a_occlusion_uv;
+    bump_uv = a_bump_uv;
+#endif
+
     vec4 pos = u_model * vec4(a_pos * u_pos_scale, 1.0);
     v_Position = vec3(pos.xyz) / pos.w;
 
     v_color = a_color;
     v_color.rgb = srgb_to_linear(v_color.rgb);
-    v_occlusion_uv = (a_occlusion_uv + 0.5) / (16.0 * VOXEL_TEXTURE_SIZE);
+    v_occlusion_uv = (occlusion_uv + 0.5) / (16.0 * VOXEL_TEXTURE_SIZE);
+#ifdef BAKED_AO
+    v_ao = a_ao;
+#endif
     gl_Position = u_proj * u_view * vec4(v_Position, 1.0);
     gl_Position.z += u_z_ofs;
 
@@ -202,17 +265,16 @@ void main()
 #endif
 
 #ifdef HAS_TANGENTS
-    mediump vec4 tangent = vec4(normalize(a_tangent), 1.0);
-    mediump vec3 normalW = normalize(a_normal);
-    mediump vec3 tangentW = normalize(vec3(u_model * vec4(tangent.xyz, 0.0)));
-    mediump vec3 bitangentW = cross(normalW, tangentW) * tangent.w;
+    mediump vec3 normalW = normalize(normal);
+    mediump vec3 tangentW = normalize(vec3(u_model * vec4(tangent, 0.0)));
+    mediump vec3 bitangentW = cross(normalW, tangentW);
     v_TBN = mat3(tangentW, bitangentW, normalW);
 #else
-    v_Normal = normalize(a_normal);
+    v_Normal = normalize(normal);
 #endif
 
     v_gradient = a_gradient;
-    v_UVCoord1 = (a_bump_uv + 0.5 + a_uv * 15.0) / 256.0;
+    v_UVCoord1 = (bump_uv + 0.5 + uv * 15.0) / 256.0;
 
 #ifdef VERTEX_LIGHTNING
     mediump vec3 N = getNormal();
@@ -252,6 +314,23 @@ vec3 toneMap(vec3 color)
     return linear_to_srgb(color);
 }
 
+void write_color(vec4 color)
+{
+#ifdef OIT
+    // Weighted blended order independent transparency, with a weight
+    // function from McGuire and Bavoil 2013 using the distance to the
+    // camera.  See oit_begin in render.c.
+    highp float a = u_alpha;
+    highp float d = length(v_Position - u_camera);
+    highp float w = a * clamp(10.0 / (1e-5 + pow(d / 10.0, 3.0) +
+                                      pow(d / 200.0, 6.0)), 1e-2, 3e3);
+    gl_FragData[0] = vec4(color.rgb * a * w, a);
+    gl_FragData[1] = vec4(a * w, 0.0, 0.0, 0.0);
+#else
+    gl_FragColor = color;
+#endif
+}
+
 void main()
 {
 
@@ -266,7 +345,7 @@ void main()
     vec4 base_color = u_m_base_color * v_color;
 
 #ifdef MATERIAL_UNLIT
-    gl_FragColor = vec4(sqrt(base_color.rgb), base_color.a);
+    write_color(vec4(sqrt(base_color.rgb), base_color.a));
     return;
 #endif
 
@@ -305,13 +384,17 @@ void main()
 
 #ifdef HAS_OCCLUSION_MAP
     lowp float ao;
+#ifdef BAKED_AO
+    ao = v_ao;
+#else
     ao = texture2D(u_occlusion_tex, v_occlusion_uv).r;
+#endif
     color = mix(color, color * ao, u_occlusion_strength);
 #endif
 
     color += u_m_emissive_factor;
 
-    gl_FragColor = vec4(toneMap(color), 1.0);
+    write_color(vec4(toneMap(color), 1.0));
 }
 
 #endif
@@ -52,10 +52,12 @@ namespace yocto {
 
 // Simple parallel for used since our target platforms do not yet support
 // parallel algorithms. `Func` takes the two integer indices.
+// Goxel: added the number of threads, 0 for all the cores.
 template <typename T, typename Func>
-inline void parallel_for(T num1, T num2, Func&& func) {
+inline void parallel_for(T num1, T num2, int threads, Func&& func) {
   auto              futures  = vector<std::future<void>>{};
-  auto              nthreads = std::thread::hardware_concurrency();
+  auto              nthreads = threads > 0 ? (unsigned)threads
+                                           : std::thread::hardware_concurrency();
   std::atomic<T>    next_idx(0);
   std::atomic<bool> has_error(false);
   for (auto thread_id = 0; thread_id < (int)nthreads; thread_id++) {
@@ -95,14 +97,26 @@ trace_bvh make_trace_bvh(const scene_data& scene, const trace_params& params) {
   }
 }
 
+// Goxel: number of rays traced by the current thread.
+static thread_local int64_t rays_counter = 0;
+
 // Ray-intersection shortcuts
 static scene_intersection intersect_scene(const trace_bvh& bvh,
     const scene_data& scene, const ray3f& ray, bool find_any = false) {
+  auto intersection = scene_intersection{};
+  rays_counter++;
   if (bvh.ebvh.ebvh) {
-    return intersect_scene_ebvh(bvh.ebvh, scene, ray, find_any);
+    intersection = intersect_scene_ebvh(bvh.ebvh, scene, ray, find_any);
   } else {
-    return intersect_scene_bvh(bvh.bvh, scene, ray, find_any);
+    intersection = intersect_scene_bvh(bvh.bvh, scene, ray, find_any);
+  }
+  if (bvh.custom && !(find_any && intersection.hit)) {
+    auto custom_ray = ray;
+    if (intersection.hit) custom_ray.tmax = intersection.distance;
+    auto custom = bvh.custom(custom_ray, find_any);
+    if (custom.hit) intersection = custom;
   }
+  return intersection;
 }
 static scene_intersection intersect_instance(const trace_bvh& bvh,
     const scene_data& scene, int instance, const ray3f& ray,
@@ -1464,14 +1478,24 @@ void trace_sample(trace_state& state, const scene_data& scene,
   auto& camera  = scene.cameras[params.camera];
   auto  sampler = get_trace_sampler_func(params);
   auto  idx     = state.width * j + i;
-  auto  ray     = sample_camera(camera, {i, j}, {state.width, state.height},
-           rand2f(state.rngs[idx]), rand2f(state.rngs[idx]), params.tentfilter);
+  auto  rays    = rays_counter;
+  auto  ray     = sample_camera(camera, {i + state.offset.x, j + state.offset.y},
+           state.size, rand2f(state.rngs[idx]), rand2f(state.rngs[idx]),
+           params.tentfilter);
   auto [radiance, hit, albedo, normal] = sampler(
       scene, bvh, lights, ray, state.rngs[idx], params);
+  state.rays[idx] += rays_counter - rays;
   if (!isfinite(radiance)) radiance = {0, 0, 0};
   if (max(radiance) > params.clamp)
     radiance = radiance * (params.clamp / max(radiance));
-  auto weight = 1.0f / (sample + 1);
+  // Goxel: use the pixel samples count, since with the adaptive sampling
+  // the pixels don't all get the same number of samples.
+  auto weight = 1.0f / (state.counts[idx] + 1);
+  auto count  = ++state.counts[idx];
+  auto lum    = luminance(radiance);
+  auto delta  = lum - state.moments[idx].x;
+  state.moments[idx].x += delta / count;
+  state.moments[idx].y += delta * (lum - state.moments[idx].x);
   if (hit) {
     state.image[idx] = lerp(
         state.image[idx], {radiance.x, radiance.y, radiance.z, 1}, weight);
@@ -1503,15 +1527,32 @@ trace_state make_trace_state(
     state.height = params.resolution;
     state.width  = (int)round(params.resolution * camera.aspect);
   }
+  state.size = {state.width, state.height};
+  if (params.region.z > 0 && params.region.w > 0) {
+    state.offset = {params.region.x, params.region.y};
+    state.width  = params.region.z;
+    state.height = params.region.w;
+  }
   state.samples = 0;
   state.image.assign(state.width * state.height, {0, 0, 0, 0});
   state.albedo.assign(state.width * state.height, {0, 0, 0});
   state.normal.assign(state.width * state.height, {0, 0, 0});
   state.hits.assign(state.width * state.height, 0);
   state.rngs.assign(state.width * state.height, {});
-  auto rng_ = make_rng(1301081);
-  for (auto& rng : state.rngs) {
-    rng = make_rng(params.seed, rand1i(rng_, 1 << 31) / 2 + 1);
+  state.counts.assign(state.width * state.height, 0);
+  state.moments.assign(state.width * state.height, {0, 0});
+  state.rays.assign(state.width * state.height, 0);
+  state.active = state.width * state.height;
+  // Goxel: seed each pixel from its index in the full image, so that a
+  // region renders exactly as the same part of the full image.
+  for (auto j : range(state.height)) {
+    for (auto i : range(state.width)) {
+      auto seq = (uint64_t)(j + state.offset.y) * state.size.x +
+                 (i + state.offset.x) + 1;
+      seq      = (seq ^ (seq >> 30)) * 0xbf58476d1ce4e5b9ull;
+      seq      = (seq ^ (seq >> 27)) * 0x94d049bb133111ebull;
+      state.rngs[j * state.width + i] = make_rng(params.seed, seq ^ (seq >> 31));
+    }
   }
   if (params.denoise) {
     state.denoised.assign(state.width * state.height, {0, 0, 0, 0});
@@ -1591,6 +1632,27 @@ image_data trace_image(const scene_data& scene, const trace_params& params) {
   return get_image(state);
 }
 
+// Goxel: check if the relative error of a pixel mean is below the adaptive
+// sampling threshold.
+static bool is_pixel_converged(
+    const trace_state& state, int idx, const trace_params& params) {
+  if (params.adaptive <= 0) return false;
+  auto n = state.counts[idx];
+  if (n < max(params.adaptive_min, 2)) return false;
+  auto mean  = state.moments[idx].x;
+  auto error = sqrt(state.moments[idx].y / (n * (n - 1.0f)));
+  return error < params.adaptive * max(mean, 0.01f);
+}
+
+// Goxel: count the pixels that still need samples.
+static void update_active_pixels(
+    trace_state& state, const trace_params& params) {
+  state.active = 0;
+  for (auto idx : range(state.width * state.height)) {
+    if (!is_pixel_converged(state, idx, params)) state.active++;
+  }
+}
+
 // Progressively compute an image by calling trace_samples multiple times.
 void trace_samples(trace_state& state, const scene_data& scene,
     const trace_bvh& bvh, const trace_lights& lights,
@@ -1599,19 +1661,22 @@ void trace_samples(trace_state& state, const scene_data& scene,
   if (params.noparallel) {
     for (auto j : range(state.height)) {
       for (auto i : range(state.width)) {
+        if (is_pixel_converged(state, state.width * j + i, params)) continue;
         for (auto sample : range(state.samples, state.samples + params.batch)) {
           trace_sample(state, scene, bvh, lights, i, j, sample, params);
         }
       }
     }
   } else {
-    parallel_for(state.width, state.height, [&](int i, int j) {
+    parallel_for(state.width, state.height, params.threads, [&](int i, int j) {
+      if (is_pixel_converged(state, state.width * j + i, params)) return;
       for (auto sample : range(state.samples, state.samples + params.batch)) {
         trace_sample(state, scene, bvh, lights, i, j, sample, params);
       }
     });
   }
   state.samples += params.batch;
+  update_active_pixels(state, params);
   if (params.denoise && !state.denoised.empty()) {
     denoise_image(state.denoised, state.width, state.height, state.image,
         state.albedo, state.normal);
@@ -1632,13 +1697,15 @@ void trace_start(trace_context& context, trace_state& state,
   context.done   = false;
   context.worker = std::async(std::launch::async, [&]() {
     if (context.stop) return;
-    parallel_for(state.width, state.height, [&](int i, int j) {
+    parallel_for(state.width, state.height, params.threads, [&](int i, int j) {
+      if (is_pixel_converged(state, state.width * j + i, params)) return;
       for (auto sample : range(state.samples, state.samples + params.batch)) {
         if (context.stop) return;
         trace_sample(state, scene, bvh, lights, i, j, sample, params);
       }
     });
     state.samples += params.batch;
+    update_active_pixels(state, params);
     if (context.stop) return;
     if (params.denoise && !state.denoised.empty()) {
       denoise_image(state.denoised, state.width, state.height, state.image,
@@ -1664,6 +1731,10 @@ void trace_preview(color_image& image, trace_context& context,
   auto pparams = params;
   pparams.resolution /= params.pratio;
   pparams.samples = 1;
+  pparams.region  = {params.region.x / params.pratio,
+      params.region.y / params.pratio,
+      params.region.z ? max(params.region.z / params.pratio, 1) : 0,
+      params.region.w ? max(params.region.w / params.pratio, 1) : 0};
   auto pstate     = make_trace_state(scene, pparams);
   trace_samples(pstate, scene, bvh, lights, pparams);
   auto preview = get_image(pstate);
@@ -1690,6 +1761,13 @@ static void check_image(const vector<T>& image, int width, int height) {
     throw std::invalid_argument{"image should have the same size"};
 }
 
+// Goxel: get the total number of rays traced so far.
+int64_t get_trace_rays(const trace_state& state) {
+  auto rays = (int64_t)0;
+  for (auto count : state.rays) rays += count;
+  return rays;
+}
+
 // Get resulting render, denoised if requested
 image_data get_image(const trace_state& state) {
   auto image = make_image(state.width, state.height, true);
@@ -38,6 +38,7 @@
 // -----------------------------------------------------------------------------
 
 #include <atomic>
+#include <functional>
 #include <future>
 #include <memory>
 #include <string>
@@ -110,6 +111,14 @@ struct trace_params {
   int                   pratio         = 8;
   bool                  denoise        = false;
   int                   batch          = 1;
+  int                   threads        = 0;  // Goxel: 0 for all the cores.
+  // Goxel: adaptive sampling, the pixels stop once their relative error
+  // gets below the threshold.  0 to disable.
+  float                 adaptive       = 0;
+  int                   adaptive_min   = 16;
+  // Goxel: x, y, w, h of the region of the image to render, zero size for
+  // the full image.
+  vec4i                 region         = {0, 0, 0, 0};
 };
 
 // Progressively computes an image.
@@ -138,6 +147,10 @@ struct trace_lights {
 struct trace_bvh {
   scene_bvh  bvh  = {};
   scene_ebvh ebvh = {};
+  // Goxel: optional extra scene intersection, the closest hit between it
+  // and the bvh is used.
+  std::function<scene_intersection(const ray3f& ray, bool find_any)> custom =
+      {};
 };
 
 // Check is a sampler requires lights
@@ -154,6 +167,16 @@ struct trace_state {
   vector<int>       hits     = {};
   vector<rng_state> rngs     = {};
   vector<vec4f>     denoised = {};
+  // Goxel: per pixel samples count and luminance mean and M2, for the
+  // adaptive sampling, and number of pixels not converged yet.
+  vector<int>       counts   = {};
+  vector<vec2f>     moments  = {};
+  int               active   = 0;
+  // Goxel: offset of the rendered region, and size of the full image.
+  vec2i             offset   = {0, 0};
+  vec2i             size     = {0, 0};
+  // Goxel: per pixel number of traced rays, for the stats.
+  vector<int64_t>   rays     = {};
 };
 
 // Initialize state.
@@ -175,6 +198,9 @@ void trace_sample(trace_state& state, const scene_data& scene,
     const trace_bvh& bvh, const trace_lights& lights, int i, int j, int sample,
     const trace_params& params);
 
+// Goxel: get the total number of rays traced so far.
+int64_t get_trace_rays(const trace_state& state);
+
 // Get resulting render, denoised if requested
 image_data get_image(const trace_state& state);
 void       get_image(image_data& image, const trace_state& state);
@@ -89,21 +89,19 @@ void actions_iter(int (*f)(action_t *action, void *user), void *user)
 int action_exec(const action_t *action)
 {
     assert(action);
-    // So that we do not add undo snapshot when an action calls an other one.
-    static int reentry = 0;
-
-    reentry++;
+    // So that we only add a single undo snapshot when an action calls other
+    // ones.
+    image_history_begin();
 
     if (action->data)
         action->cfunc_data(action->data);
     else
         action->cfunc();
 
-    if (reentry == 1 && (action->flags & ACTION_TOUCH_IMAGE)) {
+    if (action->flags & ACTION_TOUCH_IMAGE)
         image_history_push(goxel.image);
-    }
 
-    reentry--;
+    image_history_commit();
     return 0;
 }
 
@@ -44,6 +44,8 @@ enum {
     ACTION_img_move_camera_down,
     ACTION_img_image_layer_to_volume,
     ACTION_img_new_shape_layer,
+    ACTION_img_new_stream_layer,
+    ACTION_layer_stream,
     ACTION_img_new_material,
     ACTION_img_del_material,
     ACTION_img_auto_resize,
@@ -54,6 +56,7 @@ enum {
     ACTION_paint_selection,
     ACTION_add_selection,
     ACTION_sub_selection,
+    ACTION_invert_selection,
     ACTION_copy,
     ACTION_paste,
     ACTION_view_left,
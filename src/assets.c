@@ -26,28 +26,84 @@ typedef struct {
 
 static asset_t ASSETS[]; // Defined in assets.inl
 
+// Indices of the assets sorted by path, created on first use.
+static int *g_index = NULL;
+static int g_nb_assets = 0;
+
+static int index_cmp(const void *a, const void *b)
+{
+    return strcmp(ASSETS[*(int*)a].path, ASSETS[*(int*)b].path);
+}
+
+static int int_cmp(const void *a, const void *b)
+{
+    return cmp(*(int*)a, *(int*)b);
+}
+
+static void index_init(void)
+{
+    int i, nb, *index, *expected = NULL;
+
+    if (__atomic_load_n(&g_index, __ATOMIC_ACQUIRE)) return;
+    for (nb = 0; ASSETS[nb].path; nb++) {}
+    index = malloc(nb * sizeof(*index));
+    for (i = 0; i < nb; i++) index[i] = i;
+    qsort(index, nb, sizeof(*index), index_cmp);
+    // An other thread could have created the index meanwhile.
+    g_nb_assets = nb;
+    if (!__atomic_compare_exchange_n(&g_index, &expected, index, false,
+                                     __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+        free(index);
+}
+
+// Return the position in the index of the first asset whose path is not
+// smaller than a given string.
+static int index_lower_bound(const char *path)
+{
+    int lo = 0, hi = g_nb_assets, mid;
+    while (lo < hi) {
+        mid = (lo + hi) / 2;
+        if (strcmp(ASSETS[g_index[mid]].path, path) < 0)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
 const void *assets_get(const char *url, int *size)
 {
     int i;
+    const asset_t *asset;
+
     if (str_startswith(url, "asset://")) url += 8; // Skip asset://
-    for (i = 0; ASSETS[i].path; i++) {
-        if (strcmp(ASSETS[i].path, url) == 0) {
-            if (size) *size = ASSETS[i].size;
-            return ASSETS[i].data;
-        }
-    }
-    return NULL;
+    index_init();
+    i = index_lower_bound(url);
+    if (i == g_nb_assets) return NULL;
+    asset = &ASSETS[g_index[i]];
+    if (strcmp(asset->path, url) != 0) return NULL;
+    if (size) *size = asset->size;
+    return asset->data;
 }
 
 int assets_list(const char *url, void *user,
                 int (*f)(int i, const char *path, void *user))
 {
-    int i, j = 0;
-    for (i = 0; ASSETS[i].path; i++) {
-        if (str_startswith(ASSETS[i].path, url)) {
-            if (!f || f(j, ASSETS[i].path, user) == 0) j++;
-        }
+    int i, j = 0, nb, start, *found;
+
+    index_init();
+    start = index_lower_bound(url);
+    for (nb = 0; start + nb < g_nb_assets; nb++) {
+        if (!str_startswith(ASSETS[g_index[start + nb]].path, url)) break;
+    }
+    // Keep the order of the assets table.
+    found = malloc(nb * sizeof(*found));
+    memcpy(found, g_index + start, nb * sizeof(*found));
+    qsort(found, nb, sizeof(*found), int_cmp);
+    for (i = 0; i < nb; i++) {
+        if (!f || f(j, ASSETS[found[i]].path, user) == 0) j++;
     }
+    free(found);
     return j;
 }
 
@@ -59,6 +115,7 @@ static asset_t ASSETS[] = {
 #include "assets/other.inl"
 #include "assets/palettes.inl"
 #include "assets/progs.inl"
+#include "assets/samples.inl"
 #include "assets/shaders.inl"
 #include "assets/scripts.inl"
 #include "assets/sounds.inl"
@@ -18,7 +18,7 @@
 
 /* This file is autogenerated by tools/create_assets.py */
 
-{.path = "data/other/povray_template.pov", .size = 748, .data =
+{.path = "data/other/povray_template.pov", .size = 842, .data =
     "// Generated from goxel {{version}}\n"
     "// https://github.com/guillaumechereau/goxel\n"
     "\n"
@@ -44,6 +44,12 @@
     "        texture { pigment {color rgb Color / 255} }\n"
     "    }\n"
     "#end\n"
+    "#macro VoxRun(Pos, Len, Color)\n"
+    "    box {\n"
+    "        Pos, Pos + <Len, 1, 1>\n"
+    "        texture { pigment {color rgb Color / 255} }\n"
+    "    }\n"
+    "#end\n"
     "\n"
     "{{#light}}\n"
     "global_settings { ambient_light rgb<1, 1, 1> * {{ambient}} }\n"
@@ -55,9 +61,7 @@
     "{{/light}}\n"
     "\n"
     "union {\n"
-    "{{#voxels}}\n"
-    "    Vox({{pos}}, {{color}})\n"
-    "{{/voxels}}\n"
+    "{{voxels}}\n"
     "}\n"
     ""
 },
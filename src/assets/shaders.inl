@@ -138,18 +138,80 @@
     "#endif\n"
     ""
 },
-{.path = "data/shaders/pos_data.glsl", .size = 788, .data =
-    "varying lowp  vec2 v_pos_data;\n"
+{.path = "data/shaders/oit.glsl", .size = 1753, .data =
+    "/* Goxel 3D voxels editor\n"
+    " *\n"
+    " * copyright (c) 2024 Guillaume Chereau <guillaume@noctua-software.com>\n"
+    " *\n"
+    " * Goxel is free software: you can redistribute it and/or modify it under the\n"
+    " * terms of the GNU General Public License as published by the Free Software\n"
+    " * Foundation, either version 3 of the License, or (at your option) any later\n"
+    " * version.\n"
+    "\n"
+    " * Goxel is distributed in the hope that it will be useful, but WITHOUT ANY\n"
+    " * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS\n"
+    " * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more\n"
+    " * details.\n"
+    "\n"
+    " * You should have received a copy of the GNU General Public License along with\n"
+    " * goxel.  If not, see <http://www.gnu.org/licenses/>.\n"
+    " */\n"
+    "\n"
+    "/*\n"
+    " * Composite the order independent transparency buffers over the frame.\n"
+    " *\n"
+    " * The output alpha is the revealage, and should be blended with\n"
+    " * (ONE_MINUS_SRC_ALPHA, SRC_ALPHA) for the colors.\n"
+    " */\n"
+    "\n"
+    "uniform mediump sampler2D u_accum_tex;\n"
+    "uniform mediump sampler2D u_weight_tex;\n"
+    "\n"
+    "varying mediump vec2 v_uv;\n"
+    "\n"
+    "#ifdef VERTEX_SHADER\n"
+    "\n"
+    "/************************************************************************/\n"
+    "attribute highp vec3 a_pos;\n"
+    "\n"
+    "void main()\n"
+    "{\n"
+    "    v_uv = a_pos.xy * 0.5 + 0.5;\n"
+    "    gl_Position = vec4(a_pos.xy, 0.0, 1.0);\n"
+    "}\n"
+    "/************************************************************************/\n"
+    "\n"
+    "#endif\n"
+    "\n"
+    "#ifdef FRAGMENT_SHADER\n"
+    "\n"
+    "/************************************************************************/\n"
+    "void main()\n"
+    "{\n"
+    "    mediump vec4 accum = texture2D(u_accum_tex, v_uv);\n"
+    "    mediump float weight = texture2D(u_weight_tex, v_uv).r;\n"
+    "    if (accum.a >= 1.0) discard;\n"
+    "    gl_FragColor = vec4(accum.rgb / max(weight, 1e-5), accum.a);\n"
+    "}\n"
+    "/************************************************************************/\n"
+    "\n"
+    "#endif\n"
+    ""
+},
+{.path = "data/shaders/pos_data.glsl", .size = 990, .data =
+    "varying lowp  vec3 v_pos_data;\n"
     "uniform highp mat4 u_model;\n"
     "uniform highp mat4 u_view;\n"
     "uniform highp mat4 u_proj;\n"
-    "uniform lowp  vec2 u_tile_id;\n"
+    "// Tile id part of the RGBA picking value, its bits don't overlap with the\n"
+    "// pos data ones.\n"
+    "uniform lowp  vec4 u_tile_id;\n"
     "\n"
     "#ifdef VERTEX_SHADER\n"
     "\n"
     "/************************************************************************/\n"
     "attribute highp vec3 a_pos;\n"
-    "attribute lowp  vec2 a_pos_data;\n"
+    "attribute lowp  vec3 a_pos_data; // Only two bytes with 16^3 tiles.\n"
     "\n"
     "void main()\n"
     "{\n"
@@ -166,8 +228,254 @@
     "/************************************************************************/\n"
     "void main()\n"
     "{\n"
-    "    gl_FragColor.rg = u_tile_id;\n"
-    "    gl_FragColor.ba = v_pos_data;\n"
+    "    gl_FragColor = u_tile_id;\n"
+    "#ifdef POS_DATA_3_BYTES\n"
+    "    gl_FragColor.gba += v_pos_data;\n"
+    "#else\n"
+    "    gl_FragColor.ba += v_pos_data.xy;\n"
+    "#endif\n"
+    "}\n"
+    "/************************************************************************/\n"
+    "\n"
+    "#endif\n"
+    ""
+},
+{.path = "data/shaders/raymarch.glsl", .size = 7743, .data =
+    "/* Goxel 3D voxels editor\n"
+    " *\n"
+    " * copyright (c) 2026 Guillaume Chereau <guillaume@noctua-software.com>\n"
+    " *\n"
+    " * Goxel is free software: you can redistribute it and/or modify it under the\n"
+    " * terms of the GNU General Public License as published by the Free Software\n"
+    " * Foundation, either version 3 of the License, or (at your option) any later\n"
+    " * version.\n"
+    "\n"
+    " * Goxel is distributed in the hope that it will be useful, but WITHOUT ANY\n"
+    " * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS\n"
+    " * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more\n"
+    " * details.\n"
+    "\n"
+    " * You should have received a copy of the GNU General Public License along with\n"
+    " * goxel.  If not, see <http://www.gnu.org/licenses/>.\n"
+    " */\n"
+    "\n"
+    "/*\n"
+    " * Render the tiles of a volume by raymarching their voxels, uploaded into\n"
+    " * a 3D texture atlas, instead of meshing them.\n"
+    " *\n"
+    " * We render the back faces of each tile box, and for each fragment walk\n"
+    " * the tile voxels grid along the view ray, like the shape shader, until we\n"
+    " * find a filled voxel.  The walk is done in the volume space, the camera\n"
+    " * position and direction are given in it.\n"
+    " */\n"
+    "\n"
+    "#if defined(GL_ES) && defined(FRAGMENT_SHADER)\n"
+    "#extension GL_EXT_frag_depth : enable\n"
+    "#endif\n"
+    "\n"
+    "// Must be at least three times the tiles size.\n"
+    "#define MAX_STEPS 96\n"
+    "\n"
+    "const mediump float M_PI = 3.141592653589793;\n"
+    "\n"
+    "uniform highp mat4  u_model;\n"
+    "uniform highp mat4  u_view;\n"
+    "uniform highp mat4  u_proj;\n"
+    "uniform highp vec3  u_camera;\n"
+    "uniform highp vec3  u_camera_dir;\n"
+    "uniform lowp  float u_ortho;\n"
+    "\n"
+    "uniform highp float u_tile_size;\n"
+    "uniform highp vec3  u_tile_pos;\n"
+    "uniform mediump sampler3D u_atlas;\n"
+    "// Position of the tile slot and size of the atlas, in texels.\n"
+    "uniform highp vec3  u_atlas_ofs;\n"
+    "uniform highp vec3  u_atlas_size;\n"
+    "\n"
+    "uniform lowp  vec4  u_m_base_color;\n"
+    "uniform lowp  vec3  u_m_emissive_factor;\n"
+    "uniform lowp  vec3  u_l_dir;\n"
+    "uniform lowp  float u_l_int;\n"
+    "uniform lowp  float u_l_amb;\n"
+    "\n"
+    "#ifdef PICK\n"
+    "// Same picking value as the pos_data shader.\n"
+    "uniform lowp  vec4  u_tile_id;\n"
+    "uniform highp float u_pick_scale; // 2^PICK_DATA_SHIFT.\n"
+    "#endif\n"
+    "\n"
+    "#ifdef SHADOW\n"
+    "uniform highp   mat4      u_shadow_mvp;\n"
+    "uniform mediump sampler2D u_shadow_tex;\n"
+    "uniform mediump float     u_shadow_strength;\n"
+    "#endif\n"
+    "\n"
+    "varying highp vec3 v_pos;\n"
+    "\n"
+    "#ifdef VERTEX_SHADER\n"
+    "\n"
+    "/************************************************************************/\n"
+    "attribute highp vec3 a_pos;\n"
+    "\n"
+    "void main()\n"
+    "{\n"
+    "    v_pos = u_tile_pos + (a_pos * 0.5 + 0.5) * u_tile_size;\n"
+    "    gl_Position = u_proj * u_view * u_model * vec4(v_pos, 1.0);\n"
+    "}\n"
+    "/************************************************************************/\n"
+    "\n"
+    "#endif\n"
+    "\n"
+    "#ifdef FRAGMENT_SHADER\n"
+    "\n"
+    "/************************************************************************/\n"
+    "\n"
+    "#ifdef SHADOW\n"
+    "float get_shadow(highp vec3 p, highp vec3 n)\n"
+    "{\n"
+    "    lowp vec2 PS[4]; // Poisson offsets used for the shadow map.\n"
+    "    mediump float visibility = 1.0;\n"
+    "    mediump float NdotL = clamp(dot(n, u_l_dir), 0.0, 1.0);\n"
+    "    mediump vec4 coord = u_shadow_mvp * u_model * vec4(p, 1.0);\n"
+    "    lowp float bias = clamp(0.005 * tan(acos(NdotL)), 0.0015, 0.015);\n"
+    "    int i;\n"
+    "\n"
+    "    coord /= coord.w;\n"
+    "    coord.z -= bias;\n"
+    "    PS[0] = vec2(-0.94201624, -0.39906216) / 1024.0;\n"
+    "    PS[1] = vec2(+0.94558609, -0.76890725) / 1024.0;\n"
+    "    PS[2] = vec2(-0.09418410, -0.92938870) / 1024.0;\n"
+    "    PS[3] = vec2(+0.34495938, +0.29387760) / 1024.0;\n"
+    "    for (i = 0; i < 4; i++)\n"
+    "        if (texture2D(u_shadow_tex, coord.xy + PS[i]).z < coord.z)\n"
+    "            visibility -= 0.2;\n"
+    "    if (NdotL <= 0.0) visibility = 0.5;\n"
+    "    return mix(1.0, visibility, u_shadow_strength);\n"
+    "}\n"
+    "#endif\n"
+    "\n"
+    "// Same color conversions as the volume shader.\n"
+    "mediump float gamma_to_linear(mediump float v)\n"
+    "{\n"
+    "    return (v <= 0.04045) ? (v / 12.92) : pow((v + 0.055) / 1.055, 2.4);\n"
+    "}\n"
+    "\n"
+    "mediump float linear_to_gamma(mediump float v)\n"
+    "{\n"
+    "    return (v <= 0.0031308) ? 12.92 * v : (1.055) * pow(v, 1.0 / 2.4) - 0.055;\n"
+    "}\n"
+    "\n"
+    "#ifdef PICK\n"
+    "// Byte i of a picking value, as a color channel.\n"
+    "lowp float pick_byte(highp float v, highp float i)\n"
+    "{\n"
+    "    return mod(floor(v / pow(256.0, i)), 256.0) / 255.0;\n"
+    "}\n"
+    "#endif\n"
+    "\n"
+    "void main()\n"
+    "{\n"
+    "    highp vec3 ro, rd, t0, t1, tmax, tdelta, v, n, p;\n"
+    "    highp float tin, tout, t;\n"
+    "    highp vec4 clip;\n"
+    "    lowp vec4 color;\n"
+    "    mediump vec3 wn, base, light;\n"
+    "    bool hit = false;\n"
+    "\n"
+    "    // View ray, going away from the camera.\n"
+    "    rd = (u_ortho > 0.0) ? u_camera_dir : normalize(v_pos - u_camera);\n"
+    "    rd = mix(rd, vec3(1e-6), vec3(equal(rd, vec3(0.0))));\n"
+    "    ro = v_pos;\n"
+    "\n"
+    "    // Clip the ray to the tile box.\n"
+    "    t0 = (u_tile_pos - ro) / rd;\n"
+    "    t1 = (u_tile_pos + u_tile_size - ro) / rd;\n"
+    "    tin = max(max(min(t0.x, t1.x), min(t0.y, t1.y)), min(t0.z, t1.z));\n"
+    "    tout = min(min(max(t0.x, t1.x), max(t0.y, t1.y)), max(t0.z, t1.z));\n"
+    "    if (u_ortho <= 0.0) tin = max(tin, -length(v_pos - u_camera));\n"
+    "    if (tin >= tout) discard;\n"
+    "\n"
+    "    // Normal of the entry face.\n"
+    "    n = -sign(rd) * vec3(equal(vec3(tin), min(t0, t1)));\n"
+    "\n"
+    "    // Walk the tile voxels, in the tile space.\n"
+    "    v = clamp(floor(ro + rd * (tin + 1e-4) - u_tile_pos),\n"
+    "              0.0, u_tile_size - 1.0);\n"
+    "    tdelta = abs(1.0 / rd);\n"
+    "    tmax = (u_tile_pos + v + max(sign(rd), 0.0) - ro) / rd;\n"
+    "    t = tin;\n"
+    "    for (int i = 0; i < MAX_STEPS; i++) {\n"
+    "        color = texture3D(u_atlas, (u_atlas_ofs + v + 0.5) / u_atlas_size);\n"
+    "        if (color.a > 0.0) {\n"
+    "            hit = true;\n"
+    "            break;\n"
+    "        }\n"
+    "        if (tmax.x < tmax.y && tmax.x < tmax.z) {\n"
+    "            t = tmax.x;\n"
+    "            v.x += sign(rd.x);\n"
+    "            tmax.x += tdelta.x;\n"
+    "            n = vec3(-sign(rd.x), 0.0, 0.0);\n"
+    "        } else if (tmax.y < tmax.z) {\n"
+    "            t = tmax.y;\n"
+    "            v.y += sign(rd.y);\n"
+    "            tmax.y += tdelta.y;\n"
+    "            n = vec3(0.0, -sign(rd.y), 0.0);\n"
+    "        } else {\n"
+    "            t = tmax.z;\n"
+    "            v.z += sign(rd.z);\n"
+    "            tmax.z += tdelta.z;\n"
+    "            n = vec3(0.0, 0.0, -sign(rd.z));\n"
+    "        }\n"
+    "        if (t >= tout) break;\n"
+    "        if (any(lessThan(v, vec3(0.0))) ||\n"
+    "            any(greaterThanEqual(v, vec3(u_tile_size)))) break;\n"
+    "    }\n"
+    "    if (!hit) discard;\n"
+    "    p = ro + rd * t;\n"
+    "\n"
+    "#if defined(PICK)\n"
+    "    // Same as get_pos_data, with the face index of the normal.\n"
+    "    highp float f = (n.y < 0.0) ? 0.0 : (n.y > 0.0) ? 1.0 :\n"
+    "                    (n.z < 0.0) ? 2.0 : (n.z > 0.0) ? 3.0 :\n"
+    "                    (n.x > 0.0) ? 4.0 : 5.0;\n"
+    "    highp float d = (((v.x * u_tile_size + v.y) * u_tile_size + v.z) * 16.0\n"
+    "                     + f) * u_pick_scale;\n"
+    "    gl_FragColor = u_tile_id;\n"
+    "#ifdef POS_DATA_3_BYTES\n"
+    "    gl_FragColor.gba += vec3(pick_byte(d, 0.0), pick_byte(d, 1.0),\n"
+    "                             pick_byte(d, 2.0));\n"
+    "#else\n"
+    "    gl_FragColor.ba += vec2(pick_byte(d, 0.0), pick_byte(d, 1.0));\n"
+    "#endif\n"
+    "#else\n"
+    "    base = u_m_base_color.rgb * vec3(gamma_to_linear(color.r),\n"
+    "                                     gamma_to_linear(color.g),\n"
+    "                                     gamma_to_linear(color.b));\n"
+    "#ifdef MATERIAL_UNLIT\n"
+    "    light = sqrt(base);\n"
+    "#else\n"
+    "    // The diffuse part of the volume shader lighting.\n"
+    "    wn = mat3(u_model[0].xyz, u_model[1].xyz, u_model[2].xyz) * n;\n"
+    "    wn = normalize(wn);\n"
+    "    light = base * 0.96 / M_PI * u_l_int * max(0.0, dot(u_l_dir, wn)) +\n"
+    "            base * u_l_amb;\n"
+    "#ifdef SHADOW\n"
+    "    light *= get_shadow(p, wn);\n"
+    "#endif\n"
+    "    light += u_m_emissive_factor;\n"
+    "    light = vec3(linear_to_gamma(light.r), linear_to_gamma(light.g),\n"
+    "                 linear_to_gamma(light.b));\n"
+    "#endif\n"
+    "    gl_FragColor = vec4(light, u_m_base_color.a);\n"
+    "#endif\n"
+    "\n"
+    "    // Write the depth of the voxel face.\n"
+    "    clip = u_proj * u_view * u_model * vec4(p, 1.0);\n"
+    "#if defined(GL_ES) && defined(GL_EXT_frag_depth)\n"
+    "    gl_FragDepthEXT = clip.z / clip.w * 0.5 + 0.5;\n"
+    "#elif !defined(GL_ES)\n"
+    "    gl_FragDepth = clip.z / clip.w * 0.5 + 0.5;\n"
+    "#endif\n"
     "}\n"
     "/************************************************************************/\n"
     "\n"
@@ -201,7 +509,192 @@
     "#endif\n"
     ""
 },
-{.path = "data/shaders/volume.glsl", .size = 9420, .data =
+{.path = "data/shaders/shape.glsl", .size = 5396, .data =
+    "/* Goxel 3D voxels editor\n"
+    " *\n"
+    " * copyright (c) 2024 Guillaume Chereau <guillaume@noctua-software.com>\n"
+    " *\n"
+    " * Goxel is free software: you can redistribute it and/or modify it under the\n"
+    " * terms of the GNU General Public License as published by the Free Software\n"
+    " * Foundation, either version 3 of the License, or (at your option) any later\n"
+    " * version.\n"
+    "\n"
+    " * Goxel is distributed in the hope that it will be useful, but WITHOUT ANY\n"
+    " * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS\n"
+    " * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more\n"
+    " * details.\n"
+    "\n"
+    " * You should have received a copy of the GNU General Public License along with\n"
+    " * goxel.  If not, see <http://www.gnu.org/licenses/>.\n"
+    " */\n"
+    "\n"
+    "/*\n"
+    " * Render a shape layer directly from its shape function, without\n"
+    " * voxelizing it first.\n"
+    " *\n"
+    " * We render the back faces of the shape box, and for each fragment walk\n"
+    " * the voxels grid along the view ray, testing the voxels centers with the\n"
+    " * same function as volume_op, until we find a filled voxel.\n"
+    " */\n"
+    "\n"
+    "#if defined(GL_ES) && defined(FRAGMENT_SHADER)\n"
+    "#extension GL_EXT_frag_depth : enable\n"
+    "#endif\n"
+    "\n"
+    "// Must be at least the sum of the sizes of the voxels box.\n"
+    "#define MAX_STEPS 1024\n"
+    "\n"
+    "uniform highp mat4  u_model;\n"
+    "uniform highp mat4  u_view;\n"
+    "uniform highp mat4  u_proj;\n"
+    "uniform highp vec3  u_camera;\n"
+    "uniform highp vec3  u_camera_dir;\n"
+    "uniform lowp  float u_ortho;\n"
+    "\n"
+    "// Voxels position to shape space transformation.\n"
+    "uniform highp mat4  u_shape_mat;\n"
+    "uniform highp vec3  u_shape_size;\n"
+    "// Voxels box, as its min (included) and max (excluded) corners.\n"
+    "uniform highp vec3  u_aabb_min;\n"
+    "uniform highp vec3  u_aabb_max;\n"
+    "\n"
+    "uniform lowp  vec4  u_color;\n"
+    "uniform lowp  vec3  u_l_dir;\n"
+    "uniform lowp  float u_l_int;\n"
+    "uniform lowp  float u_l_amb;\n"
+    "\n"
+    "varying highp vec3 v_pos;\n"
+    "\n"
+    "#ifdef VERTEX_SHADER\n"
+    "\n"
+    "/************************************************************************/\n"
+    "attribute highp vec3 a_pos;\n"
+    "\n"
+    "void main()\n"
+    "{\n"
+    "    v_pos = (u_model * vec4(a_pos, 1.0)).xyz;\n"
+    "    gl_Position = u_proj * u_view * vec4(v_pos, 1.0);\n"
+    "}\n"
+    "/************************************************************************/\n"
+    "\n"
+    "#endif\n"
+    "\n"
+    "#ifdef FRAGMENT_SHADER\n"
+    "\n"
+    "/************************************************************************/\n"
+    "\n"
+    "// Same functions as in shape.c, with a smoothness of zero.\n"
+    "\n"
+    "#ifdef SHAPE_SPHERE\n"
+    "bool shape_test(highp vec3 p, highp vec3 s)\n"
+    "{\n"
+    "    highp float d = length(p);\n"
+    "    highp float r;\n"
+    "    if (d == 0.0) return true;\n"
+    "    r = s.x * s.y * s.z / length(vec3(s.y * s.z * p.x / d,\n"
+    "                                      s.x * s.z * p.y / d,\n"
+    "                                      s.x * s.y * p.z / d));\n"
+    "    return r - d >= 0.0;\n"
+    "}\n"
+    "#endif\n"
+    "\n"
+    "#ifdef SHAPE_CUBE\n"
+    "bool shape_test(highp vec3 p, highp vec3 s)\n"
+    "{\n"
+    "    return all(greaterThanEqual(p, -s)) && all(lessThan(p, s));\n"
+    "}\n"
+    "#endif\n"
+    "\n"
+    "#ifdef SHAPE_CYLINDER\n"
+    "bool shape_test(highp vec3 p, highp vec3 s)\n"
+    "{\n"
+    "    highp float d = length(p.xy);\n"
+    "    highp float rz = s.z - abs(p.z);\n"
+    "    highp float r;\n"
+    "    if (d == 0.0) return rz >= 0.0;\n"
+    "    r = s.x * s.y / length(vec2(s.y * p.x / d, s.x * p.y / d));\n"
+    "    return min(rz, r - d) >= 0.0;\n"
+    "}\n"
+    "#endif\n"
+    "\n"
+    "bool voxel_test(highp vec3 v)\n"
+    "{\n"
+    "    highp vec3 p = (u_shape_mat * vec4(v + 0.5, 1.0)).xyz;\n"
+    "    return shape_test(p, u_shape_size);\n"
+    "}\n"
+    "\n"
+    "void main()\n"
+    "{\n"
+    "    highp vec3 ro, rd, t0, t1, tmax, tdelta, v, n;\n"
+    "    highp float tin, tout, t;\n"
+    "    highp vec4 clip;\n"
+    "    mediump float diffuse;\n"
+    "    bool hit = false;\n"
+    "\n"
+    "    // View ray, going away from the camera.\n"
+    "    rd = (u_ortho > 0.0) ? u_camera_dir : normalize(v_pos - u_camera);\n"
+    "    rd = mix(rd, vec3(1e-6), vec3(equal(rd, vec3(0.0))));\n"
+    "    ro = v_pos;\n"
+    "\n"
+    "    // Clip the ray to the voxels box.\n"
+    "    t0 = (u_aabb_min - ro) / rd;\n"
+    "    t1 = (u_aabb_max - ro) / rd;\n"
+    "    tin = max(max(min(t0.x, t1.x), min(t0.y, t1.y)), min(t0.z, t1.z));\n"
+    "    tout = min(min(max(t0.x, t1.x), max(t0.y, t1.y)), max(t0.z, t1.z));\n"
+    "    if (u_ortho <= 0.0) tin = max(tin, -length(v_pos - u_camera));\n"
+    "    if (tin >= tout) discard;\n"
+    "\n"
+    "    // Normal of the entry face.\n"
+    "    n = -sign(rd) * vec3(equal(vec3(tin), min(t0, t1)));\n"
+    "\n"
+    "    // Walk the voxels grid.\n"
+    "    v = clamp(floor(ro + rd * (tin + 1e-4)), u_aabb_min, u_aabb_max - 1.0);\n"
+    "    tdelta = abs(1.0 / rd);\n"
+    "    tmax = (v + max(sign(rd), 0.0) - ro) / rd;\n"
+    "    t = tin;\n"
+    "    for (int i = 0; i < MAX_STEPS; i++) {\n"
+    "        if (voxel_test(v)) {\n"
+    "            hit = true;\n"
+    "            break;\n"
+    "        }\n"
+    "        if (tmax.x < tmax.y && tmax.x < tmax.z) {\n"
+    "            t = tmax.x;\n"
+    "            v.x += sign(rd.x);\n"
+    "            tmax.x += tdelta.x;\n"
+    "            n = vec3(-sign(rd.x), 0.0, 0.0);\n"
+    "        } else if (tmax.y < tmax.z) {\n"
+    "            t = tmax.y;\n"
+    "            v.y += sign(rd.y);\n"
+    "            tmax.y += tdelta.y;\n"
+    "            n = vec3(0.0, -sign(rd.y), 0.0);\n"
+    "        } else {\n"
+    "            t = tmax.z;\n"
+    "            v.z += sign(rd.z);\n"
+    "            tmax.z += tdelta.z;\n"
+    "            n = vec3(0.0, 0.0, -sign(rd.z));\n"
+    "        }\n"
+    "        if (t >= tout) break;\n"
+    "    }\n"
+    "    if (!hit) discard;\n"
+    "\n"
+    "    diffuse = max(0.0, dot(u_l_dir, n));\n"
+    "    gl_FragColor = vec4(u_color.rgb * (u_l_amb + u_l_int * diffuse),\n"
+    "                        u_color.a);\n"
+    "\n"
+    "    // Write the depth of the voxel face.\n"
+    "    clip = u_proj * u_view * vec4(ro + rd * t, 1.0);\n"
+    "#if defined(GL_ES) && defined(GL_EXT_frag_depth)\n"
+    "    gl_FragDepthEXT = clip.z / clip.w * 0.5 + 0.5;\n"
+    "#elif !defined(GL_ES)\n"
+    "    gl_FragDepth = clip.z / clip.w * 0.5 + 0.5;\n"
+    "#endif\n"
+    "}\n"
+    "/************************************************************************/\n"
+    "\n"
+    "#endif\n"
+    ""
+},
+{.path = "data/shaders/volume.glsl", .size = 12022, .data =
     "/* Goxel 3D voxels editor\n"
     " *\n"
     " * copyright (c) 2015 Guillaume Chereau <guillaume@noctua-software.com>\n"
@@ -225,7 +718,7 @@
     "uniform highp mat4  u_model;\n"
     "uniform highp mat4  u_view;\n"
     "uniform highp mat4  u_proj;\n"
-    "uniform lowp  float u_pos_scale;\n"
+    "uniform mediump float u_pos_scale;\n"
     "uniform highp vec3  u_camera;\n"
     "uniform highp float u_z_ofs; // Used for line rendering.\n"
     "\n"
@@ -240,6 +733,7 @@
     "uniform lowp float u_m_smoothness;\n"
     "uniform lowp vec4  u_m_base_color;\n"
     "uniform lowp vec3  u_m_emissive_factor;\n"
+    "uniform lowp float u_alpha; // Only used for OIT.\n"
     "\n"
     "uniform mediump sampler2D u_normal_sampler;\n"
     "uniform lowp    float     u_normal_scale;\n"
@@ -262,6 +756,9 @@
     "varying mediump vec2 v_occlusion_uv;\n"
     "varying mediump vec2 v_UVCoord1;\n"
     "varying mediump vec3 v_gradient;\n"
+    "#ifdef BAKED_AO\n"
+    "varying lowp    float v_ao;\n"
+    "#endif\n"
     "\n"
     "#ifdef HAS_TANGENTS\n"
     "varying mediump mat3 v_TBN;\n"
@@ -367,17 +864,61 @@
     "\n"
     "/************************************************************************/\n"
     "attribute highp   vec3 a_pos;\n"
-    "attribute mediump vec3 a_normal;\n"
-    "attribute mediump vec3 a_tangent;\n"
     "attribute mediump vec3 a_gradient;\n"
     "attribute lowp    vec4 a_color;\n"
+    "#ifdef PACKED_VERTEX\n"
+    "attribute mediump float a_face;     // face * 4 + quad corner.\n"
+    "attribute mediump vec2 a_masks;     // occlusion and borders masks.\n"
+    "#ifdef BAKED_AO\n"
+    "attribute lowp    float a_ao;       // Baked occlusion [0,1].\n"
+    "#endif\n"
+    "#else\n"
+    "attribute mediump vec3 a_normal;\n"
+    "attribute mediump vec3 a_tangent;\n"
     "attribute mediump vec2 a_occlusion_uv;\n"
     "attribute mediump vec2 a_bump_uv;   // bump tex base coordinates [0,255]\n"
     "attribute mediump vec2 a_uv;        // uv coordinates [0,1]\n"
+    "#endif\n"
     "\n"
     "// Must match the value in goxel.h\n"
     "#define VOXEL_TEXTURE_SIZE 8.0\n"
     "\n"
+    "#ifdef PACKED_VERTEX\n"
+    "/*\n"
+    " * Function: unpack_vertex\n"
+    " * Compute the quad vertex attributes from the face and masks attributes.\n"
+    " *\n"
+    " * Must match FACES_NORMALS, FACES_TANGENTS and VERTICE_UV in block_def.h,\n"
+    " * and pack_vertices in render.c.\n"
+    " */\n"
+    "void unpack_vertex(out mediump vec3 normal, out mediump vec3 tangent,\n"
+    "                   out mediump vec2 uv, out mediump vec2 occlusion_uv,\n"
+    "                   out mediump vec2 bump_uv)\n"
+    "{\n"
+    "    mediump float f = floor(a_face / 4.0);\n"
+    "    mediump float c = a_face - f * 4.0;\n"
+    "    mediump float ts = VOXEL_TEXTURE_SIZE;\n"
+    "\n"
+    "    if (f < 0.5) {\n"
+    "        normal = vec3(0.0, -1.0, 0.0); tangent = vec3(1.0, 0.0, 0.0);\n"
+    "    } else if (f < 1.5) {\n"
+    "        normal = vec3(0.0, 1.0, 0.0); tangent = vec3(-1.0, 0.0, 0.0);\n"
+    "    } else if (f < 2.5) {\n"
+    "        normal = vec3(0.0, 0.0, -1.0); tangent = vec3(0.0, 1.0, 0.0);\n"
+    "    } else if (f < 3.5) {\n"
+    "        normal = vec3(0.0, 0.0, 1.0); tangent = vec3(0.0, 1.0, 0.0);\n"
+    "    } else if (f < 4.5) {\n"
+    "        normal = vec3(1.0, 0.0, 0.0); tangent = vec3(0.0, 1.0, 0.0);\n"
+    "    } else {\n"
+    "        normal = vec3(-1.0, 0.0, 0.0); tangent = vec3(0.0, 0.0, 1.0);\n"
+    "    }\n"
+    "    uv = vec2(step(0.5, c) * step(c, 2.5), step(1.5, c));\n"
+    "    occlusion_uv = vec2(mod(a_masks.x, 16.0), floor(a_masks.x / 16.0)) * ts +\n"
+    "                   uv * (ts - 1.0);\n"
+    "    bump_uv = vec2(mod(a_masks.y, 16.0), floor(a_masks.y / 16.0)) * 16.0;\n"
+    "}\n"
+    "#endif\n"
+    "\n"
     "float gamma_to_linear(float v)\n"
     "{\n"
     "    return (v <= 0.04045) ? (v / 12.92) : pow((v + 0.055) / 1.055, 2.4);\n"
@@ -392,12 +933,27 @@
     "\n"
     "void main()\n"
     "{\n"
+    "    mediump vec3 normal, tangent;\n"
+    "    mediump vec2 uv, occlusion_uv, bump_uv;\n"
+    "#ifdef PACKED_VERTEX\n"
+    "    unpack_vertex(normal, tangent, uv, occlusion_uv, bump_uv);\n"
+    "#else\n"
+    "    normal = a_normal;\n"
+    "    tangent = a_tangent;\n"
+    "    uv = a_uv;\n"
+    "    occlusion_uv = a_occlusion_uv;\n"
+    "    bump_uv = a_bump_uv;\n"
+    "#endif\n"
+    "\n"
     "    vec4 pos = u_model * vec4(a_pos * u_pos_scale, 1.0);\n"
     "    v_Position = vec3(pos.xyz) / pos.w;\n"
     "\n"
     "    v_color = a_color;\n"
     "    v_color.rgb = srgb_to_linear(v_color.rgb);\n"
-    "    v_occlusion_uv = (a_occlusion_uv + 0.5) / (16.0 * VOXEL_TEXTURE_SIZE);\n"
+    "    v_occlusion_uv = (occlusion_uv + 0.5) / (16.0 * VOXEL_TEXTURE_SIZE);\n"
+    "#ifdef BAKED_AO\n"
+    "    v_ao = a_ao;\n"
+    "#endif\n"
     "    gl_Position = u_proj * u_view * vec4(v_Position, 1.0);\n"
     "    gl_Position.z += u_z_ofs;\n"
     "\n"
@@ -406,17 +962,16 @@
     "#endif\n"
     "\n"
     "#ifdef HAS_TANGENTS\n"
-    "    mediump vec4 tangent = vec4(normalize(a_tangent), 1.0);\n"
-    "    mediump vec3 normalW = normalize(a_normal);\n"
-    "    mediump vec3 tangentW = normalize(vec3(u_model * vec4(tangent.xyz, 0.0)));\n"
-    "    mediump vec3 bitangentW = cross(normalW, tangentW) * tangent.w;\n"
+    "    mediump vec3 normalW = normalize(normal);\n"
+    "    mediump vec3 tangentW = normalize(vec3(u_model * vec4(tangent, 0.0)));\n"
+    "    mediump vec3 bitangentW = cross(normalW, tangentW);\n"
     "    v_TBN = mat3(tangentW, bitangentW, normalW);\n"
     "#else\n"
-    "    v_Normal = normalize(a_normal);\n"
+    "    v_Normal = normalize(normal);\n"
     "#endif\n"
     "\n"
     "    v_gradient = a_gradient;\n"
-    "    v_UVCoord1 = (a_bump_uv + 0.5 + a_uv * 15.0) / 256.0;\n"
+    "    v_UVCoord1 = (bump_uv + 0.5 + uv * 15.0) / 256.0;\n"
     "\n"
     "#ifdef VERTEX_LIGHTNING\n"
     "    mediump vec3 N = getNormal();\n"
@@ -456,6 +1011,23 @@
     "    return linear_to_srgb(color);\n"
     "}\n"
     "\n"
+    "void write_color(vec4 color)\n"
+    "{\n"
+    "#ifdef OIT\n"
+    "    // Weighted blended order independent transparency, with a weight\n"
+    "    // function from McGuire and Bavoil 2013 using the distance to the\n"
+    "    // camera.  See oit_begin in render.c.\n"
+    "    highp float a = u_alpha;\n"
+    "    highp float d = length(v_Position - u_camera);\n"
+    "    highp float w = a * clamp(10.0 / (1e-5 + pow(d / 10.0, 3.0) +\n"
+    "                                      pow(d / 200.0, 6.0)), 1e-2, 3e3);\n"
+    "    gl_FragData[0] = vec4(color.rgb * a * w, a);\n"
+    "    gl_FragData[1] = vec4(a * w, 0.0, 0.0, 0.0);\n"
+    "#else\n"
+    "    gl_FragColor = color;\n"
+    "#endif\n"
+    "}\n"
+    "\n"
     "void main()\n"
     "{\n"
     "\n"
@@ -470,7 +1042,7 @@
     "    vec4 base_color = u_m_base_color * v_color;\n"
     "\n"
     "#ifdef MATERIAL_UNLIT\n"
-    "    gl_FragColor = vec4(sqrt(base_color.rgb), base_color.a);\n"
+    "    write_color(vec4(sqrt(base_color.rgb), base_color.a));\n"
     "    return;\n"
     "#endif\n"
     "\n"
@@ -509,13 +1081,17 @@
     "\n"
     "#ifdef HAS_OCCLUSION_MAP\n"
     "    lowp float ao;\n"
+    "#ifdef BAKED_AO\n"
+    "    ao = v_ao;\n"
+    "#else\n"
     "    ao = texture2D(u_occlusion_tex, v_occlusion_uv).r;\n"
+    "#endif\n"
     "    color = mix(color, color * ao, u_occlusion_strength);\n"
     "#endif\n"
     "\n"
     "    color += u_m_emissive_factor;\n"
     "\n"
-    "    gl_FragColor = vec4(toneMap(color), 1.0);\n"
+    "    write_color(vec4(toneMap(color), 1.0));\n"
     "}\n"
     "\n"
     "#endif\n"
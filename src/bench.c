@@ -0,0 +1,385 @@
+/* Goxel 3D voxels editor
+ *
+ * copyright (c) 2024 Guillaume Chereau <guillaume@noctua-software.com>
+ *
+ * Goxel is free software: you can redistribute it and/or modify it under the
+ * terms of the GNU General Public License as published by the Free Software
+ * Foundation, either version 3 of the License, or (at your option) any later
+ * version.
+
+ * Goxel is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+
+ * You should have received a copy of the GNU General Public License along with
+ * goxel.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Benchmarks of the core voxel operations.
+ *
+ * All the scenes are generated from a fixed seed, so that the results can
+ * be compared between versions.  The caches are cleared before each run,
+ * otherwise the operations repeated with the same inputs would only
+ * measure the cache lookups.
+ */
+
+#include "goxel.h"
+
+#include <errno.h> // IWYU pragma: keep.
+
+// Each benchmark runs at least this number of times, and then until it
+// has run for BENCH_TIME seconds.
+#define BENCH_MIN_RUNS 3
+#define BENCH_MAX_RUNS 100
+#define BENCH_TIME 0.5
+
+static const int SIZES[] = {32, 64, 128};
+
+typedef struct {
+    FILE        *file;
+    bool        first;
+    int         size;   // Size of the current scene.
+    volume_t    *scene;
+    volume_t    *layers[8];
+} bench_t;
+
+// Function measuring a single run of a benchmark, returns the time in
+// seconds.
+typedef double (*bench_func_t)(bench_t *bench, const void *arg);
+
+// Deterministic random generator, so that all the runs use the same
+// positions.
+static uint32_t rand_next(uint32_t *state)
+{
+    *state = *state * 1664525u + 1013904223u;
+    return *state >> 8;
+}
+
+static void get_box(int size, const float offset[3], float box[4][4])
+{
+    mat4_set_identity(box);
+    mat4_itranslate(box, offset[0], offset[1], offset[2]);
+    mat4_iscale(box, size / 2.f, size / 2.f, size / 2.f);
+}
+
+static void paint(volume_t *volume, const shape_t *shape, int mode,
+                  const uint8_t color[4], int size, const float offset[3])
+{
+    float box[4][4];
+    painter_t painter = {
+        .mode = mode,
+        .shape = shape,
+        .color = {color[0], color[1], color[2], color[3]},
+    };
+    get_box(size, offset, box);
+    volume_op(volume, &painter, box);
+}
+
+// Generate a terrain scene, that fits in a box of size^3 voxels.
+static volume_t *create_scene(int size, uint32_t seed)
+{
+    volume_t *volume = volume_new();
+    generator_fill_volume(volume, "terrain", (int64_t)size * size * size / 2,
+                          seed);
+    return volume;
+}
+
+static void run(bench_t *bench, const char *name, bench_func_t func,
+                const void *arg)
+{
+    double t, total = 0, min_time = DBL_MAX;
+    int nb;
+
+    for (nb = 0; nb < BENCH_MAX_RUNS; nb++) {
+        if (nb >= BENCH_MIN_RUNS && total >= BENCH_TIME) break;
+        cache_on_low_memory();
+        t = func(bench, arg);
+        total += t;
+        min_time = min(min_time, t);
+    }
+    LOG_I("%-24s %4d: %8.2f ms", name, bench->size, min_time * 1000);
+    fprintf(bench->file, "%s    {\"name\": \"%s\", \"size\": %d, "
+            "\"runs\": %d, \"min_ms\": %.3f, \"mean_ms\": %.3f}",
+            bench->first ? "" : ",\n", name, bench->size, nb,
+            min_time * 1000, total / nb * 1000);
+    bench->first = false;
+}
+
+static double bench_set_seq(bench_t *bench, const void *arg)
+{
+    volume_t *volume = volume_new();
+    volume_accessor_t acc = volume_get_accessor(volume);
+    int x, y, z, s = bench->size;
+    double t = sys_get_time();
+
+    for (z = 0; z < s; z++)
+    for (y = 0; y < s; y++)
+    for (x = 0; x < s; x++) {
+        volume_set_at(volume, &acc, (int[]){x, y, z},
+                      (uint8_t[]){x, y, z, 255});
+    }
+    t = sys_get_time() - t;
+    volume_delete(volume);
+    return t;
+}
+
+static double bench_get_seq(bench_t *bench, const void *arg)
+{
+    volume_accessor_t acc = volume_get_accessor(bench->scene);
+    int x, y, z, s = bench->size;
+    uint8_t v[4];
+    uint32_t sum = 0;
+    double t = sys_get_time();
+
+    for (z = 0; z < s; z++)
+    for (y = 0; y < s; y++)
+    for (x = 0; x < s; x++) {
+        volume_get_at(bench->scene, &acc, (int[]){x - s / 2, y - s / 2, z},
+                      v);
+        sum += v[3];
+    }
+    t = sys_get_time() - t;
+    if (sum == 1) LOG_D("Only one voxel"); // To not optimize out the loop.
+    return t;
+}
+
+// Same as bench_get_seq, but with z as the fastest changing coordinate.
+static double bench_get_z_order(bench_t *bench, const void *arg)
+{
+    volume_accessor_t acc = volume_get_accessor(bench->scene);
+    int x, y, z, s = bench->size;
+    uint8_t v[4];
+    uint32_t sum = 0;
+    double t = sys_get_time();
+
+    for (x = 0; x < s; x++)
+    for (y = 0; y < s; y++)
+    for (z = 0; z < s; z++) {
+        volume_get_at(bench->scene, &acc, (int[]){x - s / 2, y - s / 2, z},
+                      v);
+        sum += v[3];
+    }
+    t = sys_get_time() - t;
+    if (sum == 1) LOG_D("Only one voxel");
+    return t;
+}
+
+// Gather the six neighbors of each voxel, like the flood fill does.
+static double bench_get_neighbors(bench_t *bench, const void *arg)
+{
+    volume_accessor_t acc = volume_get_accessor(bench->scene);
+    int x, y, z, i, s = bench->size;
+    const int dirs[6][3] = {{1, 0, 0}, {-1, 0, 0}, {0, 1, 0},
+                            {0, -1, 0}, {0, 0, 1}, {0, 0, -1}};
+    uint8_t v[4];
+    uint32_t sum = 0;
+    double t = sys_get_time();
+
+    for (z = 0; z < s; z++)
+    for (y = 0; y < s; y++)
+    for (x = 0; x < s; x++) {
+        for (i = 0; i < 6; i++) {
+            volume_get_at(bench->scene, &acc,
+                          (int[]){x - s / 2 + dirs[i][0],
+                                  y - s / 2 + dirs[i][1],
+                                  z + dirs[i][2]}, v);
+            sum += v[3];
+        }
+    }
+    t = sys_get_time() - t;
+    if (sum == 1) LOG_D("Only one voxel");
+    return t;
+}
+
+static double bench_set_random(bench_t *bench, const void *arg)
+{
+    volume_t *volume = volume_new();
+    volume_accessor_t acc = volume_get_accessor(volume);
+    int i, pos[3], s = bench->size;
+    uint32_t seed = 1;
+    double t = sys_get_time();
+
+    for (i = 0; i < s * s * s; i++) {
+        pos[0] = rand_next(&seed) % s;
+        pos[1] = rand_next(&seed) % s;
+        pos[2] = rand_next(&seed) % s;
+        volume_set_at(volume, &acc, pos, (uint8_t[]){i, i >> 8, 0, 255});
+    }
+    t = sys_get_time() - t;
+    volume_delete(volume);
+    return t;
+}
+
+static double bench_get_random(bench_t *bench, const void *arg)
+{
+    volume_accessor_t acc = volume_get_accessor(bench->scene);
+    int i, pos[3], s = bench->size;
+    uint32_t seed = 1, sum = 0;
+    uint8_t v[4];
+    double t = sys_get_time();
+
+    for (i = 0; i < s * s * s; i++) {
+        pos[0] = (int)(rand_next(&seed) % s) - s / 2;
+        pos[1] = (int)(rand_next(&seed) % s) - s / 2;
+        pos[2] = rand_next(&seed) % s;
+        volume_get_at(bench->scene, &acc, pos, v);
+        sum += v[3];
+    }
+    t = sys_get_time() - t;
+    if (sum == 1) LOG_D("Only one voxel");
+    return t;
+}
+
+typedef struct {
+    const shape_t   *shape;
+    int             mode;
+} op_arg_t;
+
+static double bench_op(bench_t *bench, const void *arg_)
+{
+    const op_arg_t *arg = arg_;
+    volume_t *volume = volume_copy(bench->scene);
+    int s = bench->size;
+    double t = sys_get_time();
+
+    paint(volume, arg->shape, arg->mode, (uint8_t[]){255, 0, 0, 255},
+          s / 2, VEC(s / 4, 0, s / 2));
+    t = sys_get_time() - t;
+    volume_delete(volume);
+    return t;
+}
+
+static double bench_merge(bench_t *bench, const void *arg)
+{
+    volume_t *volume = volume_new();
+    int i;
+    double t = sys_get_time();
+
+    for (i = 0; i < ARRAY_SIZE(bench->layers); i++)
+        volume_merge(volume, bench->layers[i], MODE_OVER, NULL);
+    t = sys_get_time() - t;
+    volume_delete(volume);
+    return t;
+}
+
+static double bench_vertices(bench_t *bench, const void *arg)
+{
+    int effects = *(const int*)arg;
+    voxel_vertex_t *verts;
+    volume_iterator_t iter;
+    int bpos[3], size, subdivide;
+    double t;
+
+    verts = calloc(TILE_SIZE * TILE_SIZE * TILE_SIZE * 6 * 4, sizeof(*verts));
+    t = sys_get_time();
+    iter = volume_get_iterator(bench->scene,
+            VOLUME_ITER_TILES | VOLUME_ITER_INCLUDES_NEIGHBORS);
+    while (volume_iter(&iter, bpos)) {
+        volume_generate_vertices(bench->scene, bpos, effects, verts,
+                                 &size, &subdivide);
+    }
+    t = sys_get_time() - t;
+    free(verts);
+    return t;
+}
+
+static double bench_mesh(bench_t *bench, const void *arg)
+{
+    volume_mesh_t *mesh;
+    double t = sys_get_time();
+
+    mesh = volume_generate_mesh(bench->scene, 0, NULL, 0);
+    t = sys_get_time() - t;
+    volume_mesh_free(mesh);
+    return t;
+}
+
+static double bench_gox_save(bench_t *bench, const void *path)
+{
+    double t = sys_get_time();
+    save_to_file(goxel.image, path);
+    return sys_get_time() - t;
+}
+
+static double bench_gox_load(bench_t *bench, const void *path)
+{
+    double t = sys_get_time();
+    load_from_file(path, true);
+    return sys_get_time() - t;
+}
+
+static void run_all(bench_t *bench)
+{
+    int i, j, s = bench->size;
+    char name[64], path[1024];
+    const int effects_cube = 0, effects_mc = EFFECT_MARCHING_CUBES;
+    const shape_t *shapes[] = {&shape_sphere, &shape_cube, &shape_cylinder};
+    const struct {
+        const char *name;
+        int mode;
+    } modes[] = {{"over", MODE_OVER}, {"sub", MODE_SUB},
+                 {"paint", MODE_PAINT}};
+
+    bench->scene = create_scene(s, 1);
+    for (i = 0; i < ARRAY_SIZE(bench->layers); i++) {
+        bench->layers[i] = create_scene(s, i + 2);
+        volume_move(bench->layers[i], (float[4][4]){
+            {1, 0, 0, 0}, {0, 1, 0, 0}, {0, 0, 1, 0},
+            {(i % 2) * s / 2, (i / 2 % 2) * s / 2, i / 4 * s / 2, 1}});
+    }
+
+    run(bench, "set_at_sequential", bench_set_seq, NULL);
+    run(bench, "get_at_sequential", bench_get_seq, NULL);
+    run(bench, "get_at_z_order", bench_get_z_order, NULL);
+    run(bench, "get_at_neighbors", bench_get_neighbors, NULL);
+    run(bench, "set_at_random", bench_set_random, NULL);
+    run(bench, "get_at_random", bench_get_random, NULL);
+    for (i = 0; i < ARRAY_SIZE(shapes); i++) {
+        for (j = 0; j < ARRAY_SIZE(modes); j++) {
+            snprintf(name, sizeof(name), "volume_op_%s_%s",
+                     shapes[i]->id, modes[j].name);
+            run(bench, name, bench_op,
+                &(op_arg_t){shapes[i], modes[j].mode});
+        }
+    }
+    run(bench, "volume_merge_8_layers", bench_merge, NULL);
+    run(bench, "vertices_cube", bench_vertices, &effects_cube);
+    run(bench, "vertices_marching_cubes", bench_vertices, &effects_mc);
+    run(bench, "generate_mesh", bench_mesh, NULL);
+
+    snprintf(path, sizeof(path), "%s/bench.gox", sys_get_user_dir());
+    image_delete(goxel.image);
+    goxel.image = image_new();
+    volume_set(goxel.image->active_layer->volume, bench->scene);
+    run(bench, "gox_save", bench_gox_save, path);
+    run(bench, "gox_load", bench_gox_load, path);
+    sys_delete_file(path);
+
+    volume_delete(bench->scene);
+    for (i = 0; i < ARRAY_SIZE(bench->layers); i++)
+        volume_delete(bench->layers[i]);
+}
+
+int bench_run(const char *path)
+{
+    bench_t bench = {.first = true};
+    int i;
+
+    bench.file = fopen(path, "w");
+    if (!bench.file) {
+        LOG_E("Cannot open %s: %s", path, strerror(errno));
+        return -1;
+    }
+    fprintf(bench.file, "{\n  \"version\": \"%s\",\n  \"workers\": %d,\n"
+            "  \"benchmarks\": [\n", GOXEL_VERSION_STR,
+            jobs_get_nb_workers());
+    for (i = 0; i < ARRAY_SIZE(SIZES); i++) {
+        bench.size = SIZES[i];
+        run_all(&bench);
+    }
+    fprintf(bench.file, "\n  ]\n}\n");
+    fclose(bench.file);
+    return 0;
+}
@@ -56,16 +56,35 @@ void camera_set(camera_t *cam, const camera_t *other)
     mat4_copy(other->mat, cam->mat);
 }
 
-static void compute_clip(const float view_mat[4][4], float *near_, float *far_)
+// Extend the clip range to the tiles of a volume.
+static void add_volume_clip(const float view_mat[4][4], const volume_t *volume,
+                            int margin, float *n, float *f)
 {
     int bpos[3];
+    float p[3];
+    volume_iterator_t iter;
+
+    iter = volume_get_iterator(volume, VOLUME_ITER_TILES);
+    while (volume_iter(&iter, bpos)) {
+        vec3_set(p, bpos[0], bpos[1], bpos[2]);
+        mat4_mul_vec3(view_mat, p, p);
+        if (p[2] < 0) {
+            *n = min(*n, -p[2] - margin);
+            *f = max(*f, -p[2] + margin);
+        }
+    }
+}
+
+static void compute_clip(const float view_mat[4][4], float *near_, float *far_)
+{
     float p[3];
     float n = FLT_MAX, f = 256;
     int i;
     const int margin = 8 * BLOCK_SIZE;
     float vertices[8][3];
-    const volume_t *volume = goxel_get_layers_volume(goxel.image);
-    volume_iterator_t iter;
+    const layer_t *layer, *base;
+    float box[4][4];
+    const tool_overlay_t *overlay;
 
     if (!box_is_null(goxel.image->box)) {
         box_get_vertices(goxel.image->box, vertices);
@@ -78,13 +97,32 @@ static void compute_clip(const float view_mat[4][4], float *near_, float *far_)
         }
     }
 
-    iter = volume_get_iterator(volume, VOLUME_ITER_TILES);
-    while (volume_iter(&iter, bpos)) {
-        vec3_set(p, bpos[0], bpos[1], bpos[2]);
-        mat4_mul_vec3(view_mat, p, p);
-        if (p[2] < 0) {
-            n = min(n, -p[2] - margin);
-            f = max(f, -p[2] + margin);
+    // Use the rendered layers, so that we don't voxelize the shape layers
+    // that are rendered directly.
+    for (layer = goxel_get_render_layers(true); layer; layer = layer->next)
+        add_volume_clip(view_mat, layer->volume, margin, &n, &f);
+    // The tool preview can add tiles.
+    overlay = goxel_get_tool_overlay();
+    if (overlay) add_volume_clip(view_mat, overlay->volume, margin, &n, &f);
+    DL_FOREACH(goxel.image->layers, layer) {
+        base = image_get_instance_base(goxel.image, layer);
+        if (base) {
+            // Use the volume bounding box since there can be many clones.
+            volume_get_box(base->volume, false, box);
+            mat4_mul(layer->mat, box, box);
+        } else if (image_can_render_shape(goxel.image, layer)) {
+            mat4_copy(layer->mat, box);
+        } else {
+            continue;
+        }
+        if (box_is_null(box)) continue;
+        box_get_vertices(box, vertices);
+        for (i = 0; i < 8; i++) {
+            mat4_mul_vec3(view_mat, vertices[i], p);
+            if (p[2] < 0) {
+                n = min(n, -p[2] - margin);
+                f = max(f, -p[2] + margin);
+            }
         }
     }
     if (n >= f) n = 1;
@@ -161,13 +199,13 @@ void camera_fit_box(camera_t *cam, const float box[4][4])
  * Function: camera_get_key
  * Return a value that is guarantied to change when the camera change.
  */
-uint32_t camera_get_key(const camera_t *cam)
+uint64_t camera_get_key(const camera_t *cam)
 {
-    uint32_t key = 0;
-    key = XXH32(&cam->name, sizeof(cam->name), key);
-    key = XXH32(&cam->ortho, sizeof(cam->ortho), key);
-    key = XXH32(&cam->dist, sizeof(cam->dist), key);
-    key = XXH32(&cam->mat, sizeof(cam->mat), key);
+    uint64_t key = 0;
+    key = XXH64(cam->name, strlen(cam->name), key);
+    key = XXH64(&cam->ortho, sizeof(cam->ortho), key);
+    key = XXH64(&cam->dist, sizeof(cam->dist), key);
+    key = XXH64(&cam->mat, sizeof(cam->mat), key);
     return key;
 }
 
@@ -120,7 +120,7 @@ void camera_fit_box(camera_t *camera, const float box[4][4]);
  * Function: camera_get_key
  * Return a value that is guarantied to change when the camera change.
  */
-uint32_t camera_get_key(const camera_t *camera);
+uint64_t camera_get_key(const camera_t *camera);
 
 void camera_turntable(camera_t *camera, float rz, float rx);
 
@@ -26,6 +26,9 @@
 // The global hash table of file formats.
 file_format_t *file_formats = NULL;
 
+// The import or export task running in the current thread.
+static __thread file_format_task_t *g_task = NULL;
+
 static bool endswith(const char *str, const char *end)
 {
     const char *start;
@@ -86,3 +89,16 @@ void file_format_iter(const char *mode, void *user,
         fun(user, f);
     }
 }
+
+void file_format_set_task(file_format_task_t *task)
+{
+    g_task = task;
+}
+
+bool file_format_report_progress(float progress)
+{
+    if (!g_task) return true;
+    __atomic_store_n(&g_task->progress, (int)(progress * 100),
+                     __ATOMIC_RELAXED);
+    return !__atomic_load_n(&g_task->cancel, __ATOMIC_RELAXED);
+}
@@ -35,8 +35,43 @@ struct file_format
                                    const char *path);
     void            (*import_gui)(file_format_t *format);
     int             priority; // Specifies the order of file_format_iter.
+    // Set if the import and export functions can run in a background
+    // thread, on a private copy of the image.  They can then report their
+    // progress with <file_format_report_progress>.
+    bool            thread_safe;
 };
 
+/*
+ * Type: file_format_task_t
+ * State of an import or export running in a background thread.
+ *
+ * Attributes:
+ *   progress - The progress in percent, updated atomically.
+ *   cancel   - Set by the main thread to stop the task.
+ */
+typedef struct {
+    int progress;
+    int cancel;
+} file_format_task_t;
+
+// Set the task of the calling thread, or NULL once it is done.
+void file_format_set_task(file_format_task_t *task);
+
+/*
+ * Function: file_format_report_progress
+ * Report the progress of the import or export running in the calling
+ * thread.
+ *
+ * Parameters:
+ *   progress - The progress between 0 and 1.
+ *
+ * Return:
+ *   False if the task got cancelled, in that case the format function
+ *   should return as soon as possible.  Outside of a background task this
+ *   always returns true.
+ */
+bool file_format_report_progress(float progress);
+
 void file_format_register(file_format_t *format);
 
 /**
@@ -21,6 +21,8 @@
 #include "file_format.h"
 #include "utils/vec.h"
 
+#include <errno.h>
+
 #pragma GCC diagnostic push
 #pragma GCC diagnostic ignored "-Wformat-truncation"
 #define CGLTF_IMPLEMENTATION
@@ -32,6 +34,11 @@ typedef struct {
     cgltf_data *data;
     palette_t palette;
     cgltf_material *default_mat;
+    // All the binary data, shared by every buffer view.
+    cgltf_buffer *buffer;
+    uint8_t *bin;
+    size_t bin_size;
+    size_t bin_capacity;
 } gltf_t;
 
 typedef struct {
@@ -48,9 +55,23 @@ typedef struct {
 typedef struct {
     bool vertex_color;
     bool visible_only;
+    bool external_bin; // Save the buffer in a separate .bin file.
+    // Save one mesh per unique tile, placed with EXT_mesh_gpu_instancing.
+    bool instancing;
     float simplify;
 } export_options_t;
 
+// A group of tiles with the same voxels and neighbors, that are saved as
+// instances of a single mesh.
+typedef struct {
+    UT_hash_handle  hh;
+    uint64_t        key[27];    // Data ids of the tile and its neighbors.
+    int             nb;
+    int             capacity;
+    int             (*pos)[3];
+    volume_mesh_t   *mesh;
+} tile_group_t;
+
 static export_options_t g_export_options = {};
 
 
@@ -125,6 +146,8 @@ static char *data_new(const void *data, uint32_t len, const char *mime)
         }                                                                     \
     })
 
+#define add_item(data, list) ({ &(data)->list[(data)->list##_count++]; })
+
 static void gltf_init(gltf_t *g, const export_options_t *options,
                       const image_t *img)
 {
@@ -151,14 +174,36 @@ static void gltf_init(gltf_t *g, const export_options_t *options,
     ALLOC(g->data->scenes, 1);
     ALLOC(g->data->nodes, 1 + nb_blocks + DL_SIZE(img->layers));
     ALLOC(g->data->meshes, nb_blocks);
-    ALLOC(g->data->accessors, nb_blocks * 4);
-    ALLOC(g->data->buffers, nb_blocks * 2 + 1);
-    ALLOC(g->data->buffer_views, nb_blocks * 2 + 1);
+    ALLOC(g->data->accessors, nb_blocks * 5);
+    ALLOC(g->data->buffers, 1);
+    ALLOC(g->data->buffer_views, nb_blocks * 3 + 1);
+    g->buffer = add_item(g->data, buffers);
     ALLOC(g->data->images, 1);
     ALLOC(g->data->textures, 1);
 }
 
-#define add_item(data, list) ({ &(data)->list[(data)->list##_count++]; })
+// Append some data to the shared binary buffer and create a buffer view
+// for it.  The views are aligned to four bytes, as required by the spec.
+static cgltf_buffer_view *add_buffer_view(gltf_t *g, const void *data,
+                                          size_t size)
+{
+    cgltf_buffer_view *buffer_view;
+    size_t ofs = (g->bin_size + 3) & ~(size_t)3;
+
+    if (ofs + size > g->bin_capacity) {
+        g->bin_capacity = max(ofs + size, g->bin_capacity * 2);
+        g->bin = realloc(g->bin, g->bin_capacity);
+    }
+    memset(g->bin + g->bin_size, 0, ofs - g->bin_size);
+    memcpy(g->bin + ofs, data, size);
+    g->bin_size = ofs + size;
+
+    buffer_view = add_item(g->data, buffer_views);
+    buffer_view->buffer = g->buffer;
+    buffer_view->offset = ofs;
+    buffer_view->size = size;
+    return buffer_view;
+}
 
 // Create a buffer view and attribute.
 static void make_attribute(gltf_t *g, cgltf_buffer_view *buffer_view,
@@ -241,26 +286,16 @@ static cgltf_material *get_default_mat(
     return g->default_mat;
 }
 
-static void save_layer(gltf_t *g, cgltf_node *root_node,
-                       const image_t *img, const layer_t *layer,
-                       const palette_t *palette,
-                       int palette_pix_size,
-                       const export_options_t *options)
+// Create a gltf mesh from a volume mesh.
+static cgltf_mesh *add_mesh(gltf_t *g, const image_t *img,
+                            const layer_t *layer, const volume_mesh_t *mesh,
+                            const export_options_t *options)
 {
-    volume_mesh_t *mesh;
     cgltf_mesh *gmesh;
-    cgltf_node *node;
     cgltf_primitive *primitive;
-    cgltf_buffer *buffer;
     cgltf_buffer_view *buffer_view;
     cgltf_accessor *accessor;
 
-    mesh = volume_generate_mesh(
-            layer->volume, goxel.rend.settings.effects, palette,
-            g_export_options.simplify);
-
-    if (mesh->vertices_count == 0) return;
-
     gmesh = add_item(g->data, meshes);
     ALLOC(gmesh->primitives, 1);
     primitive = add_item(gmesh, primitives);
@@ -273,13 +308,8 @@ static void save_layer(gltf_t *g, cgltf_node *root_node,
         primitive->material = get_default_mat(g, options);
     }
 
-
-    buffer = add_item(g->data, buffers);
-    buffer->size = mesh->vertices_count * sizeof(*mesh->vertices);
-    buffer->uri = data_new(mesh->vertices, buffer->size, NULL);
-    buffer_view = add_item(g->data, buffer_views);
-    buffer_view->buffer = buffer;
-    buffer_view->size = buffer->size;
+    buffer_view = add_buffer_view(
+            g, mesh->vertices, mesh->vertices_count * sizeof(*mesh->vertices));
     buffer_view->stride = sizeof(*mesh->vertices);
     buffer_view->type = cgltf_buffer_view_type_vertices;
 
@@ -314,12 +344,8 @@ static void save_layer(gltf_t *g, cgltf_node *root_node,
                        NULL, NULL);
     }
 
-    buffer = add_item(g->data, buffers);
-    buffer->size = mesh->indices_count * sizeof(*mesh->indices);
-    buffer->uri = data_new(mesh->indices, buffer->size, NULL);
-    buffer_view = add_item(g->data, buffer_views);
-    buffer_view->buffer = buffer;
-    buffer_view->size = buffer->size;
+    buffer_view = add_buffer_view(
+            g, mesh->indices, mesh->indices_count * sizeof(*mesh->indices));
     buffer_view->type = cgltf_buffer_view_type_indices;
 
     accessor = add_item(g->data, accessors);
@@ -328,15 +354,166 @@ static void save_layer(gltf_t *g, cgltf_node *root_node,
     accessor->count = mesh->indices_count;
     accessor->type = cgltf_type_scalar;
     primitive->indices = accessor;
+    return gmesh;
+}
+
+static int get_export_effects(void)
+{
+    return goxel.rend.settings.effects | EFFECT_GREEDY_MESH;
+}
+
+static void save_layer(gltf_t *g, cgltf_node *root_node,
+                       const image_t *img, const layer_t *layer,
+                       const palette_t *palette,
+                       int palette_pix_size,
+                       const export_options_t *options)
+{
+    volume_mesh_t *mesh;
+    cgltf_node *node;
 
+    mesh = volume_generate_mesh(layer->volume, get_export_effects(),
+                                palette, options->simplify);
+    if (mesh->vertices_count == 0) {
+        volume_mesh_free(mesh);
+        return;
+    }
     node = add_item(g->data, nodes);
-    node->mesh = gmesh;
+    node->mesh = add_mesh(g, img, layer, mesh, options);
     node->name = strdup(layer->name);
     *add_item(root_node, children) = node;
-
     volume_mesh_free(mesh);
 }
 
+typedef struct {
+    const volume_t          *volume;
+    const palette_t         *palette;
+    const export_options_t  *options;
+    tile_group_t            **groups;
+} groups_ctx_t;
+
+static void group_mesh_job(void *user, int i, int worker)
+{
+    groups_ctx_t *ctx = user;
+    tile_group_t *group = ctx->groups[i];
+    group->mesh = volume_generate_tile_mesh(
+            ctx->volume, group->pos[0], get_export_effects(), ctx->palette,
+            ctx->options->simplify);
+}
+
+// Add a node placing a mesh at the positions of all the tiles of a group.
+static cgltf_node *add_group_node(gltf_t *g, cgltf_mesh *gmesh,
+                                  const tile_group_t *group)
+{
+    cgltf_node *node;
+    cgltf_buffer_view *buffer_view;
+    cgltf_accessor *accessor;
+    cgltf_attribute *attribute;
+    float (*translations)[3];
+    int i;
+
+    node = add_item(g->data, nodes);
+    node->mesh = gmesh;
+    if (group->nb == 1) {
+        vec3_set(node->translation, group->pos[0][0], group->pos[0][1],
+                 group->pos[0][2]);
+        node->has_translation = true;
+        return node;
+    }
+
+    translations = calloc(group->nb, sizeof(*translations));
+    for (i = 0; i < group->nb; i++)
+        vec3_set(translations[i], group->pos[i][0], group->pos[i][1],
+                 group->pos[i][2]);
+    buffer_view = add_buffer_view(g, translations,
+                                  group->nb * sizeof(*translations));
+    free(translations);
+    accessor = add_item(g->data, accessors);
+    accessor->buffer_view = buffer_view;
+    accessor->component_type = cgltf_component_type_r_32f;
+    accessor->type = cgltf_type_vec3;
+    accessor->count = group->nb;
+
+    node->has_mesh_gpu_instancing = true;
+    ALLOC(node->mesh_gpu_instancing.attributes, 1);
+    attribute = add_item(&node->mesh_gpu_instancing, attributes);
+    attribute->name = strdup("TRANSLATION");
+    attribute->data = accessor;
+    return node;
+}
+
+/*
+ * Save a layer as one mesh per group of tiles with the same voxels and
+ * neighbors.  Since the tiles meshes only depend on those, all the tiles
+ * of a group can be rendered as instances of the same mesh.
+ */
+static void save_layer_instanced(gltf_t *g, cgltf_node *root_node,
+                                 const image_t *img, const layer_t *layer,
+                                 const palette_t *palette,
+                                 const export_options_t *options)
+{
+    volume_iterator_t iter;
+    volume_accessor_t accessor;
+    int i, x, y, z, pos[3], p[3], nb = 0;
+    uint64_t key[27];
+    tile_group_t *group, *table = NULL, **groups = NULL;
+    groups_ctx_t ctx;
+    cgltf_node *node;
+    cgltf_mesh *gmesh;
+
+    accessor = volume_get_neighbors_accessor(layer->volume);
+    iter = volume_get_iterator(layer->volume,
+            VOLUME_ITER_TILES | VOLUME_ITER_INCLUDES_NEIGHBORS);
+    while (volume_iter(&iter, pos)) {
+        for (i = 0, z = -1; z <= 1; z++)
+        for (y = -1; y <= 1; y++)
+        for (x = -1; x <= 1; x++, i++) {
+            p[0] = pos[0] + x * TILE_SIZE;
+            p[1] = pos[1] + y * TILE_SIZE;
+            p[2] = pos[2] + z * TILE_SIZE;
+            volume_get_tile_data(layer->volume, &accessor, p, &key[i]);
+        }
+        HASH_FIND(hh, table, key, sizeof(key), group);
+        if (!group) {
+            group = calloc(1, sizeof(*group));
+            memcpy(group->key, key, sizeof(key));
+            HASH_ADD(hh, table, key, sizeof(group->key), group);
+            groups = realloc(groups, (nb + 1) * sizeof(*groups));
+            groups[nb++] = group;
+        }
+        if (group->nb >= group->capacity) {
+            group->capacity = max(group->capacity * 2, 8);
+            group->pos = realloc(group->pos,
+                                 group->capacity * sizeof(*group->pos));
+        }
+        memcpy(group->pos[group->nb++], pos, sizeof(pos));
+    }
+
+    ctx = (groups_ctx_t) {
+        .volume = layer->volume,
+        .palette = palette,
+        .options = options,
+        .groups = groups,
+    };
+    jobs_parallel_for(nb, group_mesh_job, &ctx);
+
+    node = add_item(g->data, nodes);
+    node->name = strdup(layer->name);
+    *add_item(root_node, children) = node;
+    ALLOC(node->children, nb);
+    for (i = 0; i < nb; i++) {
+        group = groups[i];
+        if (group->mesh->vertices_count) {
+            gmesh = add_mesh(g, img, layer, group->mesh, options);
+            *add_item(node, children) = add_group_node(g, gmesh, group);
+        }
+        volume_mesh_free(group->mesh);
+        HASH_DEL(table, group);
+        free(group->pos);
+        free(group);
+    }
+    free(groups);
+}
+
 static void create_palette_texture(
         gltf_t *g, const image_t *img, int pix_size)
 {
@@ -347,11 +524,12 @@ static void create_palette_texture(
     uint8_t c[4];
     uint8_t (*data)[3];
     uint8_t *png;
-    cgltf_buffer *buffer;
     cgltf_buffer_view *buffer_view;
     cgltf_image *image;
     cgltf_texture *texture;
 
+    // The lookup is released after the meshes are generated.
+    palette_lookup_begin(&g->palette);
     DL_FOREACH(img->layers, layer) {
         iter = volume_get_iterator(layer->volume, 0);
         while (volume_iter(&iter, pos)) {
@@ -377,12 +555,7 @@ static void create_palette_texture(
     }
     png = img_write_to_mem((void*)data, s, s, 3, &size);
     free(data);
-    buffer = add_item(g->data, buffers);
-    buffer->size = size;
-    buffer->uri = data_new(png, size, NULL);
-    buffer_view = add_item(g->data, buffer_views);
-    buffer_view->buffer = buffer;
-    buffer_view->size = size;
+    buffer_view = add_buffer_view(g, png, size);
     image = add_item(g->data, images);
     image->mime_type = strdup("image/png");
     image->buffer_view = buffer_view;
@@ -391,8 +564,40 @@ static void create_palette_texture(
     free(png);
 }
 
-static void gltf_export(const image_t *img, const char *path,
-                        const export_options_t *options)
+// Set the shared buffer data, either embedded as a data uri, saved into
+// an external .bin file, or as the binary chunk of a glb file.
+static int save_buffer(gltf_t *g, const char *path, bool glb,
+                       const export_options_t *options)
+{
+    char bin_path[1024], uri[1024];
+    FILE *file;
+
+    g->buffer->size = g->bin_size;
+    if (glb) {
+        g->data->bin = g->bin;
+        g->data->bin_size = g->bin_size;
+        return 0;
+    }
+    if (!options->external_bin) {
+        g->buffer->uri = data_new(g->bin, g->bin_size, NULL);
+        return 0;
+    }
+    if (!str_replace_ext(path, "bin", bin_path, sizeof(bin_path)))
+        snprintf(bin_path, sizeof(bin_path), "%s.bin", path);
+    file = fopen(bin_path, "wb");
+    if (!file) {
+        LOG_E("Cannot save to %s: %s", bin_path, strerror(errno));
+        return -1;
+    }
+    fwrite(g->bin, 1, g->bin_size, file);
+    fclose(file);
+    path_basename(bin_path, uri, sizeof(uri));
+    g->buffer->uri = strdup(uri);
+    return 0;
+}
+
+static int gltf_export(const image_t *img, const char *path, bool glb,
+                       const export_options_t *options)
 {
     gltf_t g = {};
     const layer_t *layer;
@@ -402,6 +607,7 @@ static void gltf_export(const image_t *img, const char *path,
     material_t *mat;
     const palette_t *palette = NULL;
     const int palette_pix_size = 4;
+    int ret;
 
     gltf_init(&g, options, img);
 
@@ -428,20 +634,43 @@ static void gltf_export(const image_t *img, const char *path,
     ALLOC(root_node->children, DL_SIZE(img->layers));
     DL_FOREACH(img->layers, layer) {
         if (options->visible_only && !layer->visible) continue;
-        save_layer(&g, root_node, img, layer,
-                   palette, palette_pix_size, options);
+        if (options->instancing) {
+            save_layer_instanced(&g, root_node, img, layer, palette,
+                                 options);
+        } else {
+            save_layer(&g, root_node, img, layer,
+                       palette, palette_pix_size, options);
+        }
     }
 
-    cgltf_write_file(&gltf_options, path, g.data);
+    ret = save_buffer(&g, path, glb, options);
+    if (ret == 0) {
+        gltf_options.type = glb ? cgltf_file_type_glb : cgltf_file_type_gltf;
+        if (cgltf_write_file(&gltf_options, path, g.data) !=
+                cgltf_result_success) {
+            LOG_E("Cannot save to %s", path);
+            ret = -1;
+        }
+    }
+    // The binary chunk is owned by us, not by cgltf.
+    g.data->bin = NULL;
     cgltf_free(g.data);
+    free(g.bin);
+    palette_lookup_end(&g.palette);
     free(g.palette.entries);
+    return ret;
 }
 
 static int export_as_gltf(const file_format_t *format, const image_t *img,
                           const char *path)
 {
-    gltf_export(img, path, &g_export_options);
-    return 0;
+    return gltf_export(img, path, false, &g_export_options);
+}
+
+static int export_as_glb(const file_format_t *format, const image_t *img,
+                         const char *path)
+{
+    return gltf_export(img, path, true, &g_export_options);
 }
 
 static void export_gui(file_format_t *format)
@@ -452,13 +681,34 @@ static void export_gui(file_format_t *format)
                  _("Exclude hidden layers"));
     gui_input_float(_("Simplify"), &g_export_options.simplify, 0.1,
                     0, 1, "%.1f");
+    gui_checkbox(_("Tile Instancing"), &g_export_options.instancing,
+                 _("Save the identical tiles as instances of a single "
+                   "mesh (EXT_mesh_gpu_instancing)"));
+}
+
+static void export_gltf_gui(file_format_t *format)
+{
+    export_gui(format);
+    gui_checkbox(_("External Buffer"), &g_export_options.external_bin,
+                 _("Save the binary data in a separate .bin file"));
 }
 
 FILE_FORMAT_REGISTER(gltf,
     .name = "gltf",
     .exts = {"*.gltf"},
     .exts_desc = "glTF2",
-    .export_gui = export_gui,
+    .export_gui = export_gltf_gui,
     .export_func = export_as_gltf,
     .priority = 100,
+    .thread_safe = true,
+)
+
+FILE_FORMAT_REGISTER(glb,
+    .name = "glb",
+    .exts = {"*.glb"},
+    .exts_desc = "glTF2 binary",
+    .export_gui = export_gui,
+    .export_func = export_as_glb,
+    .priority = 100,
+    .thread_safe = true,
 )
@@ -19,18 +19,21 @@
 
 #include "goxel.h"
 #include "file_format.h"
+#include "xxhash.h"
 #include <errno.h>
 
-#define VERSION 2 // Current version of the file format.
+#include "../../ext_src/stb/stb_ds.h"
+
+#define VERSION 3 // Current version of the file format.
 
 /*
- * File format, version 2:
+ * File format, version 3:
  *
  * This is inspired by the png format, where the file consists of a list of
  * chunks with different types.
  *
  *  4 bytes magic string        : "GOX "
- *  4 bytes version             : 2
+ *  4 bytes version             : 3
  *  List of chunks:
  *      4 bytes: type
  *      4 bytes: data length
@@ -51,7 +54,38 @@
  *
  *  PREV: a png image for preview.
  *
- *  BL16: a 16^3 block saved as a 64x64 png image.
+ *  BL16: a 16^3 block saved as a 64x64 png image (only read, replaced by
+ *        BLRL since version 3).
+ *
+ *  BLRL: a 16^3 block of RGBA voxels:
+ *      4 bytes: XXH32 of the raw voxels data.
+ *      1 byte : encoding, 0 for raw voxels, 1 for run length.
+ *      if raw: 16^3 * 4 bytes: the voxels.
+ *      if run length, until we got 16^3 voxels:
+ *          2 bytes: number of voxels of the run.
+ *          4 bytes: value of the voxels.
+ *
+ *  BL32: same as BLRL, for a 32^3 block.  The blocks are saved with the
+ *        tiles size of the build, but all the sizes can be read, and the
+ *        position of a block doesn't need to be aligned to its size.
+ *
+ *  JRNL: empty chunk starting a journal entry.  When we save again into
+ *        the same file, we only append the new blocks, then a JRNL
+ *        followed by all the other chunks (IMG, PREV, MATE, LAYR, CAMR,
+ *        LIGH).  The non block chunks before the last JRNL are ignored.
+ *        An entry is only valid once its LIGH chunk is written.
+ *
+ *  INDX: optional index of the chunks, always the last chunk of the file:
+ *          4 bytes: number of entries.
+ *          for each entry:
+ *              4 bytes: chunk type.
+ *              8 bytes: chunk offset in the file.
+ *              4 bytes: chunk data length.
+ *          8 bytes: offset of the INDX chunk itself, so that we can find
+ *                   it from the end of the file.
+ *        The index lists all the blocks, in order, followed by the other
+ *        chunks of the last journal entry.  If it is missing or invalid
+ *        the file is read sequentially.
  *
  *  LAYR: a layer:
  *      4 bytes: number of blocks.
@@ -85,8 +119,33 @@ typedef struct {
     void            *v;
     uint64_t        uid;
     int             index;
+    // When saving, tile the block data comes from.
+    const volume_t  *volume;
+    int             pos[3];
+    // Encoded data of the block, waiting to be written (save), and whether
+    // it is a png image (BL16 chunk).
+    uint8_t         *buf;
+    int             size;
+    bool            png;
+    int             block_size; // Size of the voxels cube: 16 or 32.
+    // When loading, position of the block chunk in the file, and encoded
+    // data waiting to be decoded, pointing directly into the file content.
+    long            offset;
+    const uint8_t   *src;
+    // When loading, the blocks of the size of a tile are decoded into a tile
+    // data that the layers share, instead of the voxels v.  Empty blocks
+    // have neither.
+    tile_data_t     *tile;
+    bool            decoded;
 } block_hash_t;
 
+// Entry of the INDX chunk.
+typedef struct {
+    char            type[4];
+    int64_t         offset;
+    int32_t         length;
+} index_entry_t;
+
 #define CHUNK_BUFF_SIZE (1 << 20) // 1 MiB max buffer size!
 
 // XXX: should be something in goxel.h
@@ -117,56 +176,58 @@ static void write_int32(FILE *out, int32_t v)
     fwrite((char*)&v, 4, 1, out);
 }
 
-static int32_t read_int32(FILE *in)
-{
-    int32_t v;
-    if (fread(&v, 4, 1, in) != 1) {
-        // XXX: use a better error mechanism!
-        LOG_E("Error reading file");
-    }
-    return v;
-}
+// The read functions never fail: in case of error the reader error flag is
+// set, and the loader checks it once done.
 
-static bool chunk_read_start(chunk_t *c, FILE *in)
+static bool chunk_read_start(chunk_t *c, reader_t *in)
 {
-    size_t r;
     memset(c, 0, sizeof(*c));
-    r = fread(c->type, 4, 1, in);
-    if (r == 0) return false; // eof.
-    if (r != 1) LOG_E("Error reading file");
-    c->length = read_int32(in);
-    return true;
+    if (reader_remaining(in) == 0) return false; // eof.
+    reader_read(in, c->type, 4);
+    c->length = reader_i32(in);
+    if (c->length < 0 || c->length > reader_remaining(in)) {
+        LOG_E("Invalid chunk length");
+        in->error = true;
+    }
+    return !in->error;
 }
 
-static void chunk_read(chunk_t *c, FILE *in, char *buff, int size, int line)
+static void chunk_read(chunk_t *c, reader_t *in, char *buff, int size,
+                       int line)
 {
     if (size == 0) return;
     c->pos += size;
     assert(c->pos <= c->length);
     if (buff) {
-        // XXX: use a better error mechanism!
-        if (fread(buff, size, 1, in) != 1) {
-            LOG_E("Error reading file (line %d)", line);
-        }
+        reader_read(in, buff, size);
     } else {
-        fseek(in, size, SEEK_CUR);
+        reader_skip(in, size);
     }
 }
 
-static int32_t chunk_read_int32(chunk_t *c, FILE *in, int line)
+// Return a pointer to the next data of a chunk, directly from the file.
+static const uint8_t *chunk_read_bytes(chunk_t *c, reader_t *in, int size,
+                                       int line)
+{
+    c->pos += size;
+    assert(c->pos <= c->length);
+    return reader_read_bytes(in, size);
+}
+
+static int32_t chunk_read_int32(chunk_t *c, reader_t *in, int line)
 {
     int32_t v;
     chunk_read(c, in, (char*)&v, 4, line);
     return v;
 }
 
-static void chunk_read_finish(chunk_t *c, FILE *in)
+static void chunk_read_finish(chunk_t *c, reader_t *in)
 {
     assert(c->pos == c->length);
-    read_int32(in); // TODO: check crc.
+    reader_skip(in, 4); // TODO: check crc.
 }
 
-static bool chunk_read_dict_value(chunk_t *c, FILE *in,
+static bool chunk_read_dict_value(chunk_t *c, reader_t *in,
                                   char *key, char *value, int *value_size,
                                   int line) {
     int size;
@@ -174,14 +235,21 @@ static bool chunk_read_dict_value(chunk_t *c, FILE *in,
     if (c->pos == c->length) return 0;
     size = chunk_read_int32(c, in, line);
     if (size == 0) return false;
-    assert(size < 256);
+    if (size < 0 || size >= 256 || size > c->length - c->pos) goto error;
     chunk_read(c, in, key, size, line);
     key[size] = '\0';
     size = chunk_read_int32(c, in, line);
+    if (size < 0 || size >= 256 || size > c->length - c->pos) goto error;
     chunk_read(c, in, value, size, line);
     value[size] = '\0';
     *value_size = size;
     return true;
+
+error:
+    LOG_E("Invalid dict value (line %d)", line);
+    in->error = true;
+    chunk_read(c, in, NULL, c->length - c->pos, line);
+    return false;
 }
 
 static void chunk_write_start(chunk_t *c, FILE *out, const char *type)
@@ -229,10 +297,367 @@ static void chunk_write_all(FILE *out, const char *type,
 {
     fwrite(type, 4, 1, out);
     write_int32(out, size);
-    fwrite(data, size, 1, out);
+    if (size) fwrite(data, size, 1, out);
+    write_int32(out, 0);        // CRC XXX: todo.
+}
+
+// Add the chunk we just wrote to an index.
+static void index_add(index_entry_t **index, FILE *out, const char *type,
+                      int length)
+{
+    index_entry_t entry = {.length = length};
+    memcpy(entry.type, type, 4);
+    entry.offset = ftell(out) - 12 - length;
+    arrput(*index, entry);
+}
+
+static void write_index(FILE *out, const index_entry_t *blocks,
+                        const index_entry_t *chunks)
+{
+    int i, n = arrlen(blocks) + arrlen(chunks);
+    int64_t offset = ftell(out);
+    const index_entry_t *entry;
+
+    fwrite("INDX", 4, 1, out);
+    write_int32(out, 4 + n * 16 + 8);
+    write_int32(out, n);
+    for (i = 0; i < n; i++) {
+        entry = i < arrlen(blocks) ? &blocks[i] : &chunks[i - arrlen(blocks)];
+        fwrite(entry->type, 4, 1, out);
+        fwrite(&entry->offset, 8, 1, out);
+        write_int32(out, entry->length);
+    }
+    fwrite(&offset, 8, 1, out);
     write_int32(out, 0);        // CRC XXX: todo.
 }
 
+/*
+ * Read the INDX chunk at the end of a file.
+ *
+ * Return an array of entries, or NULL if the file has no valid index.  The
+ * file position is restored.
+ */
+static index_entry_t *read_index(reader_t *in)
+{
+    size_t start = in->pos, size = in->size;
+    int64_t offset;
+    char type[4];
+    int32_t length, n, i;
+    index_entry_t *index = NULL, entry;
+
+    if (size < 8 + 24) goto end;
+    reader_seek(in, size - 12);
+    offset = reader_i64(in);
+    if (offset < 8 || offset > size - 24) goto end;
+    reader_seek(in, offset);
+    reader_read(in, type, 4);
+    length = reader_i32(in);
+    n = reader_i32(in);
+    if (    strncmp(type, "INDX", 4) != 0 ||
+            offset + 12 + length != size ||
+            n < 0 || n > (length - 12) / 16 ||
+            length != 4 + n * 16 + 8) {
+        goto end;
+    }
+    for (i = 0; i < n; i++) {
+        reader_read(in, entry.type, 4);
+        entry.offset = reader_i64(in);
+        entry.length = reader_i32(in);
+        if (    entry.offset < 8 || entry.length < 0 ||
+                entry.offset + 12 + entry.length > offset) {
+            arrfree(index);
+            goto end;
+        }
+        arrput(index, entry);
+    }
+end:
+    reader_seek(in, start);
+    return index;
+}
+
+enum {
+    BLOCK_RAW = 0,
+    BLOCK_RLE = 1,
+};
+
+#define BLOCK_NB_VOXELS (TILE_SIZE * TILE_SIZE * TILE_SIZE)
+// Max size of an encoded BLRL or BL32 chunk of the tiles size.
+#define BLOCK_MAX_SIZE (5 + BLOCK_NB_VOXELS * 4)
+// Chunk type of the blocks we save.
+#define BLOCK_CHUNK_TYPE (TILE_SIZE == 16 ? "BLRL" : "BL32")
+
+// Return the size of the blocks of a chunk type, or 0 if it is not a
+// block chunk.
+static int get_block_chunk_size(const char type[4])
+{
+    if (strncmp(type, "BL16", 4) == 0) return 16;
+    if (strncmp(type, "BLRL", 4) == 0) return 16;
+    if (strncmp(type, "BL32", 4) == 0) return 32;
+    return 0;
+}
+
+static const char *get_block_chunk_type(const block_hash_t *data)
+{
+    if (data->png) return "BL16";
+    return data->block_size == 32 ? "BL32" : "BLRL";
+}
+
+/*
+ * Encode a block voxels into a BLRL chunk data, using a run length
+ * encoding, or the raw voxels if it would be smaller.
+ *
+ * Parameters:
+ *   voxels - The tile voxels, or NULL for a uniform tile.
+ *   value  - The voxels value if the tile is uniform.
+ *   out    - Receive the encoded data, must be at least BLOCK_MAX_SIZE.
+ *
+ * Return:
+ *   The size of the encoded data.
+ */
+static int block_encode(const uint8_t (*voxels)[4], const uint8_t value[4],
+                        uint8_t *out)
+{
+    int i, n, size = 5;
+    uint16_t run;
+    uint32_t crc;
+    uint8_t uniform[BLOCK_NB_VOXELS][4];
+
+    if (!voxels) {
+        for (i = 0; i < BLOCK_NB_VOXELS; i++)
+            memcpy(uniform[i], value, 4);
+        voxels = uniform;
+    }
+    crc = XXH32(voxels, BLOCK_NB_VOXELS * 4, 0);
+    memcpy(out, &crc, 4);
+    out[4] = BLOCK_RLE;
+    for (i = 0; i < BLOCK_NB_VOXELS; i += n) {
+        for (n = 1; i + n < BLOCK_NB_VOXELS; n++) {
+            if (memcmp(voxels[i + n], voxels[i], 4) != 0) break;
+        }
+        if (size + 6 > BLOCK_MAX_SIZE) {
+            // The run length would be bigger than the raw data.
+            out[4] = BLOCK_RAW;
+            memcpy(out + 5, voxels, BLOCK_NB_VOXELS * 4);
+            return BLOCK_MAX_SIZE;
+        }
+        run = n;
+        memcpy(out + size, &run, 2);
+        memcpy(out + size + 2, voxels[i], 4);
+        size += 6;
+    }
+    return size;
+}
+
+/*
+ * Decode a BLRL or BL32 chunk data into the block voxels.
+ *
+ * Parameters:
+ *   data   - The chunk data.
+ *   size   - The chunk data size.
+ *   n      - Number of voxels of the block.
+ *   voxels - Receive the voxels.
+ *
+ * Return:
+ *   0 on success, -1 if the data is invalid.
+ */
+static int block_decode(const uint8_t *data, int size, int n,
+                        uint8_t (*voxels)[4])
+{
+    int i = 0, pos = 5;
+    uint16_t run;
+    uint32_t crc;
+
+    if (size < 5) return -1;
+    memcpy(&crc, data, 4);
+    if (data[4] == BLOCK_RAW) {
+        if (size != 5 + n * 4) return -1;
+        memcpy(voxels, data + 5, n * 4);
+        i = n;
+    } else if (data[4] == BLOCK_RLE) {
+        for (; pos + 6 <= size; pos += 6) {
+            memcpy(&run, data + pos, 2);
+            if (run == 0 || i + run > n) return -1;
+            for (; run; run--, i++) memcpy(voxels[i], data + pos + 2, 4);
+        }
+        if (pos != size) return -1;
+    }
+    if (i != n) return -1;
+    if (XXH32(voxels, n * 4, 0) != crc) return -1;
+    return 0;
+}
+
+/*
+ * Blocks already in the last saved file, so that we can save again into
+ * the same file by only appending the new blocks (see the JRNL chunk).
+ * Only accessed by the save task, or by the main thread when no save is
+ * running.
+ */
+static struct {
+    char            *path;
+    long            size;       // Size of the file after the last save.
+    long            full_size;  // Size after the last full save or load.
+    index_entry_t   *entries;   // Chunks of the blocks in the file.
+    block_hash_t    *blocks;    // Blocks indices, by tile data uid.
+} g_journal = {};
+
+static void journal_reset(const char *path)
+{
+    block_hash_t *data, *data_tmp;
+    HASH_ITER(hh, g_journal.blocks, data, data_tmp) {
+        HASH_DEL(g_journal.blocks, data);
+        free(data);
+    }
+    free(g_journal.path);
+    g_journal.path = path ? strdup(path) : NULL;
+    g_journal.size = 0;
+    g_journal.full_size = 0;
+    arrfree(g_journal.entries);
+}
+
+static void journal_add_block(uint64_t uid, int index)
+{
+    block_hash_t *data;
+    if (!uid) return;
+    HASH_FIND(hh, g_journal.blocks, &uid, sizeof(uid), data);
+    if (data) return;
+    data = calloc(1, sizeof(*data));
+    data->uid = uid;
+    data->index = index;
+    HASH_ADD(hh, g_journal.blocks, uid, sizeof(data->uid), data);
+}
+
+/*
+ * Open a file to append a journal entry to it, if it is the file we saved
+ * last, unchanged since, and not too big compared to its compacted size.
+ */
+static FILE *journal_open(const char *path)
+{
+    FILE *out;
+    if (!g_journal.path || strcmp(g_journal.path, path) != 0) return NULL;
+    if (g_journal.size > 2 * g_journal.full_size) return NULL;
+    out = fopen(path, "r+b");
+    if (!out) return NULL;
+    if (    fseek(out, 0, SEEK_END) != 0 ||
+            ftell(out) != g_journal.size) {
+        fclose(out);
+        return NULL;
+    }
+    return out;
+}
+
+/*
+ * Find the last complete journal entry of a file, and where the valid
+ * data ends, in case an append got interrupted.
+ *
+ * Parameters:
+ *   in      - A file, positioned after the header.  The position is
+ *             restored.
+ *   journal - Receive the position of the last complete JRNL chunk, or -1.
+ *   end     - Receive the position after the last valid chunk.
+ */
+static void journal_find(reader_t *in, long *journal, long *end)
+{
+    long start = in->pos, pos = start, size = in->size, entry = -1;
+    char type[4];
+    int32_t length;
+
+    *journal = -1;
+    while (pos + 8 <= size) {
+        reader_read(in, type, 4);
+        length = reader_i32(in);
+        if (length < 0 || pos + 12 + length > size) break;
+        if (strncmp(type, "JRNL", 4) == 0) entry = pos;
+        if (strncmp(type, "LIGH", 4) == 0 && entry != -1) {
+            *journal = entry;
+            entry = -1;
+        }
+        pos += 12 + length;
+        reader_seek(in, pos);
+    }
+    // Ignore an interrupted journal entry.
+    *end = entry != -1 ? entry : pos;
+    reader_seek(in, start);
+}
+
+typedef struct {
+    block_hash_t **blocks;
+    int nb;
+    int done;       // Number of blocks encoded so far.
+    int *progress;  // If set, receive the progress of the save in percent.
+} encode_ctx_t;
+
+// Encode a block on the jobs pool.
+static void encode_block_job(void *user, int i, int worker)
+{
+    encode_ctx_t *ctx = user;
+    block_hash_t *data = ctx->blocks[i];
+    int done;
+    uint8_t *block = jobs_get_scratch(BLOCK_MAX_SIZE + BLOCK_NB_VOXELS * 4);
+    uint8_t (*voxels)[4] = (void*)(block + BLOCK_MAX_SIZE);
+    uint8_t value[4];
+
+    if (volume_is_tile_uniform(data->volume, NULL, data->pos, value)) {
+        data->size = block_encode(NULL, value, block);
+    } else {
+        volume_get_tile_voxels(data->volume, NULL, data->pos, voxels);
+        data->size = block_encode(voxels, NULL, block);
+    }
+    data->buf = malloc(data->size);
+    memcpy(data->buf, block, data->size);
+    done = __atomic_add_fetch(&ctx->done, 1, __ATOMIC_RELAXED);
+    if (ctx->progress) {
+        __atomic_store_n(ctx->progress, done * 100 / (ctx->nb + 1),
+                         __ATOMIC_RELAXED);
+    }
+}
+
+// Test if a block has any visible voxel.
+static bool block_is_empty(const uint8_t (*voxels)[4], int n)
+{
+    int i;
+    for (i = 0; i < n; i++) {
+        if (voxels[i][3]) return false;
+    }
+    return true;
+}
+
+// Decode a block read from a BL16, BLRL or BL32 chunk on the jobs pool.
+static void decode_block_job(void *user, int i, int worker)
+{
+    block_hash_t *data = ((block_hash_t**)user)[i];
+    uint8_t *voxels;
+    void *v;
+    int w, h, bpp = 4, err = 0;
+    const int n = data->block_size * data->block_size * data->block_size;
+    const bool as_tile = data->block_size == TILE_SIZE;
+
+    if (!data->src) return;
+    v = as_tile ? jobs_get_scratch(n * 4) : calloc(1, n * 4);
+    if (data->png) {
+        voxels = img_read_from_mem((const char*)data->src, data->size,
+                                   &w, &h, &bpp);
+        if (voxels && w == 64 && h == 64 && bpp == 4)
+            memcpy(v, voxels, n * 4);
+        else
+            err = -1;
+        free(voxels);
+    } else {
+        err = block_decode(data->src, data->size, n, v);
+    }
+    // Keep the corrupted blocks empty, so that the indices of the
+    // following blocks stay valid.
+    if (err) {
+        LOG_W("Corrupted block %d", i);
+        memset(v, 0, n * 4);
+    }
+    if (!as_tile)
+        data->v = v;
+    else if (!block_is_empty((const void*)v, n))
+        data->tile = volume_tile_data_new((const void*)v);
+    data->src = NULL;
+    data->decoded = true;
+}
+
 static int get_material_idx(const image_t *img, const material_t *mat)
 {
     int i;
@@ -253,45 +678,65 @@ static const material_t *get_material(const image_t *img, int idx)
     return NULL;
 }
 
-void save_to_file(const image_t *img, const char *path)
+/*
+ * Write an image into a gox file.
+ *
+ * This doesn't access the gui or the graphics, so that we can call it from
+ * a background thread on a snapshot of the image.  The file is first
+ * written to a temporary file, that is then renamed, so that we never leave
+ * a partially written file.
+ *
+ * In append mode, if the file is the one we saved last, we only append the
+ * new blocks and a journal entry to it.  See the JRNL chunk.
+ *
+ * Parameters:
+ *   img        - The image to save.
+ *   rend       - Renderer with the light and render settings to save.
+ *   preview    - A 128x128 RGBA preview image.
+ *   path       - The file path.
+ *   append     - Allow to only append the changes to the file.
+ *   progress   - If set, receive the progress in percent.
+ */
+static int write_image(const image_t *img, const renderer_t *rend,
+                       const uint8_t *preview, const char *path,
+                       bool append, int *progress)
 {
     // XXX: remove all empty blocks before saving.
-    LOG_I("Save to %s", path);
     block_hash_t *blocks_table = NULL, *data, *data_tmp;
     layer_t *layer;
     chunk_t c;
-    int nb_blocks, index, size, bpos[3], material_idx;
+    int i, nb_blocks, index, size, bpos[3], material_idx;
     uint64_t uid;
     FILE *out;
-    uint8_t *png, *preview;
+    uint8_t *png;
     camera_t *camera;
     material_t *material;
     volume_iterator_t iter;
-
-    img = img ?: goxel.image;
-    out = fopen(path, "wb");
-    if (!out) {
-        LOG_E("Cannot save to %s: %s", path, strerror(errno));
-        return;
+    encode_ctx_t ctx = {.progress = progress};
+    char tmp_path[1024];
+    int first = 0; // Index of the first new block.
+    long file_size;
+    index_entry_t *chunks = NULL; // Index of the non block chunks.
+
+    out = append ? journal_open(path) : NULL;
+    if (out) {
+        first = arrlen(g_journal.entries);
+    } else {
+        append = false;
+        journal_reset(NULL);
+        snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", path);
+        out = fopen(tmp_path, "wb");
+        if (!out) {
+            LOG_E("Cannot save to %s: %s", path, strerror(errno));
+            return -1;
+        }
+        fwrite("GOX ", 4, 1, out);
+        write_int32(out, VERSION);
     }
-    fwrite("GOX ", 4, 1, out);
-    write_int32(out, VERSION);
-
-    // Write image info.
-    chunk_write_start(&c, out, "IMG ");
-    if (!box_is_null(img->box))
-        chunk_write_dict_value(&c, out, "box", &img->box, sizeof(img->box));
-    chunk_write_finish(&c, out);
-
-    preview = calloc(128 * 128, 4);
-    goxel_render_to_buf(preview, 128, 128, 4);
-    png = img_write_to_mem(preview, 128, 128, 4, &size);
-    chunk_write_all(out, "PREV", (char*)png, size);
-    free(preview);
-    free(png);
 
-    // Add all the blocks data into the hash table.
-    index = 0;
+    // Add all the blocks data into the hash table, reusing the blocks
+    // already in the file if we append to it.
+    index = first;
     DL_FOREACH(img->layers, layer) {
         iter = volume_get_iterator(layer->volume, VOLUME_ITER_TILES);
         while (volume_iter(&iter, bpos)) {
@@ -299,18 +744,58 @@ void save_to_file(const image_t *img, const char *path)
             HASH_FIND(hh, blocks_table, &uid, sizeof(uid), data);
             if (data) continue;
             data = calloc(1, sizeof(*data));
-            data->v = volume_get_tile_data(layer->volume, &iter, bpos, NULL);
-            assert(data->v);
+            data->volume = layer->volume;
+            memcpy(data->pos, bpos, sizeof(data->pos));
             data->uid = uid;
-            data->index = index++;
+            HASH_FIND(hh, g_journal.blocks, &uid, sizeof(uid), data_tmp);
+            data->index = data_tmp ? data_tmp->index : index++;
             HASH_ADD(hh, blocks_table, uid, sizeof(data->uid), data);
         }
     }
 
-    // Write all the blocks chunks.
+    if (!append) {
+        // Write image info.
+        chunk_write_start(&c, out, "IMG ");
+        if (!box_is_null(img->box))
+            chunk_write_dict_value(&c, out, "box", &img->box,
+                                   sizeof(img->box));
+        chunk_write_finish(&c, out);
+        index_add(&chunks, out, "IMG ", c.length);
+        png = img_write_to_mem(preview, 128, 128, 4, &size);
+        chunk_write_all(out, "PREV", (char*)png, size);
+        index_add(&chunks, out, "PREV", size);
+        free(png);
+    }
+
+    // Encode all the new blocks in parallel, and write them in index order.
+    ctx.nb = index - first;
+    ctx.blocks = calloc(ctx.nb, sizeof(*ctx.blocks));
     HASH_ITER(hh, blocks_table, data, data_tmp) {
-        png = img_write_to_mem((uint8_t*)data->v, 64, 64, 4, &size);
-        chunk_write_all(out, "BL16", (char*)png, size);
+        if (data->index >= first) ctx.blocks[data->index - first] = data;
+    }
+    jobs_parallel_for(ctx.nb, encode_block_job, &ctx);
+    for (i = 0; i < ctx.nb; i++) {
+        data = ctx.blocks[i];
+        chunk_write_all(out, BLOCK_CHUNK_TYPE, (char*)data->buf, data->size);
+        index_add(&g_journal.entries, out, BLOCK_CHUNK_TYPE, data->size);
+        journal_add_block(data->uid, data->index);
+        free(data->buf);
+        data->buf = NULL;
+    }
+    free(ctx.blocks);
+
+    if (append) {
+        // Start the journal entry, with all the non block chunks.
+        chunk_write_all(out, "JRNL", NULL, 0);
+        chunk_write_start(&c, out, "IMG ");
+        if (!box_is_null(img->box))
+            chunk_write_dict_value(&c, out, "box", &img->box,
+                                   sizeof(img->box));
+        chunk_write_finish(&c, out);
+        index_add(&chunks, out, "IMG ", c.length);
+        png = img_write_to_mem(preview, 128, 128, 4, &size);
+        chunk_write_all(out, "PREV", (char*)png, size);
+        index_add(&chunks, out, "PREV", size);
         free(png);
     }
 
@@ -328,6 +813,7 @@ void save_to_file(const image_t *img, const char *path)
         chunk_write_dict_value(&c, out, "emission", &material->emission,
                                sizeof(material->emission));
         chunk_write_finish(&c, out);
+        index_add(&chunks, out, "MATE", c.length);
     }
 
     // Write all the layers.
@@ -384,6 +870,7 @@ void save_to_file(const image_t *img, const char *path)
                                sizeof(layer->visible));
 
         chunk_write_finish(&c, out);
+        index_add(&chunks, out, "LAYR", c.length);
     }
 
     // Write all the cameras.
@@ -405,30 +892,168 @@ void save_to_file(const image_t *img, const char *path)
             chunk_write_dict_value(&c, out, "active", NULL, 0);
 
         chunk_write_finish(&c, out);
+        index_add(&chunks, out, "CAMR", c.length);
     }
 
     // Write the light settings.
     chunk_write_start(&c, out, "LIGH");
-    chunk_write_dict_value(&c, out, "pitch", &goxel.rend.light.pitch,
-                           sizeof(goxel.rend.light.pitch));
-    chunk_write_dict_value(&c, out, "yaw", &goxel.rend.light.yaw,
-                           sizeof(goxel.rend.light.yaw));
-    chunk_write_dict_value(&c, out, "intensity", &goxel.rend.light.intensity,
-                           sizeof(goxel.rend.light.intensity));
-    chunk_write_dict_value(&c, out, "fixed", &goxel.rend.light.fixed,
-                           sizeof(goxel.rend.light.fixed));
-    chunk_write_dict_value(&c, out, "ambient", &goxel.rend.settings.ambient,
-                           sizeof(goxel.rend.settings.ambient));
-    chunk_write_dict_value(&c, out, "shadow", &goxel.rend.settings.shadow,
-                           sizeof(goxel.rend.settings.shadow));
+    chunk_write_dict_value(&c, out, "pitch", &rend->light.pitch,
+                           sizeof(rend->light.pitch));
+    chunk_write_dict_value(&c, out, "yaw", &rend->light.yaw,
+                           sizeof(rend->light.yaw));
+    chunk_write_dict_value(&c, out, "intensity", &rend->light.intensity,
+                           sizeof(rend->light.intensity));
+    chunk_write_dict_value(&c, out, "fixed", &rend->light.fixed,
+                           sizeof(rend->light.fixed));
+    chunk_write_dict_value(&c, out, "ambient", &rend->settings.ambient,
+                           sizeof(rend->settings.ambient));
+    chunk_write_dict_value(&c, out, "shadow", &rend->settings.shadow,
+                           sizeof(rend->settings.shadow));
     chunk_write_finish(&c, out);
+    index_add(&chunks, out, "LIGH", c.length);
+
+    write_index(out, g_journal.entries, chunks);
+    arrfree(chunks);
 
     HASH_ITER(hh, blocks_table, data, data_tmp) {
         HASH_DEL(blocks_table, data);
         free(data);
     }
 
-    fclose(out);
+    file_size = ftell(out);
+    if (fclose(out) != 0) {
+        LOG_E("Cannot save to %s: %s", path, strerror(errno));
+        if (!append) remove(tmp_path);
+        journal_reset(NULL);
+        return -1;
+    }
+    if (!append) {
+        // Windows rename doesn't replace existing files.
+        if (DEFINED(WIN32)) remove(path);
+        if (rename(tmp_path, path) != 0) {
+            LOG_E("Cannot save to %s: %s", path, strerror(errno));
+            remove(tmp_path);
+            return -1;
+        }
+        free(g_journal.path);
+        g_journal.path = strdup(path);
+        g_journal.full_size = file_size;
+    }
+    g_journal.size = file_size;
+    return 0;
+}
+
+void save_to_file(const image_t *img, const char *path)
+{
+    uint8_t *preview;
+
+    LOG_I("Save to %s", path);
+    img = img ?: goxel.image;
+    preview = calloc(128 * 128, 4);
+    goxel_render_to_buf(preview, 128, 128, 4);
+    write_image(img, &goxel.rend, preview, path, false, NULL);
+    free(preview);
+}
+
+// Background save task.
+typedef struct {
+    const image_t *src;     // The saved image, only used as an identifier.
+    image_t     *image;     // Snapshot of the image.
+    uint64_t    key;        // Key of the image at the time of the snapshot.
+    renderer_t  rend;
+    uint8_t     *preview;
+    char        *path;
+    bool        append;
+    int         progress;
+    int         err;
+    int         done;
+} save_task_t;
+
+static save_task_t *g_save_task = NULL;
+
+static void save_task_run(void *user)
+{
+    save_task_t *task = user;
+    task->err = write_image(task->image, &task->rend, task->preview,
+                            task->path, task->append, &task->progress);
+    __atomic_store_n(&task->done, 1, __ATOMIC_RELEASE);
+}
+
+/*
+ * Function: save_to_file_async
+ * Save an image in the background.
+ *
+ * The image is copied (the volumes are copy on write, so this is cheap),
+ * and the copy is written by a background thread, so that we can keep
+ * editing the image in the meantime.  Only the preview is rendered
+ * immediately.  Call <save_update> to finish the save.
+ *
+ * Parameters:
+ *   img    - The image to save.
+ *   path   - The file path.
+ *   append - If we saved the same file last, only append the changes to
+ *            it.  Otherwise the file is compacted.
+ */
+void save_to_file_async(const image_t *img, const char *path, bool append)
+{
+    save_task_t *task;
+
+    save_update(true); // Only one save at a time.
+    // The streaming layers tiles are saved in their own files.
+    image_flush_streams(img);
+    LOG_I("Save to %s", path);
+    task = calloc(1, sizeof(*task));
+    task->src = img;
+    task->image = image_copy(img);
+    task->key = image_get_key(img);
+    task->rend = goxel.rend;
+    task->path = strdup(path);
+    task->append = append;
+    task->preview = calloc(128 * 128, 4);
+    goxel_render_to_buf(task->preview, 128, 128, 4);
+    g_save_task = task;
+    jobs_async(save_task_run, task);
+}
+
+/*
+ * Function: save_get_progress
+ * Return the progress of the background save in percent, or -1 if there is
+ * no background save running.
+ */
+int save_get_progress(void)
+{
+    if (!g_save_task) return -1;
+    return __atomic_load_n(&g_save_task->progress, __ATOMIC_RELAXED);
+}
+
+/*
+ * Function: save_update
+ * Finish the background save if it is done.
+ *
+ * Parameters:
+ *   wait - If set, block until the background save is done.
+ */
+void save_update(bool wait)
+{
+    save_task_t *task = g_save_task;
+
+    if (!task) return;
+    if (!wait && !__atomic_load_n(&task->done, __ATOMIC_ACQUIRE)) return;
+    while (!__atomic_load_n(&task->done, __ATOMIC_ACQUIRE)) {}
+    g_save_task = NULL;
+    if (task->err) {
+        gui_alert(_("Error"), _("Cannot save the file"));
+    } else {
+        if (task->src == goxel.image) goxel.image->saved_key = task->key;
+        sys_on_saved(task->path);
+        goxel_add_recent_file(task->path);
+        thumbnail_invalidate(task->path);
+    }
+    // The snapshot can own textures, so we delete it on the main thread.
+    image_delete(task->image);
+    free(task->preview);
+    free(task->path);
+    free(task);
 }
 
 // Iter info of a gox file, without actually reading it.
@@ -438,19 +1063,46 @@ int gox_iter_infos(const char *path,
                                    void *value, void *user),
                    void *user)
 {
-    FILE *in;
+    reader_t reader, *in = &reader;
     chunk_t c;
     uint8_t *png;
     char magic[4];
+    long journal, end;
+    index_entry_t *index;
+    int i;
 
-    in = fopen(path, "rb");
+    if (reader_open(in, path) != 0) {
+        LOG_W("Cannot get gox file info");
+        return -1;
+    }
 
-    if (fread(magic, 4, 1, in) != 1) goto error;
+    if (!reader_read(in, magic, 4)) goto error;
     if (strncmp(magic, "GOX ", 4) != 0) goto error;
-    read_int32(in);
+    reader_skip(in, 4);
+
+    // With an index we can directly read the preview.
+    index = read_index(in);
+    for (i = 0; i < arrlen(index); i++) {
+        if (strncmp(index[i].type, "PREV", 4) != 0) continue;
+        png = calloc(1, index[i].length);
+        reader_seek(in, index[i].offset + 8);
+        if (reader_read(in, png, index[i].length))
+            callback("PREV", index[i].length, png, user);
+        free(png);
+        break;
+    }
+    if (index) {
+        arrfree(index);
+        reader_close(in);
+        return 0;
+    }
 
-    while (chunk_read_start(&c, in)) {
-        if (strncmp(c.type, "BL16", 4) == 0) break;
+    // Only the last journal entry preview is up to date.
+    journal_find(in, &journal, &end);
+    if (journal != -1) reader_seek(in, journal);
+
+    while (in->pos < end && chunk_read_start(&c, in)) {
+        if (get_block_chunk_size(c.type)) break;
         if (strncmp(c.type, "LAYR", 4) == 0) break;
         if (strncmp(c.type, "PREV", 4) == 0) {
             png = calloc(1, c.length);
@@ -463,26 +1115,86 @@ int gox_iter_infos(const char *path,
         }
         chunk_read_finish(&c, in);
     }
-    fclose(in);
+    reader_close(in);
     return 0;
 
 error:
-    fclose(in);
+    reader_close(in);
     LOG_W("Cannot get gox file info");
     return -1;
 }
 
 
-static block_hash_t *hash_find_at(block_hash_t *hash, int index)
+/*
+ * Decode in parallel all the blocks used by a layer chunk.
+ *
+ * The blocks not located yet (when we load from the index) are located
+ * first, so that we never decode the blocks no layer uses anymore.  The
+ * file position is restored.
+ */
+static void decode_layer_blocks(reader_t *in, const chunk_t *layer,
+                                block_hash_t **blocks)
 {
-    int i;
-    for (i = 0; i < index; i++) {
-        hash = hash->hh.next;
+    size_t pos = in->pos;
+    chunk_t c = *layer;
+    int i, nb, index;
+    bool decode = false;
+    block_hash_t *data;
+
+    nb = chunk_read_int32(&c, in, __LINE__);
+    for (i = 0; i < nb; i++) {
+        index = chunk_read_int32(&c, in, __LINE__);
+        chunk_read(&c, in, NULL, 16, __LINE__);
+        if (index < 0 || index >= arrlen(blocks)) continue;
+        data = blocks[index];
+        if (data->decoded || data->src) continue;
+        // The index entries have been checked to be inside the file.
+        data->src = in->data + data->offset + 8;
     }
-    return hash;
+    for (i = 0; i < arrlen(blocks); i++) {
+        if (blocks[i]->src) decode = true;
+    }
+    if (decode) jobs_parallel_for(arrlen(blocks), decode_block_job, blocks);
+    reader_seek(in, pos);
 }
 
 
+/*
+ * Add a decoded block to a layer volume.  The blocks that match a tile
+ * share their data with all the layers that use them, so we don't copy or
+ * compact the voxels again.
+ */
+static void add_layer_block(volume_t *volume, const block_hash_t *data,
+                            int x, int y, int z)
+{
+    const int pos[3] = {x, y, z};
+    const int n = data->block_size;
+    uint8_t (*voxels)[4];
+    volume_t *tmp;
+
+    if (n != TILE_SIZE) {
+        volume_blit(volume, data->v, x, y, z, n, n, n, NULL);
+        return;
+    }
+    if (x % n == 0 && y % n == 0 && z % n == 0) {
+        if (data->tile)
+            volume_set_tile_data(volume, pos, data->tile);
+        else
+            volume_clear_tile(volume, NULL, pos);
+        return;
+    }
+    // Not aligned to the tiles (version 1 files).
+    voxels = calloc(n * n * n, 4);
+    if (data->tile) {
+        tmp = volume_new();
+        volume_set_tile_data(tmp, (int[]){0, 0, 0}, data->tile);
+        volume_get_tile_voxels(tmp, NULL, (int[]){0, 0, 0}, voxels);
+        volume_delete(tmp);
+    }
+    volume_blit(volume, (const uint8_t*)voxels, x, y, z, n, n, n, NULL);
+    free(voxels);
+}
+
 // Ugly macro that check dict key/value and copy them if needed.
 #define DICT_CPY(key, dst) ({ \
     bool r = false; \
@@ -500,29 +1212,40 @@ static block_hash_t *hash_find_at(block_hash_t *hash, int index)
 int load_from_file(const char *path, bool replace)
 {
     layer_t *layer, *layer_tmp;
-    block_hash_t *blocks_table = NULL, *data, *data_tmp;
-    FILE *in;
+    block_hash_t **blocks = NULL, *data;
+    reader_t reader, *in = &reader;
     char magic[4] = {};
-    uint8_t *voxel_data;
     int nb_blocks;
-    int w, h, bpp;
-    uint8_t *png;
     chunk_t c;
-    int i, index, version, x, y, z, material_idx = 0;
+    int i, index, version, x, y, z, n, material_idx = 0;
     int  dict_value_size;
     char dict_key[256];
     char dict_value[256];
-    uint64_t uid = 1;
     int aabb[2][3];
     camera_t *camera, *camera_tmp;
     material_t *mat, *mat_tmp;
+    const void *asset_data;
+    int asset_size;
+    long journal, end;
+    uint64_t uid;
+    index_entry_t *file_index, entry;
+    int chunk_idx, ret = 0;
+    bool skip, use_journal = replace && !str_startswith(path, "asset://");
 
-    in = fopen(path, "rb");
-    if (!in) return -1;
+    // Make sure we are not saving while we update the journal.
+    save_update(true);
+
+    if (str_startswith(path, "asset://")) {
+        asset_data = assets_get(path, &asset_size);
+        if (!asset_data) return -1;
+        reader_open_mem(in, asset_data, asset_size);
+    } else {
+        if (reader_open(in, path) != 0) return -1;
+    }
 
-    if (fread(magic, 4, 1, in) != 1) goto error;
+    if (!reader_read(in, magic, 4)) goto error;
     if (strncmp(magic, "GOX ", 4) != 0) goto error;
-    version = read_int32(in);
+    version = reader_i32(in);
     if (version > VERSION) {
         LOG_W("Cannot open gox file version %d", version);
         goto error;
@@ -551,22 +1274,52 @@ int load_from_file(const char *path, bool replace)
         memset(&goxel.image->box, 0, sizeof(goxel.image->box));
     }
 
-    while (chunk_read_start(&c, in)) {
-        if (strncmp(c.type, "BL16", 4) == 0) {
-            png = calloc(1, c.length);
-            chunk_read(&c, in, (char*)png, c.length, __LINE__);
-            bpp = 4;
-            voxel_data = img_read_from_mem((void*)png, c.length, &w, &h, &bpp);
-            assert(w == 64 && h == 64 && bpp == 4);
-            data = calloc(1, sizeof(*data));
-            data->v = calloc(1, 64 * 64 * 4);
-            memcpy(data->v, voxel_data, 64 * 64 * 4);
-            data->uid = ++uid;
-            HASH_ADD(hh, blocks_table, uid, sizeof(data->uid), data);
-            free(voxel_data);
-            free(png);
+    if (use_journal) journal_reset(path);
 
+    // With an index, we only read the chunks it lists, and the blocks
+    // when a layer uses them.  Otherwise, if the file has journal entries,
+    // only the chunks of the last one are valid, except for the blocks.
+    file_index = read_index(in);
+    if (file_index) {
+        journal = -1;
+        end = in->size;
+    } else {
+        journal_find(in, &journal, &end);
+    }
+    for (i = 0; i < arrlen(file_index); i++) {
+        if (!get_block_chunk_size(file_index[i].type)) continue;
+        data = calloc(1, sizeof(*data));
+        data->size = file_index[i].length;
+        data->png = strncmp(file_index[i].type, "BL16", 4) == 0;
+        data->block_size = get_block_chunk_size(file_index[i].type);
+        data->offset = file_index[i].offset;
+        arrput(blocks, data);
+    }
+
+    for (chunk_idx = 0; ; chunk_idx++) {
+        if (file_index) {
+            if (chunk_idx >= arrlen(file_index)) break;
+            if (get_block_chunk_size(file_index[chunk_idx].type)) continue;
+            reader_seek(in, file_index[chunk_idx].offset);
+        }
+        if (in->pos >= end || !chunk_read_start(&c, in)) break;
+        skip = (long)in->pos - 8 < journal;
+        if (get_block_chunk_size(c.type)) {
+            // Only read the data for now, the blocks are decoded in
+            // parallel before the first layer.
+            data = calloc(1, sizeof(*data));
+            data->size = c.length;
+            data->png = strncmp(c.type, "BL16", 4) == 0;
+            data->block_size = get_block_chunk_size(c.type);
+            data->offset = in->pos - 8;
+            data->src = chunk_read_bytes(&c, in, c.length, __LINE__);
+            arrput(blocks, data);
+
+        } else if (skip) {
+            // Chunk replaced by a later journal entry.
+            chunk_read(&c, in, NULL, c.length, __LINE__);
         } else if (strncmp(c.type, "LAYR", 4) == 0) {
+            decode_layer_blocks(in, &c, blocks);
             layer = image_add_layer(goxel.image, NULL);
             nb_blocks = chunk_read_int32(&c, in, __LINE__);
             assert(nb_blocks >= 0);
@@ -580,9 +1333,19 @@ int load_from_file(const char *path, bool replace)
                     x -= 8; y -= 8; z -= 8;
                 }
                 chunk_read_int32(&c, in, __LINE__);
-                data = hash_find_at(blocks_table, index);
-                assert(data);
-                volume_blit(layer->volume, data->v, x, y, z, 16, 16, 16, NULL);
+                if (index >= arrlen(blocks)) {
+                    LOG_W("Invalid block index %d", index);
+                    continue;
+                }
+                data = blocks[index];
+                n = data->block_size;
+                add_layer_block(layer->volume, data, x, y, z);
+                // We can only reuse the blocks that map to a single tile.
+                if (use_journal && n == TILE_SIZE) {
+                    volume_get_tile_data(layer->volume, NULL,
+                                         (int[]){x, y, z}, &uid);
+                    journal_add_block(uid, index);
+                }
             }
             while ((chunk_read_dict_value(&c, in, dict_key, dict_value,
                                           &dict_value_size, __LINE__))) {
@@ -592,7 +1355,8 @@ int load_from_file(const char *path, bool replace)
                 DICT_CPY("mat", layer->mat);
 
                 if (strcmp(dict_key, "img-path") == 0) {
-                    layer->image = texture_new_image(dict_value, TF_NEAREST);
+                    layer->image = texture_new_image(
+                            dict_value, TF_NEAREST | TF_MIPMAP);
                 }
 
                 typeof(layer->id) id = 0;
@@ -664,19 +1428,39 @@ int load_from_file(const char *path, bool replace)
         chunk_read_finish(&c, in);
     }
 
-    // Free the block hash table.  We do not delete the block data because
-    // they have been used by the volumes.
-    HASH_ITER(hh, blocks_table, data, data_tmp) {
-        HASH_DEL(blocks_table, data);
-        free(data->v);
-        free(data);
+    arrfree(file_index);
+    if (in->error) {
+        LOG_E("Error reading %s", path);
+        ret = -1;
     }
+    for (i = 0; use_journal && i < arrlen(blocks); i++) {
+        entry = (index_entry_t){.offset = blocks[i]->offset,
+                                .length = blocks[i]->size};
+        memcpy(entry.type, get_block_chunk_type(blocks[i]), 4);
+        arrput(g_journal.entries, entry);
+    }
+
+    // Free the blocks.  The tiles data stay used by the layers.
+    for (i = 0; i < arrlen(blocks); i++) {
+        free(blocks[i]->buf);
+        free(blocks[i]->v);
+        if (blocks[i]->tile) volume_tile_data_release(blocks[i]->tile);
+        free(blocks[i]);
+    }
+    arrfree(blocks);
 
     if (replace) {
         goxel.image->path = strdup(path);
         goxel.image->saved_key = image_get_key(goxel.image);
     }
-    fclose(in);
+    if (use_journal) {
+        // Don't append after an interrupted journal entry, or to a file we
+        // could not fully read.
+        g_journal.size = in->size;
+        g_journal.full_size = g_journal.size;
+        if (end != g_journal.size || ret) journal_reset(NULL);
+    }
+    reader_close(in);
 
     // Add a default camera if there is none.
     if (!goxel.image->cameras) {
@@ -701,12 +1485,13 @@ int load_from_file(const char *path, bool replace)
     // Update plane, snap mask not to confuse people.
     plane_from_vectors(goxel.plane, goxel.image->box[3],
                        VEC(1, 0, 0), VEC(0, 1, 0));
+    image_dedup(goxel.image);
     image_history_push(goxel.image);
 
-    return 0;
+    return ret;
 
 error:
-    fclose(in);
+    reader_close(in);
     return -1;
 }
 
@@ -732,6 +1517,7 @@ static void a_open(void)
     get_default_save_path(default_save_path, sizeof(default_save_path));
     path = sys_open_file_dialog("Open", default_save_path, filters, "gox");
     if (!path) return;
+    image_flush_streams(goxel.image);
     image_delete(goxel.image);
     goxel.image = image_new();
     load_from_file(path, true);
@@ -756,10 +1542,7 @@ static void a_save_as(void)
         free(goxel.image->path);
         goxel.image->path = strdup(path);
     }
-    save_to_file(goxel.image, goxel.image->path);
-    goxel.image->saved_key = image_get_key(goxel.image);
-    sys_on_saved(path);
-    goxel_add_recent_file(path);
+    save_to_file_async(goxel.image, goxel.image->path, false);
 }
 
 ACTION_REGISTER(ACTION_save_as,
@@ -781,10 +1564,7 @@ static void a_save(void)
         free(goxel.image->path);
         goxel.image->path = strdup(path);
     }
-    save_to_file(goxel.image, goxel.image->path);
-    goxel.image->saved_key = image_get_key(goxel.image);
-    sys_on_saved(path);
-    goxel_add_recent_file(path);
+    save_to_file_async(goxel.image, goxel.image->path, true);
 }
 
 ACTION_REGISTER(ACTION_save,
@@ -19,81 +19,97 @@
 #include "goxel.h"
 #include "file_format.h"
 
+#include <ctype.h>
+
 // For the zlib decompression.
 #include "stb_image.h"
 
-#define READ(type, file) \
-    ({ type v; size_t r = fread(&v, sizeof(v), 1, file); (void)r; v;})
-
 #define raise(msg) do { \
         LOG_E(msg); \
         goto error; \
     } while (0)
 
-static int read_uint16(FILE *file)
+// Read a big endian uint16.
+static int read_uint16(reader_t *file)
 {
     uint8_t data[2];
-    int r;
-    r = fread(data, 2, 1, file);
-    if (r != 1) return 0; // XXX: need to properly check for errors.
+    reader_read(file, data, 2);
     return (data[0] << 8) | data[1];
 }
 
-static int get_file_remaining_size(FILE *file)
+// Entry of the table of the palettes colors by name.
+typedef struct {
+    UT_hash_handle  hh;
+    char            name[256];  // Lower case.
+    uint8_t         color[4];
+} color_entry_t;
+
+static void lower_name(const char *name, char out[256])
 {
-    long cur, end;
-    cur = ftell(file);
-    fseek(file, 0, SEEK_END);
-    end = ftell(file);
-    fseek(file, cur, SEEK_SET);
-    return end - cur;
+    int i;
+    for (i = 0; name[i] && i < 255; i++) out[i] = tolower(name[i]);
+    out[i] = '\0';
 }
 
-static void get_color(const char *name, uint8_t out[4],
-                      const palette_t *minetest_palette)
+// Add the colors of a palette to the table, without replacing the names
+// already in it.
+static void colors_table_add(color_entry_t **table, const palette_t *palette)
 {
     int i;
-
-    // First search using the current palette.
-    for (i = 0; i < goxel.palette->size; i++) {
-        if (strcasecmp(goxel.palette->entries[i].name, name) == 0) {
-            memcpy(out, goxel.palette->entries[i].color, 4);
-            return;
-        }
+    char name[256];
+    color_entry_t *entry;
+
+    for (i = 0; palette && i < palette->size; i++) {
+        lower_name(palette->entries[i].name, name);
+        HASH_FIND_STR(*table, name, entry);
+        if (entry) continue;
+        entry = calloc(1, sizeof(*entry));
+        memcpy(entry->name, name, sizeof(name));
+        memcpy(entry->color, palette->entries[i].color, 4);
+        HASH_ADD_STR(*table, name, entry);
     }
+}
 
-    // Try minetest palette next.
-    for (i = 0; i < minetest_palette->size; i++) {
-        if (strcasecmp(minetest_palette->entries[i].name, name) == 0) {
-            memcpy(out, minetest_palette->entries[i].color, 4);
-            return;
-        }
+static void colors_table_free(color_entry_t **table)
+{
+    color_entry_t *entry, *tmp;
+    HASH_ITER(hh, *table, entry, tmp) {
+        HASH_DEL(*table, entry);
+        free(entry);
     }
+}
 
-    // Fallback to white.
-    LOG_I("Cannot fine color for '%s'", name);
-    out[0] = 255;
-    out[1] = 255;
-    out[2] = 255;
-    out[3] = 255;
+// Search the color of a node name, or return false.
+static bool get_color(color_entry_t *table, const char *name, uint8_t out[4])
+{
+    char key[256];
+    color_entry_t *entry;
+
+    lower_name(name, key);
+    HASH_FIND_STR(table, key, entry);
+    if (!entry) return false;
+    memcpy(out, entry->color, 4);
+    return true;
 }
 
 static int mts_import(const file_format_t *format, image_t *image,
                       const char *path)
 {
-    FILE *file;
+    reader_t reader, *file = &reader;
     char magic[4];
-    int r, version, w, h, d, x, y, z, n_strings, len, i, size, c, pos[3];
-    uint8_t color[4], (*palette)[4];
-    char string[512], *buf, *data;
+    const int N = TILE_SIZE;
+    int version, w, h, d, x, y, z, y0, n, n_strings, len, i, size, c;
+    int nb_missing = 0;
+    uint8_t (*palette)[4] = NULL, *slab, *out;
+    char string[512], *data = NULL;
     const uint8_t *ptr;
     layer_t *layer;
-    volume_iterator_t iter = {0};
     const palette_t *minetest_palette = NULL;
+    color_entry_t *colors = NULL;
 
-    file = fopen(path, "rb");
-    r = fread(magic, 1, 4, file);
-    if (r != 4 || strncmp(magic, "MTSM ", 4) != 0) raise("Invalid magic");
+    if (reader_open(file, path) != 0) return -1;
+    if (!reader_read(file, magic, 4) || strncmp(magic, "MTSM ", 4) != 0)
+        raise("Invalid magic");
 
     version = read_uint16(file);
     w = read_uint16(file);
@@ -102,60 +118,78 @@ static int mts_import(const file_format_t *format, image_t *image,
     LOG_I("Minetest file version %d, size = %dx%dx%d", version, w, h, d);
 
     // Skip the layer probability values.
-    fseek(file, h, SEEK_CUR);
+    reader_skip(file, h);
     n_strings = read_uint16(file);
     LOG_D("n_strings = %d", n_strings);
 
     // Generate the palette to use for the indices, based on the Minetest
     // palette.
-    DL_FOREACH(goxel.palettes, minetest_palette) {
+    DL_FOREACH(goxel_get_palettes(), minetest_palette) {
         if (strcmp(minetest_palette->name, "Minetest") == 0)
             break;
     }
-    // assert(minetest_palette);
+    // Search using the current palette first, then the minetest palette.
+    colors_table_add(&colors, goxel.palette);
+    colors_table_add(&colors, minetest_palette);
     palette = calloc(n_strings, sizeof(*palette));
     for (i = 0; i < n_strings; i++) {
         len = read_uint16(file);
         if (len >= sizeof(string)) raise("String name too long");
-        r = fread(string, len, 1, file);
-        if (r != 1) raise("Error reading file");
+        if (!reader_read(file, string, len)) raise("Error reading file");
         string[len] = '\0';
         if (strcasecmp(string, "air") == 0) continue;
-        get_color(string, palette[i], minetest_palette);
+        if (get_color(colors, string, palette[i])) continue;
+        // Fallback to white.
+        LOG_D("Cannot find color for '%s'", string);
+        memset(palette[i], 255, 4);
+        nb_missing++;
     }
+    if (nb_missing) LOG_I("Cannot find %d node colors", nb_missing);
 
-    // Uncompress the data.
-    size = get_file_remaining_size(file);
-    buf = malloc(size);
-    r = fread(buf, size, 1, file);
-    if (r != 1) raise("Error reading file");
-    data = stbi_zlib_decode_malloc(buf, size, &size);
-    free(buf);
+    // Uncompress the data, directly from the file content.
+    if (file->error) raise("Error reading file");
+    size = reader_remaining(file);
+    data = stbi_zlib_decode_malloc(
+            reader_read_bytes(file, size), size, &size);
+    if (!data || size < w * h * d * 2) raise("Error reading file");
 
     layer = image_add_layer(image, NULL);
 
-    for (z = 0; z < d; z++)
-    for (y = 0; y < h; y++)
-    for (x = 0; x < w; x++) {
-        pos[0] = x;
-        pos[1] = z;
-        pos[2] = y;
-
-        ptr = (const uint8_t*)(data + (z * w * h + y * w + x) * 2);
-        c = ((int)ptr[0] << 8) | (int)ptr[1];
-
-        if (c >= n_strings) continue;
-        memcpy(color, palette[c], 4);
-        volume_set_at(layer->volume, &iter, pos, color);
+    // Fill the volume one slab of tiles at a time.  The schematic uses Y
+    // up, we use Z up.
+    slab = malloc(w * d * N * 4);
+    for (y0 = 0; y0 < h; y0 += N) {
+        n = min(N, h - y0);
+        for (y = y0; y < y0 + n; y++)
+        for (z = 0; z < d; z++) {
+            ptr = (const uint8_t*)(data + (z * w * h + y * w) * 2);
+            out = slab + ((y - y0) * w * d + z * w) * 4;
+            for (x = 0; x < w; x++, ptr += 2, out += 4) {
+                c = ((int)ptr[0] << 8) | (int)ptr[1];
+                if (c < n_strings)
+                    memcpy(out, palette[c], 4);
+                else
+                    memset(out, 0, 4);
+            }
+        }
+        volume_set_span(layer->volume,
+                        (const int[2][3]){{0, 0, y0}, {w, d, y0 + n}},
+                        slab, NULL);
     }
+    free(slab);
 
     free(data);
     free(palette);
+    colors_table_free(&colors);
+    reader_close(file);
 
     return 0;
 
 error:
-    fclose(file);
+    free(data);
+    free(palette);
+    colors_table_free(&colors);
+    reader_close(file);
     return -1;
 }
 
@@ -19,30 +19,21 @@
 #include "goxel.h"
 #include "file_format.h"
 
-// XXX: this function has to be rewritten.
 static int png_export(const image_t *img, const char *path, int w, int h)
 {
-    if (!goxel.graphics_initialized) {
-        goxel_create_graphics();
-    }
-
-    uint8_t *buf;
     int bpp = img->export_transparent_background ? 4 : 3;
     if (!path) return -1;
     LOG_I("Exporting to file %s", path);
-    buf = calloc(w * h, bpp);
-    goxel_render_to_buf(buf, w, h, bpp);
-    img_write(buf, w, h, bpp, path);
-    free(buf);
-    return 0;
+    return goxel_render_to_file(path, w, h, bpp);
 }
 
 static void export_gui(file_format_t *format)
 {
-    int maxsize, i;
+    int i;
+    // The image is rendered in tiles, so we are not limited by the
+    // maximum texture size.
+    const int maxsize = 1 << 16;
 
-    GL(glGetIntegerv(GL_MAX_TEXTURE_SIZE, &maxsize));
-    maxsize /= 2; // Because png export already double it.
     goxel.show_export_viewport = true;
     gui_group_begin(NULL);
     gui_checkbox(_("Size"), &goxel.image->export_custom_size, NULL);
@@ -69,8 +60,7 @@ static void export_gui(file_format_t *format)
 static int export_as_png(const file_format_t *format, const image_t *img,
                          const char *path)
 {
-    png_export(img, path, img->export_width, img->export_height);
-    return 0;
+    return png_export(img, path, img->export_width, img->export_height);
 }
 
 FILE_FORMAT_REGISTER(png,
@@ -19,46 +19,109 @@
 #include "goxel.h"
 #include "file_format.h"
 
+static struct {
+    bool separate_files; // Save one png file per z slice.
+} g_export_options = {};
+
+// Return the first tile boundary strictly after x.
+static int next_tile_boundary(int x)
+{
+    return (int)floor((float)x / TILE_SIZE + 1) * TILE_SIZE;
+}
+
+// Save each z slice into its own file, reading the volume one layer of
+// tiles at a time.
+static int export_slices_files(const volume_t *volume, const char *path,
+                               const int aabb[2][3])
+{
+    int w, h, z, z1, aabb_band[2][3], base_len;
+    uint8_t *buf;
+    char slice_path[1024];
+    const char *ext;
+
+    w = aabb[1][0] - aabb[0][0];
+    h = aabb[1][1] - aabb[0][1];
+    // The slices are saved as <path without extension>_XXXX.png.
+    ext = strrchr(path, '.');
+    base_len = ext ? (int)(ext - path) : (int)strlen(path);
+    buf = malloc((size_t)w * h * TILE_SIZE * 4);
+    memcpy(aabb_band, aabb, sizeof(aabb_band));
+    for (z = aabb[0][2]; z < aabb[1][2]; z = z1) {
+        z1 = min(next_tile_boundary(z), aabb[1][2]);
+        aabb_band[0][2] = z;
+        aabb_band[1][2] = z1;
+        volume_get_span(volume, aabb_band, buf, NULL);
+        for (; z < z1; z++) {
+            snprintf(slice_path, sizeof(slice_path), "%.*s_%04d.png",
+                     base_len, path, z - aabb[0][2]);
+            img_write(buf + (size_t)(z - aabb_band[0][2]) * w * h * 4,
+                      w, h, 4, slice_path);
+        }
+    }
+    free(buf);
+    return 0;
+}
+
+// Save all the slices side by side in a single image, writing one layer of
+// tiles worth of rows at a time.
+static int export_slices_atlas(const volume_t *volume, const char *path,
+                               const int aabb[2][3])
+{
+    int w, h, d, y, y1, aabb_band[2][3], stride[2];
+    uint8_t *buf;
+    img_writer_t *writer;
+
+    w = aabb[1][0] - aabb[0][0];
+    h = aabb[1][1] - aabb[0][1];
+    d = aabb[1][2] - aabb[0][2];
+    writer = img_writer_open(path, w * d, h, 4);
+    if (!writer) return -1;
+    // Row y of the image contains all the slices side by side.
+    stride[0] = w * d * 4;
+    stride[1] = w * 4;
+    buf = malloc((size_t)stride[0] * TILE_SIZE);
+    memcpy(aabb_band, aabb, sizeof(aabb_band));
+    for (y = aabb[0][1]; y < aabb[1][1]; y = y1) {
+        y1 = min(next_tile_boundary(y), aabb[1][1]);
+        aabb_band[0][1] = y;
+        aabb_band[1][1] = y1;
+        volume_get_span(volume, aabb_band, buf, stride);
+        img_writer_write_rows(writer, buf, y1 - y);
+    }
+    free(buf);
+    return img_writer_close(writer);
+}
+
 static int export_as_png_slices(const file_format_t *format,
                                 const image_t *image, const char *path)
 {
     float box[4][4];
     const volume_t *volume;
-    int x, y, z, w, h, d, pos[3], start_pos[3];
-    uint8_t c[4];
-    uint8_t *img;
-    volume_iterator_t iter = {0};
+    int i, aabb[2][3];
 
     volume = goxel_get_layers_volume(image);
     mat4_copy(image->box, box);
     if (box_is_null(box)) volume_get_box(volume, true, box);
-    w = box[0][0] * 2;
-    h = box[1][1] * 2;
-    d = box[2][2] * 2;
-    start_pos[0] = box[3][0] - box[0][0];
-    start_pos[1] = box[3][1] - box[1][1];
-    start_pos[2] = box[3][2] - box[2][2];
-    img = calloc(w * h * d, 4);
-    for (z = 0; z < d; z++)
-    for (y = 0; y < h; y++)
-    for (x = 0; x < w; x++) {
-        pos[0] = x + start_pos[0];
-        pos[1] = y + start_pos[1];
-        pos[2] = z + start_pos[2];
-        volume_get_at(volume, &iter, pos, c);
-        img[(y * w * d + z * w + x) * 4 + 0] = c[0];
-        img[(y * w * d + z * w + x) * 4 + 1] = c[1];
-        img[(y * w * d + z * w + x) * 4 + 2] = c[2];
-        img[(y * w * d + z * w + x) * 4 + 3] = c[3];
+    for (i = 0; i < 3; i++) {
+        aabb[0][i] = box[3][i] - box[i][i];
+        aabb[1][i] = aabb[0][i] + (int)(box[i][i] * 2);
     }
-    img_write(img, w * d, h, 4, path);
-    free(img);
-    return 0;
+    if (g_export_options.separate_files)
+        return export_slices_files(volume, path, aabb);
+    return export_slices_atlas(volume, path, aabb);
+}
+
+static void export_gui(file_format_t *format)
+{
+    gui_checkbox(_("Separate Files"), &g_export_options.separate_files,
+                 _("Save each slice into its own file"));
 }
 
 FILE_FORMAT_REGISTER(png_slices,
     .name = "png slices",
     .exts = {"*.png"},
     .exts_desc = "png",
+    .export_gui = export_gui,
     .export_func = export_as_png_slices,
+    .thread_safe = true,
 )
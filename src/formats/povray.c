@@ -22,17 +22,64 @@
 #include "file_format.h"
 #include "utils/mustache.h"
 
+#include <errno.h>
+
+static struct {
+    bool merge; // Merge the runs of same color voxels into boxes.
+} g_export_options = {
+    .merge = true,
+};
+
+// Value of the voxels template tag, replaced by the streamed voxels.
+#define VOXELS_MARK "<voxels>"
+
+// Write the voxels of a tile, optionally merging the runs along x.
+static void write_tile(FILE *file, const int tile_pos[3],
+                       const uint8_t (*voxels)[4], bool merge)
+{
+    int x, y, z, len;
+    const uint8_t *v;
+    const int n = TILE_SIZE;
+
+    for (z = 0; z < n; z++)
+    for (y = 0; y < n; y++)
+    for (x = 0; x < n; x += len) {
+        v = voxels[x + y * n + z * n * n];
+        len = 1;
+        if (v[3] < 127) continue;
+        while (merge && x + len < n &&
+               voxels[x + len + y * n + z * n * n][3] >= 127 &&
+               memcmp(voxels[x + len + y * n + z * n * n], v, 3) == 0) {
+            len++;
+        }
+        if (len == 1) {
+            fprintf(file, "    Vox(<%d, %d, %d>, <%d, %d, %d>)\n",
+                    tile_pos[0] + x, tile_pos[1] + y, tile_pos[2] + z,
+                    v[0], v[1], v[2]);
+        } else {
+            fprintf(file, "    VoxRun(<%d, %d, %d>, %d, <%d, %d, %d>)\n",
+                    tile_pos[0] + x, tile_pos[1] + y, tile_pos[2] + z,
+                    len, v[0], v[1], v[2]);
+        }
+    }
+}
+
+/*
+ * The template is only used for the header and footer around the voxels,
+ * that are directly streamed to the file while walking the tiles, so that
+ * we don't need to keep the whole scene text in memory.
+ */
 static int export_as_pov(const file_format_t *format, const image_t *image,
                          const char *path)
 {
     FILE *file;
     layer_t *layer;
     int size, p[3], w, h;
-    char *buf;
+    char *buf, *mark;
     const char *template;
-    uint8_t v[4];
+    uint8_t (*voxels)[4];
     float modelview[4][4], light_dir[3];
-    mustache_t *m, *m_cam, *m_light, *m_voxels, *m_voxel;
+    mustache_t *m, *m_cam, *m_light;
     camera_t camera = *image->active_camera;
     volume_iterator_t iter;
 
@@ -66,36 +113,54 @@ static int export_as_pov(const file_format_t *format, const image_t *image,
                      goxel.rend.settings.ambient);
     mustache_add_str(m_light, "point_at", "<%.1f, %.1f, %.1f + 1024>",
                      -light_dir[0], -light_dir[1], -light_dir[2]);
-
-    m_voxels = mustache_add_list(m, "voxels");
-    DL_FOREACH(image->layers, layer) {
-        iter = volume_get_iterator(layer->volume, VOLUME_ITER_VOXELS);
-        while (volume_iter(&iter, p)) {
-            volume_get_at(layer->volume, &iter, p, v);
-            if (v[3] < 127) continue;
-            m_voxel = mustache_add_dict(m_voxels, NULL);
-            mustache_add_str(m_voxel, "pos", "<%d, %d, %d>",
-                             p[0], p[1], p[2]);
-            mustache_add_str(m_voxel, "color", "<%d, %d, %d>",
-                             v[0], v[1], v[2]);
-        }
-    }
+    mustache_add_str(m, "voxels", VOXELS_MARK);
 
     size = mustache_render(m, template, NULL);
     buf = calloc(size + 1, 1);
     mustache_render(m, template, buf);
     mustache_free(m);
+    mark = strstr(buf, VOXELS_MARK);
+    assert(mark);
 
     file = fopen(path, "wb");
-    fwrite(buf, 1, size, file);
+    if (!file) {
+        LOG_E("Cannot save to %s: %s", path, strerror(errno));
+        free(buf);
+        return -1;
+    }
+    fwrite(buf, 1, mark - buf, file);
+
+    voxels = malloc(TILE_SIZE * TILE_SIZE * TILE_SIZE * sizeof(*voxels));
+    DL_FOREACH(image->layers, layer) {
+        iter = volume_get_iterator(layer->volume, VOLUME_ITER_TILES);
+        while (volume_iter(&iter, p)) {
+            volume_read(layer->volume, p,
+                        (int[]){TILE_SIZE, TILE_SIZE, TILE_SIZE},
+                        (uint8_t*)voxels);
+            write_tile(file, p, voxels, g_export_options.merge);
+        }
+    }
+    free(voxels);
+
+    // The tag is alone on its line, and each voxel ends its own line.
+    mark += strlen(VOXELS_MARK);
+    if (*mark == '\n') mark++;
+    fwrite(mark, 1, buf + size - mark, file);
     fclose(file);
     free(buf);
     return 0;
 }
 
+static void export_gui(file_format_t *format)
+{
+    gui_checkbox(_("Merge Voxels"), &g_export_options.merge,
+                 _("Merge the runs of same color voxels into boxes"));
+}
+
 FILE_FORMAT_REGISTER(povray,
     .name = "povray",
     .exts = {"*.povray"},
     .exts_desc = "povray",
+    .export_gui = export_gui,
     .export_func = export_as_pov,
 )
@@ -21,8 +21,8 @@
 
 // Load qubicle files.
 
-#define READ(type, file) \
-    ({ type v; size_t r = fread(&v, sizeof(v), 1, file); (void)r; v;})
+#define READ(type, reader) \
+    ({ type v; reader_read(reader, &v, sizeof(v)); v;})
 #define WRITE(type, v, file) \
     ({ type v_ = v; fwrite(&v_, sizeof(v_), 1, file);})
 
@@ -39,9 +39,10 @@ static void apply_orientation(int orientation, int pos[3])
 static int qubicle_import(const file_format_t *format, image_t *image,
                           const char *path)
 {
-    FILE *file;
+    reader_t reader, *file = &reader;
     int version, color_format, orientation, compression, vmask, mat_count;
-    int i, j, r, index, len, w, h, d, pos[3], vpos[3], x, y, z, bbox[2][3];
+    int i, j, index, len, w, h, d, pos[3], vpos[3], x, y, z, bbox[2][3];
+    int size[3];
     union {
         uint8_t v[4];
         uint32_t uint32;
@@ -52,9 +53,9 @@ static int qubicle_import(const file_format_t *format, image_t *image,
     const uint32_t CODEFLAG = 2;
     const uint32_t NEXTSLICEFLAG = 6;
     layer_t *layer;
-    volume_iterator_t iter = {0};
+    uint8_t (*cube)[4];
 
-    file = fopen(path, "rb");
+    if (reader_open(file, path) != 0) return -1;
     version = READ(uint32_t, file);
     (void)version;
     color_format = READ(uint32_t, file);
@@ -67,17 +68,20 @@ static int qubicle_import(const file_format_t *format, image_t *image,
 
     for (i = 0; i < mat_count; i++) {
         layer = image_add_layer(goxel.image, NULL);
-        iter = volume_get_accessor(layer->volume);
         memset(layer->name, 0, sizeof(layer->name));
         len = READ(uint8_t, file);
-        r = (int)fread(layer->name, len, 1, file);
-        (void)r;
+        reader_read(file, layer->name, len);
         w = READ(uint32_t, file);
         h = READ(uint32_t, file);
         d = READ(uint32_t, file);
         pos[0] = READ(int32_t, file);
         pos[1] = READ(int32_t, file);
         pos[2] = READ(int32_t, file);
+        if (file->error) goto error;
+        if (compression == 0 &&
+                (uint64_t)w * h * d * 4 > reader_remaining(file)) {
+            goto error;
+        }
 
         // Set the layer bounding box.
         vec3_set(bbox[0], pos[0], pos[1], pos[2]);
@@ -91,6 +95,16 @@ static int qubicle_import(const file_format_t *format, image_t *image,
         }
         bbox_from_aabb(layer->box, bbox);
 
+        // Decode the matrix into a dense block that we then blit into the
+        // layer volume all at once.
+        size[0] = bbox[1][0] - bbox[0][0];
+        size[1] = bbox[1][1] - bbox[0][1];
+        size[2] = bbox[1][2] - bbox[0][2];
+        cube = calloc((size_t)size[0] * size[1] * size[2], sizeof(*cube));
+#define CUBE_AT(p) cube[((p)[2] - bbox[0][2]) * size[0] * size[1] + \
+                        ((p)[1] - bbox[0][1]) * size[0] + \
+                        ((p)[0] - bbox[0][0])]
+
         if (compression == 0) {
             for (index = 0; index < w * h * d; index++) {
                 v.uint32 = READ(uint32_t, file);
@@ -100,12 +114,12 @@ static int qubicle_import(const file_format_t *format, image_t *image,
                 vpos[1] = pos[1] + (index % (w * h)) / w;
                 vpos[2] = pos[2] + index / (w * h);
                 apply_orientation(orientation, vpos);
-                volume_set_at(layer->volume, &iter, vpos, v.v);
+                memcpy(CUBE_AT(vpos), v.v, 4);
             }
         } else {
             for (z = 0; z < d; z++) {
                 index = 0;
-                while (true) {
+                while (!file->error) {
                     v.uint32 = READ(uint32_t, file);
                     if (v.uint32 == NEXTSLICEFLAG) {
                         break; // Next z.
@@ -116,22 +130,33 @@ static int qubicle_import(const file_format_t *format, image_t *image,
                         v.uint32 = READ(uint32_t, file);
                         v.a = v.a ? 255 : 0;
                     }
-                    for (j = 0; j < len; j++) {
+                    for (j = 0; j < len && index < w * h; j++, index++) {
                         x = index % w;
                         y = index / w;
                         v.a = v.a ? 255 : 0;
+                        if (!v.a) continue;
                         vpos[0] = pos[0] + x;
                         vpos[1] = pos[1] + y;
                         vpos[2] = pos[2] + z;
                         apply_orientation(orientation, vpos);
-                        volume_set_at(layer->volume, &iter, vpos, v.v);
-                        index++;
+                        memcpy(CUBE_AT(vpos), v.v, 4);
                     }
                 }
             }
         }
+#undef CUBE_AT
+        volume_blit(layer->volume, (uint8_t*)cube, bbox[0][0], bbox[0][1],
+                    bbox[0][2], size[0], size[1], size[2], NULL);
+        free(cube);
     }
+    if (file->error) goto error;
+    reader_close(file);
     return 0;
+
+error:
+    LOG_E("Cannot read qubicle file %s", path);
+    reader_close(file);
+    return -1;
 }
 
 static int qubicle_export(const file_format_t *format, const image_t *img,
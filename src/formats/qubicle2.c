@@ -29,6 +29,8 @@
 // For the zlib decompression.
 #include "stb_image.h"
 
+#include "../../ext_src/stb/stb_ds.h"
+
 #define raise(msg, ...) do { \
         LOG_E(msg, ##__VA_ARGS__); \
         goto error; \
@@ -40,15 +42,55 @@
 // Todo: add errors check.
 #define SKIP(file, size) fseek(file, size, SEEK_CUR)
 
-static int import_matrix(FILE *file);
-static int import_model(FILE *file);
-
-static int import_node(FILE *file)
+// A decoded tile.  The uniform tiles have no data.
+typedef struct {
+    int         pos[3];
+    tile_data_t *data;
+    uint8_t     color[4];
+} matrix_tile_t;
+
+// A matrix node, decoded after the whole file has been read.
+typedef struct {
+    volume_t    *volume;
+    int         size[3];
+    int         pos[3];
+    char        *comp_data;
+    int         comp_data_size;
+    matrix_tile_t *tiles;
+    int         err;
+} matrix_t;
+
+typedef struct {
+    image_t     *image;
+    matrix_t    *matrices;
+} ctx_t;
+
+// A tile of the slab being decoded.
+typedef struct {
+    uint8_t     (*voxels)[4];
+    int         nb;         // Number of voxels set.
+    bool        mixed;      // Set if the voxels don't all have the color.
+    uint8_t     color[4];
+} slot_t;
+
+// The tiles of a matrix at a given x position.  The data is stored by
+// columns of same x, so we only need one slab of tiles at a time.
+typedef struct {
+    int         x;          // Tile x position.
+    int         y, z;       // Position of the first tile.
+    int         ny, nz;     // Number of tiles.
+    slot_t      *slots;
+} slab_t;
+
+static int import_matrix(ctx_t *ctx, FILE *file, layer_t *layer);
+static int import_model(ctx_t *ctx, FILE *file);
+
+static int import_node(ctx_t *ctx, FILE *file)
 {
     int type, name_size, r;
     layer_t *layer;
 
-    layer = image_add_layer(goxel.image, NULL);
+    layer = image_add_layer(ctx->image, NULL);
     type = READ(int32_t, file);
     SKIP(file, 4);
     name_size = READ(uint32_t, file);
@@ -60,11 +102,11 @@ static int import_node(FILE *file)
 
     switch (type) {
     case 0:
-        r = import_matrix(file);
+        r = import_matrix(ctx, file, layer);
         if (r != 0) return r;
         break;
     case 1:
-        r = import_model(file);
+        r = import_model(ctx, file);
         if (r != 0) return r;
         break;
     default:
@@ -77,106 +119,217 @@ error:
     return -1;
 }
 
-static int import_model(FILE *file)
+static int import_model(ctx_t *ctx, FILE *file)
 {
     int i, child_count, r;
 
     SKIP(file, 36);
     child_count = READ(uint32_t, file);
     for (i = 0; i < child_count; i++) {
-        r = import_node(file);
+        r = import_node(ctx, file);
         if (r != 0) return r;
     }
     return 0;
 }
 
-static int AT(int x, int y, int z, int w, int h, int d)
+static void slab_flush(matrix_t *matrix, slab_t *slab)
+{
+    int i, n = TILE_SIZE * TILE_SIZE * TILE_SIZE;
+    slot_t *slot;
+    matrix_tile_t *tile;
+
+    for (i = 0; i < slab->ny * slab->nz; i++) {
+        slot = &slab->slots[i];
+        if (!slot->nb) continue;
+        tile = arraddnptr(matrix->tiles, 1);
+        tile->pos[0] = slab->x;
+        tile->pos[1] = slab->y + (i % slab->ny) * TILE_SIZE;
+        tile->pos[2] = slab->z + (i / slab->ny) * TILE_SIZE;
+        tile->data = NULL;
+        memcpy(tile->color, slot->color, 4);
+        if (slot->nb < n || slot->mixed)
+            tile->data = volume_tile_data_new((const void*)slot->voxels);
+        if (slot->voxels) memset(slot->voxels, 0, n * 4);
+        slot->nb = 0;
+        slot->mixed = false;
+    }
+}
+
+// Set a run of voxels of a column, from the position x, y, z (in goxel
+// coordinates) and up.
+static void slab_set(slab_t *slab, int x, int y, int z, int nb,
+                     const uint8_t c[4])
 {
-    // Qubicle uses Y up, we use Z up.
-    return y * (w * d) + z * w + (w - x - 1);
+    const int N = TILE_SIZE;
+    int i, n;
+    slot_t *slot;
+    uint8_t (*v)[4];
+
+    while (nb > 0) {
+        slot = &slab->slots[(z - slab->z) / N * slab->ny + (y - slab->y) / N];
+        n = min(nb, N - (z - slab->z) % N);
+        if (!slot->nb) memcpy(slot->color, c, 4);
+        if (memcmp(slot->color, c, 4) != 0) slot->mixed = true;
+        slot->nb += n;
+        if (!slot->voxels) slot->voxels = calloc(N * N * N, 4);
+        v = &slot->voxels[(x - slab->x) + (y - slab->y) % N * N +
+                          (z - slab->z) % N * N * N];
+        for (i = 0; i < n; i++) memcpy(v[i * N * N], c, 4);
+        z += n;
+        nb -= n;
+    }
 }
 
-static int import_matrix_data(const char *data, int data_size,
-                              uint8_t (*cube)[4], const int w, int h, int d)
+/*
+ * Decode the voxels of a matrix directly into tiles.  The data is a list of
+ * columns of voxels, each one compressed with a simple RLE.  Qubicle uses Y
+ * up, we use Z up.
+ */
+static void decode_matrix(void *user, int idx, int worker)
 {
+    matrix_t *matrix = &((matrix_t*)user)[idx];
+    const int N = TILE_SIZE;
+    const int w = matrix->size[0], h = matrix->size[1], d = matrix->size[2];
     uint16_t size;
-    int i, j, x, y, z, index = 0;
+    int i, x = 0, y, z = 0, gx, tile_x, data_size;
     uint8_t cmd[4], color[4];
-    const char *end = data + data_size;
-
-    while (data < end) {
+    char *buf;
+    const char *data, *end;
+    slab_t slab = {};
+
+    buf = stbi_zlib_decode_malloc(matrix->comp_data, matrix->comp_data_size,
+                                  &data_size);
+    if (!buf) {
+        matrix->err = -1;
+        return;
+    }
+    data = buf;
+    end = data + data_size;
+
+    // Tiles range in y and z.
+    slab.y = matrix->pos[2] & ~(N - 1);
+    slab.z = matrix->pos[1] & ~(N - 1);
+    slab.ny = (matrix->pos[2] + d - slab.y + N - 1) / N;
+    slab.nz = (matrix->pos[1] + h - slab.z + N - 1) / N;
+    slab.slots = calloc(slab.ny * slab.nz, sizeof(*slab.slots));
+    slab.x = (matrix->pos[0] + w - 1) & ~(N - 1);
+
+    while (data + 2 <= end && x < w) {
+        gx = matrix->pos[0] + w - x - 1;
+        tile_x = gx & ~(N - 1);
+        if (tile_x != slab.x) {
+            slab_flush(matrix, &slab);
+            slab.x = tile_x;
+        }
         y = 0;
         memcpy(&size, data, 2);
         data += 2;
-        for (i = 0;  i < size; i++) {
+        for (i = 0; i < size && data + 4 <= end; i++) {
             memcpy(cmd, data, 4);
             data += 4;
             if (cmd[3] == 2) { // RLE
+                if (data + 4 > end) break;
                 memcpy(color, data, 4);
                 data += 4;
                 if (color[3]) color[3] = 255;
-                for (j = 0; j < cmd[0]; j++) {
-                    x = index / d;
-                    z = index % d;
-                    memcpy(&cube[AT(x, y, z, w, h, d)], color, 4);
-                    y++;
+                if (color[3] && y < h) {
+                    slab_set(&slab, gx, matrix->pos[2] + z,
+                             matrix->pos[1] + y, min(cmd[0], h - y), color);
                 }
+                y += cmd[0];
                 i++;
             } else if (cmd[3] == 0) {
                 y++;
             } else {
-                if (cmd[3]) cmd[3] = 255;
-                x = index / d;
-                z = index % d;
-                memcpy(&cube[AT(x, y, z, w, h, d)], cmd, 4);
+                cmd[3] = 255;
+                if (y < h) {
+                    slab_set(&slab, gx, matrix->pos[2] + z,
+                             matrix->pos[1] + y, 1, cmd);
+                }
                 y++;
             }
         }
-        index++;
+        if (++z == d) {
+            z = 0;
+            x++;
+        }
     }
+    slab_flush(matrix, &slab);
 
-    return 0;
+    for (i = 0; i < slab.ny * slab.nz; i++) free(slab.slots[i].voxels);
+    free(slab.slots);
+    free(buf);
 }
 
-static int import_matrix(FILE *file)
+static int import_matrix(ctx_t *ctx, FILE *file, layer_t *layer)
 {
-    int size[3], pos[3];
     float pivot[3];
-    int r, comp_data_size, data_size;
-    char *comp_data, *data;
-    uint8_t (*cube)[4];
-
-    size[0] = READ(int32_t, file);
-    size[1] = READ(int32_t, file);
-    size[2] = READ(int32_t, file);
-    pos[0] = READ(int32_t, file);
-    pos[1] = READ(int32_t, file);
-    pos[2] = READ(int32_t, file);
+    int r;
+    matrix_t *matrix;
+
+    matrix = arraddnptr(ctx->matrices, 1);
+    memset(matrix, 0, sizeof(*matrix));
+    matrix->volume = layer->volume;
+    matrix->size[0] = READ(int32_t, file);
+    matrix->size[1] = READ(int32_t, file);
+    matrix->size[2] = READ(int32_t, file);
+    matrix->pos[0] = READ(int32_t, file);
+    matrix->pos[1] = READ(int32_t, file);
+    matrix->pos[2] = READ(int32_t, file);
     pivot[0] = READ(float, file);
     pivot[1] = READ(float, file);
     pivot[2] = READ(float, file);
     (void)pivot;
-    comp_data_size = READ(uint32_t, file);
-
-    comp_data = malloc(comp_data_size);
-    r = fread(comp_data, comp_data_size, 1, file);
-    if (r != 1) return -1;
+    matrix->comp_data_size = READ(uint32_t, file);
+    if (    matrix->size[0] <= 0 || matrix->size[1] <= 0 ||
+            matrix->size[2] <= 0)
+        raise("Invalid matrix size");
 
-    data = stbi_zlib_decode_malloc(comp_data, comp_data_size, &data_size);
-
-    cube = calloc(size[0] * size[1] * size[2], sizeof(*cube));
-    import_matrix_data(data, data_size, cube, size[0], size[1], size[2]);
+    matrix->comp_data = malloc(matrix->comp_data_size);
+    r = fread(matrix->comp_data, matrix->comp_data_size, 1, file);
+    if (r != 1) raise("Read file error");
+    return 0;
 
-    volume_blit(goxel.image->active_layer->volume, (uint8_t*)cube,
-              pos[0], pos[2], pos[1],
-              size[0], size[2], size[1], NULL);
+error:
+    return -1;
+}
 
-    free(cube);
+// Decode all the matrices in parallel, and write their tiles into the
+// layers.
+static int decode_matrices(ctx_t *ctx)
+{
+    int i, j, ret = 0;
+    matrix_t *matrix;
+
+    jobs_parallel_for(arrlen(ctx->matrices), decode_matrix, ctx->matrices);
+    for (i = 0; i < arrlen(ctx->matrices); i++) {
+        matrix = &ctx->matrices[i];
+        if (matrix->err) ret = -1;
+        for (j = 0; j < arrlen(matrix->tiles); j++) {
+            if (matrix->tiles[j].data) {
+                volume_set_tile_data(matrix->volume, matrix->tiles[j].pos,
+                                     matrix->tiles[j].data);
+                volume_tile_data_release(matrix->tiles[j].data);
+            } else {
+                volume_fill_tile(matrix->volume, NULL, matrix->tiles[j].pos,
+                                 matrix->tiles[j].color);
+            }
+        }
+    }
+    return ret;
+}
 
-    free(comp_data);
-    free(data);
+static void ctx_release(ctx_t *ctx)
+{
+    int i;
+    matrix_t *matrix;
 
-    return 0;
+    for (i = 0; i < arrlen(ctx->matrices); i++) {
+        matrix = &ctx->matrices[i];
+        arrfree(matrix->tiles);
+        free(matrix->comp_data);
+    }
+    arrfree(ctx->matrices);
 }
 
 static int qubicle2_import(const file_format_t *format, image_t *image,
@@ -187,10 +340,15 @@ static int qubicle2_import(const file_format_t *format, image_t *image,
     uint32_t prog_version;
     uint32_t file_version;
     int r, i, w, h, size;
+    ctx_t ctx = {.image = image};
 
     file = fopen(path, "rb");
+    if (!file) {
+        LOG_E("Cannot open %s", path);
+        return -1;
+    }
     r = fread(magic, 1, 4, file);
-    if (r != 1 || strncmp(magic, "QBCL ", 4) != 0) raise("Invalid magic");
+    if (r != 4 || strncmp(magic, "QBCL", 4) != 0) raise("Invalid magic");
     prog_version = READ(uint32_t, file);
     file_version = READ(uint32_t, file);
     LOG_I("Qubicle prog version: %d, file version: %d",
@@ -207,12 +365,15 @@ static int qubicle2_import(const file_format_t *format, image_t *image,
         SKIP(file, size);
     }
     SKIP(file, 16);
-    if (import_node(file)) raise("Cannot load file");
+    if (import_node(&ctx, file)) raise("Cannot load file");
+    if (decode_matrices(&ctx)) raise("Cannot decode file");
 
+    ctx_release(&ctx);
     fclose(file);
     return 0;
 
 error:
+    ctx_release(&ctx);
     fclose(file);
     return -1;
 }
@@ -222,4 +383,5 @@ FILE_FORMAT_REGISTER(qubicle,
     .exts = {"*.qbcl"},
     .exts_desc = "qubicle2",
     .import_func = qubicle2_import,
+    .thread_safe = true,
 )
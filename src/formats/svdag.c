@@ -0,0 +1,371 @@
+/* Goxel 3D voxels editor
+ *
+ * copyright (c) 2026 Guillaume Chereau <guillaume@noctua-software.com>
+ *
+ * Goxel is free software: you can redistribute it and/or modify it under the
+ * terms of the GNU General Public License as published by the Free Software
+ * Foundation, either version 3 of the License, or (at your option) any later
+ * version.
+
+ * Goxel is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+
+ * You should have received a copy of the GNU General Public License along with
+ * goxel.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "goxel.h"
+#include "file_format.h"
+#include <errno.h>
+
+#include "../../ext_src/stb/stb_ds.h"
+
+/*
+ * Sparse voxel DAG format.
+ *
+ * Each layer is stored as an octree where all the identical subtrees are
+ * merged, so that the repeated parts of a scene are only stored once.  The
+ * nodes are kept in a flat array of 32 bits words, that can be uploaded as
+ * is into a GPU buffer for ray tracing.  A node is made of:
+ *
+ *   header     The mask of the non empty children in the low 8 bits.
+ *   children   One word per bit set in the mask, in the bits order.
+ *
+ * The child i covers the octant (i & 1, (i >> 1) & 1, (i >> 2) & 1) of its
+ * parent.  For the nodes of 2x2x2 voxels, the children are indices in the
+ * colors table, for the others they are the offsets of the children nodes
+ * in the words array.  The children are always written before their
+ * parents.
+ *
+ * File layout, all the values are little endian:
+ *
+ *   char[4]    magic "SDAG"
+ *   uint32     version (1)
+ *   uint32     number of colors
+ *   uint8[4]   RGBA colors
+ *   uint32     number of words
+ *   uint32     words
+ *   uint32     number of layers
+ *   For each layer:
+ *     uint8    name length
+ *     char     name
+ *     int32[3] position of the root node
+ *     uint32   depth: the root node covers 2^depth voxels per side
+ *     uint32   offset of the root node, or 0xffffffff for an empty layer
+ */
+
+#define VERSION 1
+#define NO_NODE 0xffffffff
+#define MAX_DEPTH 20
+
+#define READ(type, reader) \
+    ({ type v; reader_read(reader, &v, sizeof(v)); v;})
+#define WRITE(type, v, file) \
+    ({ type v_ = v; fwrite(&v_, sizeof(v_), 1, file);})
+
+typedef struct {
+    UT_hash_handle  hh;
+    uint32_t        key[10]; // Level, header and children.
+    uint32_t        ofs;
+} node_hash_t;
+
+typedef struct {
+    UT_hash_handle  hh;
+    uint64_t        uid; // Tile data id.
+    uint32_t        ofs;
+} tile_hash_t;
+
+typedef struct {
+    UT_hash_handle  hh;
+    uint8_t         color[4];
+    uint32_t        index;
+} color_hash_t;
+
+typedef struct {
+    const volume_t      *volume;
+    volume_accessor_t   accessor;
+    uint32_t            *words;     // stb array.
+    color_hash_t        *colors;    // Colors table, in index order.
+    int                 nb_colors;
+    node_hash_t         *nodes;
+    tile_hash_t         *tiles;
+} dag_t;
+
+static uint32_t dag_add_color(dag_t *dag, const uint8_t v[4])
+{
+    color_hash_t *entry;
+    HASH_FIND(hh, dag->colors, v, 4, entry);
+    if (entry) return entry->index;
+    entry = calloc(1, sizeof(*entry));
+    memcpy(entry->color, v, 4);
+    entry->index = dag->nb_colors++;
+    HASH_ADD(hh, dag->colors, color, 4, entry);
+    return entry->index;
+}
+
+// Add a node to the words array, or return the offset of an identical node
+// of the same level already added.
+static uint32_t dag_add_node(dag_t *dag, int level, int mask,
+                             const uint32_t *children, int n)
+{
+    node_hash_t *node;
+    uint32_t key[10] = {level, mask};
+    int i;
+
+    memcpy(key + 2, children, n * sizeof(*children));
+    HASH_FIND(hh, dag->nodes, key, sizeof(key), node);
+    if (node) return node->ofs;
+    node = calloc(1, sizeof(*node));
+    memcpy(node->key, key, sizeof(key));
+    node->ofs = arrlen(dag->words);
+    HASH_ADD(hh, dag->nodes, key, sizeof(node->key), node);
+    arrput(dag->words, mask);
+    for (i = 0; i < n; i++) arrput(dag->words, children[i]);
+    return node->ofs;
+}
+
+// Build the subtree of 2^level voxels at a given position and return its
+// offset.  The nodes covering a whole tile are directly reused for all
+// the tiles sharing the same data, like the gox format blocks.
+static uint32_t dag_build(dag_t *dag, int level, const int pos[3])
+{
+    uint32_t children[8], ofs;
+    int i, n = 0, mask = 0, p[3];
+    const int half = 1 << (level - 1);
+    uint64_t uid;
+    uint8_t v[4];
+    tile_hash_t *tile;
+
+    if (level == TILE_BITS) {
+        volume_get_tile_data(dag->volume, NULL, pos, &uid);
+        if (!uid) return NO_NODE;
+        HASH_FIND(hh, dag->tiles, &uid, sizeof(uid), tile);
+        if (tile) return tile->ofs;
+    }
+
+    for (i = 0; i < 8; i++) {
+        p[0] = pos[0] + ((i >> 0) & 1) * half;
+        p[1] = pos[1] + ((i >> 1) & 1) * half;
+        p[2] = pos[2] + ((i >> 2) & 1) * half;
+        if (level == 1) {
+            volume_get_at(dag->volume, &dag->accessor, p, v);
+            if (!v[3]) continue;
+            ofs = dag_add_color(dag, v);
+        } else {
+            ofs = dag_build(dag, level - 1, p);
+            if (ofs == NO_NODE) continue;
+        }
+        children[n++] = ofs;
+        mask |= 1 << i;
+    }
+    ofs = mask ? dag_add_node(dag, level, mask, children, n) : NO_NODE;
+
+    if (level == TILE_BITS) {
+        tile = calloc(1, sizeof(*tile));
+        tile->uid = uid;
+        tile->ofs = ofs;
+        HASH_ADD(hh, dag->tiles, uid, sizeof(tile->uid), tile);
+    }
+    return ofs;
+}
+
+static int svdag_export(const file_format_t *format, const image_t *img,
+                        const char *path)
+{
+    FILE *file;
+    dag_t dag = {0};
+    layer_t *layer;
+    int i, count = 0, size, bbox[2][3];
+    int (*bboxes)[2][3], *depths;
+    uint32_t *roots;
+    color_hash_t *color, *color_tmp;
+    node_hash_t *node, *node_tmp;
+    tile_hash_t *tile, *tile_tmp;
+
+    file = fopen(path, "wb");
+    if (!file) {
+        LOG_E("Cannot save to %s: %s", path, strerror(errno));
+        return -1;
+    }
+
+    DL_COUNT(img->layers, layer, count);
+    bboxes = calloc(count, sizeof(*bboxes));
+    depths = calloc(count, sizeof(*depths));
+    roots = calloc(count, sizeof(*roots));
+
+    // Build all the layers first, so that they share the same nodes.
+    i = 0;
+    DL_FOREACH(img->layers, layer) {
+        roots[i] = NO_NODE;
+        depths[i] = TILE_BITS;
+        if (volume_get_bbox(layer->volume, bbox, false)) {
+            size = max(max(bbox[1][0] - bbox[0][0],
+                           bbox[1][1] - bbox[0][1]),
+                       bbox[1][2] - bbox[0][2]);
+            while ((1 << depths[i]) < size) depths[i]++;
+            dag.volume = layer->volume;
+            dag.accessor = volume_get_accessor(layer->volume);
+            roots[i] = dag_build(&dag, depths[i], bbox[0]);
+        }
+        memcpy(bboxes[i], bbox, sizeof(bbox));
+        i++;
+    }
+
+    fwrite("SDAG", 4, 1, file);
+    WRITE(uint32_t, VERSION, file);
+    WRITE(uint32_t, dag.nb_colors, file);
+    // The hash keeps the insertion order, so the colors are in index order.
+    HASH_ITER(hh, dag.colors, color, color_tmp) {
+        fwrite(color->color, 4, 1, file);
+    }
+    WRITE(uint32_t, arrlen(dag.words), file);
+    fwrite(dag.words, sizeof(*dag.words), arrlen(dag.words), file);
+    WRITE(uint32_t, count, file);
+    i = 0;
+    DL_FOREACH(img->layers, layer) {
+        WRITE(uint8_t, strlen(layer->name), file);
+        fwrite(layer->name, strlen(layer->name), 1, file);
+        WRITE(int32_t, bboxes[i][0][0], file);
+        WRITE(int32_t, bboxes[i][0][1], file);
+        WRITE(int32_t, bboxes[i][0][2], file);
+        WRITE(uint32_t, depths[i], file);
+        WRITE(uint32_t, roots[i], file);
+        i++;
+    }
+    fclose(file);
+
+    LOG_I("Exported %d colors, %d words", dag.nb_colors,
+          (int)arrlen(dag.words));
+    HASH_ITER(hh, dag.colors, color, color_tmp) {
+        HASH_DEL(dag.colors, color);
+        free(color);
+    }
+    HASH_ITER(hh, dag.nodes, node, node_tmp) {
+        HASH_DEL(dag.nodes, node);
+        free(node);
+    }
+    HASH_ITER(hh, dag.tiles, tile, tile_tmp) {
+        HASH_DEL(dag.tiles, tile);
+        free(tile);
+    }
+    arrfree(dag.words);
+    free(bboxes);
+    free(depths);
+    free(roots);
+    return 0;
+}
+
+typedef struct {
+    const uint32_t  *words;
+    uint32_t        nb_words;
+    const uint8_t   (*colors)[4];
+    uint32_t        nb_colors;
+    volume_t        *volume;
+    volume_accessor_t accessor;
+} dag_reader_t;
+
+// Decode a node into the volume.  Return -1 if the node is invalid.
+static int dag_decode(dag_reader_t *dag, int level, uint32_t ofs,
+                      const int pos[3])
+{
+    uint32_t mask, child;
+    int i, n = 0, p[3];
+    const int half = 1 << (level - 1);
+
+    if (ofs >= dag->nb_words) return -1;
+    mask = dag->words[ofs];
+    if (mask > 255 || ofs + 1 + __builtin_popcount(mask) > dag->nb_words)
+        return -1;
+
+    for (i = 0; i < 8; i++) {
+        if (!(mask & (1 << i))) continue;
+        child = dag->words[ofs + 1 + n++];
+        p[0] = pos[0] + ((i >> 0) & 1) * half;
+        p[1] = pos[1] + ((i >> 1) & 1) * half;
+        p[2] = pos[2] + ((i >> 2) & 1) * half;
+        if (level == 1) {
+            if (child >= dag->nb_colors) return -1;
+            volume_set_at(dag->volume, &dag->accessor, p, dag->colors[child]);
+            continue;
+        }
+        // Children are always before their parent.
+        if (child >= ofs) return -1;
+        if (dag_decode(dag, level - 1, child, p) != 0) return -1;
+    }
+    return 0;
+}
+
+static int svdag_import(const file_format_t *format, image_t *image,
+                        const char *path)
+{
+    reader_t reader, *file = &reader;
+    char magic[4];
+    int i, len, pos[3];
+    uint32_t nb_layers, depth, root;
+    uint32_t *words = NULL;
+    uint8_t (*colors)[4] = NULL;
+    dag_reader_t dag = {0};
+    layer_t *layer;
+
+    if (reader_open(file, path) != 0) return -1;
+    if (!reader_read(file, magic, 4) || strncmp(magic, "SDAG", 4) != 0)
+        goto error;
+    if (READ(uint32_t, file) != VERSION) goto error;
+
+    dag.nb_colors = READ(uint32_t, file);
+    if (file->error || (uint64_t)dag.nb_colors * 4 > reader_remaining(file))
+        goto error;
+    colors = malloc(dag.nb_colors * 4 + 1);
+    reader_read(file, colors, dag.nb_colors * 4);
+
+    dag.nb_words = READ(uint32_t, file);
+    if (file->error || (uint64_t)dag.nb_words * 4 > reader_remaining(file))
+        goto error;
+    words = malloc(dag.nb_words * 4 + 1);
+    reader_read(file, words, dag.nb_words * 4);
+    dag.words = words;
+    dag.colors = colors;
+
+    nb_layers = READ(uint32_t, file);
+    for (i = 0; i < nb_layers && !file->error; i++) {
+        layer = image_add_layer(image, NULL);
+        memset(layer->name, 0, sizeof(layer->name));
+        len = READ(uint8_t, file);
+        reader_read(file, layer->name, len);
+        pos[0] = READ(int32_t, file);
+        pos[1] = READ(int32_t, file);
+        pos[2] = READ(int32_t, file);
+        depth = READ(uint32_t, file);
+        root = READ(uint32_t, file);
+        if (file->error) goto error;
+        if (root == NO_NODE) continue;
+        if (depth < 1 || depth > MAX_DEPTH) goto error;
+        dag.volume = layer->volume;
+        dag.accessor = volume_get_accessor(layer->volume);
+        if (dag_decode(&dag, depth, root, pos) != 0) goto error;
+    }
+    if (file->error) goto error;
+
+    free(words);
+    free(colors);
+    reader_close(file);
+    return 0;
+
+error:
+    LOG_E("Cannot read sparse voxel DAG file %s", path);
+    free(words);
+    free(colors);
+    reader_close(file);
+    return -1;
+}
+
+FILE_FORMAT_REGISTER(svdag,
+    .name = "svdag",
+    .exts = {"*.svdag"},
+    .exts_desc = "sparse voxel DAG",
+    .import_func = svdag_import,
+    .export_func = svdag_export,
+    .thread_safe = true,
+)
@@ -20,68 +20,262 @@
 #include "file_format.h"
 #include <errno.h>
 
-#define CHECK(x) do { \
-        if (!(x)) { \
-            ret = -1; \
-            goto end; \
-        } \
-    } while(0)
+#include "../../ext_src/stb/stb_ds.h"
+
+// The files are parsed in chunks of about this size, in parallel.
+#define CHUNK_SIZE (1 << 20)
+
+#define TILE_NB_VOXELS (TILE_SIZE * TILE_SIZE * TILE_SIZE)
+
+typedef struct {
+    int     pos[3];
+    uint8_t color[4];
+} txt_voxel_t;
+
+typedef struct {
+    const char  *start;
+    const char  *end;
+    txt_voxel_t *voxels; // stb array.
+    bool        error;
+} txt_chunk_t;
+
+// List of the voxels that go into a given tile.
+typedef struct {
+    UT_hash_handle  hh;
+    int             pos[3];
+    int             nb;
+    int             ofs;
+} txt_tile_t;
+
+typedef struct {
+    const txt_voxel_t   **voxels; // Sorted by tile, in file order.
+    txt_tile_t          *tiles;
+} txt_import_ctx_t;
+
+static inline bool is_space(char c)
+{
+    return c == ' ' || c == '\t';
+}
+
+static inline int hex_value(char c)
+{
+    if (c >= '0' && c <= '9') return c - '0';
+    if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+    return -1;
+}
+
+static bool parse_int(const char **p, const char *end, int *out)
+{
+    const char *s = *p;
+    bool neg = false;
+    unsigned int v = 0;
+
+    while (s < end && is_space(*s)) s++;
+    if (s < end && (*s == '-' || *s == '+')) neg = *s++ == '-';
+    if (s == end || *s < '0' || *s > '9') return false;
+    while (s < end && *s >= '0' && *s <= '9')
+        v = v * 10 + (*s++ - '0');
+    *out = neg ? -(int)v : (int)v;
+    *p = s;
+    return true;
+}
+
+static bool parse_color(const char **p, const char *end, uint8_t out[4])
+{
+    const char *s = *p;
+    int i, h, l;
+
+    while (s < end && is_space(*s)) s++;
+    if (end - s < 6) return false;
+    for (i = 0; i < 3; i++) {
+        h = hex_value(s[i * 2 + 0]);
+        l = hex_value(s[i * 2 + 1]);
+        if (h < 0 || l < 0) return false;
+        out[i] = h * 16 + l;
+    }
+    out[3] = 255;
+    *p = s + 6;
+    return true;
+}
+
+// Parse all the lines starting in a chunk.
+static void parse_chunk_job(void *user, int i, int worker)
+{
+    txt_chunk_t *chunk = (txt_chunk_t*)user + i;
+    const char *p = chunk->start, *end;
+    txt_voxel_t v;
+
+    while (p < chunk->end) {
+        end = memchr(p, '\n', chunk->end - p);
+        if (!end) end = chunk->end;
+        while (p < end && is_space(*p)) p++;
+        // Skip empty lines and comments.
+        if (p == end || *p == '\r' || *p == '#') {
+            p = end + 1;
+            continue;
+        }
+        if (    !parse_int(&p, end, &v.pos[0]) ||
+                !parse_int(&p, end, &v.pos[1]) ||
+                !parse_int(&p, end, &v.pos[2]) ||
+                !parse_color(&p, end, v.color)) {
+            chunk->error = true;
+            return;
+        }
+        arrput(chunk->voxels, v);
+        p = end + 1;
+    }
+}
+
+static bool set_tile_voxels(void *user, const int pos[3],
+                            uint8_t (*voxels)[4])
+{
+    const txt_import_ctx_t *ctx = user;
+    const txt_tile_t *tile;
+    const txt_voxel_t *v;
+    int i, idx;
+
+    HASH_FIND(hh, ctx->tiles, pos, sizeof(tile->pos), tile);
+    for (i = 0; i < tile->nb; i++) {
+        v = ctx->voxels[tile->ofs + i];
+        idx = (v->pos[0] - pos[0]) +
+              (v->pos[1] - pos[1]) * TILE_SIZE +
+              (v->pos[2] - pos[2]) * TILE_SIZE * TILE_SIZE;
+        memcpy(voxels[idx], v->color, 4);
+    }
+    return true;
+}
+
+static txt_tile_t *get_tile(txt_tile_t **tiles, txt_tile_t *last,
+                            const int vpos[3])
+{
+    int i, pos[3];
+    txt_tile_t *tile;
+
+    for (i = 0; i < 3; i++) pos[i] = vpos[i] & ~(TILE_SIZE - 1);
+    // Point clouds are usually sorted, so most voxels are in the same tile
+    // as the previous one.
+    if (last && memcmp(last->pos, pos, sizeof(pos)) == 0) return last;
+    HASH_FIND(hh, *tiles, pos, sizeof(pos), tile);
+    if (!tile) {
+        tile = calloc(1, sizeof(*tile));
+        memcpy(tile->pos, pos, sizeof(pos));
+        HASH_ADD(hh, *tiles, pos, sizeof(tile->pos), tile);
+    }
+    return tile;
+}
 
 static int import_as_txt(const file_format_t *format, image_t *image,
                          const char *path)
 {
-    FILE *file;
-    char line[2048];
-    layer_t *layer;
-    volume_iterator_t iter = {0};
-    int pos[3];
-    unsigned int c[4];
-    char *token;
-    int ret = 0;
+    reader_t reader;
+    const char *data;
+    int i, j, k, nb_chunks, nb_tiles, ofs, ret = 0;
+    size_t nb_voxels = 0;
+    txt_chunk_t *chunks;
+    txt_tile_t *tile, *tmp;
+    txt_import_ctx_t ctx = {0};
+    int (*tiles_pos)[3];
 
     LOG_I("Reading text file. One line per voxel. Format should be: X Y Z RRGGBB");
-    file = fopen(path, "r");
-
-    //Checks if file is empty
-    if (file == NULL) {
+    if (reader_open(&reader, path) != 0) {
         LOG_E("Can not open file for reading: %s", path);
-        return 1;
+        return -1;
     }
 
-    layer = image->active_layer;
+    // Split the file into chunks that start at the beginning of a line.
+    data = (const char*)reader.data;
+    nb_chunks = reader.size / CHUNK_SIZE + 1;
+    chunks = calloc(nb_chunks, sizeof(*chunks));
+    for (i = 0; i < nb_chunks; i++) {
+        chunks[i].start = i ? chunks[i - 1].end : data;
+        chunks[i].end = data + reader.size * (i + 1) / nb_chunks;
+        if (chunks[i].end < chunks[i].start)
+            chunks[i].end = chunks[i].start;
+        while (chunks[i].end < data + reader.size &&
+               chunks[i].end[-1] != '\n')
+            chunks[i].end++;
+    }
+    jobs_parallel_for(nb_chunks, parse_chunk_job, chunks);
 
-    while (fgets(line, 2048, file)) {
-        // if empty line or comment, skip
-        if (line[0] == '\n' || line[0] == '\0')
-            continue;
+    for (i = 0; i < nb_chunks; i++) {
+        if (chunks[i].error) {
+            LOG_E("Invalid text file %s", path);
+            ret = -1;
+            goto end;
+        }
+        nb_voxels += arrlen(chunks[i].voxels);
+    }
 
-        CHECK(token = strtok(line, " ")); // get first token (X)
-        if (strcmp(token, "#") == 0)
-            continue;
-        pos[0] = atoi(token);
-        CHECK(token = strtok(NULL, " ")); // get second token (Y)
-        pos[1] = atoi(token);
-        CHECK(token = strtok(NULL, " ")); // get third token (Z)
-        pos[2] = atoi(token);
-        CHECK(token = strtok(NULL, " ")); // get forth token (RRGGBB)
-        CHECK(sscanf(token, "%02x%02x%02x", &c[0], &c[1], &c[2]) == 3);
-        volume_set_at(layer->volume, &iter, pos,
-                      (uint8_t[]){c[0], c[1], c[2], 255});
+    // Bucket the voxels per tile, keeping the file order so that the last
+    // value of a voxel wins.
+    tile = NULL;
+    for (i = 0; i < nb_chunks; i++) {
+        for (j = 0; j < arrlen(chunks[i].voxels); j++) {
+            tile = get_tile(&ctx.tiles, tile, chunks[i].voxels[j].pos);
+            tile->nb++;
+        }
+    }
+    ctx.voxels = malloc(nb_voxels * sizeof(*ctx.voxels));
+    nb_tiles = HASH_COUNT(ctx.tiles);
+    tiles_pos = malloc(nb_tiles * sizeof(*tiles_pos));
+    ofs = 0;
+    k = 0;
+    HASH_ITER(hh, ctx.tiles, tile, tmp) {
+        memcpy(tiles_pos[k++], tile->pos, sizeof(tile->pos));
+        tile->ofs = ofs;
+        ofs += tile->nb;
+        tile->nb = 0;
     }
+    tile = NULL;
+    for (i = 0; i < nb_chunks; i++) {
+        for (j = 0; j < arrlen(chunks[i].voxels); j++) {
+            tile = get_tile(&ctx.tiles, tile, chunks[i].voxels[j].pos);
+            ctx.voxels[tile->ofs + tile->nb++] = &chunks[i].voxels[j];
+        }
+    }
+
+    volume_apply_tiles(image->active_layer->volume, nb_tiles,
+                       (const int (*)[3])tiles_pos, set_tile_voxels, &ctx);
+    free(tiles_pos);
 
 end:
-    fclose(file);
+    HASH_ITER(hh, ctx.tiles, tile, tmp) {
+        HASH_DEL(ctx.tiles, tile);
+        free(tile);
+    }
+    free(ctx.voxels);
+    for (i = 0; i < nb_chunks; i++) arrfree(chunks[i].voxels);
+    free(chunks);
+    reader_close(&reader);
     return ret;
 }
 
+static char *write_int(char *p, int v)
+{
+    char tmp[16];
+    int n = 0;
+    unsigned int u = v < 0 ? -(unsigned int)v : (unsigned int)v;
+
+    if (v < 0) *p++ = '-';
+    do {
+        tmp[n++] = '0' + u % 10;
+        u /= 10;
+    } while (u);
+    while (n) *p++ = tmp[--n];
+    return p;
+}
 
 static int export_as_txt(const file_format_t *format, const image_t *image,
                          const char *path)
 {
+    const char HEX[] = "0123456789abcdef";
+    const size_t buf_size = 1 << 20;
     FILE *out;
     const volume_t *volume = goxel_get_layers_volume(image);
-    int p[3];
-    uint8_t v[4];
+    int i, j, p[3], tile_pos[3];
+    uint8_t (*voxels)[4];
+    char *buf, *ptr;
     volume_iterator_t iter;
 
     out = fopen(path, "w");
@@ -93,13 +287,38 @@ static int export_as_txt(const file_format_t *format, const image_t *image,
     fprintf(out, "# One line per voxel\n");
     fprintf(out, "# X Y Z RRGGBB\n");
 
-    iter = volume_get_iterator(volume, VOLUME_ITER_VOXELS);
-    while (volume_iter(&iter, p)) {
-        volume_get_at(volume, &iter, p, v);
-        if (v[3] < 127) continue;
-        fprintf(out, "%d %d %d %02x%02x%02x\n",
-                p[0], p[1], p[2], v[0], v[1], v[2]);
+    // Format the lines ourselves into a large buffer, since fprintf ends
+    // up dominating the export time of large models.
+    buf = malloc(buf_size);
+    ptr = buf;
+    voxels = malloc(TILE_NB_VOXELS * sizeof(*voxels));
+    iter = volume_get_iterator(volume, VOLUME_ITER_TILES);
+    while (volume_iter(&iter, tile_pos)) {
+        volume_get_tile_voxels(volume, NULL, tile_pos, voxels);
+        for (i = 0; i < TILE_NB_VOXELS; i++) {
+            if (voxels[i][3] < 127) continue;
+            p[0] = tile_pos[0] + i % TILE_SIZE;
+            p[1] = tile_pos[1] + (i / TILE_SIZE) % TILE_SIZE;
+            p[2] = tile_pos[2] + i / (TILE_SIZE * TILE_SIZE);
+            for (j = 0; j < 3; j++) {
+                ptr = write_int(ptr, p[j]);
+                *ptr++ = ' ';
+            }
+            for (j = 0; j < 3; j++) {
+                *ptr++ = HEX[voxels[i][j] >> 4];
+                *ptr++ = HEX[voxels[i][j] & 15];
+            }
+            *ptr++ = '\n';
+            // Enough space for the longest possible line.
+            if (ptr - buf > buf_size - 64) {
+                fwrite(buf, 1, ptr - buf, out);
+                ptr = buf;
+            }
+        }
     }
+    fwrite(buf, 1, ptr - buf, out);
+    free(voxels);
+    free(buf);
     fclose(out);
     return 0;
 }
@@ -110,4 +329,5 @@ FILE_FORMAT_REGISTER(txt,
     .exts_desc = "text",
     .import_func = import_as_txt,
     .export_func = export_as_txt,
+    .thread_safe = true,
 )
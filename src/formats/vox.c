@@ -34,10 +34,8 @@ static inline void hexcolor(uint32_t v, uint8_t out[4])
     out[3] = (v >>  0) & 0xff;
 }
 
-#define READ(type, file) \
-    ({ type v; size_t r = fread(&v, sizeof(v), 1, file); \
-       if (r != 1) goto error; \
-       v;})
+#define READ(type, reader) \
+    ({ type v; if (!reader_read(reader, &v, sizeof(v))) goto error; v;})
 
 #define WRITE(type, v, file) \
     ({ type v_ = v; fwrite(&v_, sizeof(v_), 1, file);})
@@ -47,9 +45,8 @@ static inline void hexcolor(uint32_t v, uint8_t out[4])
 // Import the old magica voxel file format:
 //
 // d, h, w, <data>, <palette>
-static int vox_import_old(const char *path)
+static int vox_import_old(reader_t *file)
 {
-    FILE *file;
     int w, h, d, i;
     uint8_t *voxels = NULL;
     uint8_t (*palette)[4] = NULL;
@@ -57,8 +54,6 @@ static int vox_import_old(const char *path)
     int ret = -1;
     size_t size;
 
-    file = fopen(path, "rb");
-    if (!file) return -1;
     d = READ(uint32_t, file);
     h = READ(uint32_t, file);
     w = READ(uint32_t, file);
@@ -69,9 +64,7 @@ static int vox_import_old(const char *path)
     palette = calloc(256, sizeof(*palette));
     cube = calloc(size, sizeof(*cube));
     if (!cube) goto error;
-    for (i = 0; i < w * h * d; i++) {
-        voxels[i] = READ(uint8_t, file);
-    }
+    if (!reader_read(file, voxels, size)) goto error;
     for (i = 0; i < 256; i++) {
         palette[i][0] = READ(uint8_t, file);
         palette[i][1] = READ(uint8_t, file);
@@ -93,7 +86,6 @@ error:
     free(palette);
     free(voxels);
     free(cube);
-    fclose(file);
     return ret;
 }
 
@@ -139,22 +131,20 @@ struct node {
     };
 };
 
-static int read_string(FILE *file, char **out)
+static int read_string(reader_t *file, char **out)
 {
-    int size, r;
+    int size;
     size = READ(int32_t, file);
+    if (size < 0 || size > reader_remaining(file)) goto error;
     *out = calloc(size + 1, 1);
-    r = fread(*out, 1, size, file);
-    if (r != size) {
-        return -1;
-    }
+    reader_read(file, *out, size);
     return size;
 
 error:
     return -1;
 }
 
-static void read_dict(FILE *file, void *user,
+static void read_dict(reader_t *file, void *user,
                       void (*callback)(void *user, const char *key, int size,
                                        const char *value))
 {
@@ -165,7 +155,10 @@ static void read_dict(FILE *file, void *user,
         size = read_string(file, &key);
         if (size < 0) goto error;
         size = read_string(file, &value);
-        if (size < 0) goto error;
+        if (size < 0) {
+            free(key);
+            goto error;
+        }
         if (callback) callback(user, key, size, value);
         free(key);
         free(value);
@@ -231,21 +224,23 @@ static void free_node(node_t *node)
     free(node);
 }
 
-static node_t *read_node(FILE *file)
+static node_t *read_node(reader_t *file)
 {
-    int i, r, size, children_size;
+    int i;
+    uint32_t size, children_size;
     node_t *node, *child, *child2;
-    long fpos;
+    size_t fpos;
 
     node = calloc(1, sizeof(*node));
     node->node_id = -1;
-    r = fread(node->id, 1, 4, file);
-    if (r != 4) goto error;
+    if (!reader_read(file, node->id, 4)) goto error;
 
     size = READ(uint32_t, file);
     children_size = READ(uint32_t, file);
 
-    fpos = ftell(file);
+    fpos = file->pos;
+    if (size > reader_remaining(file) ||
+        children_size > reader_remaining(file) - size) goto error;
 
     if (strncmp(node->id, "MAIN", 4) == 0) {
         // Nothing to do.
@@ -256,25 +251,16 @@ static node_t *read_node(FILE *file)
         node->size.d = READ(uint32_t, file);
     }
     else if (strncmp(node->id, "RGBA", 4) == 0) {
-        node->rgba.values = malloc(4 * 256);
-        for (i = 1; i < 256; i++) {
-            node->rgba.values[i][0] = READ(uint8_t, file);
-            node->rgba.values[i][1] = READ(uint8_t, file);
-            node->rgba.values[i][2] = READ(uint8_t, file);
-            node->rgba.values[i][3] = READ(uint8_t, file);
-        }
+        node->rgba.values = calloc(256, 4);
+        if (!reader_read(file, node->rgba.values[1], 255 * 4)) goto error;
         // Skip the last value!
-        for (i = 0; i < 4; i++) READ(uint8_t, file);
+        reader_skip(file, 4);
     }
     else if (strncmp(node->id, "XYZI", 4) == 0) {
         node->xyzi.nb = READ(uint32_t, file);
-        node->xyzi.values = calloc(node->xyzi.nb, 4);
-        for (i = 0; i < node->xyzi.nb; i++) {
-            node->xyzi.values[i * 4 + 0] = READ(uint8_t, file);
-            node->xyzi.values[i * 4 + 1] = READ(uint8_t, file);
-            node->xyzi.values[i * 4 + 2] = READ(uint8_t, file);
-            node->xyzi.values[i * 4 + 3] = READ(uint8_t, file);
-        }
+        if (node->xyzi.nb > reader_remaining(file) / 4) goto error;
+        node->xyzi.values = malloc(node->xyzi.nb * 4);
+        reader_read(file, node->xyzi.values, node->xyzi.nb * 4);
     }
     else if (strncmp(node->id, "nTRN", 4) == 0) {
         node->node_id = READ(int32_t, file);
@@ -308,13 +294,13 @@ static node_t *read_node(FILE *file)
         }
     }
 
-    if (ftell(file) < fpos + size) {
-        fseek(file, fpos + size, SEEK_SET);
+    if (file->pos < fpos + size) {
+        reader_seek(file, fpos + size);
     }
 
-    while (ftell(file) < fpos + size + children_size) {
+    while (file->pos < fpos + size + children_size) {
         child = read_node(file);
-        if (!child) continue;
+        if (!child) break;
         DL_APPEND(node->children, child);
     }
 
@@ -383,75 +369,185 @@ static const node_t *node_get_ntrn(const node_t *node)
     return node_get_ntrn(node->parent);
 }
 
-static int import_layer(image_t *image,
-                        const node_t *size, const node_t *xyzi,
-                        const node_t *rgba, const node_t *tree,
-                        int model_id)
+// A model (SIZE and XYZI chunks) to import into a layer.
+typedef struct {
+    const node_t    *size;
+    const node_t    *xyzi;
+    const node_t    *rgba;
+    layer_t         *layer;
+    float           mat[4][4];
+    bool            int_mat;    // Set if mat is an integer transform.
+    int             rot[3][3];
+    int             ofs[3];
+    // Decoded tiles.
+    int             nb_tiles;
+    int             (*tiles_pos)[3];
+    tile_data_t     **tiles_data;
+} model_t;
+
+/*
+ * Get the integer rotation and translation of a transformation matrix,
+ * if it only contains a signed permutation of the axes and an integer
+ * translation, as the transformations of MagicaVoxel do.
+ */
+static bool get_int_transform(const float mat[4][4], int rot[3][3],
+                              int ofs[3])
 {
-    int i, x, y, z, c, pos[3];
-    layer_t *layer;
-    uint8_t color[4];
-    volume_iterator_t iter = {0};
-    const node_t *shape, *ntrn;
-    float mat[4][4] = MAT4_IDENTITY;
-
-    // Use the current layer for first shape, then create new layers.
-    if (size == tree->children)
-        layer = image->active_layer;
-    else
-        layer = image_add_layer(image, NULL);
-
-    for (i = 0; i < xyzi->xyzi.nb; i++) {
-        x = xyzi->xyzi.values[i * 4 + 0];
-        y = xyzi->xyzi.values[i * 4 + 1];
-        z = xyzi->xyzi.values[i * 4 + 2];
-        c = xyzi->xyzi.values[i * 4 + 3];
-        pos[0] = x - size->size.w / 2;
-        pos[1] = y - size->size.h / 2;
-        pos[2] = z - size->size.d / 2;
+    const float eps = 1e-5;
+    int i, j;
+
+    for (i = 0; i < 3; i++) {
+        for (j = 0; j < 3; j++) {
+            rot[i][j] = round(mat[j][i]);
+            if (fabs(mat[j][i] - rot[i][j]) > eps) return false;
+        }
+        ofs[i] = round(mat[3][i]);
+        if (fabs(mat[3][i] - ofs[i]) > eps) return false;
+    }
+    for (i = 0; i < 3; i++) {
+        if (    abs(rot[i][0]) + abs(rot[i][1]) + abs(rot[i][2]) != 1 ||
+                abs(rot[0][i]) + abs(rot[1][i]) + abs(rot[2][i]) != 1)
+            return false;
+    }
+    return true;
+}
+
+// Final position of a voxel of a model.
+static void model_get_pos(const model_t *model, int i, int out[3])
+{
+    const uint8_t *v = &model->xyzi->xyzi.values[i * 4];
+    int j, p[3];
+
+    p[0] = v[0] - model->size->size.w / 2;
+    p[1] = v[1] - model->size->size.h / 2;
+    p[2] = v[2] - model->size->size.d / 2;
+    if (!model->int_mat) {
+        memcpy(out, p, sizeof(p));
+        return;
+    }
+    for (j = 0; j < 3; j++) {
+        out[j] = model->rot[j][0] * p[0] + model->rot[j][1] * p[1] +
+                 model->rot[j][2] * p[2] + model->ofs[j];
+    }
+}
+
+/*
+ * Decode the voxels of a model directly into tiles, at their final
+ * position if the model has an integer transformation.  Called in
+ * parallel for each model.
+ */
+static void decode_model(void *user, int idx, int worker)
+{
+    model_t *model = &((model_t*)user)[idx];
+    const int N = TILE_SIZE;
+    const int nb = model->xyzi->xyzi.nb;
+    int i, j, k, c, p[3], tmin[3], tmax[3], size[3], nb_slots;
+    uint8_t color[4], *v;
+    uint8_t (**slots)[4];
+    int *counts;
+
+    if (!nb) return;
+    for (i = 0; i < 3; i++) {
+        tmin[i] = INT_MAX;
+        tmax[i] = INT_MIN;
+    }
+    for (i = 0; i < nb; i++) {
+        model_get_pos(model, i, p);
+        for (j = 0; j < 3; j++) {
+            tmin[j] = min(tmin[j], p[j] & ~(N - 1));
+            tmax[j] = max(tmax[j], p[j] & ~(N - 1));
+        }
+    }
+    for (i = 0; i < 3; i++) size[i] = (tmax[i] - tmin[i]) / N + 1;
+    nb_slots = size[0] * size[1] * size[2];
+    slots = calloc(nb_slots, sizeof(*slots));
+    // Number of visible voxels of each tile.
+    counts = calloc(nb_slots, sizeof(*counts));
+
+    for (i = 0; i < nb; i++) {
+        c = model->xyzi->xyzi.values[i * 4 + 3];
         if (!c) continue; // Not sure what c == 0 means.
-        if (rgba)
-            memcpy(color, rgba->rgba.values[c], 4);
+        if (model->rgba)
+            memcpy(color, model->rgba->rgba.values[c], 4);
         else
             hexcolor(VOX_DEFAULT_PALETTE[c], color);
-        volume_set_at(layer->volume, &iter, pos, color);
-    }
-
-    // Apply the transformation.
-    // XXX: would be better to properly support layer transformations!
-    shape = tree_find_shape(tree, model_id);
-    if (shape) {
-        node_apply_mat(shape, mat);
-        volume_move(layer->volume, mat);
-        ntrn = node_get_ntrn(shape);
-        if (*ntrn->ntrn.name) {
-            snprintf(layer->name, sizeof(layer->name), "%s", ntrn->ntrn.name);
+        model_get_pos(model, i, p);
+        k = (p[0] - tmin[0]) / N +
+            (p[1] - tmin[1]) / N * size[0] +
+            (p[2] - tmin[2]) / N * size[0] * size[1];
+        if (!slots[k]) slots[k] = calloc(N * N * N, 4);
+        v = slots[k][(p[0] & (N - 1)) + (p[1] & (N - 1)) * N +
+                     (p[2] & (N - 1)) * N * N];
+        counts[k] += (color[3] != 0) - (v[3] != 0);
+        memcpy(v, color, 4);
+    }
+
+    model->tiles_pos = calloc(nb_slots, sizeof(*model->tiles_pos));
+    model->tiles_data = calloc(nb_slots, sizeof(*model->tiles_data));
+    for (k = 0; k < nb_slots; k++) {
+        if (!slots[k]) continue;
+        if (counts[k]) {
+            model->tiles_pos[model->nb_tiles][0] =
+                tmin[0] + k % size[0] * N;
+            model->tiles_pos[model->nb_tiles][1] =
+                tmin[1] + k / size[0] % size[1] * N;
+            model->tiles_pos[model->nb_tiles][2] =
+                tmin[2] + k / (size[0] * size[1]) * N;
+            model->tiles_data[model->nb_tiles++] =
+                volume_tile_data_new((const void*)slots[k]);
         }
+        free(slots[k]);
     }
+    free(slots);
+    free(counts);
+}
 
-    return 0;
+/*
+ * Import all the models into layers.  The models are decoded in parallel,
+ * then their tiles are set in the layers volumes.
+ */
+static void import_models(image_t *image, model_t *models, int nb)
+{
+    int i, j;
+    model_t *model;
+
+    jobs_parallel_for(nb, decode_model, models);
+    for (i = 0; i < nb; i++) {
+        model = &models[i];
+        for (j = 0; j < model->nb_tiles; j++) {
+            volume_set_tile_data(model->layer->volume, model->tiles_pos[j],
+                                 model->tiles_data[j]);
+            volume_tile_data_release(model->tiles_data[j]);
+        }
+        free(model->tiles_pos);
+        free(model->tiles_data);
+        // XXX: would be better to properly support layer transformations!
+        if (!model->int_mat) volume_move(model->layer->volume, model->mat);
+    }
 }
 
 static int vox_import(const file_format_t *format, image_t *image,
                       const char *path)
 {
-    FILE *file;
+    reader_t reader, *file = &reader;
     char magic[4];
-    int r, i, version;
+    int ret, version, nb = 0;
     node_t *tree, *size_n, *xyzi_n, *rgba_n;
+    const node_t *shape, *ntrn;
+    model_t *models = NULL, *model;
 
     path = path ?: sys_open_file_dialog("Open", NULL, format->exts,
                                         format->exts_desc);
     if (!path) return -1;
-    file = fopen(path, "rb");
-    if (!file) return -1;
-    r = fread(magic, 1, 4, file);
-    if (r != 4) FILE_ERROR("Cannot read file");
+    if (reader_open(file, path) != 0) return -1;
+    if (!reader_read(file, magic, 4)) FILE_ERROR("Cannot read file");
 
     if (strncmp(magic, "VOX ", 4) != 0) {
         LOG_D("Old style magica voxel file");
-        fclose(file);
-        return vox_import_old(path);
+        reader_seek(file, 0);
+        ret = vox_import_old(file);
+        reader_close(file);
+        return ret;
     }
 
     if (strncmp(magic, "VOX ", 4) != 0) FILE_ERROR("Wrong magic string");
@@ -466,68 +562,278 @@ static int vox_import(const file_format_t *format, image_t *image,
     }
 
     // Create one layer for each ('size', 'xyzi') chunks in the main chunk.
-    i = 0;
     DL_FOREACH(tree->children, size_n) {
         if (strncmp(size_n->id, "SIZE", 4) != 0) continue;
         xyzi_n = size_n->next;
         if (!xyzi_n) continue;
         if (strncmp(xyzi_n->id, "XYZI", 4) != 0) continue;
-        import_layer(image, size_n, xyzi_n, rgba_n, tree, i);
-        i++;
+        models = realloc(models, (nb + 1) * sizeof(*models));
+        model = &models[nb];
+        *model = (model_t) {size_n, xyzi_n, rgba_n, .mat = MAT4_IDENTITY};
+        // Use the current layer for first shape, then create new layers.
+        if (size_n == tree->children)
+            model->layer = image->active_layer;
+        else
+            model->layer = image_add_layer(image, NULL);
+        shape = tree_find_shape(tree, nb);
+        if (shape) {
+            node_apply_mat(shape, model->mat);
+            ntrn = node_get_ntrn(shape);
+            if (ntrn && *ntrn->ntrn.name) {
+                snprintf(model->layer->name, sizeof(model->layer->name),
+                         "%s", ntrn->ntrn.name);
+            }
+        }
+        model->int_mat = get_int_transform(model->mat, model->rot,
+                                           model->ofs);
+        nb++;
     }
+    import_models(image, models, nb);
 
+    free(models);
     free_node(tree);
-    fclose(file);
+    reader_close(file);
 
     return 0;
 
 error:
-    fclose(file);
+    reader_close(file);
     return -1;
 }
 
-static int get_color_index(uint8_t v[4], uint8_t (*palette)[4], bool exact)
+/*
+ * Create a palette with the colors 1 to 254 of a file palette, to quickly
+ * search the voxels colors into it.  We only compare the rgb values.
+ */
+static void search_palette_init(palette_t *search, uint8_t (*palette)[4])
+{
+    int i;
+    palette_lookup_end(search);
+    free(search->entries);
+    memset(search, 0, sizeof(*search));
+    search->size = search->allocated = 254;
+    search->entries = calloc(search->size, sizeof(*search->entries));
+    for (i = 0; i < search->size; i++) {
+        memcpy(search->entries[i].color, palette[i + 1], 3);
+        search->entries[i].color[3] = 255;
+    }
+    palette_lookup_begin(search);
+}
+
+static void search_palette_release(palette_t *search)
 {
-    const uint8_t *c;
-    int i, dist, best = -1, best_dist = 1024;
-    for (i = 1; i < 255; i++) {
-        c = palette[i];
-        dist = abs((int)c[0] - (int)v[0]) +
-               abs((int)c[1] - (int)v[1]) +
-               abs((int)c[2] - (int)v[2]);
-        if (dist == 0) return i;
-        if (exact) continue;
-        if (dist < best_dist) {
-            best_dist = dist;
-            best = i;
+    palette_lookup_end(search);
+    free(search->entries);
+}
+
+static int get_color_index(const uint8_t v[4], const palette_t *search,
+                           bool exact)
+{
+    int i;
+    i = palette_search(search, (uint8_t[]){v[0], v[1], v[2], 255}, exact);
+    return i == -1 ? -1 : i + 1;
+}
+
+#define MODEL_SIZE 256 // Max size of a model.
+#define TILE_NB_VOXELS (TILE_SIZE * TILE_SIZE * TILE_SIZE)
+
+// A tile of a volume, and the model it goes into.
+typedef struct {
+    int region[3];
+    int pos[3];
+} export_tile_t;
+
+// A model of the exported scene.
+typedef struct {
+    int trans[3];
+    char name[256];
+} export_model_t;
+
+static int export_tile_cmp(const void *a_, const void *b_)
+{
+    const export_tile_t *a = a_;
+    const export_tile_t *b = b_;
+    return cmp(a->region[2], b->region[2]) ?:
+           cmp(a->region[1], b->region[1]) ?:
+           cmp(a->region[0], b->region[0]) ?:
+           cmp(a->pos[2], b->pos[2]) ?:
+           cmp(a->pos[1], b->pos[1]) ?:
+           cmp(a->pos[0], b->pos[0]);
+}
+
+// Start a chunk, and return its position so that we can set its size
+// once written.
+static long chunk_begin(FILE *file, const char *id)
+{
+    long pos = ftell(file);
+    fwrite(id, 4, 1, file);
+    WRITE(uint32_t, 0, file);   // Content size.
+    WRITE(uint32_t, 0, file);   // Children size.
+    return pos;
+}
+
+static void chunk_end(FILE *file, long pos, bool children)
+{
+    long end = ftell(file);
+    fseek(file, pos + (children ? 8 : 4), SEEK_SET);
+    WRITE(uint32_t, end - pos - 12, file);
+    fseek(file, end, SEEK_SET);
+}
+
+static void write_string(FILE *file, const char *str)
+{
+    WRITE(int32_t, strlen(str), file);
+    fwrite(str, strlen(str), 1, file);
+}
+
+static void write_ntrn(FILE *file, int id, int child_id,
+                       const export_model_t *model)
+{
+    char buf[64];
+    long chunk = chunk_begin(file, "nTRN");
+    WRITE(int32_t, id, file);
+    WRITE(int32_t, model && *model->name ? 1 : 0, file); // Attributes dict.
+    if (model && *model->name) {
+        write_string(file, "_name");
+        write_string(file, model->name);
+    }
+    WRITE(int32_t, child_id, file);
+    WRITE(int32_t, -1, file);   // Reserved.
+    WRITE(int32_t, -1, file);   // Layer id.
+    WRITE(int32_t, 1, file);    // Number of frames.
+    WRITE(int32_t, model ? 1 : 0, file); // Frame dict.
+    if (model) {
+        snprintf(buf, sizeof(buf), "%d %d %d", model->trans[0],
+                 model->trans[1], model->trans[2]);
+        write_string(file, "_t");
+        write_string(file, buf);
+    }
+    chunk_end(file, chunk, false);
+}
+
+/*
+ * Write the SIZE and XYZI chunks of the models of a volume.
+ *
+ * The volume is split into regions of at most 256^3 voxels, starting from
+ * the origin, and we write one model per region.  The tiles are streamed
+ * region by region, without copying the voxels of the whole volume.
+ */
+static void export_volume(FILE *file, const volume_t *volume,
+                          const int origin[3], const char *name,
+                          const palette_t *search,
+                          export_model_t **models, int *nb_models)
+{
+    volume_iterator_t iter;
+    export_tile_t *tiles = NULL;
+    int nb_tiles = 0, nb_vox, i, j, k, n, v, pos[3], bbox[2][3], size[3];
+    uint8_t (*voxels)[4], xyzi[4];
+    export_model_t *model;
+    long chunk;
+
+    iter = volume_get_iterator(volume, VOLUME_ITER_TILES);
+    while (volume_iter(&iter, pos)) {
+        tiles = realloc(tiles, (nb_tiles + 1) * sizeof(*tiles));
+        for (k = 0; k < 3; k++) {
+            tiles[nb_tiles].pos[k] = pos[k];
+            tiles[nb_tiles].region[k] = (pos[k] - origin[k]) / MODEL_SIZE;
         }
+        nb_tiles++;
     }
-    return best;
+    qsort(tiles, nb_tiles, sizeof(*tiles), export_tile_cmp);
+
+    voxels = calloc(TILE_NB_VOXELS, sizeof(*voxels));
+    for (i = 0; i < nb_tiles; i = j) {
+        // Tiles [i, j) are all in the same region.
+        for (j = i + 1; j < nb_tiles; j++) {
+            if (memcmp(tiles[j].region, tiles[i].region,
+                       sizeof(tiles[i].region)) != 0) break;
+        }
+
+        // Get the exact bounding box of the region voxels.
+        bbox[0][0] = bbox[0][1] = bbox[0][2] = INT_MAX;
+        bbox[1][0] = bbox[1][1] = bbox[1][2] = INT_MIN;
+        for (n = i; n < j; n++) {
+            volume_get_tile_voxels(volume, NULL, tiles[n].pos, voxels);
+            for (v = 0; v < TILE_NB_VOXELS; v++) {
+                if (voxels[v][3] < 127) continue;
+                pos[0] = tiles[n].pos[0] + v % TILE_SIZE;
+                pos[1] = tiles[n].pos[1] + v / TILE_SIZE % TILE_SIZE;
+                pos[2] = tiles[n].pos[2] + v / TILE_SIZE / TILE_SIZE;
+                for (k = 0; k < 3; k++) {
+                    bbox[0][k] = min(bbox[0][k], pos[k]);
+                    bbox[1][k] = max(bbox[1][k], pos[k] + 1);
+                }
+            }
+        }
+        if (bbox[0][0] > bbox[1][0]) continue; // Empty region.
+
+        for (k = 0; k < 3; k++) size[k] = bbox[1][k] - bbox[0][k];
+        chunk = chunk_begin(file, "SIZE");
+        WRITE(uint32_t, size[0], file);
+        WRITE(uint32_t, size[1], file);
+        WRITE(uint32_t, size[2], file);
+        chunk_end(file, chunk, false);
+
+        chunk = chunk_begin(file, "XYZI");
+        WRITE(uint32_t, 0, file); // Number of voxels, set after.
+        nb_vox = 0;
+        for (n = i; n < j; n++) {
+            volume_get_tile_voxels(volume, NULL, tiles[n].pos, voxels);
+            for (v = 0; v < TILE_NB_VOXELS; v++) {
+                if (voxels[v][3] < 127) continue;
+                xyzi[0] = tiles[n].pos[0] + v % TILE_SIZE - bbox[0][0];
+                xyzi[1] = tiles[n].pos[1] + v / TILE_SIZE % TILE_SIZE -
+                          bbox[0][1];
+                xyzi[2] = tiles[n].pos[2] + v / TILE_SIZE / TILE_SIZE -
+                          bbox[0][2];
+                xyzi[3] = get_color_index(voxels[v], search, false);
+                fwrite(xyzi, 4, 1, file);
+                nb_vox++;
+            }
+        }
+        chunk_end(file, chunk, false);
+        fseek(file, chunk + 12, SEEK_SET);
+        WRITE(uint32_t, nb_vox, file);
+        fseek(file, 0, SEEK_END);
+
+        // The importer puts the voxels around the model center.
+        *models = realloc(*models, (*nb_models + 1) * sizeof(**models));
+        model = &(*models)[(*nb_models)++];
+        memset(model, 0, sizeof(*model));
+        for (k = 0; k < 3; k++)
+            model->trans[k] = bbox[0][k] + size[k] / 2;
+        snprintf(model->name, sizeof(model->name), "%s", name ?: "");
+    }
+    free(voxels);
+    free(tiles);
 }
 
-static int voxel_cmp(const void *a_, const void *b_)
+// Check that we can export all the layers as separate models, that is,
+// they are all simply added to each other.
+static bool can_export_layers(const image_t *image)
 {
-    const uint8_t *a = a_;
-    const uint8_t *b = b_;
-    if (a[2] != b[2]) return cmp(a[2], b[2]);
-    if (a[1] != b[1]) return cmp(a[1], b[1]);
-    if (a[0] != b[0]) return cmp(a[0], b[0]);
-    return 0;
+    const layer_t *layer;
+    DL_FOREACH(image->layers, layer) {
+        if (!layer->visible || !layer->volume) continue;
+        if (layer->mode != MODE_OVER) return false;
+    }
+    return true;
 }
 
 static int vox_export(const file_format_t *format, const image_t *image,
                       const char *path)
 {
     FILE *file;
-    int children_size, nb_vox = 0, i, pos[3];
-    int xmin = INT_MAX, ymin = INT_MAX, zmin = INT_MAX;
-    int xmax = INT_MIN, ymax = INT_MIN, zmax = INT_MIN;
+    int i, pos[3], bbox[2][3], nb_models = 0;
     uint8_t (*palette)[4];
+    uint8_t (*voxels)[4];
     bool use_default_palette = true;
-    uint8_t *voxels;
-    uint8_t v[4];
     volume_iterator_t iter;
     const volume_t *volume;
+    const layer_t *layer;
+    palette_t search = {};
+    export_model_t *models = NULL;
+    long main_chunk, chunk;
 
     file = fopen(path, "wb");
     if (!file) {
@@ -539,76 +845,73 @@ static int vox_export(const file_format_t *format, const image_t *image,
     palette = calloc(256, sizeof(*palette));
     for (i = 0; i < 256; i++)
         hexcolor(VOX_DEFAULT_PALETTE[i], palette[i]);
-
-    // Iter all the voxels to get the count and the size.
-    iter = volume_get_iterator(volume, VOLUME_ITER_VOXELS);
-    while (volume_iter(&iter, pos)) {
-        volume_get_at(volume, &iter, pos, v);
-        if (v[3] < 127) continue;
-        v[3] = 255;
-        use_default_palette = use_default_palette &&
-                            get_color_index(v, palette, true) != -1;
-        nb_vox++;
-        xmin = min(xmin, pos[0]);
-        ymin = min(ymin, pos[1]);
-        zmin = min(zmin, pos[2]);
-        xmax = max(xmax, pos[0] + 1);
-        ymax = max(ymax, pos[1] + 1);
-        zmax = max(zmax, pos[2] + 1);
-    }
-    if (!use_default_palette)
+    search_palette_init(&search, palette);
+
+    // Check if the default palette contains all the colors.
+    voxels = calloc(TILE_NB_VOXELS, sizeof(*voxels));
+    iter = volume_get_iterator(volume, VOLUME_ITER_TILES);
+    while (use_default_palette && volume_iter(&iter, pos)) {
+        volume_get_tile_voxels(volume, NULL, pos, voxels);
+        for (i = 0; i < TILE_NB_VOXELS; i++) {
+            if (voxels[i][3] < 127) continue;
+            if (get_color_index(voxels[i], &search, true) == -1) {
+                use_default_palette = false;
+                break;
+            }
+        }
+    }
+    free(voxels);
+    if (!use_default_palette) {
         quantization_gen_palette(volume, 255, (void*)(palette + 1));
+        search_palette_init(&search, palette);
+    }
 
-    children_size = 12 + 4 * 3 +      // SIZE chunk
-                    12 + 4 + 4 * nb_vox + // XYZI chunk
-                    (use_default_palette ? 0 : (12 + 4 * 256)); // RGBA chunk.
+    // All the models are split on the same grid, starting from the tile
+    // containing the bottom corner of the image.
+    volume_get_bbox(volume, bbox, true);
+    for (i = 0; i < 3; i++)
+        pos[i] = (int)floor(bbox[0][i] / (float)TILE_SIZE) * TILE_SIZE;
 
     fprintf(file, "VOX ");
     WRITE(uint32_t, 150, file);     // Version
-    fprintf(file, "MAIN");
-    WRITE(uint32_t, 0, file);       // Main chunck size.
-    WRITE(uint32_t, children_size, file);
-
-    fprintf(file, "SIZE");
-    WRITE(uint32_t, 4 * 3, file);
-    WRITE(uint32_t, 0, file);
-    WRITE(uint32_t, xmax - xmin, file);
-    WRITE(uint32_t, ymax - ymin, file);
-    WRITE(uint32_t, zmax - zmin, file);
-
-    fprintf(file, "XYZI");
-    WRITE(uint32_t, 4 * nb_vox + 4, file);
-    WRITE(uint32_t, 0, file);
-    WRITE(uint32_t, nb_vox, file);
-
-    voxels = calloc(nb_vox, 4);
-    i = 0;
-    iter = volume_get_iterator(volume, VOLUME_ITER_VOXELS);
-    while (volume_iter(&iter, pos)) {
-        volume_get_at(volume, &iter, pos, v);
-        if (v[3] < 127) continue;
-        pos[0] -= xmin;
-        pos[1] -= ymin;
-        pos[2] -= zmin;
-        assert(pos[0] >= 0 && pos[0] < 255);
-        assert(pos[1] >= 0 && pos[1] < 255);
-        assert(pos[2] >= 0 && pos[2] < 255);
-
-        voxels[i * 4 + 0] = pos[0];
-        voxels[i * 4 + 1] = pos[1];
-        voxels[i * 4 + 2] = pos[2];
-        voxels[i * 4 + 3] = get_color_index(v, palette, false);
-        i++;
-    }
-    qsort(voxels, nb_vox, 4, voxel_cmp);
-    for (i = 0; i < nb_vox; i++)
-        fwrite(voxels + i * 4, 4, 1, file);
-    free(voxels);
+    main_chunk = chunk_begin(file, "MAIN");
+
+    if (can_export_layers(image)) {
+        DL_FOREACH(image->layers, layer) {
+            if (!layer->visible || !layer->volume) continue;
+            export_volume(file, layer->volume, pos, layer->name, &search,
+                          &models, &nb_models);
+        }
+    } else {
+        export_volume(file, volume, pos, NULL, &search,
+                      &models, &nb_models);
+    }
+
+    // Scene graph: a root transform and group, and a transform and shape
+    // for each model.
+    if (nb_models) {
+        write_ntrn(file, 0, 1, NULL);
+        chunk = chunk_begin(file, "nGRP");
+        WRITE(int32_t, 1, file);
+        WRITE(int32_t, 0, file);    // Attributes dict.
+        WRITE(int32_t, nb_models, file);
+        for (i = 0; i < nb_models; i++)
+            WRITE(int32_t, 2 + i * 2, file);
+        chunk_end(file, chunk, false);
+        for (i = 0; i < nb_models; i++) {
+            write_ntrn(file, 2 + i * 2, 3 + i * 2, &models[i]);
+            chunk = chunk_begin(file, "nSHP");
+            WRITE(int32_t, 3 + i * 2, file);
+            WRITE(int32_t, 0, file);    // Attributes dict.
+            WRITE(int32_t, 1, file);    // Number of models.
+            WRITE(int32_t, i, file);
+            WRITE(int32_t, 0, file);    // Model dict.
+            chunk_end(file, chunk, false);
+        }
+    }
 
     if (!use_default_palette) {
-        fprintf(file, "RGBA");
-        WRITE(uint32_t, 4 * 256, file);
-        WRITE(uint32_t, 0, file);
+        chunk = chunk_begin(file, "RGBA");
         for (i = 1; i < 256; i++) {
             WRITE(uint8_t, palette[i][0], file);
             WRITE(uint8_t, palette[i][1], file);
@@ -616,10 +919,14 @@ static int vox_export(const file_format_t *format, const image_t *image,
             WRITE(uint8_t, palette[i][3], file);
         }
         WRITE(uint32_t, 0, file);
+        chunk_end(file, chunk, false);
     }
+    chunk_end(file, main_chunk, true);
 
     fclose(file);
     free(palette);
+    free(models);
+    search_palette_release(&search);
     return 0;
 }
 
@@ -46,8 +46,8 @@ typedef struct {
 } slab_t;
 
 
-#define READ(type, file) \
-    ({ type v; size_t r = fread(&v, sizeof(v), 1, file); (void)r; v;})
+#define READ(type, reader) \
+    ({ type v; reader_read(reader, &v, sizeof(v)); v;})
 #define WRITE(type, v, file) \
     ({ type v_ = v; fwrite(&v_, sizeof(v_), 1, file);})
 
@@ -76,32 +76,34 @@ static void swap_color(uint32_t v, uint8_t ret[4])
 static int kv6_import(const file_format_t *format, image_t *image,
                       const char *path)
 {
-    FILE *file;
+    reader_t reader, *file = &reader;
     char magic[4];
-    int i, r, ret = 0, w, h, d, blklen, x, y, z = 0, nb, p = 0;
+    int i, ret = 0, w, h, d, blklen, x, y, z = 0, nb, p = 0;
     uint32_t *xoffsets = NULL;
     uint16_t *xyoffsets = NULL;
     uint8_t (*cube)[4] = NULL;
     uint8_t color[4] = {0};
-    (void)r;
     struct {
         uint32_t color;
         uint8_t zpos;
         uint8_t visface;
     } *blocks = NULL;
 
-    file = fopen(path, "rb");
-    r = fread(magic, 1, 4, file);
+    if (reader_open(file, path) != 0) return -1;
+    reader_read(file, magic, 4);
     if (strncmp(magic, "Kvxl ", 4) != 0) raise("Invalid magic");
     w = READ(uint32_t, file);
     h = READ(uint32_t, file);
     d = READ(uint32_t, file);
+    if ((uint64_t)w * h * d > 512 * 512 * 512) raise("Invalid size");
     cube = calloc(w * h * d, sizeof(*cube));
 
     READ(float, file);
     READ(float, file);
     READ(float, file);
     blklen = READ(uint32_t, file);
+    if (blklen < 0 || blklen > reader_remaining(file) / 8)
+        raise("Invalid file");
     blocks = calloc(blklen, sizeof(*blocks));
     for (i = 0; i < blklen; i++) {
         blocks[i].color = READ(uint32_t, file);
@@ -113,12 +115,15 @@ static int kv6_import(const file_format_t *format, image_t *image,
     xyoffsets = calloc(w * h, sizeof(*xyoffsets));
     for (i = 0; i < w; i++)      xoffsets[i] = READ(uint32_t, file);
     for (i = 0; i < w * h; i++) xyoffsets[i] = READ(uint16_t, file);
+    if (file->error) raise("Cannot read file");
 
     for (x = 0; x < w; x++)
     for (y = 0; y < h; y++) {
         nb = xyoffsets[x * h + y];
+        if (p + nb > blklen) raise("Invalid file");
         for (i = 0; i < nb; i++, p++) {
             z = blocks[p].zpos;
+            if (z >= d) raise("Invalid file");
             swap_color(blocks[p].color, cube[AT(x, y, z, w, h, d)]);
         }
     }
@@ -149,15 +154,15 @@ end:
     free(blocks);
     free(xoffsets);
     free(xyoffsets);
-    fclose(file);
+    reader_close(file);
     return ret;
 }
 
 static int kvx_import(const file_format_t *format, image_t *image,
                       const char *path)
 {
-    FILE *file;
-    int i, r, ret = 0, nb, size, lastz = 0, len, visface;
+    reader_t reader, *file = &reader;
+    int i, ret = 0, nb, size, lastz = 0, len, visface;
     int w, h, d, px, py, pz, x, y, z;
     int offsetsize, voxdatasize;
     int aabb[2][3];
@@ -166,18 +171,19 @@ static int kvx_import(const file_format_t *format, image_t *image,
     uint32_t *xoffsets = NULL;
     uint16_t *xyoffsets = NULL;
     uint8_t (*cube)[4] = NULL;
-    long datpos;
-    (void)r;
+    size_t datpos;
 
     path = path ?: sys_open_file_dialog("Open", NULL, format->exts,
                                         format->exts_desc);
     if (!path) return -1;
 
-    file = fopen(path, "rb");
+    if (reader_open(file, path) != 0) return -1;
     size = READ(uint32_t, file);
     w = READ(uint32_t, file);
     h = READ(uint32_t, file);
     d = READ(uint32_t, file);
+    if ((uint64_t)w * h * d > 512 * 512 * 512 ||
+            reader_remaining(file) < 256 * 3) raise("Invalid file");
     cube = calloc(w * h * d, sizeof(*cube));
 
     px = READ(uint32_t, file) / 256;
@@ -195,10 +201,10 @@ static int kvx_import(const file_format_t *format, image_t *image,
     voxdatasize = size - 24 - offsetsize;
     if (xoffsets[w] != offsetsize + voxdatasize) LOG_W("Invalide kvx file");
 
-    datpos = ftell(file);
+    datpos = file->pos;
 
     // Read the palette at the end of the file first.
-    fseek(file, -256 * 3, SEEK_END);
+    reader_seek(file, file->size - 256 * 3);
     palette = calloc(256, sizeof(*palette));
     for (i = 0; i < 256; i++) {
         palette[i][0] = clamp(round(READ(uint8_t, file) * 255 / 63.f), 0, 255);
@@ -206,7 +212,7 @@ static int kvx_import(const file_format_t *format, image_t *image,
         palette[i][2] = clamp(round(READ(uint8_t, file) * 255 / 63.f), 0, 255);
         palette[i][3] = 255;
     }
-    fseek(file, datpos, SEEK_SET);
+    reader_seek(file, datpos);
 
     for (x = 0; x < w; x++)
     for (y = 0; y < h; y++) {
@@ -217,7 +223,7 @@ static int kvx_import(const file_format_t *format, image_t *image,
             z = READ(uint8_t, file);
             len = READ(uint8_t, file);
             visface = READ(uint8_t, file);
-            assert(z + len - 1  < d);
+            if (file->error || z + len > d) raise("Invalid format");
             for (i = 0; i < len; i++) {
                 color = READ(uint8_t, file);
                 memcpy(cube[AT(x, y, z + i, w, h, d)], palette[color], 4);
@@ -252,38 +258,42 @@ end:
     free(cube);
     free(xoffsets);
     free(xyoffsets);
-    fclose(file);
+    reader_close(file);
     return ret;
 }
 
 
-static int get_color_index(uint8_t v[4], uint8_t (*palette)[4], bool exact)
+/*
+ * Create a palette with the colors 1 to 254 of a file palette, to quickly
+ * search the voxels colors into it.  We only compare the rgb values.
+ */
+static void search_palette_init(palette_t *search, uint8_t (*palette)[4])
 {
-    const uint8_t *c;
-    int i, dist, best = -1, best_dist = 1024;
-    for (i = 1; i < 255; i++) {
-        c = palette[i];
-        dist = abs((int)c[0] - (int)v[0]) +
-               abs((int)c[1] - (int)v[1]) +
-               abs((int)c[2] - (int)v[2]);
-        if (dist == 0) return i;
-        if (exact) continue;
-        if (dist < best_dist) {
-            best_dist = dist;
-            best = i;
-        }
+    int i;
+    palette_lookup_end(search);
+    free(search->entries);
+    memset(search, 0, sizeof(*search));
+    search->size = search->allocated = 254;
+    search->entries = calloc(search->size, sizeof(*search->entries));
+    for (i = 0; i < search->size; i++) {
+        memcpy(search->entries[i].color, palette[i + 1], 3);
+        search->entries[i].color[3] = 255;
     }
-    return best;
+    palette_lookup_begin(search);
 }
 
-// Sort the voxels as they appear in the slabs.
-static int voxel_cmp(const void *a_, const void *b_)
+static void search_palette_release(palette_t *search)
 {
-    const voxel_t *a = (void*)a_;
-    const voxel_t *b = (void*)b_;
-    return cmp(a->pos[0], b->pos[0]) ?:
-           cmp(a->pos[1], b->pos[1]) ?:
-           cmp(a->pos[2], b->pos[2]);
+    palette_lookup_end(search);
+    free(search->entries);
+}
+
+static int get_color_index(const uint8_t v[4], const palette_t *search,
+                           bool exact)
+{
+    int i;
+    i = palette_search(search, (uint8_t[]){v[0], v[1], v[2], 255}, exact);
+    return i == -1 ? -1 : i + 1;
 }
 
 /*
@@ -312,28 +322,109 @@ static bool slab_append(slab_t *slab, voxel_t *vox)
 }
 
 
+/*
+ * Add a voxel to the slabs, starting a new slab if it doesn't continue the
+ * last one.
+ */
+static void slabs_add(UT_array *slabs, voxel_t *vox)
+{
+    slab_t *slab = (void*)utarray_back(slabs);
+    if (slab_append(slab, vox)) return;
+    // Finished a slab, create a new one.
+    utarray_extend_back(slabs);
+    slab = (void*)utarray_back(slabs);
+    slab_append(slab, vox);     // Always works.
+}
+
+/*
+ * Generate the slabs of the voxels of a volume in the order they are
+ * saved: by x columns, then y columns, then z, with the y and z axis of
+ * the file reversed.
+ *
+ * The volume is read one band of tiles of same x at a time, plus a one
+ * voxel border, and an occupancy mask of the band gives the visible faces,
+ * so that the slabs are directly produced in order.  Only the voxels in
+ * the area [lo, hi) are exported.
+ */
+static void gen_slabs(const volume_t *volume, const int orig[3],
+                      const int size[3], const int lo[3], const int hi[3],
+                      const palette_t *search, UT_array *slabs)
+{
+    const int N = TILE_SIZE;
+    int bx, x, y, z, w, h, d, i, aabb[2][3], last_color = 0;
+    uint8_t *buf, *mask, *v, last[4] = {};
+    voxel_t vox;
+
+    h = size[1] + 2;
+    d = size[2] + 2;
+    for (bx = orig[0] & ~(N - 1); bx < orig[0] + size[0]; bx += N) {
+        aabb[0][0] = max(bx, orig[0]) - 1;
+        aabb[1][0] = min(bx + N, orig[0] + size[0]) + 1;
+        aabb[0][1] = orig[1] - 1;
+        aabb[1][1] = orig[1] + size[1] + 1;
+        aabb[0][2] = orig[2] - 1;
+        aabb[1][2] = orig[2] + size[2] + 1;
+        w = aabb[1][0] - aabb[0][0];
+        buf = malloc(w * h * d * 4);
+        mask = malloc(w * h * d);
+        volume_get_span(volume, aabb, buf, NULL);
+        for (i = 0; i < w * h * d; i++) mask[i] = buf[i * 4 + 3] >= 127;
+
+        for (x = 1; x < w - 1; x++)
+        for (y = h - 2; y >= 1; y--)
+        for (z = d - 2; z >= 1; z--) {
+            i = x + y * w + z * w * h;
+            if (!mask[i]) continue;
+            vox.pos[0] = aabb[0][0] + x;
+            vox.pos[1] = aabb[0][1] + y;
+            vox.pos[2] = aabb[0][2] + z;
+            if (    vox.pos[0] < lo[0] || vox.pos[0] >= hi[0] ||
+                    vox.pos[1] < lo[1] || vox.pos[1] >= hi[1] ||
+                    vox.pos[2] < lo[2] || vox.pos[2] >= hi[2])
+                continue;
+            // Visible face mask.
+            vox.vis = (!mask[i - 1]         ? 1  : 0) |
+                      (!mask[i + 1]         ? 2  : 0) |
+                      (!mask[i + w]         ? 4  : 0) |
+                      (!mask[i - w]         ? 8  : 0) |
+                      (!mask[i + w * h]     ? 16 : 0) |
+                      (!mask[i - w * h]     ? 32 : 0);
+            if (!vox.vis) continue; // No visible faces.
+            v = &buf[i * 4];
+            if (!last_color || memcmp(v, last, 3) != 0) {
+                memcpy(last, v, 3);
+                last_color = get_color_index(v, search, false);
+            }
+            vox.color = last_color;
+            vox.pos[0] -= orig[0];
+            vox.pos[1] = size[1] - (vox.pos[1] - orig[1]) - 1;
+            vox.pos[2] = size[2] - (vox.pos[2] - orig[2]) - 1;
+            slabs_add(slabs, &vox);
+        }
+        free(buf);
+        free(mask);
+    }
+}
+
 static int kvx_export(const file_format_t *format, const image_t *image,
                       const char *path)
 {
     FILE *file;
     uint8_t (*palette)[4];
     volume_iterator_t iter;
-    volume_accessor_t acc;
-    uint8_t v[4];
+    uint8_t v[4], last[4] = {};
     float box[4][4];
-    int pos[3], size[3], orig[3], x, y, i;
+    int pos[3], size[3], orig[3], lo[3], hi[3], x, y, i;
     UT_array *slabs;
-    UT_array *voxels;
     slab_t *slab;
-    voxel_t voxel, *vox;
     uint32_t ofs;
     uint32_t *xoffsets;
     uint32_t *xyoffsets;
     bool use_current_palette = false;
     float pivot[3];
+    palette_t search = {};
     const volume_t *volume = goxel_get_layers_volume(image);
 
-    UT_icd voxel_icd = {sizeof(voxel_t), NULL, NULL, NULL};
     UT_icd slab_icd = {sizeof(slab_t), NULL, NULL, NULL};
 
     mat4_copy(image->box, box);
@@ -352,15 +443,21 @@ static int kvx_export(const file_format_t *format, const image_t *image,
     // create a palette.
     if (goxel.palette->size == 256) {
         use_current_palette = true;
-        iter = volume_get_iterator(volume, VOLUME_ITER_VOXELS);
+        palette_lookup_begin(goxel.palette);
+        iter = volume_get_iterator(volume,
+                VOLUME_ITER_VOXELS | VOLUME_ITER_SKIP_EMPTY);
         while (volume_iter(&iter, pos)) {
             volume_get_at(volume, &iter, pos, v);
             if (v[3] < 127) continue;
+            // Most voxels have the same color as the previous one.
+            if (memcmp(v, last, 4) == 0) continue;
+            memcpy(last, v, 4);
             if (palette_search(goxel.palette, v, true) < 0) {
                 use_current_palette = false;
                 break;
             }
         }
+        palette_lookup_end(goxel.palette);
     }
     palette = calloc(256, sizeof(*palette));
     if (use_current_palette) {
@@ -371,70 +468,16 @@ static int kvx_export(const file_format_t *format, const image_t *image,
     } else {
         quantization_gen_palette(volume, 256, (void*)(palette));
     }
+    search_palette_init(&search, palette);
 
-    // Iter the voxels and only keep the visible ones, plus the visible
-    // faces mask.  Put them all into an array.
-    utarray_new(voxels, &voxel_icd);
-    iter = volume_get_iterator(volume,
-                               VOLUME_ITER_VOXELS | VOLUME_ITER_SKIP_EMPTY);
-    acc = volume_get_accessor(volume);
-
-    while (volume_iter(&iter, voxel.pos)) {
-        volume_get_at(volume, &iter, voxel.pos, v);
-        if (v[3] < 127) continue;
-
-        // XXX: we should be able to use box iterator instead of this,
-        // but for some reason it doesn't work!
-        if (!bbox_contains_vec(box,
-                    (float[]){voxel.pos[0], voxel.pos[1], voxel.pos[2]}))
-            continue;
-
-        // Compute visible face mask.
-        voxel.vis = 0;
-        #define vis_test(x, y, z) \
-            (volume_get_alpha_at(volume, &acc, \
-                        (int[]){voxel.pos[0] + (x), \
-                                voxel.pos[1] + (y), \
-                                voxel.pos[2] + (z)}) < 127)
-        if (vis_test(-1,  0,  0)) voxel.vis |= 1;
-        if (vis_test(+1,  0,  0)) voxel.vis |= 2;
-        if (vis_test( 0, +1,  0)) voxel.vis |= 4;
-        if (vis_test( 0, -1,  0)) voxel.vis |= 8;
-        if (vis_test( 0,  0, +1)) voxel.vis |= 16;
-        if (vis_test( 0,  0, -1)) voxel.vis |= 32;
-
-        #undef vis_test
-        if (!voxel.vis) continue; // No visible faces.
-        voxel.color = get_color_index(v, palette, false);
-        voxel.pos[0] -= orig[0];
-        voxel.pos[1] -= orig[1];
-        voxel.pos[2] -= orig[2];
-
-        voxel.pos[1] = size[1] - voxel.pos[1] - 1;
-        voxel.pos[2] = size[2] - voxel.pos[2] - 1;
-
-        assert(voxel.pos[0] >= 0 && voxel.pos[0] < size[0]);
-        assert(voxel.pos[1] >= 0 && voxel.pos[1] < size[1]);
-        assert(voxel.pos[2] >= 0 && voxel.pos[2] < size[2]);
-        utarray_push_back(voxels, &voxel);
+    // Exported area: the voxels inside the box.
+    for (i = 0; i < 3; i++) {
+        lo[i] = max(orig[i], (int)ceilf(box[3][i] - box[i][i]));
+        hi[i] = min(orig[i] + size[i], (int)ceilf(box[3][i] + box[i][i]));
     }
-
-    // Sort the voxels by xy columns in order they will be in the slabs.
-    utarray_sort(voxels, voxel_cmp);
-
-    // Iter the voxels and generates the slabs array.
     utarray_new(slabs, &slab_icd);
     utarray_extend_back(slabs); // Add an initial slab.
-    for (vox = (void*)utarray_front(voxels); vox;
-         vox = (void*)utarray_next(voxels, vox))
-    {
-        slab = (void*)utarray_back(slabs);
-        if (slab_append(slab, vox)) continue;
-        // Finished a slab, create a new one.
-        utarray_extend_back(slabs); // Add a new slab.
-        slab = (void*)utarray_back(slabs);
-        slab_append(slab, vox);     // Always works.
-    }
+    gen_slabs(volume, orig, size, lo, hi, &search, slabs);
 
     // Compute xoffsets and xyoffsetx.
     // Can we do it in a simpler way?
@@ -505,10 +548,10 @@ static int kvx_export(const file_format_t *format, const image_t *image,
     }
 
     utarray_free(slabs);
-    utarray_free(voxels);
     free(xoffsets);
     free(xyoffsets);
     free(palette);
+    search_palette_release(&search);
     fclose(file);
     return 0;
 }
@@ -21,6 +21,8 @@
 #include "goxel.h"
 #include "file_format.h"
 
+#include "../../ext_src/stb/stb_ds.h"
+
 #define READ(type, file) \
     ({ type v; size_t r = fread(&v, sizeof(v), 1, file); (void)r; v;})
 
@@ -54,18 +56,16 @@ static int vxl_import(const file_format_t *format, image_t *image,
 
     int ret = 0;
 
-    // The variable i here points to the location in the data array we
-    // are reading from
-    int i = 0;
     int x = 0; // Cursor location x
     int y = 0; // Cursor location y
     int columnI = 0; // Which vertical column we are currently on
     int columnCount = width * depth; // The total number of columns in the map
 
-    int size;
-    uint8_t *data = (uint8_t*)read_file(path, &size);
-
+    reader_t reader;
+    const uint8_t *data;
     uint8_t (*cube)[4] = NULL;
+
+    if (reader_open(&reader, path) != 0) return -1;
     cube = calloc(width * height * depth, sizeof(*cube));
 
     // The general strategy for this loader is to consume data from the input
@@ -73,21 +73,28 @@ static int vxl_import(const file_format_t *format, image_t *image,
     // We will move the cursor (x, y, zz) as we read the voxel data. The cursor
     // indicates the current location we are modifying
     while (columnI < columnCount) {
-        // i = span start byte
-        int N = data[i]; // length of span data (N * 4 bytes including span header)
-        int S = data[i + 1]; // Starting height of top colored run
-        int E = data[i + 2]; // Ending height of top colored run
+        // data = span start
+        data = reader.data + reader.pos;
+        CHECK(reader_remaining(&reader) >= 4);
+        int N = data[0]; // length of span data (N * 4 bytes including span header)
+        int S = data[1]; // Starting height of top colored run
+        int E = data[2]; // Ending height of top colored run
         int K = E - S + 1;
         int M, Z, zz, runLength;
 
+        CHECK(K >= 0 && E < height);
         if (N == 0) {
             Z = 0;
             M = 64;
+            CHECK(reader_skip(&reader, 4 * (1 + K)));
         } else {
             Z = (N - 1) - K;
+            CHECK(Z >= 0 && reader_skip(&reader, N * 4));
             // A of the next span
-            M = data[i + N * 4 + 3];
+            CHECK(reader_remaining(&reader) >= 4);
+            M = reader.data[reader.pos + 3];
         }
+        CHECK(M <= height && M - Z >= 0);
 
         int colorI = 0;
         // Execute the following loop twice:
@@ -104,9 +111,9 @@ static int vxl_import(const file_format_t *format, image_t *image,
             }
 
             for (int j = 0; j < runLength; j++) {
-                uint8_t blue = data[i + 4 + colorI * 4];
-                uint8_t green = data[i + 5 + colorI * 4];
-                uint8_t red = data[i + 6 + colorI * 4];
+                uint8_t blue = data[4 + colorI * 4];
+                uint8_t green = data[5 + colorI * 4];
+                uint8_t red = data[6 + colorI * 4];
 
                 int idx = AT(x, y, zz, height);
                 cube[idx][0] = red;
@@ -144,10 +151,6 @@ static int vxl_import(const file_format_t *format, image_t *image,
                 x = 0;
                 y++;
             }
-
-            i += 4 * (1 + K);
-        } else {
-            i += N * 4;
         }
     }
 
@@ -157,149 +160,203 @@ static int vxl_import(const file_format_t *format, image_t *image,
         bbox_from_extents(image->box, vec3_zero, width / 2, depth / 2, height / 2);
     }
 
+end:
+    if (ret) LOG_E("Invalid vxl file %s", path);
     free(cube);
-    free(data);
+    reader_close(&reader);
     return ret;
 }
 
-static int is_surface(int x, int y, int z, uint8_t map[512][512][64])
+/*
+ * The map is exported by bands of 16 rows, each split into groups of 16x16
+ * columns encoded in parallel.  Each column is a 64 bits mask of the solid
+ * voxels, so that we can find the surface voxels (the solid voxels with at
+ * least one empty neighbor, or on the border of the map) with a few bit
+ * operations on the neighbor columns.
+ */
+
+#define MAP_Z  64
+#define GROUP_SIZE 16
+// Size of the groups with their neighbor columns.
+#define GROUP_SPAN (GROUP_SIZE + 2)
+#define BIT(mask, k) (((mask) >> (k)) & 1)
+
+typedef struct {
+    uint8_t *buf;       // The encoded columns of the group.
+    int     ofs[GROUP_SIZE * GROUP_SIZE + 1];
+} group_t;
+
+typedef struct {
+    const volume_t *volume;
+    int     j0;         // First row of the band.
+    group_t groups[512 / GROUP_SIZE];
+} band_t;
+
+static void put_color(uint8_t **buf, const uint8_t c[4])
 {
-   if (map[x][y][z]==0) return 0;
-   if (x == 0 || x == 511) return 1;
-   if (y == 0 || y == 511) return 1;
-   if (z == 0 || z == 63) return 1;
-   if (x   >   0 && map[x-1][y][z]==0) return 1;
-   if (x+1 < 512 && map[x+1][y][z]==0) return 1;
-   if (y   >   0 && map[x][y-1][z]==0) return 1;
-   if (y+1 < 512 && map[x][y+1][z]==0) return 1;
-   if (z   >   0 && map[x][y][z-1]==0) return 1;
-   if (z+1 <  64 && map[x][y][z+1]==0) return 1;
-   return 0;
+    uint8_t *out = arraddnptr(*buf, 4);
+    out[0] = c[2];
+    out[1] = c[1];
+    out[2] = c[0];
+    out[3] = c[3];
 }
 
-static void write_color(FILE *f, uint32_t color)
+// Encode the spans of a column.  colors is indexed by height from the top.
+static void encode_column(uint64_t map, uint64_t surface,
+                          const uint8_t (*colors)[4], uint8_t **buf)
 {
-    uint8_t c[4];
-    memcpy(c, &color, 4);
-    fputc(c[2], f);
-    fputc(c[1], f);
-    fputc(c[0], f);
-    fputc(c[3], f);
+    int k = 0, z;
+    int air_start;
+    int top_colors_start;
+    int top_colors_end; // exclusive
+    int bottom_colors_start;
+    int bottom_colors_end; // exclusive
+    int top_colors_len;
+    int bottom_colors_len;
+    uint8_t *out;
+
+    while (k < MAP_Z) {
+        // find the air region
+        air_start = k;
+        while (k < MAP_Z && !BIT(map, k))
+            ++k;
+
+        // find the top region
+        top_colors_start = k;
+        while (k < MAP_Z && BIT(surface, k))
+            ++k;
+        top_colors_end = k;
+
+        // now skip past the solid voxels
+        while (k < MAP_Z && BIT(map, k) && !BIT(surface, k))
+            ++k;
+
+        // at the end of the solid voxels, we have colored voxels.
+        // in the "normal" case they're bottom colors; but it's
+        // possible to have air-color-solid-color-solid-color-air,
+        // which we encode as air-color-solid-0, 0-color-solid-air
+
+        // so figure out if we have any bottom colors at this point
+        bottom_colors_start = k;
+
+        z = k;
+        while (z < MAP_Z && BIT(surface, z))
+            ++z;
+
+        // If we reach the bottom, the bottom colors of this span are
+        // empty, because we'll emit them as top colors.  Otherwise these
+        // are real bottom colors.
+        if (z != MAP_Z) k = z;
+        bottom_colors_end = k;
+
+        // now we're ready to write a span
+        top_colors_len    = top_colors_end    - top_colors_start;
+        bottom_colors_len = bottom_colors_end - bottom_colors_start;
+
+        out = arraddnptr(*buf, 4);
+        out[0] = (k == MAP_Z) ? 0 : // last span
+                 top_colors_len + bottom_colors_len + 1;
+        out[1] = top_colors_start;
+        out[2] = top_colors_end - 1;
+        out[3] = air_start;
+
+        for (z = 0; z < top_colors_len; ++z)
+            put_color(buf, colors[top_colors_start + z]);
+        for (z = 0; z < bottom_colors_len; ++z)
+            put_color(buf, colors[bottom_colors_start + z]);
+    }
 }
 
-#define MAP_Z  64
-void write_map(const char *filename,
-               uint8_t map[512][512][64],
-               uint32_t color[512][512][64])
+static void encode_group(void *user, int g, int worker)
 {
-    int i,j,k;
-    FILE *f = fopen(filename, "wb");
-
-    for (j = 0; j < 512; ++j) {
-        for (i=0; i < 512; ++i) {
-            k = 0;
-            while (k < MAP_Z) {
-                int z;
-                int air_start;
-                int top_colors_start;
-                int top_colors_end; // exclusive
-                int bottom_colors_start;
-                int bottom_colors_end; // exclusive
-                int top_colors_len;
-                int bottom_colors_len;
-                int colors;
-
-                // find the air region
-                air_start = k;
-                while (k < MAP_Z && !map[i][j][k])
-                    ++k;
-
-                // find the top region
-                top_colors_start = k;
-                while (k < MAP_Z && is_surface(i,j,k,map))
-                    ++k;
-                top_colors_end = k;
-
-                // now skip past the solid voxels
-                while (k < MAP_Z && map[i][j][k] && !is_surface(i,j,k,map))
-                    ++k;
-
-                // at the end of the solid voxels, we have colored voxels.
-                // in the "normal" case they're bottom colors; but it's
-                // possible to have air-color-solid-color-solid-color-air,
-                // which we encode as air-color-solid-0, 0-color-solid-air
-
-                // so figure out if we have any bottom colors at this point
-                bottom_colors_start = k;
-
-                z = k;
-                while (z < MAP_Z && is_surface(i,j,z,map))
-                    ++z;
-
-                if (z == MAP_Z || 0)
-                    ; // in this case, the bottom colors of this span are
-                      // empty, because we'l emit as top colors
-                else {
-                    // otherwise, these are real bottom colors so we can write
-                    // them
-                    while (is_surface(i,j,k,map))
-                        ++k;
-                }
-                bottom_colors_end = k;
-
-                // now we're ready to write a span
-                top_colors_len    = top_colors_end    - top_colors_start;
-                bottom_colors_len = bottom_colors_end - bottom_colors_start;
-
-                colors = top_colors_len + bottom_colors_len;
-
-                if (k == MAP_Z)
-                    fputc(0,f); // last span
-                else
-                    fputc(colors+1, f);
-
-                fputc(top_colors_start, f);
-                fputc(top_colors_end-1, f);
-                fputc(air_start, f);
-
-                for (z=0; z < top_colors_len; ++z)
-                    write_color(f, color[i][j][top_colors_start + z]);
-                for (z=0; z < bottom_colors_len; ++z)
-                    write_color(f, color[i][j][bottom_colors_start + z]);
-            }
+    band_t *band = user;
+    group_t *group = &band->groups[g];
+    int i0 = g * GROUP_SIZE, j0 = band->j0;
+    int i, j, x, y, k, aabb[2][3];
+    uint64_t map[GROUP_SPAN][GROUP_SPAN], interior, surface;
+    uint8_t (*voxels)[4], colors[MAP_Z][4];
+
+    // Read the columns with their neighbors.  Column (i, j) is at position
+    // (256 - i, j - 256), from z = 31 at the top to z = -32.
+    voxels = jobs_get_scratch(GROUP_SPAN * GROUP_SPAN * MAP_Z * 4);
+    aabb[0][0] = 256 - (i0 + GROUP_SIZE);
+    aabb[0][1] = j0 - 1 - 256;
+    aabb[0][2] = 31 - (MAP_Z - 1);
+    aabb[1][0] = aabb[0][0] + GROUP_SPAN;
+    aabb[1][1] = aabb[0][1] + GROUP_SPAN;
+    aabb[1][2] = 32;
+    volume_get_span(band->volume, aabb, (uint8_t*)voxels, NULL);
+
+#define VOXEL(i, j, k) \
+    voxels[((MAP_Z - 1 - (k)) * GROUP_SPAN + ((j) - j0 + 1)) * GROUP_SPAN + \
+           (i0 + GROUP_SIZE - (i))]
+
+    for (j = j0 - 1; j < j0 + GROUP_SIZE + 1; j++)
+    for (i = i0 - 1; i < i0 + GROUP_SIZE + 1; i++) {
+        map[j - j0 + 1][i - i0 + 1] = 0;
+        for (k = 0; k < MAP_Z; k++) {
+            if (VOXEL(i, j, k)[3] > 127)
+                map[j - j0 + 1][i - i0 + 1] |= 1ULL << k;
         }
     }
-    fclose(f);
+
+    arrsetlen(group->buf, 0);
+    for (j = j0; j < j0 + GROUP_SIZE; j++)
+    for (i = i0; i < i0 + GROUP_SIZE; i++) {
+        x = i - i0 + 1;
+        y = j - j0 + 1;
+        interior = 0;
+        if (i > 0 && i < 511 && j > 0 && j < 511) {
+            interior = map[y][x - 1] & map[y][x + 1] &
+                       map[y - 1][x] & map[y + 1][x] &
+                       (map[y][x] << 1) & (map[y][x] >> 1);
+        }
+        surface = map[y][x] & ~interior;
+        for (k = 0; k < MAP_Z; k++) {
+            if (BIT(surface, k)) memcpy(colors[k], VOXEL(i, j, k), 4);
+        }
+        group->ofs[(j - j0) * GROUP_SIZE + (i - i0)] = arrlen(group->buf);
+        encode_column(map[y][x], surface, colors, &group->buf);
+    }
+    group->ofs[GROUP_SIZE * GROUP_SIZE] = arrlen(group->buf);
+#undef VOXEL
 }
 
 static int export_as_vxl(const file_format_t *format, const image_t *image,
                          const char *path)
 {
-    uint8_t (*map)[512][512][64];
-    uint32_t (*color)[512][512][64];
-    const volume_t *volume = goxel_get_layers_volume(image);
-    volume_iterator_t iter = {0};
-    uint8_t c[4];
-    int x, y, z, pos[3];
+    band_t *band;
+    const group_t *group;
+    int j, g, a, b, ret = 0;
+    FILE *file;
     assert(path);
 
-    map = calloc(1, sizeof(*map));
-    color = calloc(1, sizeof(*color));
-    for (z = 0; z < 64; z++)
-    for (y = 0; y < 512; y++)
-    for (x = 0; x < 512; x++) {
-        pos[0] = 256 - x;
-        pos[1] = y - 256;
-        pos[2] = 31 - z;
-        volume_get_at(volume, &iter, pos, c);
-        if (c[3] <= 127) continue;
-        (*map)[x][y][z] = 1;
-        memcpy(&((*color)[x][y][z]), c, 4);
+    file = fopen(path, "wb");
+    if (!file) {
+        LOG_E("Cannot open %s", path);
+        return -1;
+    }
+    band = calloc(1, sizeof(*band));
+    band->volume = goxel_get_layers_volume(image);
+    for (band->j0 = 0; band->j0 < 512; band->j0 += GROUP_SIZE) {
+        jobs_parallel_for(ARRAY_SIZE(band->groups), encode_group, band);
+        // The columns are stored row by row.
+        for (j = 0; j < GROUP_SIZE; j++)
+        for (g = 0; g < ARRAY_SIZE(band->groups); g++) {
+            group = &band->groups[g];
+            a = group->ofs[j * GROUP_SIZE];
+            b = group->ofs[(j + 1) * GROUP_SIZE];
+            if (fwrite(group->buf + a, 1, b - a, file) != b - a) ret = -1;
+        }
+        if (!file_format_report_progress((band->j0 + GROUP_SIZE) / 512.))
+            break;
     }
-    write_map(path, *map, *color);
-    free(map);
-    free(color);
-    return 0;
+    for (g = 0; g < ARRAY_SIZE(band->groups); g++)
+        arrfree(band->groups[g].buf);
+    free(band);
+    if (fclose(file) != 0) ret = -1;
+    if (ret) LOG_E("Cannot write %s", path);
+    return ret;
 }
 
 FILE_FORMAT_REGISTER(vxl,
@@ -308,4 +365,5 @@ FILE_FORMAT_REGISTER(vxl,
     .exts_desc = "vxl",
     .import_func = vxl_import,
     .export_func = export_as_vxl,
+    .thread_safe = true,
 )
@@ -18,13 +18,7 @@
 
 #include "file_format.h"
 #include "goxel.h"
-
-#pragma GCC diagnostic push
-#pragma GCC diagnostic ignored "-Wimplicit-const-int-float-conversion"
-#pragma GCC diagnostic ignored "-Wnan-infinity-disabled"
-#define VOXELIZER_IMPLEMENTATION
-#include "../ext_src/voxelizer/voxelizer.h"
-#pragma GCC diagnostic pop
+#include "xxhash.h"
 
 #define TINYOBJ_LOADER_C_IMPLEMENTATION
 #include "../ext_src/tinyobjloader/tinyobj_loader_c.h"
@@ -53,42 +47,70 @@ static export_options_t g_export_options = {
 
 static UT_icd line_icd = {sizeof(line_t), NULL, NULL, NULL};
 
-static int lines_find(UT_array *lines, const line_t *line, int search_nb)
+// A list of lines, with a hash table of their indices to quickly find
+// the duplicated ones.
+typedef struct {
+    UT_array *lines;
+    uint32_t *slots;    // Index + 1 of a line, or zero if the slot is empty.
+    uint32_t capacity;  // Number of slots, always a power of two.
+} lines_t;
+
+static void lines_init(lines_t *lines)
+{
+    memset(lines, 0, sizeof(*lines));
+    utarray_new(lines->lines, &line_icd);
+}
+
+static void lines_release(lines_t *lines)
 {
-    int i, len;
-    line_t *l;
-    len = utarray_len(lines);
-    for (i = len - 1; (i >= 0) && (i > len - 1 - search_nb); i--) {
-        l = (line_t*)utarray_eltptr(lines, i);
-        if (memcmp(l, line, sizeof(*line)) == 0) return i + 1;
+    utarray_free(lines->lines);
+    free(lines->slots);
+}
+
+static uint32_t *lines_find(lines_t *lines, const line_t *line)
+{
+    uint32_t i, mask = lines->capacity - 1;
+    const line_t *l;
+    for (i = XXH32(line, sizeof(*line), 0) & mask; ; i = (i + 1) & mask) {
+        if (!lines->slots[i]) return &lines->slots[i];
+        l = (line_t*)utarray_eltptr(lines->lines, lines->slots[i] - 1);
+        if (memcmp(l, line, sizeof(*line)) == 0) return &lines->slots[i];
+    }
+}
+
+static void lines_grow(lines_t *lines)
+{
+    uint32_t i;
+    lines->capacity = max(lines->capacity * 2, 1024);
+    free(lines->slots);
+    lines->slots = calloc(lines->capacity, sizeof(*lines->slots));
+    for (i = 0; i < utarray_len(lines->lines); i++) {
+        *lines_find(lines, (line_t*)utarray_eltptr(lines->lines, i)) = i + 1;
     }
-    return 0;
 }
 
 /*
  * Function: lines_add
  * Add a line entry into a list and return its index.
  *
- * Parameters:
- *   lines      - The list.
- *   line       - The new line we want to add.
- *   search_nb  - How far into the list we search for a similar line.  If
- *                a similar line is found we just return its index insead
- *                of adding a new one.
+ * If a similar line is already in the list, we just return its index
+ * instead of adding a new one.
  */
-static int lines_add(UT_array *lines, const line_t *line, int search_nb)
+static int lines_add(lines_t *lines, const line_t *line)
 {
-    int idx;
-    idx = lines_find(lines, line, search_nb);
-    if (idx) return idx;
-    utarray_push_back(lines, line);
-    return utarray_len(lines);
+    uint32_t *slot;
+    if (utarray_len(lines->lines) * 2 >= lines->capacity) lines_grow(lines);
+    slot = lines_find(lines, line);
+    if (!*slot) {
+        utarray_push_back(lines->lines, line);
+        *slot = utarray_len(lines->lines);
+    }
+    return *slot;
 }
 
 static int export(const volume_t *volume, const char *path, bool ply)
 {
-    // XXX: Merge faces that can be merged into bigger ones.
-    //      Allow to chose between quads or triangles.
+    // XXX: Allow to chose between quads or triangles.
     //      Also export mlt file for the colors.
     voxel_vertex_t* verts;
     float v[3];
@@ -98,7 +120,8 @@ static int export(const volume_t *volume, const char *path, bool ply)
     FILE *out;
     const int N = BLOCK_SIZE;
     int size = 0, subdivide;
-    UT_array *lines_f, *lines_v, *lines_vn;
+    UT_array *lines_f;
+    lines_t lines_v, lines_vn;
     line_t line, face, *line_ptr = NULL;
     volume_iterator_t iter;
     static const float ZUP2YUP[4][4] = {
@@ -106,8 +129,8 @@ static int export(const volume_t *volume, const char *path, bool ply)
     };
 
     utarray_new(lines_f, &line_icd);
-    utarray_new(lines_v, &line_icd);
-    utarray_new(lines_vn, &line_icd);
+    lines_init(&lines_v);
+    lines_init(&lines_vn);
     verts = calloc(N * N * N * 6 * 4, sizeof(*verts));
     face = (line_t){};
     iter = volume_get_iterator(volume,
@@ -119,7 +142,8 @@ static int export(const volume_t *volume, const char *path, bool ply)
         }
         mat4_itranslate(mat, bpos[0], bpos[1], bpos[2]);
         nb_elems = volume_generate_vertices(volume, bpos,
-                                    goxel.rend.settings.effects, verts,
+                                    goxel.rend.settings.effects |
+                                    EFFECT_GREEDY_MESH, verts,
                                     &size, &subdivide);
         for (i = 0; i < nb_elems; i++) {
             // Put the vertices.
@@ -131,8 +155,7 @@ static int export(const volume_t *volume, const char *path, bool ply)
                 memcpy(c, verts[i * size + j].color, 3);
                 line = (line_t){
                     .v = {v[0], v[1], v[2]}, .c = {c[0], c[1], c[2]}};
-                // XXX: not sure about the search nb value to use here.
-                face.vs[j] = lines_add(lines_v, &line, 1024);
+                face.vs[j] = lines_add(&lines_v, &line);
             }
             // Put the normals
             for (j = 0; j < size; j++) {
@@ -141,9 +164,9 @@ static int export(const volume_t *volume, const char *path, bool ply)
                 v[2] = verts[i * size + j].normal[2];
                 mat4_mul_dir3(mat, v, v);
                 line = (line_t){.vn = {v[0], v[1], v[2]}};
-                face.vns[j] = lines_add(lines_vn, &line, 512);
+                face.vns[j] = lines_add(&lines_vn, &line);
             }
-            lines_add(lines_f, &face, 0);
+            utarray_push_back(lines_f, &face);
         }
     }
     out = fopen(path, "w");
@@ -151,7 +174,7 @@ static int export(const volume_t *volume, const char *path, bool ply)
         fprintf(out, "ply\n");
         fprintf(out, "format ascii 1.0\n");
         fprintf(out, "comment Generated from Goxel " GOXEL_VERSION_STR "\n");
-        fprintf(out, "element vertex %d\n", utarray_len(lines_v));
+        fprintf(out, "element vertex %d\n", utarray_len(lines_v.lines));
         fprintf(out, "property float x\n");
         fprintf(out, "property float y\n");
         fprintf(out, "property float z\n");
@@ -161,7 +184,7 @@ static int export(const volume_t *volume, const char *path, bool ply)
         fprintf(out, "element face %d\n", utarray_len(lines_f));
         fprintf(out, "property list uchar int vertex_indices\n");
         fprintf(out, "end_header\n");
-        while( (line_ptr = (line_t*)utarray_next(lines_v, line_ptr))) {
+        while( (line_ptr = (line_t*)utarray_next(lines_v.lines, line_ptr))) {
             fprintf(out, "%g %g %g %f %f %f\n",
                     line_ptr->v[0], line_ptr->v[1], line_ptr->v[2],
                     line_ptr->c[0] / 255.,
@@ -182,14 +205,14 @@ static int export(const volume_t *volume, const char *path, bool ply)
         }
     } else {
         fprintf(out, "# Goxel " GOXEL_VERSION_STR "\n");
-        while( (line_ptr = (line_t*)utarray_next(lines_v, line_ptr))) {
+        while( (line_ptr = (line_t*)utarray_next(lines_v.lines, line_ptr))) {
             fprintf(out, "v %g %g %g %f %f %f\n",
                     line_ptr->v[0], line_ptr->v[1], line_ptr->v[2],
                     line_ptr->c[0] / 255.,
                     line_ptr->c[1] / 255.,
                     line_ptr->c[2] / 255.);
         }
-        while( (line_ptr = (line_t*)utarray_next(lines_vn, line_ptr))) {
+        while( (line_ptr = (line_t*)utarray_next(lines_vn.lines, line_ptr))) {
             fprintf(out, "vn %g %g %g\n",
                     line_ptr->vn[0], line_ptr->vn[1], line_ptr->vn[2]);
         }
@@ -210,8 +233,8 @@ static int export(const volume_t *volume, const char *path, bool ply)
     }
     fclose(out);
     utarray_free(lines_f);
-    utarray_free(lines_v);
-    utarray_free(lines_vn);
+    lines_release(&lines_v);
+    lines_release(&lines_vn);
     free(verts);
     return 0;
 }
@@ -239,12 +262,19 @@ static void get_file_data(void *ctx, const char *filename, const int is_mtl,
                           const char *obj_filename, char **data, size_t *len)
 {
     int size;
+    char dir[1024], path[2048];
 
     if (!filename) {
         (*data) = NULL;
         (*len) = 0;
         return;
     }
+    // The mtl files are relative to the obj file.
+    if (is_mtl && obj_filename && filename[0] != '/') {
+        path_dirname(obj_filename, dir, sizeof(dir));
+        snprintf(path, sizeof(path), "%s/%s", dir, filename);
+        filename = path;
+    }
     *data = read_file(filename, &size);
     *len = size;
 }
@@ -257,6 +287,41 @@ static void import_gui(file_format_t *format)
     gui_input_float("Resolution", &g_resolution, 0.01, 0, 100000, "%.3f");
 }
 
+static bool on_progress(void *user, float p)
+{
+    double *last_time = user;
+    if (sys_get_time() - *last_time >= 1) {
+        LOG_I("Voxelize mesh: %d%%", (int)(p * 100));
+        *last_time = sys_get_time();
+    }
+    return file_format_report_progress(p);
+}
+
+static void load_material(const tinyobj_material_t *material,
+                          const char *path, voxelizer_material_t *out)
+{
+    char dir[1024], tex_path[2048];
+    int i;
+
+    for (i = 0; i < 3; i++)
+        out->color[i] = clamp(material->diffuse[i], 0, 1) * 255;
+    out->color[3] = 255;
+    if (!material->diffuse_texname) return;
+    path_dirname(path, dir, sizeof(dir));
+    snprintf(tex_path, sizeof(tex_path), "%s/%s",
+             dir, material->diffuse_texname);
+    out->texture = img_read(tex_path, &out->w, &out->h, &out->bpp);
+    if (!out->texture) {
+        LOG_W("Cannot load texture %s", tex_path);
+        return;
+    }
+    // Gray textures are not supported.
+    if (out->bpp < 3) {
+        free((void*)out->texture);
+        out->texture = NULL;
+    }
+}
+
 static int wavefront_import(const file_format_t *format, image_t *image,
                             const char *path)
 {
@@ -266,13 +331,15 @@ static int wavefront_import(const file_format_t *format, image_t *image,
     size_t num_shapes;
     tinyobj_material_t *materials = NULL;
     size_t num_materials;
-    int i, pos[3];
-    uint8_t color[4];
+    int i, j, nb = 0;
     float res = g_resolution;
     unsigned int flags;
-    vx_mesh_t *mesh;
-    vx_point_cloud_t *cloud;
-    volume_iterator_t iter = {0};
+    float (*vertices)[3];
+    int (*triangles)[3], (*triangles_uv)[3], *material_ids;
+    voxelizer_material_t *mats;
+    voxelizer_mesh_t mesh;
+    const tinyobj_vertex_index_t *face;
+    double last_time;
     layer_t *layer;
 
     // XXX TODO: free the file data at the end!
@@ -284,40 +351,58 @@ static int wavefront_import(const file_format_t *format, image_t *image,
         return -1;
     }
 
-    mesh = vx_mesh_alloc(attrib.num_vertices, attrib.num_faces);
+    vertices = calloc(attrib.num_vertices, sizeof(*vertices));
     for (i = 0; i < attrib.num_vertices; i++) {
-        mesh->vertices[i].x = attrib.vertices[i * 3 + 0];
-        mesh->vertices[i].z = attrib.vertices[i * 3 + 1];
-        mesh->vertices[i].y = -attrib.vertices[i * 3 + 2];
-        mesh->colors[i].r = 255;
-        mesh->colors[i].g = 255;
-        mesh->colors[i].b = 255;
+        vertices[i][0] = attrib.vertices[i * 3 + 0] / res;
+        vertices[i][2] = attrib.vertices[i * 3 + 1] / res;
+        vertices[i][1] = -attrib.vertices[i * 3 + 2] / res;
     }
-    for (i = 0; i < attrib.num_faces; i++) {
-        mesh->indices[i] = attrib.faces[i].v_idx;
+    triangles = calloc(attrib.num_face_num_verts, sizeof(*triangles));
+    triangles_uv = calloc(attrib.num_face_num_verts, sizeof(*triangles_uv));
+    material_ids = calloc(attrib.num_face_num_verts, sizeof(*material_ids));
+    for (i = 0; i < attrib.num_face_num_verts; i++) {
+        if (i * 3 + 3 > attrib.num_faces) break;
+        face = &attrib.faces[i * 3];
+        for (j = 0; j < 3; j++) {
+            if (face[j].v_idx < 0 || face[j].v_idx >= attrib.num_vertices)
+                break;
+            triangles[nb][j] = face[j].v_idx;
+            triangles_uv[nb][j] = face[j].vt_idx;
+        }
+        if (j < 3) continue;
+        material_ids[nb] = attrib.material_ids[i];
+        nb++;
     }
+    mats = calloc(max(num_materials, 1), sizeof(*mats));
+    for (i = 0; i < num_materials; i++)
+        load_material(&materials[i], path, &mats[i]);
 
+    mesh = (voxelizer_mesh_t) {
+        .nb_vertices = attrib.num_vertices,
+        .vertices = (const float (*)[3])vertices,
+        .nb_uvs = attrib.num_texcoords,
+        .uvs = (const float (*)[2])attrib.texcoords,
+        .nb_triangles = nb,
+        .triangles = (const int (*)[3])triangles,
+        .triangles_uv = (const int (*)[3])triangles_uv,
+        .materials = material_ids,
+        .nb_materials = num_materials,
+        .materials_def = mats,
+    };
+    layer = image_add_layer(image, NULL);
+    last_time = sys_get_time();
+    err = mesh_voxelize(layer->volume, &mesh, on_progress, &last_time);
+
+    for (i = 0; i < num_materials; i++) free((void*)mats[i].texture);
+    free(mats);
+    free(vertices);
+    free(triangles);
+    free(triangles_uv);
+    free(material_ids);
     tinyobj_attrib_free(&attrib);
     tinyobj_shapes_free(shapes, num_shapes);
     tinyobj_materials_free(materials, num_materials);
-
-    cloud = vx_voxelize_pc(mesh, res, res, res, res * 0.1);
-
-    layer = image_add_layer(image, NULL);
-    for (i = 0; i < cloud->nvertices; i++) {
-        pos[0] = floor(cloud->vertices[i].x / res);
-        pos[1] = floor(cloud->vertices[i].y / res);
-        pos[2] = floor(cloud->vertices[i].z / res);
-        color[0] = cloud->colors[i].r;
-        color[1] = cloud->colors[i].g;
-        color[2] = cloud->colors[i].b;
-        color[3] = 255;
-        volume_set_at(layer->volume, &iter, pos, color);
-    }
-
-    vx_point_cloud_free(cloud);
-
-    return 0;
+    return err;
 }
 
 FILE_FORMAT_REGISTER(obj,
@@ -328,6 +413,7 @@ FILE_FORMAT_REGISTER(obj,
     .export_func = wavefront_export,
     .import_func = wavefront_import,
     .import_gui = import_gui,
+    .thread_safe = true,
 )
 
 FILE_FORMAT_REGISTER(ply,
@@ -336,4 +422,5 @@ FILE_FORMAT_REGISTER(ply,
     .exts_desc = "ply",
     .export_gui = export_gui,
     .export_func = ply_export,
+    .thread_safe = true,
 )
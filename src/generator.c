@@ -0,0 +1,406 @@
+/* Goxel 3D voxels editor
+ *
+ * copyright (c) 2024 Guillaume Chereau <guillaume@noctua-software.com>
+ *
+ * Goxel is free software: you can redistribute it and/or modify it under the
+ * terms of the GNU General Public License as published by the Free Software
+ * Foundation, either version 3 of the License, or (at your option) any later
+ * version.
+
+ * Goxel is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+
+ * You should have received a copy of the GNU General Public License along with
+ * goxel.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "goxel.h"
+
+#include <inttypes.h>
+#include <limits.h>
+
+#define N TILE_SIZE
+
+// Number of tiles generated in parallel before we add them to the volume.
+#define BATCH_SIZE 4096
+
+// Number of clones in the clones scene.
+#define NB_CLONES 15
+
+typedef struct gen gen_t;
+struct gen {
+    uint32_t    seed;
+    int         aabb[2][3];     // Box of the generated voxels.
+    float       center[3];
+    float       radius;
+    float       thickness;
+    uint8_t     color[4];
+    // Fill the voxels of a tile, return false if the tile is empty.
+    bool (*tile_func)(const gen_t *gen, const int pos[3], uint8_t (*out)[4]);
+};
+
+static uint32_t hash3(uint32_t seed, int x, int y, int z)
+{
+    uint32_t h = seed * 0x9e3779b1u;
+    h ^= x * 0x85ebca77u;
+    h ^= y * 0xc2b2ae3du;
+    h ^= z * 0x27d4eb2fu;
+    h ^= h >> 15;
+    h *= 0x2c1b3c6du;
+    h ^= h >> 12;
+    h *= 0x297a2d39u;
+    h ^= h >> 15;
+    return h;
+}
+
+// Value noise in [0, 1].
+static float noise2(uint32_t seed, float x, float y)
+{
+    int ix = floorf(x), iy = floorf(y);
+    float fx = x - ix, fy = y - iy;
+    float v00, v10, v01, v11;
+
+    fx = fx * fx * (3 - 2 * fx);
+    fy = fy * fy * (3 - 2 * fy);
+    v00 = hash3(seed, ix, iy, 0) / 4294967295.f;
+    v10 = hash3(seed, ix + 1, iy, 0) / 4294967295.f;
+    v01 = hash3(seed, ix, iy + 1, 0) / 4294967295.f;
+    v11 = hash3(seed, ix + 1, iy + 1, 0) / 4294967295.f;
+    v00 += (v10 - v00) * fx;
+    v01 += (v11 - v01) * fx;
+    return v00 + (v01 - v00) * fy;
+}
+
+static float fbm2(uint32_t seed, float x, float y)
+{
+    float ret = 0, amp = 0.5, total = 0;
+    int i;
+    for (i = 0; i < 5; i++) {
+        ret += noise2(seed + i, x, y) * amp;
+        total += amp;
+        x *= 2;
+        y *= 2;
+        amp /= 2;
+    }
+    return ret / total;
+}
+
+static bool tile_intersects(const gen_t *gen, const int pos[3])
+{
+    int i;
+    for (i = 0; i < 3; i++) {
+        if (pos[i] >= gen->aabb[1][i] || pos[i] + N <= gen->aabb[0][i])
+            return false;
+    }
+    return true;
+}
+
+static bool terrain_tile(const gen_t *gen, const int pos[3],
+                         uint8_t (*out)[4])
+{
+    int x, y, z, h, hmax = INT_MIN, heights[N][N];
+    float scale = max(gen->aabb[1][0] - gen->aabb[0][0], 1) / 4.f;
+    int size = gen->aabb[1][2] - gen->aabb[0][2];
+    uint8_t *v;
+
+    if (!tile_intersects(gen, pos)) return false;
+    for (y = 0; y < N; y++)
+    for (x = 0; x < N; x++) {
+        h = gen->aabb[0][2] + size / 4 +
+            fbm2(gen->seed, (pos[0] + x) / scale, (pos[1] + y) / scale) *
+            size / 2;
+        if (    pos[0] + x >= gen->aabb[1][0] || pos[0] + x < gen->aabb[0][0]
+             || pos[1] + y >= gen->aabb[1][1] || pos[1] + y < gen->aabb[0][1])
+            h = INT_MIN;
+        heights[y][x] = h;
+        hmax = max(hmax, h);
+    }
+    if (hmax <= pos[2]) return false;
+
+    for (z = 0; z < N; z++)
+    for (y = 0; y < N; y++)
+    for (x = 0; x < N; x++) {
+        v = out[z * N * N + y * N + x];
+        h = heights[y][x];
+        if (pos[2] + z >= h || pos[2] + z < gen->aabb[0][2]) {
+            memset(v, 0, 4);
+        } else if (pos[2] + z < h - 3) {
+            memcpy(v, (uint8_t[]){120, 100, 80, 255}, 4);
+        } else {
+            if (h - gen->aabb[0][2] > size * 0.6)
+                memcpy(v, (uint8_t[]){240, 240, 250, 255}, 4);
+            else
+                memcpy(v, (uint8_t[]){80, 160, 60, 255}, 4);
+            // Add some variations to the surface.
+            v[1] -= hash3(gen->seed, pos[0] + x, pos[1] + y, pos[2] + z) % 16;
+        }
+    }
+    return true;
+}
+
+static bool sphere_tile(const gen_t *gen, const int pos[3],
+                        uint8_t (*out)[4])
+{
+    int i, x, y, z;
+    float p[3], d, dmin = 0, dmax = 0, a, b;
+    float rin = gen->radius - gen->thickness;
+    bool ret = false;
+    uint8_t *v;
+
+    // Distance bounds of the tile to the center.
+    for (i = 0; i < 3; i++) {
+        a = pos[i] - gen->center[i];
+        b = pos[i] + N - gen->center[i];
+        if (a > 0) dmin += a * a;
+        if (b < 0) dmin += b * b;
+        dmax += max(a * a, b * b);
+    }
+    if (dmin >= gen->radius * gen->radius) return false;
+    if (gen->thickness > 0 && dmax < rin * rin) return false;
+
+    for (z = 0; z < N; z++)
+    for (y = 0; y < N; y++)
+    for (x = 0; x < N; x++) {
+        v = out[z * N * N + y * N + x];
+        vec3_sub(VEC(pos[0] + x + 0.5, pos[1] + y + 0.5, pos[2] + z + 0.5),
+                 gen->center, p);
+        d = vec3_norm(p);
+        if (d >= gen->radius || (gen->thickness > 0 && d < rin)) {
+            memset(v, 0, 4);
+            continue;
+        }
+        ret = true;
+        if (gen->thickness > 0) {
+            // Color from the direction, so that all the tiles differ.
+            v[0] = 128 + p[0] / d * 127;
+            v[1] = 128 + p[1] / d * 127;
+            v[2] = 128 + p[2] / d * 127;
+            v[3] = 255;
+        } else {
+            memcpy(v, gen->color, 4);
+        }
+    }
+    return ret;
+}
+
+static bool solid_tile(const gen_t *gen, const int pos[3], uint8_t (*out)[4])
+{
+    int x, y, z;
+    uint32_t h = hash3(gen->seed, pos[0], pos[1], pos[2]);
+    uint8_t color[4] = {h, h >> 8, h >> 16, 255};
+
+    if (!tile_intersects(gen, pos)) return false;
+    for (z = 0; z < N; z++)
+    for (y = 0; y < N; y++)
+    for (x = 0; x < N; x++) {
+        if (    pos[0] + x >= gen->aabb[0][0] && pos[0] + x < gen->aabb[1][0]
+             && pos[1] + y >= gen->aabb[0][1] && pos[1] + y < gen->aabb[1][1]
+             && pos[2] + z >= gen->aabb[0][2] && pos[2] + z < gen->aabb[1][2])
+            memcpy(out[z * N * N + y * N + x], color, 4);
+        else
+            memset(out[z * N * N + y * N + x], 0, 4);
+    }
+    return true;
+}
+
+typedef struct {
+    const gen_t *gen;
+    int         (*pos)[3];
+    tile_data_t **data;
+} batch_t;
+
+static void batch_func(void *user, int i, int worker)
+{
+    batch_t *batch = user;
+    uint8_t (*voxels)[4];
+
+    voxels = malloc(N * N * N * 4);
+    if (batch->gen->tile_func(batch->gen, batch->pos[i], voxels))
+        batch->data[i] = volume_tile_data_new(voxels);
+    free(voxels);
+}
+
+static void flush_batch(volume_t *volume, batch_t *batch, int nb)
+{
+    int i;
+
+    jobs_parallel_for(nb, batch_func, batch);
+    for (i = 0; i < nb; i++) {
+        if (!batch->data[i]) continue;
+        volume_set_tile_data(volume, batch->pos[i], batch->data[i]);
+        volume_tile_data_release(batch->data[i]);
+        batch->data[i] = NULL;
+    }
+}
+
+static void gen_volume(volume_t *volume, const gen_t *gen)
+{
+    int x, y, z, tmin[3], tmax[3], i, nb = 0;
+    batch_t batch = {gen};
+
+    for (i = 0; i < 3; i++) {
+        tmin[i] = (int)floor((float)gen->aabb[0][i] / N) * N;
+        tmax[i] = gen->aabb[1][i];
+    }
+    batch.pos = calloc(BATCH_SIZE, sizeof(*batch.pos));
+    batch.data = calloc(BATCH_SIZE, sizeof(*batch.data));
+    for (z = tmin[2]; z < tmax[2]; z += N)
+    for (y = tmin[1]; y < tmax[1]; y += N)
+    for (x = tmin[0]; x < tmax[0]; x += N) {
+        batch.pos[nb][0] = x;
+        batch.pos[nb][1] = y;
+        batch.pos[nb][2] = z;
+        if (++nb == BATCH_SIZE) {
+            flush_batch(volume, &batch, nb);
+            nb = 0;
+        }
+    }
+    flush_batch(volume, &batch, nb);
+    free(batch.pos);
+    free(batch.data);
+}
+
+static void set_aabb(gen_t *gen, int w, int h, int d)
+{
+    gen->aabb[0][0] = -w / 2;
+    gen->aabb[0][1] = -h / 2;
+    gen->aabb[0][2] = 0;
+    gen->aabb[1][0] = gen->aabb[0][0] + w;
+    gen->aabb[1][1] = gen->aabb[0][1] + h;
+    gen->aabb[1][2] = d;
+}
+
+static void gen_sphere(volume_t *volume, uint32_t seed, const float c[3],
+                       float radius, float thickness, const uint8_t color[4])
+{
+    gen_t gen = {.seed = seed, .radius = radius, .thickness = thickness,
+                 .tile_func = sphere_tile};
+    int i;
+
+    vec3_copy(c, gen.center);
+    if (color) memcpy(gen.color, color, 4);
+    for (i = 0; i < 3; i++) {
+        gen.aabb[0][i] = floorf(c[i] - radius);
+        gen.aabb[1][i] = ceilf(c[i] + radius);
+    }
+    gen_volume(volume, &gen);
+}
+
+int generator_fill_volume(volume_t *volume, const char *type,
+                          int64_t nb_voxels, uint32_t seed)
+{
+    gen_t gen = {.seed = seed};
+    int s;
+    float r;
+
+    nb_voxels = max(nb_voxels, 1);
+    if (strcmp(type, "terrain") == 0) {
+        // The average height is half the size.
+        s = round(cbrt(2.0 * nb_voxels));
+        set_aabb(&gen, s, s, s);
+        gen.tile_func = terrain_tile;
+        gen_volume(volume, &gen);
+        return 0;
+    }
+    if (strcmp(type, "solid") == 0) {
+        s = round(cbrt((double)nb_voxels));
+        set_aabb(&gen, s, s, s);
+        gen.tile_func = solid_tile;
+        gen_volume(volume, &gen);
+        return 0;
+    }
+    if (strcmp(type, "shell") == 0) {
+        // With a thickness of r / 16, the volume is about pi / 4 * r^3.
+        r = max(cbrt(4 * nb_voxels / M_PI), 4);
+        gen_sphere(volume, seed, VEC(0, 0, r), r, max(r / 16, 2), NULL);
+        return 0;
+    }
+    return -1;
+}
+
+static layer_t *add_layer(image_t *image, const char *name)
+{
+    layer_t *layer = image->active_layer;
+    if (    !layer || !layer->volume || !volume_is_empty(layer->volume) ||
+            layer->base_id || layer->shape || layer->image)
+        layer = image_add_layer(image, NULL);
+    snprintf(layer->name, sizeof(layer->name), "%s", name);
+    return layer;
+}
+
+static void gen_layers(image_t *image, int64_t nb_voxels, uint32_t seed)
+{
+    int i, nb, grid;
+    float d, spacing, pos[3];
+    uint32_t h;
+    char name[64];
+    layer_t *layer;
+
+    nb = clamp((int)round(cbrt((double)nb_voxels)), 2, 1000);
+    // Diameter of the spheres.
+    d = max(cbrt(6.0 * nb_voxels / nb / M_PI), 2);
+    spacing = d * 1.5;
+    grid = ceil(cbrt(nb));
+    for (i = 0; i < nb; i++) {
+        h = hash3(seed, i, 0, 0);
+        pos[0] = (i % grid - grid / 2) * spacing;
+        pos[1] = (i / grid % grid - grid / 2) * spacing;
+        pos[2] = (i / grid / grid) * spacing + d / 2;
+        snprintf(name, sizeof(name), "sphere %d", i + 1);
+        layer = add_layer(image, name);
+        gen_sphere(layer->volume, seed, pos, d / 2, 0,
+                   (uint8_t[]){h, h >> 8, h >> 16, 255});
+    }
+}
+
+static void gen_clones(image_t *image, int64_t nb_voxels, uint32_t seed)
+{
+    layer_t *layer;
+    int i, aabb[2][3];
+
+    layer = add_layer(image, "terrain");
+    generator_fill_volume(layer->volume, "terrain",
+                          nb_voxels / (NB_CLONES + 1), seed);
+    volume_get_bbox(layer->volume, aabb, false);
+    for (i = 0; i < NB_CLONES; i++) {
+        layer = image_clone_layer(image, layer);
+        snprintf(layer->name, sizeof(layer->name), "clone %d", i + 1);
+        mat4_itranslate(layer->mat, aabb[1][0] - aabb[0][0] + N, 0, 0);
+        layer->base_volume_key = 0; // Force the update.
+    }
+    image_update(image, false);
+}
+
+bool generator_has_type(const char *type)
+{
+    const char *types[] = {"terrain", "shell", "solid", "layers", "clones"};
+    int i;
+    for (i = 0; i < ARRAY_SIZE(types); i++) {
+        if (strcmp(type, types[i]) == 0) return true;
+    }
+    return false;
+}
+
+int generator_run(image_t *image, const char *type, int64_t nb_voxels,
+                  uint32_t seed)
+{
+    layer_t *layer;
+
+    if (!generator_has_type(type)) {
+        LOG_E("Unknown scene type: %s", type);
+        return -1;
+    }
+    LOG_I("Generate %s scene of %" PRId64 " voxels", type, nb_voxels);
+    if (strcmp(type, "layers") == 0) {
+        gen_layers(image, nb_voxels, seed);
+    } else if (strcmp(type, "clones") == 0) {
+        gen_clones(image, nb_voxels, seed);
+    } else {
+        layer = add_layer(image, type);
+        generator_fill_volume(layer->volume, type, nb_voxels, seed);
+    }
+    image_auto_resize(image);
+    return 0;
+}
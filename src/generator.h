@@ -0,0 +1,88 @@
+/* Goxel 3D voxels editor
+ *
+ * copyright (c) 2024 Guillaume Chereau <guillaume@noctua-software.com>
+ *
+ * Goxel is free software: you can redistribute it and/or modify it under the
+ * terms of the GNU General Public License as published by the Free Software
+ * Foundation, either version 3 of the License, or (at your option) any later
+ * version.
+
+ * Goxel is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+
+ * You should have received a copy of the GNU General Public License along with
+ * goxel.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* ######## Section: Generator ############################################
+ * Generate synthetic scenes of a given number of voxels, to use as
+ * fixtures for the benchmarks and the stress tests.
+ *
+ * The scenes only depend on the type, size and seed, so that the same
+ * content can be generated again on any machine.  The voxels are generated
+ * tile by tile in parallel, so that we can create scenes of up to a
+ * billion voxels.
+ *
+ * The types are:
+ *   terrain    - A noise height map, rock inside with grass and snow on
+ *                the surface.
+ *   shell      - A hollow sphere with a thin border.
+ *   solid      - A dense cube made of uniform tiles.
+ *   layers     - Many small spheres, each one in its own layer.
+ *   clones     - A terrain followed by a chain of clone layers, each one
+ *                cloned from the previous one.
+ */
+
+#ifndef GENERATOR_H
+#define GENERATOR_H
+
+#include "image.h"
+#include "volume.h"
+
+/*
+ * Function: generator_has_type
+ * Test whether a scene type is supported.
+ */
+bool generator_has_type(const char *type);
+
+/*
+ * Function: generator_fill_volume
+ * Generate the voxels of a single volume scene.
+ *
+ * Only the terrain, shell and solid types are supported.  The generated
+ * tiles replace the tiles of the volume.
+ *
+ * Parameters:
+ *   volume     - The volume.
+ *   type       - Type of the scene.
+ *   nb_voxels  - Approximate number of voxels to generate.
+ *   seed       - Seed of the random values.
+ *
+ * Return:
+ *   0 on success, -1 if the type is not supported.
+ */
+int generator_fill_volume(volume_t *volume, const char *type,
+                          int64_t nb_voxels, uint32_t seed);
+
+/*
+ * Function: generator_run
+ * Generate a scene into new layers of an image.
+ *
+ * If the active layer of the image is empty, it is used for the first
+ * generated layer.
+ *
+ * Parameters:
+ *   image      - The image.
+ *   type       - Type of the scene.
+ *   nb_voxels  - Approximate total number of voxels to generate.
+ *   seed       - Seed of the random values.
+ *
+ * Return:
+ *   0 on success, -1 if the type is not supported.
+ */
+int generator_run(image_t *image, const char *type, int64_t nb_voxels,
+                  uint32_t seed);
+
+#endif // GENERATOR_H
@@ -31,39 +31,124 @@
 // The global goxel instance.
 goxel_t goxel = {};
 
-texture_t *texture_new_image(const char *path, int flags)
+// Read an image, downscaled by an integer factor so that it fits into the
+// max image size.
+static uint8_t *read_image(const char *path, int *w, int *h, int *bpp,
+                           int *factor)
 {
     char *data;
-    uint8_t *img;
+    uint8_t *img, *small;
     bool need_to_free = false;
     int size;
-    int w, h, bpp = 0;
-    texture_t *tex;
+    const int max_size = goxel.image_max_size;
 
+    *factor = 1;
     if (str_startswith(path, "asset://")) {
         data = (char*)assets_get(path, &size);
     } else {
         data = read_file(path, &size);
         need_to_free = true;
     }
-    img = img_read_from_mem(data, size, &w, &h, &bpp);
+    if (!data) return NULL;
+    img = img_read_from_mem(data, size, w, h, bpp);
+    if (need_to_free) free(data);
+    if (!img || max_size <= 0 || max(*w, *h) <= max_size) return img;
+
+    *factor = (max(*w, *h) + max_size - 1) / max_size;
+    LOG_I("Downscale %s by %d", path, *factor);
+    small = malloc((size_t)(*w / *factor) * (*h / *factor) * *bpp);
+    img_downscale(img, *w, *h, *bpp, *factor, small);
+    free(img);
+    *w /= *factor;
+    *h /= *factor;
+    return small;
+}
+
+texture_t *texture_new_image(const char *path, int flags)
+{
+    uint8_t *img;
+    int w, h, bpp = 0, factor;
+    texture_t *tex;
+
+    img = read_image(path, &w, &h, &bpp, &factor);
+    if (!img) return NULL;
     tex = texture_new_from_buf(img, w, h, bpp, flags);
     tex->path = strdup(path);
     free(img);
-    if (need_to_free) free(data);
     return tex;
 }
 
+// Image plane being decoded in the background.
+typedef struct image_plane_task image_plane_task_t;
+struct image_plane_task {
+    image_plane_task_t *next, *prev;
+    char        *path;
+    uint8_t     *data;
+    int         w, h, bpp;      // Size of the decoded data.
+    int         factor;         // Downscale factor of the data.
+    int         done;
+};
+
+static image_plane_task_t *g_image_plane_tasks = NULL;
+
+static void image_plane_task_run(void *user)
+{
+    image_plane_task_t *task = user;
+    task->data = read_image(task->path, &task->w, &task->h, &task->bpp,
+                            &task->factor);
+    __atomic_store_n(&task->done, 1, __ATOMIC_RELEASE);
+}
+
+static void add_image_plane(const image_plane_task_t *task)
+{
+    layer_t *layer;
+    texture_t *tex;
+    int w = task->w * task->factor, h = task->h * task->factor;
+
+    tex = texture_new_from_buf(task->data, task->w, task->h, task->bpp,
+                               TF_NEAREST | TF_MIPMAP);
+    tex->path = strdup(task->path);
+    layer = image_add_layer(goxel.image, NULL);
+    sprintf(layer->name, "img");
+    layer->image = tex;
+    // Adjust position for odd sized images.
+    if (w % 2 == 1)
+        mat4_itranslate(layer->mat, 0.5, 0, 0);
+    if (h % 2 == 1)
+        mat4_itranslate(layer->mat, 0, 0.5, 0);
+    mat4_iscale(layer->mat, w, h, 1);
+    image_history_push(goxel.image);
+}
+
+// Add the layers of the image planes that are done decoding.
+static void image_plane_tasks_update(bool wait)
+{
+    image_plane_task_t *task, *tmp;
+    DL_FOREACH_SAFE(g_image_plane_tasks, task, tmp) {
+        if (!wait && !__atomic_load_n(&task->done, __ATOMIC_ACQUIRE))
+            continue;
+        while (!__atomic_load_n(&task->done, __ATOMIC_ACQUIRE)) {}
+        DL_DELETE(g_image_plane_tasks, task);
+        if (task->data)
+            add_image_plane(task);
+        else
+            LOG_E("Cannot read image %s", task->path);
+        free(task->data);
+        free(task->path);
+        free(task);
+    }
+}
+
 static void unpack_pos_data(uint32_t v, int pos[3], int *face,
                             int *cube_id)
 {
-    assert(TILE_SIZE == 16);
+    const int s = PICK_POS_SHIFT;
     int x, y, z, f, i;
-    x = v >> 28;
-    y = (v >> 24) & 0x0f;
-    z = (v >> 20) & 0x0f;
-    f = (v >> 16) & 0x0f;
-    i = v & 0xffff;
+    x = (v >> (s + 4 + 2 * TILE_BITS)) & (TILE_SIZE - 1);
+    y = (v >> (s + 4 + TILE_BITS)) & (TILE_SIZE - 1);
+    z = (v >> (s + 4)) & (TILE_SIZE - 1);
+    f = (v >> s) & 0x07;
+    i = (v & ((1u << s) - 1)) | (((v >> (s + 3)) & 1) << s);
     assert(f < 6);
     pos[0] = x;
     pos[1] = y;
@@ -205,6 +290,8 @@ static void update_pick_fbo(const int view_size[2], const volume_t *volume)
                            goxel.pick_fbo->h != view_size[1])) {
         texture_delete(goxel.pick_fbo);
         goxel.pick_fbo = NULL;
+        free(goxel.pick_data);
+        goxel.pick_data = NULL;
     }
 
     if (!goxel.pick_fbo) {
@@ -221,10 +308,8 @@ static void update_pick_fbo(const int view_size[2], const volume_t *volume)
         .view_size = {view_size[0], view_size[1]},
     };
 
-    if (memcmp((void *)&key, (void *)&cache_key, sizeof(key_t)) == 0) {
-        GL(glBindFramebuffer(GL_FRAMEBUFFER, goxel.pick_fbo->framebuffer));
+    if (memcmp((void *)&key, (void *)&cache_key, sizeof(key_t)) == 0)
         return;
-    }
     memcpy(&cache_key, &key, sizeof(key_t));
 
     mat4_copy(goxel.rend.view_mat, rend.view_mat);
@@ -235,25 +320,17 @@ static void update_pick_fbo(const int view_size[2], const volume_t *volume)
     rend.scale = 1;
     render_volume(&rend, volume, NULL, EFFECT_RENDER_POS);
     render_submit(&rend, rect, clear_color);
+    // Start the readback now, and only get the data when we actually need
+    // it, so that the transfer doesn't block the pipeline.
+    texture_read_async(goxel.pick_fbo, view_size[0], view_size[1]);
+    GL(glBindFramebuffer(GL_FRAMEBUFFER, 0));
+    free(goxel.pick_data);
+    goxel.pick_data = NULL;
 }
 
-static void volume_get_tile_pos(const volume_t *volume, int id, int pos[3])
-{
-    int tile_id, tile_pos[3];
-    volume_iterator_t iter;
-    tile_id = 1;
-    iter = volume_get_iterator(volume,
-            VOLUME_ITER_TILES | VOLUME_ITER_INCLUDES_NEIGHBORS);
-    while (volume_iter(&iter, tile_pos)) {
-        if (tile_id == id) {
-            memcpy(pos, tile_pos, sizeof(tile_pos));
-            return;
-        }
-        tile_id++;
-    }
-}
-
-static bool goxel_unproject_on_volume(
+// Pick a voxel by rendering the volume into the pick fbo.  Only used when
+// the volume is not rendered as cubes.
+static bool goxel_unproject_on_volume_fbo(
         const float view[4], const float pos[2], const volume_t *volume,
         float out[3], float normal[3])
 {
@@ -268,15 +345,21 @@ static bool goxel_unproject_on_volume(
 
     x = round(pos[0] - view[0]);
     y = round(pos[1] - view[1]);
-    GL(glViewport(0, 0, goxel.pick_fbo->w, goxel.pick_fbo->h));
     if (x < 0 || x >= view_size[0] ||
         y < 0 || y >= view_size[1]) return false;
-    GL(glReadPixels(x, y, 1, 1, GL_RGBA, GL_UNSIGNED_BYTE, &pixel));
-    GL(glBindFramebuffer(GL_FRAMEBUFFER, 0));
+    // Read the whole buffer once, so that all the picks until the next
+    // update don't need to access the GPU.
+    if (!goxel.pick_data) {
+        goxel.pick_data = malloc(view_size[0] * view_size[1] * 4);
+        texture_get_data(goxel.pick_fbo, view_size[0], view_size[1], 4,
+                         (uint8_t*)goxel.pick_data);
+        GL(glBindFramebuffer(GL_FRAMEBUFFER, 0));
+    }
+    // texture_get_data flips the y axis.
+    pixel = goxel.pick_data[(view_size[1] - 1 - y) * view_size[0] + x];
 
     unpack_pos_data(pixel, voxel_pos, &face, &tile_id);
-    if (!tile_id) return false;
-    volume_get_tile_pos(volume, tile_id, tile_pos);
+    if (!render_get_pick_tile_pos(tile_id, tile_pos)) return false;
     out[0] = tile_pos[0] + voxel_pos[0] + 0.5;
     out[1] = tile_pos[1] + voxel_pos[1] + 0.5;
     out[2] = tile_pos[2] + voxel_pos[2] + 0.5;
@@ -287,6 +370,222 @@ static bool goxel_unproject_on_volume(
     return true;
 }
 
+void goxel_get_visible_voxels(const float view[4], const float rect[4],
+                              const volume_t *volume, volume_t *out)
+{
+    int view_size[2] = {view[2], view[3]};
+    int x, y, x0, y0, x1, y1, face, tile_id, voxel_pos[3], tile_pos[3], p[3];
+    uint32_t pixel;
+    const uint8_t white[4] = {255, 255, 255, 255};
+    volume_accessor_t acc = volume_get_accessor(out);
+
+    volume_clear(out);
+    update_pick_fbo(view_size, volume);
+    if (!goxel.pick_data) {
+        goxel.pick_data = malloc(view_size[0] * view_size[1] * 4);
+        texture_get_data(goxel.pick_fbo, view_size[0], view_size[1], 4,
+                         (uint8_t*)goxel.pick_data);
+        GL(glBindFramebuffer(GL_FRAMEBUFFER, 0));
+    }
+
+    x0 = max(0, floor((rect[0] + 1) / 2 * view_size[0]));
+    y0 = max(0, floor((rect[1] + 1) / 2 * view_size[1]));
+    x1 = min(view_size[0], ceil((rect[2] + 1) / 2 * view_size[0]));
+    y1 = min(view_size[1], ceil((rect[3] + 1) / 2 * view_size[1]));
+
+    for (y = y0; y < y1; y++)
+    for (x = x0; x < x1; x++) {
+        pixel = goxel.pick_data[(view_size[1] - 1 - y) * view_size[0] + x];
+        unpack_pos_data(pixel, voxel_pos, &face, &tile_id);
+        if (!render_get_pick_tile_pos(tile_id, tile_pos)) continue;
+        p[0] = tile_pos[0] + voxel_pos[0];
+        p[1] = tile_pos[1] + voxel_pos[1];
+        p[2] = tile_pos[2] + voxel_pos[2];
+        volume_set_at(out, &acc, p, white);
+    }
+}
+
+static bool goxel_unproject_on_volume(
+        const float view[4], const float pos[2], const volume_t *volume,
+        float out[3], float normal[3])
+{
+    float wpos[3] = {pos[0], pos[1], 0};
+    float opos[3], onorm[3];
+    int i, voxel_pos[3], voxel_normal[3];
+
+    // The marching cubes surface doesn't match the voxels.
+    if (goxel.rend.settings.effects & EFFECT_MARCHING_CUBES)
+        return goxel_unproject_on_volume_fbo(view, pos, volume, out, normal);
+
+    if (    pos[0] < view[0] || pos[0] >= view[0] + view[2] ||
+            pos[1] < view[1] || pos[1] >= view[1] + view[3])
+        return false;
+    camera_get_ray(get_camera(), wpos, view, opos, onorm);
+    if (!volume_raycast(volume, opos, onorm, voxel_pos, voxel_normal))
+        return false;
+    for (i = 0; i < 3; i++) {
+        normal[i] = voxel_normal[i];
+        out[i] = voxel_pos[i] + 0.5 + normal[i] * 0.5;
+    }
+    return true;
+}
+
+/*
+ * Return a lower bound of the view depth of the voxels of a volume moved by
+ * a translation: the depth of the closest corner of its bounding box.  The
+ * boxes are cached by volume key, since getting them goes through all the
+ * tiles.
+ */
+static float get_volume_min_depth(const volume_t *volume, const float ofs[3])
+{
+    static struct {
+        uint64_t    key;
+        bool        empty;
+        int         bbox[2][3];
+    } cache[8];
+    static int cache_next = 0;
+    camera_t *cam = get_camera();
+    uint64_t key = volume_get_key(volume);
+    float p[3], v[3], ret = INFINITY;
+    int i, c;
+
+    for (c = 0; c < ARRAY_SIZE(cache); c++) {
+        if (cache[c].key == key) break;
+    }
+    if (c == ARRAY_SIZE(cache)) {
+        c = cache_next;
+        cache_next = (cache_next + 1) % ARRAY_SIZE(cache);
+        cache[c].key = key;
+        cache[c].empty = !volume_get_bbox(volume, cache[c].bbox, false);
+    }
+    if (cache[c].empty) return INFINITY;
+    for (i = 0; i < 8; i++) {
+        p[0] = cache[c].bbox[(i >> 0) & 1][0] + ofs[0];
+        p[1] = cache[c].bbox[(i >> 1) & 1][1] + ofs[1];
+        p[2] = cache[c].bbox[(i >> 2) & 1][2] + ofs[2];
+        mat4_mul_vec3(cam->view_mat, p, v);
+        ret = min(ret, -v[2]);
+    }
+    return ret;
+}
+
+// Ray cast a volume moved by a translation, and keep the hit if it is the
+// closest one so far.
+static void unproject_on_layer_volume(
+        const volume_t *volume, const float ofs[3], const float opos[3],
+        const float onorm[3], float *best, float out[3], float normal[3])
+{
+    camera_t *cam = get_camera();
+    float o[3], p[3], v[3];
+    int i, voxel_pos[3], voxel_normal[3];
+
+    // No need to ray cast if the whole volume is behind the best hit.
+    if (get_volume_min_depth(volume, ofs) >= *best) return;
+    vec3_sub(opos, ofs, o);
+    if (!volume_raycast(volume, o, onorm, voxel_pos, voxel_normal)) return;
+    for (i = 0; i < 3; i++)
+        p[i] = voxel_pos[i] + ofs[i] + 0.5 + voxel_normal[i] * 0.5;
+    mat4_mul_vec3(cam->view_mat, p, v);
+    if (-v[2] >= *best) return;
+    *best = -v[2];
+    vec3_copy(p, out);
+    for (i = 0; i < 3; i++) normal[i] = voxel_normal[i];
+}
+
+// Same as goxel_unproject_on_volume with the merged layers volume, but ray
+// cast the render layers directly, so that we don't need to merge them.
+// The layers the view renders without their own voxels (the shapes and
+// the instanced clones) are tested separately.  Only the hits closer than
+// max_dist are returned.
+static bool unproject_on_layers(
+        const float view[4], const float pos[2], float max_dist,
+        float out[3], float normal[3])
+{
+    float wpos[3] = {pos[0], pos[1], 0};
+    float opos[3], onorm[3], best = max_dist;
+    const float zero[3] = {0};
+    const layer_t *layer, *base;
+    layer_t *l;
+
+    if (goxel.rend.settings.effects & EFFECT_MARCHING_CUBES) {
+        return goxel_unproject_on_volume(view, pos,
+                goxel_get_layers_volume(goxel.image), out, normal);
+    }
+    if (    pos[0] < view[0] || pos[0] >= view[0] + view[2] ||
+            pos[1] < view[1] || pos[1] >= view[1] + view[3])
+        return false;
+    camera_get_ray(get_camera(), wpos, view, opos, onorm);
+    for (layer = goxel_get_render_layers(true); layer; layer = layer->next) {
+        unproject_on_layer_volume(layer->volume, zero, opos, onorm,
+                                  &best, out, normal);
+    }
+    DL_FOREACH(goxel.image->layers, l) {
+        if (!l->visible || !l->volume) continue;
+        if (image_can_render_shape(goxel.image, l)) {
+            image_update_shape_layer(goxel.image, l);
+            unproject_on_layer_volume(l->volume, zero, opos, onorm,
+                                      &best, out, normal);
+        } else if ((base = image_get_instance_base(goxel.image, l))) {
+            unproject_on_layer_volume(base->volume, l->mat[3], opos, onorm,
+                                      &best, out, normal);
+        }
+    }
+    return best != max_dist;
+}
+
+/*
+ * Memoized version of unproject_on_layers.
+ *
+ * All the 3d gestures unproject the same mouse position at each frame, so
+ * we keep the last result, keyed by the frame, the position, the view and
+ * the layers.  A miss is only reused for calls with a smaller max_dist.
+ */
+static bool goxel_unproject_on_layers(
+        const float view[4], const float pos[2], float max_dist,
+        float out[3], float normal[3])
+{
+    static struct {
+        uint64_t    key;
+        float       max_dist;
+        bool        hit;
+        float       dist;
+        float       pos[3];
+        float       normal[3];
+    } memo = {};
+    const camera_t *cam = get_camera();
+    const layer_t *layer;
+    uint64_t key, k;
+    float v[3];
+
+    key = XXH64(view, 4 * sizeof(float), goxel.frame_count);
+    key = XXH64(pos, 2 * sizeof(float), key);
+    key = XXH64(cam->view_mat, sizeof(cam->view_mat), key);
+    key = XXH64(cam->proj_mat, sizeof(cam->proj_mat), key);
+    key = XXH64(&goxel.rend.settings.effects,
+                sizeof(goxel.rend.settings.effects), key);
+    k = image_get_key(goxel.image);
+    key = XXH64(&k, sizeof(k), key);
+    for (layer = goxel_get_render_layers(true); layer; layer = layer->next) {
+        k = volume_get_key(layer->volume);
+        key = XXH64(&k, sizeof(k), key);
+    }
+
+    if (memo.key != key || (!memo.hit && max_dist > memo.max_dist)) {
+        memo.key = key;
+        memo.max_dist = max_dist;
+        memo.hit = unproject_on_layers(view, pos, max_dist,
+                                       memo.pos, memo.normal);
+        if (memo.hit) {
+            mat4_mul_vec3(cam->view_mat, memo.pos, v);
+            memo.dist = -v[2];
+        }
+    }
+    if (!memo.hit || memo.dist >= max_dist) return false;
+    vec3_copy(memo.pos, out);
+    vec3_copy(memo.normal, normal);
+    return true;
+}
+
 
 int goxel_unproject(const float viewport[4],
                     const float pos[2], int snap_mask,
@@ -295,16 +594,14 @@ int goxel_unproject(const float viewport[4],
 {
     int i, ret = 0;
     bool r = false;
-    float dist, best = INFINITY;
+    float dist, best = INFINITY, max_dist;
     float v[3], p[3] = {}, n[3] = {};
     camera_t *cam = get_camera();
 
     for (i = 0; i < 10; i++) {
         if (!(snap_mask & (1 << i))) continue;
-        if ((1 << i) == SNAP_VOLUME) {
-            r = goxel_unproject_on_volume(viewport, pos,
-                            goxel_get_layers_volume(goxel.image), p, n);
-        }
+        // The volume is tested last, see below.
+        if ((1 << i) == SNAP_VOLUME) continue;
         if ((1 << i) == SNAP_PLANE) {
             r = goxel_unproject_on_plane(
                     viewport, pos, goxel.plane, p, n);
@@ -355,6 +652,25 @@ int goxel_unproject(const float viewport[4],
         best = dist;
     }
 
+    // Picking the volume is the most expensive test, so we do it once we
+    // know the distance to beat: the layers that are entirely behind it
+    // don't need to be ray casted.  On equal distances the volume still
+    // wins over the targets with a lower bit, as if they had all been
+    // tested in order.
+    if (snap_mask & SNAP_VOLUME) {
+        max_dist = ret < SNAP_VOLUME ? nextafterf(best, INFINITY) : best;
+        if (goxel_unproject_on_layers(viewport, pos, max_dist, p, n)) {
+            mat4_mul_vec3(cam->view_mat, p, v);
+            dist = -v[2];
+            if (dist >= 0) {
+                vec3_copy(p, out);
+                vec3_copy(n, normal);
+                ret = SNAP_VOLUME;
+                best = dist;
+            }
+        }
+    }
+
     // Post effects.
     // Note: should probably move outside of this function.
     if (ret && offset)
@@ -451,17 +767,31 @@ static void goxel_load_recent_files(void)
 KEEPALIVE
 void goxel_init(void)
 {
+    uint64_t mem;
+
+    profiler_trace_begin("goxel_init");
+    LOG_I("SIMD: %s", simd_get_features_str());
+    jobs_init(0);
+    // Give an eighth of the memory to the caches.
+    mem = sys_get_total_memory();
+    if (mem) cache_governor_set_budget(clamp(mem / 8, 128 * MB, 4LL * GB));
+    profiler_trace_begin("shapes_init");
     shapes_init();
+    profiler_trace_end();
     goxel_init_sound();
+    profiler_trace_begin("script_init");
     script_init();
+    profiler_trace_end();
 
-    // Load and set default palette.
-    palette_load_all(&goxel.palettes);
-    DL_FOREACH(goxel.palettes, goxel.palette) {
-        if (strcmp(goxel.palette->name, "DB32") == 0)
-            break;
+    // Only load the default palette, the others are loaded on first use.
+    profiler_trace_begin("palettes");
+    goxel.palette = palette_load_asset("data/palettes/db32.gpl");
+    if (goxel.palette) {
+        DL_APPEND(goxel.palettes, goxel.palette);
+    } else {
+        goxel.palette = goxel_get_palettes();
     }
-    goxel.palette = goxel.palette ?: goxel.palettes;
+    profiler_trace_end();
 
     goxel_load_recent_files();
 
@@ -470,6 +800,7 @@ void goxel_init(void)
     goxel_add_gesture(GESTURE_HOVER, 0, on_hover);
     goxel_add_gesture(GESTURE_DRAG, GESTURE_LMB, on_drag_rotate);
     goxel_add_gesture(GESTURE_DRAG, GESTURE_LMB, on_drag);
+    profiler_trace_end();
 }
 
 void goxel_update_keymaps(void)
@@ -508,6 +839,7 @@ void goxel_update_keymaps(void)
 
 void goxel_reset(void)
 {
+    if (goxel.image) image_flush_streams(goxel.image);
     image_delete(goxel.image);
     goxel.image = image_new();
     goxel.lang = "en";
@@ -548,6 +880,10 @@ void goxel_reset(void)
     };
     if (DEFINED(NO_SHADOW))
         goxel.rend.settings.shadow = 0;
+    goxel.rend.async = true;
+    goxel.rend.disk_cache = true;
+    goxel.rend.lod = true;
+    goxel.rend.occlusion_culling = true;
 
     goxel.snap_mask = SNAP_VOLUME | SNAP_IMAGE_BOX;
 
@@ -572,7 +908,17 @@ void goxel_reset(void)
 void goxel_release(void)
 {
     pathtracer_stop(&goxel.pathtracer);
+    save_update(true);
+    goxel_file_task_update(true);
+    image_plane_tasks_update(true);
+    image_flush_streams(goxel.image);
     gui_release();
+    volume_stack_release(&goxel.layers_stack);
+    volume_stack_release(&goxel.render_stack);
+    volume_delete(goxel.tool_overlay.volume);
+    arrfree(goxel.tool_overlay.tiles);
+    goxel.tool_overlay = (tool_overlay_t){};
+    jobs_release();
 }
 
 /*
@@ -581,7 +927,9 @@ void goxel_release(void)
  */
 void goxel_create_graphics(void)
 {
+    profiler_trace_begin("render_init");
     render_init();
+    profiler_trace_end();
     goxel.graphics_initialized = true;
 }
 
@@ -595,8 +943,20 @@ void goxel_release_graphics(void)
     model3d_release_graphics();
     gui_release_graphics();
     shaders_release_all();
+    thumbnails_release_graphics();
     texture_delete(goxel.pick_fbo);
     goxel.pick_fbo = NULL;
+    free(goxel.pick_data);
+    goxel.pick_data = NULL;
+    texture_delete(goxel.view_fbo);
+    goxel.view_fbo = NULL;
+    texture_delete(goxel.export_fbos[0]);
+    texture_delete(goxel.export_fbos[1]);
+    goxel.export_fbos[0] = goxel.export_fbos[1] = NULL;
+    free(goxel.export_buf);
+    goxel.export_buf = NULL;
+    goxel.export_buf_size = 0;
+    profiler_release_graphics();
     goxel.graphics_initialized = false;
 }
 
@@ -626,14 +986,35 @@ static void gesture3ds_iter(void)
     gesture3d_remove_dead(&goxel.gesture3ds_count, goxel.gesture3ds);
 }
 
+// Hash of the keys of the visible layers, that changes whenever the merged
+// layers volume would change.
+static uint64_t get_layers_key(const image_t *img)
+{
+    uint64_t key = 0, k;
+    const layer_t *layer;
+
+    DL_FOREACH(img->layers, layer) {
+        if (!layer->visible) continue;
+        if (!layer->volume) continue;
+        k = layer_get_key(layer);
+        key = XXH64(&k, sizeof(k), key);
+    }
+    return key;
+}
+
 static void play_build_sound_if_needed(void)
 {
     float pitch = 1.2;
-    uint64_t volume_key;
+    uint64_t volume_key, k;
 
     if (!DEFINED(SOUND)) return;
     if (goxel.frame_time - goxel.last_click_time <= 0.1) return;
-    volume_key = volume_get_key(goxel_get_render_volume(goxel.image));
+    // Only compare the keys, we don't need the merged volume itself.
+    volume_key = get_layers_key(goxel.image);
+    if (goxel.tool_volume) {
+        k = volume_get_key(goxel.tool_volume);
+        volume_key = XXH64(&k, sizeof(k), volume_key);
+    }
     if (goxel.last_volume_key == volume_key) return;
     if (goxel.last_volume_key) {
         if (goxel.painter.mode == MODE_SUB) pitch = 0.5;
@@ -647,12 +1028,17 @@ static void play_build_sound_if_needed(void)
 KEEPALIVE
 int goxel_iter(const inputs_t *inputs)
 {
-    double time  = sys_get_time();
+    double time  = goxel.replay_time ?: sys_get_time();
     float menu_w = 20;
     int i;
+    float target[3];
     inputs_t inputs2;
     camera_t *camera = get_camera();
+    TRACE_SCOPE("goxel_iter");
 
+    profiler_new_frame();
+    profiler_begin(PROF_ITER);
+    mem_tracker_iter();
     tr_set_language(goxel.lang);
     if (!goxel.graphics_initialized)
         goxel_create_graphics();
@@ -675,6 +1061,8 @@ int goxel_iter(const inputs_t *inputs)
     camera_update(camera);
     mat4_copy(camera->view_mat, goxel.rend.view_mat);
     mat4_copy(camera->proj_mat, goxel.rend.proj_mat);
+    mat4_mul_vec3(camera->mat, VEC(0, 0, -camera->dist), target);
+    image_update_streams(goxel.image, target);
     // gui_iter(inputs);
 
     // Test: update the viewport before the UI.
@@ -694,6 +1082,9 @@ int goxel_iter(const inputs_t *inputs)
     play_build_sound_if_needed();
     gesture3ds_iter();
     sound_iter();
+    save_update(false);
+    goxel_file_task_update(false);
+    image_plane_tasks_update(false);
     update_window_title();
 
     goxel.frame_count++;
@@ -704,6 +1095,8 @@ int goxel_iter(const inputs_t *inputs)
         goxel.request_test_graphic_release = false;
     }
 
+    cache_governor_update();
+    profiler_end(PROF_ITER);
     return goxel.quit ? 1 : 0;
 }
 
@@ -836,8 +1229,8 @@ static int on_zoom(const gesture_t *gest, void *user)
             -camera->dist * (1 - pow(1.1, -zoom)));
     camera->dist *= pow(1.1, -zoom);
     // Auto adjust the camera rotation position.
-    if (goxel_unproject_on_volume(gest->viewport, gest->pos,
-                                goxel_get_layers_volume(goxel.image), p, n)) {
+    if (goxel_unproject_on_layers(gest->viewport, gest->pos, INFINITY,
+                                  p, n)) {
         camera_set_target(camera, p);
     }
     return 0;
@@ -907,6 +1300,12 @@ void goxel_mouse_in_view(const float viewport[4], const inputs_t *inputs,
     gesture_update(arrlen(goxel.gestures), goxel.gestures, inputs, viewport,
                    NULL);
 
+    // Mesh the tiles under the mouse first.
+    goxel.rend.focus[0] =
+        (inputs->touches[0].pos[0] - viewport[0]) / viewport[2] * 2 - 1;
+    goxel.rend.focus[1] =
+        (inputs->touches[0].pos[1] - viewport[1]) / viewport[3] * 2 - 1;
+
     ctrl = inputs->keys[KEY_LEFT_CONTROL] || inputs->keys[KEY_RIGHT_CONTROL];
     shift = inputs->keys[KEY_LEFT_SHIFT] || inputs->keys[KEY_RIGHT_SHIFT];
 
@@ -938,7 +1337,9 @@ void goxel_mouse_in_view(const float viewport[4], const inputs_t *inputs,
     if (painter.mode != MODE_PAINT) painter.smoothness = 0;
 
     if (!goxel.pathtrace) {
+        profiler_begin(PROF_TOOL);
         tool_iter(goxel.tool, &painter, viewport);
+        profiler_end(PROF_TOOL);
     }
 
     if (inputs->mouse_wheel && !gui_want_capture_mouse()) {
@@ -946,8 +1347,8 @@ void goxel_mouse_in_view(const float viewport[4], const inputs_t *inputs,
                 -camera->dist * (1 - pow(1.1, -inputs->mouse_wheel)));
         camera->dist *= pow(1.1, -inputs->mouse_wheel);
         // Auto adjust the camera rotation position.
-        if (goxel_unproject_on_volume(viewport, inputs->touches[0].pos,
-                                goxel_get_layers_volume(goxel.image), p, n)) {
+        if (goxel_unproject_on_layers(viewport, inputs->touches[0].pos,
+                                      INFINITY, p, n)) {
             camera_set_target(camera, p);
         }
         return;
@@ -972,17 +1373,133 @@ void goxel_mouse_in_view(const float viewport[4], const inputs_t *inputs,
     // C: recenter the view:
     // XXX: this should be an action!
     if (inputs->keys['C']) {
-        if (goxel_unproject_on_volume(viewport, inputs->touches[0].pos,
-                                goxel_get_layers_volume(goxel.image), p, n)) {
+        if (goxel_unproject_on_layers(viewport, inputs->touches[0].pos,
+                                      INFINITY, p, n)) {
             camera_set_target(camera, p);
         }
     }
 }
 
+/*
+ * Update the resolution scale of the 3d view.
+ *
+ * While the camera moves, the scale is adjusted so that the frame time
+ * gets close to the target fps, assuming the cost of the view is
+ * proportional to its number of pixels.  We go back to full resolution a
+ * short time after the camera stops.
+ */
+static float update_view_scale(void)
+{
+    static uint64_t last_key;
+    static double last_move_time;
+    static bool moving;
+    const double hold = 0.1;
+    bool was_moving = moving;
+    uint64_t key;
+    float ratio;
+
+    key = camera_get_key(get_camera());
+    if (key != last_key) last_move_time = goxel.frame_time;
+    last_key = key;
+    moving = goxel.frame_time - last_move_time < hold;
+
+    if (!goxel.dynamic_resolution || goxel.pathtrace || !moving) return 1;
+    if (goxel.view_scale <= 0) goxel.view_scale = 1;
+    // The first moving frame can come after a pause, so its delta time
+    // is meaningless.
+    if (was_moving && goxel.delta_time > 0 && goxel.target_fps > 0) {
+        ratio = sqrt(1.0 / goxel.target_fps / goxel.delta_time);
+        goxel.view_scale = clamp(goxel.view_scale * mix(1.f, ratio, 0.5f),
+                                 0.25f, 1.f);
+    }
+    return goxel.view_scale;
+}
+
+static void render_view_items(const float viewport[4]);
+
+// Render a texture of the 3d view into the current framebuffer.
+static void render_view_texture(const float viewport[4], texture_t *tex)
+{
+    renderer_t rend = {.fbo = goxel.rend.fbo, .scale = goxel.screen_scale};
+    float mat[4][4];
+
+    mat4_set_identity(mat);
+    mat4_iscale(mat, viewport[2], viewport[3], 1);
+    mat4_itranslate(mat, 0.5, 0.5, 0);
+    mat4_iscale(mat, 1, -1, 1);
+    render_img(&rend, tex, mat, EFFECT_NO_SHADING | EFFECT_PROJ_SCREEN);
+    render_submit(&rend, viewport, NULL);
+}
+
+/*
+ * Render the 3d view into the low resolution view fbo, and then upscale
+ * it into the current framebuffer.
+ */
+static void render_view_scaled(const float viewport[4], float scale)
+{
+    const float s = goxel.screen_scale;
+    const int w = viewport[2] * s;
+    const int h = viewport[3] * s;
+    const float rect[4] = {0, 0, viewport[2], viewport[3]};
+    const int fbo = goxel.rend.fbo;
+
+    if (goxel.view_fbo && (goxel.view_fbo->tex_w < w ||
+                           goxel.view_fbo->tex_h < h)) {
+        texture_delete(goxel.view_fbo);
+        goxel.view_fbo = NULL;
+    }
+    if (!goxel.view_fbo)
+        goxel.view_fbo = texture_new_buffer(w, h, TF_DEPTH);
+    // Only the bottom left part of the fbo is used, the texture size
+    // gives the uv scale when we render it.
+    goxel.view_fbo->w = max(1, (int)(w * scale));
+    goxel.view_fbo->h = max(1, (int)(h * scale));
+
+    goxel.rend.fbo = goxel.view_fbo->framebuffer;
+    goxel.rend.scale = s * scale;
+    goxel_render_view(rect, false);
+    goxel.rend.fbo = fbo;
+    goxel.rend.scale = s;
+    render_view_texture(viewport, goxel.view_fbo);
+}
+
+/*
+ * Queue the 3d view for the render thread, and render the view of the
+ * previous frame meanwhile, so that the GPU draws the view while we
+ * prepare the next frame.  The view is one frame late, except for the
+ * first frame.
+ */
+static void render_view_async(const float viewport[4], float scale)
+{
+    const float s = goxel.screen_scale;
+    const int w = max(1, (int)(viewport[2] * s * scale));
+    const int h = max(1, (int)(viewport[3] * s * scale));
+    const float rect[4] = {0, 0, viewport[2], viewport[3]};
+    static int last_frame = -1;
+    texture_t *tex;
+
+    goxel.rend.scale = s * scale;
+    render_view_items(rect);
+
+    // Don't show an old view if the last frame didn't use the thread.
+    tex = render_wait_async();
+    if (last_frame != goxel.frame_count - 1) tex = NULL;
+    last_frame = goxel.frame_count;
+    if (tex) render_view_texture(viewport, tex);
+    // Here the render thread is idle, so we don't wait for it.
+    if (goxel.frame_count > 10) render_warm_up(&goxel.rend);
+    render_submit_async(&goxel.rend, rect, goxel.back_color, w, h);
+    goxel.rend.scale = s;
+    if (!tex) render_view_texture(viewport, render_wait_async());
+}
+
 KEEPALIVE
 void goxel_render(const inputs_t *inputs)
 {
+    float scale;
+    bool async;
     uint8_t color[4];
+    TRACE_SCOPE("goxel_render");
 
     theme_get_color(THEME_GROUP_BASE, THEME_COLOR_BACKGROUND, false, color);
     GL(glViewport(0, 0, goxel.screen_size[0] * goxel.screen_scale,
@@ -994,11 +1511,26 @@ void goxel_render(const inputs_t *inputs)
     GL(glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT |
                GL_STENCIL_BUFFER_BIT));
 
-    goxel_render_view(goxel.gui.viewport, goxel.pathtrace);
+    scale = update_view_scale();
+    async = render_thread_is_running() && !goxel.pathtrace;
+    if (async)
+        render_view_async(goxel.gui.viewport, scale);
+    else if (scale < 1)
+        render_view_scaled(goxel.gui.viewport, scale);
+    else
+        goxel_render_view(goxel.gui.viewport, goxel.pathtrace);
 
     GL(glViewport(0, 0, goxel.screen_size[0] * goxel.screen_scale,
                         goxel.screen_size[1] * goxel.screen_scale));
     gui_render(inputs);
+
+    // Once the first frames are on screen, prepare the other shaders, one
+    // per frame.
+    if (goxel.frame_count > 10 && !async) render_warm_up(&goxel.rend);
+
+    // All the render items have been submitted by now.
+    assert(!goxel.rend.items);
+    frame_reset();
 }
 
 static void render_export_viewport(const float viewport[4])
@@ -1121,19 +1653,16 @@ static void render_symmetry_axis(
     }
 }
 
-void goxel_render_view(const float viewport[4], bool render_mode)
+// Add all the render items of the 3d view.
+static void render_view_items(const float viewport[4])
 {
-    const layer_t *layer;
+    const layer_t *layer, *layers, *base;
+    const tool_overlay_t *overlay;
     renderer_t *rend = &goxel.rend;
     const uint8_t layer_box_color[4] = {128, 128, 255, 255};
     int effects = 0;
     camera_t *camera = get_camera();
 
-    if (render_mode) {
-        render_pathtrace_view(viewport);
-        return;
-    }
-
     camera->aspect = viewport[2] / viewport[3];
     camera_update(camera);
     mat4_copy(camera->view_mat, goxel.rend.view_mat);
@@ -1141,10 +1670,35 @@ void goxel_render_view(const float viewport[4], bool render_mode)
 
     effects |= goxel.view_effects;
 
-    for (layer = goxel_get_render_layers(true); layer; layer = layer->next) {
-        if (layer->visible && layer->volume)
+    layers = goxel_get_render_layers(true);
+    overlay = goxel_get_tool_overlay();
+    for (layer = layers; layer; layer = layer->next) {
+        if (!layer->visible || !layer->volume) continue;
+        if (overlay && overlay->layer == layer && overlay->full)
+            render_volume(rend, overlay->volume, layer->material, effects);
+        else if (overlay && overlay->layer == layer)
+            render_volume_overlay(rend, layer->volume, overlay->volume,
+                                  overlay->nb,
+                                  (const int (*)[3])overlay->tiles,
+                                  layer->material, effects);
+        else
             render_volume(rend, layer->volume, layer->material, effects);
     }
+    DL_FOREACH(goxel.image->layers, layer) {
+        if (image_can_render_shape(goxel.image, layer))
+            render_shape(rend, layer->shape, layer->mat, layer->color,
+                         layer->material, goxel.image->box);
+        base = image_get_instance_base(goxel.image, layer);
+        if (base) {
+            render_volume_transformed(rend, base->volume, layer->material,
+                                      layer->mat, effects);
+        }
+    }
+    if (goxel.tool_moved_volume) {
+        render_volume_transformed(rend, goxel.tool_moved_volume,
+                                  goxel.image->active_layer->material,
+                                  goxel.tool_moved_mat, effects);
+    }
 
     if (!box_is_null(goxel.image->active_layer->box))
         render_box(rend, goxel.image->active_layer->box,
@@ -1204,183 +1758,781 @@ void goxel_render_view(const float viewport[4], bool render_mode)
         render_export_viewport(viewport);
 
     render_axis_arrows(viewport);
-    render_submit(&goxel.rend, viewport, goxel.back_color);
 }
 
-void image_update(image_t *img);
+void goxel_render_view(const float viewport[4], bool render_mode)
+{
+    if (render_mode) {
+        render_pathtrace_view(viewport);
+        return;
+    }
+    render_view_items(viewport);
+    render_submit(&goxel.rend, viewport, goxel.back_color);
+}
 
-const volume_t *goxel_get_layers_volume(const image_t *img)
+// Fill an array with all the visible layers volumes.
+static int get_layers_volumes(const image_t *img, const volume_t *active,
+                              const volume_t ***volumes)
 {
-    uint32_t key = 0, k;
+    int n = 0;
     layer_t *layer;
-
-    image_update((image_t*)img);
+    DL_FOREACH(img->layers, layer) n++;
+    *volumes = realloc(*volumes, max(n, 1) * sizeof(**volumes));
+    n = 0;
     DL_FOREACH(img->layers, layer) {
         if (!layer->visible) continue;
         if (!layer->volume) continue;
-        k = layer_get_key(layer);
-        key = XXH32(&k, sizeof(k), key);
-    }
-    if (key != goxel.layers_volume_hash) {
-        goxel.layers_volume_hash = key;
-        if (!goxel.layers_volume_) goxel.layers_volume_ = volume_new();
-        volume_clear(goxel.layers_volume_);
-        DL_FOREACH(img->layers, layer) {
-            if (!layer->visible) continue;
-            volume_merge(goxel.layers_volume_, layer->volume, MODE_OVER, NULL);
-        }
+        if (active && layer->volume == img->active_layer->volume)
+            (*volumes)[n++] = active;
+        else
+            (*volumes)[n++] = layer->volume;
+    }
+    return n;
+}
+
+const volume_t *goxel_get_layers_volume(const image_t *img)
+{
+    uint64_t key;
+    int n;
+    const volume_t **volumes = NULL;
+
+    // The background exports use their own stack.
+    static __thread volume_stack_t worker_stack;
+    static __thread uint64_t worker_hash;
+    volume_stack_t *stack = &goxel.layers_stack;
+    uint64_t *hash = &goxel.layers_volume_hash;
+
+    if (jobs_in_worker_thread()) {
+        stack = &worker_stack;
+        hash = &worker_hash;
+    }
+    image_update((image_t*)img, true);
+    key = get_layers_key(img);
+    if (key != *hash || !stack->volume) {
+        *hash = key;
+        n = get_layers_volumes(img, NULL, &volumes);
+        volume_stack_update(stack, n, volumes);
+        free(volumes);
     }
-    return goxel.layers_volume_;
+    return stack->volume;
 }
 
 const volume_t *goxel_get_render_volume(const image_t *img)
 {
-    uint32_t key, k;
-    const volume_t *volume;
-    layer_t *layer;
+    uint64_t key, k;
+    int n;
+    const volume_t **volumes = NULL;
 
     if (!goxel.tool_volume)
         return goxel_get_layers_volume(img);
 
     key = volume_get_key(goxel_get_layers_volume(img));
     k = volume_get_key(goxel.tool_volume);
-    key = XXH32(&k, sizeof(k), key);
-    if (key != goxel.render_volume_hash) {
-        image_update(goxel.image);
+    key = XXH64(&k, sizeof(k), key);
+    if (key != goxel.render_volume_hash || !goxel.render_stack.volume) {
+        image_update(goxel.image, true);
         goxel.render_volume_hash = key;
-        if (!goxel.render_volume_) goxel.render_volume_ = volume_new();
-        volume_clear(goxel.render_volume_);
-        DL_FOREACH(goxel.image->layers, layer) {
-            if (!layer->visible) continue;
-            volume = layer->volume;
-            if (volume == goxel.image->active_layer->volume)
-                volume = goxel.tool_volume;
-            volume_merge(goxel.render_volume_, volume, MODE_OVER, NULL);
-        }
+        n = get_layers_volumes(goxel.image, goxel.tool_volume, &volumes);
+        volume_stack_update(&goxel.render_stack, n, volumes);
+        free(volumes);
     }
-    return goxel.render_volume_;
+    return goxel.render_stack.volume;
 }
 
-const layer_t *goxel_get_render_layers(bool with_tool_preview)
+// Merge a range of layers into a single render layer, optionally with the
+// tool volume replacing the active layer volume.
+static layer_t *render_layer_create(layer_t *first, const layer_t *end,
+                                    const volume_t *tool)
 {
-    uint32_t hash, k;
-    bool no_merge;
-    layer_t *l, *layer, *tmp;
+    layer_t *layer, *l;
+    const volume_t *volume;
 
-    hash = image_get_key(goxel.image);
-    if (with_tool_preview && goxel.tool_volume) {
-        k = volume_get_key(goxel.tool_volume);
-        hash = XXH32(&k, sizeof(k), hash);
+    layer = layer_copy(first);
+    if (tool && first == goxel.image->active_layer)
+        volume_set(layer->volume, tool);
+    for (l = first->next; l != end; l = l->next) {
+        if (!l->visible) continue;
+        if (!l->volume) continue;
+        volume = l->volume;
+        if (tool && l == goxel.image->active_layer) volume = tool;
+        volume_merge(layer->volume, volume, l->mode, NULL);
     }
+    return layer;
+}
 
-    if (hash != goxel.render_layers_hash) {
-        goxel.render_layers_hash = hash;
-        image_update(goxel.image);
-
-        DL_FOREACH_SAFE(goxel.render_layers, layer, tmp) {
-            DL_DELETE(goxel.render_layers, layer);
-            layer_delete(layer);
-        }
-
-        DL_FOREACH(goxel.image->layers, l) {
-            if (!l->visible) continue;
-            if (!l->volume) continue;
-            layer = layer_copy(l);
-            if (    with_tool_preview && goxel.tool_volume &&
-                    l->volume == goxel.image->active_layer->volume)
-            {
-                volume_set(layer->volume, goxel.tool_volume);
-            }
-
-            // Don't merge different materials unless we do a boolean op.
-            no_merge = (goxel.render_layers == NULL) || (
-                (layer->mode == MODE_OVER) &&
-                (goxel.render_layers->prev->material != layer->material));
+static const layer_t *get_render_layers(bool with_tool_preview)
+{
+    uint64_t hash, k, key = 0, *keys;
+    int n = 0;
+    bool no_merge, skip, has_active = false;
+    layer_t *l, *layer, *first = NULL, *old, *tmp;
+    render_layers_t *cache = &goxel.render_layers[with_tool_preview ? 1 : 0];
 
-            if (no_merge) {
-                DL_APPEND(goxel.render_layers, layer);
+    hash = image_get_key(goxel.image);
+    if (hash == cache->hash) return cache->layers;
+    cache->hash = hash;
+    cache->active = NULL;
+    // The view renders the shape layers and the instanced clones directly,
+    // but the path tracer needs their voxels.
+    image_update(goxel.image, !with_tool_preview);
+
+    // Group the layers the same way as before, and only recreate the
+    // render layers whose sources changed.
+    DL_COUNT(goxel.image->layers, l, n);
+    keys = calloc(max(n, 1), sizeof(*keys));
+    old = cache->layers;
+    cache->layers = NULL;
+    n = 0;
+    for (l = goxel.image->layers; ; l = l->next) {
+        if (l && (!l->visible || !l->volume)) continue;
+        skip = l && (image_get_instance_base(goxel.image, l) ||
+                     (with_tool_preview &&
+                      image_can_render_shape(goxel.image, l)));
+
+        // Don't merge different materials unless we do a boolean op.  The
+        // skipped layers also end the group, since render_layer_create
+        // merges all the layers up to the end.
+        no_merge = skip || !l || !first || (
+                (l->mode == MODE_OVER) && (first->material != l->material));
+
+        if (no_merge && first) {
+            if (old && cache->nb > n && cache->keys[n] == key) {
+                layer = old;
+                DL_DELETE(old, layer);
             } else {
-                volume_merge(goxel.render_layers->prev->volume, layer->volume,
-                             layer->mode, NULL);
-                layer_delete(layer);
+                if (old) {
+                    tmp = old;
+                    DL_DELETE(old, tmp);
+                    layer_delete(tmp);
+                }
+                layer = render_layer_create(first, l, NULL);
+            }
+            DL_APPEND(cache->layers, layer);
+            keys[n++] = key;
+            if (has_active) {
+                cache->active = layer;
+                cache->active_first = first;
+                cache->active_end = l;
             }
         }
+        if (!l) break;
+        if (skip) {
+            first = NULL;
+            continue;
+        }
+        if (no_merge) {
+            first = l;
+            key = 0;
+            has_active = false;
+        }
+        k = layer_get_key(l);
+        key = XXH64(&k, sizeof(k), key);
+        if (l == goxel.image->active_layer) has_active = true;
+    }
+
+    DL_FOREACH_SAFE(old, layer, tmp) {
+        DL_DELETE(old, layer);
+        layer_delete(layer);
     }
-    return goxel.render_layers;
+    free(cache->keys);
+    cache->keys = keys;
+    cache->nb = n;
+    return cache->layers;
 }
 
-// Render the view into an RGB[A] buffer.
-void goxel_render_to_buf(uint8_t *buf, int w, int h, int bpp)
+const layer_t *goxel_get_render_layers(bool with_tool_preview)
 {
-    camera_t *camera = get_camera();
-    const volume_t *volume;
-    texture_t *fbo;
-    renderer_t rend = goxel.rend;
-    float rect[4] = {0, 0, w * 2, h * 2};
-    uint8_t *tmp_buf;
-
-    camera->aspect = (float)w / h;
-    camera_update(camera);
+    const layer_t *ret;
+    TRACE_SCOPE("goxel_get_render_layers");
+    profiler_begin(PROF_RENDER_LAYERS);
+    ret = get_render_layers(with_tool_preview);
+    profiler_end(PROF_RENDER_LAYERS);
+    return ret;
+}
 
-    volume = goxel_get_layers_volume(goxel.image);
-    fbo = texture_new_buffer(w * 2, h * 2, TF_DEPTH);
+// Above this number of changed tiles, the tool overlay replaces the whole
+// layer volume.
+#define TOOL_OVERLAY_MAX_TILES 4096
 
-    mat4_copy(camera->view_mat, rend.view_mat);
-    mat4_copy(camera->proj_mat, rend.proj_mat);
-    rend.fbo = fbo->framebuffer;
-    rend.scale = 1.0;
-    rend.items = NULL;
+static int pos_cmp(const void *a_, const void *b_)
+{
+    const int *a = a_, *b = b_;
+    int i;
+    for (i = 0; i < 3; i++) {
+        if (a[i] != b[i]) return a[i] < b[i] ? -1 : 1;
+    }
+    return 0;
+}
 
-    // XXX: use goxel_get_render_layers!
-    render_volume(&rend, volume, NULL, 0);
-    render_submit(&rend, rect, (bpp == 3) ? goxel.back_color : NULL);
-    tmp_buf = calloc(w * h * 4, bpp);
-    texture_get_data(fbo, w * 2, h * 2, bpp, tmp_buf);
-    img_downsample(tmp_buf, w * 2, h * 2, bpp, buf);
-    free(tmp_buf);
-    texture_delete(fbo);
+static void on_tool_diff(void *user, const int pos[3], int change)
+{
+    int (**list)[3] = user;
+    memcpy(arraddnptr(*list, 1), pos, sizeof(**list));
 }
 
-void goxel_add_hint(int flags, const char *title, const char *msg)
+// Return the sorted list of all the tiles up to a given distance to a list
+// of tiles.
+static int (*get_tiles_around(const int (*tiles)[3], int r))[3]
 {
-    hint_t hint;
-    int i;
+    int i, j, x, y, z, (*ret)[3] = NULL, *p;
 
-    // Can only be on coordinates hint.
-    if (flags & HINT_COORDINATES) {
-        for (i = 0; i < arrlen(goxel.hints); i++) {
-            if (goxel.hints[i].flags & HINT_COORDINATES) {
-                return;
-            }
-        }
+    for (i = 0; i < arrlen(tiles); i++)
+    for (z = -r; z <= r; z++)
+    for (y = -r; y <= r; y++)
+    for (x = -r; x <= r; x++) {
+        p = *arraddnptr(ret, 1);
+        p[0] = tiles[i][0] + x * TILE_SIZE;
+        p[1] = tiles[i][1] + y * TILE_SIZE;
+        p[2] = tiles[i][2] + z * TILE_SIZE;
     }
-    hint.flags = flags;
-    snprintf(hint.msg, sizeof(hint.msg), "%s", msg);
-    snprintf(hint.title, sizeof(hint.title), "%s", title ?: "");
-    arrput(goxel.hints, hint);
+    if (!ret) return NULL;
+    qsort(ret, arrlen(ret), sizeof(*ret), pos_cmp);
+    for (i = 1, j = 1; i < arrlen(ret); i++) {
+        if (pos_cmp(ret[i], ret[j - 1]) == 0) continue;
+        memcpy(ret[j++], ret[i], sizeof(*ret));
+    }
+    arrsetlen(ret, j);
+    return ret;
 }
 
-void goxel_import_image_plane(const char *path)
+static void tool_overlay_update(tool_overlay_t *overlay,
+                                const render_layers_t *cache)
 {
+    const volume_t *tool = goxel.tool_volume, *volume;
+    const layer_t *active = goxel.image->active_layer;
+    const layer_t *l, *first = cache->active_first;
     layer_t *layer;
-    texture_t *tex;
-    tex = texture_new_image(path, TF_NEAREST);
-    if (!tex) return;
-    layer = image_add_layer(goxel.image, NULL);
-    sprintf(layer->name, "img");
-    layer->image = tex;
-    // Adjust position for odd sized images.
-    if (tex->w % 2 == 1)
-        mat4_itranslate(layer->mat, 0.5, 0, 0);
-    if (tex->h % 2 == 1)
-        mat4_itranslate(layer->mat, 0, 0.5, 0);
-    mat4_iscale(layer->mat, layer->image->w, layer->image->h, 1);
-    image_history_push(goxel.image);
+    int (*changed)[3] = NULL, (*around)[3] = NULL;
+    int i, j, aabb[2][3];
+
+    arrfree(overlay->tiles);
+    overlay->nb = 0;
+    overlay->full = false;
+    overlay->layer = cache->active;
+    if (!overlay->layer) return;
+    if (!overlay->volume) overlay->volume = volume_new();
+
+    volume_diff(active->volume, tool, on_tool_diff, &changed);
+    if (arrlen(changed) > TOOL_OVERLAY_MAX_TILES) {
+        layer = render_layer_create(cache->active_first, cache->active_end,
+                                    tool);
+        volume_set(overlay->volume, layer->volume);
+        layer_delete(layer);
+        overlay->full = true;
+        goto end;
+    }
+
+    // The meshes of the tiles next to the changed ones also change, and
+    // to generate them we need their own neighbors.
+    overlay->tiles = get_tiles_around((const int (*)[3])changed, 1);
+    overlay->nb = arrlen(overlay->tiles);
+    around = get_tiles_around((const int (*)[3])changed, 2);
+    volume_clear(overlay->volume);
+    for (i = 0; i < arrlen(around); i++) {
+        volume_copy_tile(overlay->layer->volume, around[i],
+                         overlay->volume, around[i]);
+    }
+    // Merge the changed tiles again, the same way as render_layer_create.
+    for (i = 0; i < arrlen(changed); i++) {
+        for (j = 0; j < 3; j++) {
+            aabb[0][j] = changed[i][j];
+            aabb[1][j] = changed[i][j] + TILE_SIZE;
+        }
+        volume_copy_tile(first == active ? tool : first->volume, changed[i],
+                         overlay->volume, changed[i]);
+        for (l = first->next; l != cache->active_end; l = l->next) {
+            if (!l->visible) continue;
+            if (!l->volume) continue;
+            volume = l == active ? tool : l->volume;
+            volume_merge_aabb(overlay->volume, overlay->volume, volume, aabb,
+                              l->mode, NULL);
+        }
+    }
+end:
+    arrfree(changed);
+    arrfree(around);
+}
+
+const tool_overlay_t *goxel_get_tool_overlay(void)
+{
+    uint64_t hash, k;
+    const render_layers_t *cache = &goxel.render_layers[1];
+    tool_overlay_t *overlay = &goxel.tool_overlay;
+
+    if (!goxel.tool_volume) return NULL;
+    get_render_layers(true);
+    k = volume_get_key(goxel.tool_volume);
+    hash = XXH64(&k, sizeof(k), cache->hash);
+    if (hash != overlay->hash) {
+        overlay->hash = hash;
+        tool_overlay_update(overlay, cache);
+    }
+    return overlay->layer ? overlay : NULL;
+}
+
+bool goxel_is_idle(void)
+{
+    static uint64_t last_key = 0;
+    uint64_t key;
+    camera_t *camera = get_camera();
+
+    key = image_get_key(goxel.image);
+    if (camera) key = XXH64(&(uint64_t){camera_get_key(camera)},
+                            sizeof(uint64_t), key);
+    key = XXH64(&goxel.rend.settings, sizeof(goxel.rend.settings), key);
+    key = XXH64(&goxel.rend.light, sizeof(goxel.rend.light), key);
+    if (key != last_key) {
+        last_key = key;
+        return false;
+    }
+    if (goxel.pathtracer.status == PT_RUNNING) return false;
+    if (save_get_progress() >= 0) return false;
+    // The finished file and image plane tasks are only applied by
+    // goxel_iter.
+    if (goxel_file_task_get_progress(NULL) >= 0) return false;
+    if (g_image_plane_tasks) return false;
+    return !render_is_busy();
+}
+
+// Size of the tiles of the offscreen renders, in output pixels.  The tiles
+// are rendered at twice this size, and downsampled.
+#ifndef RENDER_TILE_SIZE
+#   define RENDER_TILE_SIZE 1024
+#endif
+
+// In headless mode the graphics are only created the first time we render
+// something.
+static bool init_offscreen_graphics(void)
+{
+    if (goxel.graphics_initialized) return true;
+    if (!sys_make_gl_context()) {
+        LOG_W("Cannot render without a GL context");
+        return false;
+    }
+    goxel_create_graphics();
+    return true;
+}
+
+// A tile of an offscreen render.
+typedef struct {
+    int view, x, y, w, h;
+    texture_t *fbo;
+} render_tile_t;
+
+// Get the offscreen buffers to render tiles of a given size, reused between
+// the renders as long as they are large enough.
+static void get_export_buffers(int tw, int th, int bpp,
+                               uint8_t **tmp_buf, uint8_t **tile_buf)
+{
+    int i;
+    size_t size = (size_t)tw * th * 5 * bpp;
+
+    for (i = 0; i < ARRAY_SIZE(goxel.export_fbos); i++) {
+        if (goxel.export_fbos[i] && (goxel.export_fbos[i]->tex_w < tw * 2 ||
+                                     goxel.export_fbos[i]->tex_h < th * 2)) {
+            texture_delete(goxel.export_fbos[i]);
+            goxel.export_fbos[i] = NULL;
+        }
+        if (!goxel.export_fbos[i]) {
+            goxel.export_fbos[i] = texture_new_buffer(tw * 2, th * 2,
+                                                      TF_DEPTH);
+        }
+    }
+    if (goxel.export_buf_size < size) {
+        free(goxel.export_buf);
+        goxel.export_buf = malloc(size);
+        goxel.export_buf_size = size;
+    }
+    *tmp_buf = goxel.export_buf;
+    *tile_buf = goxel.export_buf + (size_t)tw * th * 4 * bpp;
+}
+
+// Get the pixels of a rendered tile into the band buffer.
+static void read_tile(const render_tile_t *tile, int w, int bpp,
+                      uint8_t *tmp_buf, uint8_t *tile_buf, uint8_t *band)
+{
+    int i;
+
+    texture_get_data(tile->fbo, tile->w * 2, tile->h * 2, bpp, tmp_buf);
+    img_downsample(tmp_buf, tile->w * 2, tile->h * 2, bpp, tile_buf);
+    for (i = 0; i < tile->h; i++) {
+        memcpy(band + ((size_t)i * w + tile->x) * bpp,
+               tile_buf + (size_t)i * tile->w * bpp, tile->w * bpp);
+    }
+}
+
+// Render some views in tiles, and pass the rows of the images to a
+// callback once all the tiles of a band are done.  The tiles are rendered
+// alternatively into two buffers, so that the read back of a tile overlaps
+// the render of the next one.  If views is NULL, render the current view.
+static int render_views(int nb, const float (*views)[4][4],
+                        int w, int h, int bpp,
+                        void (*callback)(void *user, int view,
+                                         const uint8_t *rows, int nb),
+                        void *user)
+{
+    camera_t *camera = get_camera();
+    const volume_t *volume;
+    const int ts = RENDER_TILE_SIZE;
+    renderer_t rend = goxel.rend;
+    float rect[4], m[4][4], camera_mat[4][4];
+    float x0, x1, y0, y1;
+    uint8_t *band, *tmp_buf, *tile_buf;
+    int v, x, y, n = 0;
+    render_tile_t tile, last = {};
+
+    if (!init_offscreen_graphics()) return -1;
+    mat4_copy(camera->mat, camera_mat);
+    camera->aspect = (float)w / h;
+    volume = goxel_get_layers_volume(goxel.image);
+    get_export_buffers(min(w, ts), min(h, ts), bpp, &tmp_buf, &tile_buf);
+
+    rend.scale = 1.0;
+    rend.items = NULL;
+    rend.async = false;
+    // The levels of detail and the occlusion would differ between tiles.
+    rend.lod = false;
+    rend.occlusion_culling = false;
+
+    band = calloc((size_t)w * min(h, ts), bpp);
+    for (v = 0; v < nb; v++) {
+        if (views) mat4_copy(views[v], camera->mat);
+        camera_update(camera);
+        mat4_copy(camera->view_mat, rend.view_mat);
+        for (y = 0; y < h; y += ts)
+        for (x = 0; x < w; x += ts) {
+            tile = (render_tile_t){v, x, y, min(ts, w - x), min(ts, h - y),
+                                   goxel.export_fbos[n++ % 2]};
+            // Projection of the tile part of the view frustum.
+            x0 = -1 + 2.0 * x / w;
+            x1 = -1 + 2.0 * (x + tile.w) / w;
+            y0 = 1 - 2.0 * (y + tile.h) / h;
+            y1 = 1 - 2.0 * y / h;
+            mat4_set_identity(m);
+            m[0][0] = 2 / (x1 - x0);
+            m[1][1] = 2 / (y1 - y0);
+            m[3][0] = -(x1 + x0) / (x1 - x0);
+            m[3][1] = -(y1 + y0) / (y1 - y0);
+            mat4_mul(m, camera->proj_mat, rend.proj_mat);
+            vec4_set(rend.tile_rect, (float)x / w, (y0 + 1) / 2,
+                     (float)tile.w / w, (float)tile.h / h);
+            vec4_set(rect, 0, 0, tile.w * 2, tile.h * 2);
+            rend.fbo = tile.fbo->framebuffer;
+
+            // XXX: use goxel_get_render_layers!
+            render_volume(&rend, volume, NULL, 0);
+            render_submit(&rend, rect, (bpp == 3) ? goxel.back_color : NULL);
+            texture_read_async(tile.fbo, tile.w * 2, tile.h * 2);
+
+            // Now we can get the previous tile.
+            if (last.fbo) {
+                read_tile(&last, w, bpp, tmp_buf, tile_buf, band);
+                if (last.x + last.w == w)
+                    callback(user, last.view, band, last.h);
+            }
+            last = tile;
+        }
+    }
+    read_tile(&last, w, bpp, tmp_buf, tile_buf, band);
+    callback(user, last.view, band, last.h);
+    free(band);
+
+    mat4_copy(camera_mat, camera->mat);
+    camera_update(camera);
+    return 0;
+}
+
+typedef struct {
+    uint8_t *buf;
+    int     row_size;
+} buf_writer_t;
+
+static void on_buf_rows(void *user, int view, const uint8_t *rows, int nb)
+{
+    buf_writer_t *writer = user;
+    memcpy(writer->buf, rows, (size_t)nb * writer->row_size);
+    writer->buf += (size_t)nb * writer->row_size;
+}
+
+// Render the view into an RGB[A] buffer.
+int goxel_render_to_buf(uint8_t *buf, int w, int h, int bpp)
+{
+    buf_writer_t writer = {buf, w * bpp};
+    return render_views(1, NULL, w, h, bpp, on_buf_rows, &writer);
+}
+
+int goxel_render_views_to_buf(int nb, const float (*views)[4][4],
+                              int w, int h, int bpp, uint8_t *buf)
+{
+    // The views are rendered in order, so the rows just follow each other.
+    buf_writer_t writer = {buf, w * bpp};
+    return render_views(nb, views, w, h, bpp, on_buf_rows, &writer);
+}
+
+static void on_file_rows(void *user, int view, const uint8_t *rows, int nb)
+{
+    img_writer_write_rows(user, rows, nb);
+}
+
+int goxel_render_to_file(const char *path, int w, int h, int bpp)
+{
+    img_writer_t *writer;
+
+    // Check the GL context first, to not leave an empty file behind.
+    if (!init_offscreen_graphics()) return -1;
+    writer = img_writer_open(path, w, h, bpp);
+    if (!writer) return -1;
+    if (render_views(1, NULL, w, h, bpp, on_file_rows, writer)) {
+        img_writer_close(writer);
+        return -1;
+    }
+    return img_writer_close(writer);
+}
+
+typedef struct {
+    const char      *path;
+    int             w, h, bpp;
+    int             view;       // View of the current file.
+    img_writer_t    *writer;
+    int             ret;
+} sequence_writer_t;
+
+// Insert a number (frame or samples) before the extension of a file path.
+static void get_numbered_path(const char *path, int n, char *out, size_t size)
+{
+    const char *ext = strrchr(path, '.');
+    if (!ext || strchr(ext, '/')) ext = path + strlen(path);
+    snprintf(out, size, "%.*s-%04d%s", (int)(ext - path), path, n, ext);
+}
+
+static void on_sequence_rows(void *user, int view, const uint8_t *rows,
+                             int nb)
+{
+    sequence_writer_t *seq = user;
+    char path[1024];
+
+    if (seq->writer && seq->view != view) {
+        if (img_writer_close(seq->writer)) seq->ret = -1;
+        seq->writer = NULL;
+    }
+    if (!seq->writer && seq->view != view) {
+        seq->view = view;
+        get_numbered_path(seq->path, view, path, sizeof(path));
+        seq->writer = img_writer_open(path, seq->w, seq->h, seq->bpp);
+        if (!seq->writer) seq->ret = -1;
+    }
+    if (seq->writer) img_writer_write_rows(seq->writer, rows, nb);
+}
+
+static camera_t *find_camera(const char *name)
+{
+    camera_t *camera;
+
+    if (!name) return get_camera();
+    DL_FOREACH(goxel.image->cameras, camera) {
+        if (strcmp(camera->name, name) == 0) return camera;
+    }
+    LOG_E("No camera named '%s'", name);
+    return NULL;
+}
+
+// Prepare the path tracer for a new render with the active camera, and get
+// the size of the rendered part of the image.
+static int pathtrace_setup(int w, int h, int samples, int *bw, int *bh)
+{
+    pathtracer_t *pt = &goxel.pathtracer;
+    camera_t *camera = get_camera();
+    const int *r = pt->region;
+
+    if (r[2] && (r[0] < 0 || r[1] < 0 || r[0] + r[2] > w || r[1] + r[3] > h)) {
+        LOG_E("Region %d,%d,%d,%d out of the image", r[0], r[1], r[2], r[3]);
+        return -1;
+    }
+    *bw = r[2] ?: w;
+    *bh = r[3] ?: h;
+
+    camera->aspect = (float)w / h;
+    camera_update(camera);
+
+    pathtracer_stop(pt);
+    free(pt->buf);
+    pt->w = w;
+    pt->h = h;
+    pt->buf = calloc(*bw * *bh, 4);
+    pt->num_samples = samples;
+    return 0;
+}
+
+// Path trace the active camera view until all the samples are done.  The
+// path tracer is not stopped, so that the next render with only a
+// different camera reuses its scene.
+static void pathtrace_run(const char *path, int bw, int bh, int snapshots)
+{
+    pathtracer_t *pt = &goxel.pathtracer;
+    char snapshot_path[1024];
+    int last_samples = 0;
+    double log_time = sys_get_time();
+
+    pt->samples = 0;
+    pt->status = PT_RUNNING;
+    while (pt->status != PT_FINISHED) {
+        pathtracer_iter(pt, NULL);
+        pathtracer_wait(pt);
+        if (    path && snapshots && pt->samples != last_samples &&
+                pt->samples % snapshots == 0 &&
+                pt->samples < pt->num_samples) {
+            get_numbered_path(path, pt->samples, snapshot_path,
+                              sizeof(snapshot_path));
+            img_write(pt->buf, bw, bh, 4, snapshot_path);
+        }
+        if (sys_get_time() - log_time > 1) {
+            LOG_I("Render: %d/%d samples", pt->samples, pt->num_samples);
+            log_time = sys_get_time();
+        }
+        last_samples = pt->samples;
+    }
+    if (path) img_write(pt->buf, bw, bh, 4, path);
+}
+
+int goxel_pathtrace_to_file(const char *path, int w, int h, int samples,
+                            const char *camera_name, int snapshots)
+{
+    pathtracer_t *pt = &goxel.pathtracer;
+    camera_t *camera;
+    int bw, bh;
+    double start_time = sys_get_time();
+
+    camera = find_camera(camera_name);
+    if (!camera) return -1;
+    goxel.image->active_camera = camera;
+    if (pathtrace_setup(w, h, samples, &bw, &bh)) return -1;
+    pathtrace_run(path, bw, bh, snapshots);
+    if (path) LOG_I("Rendered %s in %.1fs", path, sys_get_time() - start_time);
+    // Machine readable stats, for benchmarks.
+    LOG_I("pathtracer-stats: {\"width\": %d, \"height\": %d, "
+          "\"samples\": %d, \"time\": %.3f, \"sync_time\": %.3f, "
+          "\"shapes_time\": %.3f, \"bvh_time\": %.3f, "
+          "\"render_time\": %.3f, \"rays\": %.0f, "
+          "\"rays_per_sec\": %.0f, \"samples_per_sec\": %.3f}",
+          bw, bh, pt->samples, sys_get_time() - start_time,
+          pt->stats.sync_time, pt->stats.shapes_time, pt->stats.bvh_time,
+          pt->stats.render_time, pt->stats.rays, pt->stats.rays_per_sec,
+          pt->stats.render_time > 0 ?
+            pt->samples / pt->stats.render_time : 0);
+    pathtracer_stop(pt);
+    return 0;
+}
+
+int goxel_get_turntable_views(const char *camera_name, int nb,
+                              float (*views)[4][4])
+{
+    camera_t *camera, *tmp;
+    int i;
+
+    camera = find_camera(camera_name);
+    if (!camera) return -1;
+    goxel.image->active_camera = camera;
+    tmp = camera_copy(camera);
+    for (i = 0; i < nb; i++) {
+        mat4_copy(tmp->mat, views[i]);
+        camera_turntable(tmp, 2 * M_PI / nb, 0);
+    }
+    camera_delete(tmp);
+    return 0;
+}
+
+int goxel_render_sequence_to_files(const char *path, int nb,
+                                   const float (*views)[4][4],
+                                   int w, int h, int bpp, int samples)
+{
+    sequence_writer_t seq = {path, w, h, bpp, -1};
+    camera_t *camera = get_camera();
+    float camera_mat[4][4];
+    char frame_path[1024];
+    int i, bw, bh;
+    double start_time = sys_get_time();
+
+    if (!samples) {
+        // Check the GL context first, to not leave an empty file behind.
+        if (!init_offscreen_graphics()) return -1;
+        if (render_views(nb, views, w, h, bpp, on_sequence_rows, &seq))
+            seq.ret = -1;
+        if (seq.writer && img_writer_close(seq.writer)) seq.ret = -1;
+        if (!seq.ret) {
+            LOG_I("Rendered %d frames in %.1fs", nb,
+                  sys_get_time() - start_time);
+        }
+        return seq.ret;
+    }
+
+    if (pathtrace_setup(w, h, samples, &bw, &bh)) return -1;
+    mat4_copy(camera->mat, camera_mat);
+    for (i = 0; i < nb; i++) {
+        mat4_copy(views[i], camera->mat);
+        camera_update(camera);
+        get_numbered_path(path, i, frame_path, sizeof(frame_path));
+        pathtrace_run(frame_path, bw, bh, 0);
+        LOG_I("Rendered frame %d/%d", i + 1, nb);
+    }
+    pathtracer_stop(&goxel.pathtracer);
+    mat4_copy(camera_mat, camera->mat);
+    camera_update(camera);
+    LOG_I("Rendered %d frames in %.1fs", nb, sys_get_time() - start_time);
+    return 0;
+}
+
+void goxel_add_hint(int flags, const char *title, const char *msg)
+{
+    hint_t hint;
+    int i;
+
+    // Can only be on coordinates hint.
+    if (flags & HINT_COORDINATES) {
+        for (i = 0; i < arrlen(goxel.hints); i++) {
+            if (goxel.hints[i].flags & HINT_COORDINATES) {
+                return;
+            }
+        }
+    }
+    hint.flags = flags;
+    snprintf(hint.msg, sizeof(hint.msg), "%s", msg);
+    snprintf(hint.title, sizeof(hint.title), "%s", title ?: "");
+    arrput(goxel.hints, hint);
+}
+
+void goxel_import_image_plane(const char *path)
+{
+    image_plane_task_t *task;
+    task = calloc(1, sizeof(*task));
+    task->path = strdup(path);
+    DL_APPEND(g_image_plane_tasks, task);
+    jobs_async(image_plane_task_run, task);
+}
+
+palette_t *goxel_get_palettes(void)
+{
+    if (!goxel.palettes_loaded) {
+        palette_load_all(&goxel.palettes);
+        goxel.palettes_loaded = true;
+    }
+    return goxel.palettes;
 }
 
 void goxel_on_low_memory(void)
 {
-    render_on_low_memory(&goxel.rend);
+    cache_on_low_memory();
+    image_pack_history(goxel.image, 0);
+}
+
+// Finish an import into the current image.
+static void on_imported(const file_format_t *f, const char *path,
+                        bool image_was_empty)
+{
+    if (!image_was_empty) return;
+    image_auto_resize(goxel.image);
+    free(goxel.image->export_path);
+    goxel.image->export_path = strdup(path);
+    goxel.image->export_fmt = f->name;
 }
 
 int goxel_import_file(const char *path, const char *format)
@@ -1388,6 +2540,7 @@ int goxel_import_file(const char *path, const char *format)
     const file_format_t *f;
     int err;
     bool image_was_empty;
+    TRACE_SCOPE("goxel_import_file");
 
     image_was_empty = image_is_empty(goxel.image);
 
@@ -1401,16 +2554,10 @@ int goxel_import_file(const char *path, const char *format)
             if (!path) return -1;
         }
         err = f->import_func(f, goxel.image, path);
+        if (!err) image_dedup(goxel.image);
     }
     if (err) return err;
-
-    if (image_was_empty) {
-        image_auto_resize(goxel.image);
-        assert(!goxel.image->export_path);
-        goxel.image->export_path = strdup(path);
-        goxel.image->export_fmt = f->name;
-    }
-
+    if (f) on_imported(f, path, image_was_empty);
     return 0;
 }
 
@@ -1433,12 +2580,26 @@ static void get_export_path(const file_format_t *f, char *buf, size_t size)
     snprintf(buf, size, "Untitled.%s", ext);
 }
 
+// Finish an export of the current image.
+static void on_exported(const file_format_t *f, const char *path)
+{
+    char *new_export_path;
+
+    // path might be equal to export_path, so we must strdup() it before we
+    // free export_path
+    new_export_path = strdup(path);
+    free(goxel.image->export_path);
+    goxel.image->export_path = new_export_path;
+    goxel.image->export_fmt = f->name;
+    sys_on_saved(new_export_path);
+}
+
 int goxel_export_to_file(const char *path, const char *format)
 {
     const file_format_t *f;
     char name[128];
     int err;
-    char *new_export_path;
+    TRACE_SCOPE("goxel_export_to_file");
 
     f = file_format_get(path, format, "w");
     if (!f) return -1;
@@ -1449,17 +2610,157 @@ int goxel_export_to_file(const char *path, const char *format)
     }
     err = f->export_func(f, goxel.image, path);
     if (err) return err;
-
-    // path might be equal to export_path, so we must strdup() it before we
-    // free export_path
-    new_export_path = strdup(path);
-    free(goxel.image->export_path);
-    goxel.image->export_path = new_export_path;
-    goxel.image->export_fmt = f->name;
-    sys_on_saved(new_export_path);
+    on_exported(f, path);
     return 0;
 }
 
+// Background import or export task.
+typedef struct {
+    file_format_task_t  task;
+    const file_format_t *format;
+    bool        import;
+    const image_t *src;     // The exported image, only used as identifier.
+    image_t     *image;     // Private image the format works on.
+    layer_t     *layer;     // Initial layer of the private import image.
+    char        *path;
+    int         err;
+    int         done;
+} file_task_t;
+
+static file_task_t *g_file_task = NULL;
+
+static void file_task_run(void *user)
+{
+    file_task_t *task = user;
+    const file_format_t *f = task->format;
+
+    file_format_set_task(&task->task);
+    if (task->import)
+        task->err = f->import_func(f, task->image, task->path);
+    else
+        task->err = f->export_func(f, task->image, task->path);
+    file_format_set_task(NULL);
+    __atomic_store_n(&task->done, 1, __ATOMIC_RELEASE);
+}
+
+static void file_task_start(file_task_t *task)
+{
+    goxel_file_task_update(true); // Only one task at a time.
+    LOG_I("%s %s", task->import ? "Import" : "Export", task->path);
+    task->path = strdup(task->path);
+    g_file_task = task;
+    jobs_async(file_task_run, task);
+}
+
+// Add the result of an import into the current image.
+static void file_task_end_import(file_task_t *task)
+{
+    bool image_was_empty = image_is_empty(goxel.image);
+    layer_t *layer, *tmp;
+
+    // The formats either write into the active layer, or add new layers.
+    if (!volume_is_empty(task->layer->volume)) {
+        volume_merge(goxel.image->active_layer->volume, task->layer->volume,
+                     MODE_OVER, NULL);
+    }
+    DL_FOREACH_SAFE(task->image->layers, layer, tmp) {
+        if (layer == task->layer) continue;
+        DL_DELETE(task->image->layers, layer);
+        image_add_layer(goxel.image, layer);
+    }
+    task->image->active_layer = task->layer;
+    image_dedup(goxel.image);
+    on_imported(task->format, task->path, image_was_empty);
+}
+
+void goxel_import_file_async(const char *path, const char *format)
+{
+    const file_format_t *f;
+    file_task_t *task;
+
+    f = file_format_get(path, format, "r");
+    if ((path && str_endswith(path, ".gox")) || !f || !f->thread_safe) {
+        goxel_import_file(path, format);
+        return;
+    }
+    if (!path) {
+        path = sys_open_file_dialog("Import", NULL, f->exts, f->exts_desc);
+        if (!path) return;
+    }
+    task = calloc(1, sizeof(*task));
+    task->format = f;
+    task->import = true;
+    task->image = image_new();
+    task->layer = task->image->active_layer;
+    task->path = (char*)path;
+    file_task_start(task);
+}
+
+void goxel_export_to_file_async(const char *path, const char *format)
+{
+    const file_format_t *f;
+    char name[128];
+    file_task_t *task;
+
+    f = file_format_get(path, format, "w");
+    if (!f) return;
+    if (!f->thread_safe) {
+        goxel_export_to_file(path, format);
+        return;
+    }
+    if (!path) {
+        get_export_path(f, name, sizeof(name));
+        path = sys_get_save_path(name, f->exts, f->exts_desc);
+        if (!path) return;
+    }
+    task = calloc(1, sizeof(*task));
+    task->format = f;
+    task->src = goxel.image;
+    // The volumes are copy on write, so the snapshot is cheap.
+    task->image = image_copy(goxel.image);
+    task->path = (char*)path;
+    file_task_start(task);
+}
+
+int goxel_file_task_get_progress(bool *import)
+{
+    if (!g_file_task) return -1;
+    if (import) *import = g_file_task->import;
+    return __atomic_load_n(&g_file_task->task.progress, __ATOMIC_RELAXED);
+}
+
+void goxel_file_task_cancel(void)
+{
+    if (!g_file_task) return;
+    __atomic_store_n(&g_file_task->task.cancel, 1, __ATOMIC_RELAXED);
+}
+
+void goxel_file_task_update(bool wait)
+{
+    file_task_t *task = g_file_task;
+
+    if (!task) return;
+    if (!wait && !__atomic_load_n(&task->done, __ATOMIC_ACQUIRE)) return;
+    while (!__atomic_load_n(&task->done, __ATOMIC_ACQUIRE)) {}
+    g_file_task = NULL;
+    if (task->task.cancel) {
+        LOG_I("%s cancelled", task->import ? "Import" : "Export");
+    } else if (task->err) {
+        gui_alert(_("Error"), task->import ? _("Cannot import the file") :
+                                             _("Cannot export the file"));
+    } else if (task->import) {
+        file_task_end_import(task);
+    } else if (task->src == goxel.image) {
+        on_exported(task->format, task->path);
+    } else {
+        sys_on_saved(task->path);
+    }
+    // The image can own textures, so we delete it on the main thread.
+    image_delete(task->image);
+    free(task->path);
+    free(task);
+}
+
 static void a_overwrite_export(void)
 {
     if (!goxel.image->export_path) {
@@ -1509,20 +2810,99 @@ void goxel_add_recent_file(const char *path)
     fclose(file);
 }
 
-void goxel_apply_color_filter(
-        void (*fn)(void *args, uint8_t color[4]), void *args)
+/*
+ * The selected voxels of a layer, with the table of their unique colors.
+ * Kept in a cache, so that when a filter gets applied again on the same
+ * layer and selection (like when we drag a slider in the filter gui), we
+ * don't have to redo the copy and the intersection.
+ */
+typedef struct {
+    volume_t    *volume;        // The selected voxels.
+    int         nb_tiles;
+    int         (*tiles)[3];    // Non empty tiles of the volume.
+    int         nb_colors;
+    uint32_t    *colors;        // Unique colors of the volume.
+    int         table_size;     // Always a power of two.
+    int         *table;         // Hash table color -> index, or -1.
+} color_filter_source_t;
+
+typedef struct {
+    const color_filter_source_t *source;
+    const uint32_t *results;    // Filtered value of each unique color.
+} color_filter_ctx_t;
+
+static int color_filter_source_del(void *data)
+{
+    color_filter_source_t *source = data;
+    volume_delete(source->volume);
+    free(source->tiles);
+    free(source->colors);
+    free(source->table);
+    free(source);
+    return 0;
+}
+
+static int *color_filter_find(const color_filter_source_t *source, uint32_t c)
 {
-    layer_t *layer = goxel.image->active_layer;
+    int i = (c * 2654435761u) & (source->table_size - 1);
+    while (    source->table[i] != -1 &&
+               source->colors[source->table[i]] != c)
+        i = (i + 1) & (source->table_size - 1);
+    return &source->table[i];
+}
+
+static void color_filter_add_color(color_filter_source_t *source, uint32_t c)
+{
+    int i, *slot;
+    int *old_table = source->table, old_size = source->table_size;
+
+    slot = color_filter_find(source, c);
+    if (*slot != -1) return;
+    source->colors[source->nb_colors] = c;
+    *slot = source->nb_colors++;
+    if (source->nb_colors * 2 < source->table_size) return;
+    // Grow the table, keeping it at most half full.
+    source->table_size *= 2;
+    source->colors = realloc(source->colors,
+                             source->table_size / 2 * sizeof(uint32_t));
+    source->table = malloc(source->table_size * sizeof(int));
+    memset(source->table, 0xff, source->table_size * sizeof(int));
+    for (i = 0; i < old_size; i++) {
+        if (old_table[i] == -1) continue;
+        *color_filter_find(source, source->colors[old_table[i]]) =
+            old_table[i];
+    }
+    free(old_table);
+}
+
+static color_filter_source_t *color_filter_get_source(void)
+{
+    static cache_t *cache = NULL;
+    image_t *img = goxel.image;
+    color_filter_source_t *source;
     volume_t *volume;
     volume_iterator_t iter;
-    int p[3];
-    uint8_t color[4];
     painter_t painter;
-    image_t *img = goxel.image;
+    int i, pos[3], tiles_size = 0;
+    uint32_t c, last = 0;
+    uint8_t (*voxels)[4];
+    struct {
+        uint64_t layer_key;
+        uint64_t mask_key;
+        float box[4][4];
+    } key = {
+        .layer_key = volume_get_key(img->active_layer->volume),
+        .mask_key = volume_get_key(img->selection_mask),
+    };
+
+    if (!cache) cache = cache_create("color_filter", 4);
+    mat4_copy(img->selection_box, key.box);
+    source = cache_get(cache, &key, sizeof(key));
+    if (source) return source;
 
     /* Compute the volume where we want to apply the filter.  Mask, rect
      * selection, or the whole layer.  */
-    volume = volume_copy(layer->volume);
+    volume = volume_copy(img->active_layer->volume);
     if (!volume_is_empty(img->selection_mask)) {
         volume_merge(volume, img->selection_mask, MODE_INTERSECT, NULL);
     } else if (!box_is_null(img->selection_box)) {
@@ -1533,17 +2913,106 @@ void goxel_apply_color_filter(
         };
         volume_op(volume, &painter, img->selection_box);
     }
+
+    source = calloc(1, sizeof(*source));
+    source->volume = volume;
+    source->table_size = 256;
+    source->table = malloc(source->table_size * sizeof(int));
+    source->colors = malloc(source->table_size / 2 * sizeof(uint32_t));
+    memset(source->table, 0xff, source->table_size * sizeof(int));
+    voxels = malloc(TILE_SIZE * TILE_SIZE * TILE_SIZE * 4);
     iter = volume_get_iterator(volume,
-            VOLUME_ITER_VOXELS | VOLUME_ITER_SKIP_EMPTY);
-    while (volume_iter(&iter, p)) {
-        volume_get_at(volume, &iter, p, color);
-        fn(args, color);
-        volume_set_at(volume, &iter, p, color);
+            VOLUME_ITER_TILES | VOLUME_ITER_SKIP_EMPTY);
+    while (volume_iter(&iter, pos)) {
+        if (source->nb_tiles >= tiles_size) {
+            tiles_size = max(64, tiles_size * 2);
+            source->tiles = realloc(source->tiles,
+                                    tiles_size * sizeof(*source->tiles));
+        }
+        memcpy(source->tiles[source->nb_tiles++], pos, sizeof(pos));
+        volume_get_tile_voxels(volume, NULL, pos, voxels);
+        for (i = 0; i < TILE_SIZE * TILE_SIZE * TILE_SIZE; i++) {
+            if (!voxels[i][3]) continue;
+            memcpy(&c, voxels[i], 4);
+            // Most neighbor voxels have the same color.
+            if (c == last && source->nb_colors) continue;
+            color_filter_add_color(source, c);
+            last = c;
+        }
+    }
+    free(voxels);
+    cache_add(cache, &key, sizeof(key), source, 1, color_filter_source_del);
+    return source;
+}
+
+// Called in parallel for each selected tile of the layer.
+static bool color_filter_apply_tile(void *user, const int pos[3],
+                                    uint8_t (*voxels)[4])
+{
+    const color_filter_ctx_t *ctx = user;
+    const color_filter_source_t *source = ctx->source;
+    uint8_t src[TILE_SIZE * TILE_SIZE * TILE_SIZE][4];
+    uint32_t c, last = 0, last_result = 0;
+    bool has_last = false;
+    int i;
+
+    volume_get_tile_voxels(source->volume, NULL, pos, src);
+    for (i = 0; i < TILE_SIZE * TILE_SIZE * TILE_SIZE; i++) {
+        if (!src[i][3]) continue;
+        memcpy(&c, src[i], 4);
+        if (!has_last || c != last) {
+            last = c;
+            last_result = ctx->results[*color_filter_find(source, c)];
+            has_last = true;
+        }
+        memcpy(voxels[i], &last_result, 4);
     }
+    return true;
+}
+
+void goxel_apply_color_filter(
+        void (*fn)(void *args, uint8_t color[4]), void *args)
+{
+    layer_t *layer = goxel.image->active_layer;
+    const color_filter_source_t *source;
+    uint32_t *results;
+    int i;
 
-    // Merge back into the original layer.
-    volume_merge(layer->volume, volume, MODE_OVER, NULL);
-    volume_delete(volume);
+    // Only filter each unique color once.
+    source = color_filter_get_source();
+    results = malloc(max(source->nb_colors, 1) * sizeof(*results));
+    for (i = 0; i < source->nb_colors; i++) {
+        results[i] = source->colors[i];
+        fn(args, (uint8_t*)&results[i]);
+    }
+    volume_apply_tiles(layer->volume, source->nb_tiles,
+                       (const int (*)[3])source->tiles,
+                       color_filter_apply_tile,
+                       &(color_filter_ctx_t){source, results});
+    free(results);
+}
+
+/*
+ * Get the selection box as an integer aabb.  Return false if the box is not
+ * axis aligned with its faces on the voxels boundaries, in which case it has
+ * to go through the cube shape code.
+ */
+static bool get_selection_aabb(const image_t *img, int aabb[2][3])
+{
+    const float (*b)[4] = img->selection_box;
+    float lo, hi;
+    int i;
+
+    if (box_is_null(b) || !box_is_bbox(b)) return false;
+    for (i = 0; i < 3; i++) {
+        lo = b[3][i] - fabsf(b[i][i]);
+        hi = b[3][i] + fabsf(b[i][i]);
+        if (fabsf(lo - roundf(lo)) > 0.001 || fabsf(hi - roundf(hi)) > 0.001)
+            return false;
+        aabb[0][i] = roundf(lo);
+        aabb[1][i] = roundf(hi);
+    }
+    return true;
 }
 
 static void a_cut_as_new_layer(void)
@@ -1553,14 +3022,20 @@ static void a_cut_as_new_layer(void)
     image_t *img = goxel.image;
     layer_t *layer = img->active_layer;
     const float (*box)[4][4] = &img->selection_box;
+    int aabb[2][3];
 
     new_layer = image_duplicate_layer(img, layer);
 
     // Use the mask in priority.
     if (!volume_is_empty(img->selection_mask)) {
-        volume_merge(new_layer->volume, img->selection_mask,
-                     MODE_INTERSECT, NULL);
-        volume_merge(layer->volume, img->selection_mask , MODE_SUB, NULL);
+        volume_extract(layer->volume, img->selection_mask, NULL, NULL, true,
+                       new_layer->volume);
+        return;
+    }
+
+    if (get_selection_aabb(img, aabb)) {
+        volume_extract(layer->volume, NULL, aabb, NULL, true,
+                       new_layer->volume);
         return;
     }
 
@@ -1628,6 +3103,7 @@ static void a_add_selection(void)
     volume_t *tmp;
     painter_t painter;
     image_t *img = goxel.image;
+    int aabb[2][3];
 
     if (box_is_null(img->selection_box)) return;
     painter = (painter_t) {
@@ -1635,8 +3111,14 @@ static void a_add_selection(void)
         .mode = MODE_INTERSECT_FILL,
         .color = {255, 255, 255, 255},
     };
-    tmp = volume_copy(goxel.image->active_layer->volume);
-    volume_op(tmp, &painter, img->selection_box);
+    if (get_selection_aabb(img, aabb)) {
+        tmp = volume_new();
+        volume_extract(img->active_layer->volume, NULL, aabb, painter.color,
+                       false, tmp);
+    } else {
+        tmp = volume_copy(goxel.image->active_layer->volume);
+        volume_op(tmp, &painter, img->selection_box);
+    }
     if (img->selection_mask == NULL) img->selection_mask = volume_new();
     volume_merge(img->selection_mask, tmp, MODE_OVER, painter.color);
     volume_delete(tmp);
@@ -1667,13 +3149,32 @@ ACTION_REGISTER(ACTION_sub_selection,
     .cfunc = a_sub_selection,
 )
 
+static void a_invert_selection(void)
+{
+    image_t *img = goxel.image;
+    if (img->selection_mask == NULL) img->selection_mask = volume_new();
+    volume_invert_mask(img->selection_mask, img->active_layer->volume);
+}
+
+ACTION_REGISTER(ACTION_invert_selection,
+    .help = N_("Selects the voxels of the layer that are not selected"),
+    .cfunc = a_invert_selection,
+)
+
 static void copy_action(void)
 {
     painter_t painter;
     image_t *img = goxel.image;
+    int aabb[2][3];
 
     volume_delete(goxel.clipboard.volume);
     mat4_copy(img->selection_box, goxel.clipboard.box);
+    if (get_selection_aabb(img, aabb)) {
+        goxel.clipboard.volume = volume_new();
+        volume_extract(img->active_layer->volume, NULL, aabb, NULL, false,
+                       goxel.clipboard.volume);
+        return;
+    }
     goxel.clipboard.volume = volume_copy(goxel.image->active_layer->volume);
     if (!box_is_null(img->selection_box)) {
         painter = (painter_t) {
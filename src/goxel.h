@@ -34,6 +34,7 @@
 #include "block_def.h"
 #include "camera.h"
 #include "filters.h"
+#include "generator.h"
 #include "gesture.h"
 #include "gesture3d.h"
 #include "gizmos.h"
@@ -44,28 +45,39 @@
 #include "layer.h"
 #include "log.h"
 #include "material.h"
+#include "mem_tracker.h"
+#include "mesh_voxelizer.h"
 #include "volume.h"
 #include "volume_utils.h"
 #include "model3d.h"
 #include "palette.h"
 #include "pathtracer.h"
+#include "profiler.h"
+#include "region.h"
+#include "replay.h"
 #include "render.h"
 #include "shape.h"
+#include "sync.h"
 #include "system.h"
 #include "theme.h"
+#include "thumbnails.h"
 #include "tools.h"
 #include "utarray.h"
 #include "uthash.h"
 #include "utlist.h"
 
+#include "utils/arena.h"
 #include "utils/box.h"
 #include "utils/cache.h"
 #include "utils/color.h"
 #include "utils/geometry.h"
 #include "utils/gl.h"
 #include "utils/img.h"
+#include "utils/jobs.h"
 #include "utils/path.h"
 #include "utils/plane.h"
+#include "utils/reader.h"
+#include "utils/simd.h"
 #include "utils/sound.h"
 #include "utils/texture.h"
 #include "utils/vec.h"
@@ -269,6 +281,7 @@ static inline void set_flag(int *x, int flag, bool v)
 
 /*
  * Extra texture creation function from a path, that can also be an asset.
+ * The images bigger than goxel.image_max_size are downscaled.
  */
 texture_t *texture_new_image(const char *path, int flags);
 
@@ -429,8 +442,7 @@ enum {
 #undef X
 
 // #### Block ##################
-// The block size can only be 16.
-#define BLOCK_SIZE 16
+#define BLOCK_SIZE TILE_SIZE
 #define VOXEL_TEXTURE_SIZE 8
 
 // Generate an optimal palette whith a fixed number of colors from a volume.
@@ -468,6 +480,40 @@ typedef struct hint {
     char msg[128];
 } hint_t;
 
+// Cached list of the render layers, see <goxel_get_render_layers>.
+typedef struct {
+    layer_t    *layers;
+    uint64_t   *keys;   // Key of the source layers of each render layer.
+    int        nb;
+    uint64_t   hash;
+    // The render layer of the active layer, and its source layers.
+    layer_t    *active;
+    layer_t    *active_first;
+    layer_t    *active_end;
+} render_layers_t;
+
+/*
+ * Type: tool_overlay_t
+ * Preview of the tool volume over the render layers.
+ *
+ * Attributes:
+ *   layer  - The render layer of the active layer.
+ *   volume - The layer tiles with the tool preview.  Only contains the
+ *            replaced tiles and their neighbors, unless full is set.
+ *   full   - Set if the volume replaces the whole layer volume.
+ *   nb     - Number of replaced tiles.
+ *   tiles  - Position of the replaced tiles.
+ *   hash   - Key of the sources of the overlay.
+ */
+typedef struct {
+    const layer_t *layer;
+    volume_t   *volume;
+    bool       full;
+    int        nb;
+    int        (*tiles)[3];
+    uint64_t   hash;
+} tool_overlay_t;
+
 typedef struct goxel
 {
     int        screen_size[2];
@@ -484,14 +530,20 @@ typedef struct goxel
     // during render.
     volume_t   *tool_volume;
 
-    volume_t   *layers_volume_;
-    uint32_t   layers_volume_hash;
+    // Tools can set this volume to render it on top of the layers with a
+    // model matrix, to preview a transformation without moving the voxels.
+    volume_t   *tool_moved_volume;
+    float      tool_moved_mat[4][4];
 
-    volume_t   *render_volume_; // All the layers + tool volume.
-    uint32_t   render_volume_hash;
+    // Merge of all the visible layers, updated incrementally.
+    volume_stack_t layers_stack;
+    uint64_t   layers_volume_hash;
 
-    layer_t    *render_layers;
-    uint32_t   render_layers_hash;
+    volume_stack_t render_stack; // All the layers + tool volume.
+    uint64_t   render_volume_hash;
+
+    render_layers_t render_layers[2]; // Without and with tool preview.
+    tool_overlay_t tool_overlay;
 
     struct     {
         volume_t *volume;
@@ -510,6 +562,13 @@ typedef struct goxel
     bool       hide_box;
 
     texture_t  *pick_fbo;
+    uint32_t   *pick_data;      // CPU copy of the pick fbo, once read.
+    texture_t  *view_fbo;       // Low resolution view, see view_scale.
+    // Offscreen render buffers, kept between the exports.  The renders
+    // use the two fbos in turn.
+    texture_t  *export_fbos[2];
+    uint8_t    *export_buf;
+    size_t     export_buf_size;
     painter_t  painter;
     renderer_t rend;
 
@@ -517,6 +576,28 @@ typedef struct goxel
     float      tool_radius;
     bool       pathtrace; // Render pathtraced mode.
 
+    // Render the view at a lower resolution while the camera moves, so
+    // that the frame rate stays close to target_fps.
+    bool       dynamic_resolution;
+    float      target_fps;
+
+    // Render the 3d view in a separate thread, see render_thread_start.
+    // Experimental, off by default.
+    bool       render_thread;
+
+    // Memory budget of the voxels tiles in MB, or 0 for no limit.  Above it
+    // the undo history tiles get compressed, then moved to the disk.
+    int        tiles_mem_budget;
+    // Memory budget of the undo history in MB, or 0 for no limit.  Above it
+    // the oldest snapshots get deleted.
+    int        history_mem_budget;
+    // Move the old snapshots to the disk instead of deleting them.
+    bool       history_spill;
+    // Max width and height of the images textures, the bigger images are
+    // downscaled when loaded, or 0 for no limit.
+    int        image_max_size;
+    float      view_scale;  // Current view resolution scale, in (0, 1].
+
     struct {
         float  rotation[4];
         float  pos[2];
@@ -524,12 +605,18 @@ typedef struct goxel
         float  camera_mat[4][4];
     } move_origin;
 
-    palette_t  *palettes;   // The list of all the palettes
+    // The list of all the palettes, only containing the default one until
+    // goxel_get_palettes is called.
+    palette_t  *palettes;
+    bool       palettes_loaded;
     palette_t  *palette;    // The current color palette
 
     double     delta_time;  // Elapsed time since last frame (sec)
     int        frame_count; // Global frames counter.
     double     frame_time;  // Clock time at beginning of the frame (sec)
+    // If set, used as the clock time of the next frame instead of the
+    // system time, to replay recorded inputs.
+    double     replay_time;
     double     fps;         // Average fps.
     bool       quit;        // Set to true to quit the application.
 
@@ -601,12 +688,35 @@ void goxel_release_graphics(void);
  */
 void goxel_on_low_memory(void);
 
+/*
+ * Function: goxel_get_palettes
+ * Return the list of all the palettes, loading them on first call.
+ */
+palette_t *goxel_get_palettes(void);
+
 int goxel_unproject(const float viewport[4],
                     const float pos[2], int snap_mask,
                     const float snap_shape[4][4],
                     float offset,
                     float out[3], float normal[3]);
 
+/*
+ * Function: goxel_get_visible_voxels
+ * Get the voxels of a volume visible from the current camera.
+ *
+ * The volume is rendered into the pick buffer, and all the voxels seen by
+ * the pixels inside a rectangle are set in the output volume.
+ *
+ * Parameters:
+ *   view   - The viewport of the 3d view.
+ *   rect   - Rectangle in normalized device coordinates, as
+ *            (xmin, ymin, xmax, ymax).
+ *   volume - The volume to test.
+ *   out    - Volume that gets the visible voxels set to white.
+ */
+void goxel_get_visible_voxels(const float view[4], const float rect[4],
+                              const volume_t *volume, volume_t *out);
+
 void goxel_render_view(const float viewport[4], bool render_mode);
 void goxel_render_export_view(const float viewport[4]);
 // Called by the gui when the mouse hover a 3D view.
@@ -625,13 +735,29 @@ const volume_t *goxel_get_render_volume(const image_t *img);
  * This returns a simplified list of layers from the current image where
  * we merged as many layers as possible into a single one.
  *
- * It also can replace the current layer volume with the tool preview.
+ * The clones that are instances of their base layer (see
+ * <image_get_instance_base>) are not included, the renderers add them from
+ * the base layer volume.  With the tool preview, the shape layers that we
+ * can render directly are not included either, and the preview of the tool
+ * volume is given by <goxel_get_tool_overlay>.
  *
  * This is the function that should be used the get the actual list of layers
  * to be rendered.
  */
 const layer_t *goxel_get_render_layers(bool with_tool_preview);
 
+/*
+ * Function: goxel_get_tool_overlay
+ * Get the preview of the tool volume over the render layers.
+ *
+ * Only the tiles where the tool volume differs from the active layer are
+ * merged again, so the cost doesn't depend on the size of the layers.
+ *
+ * Return:
+ *   The overlay, or NULL if there is no tool preview.
+ */
+const tool_overlay_t *goxel_get_tool_overlay(void);
+
 enum {
     HINT_LARGE = 1 << 2,
     HINT_COORDINATES = 1 << 3,
@@ -639,17 +765,152 @@ enum {
 
 void goxel_add_hint(int flags, const char *title, const char *msg);
 
+/*
+ * Function: goxel_import_image_plane
+ * Add an image plane layer from an image file.
+ *
+ * The image is decoded in the background, the layer only gets added to the
+ * current image once it is ready.
+ */
 void goxel_import_image_plane(const char *path);
 
 int goxel_import_file(const char *path, const char *format);
 int goxel_export_to_file(const char *path, const char *format);
 
-// Render the view into an RGB[A] buffer.
-void goxel_render_to_buf(uint8_t *buf, int w, int h, int bpp);
+/*
+ * Function: goxel_import_file_async
+ * Same as <goxel_import_file>, but import the file in the background.
+ *
+ * The file is imported into a private image, and the result is only added
+ * to the current image once the import is done, so that we can keep
+ * editing in the meantime.  The gox files, and the formats that are not
+ * thread safe are still imported immediately.
+ */
+void goxel_import_file_async(const char *path, const char *format);
+
+/*
+ * Function: goxel_export_to_file_async
+ * Same as <goxel_export_to_file>, but export a snapshot of the image in
+ * the background.  The formats that are not thread safe are still
+ * exported immediately.
+ */
+void goxel_export_to_file_async(const char *path, const char *format);
+
+// Return the progress in percent of the background import or export, or
+// -1 if there is none.  If set, import receives the kind of the task.
+int goxel_file_task_get_progress(bool *import);
+
+// Cancel the background import or export.  The import result is dropped,
+// but a cancelled export can leave a partial file.
+void goxel_file_task_cancel(void);
+
+// Finish the background import or export if it is done, or wait for it.
+void goxel_file_task_update(bool wait);
+
+/*
+ * Function: goxel_render_to_buf
+ * Render the view into an RGB[A] buffer.
+ *
+ * Return -1 if there is no GL context to render with, in that case the
+ * buffer is left unchanged.
+ */
+int goxel_render_to_buf(uint8_t *buf, int w, int h, int bpp);
+
+/*
+ * Function: goxel_render_views_to_buf
+ * Render several views of the image into RGB[A] buffers, like for the
+ * frames of a turntable.
+ *
+ * This is faster than calling <goxel_render_to_buf> for each view, since
+ * the read back of a view overlaps the render of the next one.  The
+ * current camera is left unchanged.
+ *
+ * Parameters:
+ *   nb    - Number of views.
+ *   views - The camera matrix of each view (see <camera_t>).
+ *   w, h  - Size of the images.
+ *   bpp   - Bytes per pixel, 3 or 4.
+ *   buf   - Output buffer for the nb images, one after the other.
+ *
+ * Return -1 if there is no GL context to render with.
+ */
+int goxel_render_views_to_buf(int nb, const float (*views)[4][4],
+                              int w, int h, int bpp, uint8_t *buf);
+
+/*
+ * Function: goxel_render_to_file
+ * Render the view into a png file.
+ *
+ * The image is rendered in tiles, and written a few rows at a time, so
+ * that we can export images larger than the maximum texture size without
+ * having them fully in memory.
+ *
+ * Return -1 if there is no GL context to render with, or if the file
+ * cannot be written.
+ */
+int goxel_render_to_file(const char *path, int w, int h, int bpp);
+
+/*
+ * Function: goxel_get_turntable_views
+ * Compute the views of a full turn of a camera around its target.
+ *
+ * The camera also becomes the active camera, so that the views are
+ * rendered with its projection.
+ *
+ * Parameters:
+ *   camera_name - Name of the camera, NULL for the active one.
+ *   nb          - Number of views.
+ *   views       - Receives the camera matrices, the first one is the
+ *                 current camera position.
+ *
+ * Return -1 if there is no camera with this name.
+ */
+int goxel_get_turntable_views(const char *camera_name, int nb,
+                              float (*views)[4][4]);
+
+/*
+ * Function: goxel_render_sequence_to_files
+ * Render several views of the image into numbered png files, like the
+ * frames of an animation.
+ *
+ * The frame number is inserted before the extension of the path, for
+ * example 'out.png' gives 'out-0000.png', 'out-0001.png', etc.  The render
+ * caches stay valid from one frame to the next: the tiles meshes with the
+ * offscreen renderer, and the scene of the path tracer, that only has to
+ * update its camera.
+ *
+ * Parameters:
+ *   path    - Path of the files.
+ *   nb      - Number of frames.
+ *   views   - The camera matrix of each frame (see <camera_t>).
+ *   w, h    - Size of the images.
+ *   bpp     - Bytes per pixel of the offscreen renders, 3 or 4.  The path
+ *             traced images are always RGBA.
+ *   samples - If not zero, render the frames with the path tracer, with
+ *             this number of samples per frame.
+ *
+ * Return -1 if there is no GL context to render with, or if a file
+ * cannot be written.
+ */
+int goxel_render_sequence_to_files(const char *path, int nb,
+                                   const float (*views)[4][4],
+                                   int w, int h, int bpp, int samples);
+
+// Render the image with the path tracer, without any gui, and save it as
+// a png.  If snapshots is not zero, also save the image every snapshots
+// samples, with the number of samples appended to the file name.  If the
+// path tracer region is set, only render and save this part of the image.
+// If path is NULL, only render the image (for benchmarks).  The render stats
+// are logged as a json line starting with 'pathtracer-stats:'.
+int goxel_pathtrace_to_file(const char *path, int w, int h, int samples,
+                            const char *camera, int snapshots);
 
 void goxel_open_file(const char *path);
 
 void save_to_file(const image_t *img, const char *path);
+void save_to_file_async(const image_t *img, const char *path, bool append);
+int save_get_progress(void);
+void save_update(bool wait);
 int load_from_file(const char *path, bool replace);
 
 // Iter info of a gox file, without actually reading it.
@@ -671,6 +932,12 @@ void goxel_add_recent_file(const char *path);
  *
  * This is a conveniance function so that we don't have to handle the case
  * where we have a selection mask or not.
+ *
+ * The function is only called once for each unique color of the selected
+ * voxels, so it should only depend on the input color.  The selected voxels
+ * are cached, so that applying a filter again on the same layer and
+ * selection (for example to preview it while a value changes) only needs
+ * to call the function and write back the voxels.
  */
 void goxel_apply_color_filter(
         void (*fn)(void *args, uint8_t color[4]), void *args);
@@ -683,6 +950,16 @@ void goxel_apply_color_filter(
  */
 bool goxel_gesture3d(const gesture3d_t *gesture);
 
+/*
+ * Function: goxel_is_idle
+ * Test whether we can stop redrawing until the next input event.
+ *
+ * Returns false if the image, camera or render settings changed since the
+ * last call, or if some rendering is still in progress (pathtracer,
+ * background meshing).
+ */
+bool goxel_is_idle(void);
+
 /*
  * Call this if the keymaps array has changed.
  */
@@ -694,5 +971,28 @@ void goxel_update_keymaps(void);
  * Run all the unit tests */
 void tests_run(void);
 
+/* Function: tests_run_perf
+ * Run the performance tests, and compare them to a baseline.
+ *
+ * Parameters:
+ *   baseline_path  - File with the baseline times.  The missing cases are
+ *                    added to it.
+ *   tolerance      - Percentage of slowdown allowed.
+ *
+ * Returns:
+ *   Zero if no case is slower than its baseline.
+ */
+int tests_run_perf(const char *baseline_path, float tolerance);
+
+/* Function: bench_run
+ * Run the benchmarks of the core voxel operations.
+ *
+ * The results are saved as json into a file, to compare the versions.
+ *
+ * Returns:
+ *   Zero on success.
+ */
+int bench_run(const char *path);
+
 
 #endif // GOXEL_H
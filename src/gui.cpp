@@ -20,9 +20,13 @@
 #   define GUI_HAS_SCROLLBARS 1
 #endif
 
+#include <errno.h> // IWYU pragma: keep.
+#include <inttypes.h>
+
 extern "C" {
 #include "goxel.h"
 #include "utils/color.h"
+#include "xxhash.h"
 
 void gui_app(void);
 void gui_render_panel(void);
@@ -378,9 +382,193 @@ static void add_font(const char *uri, const ImWchar *ranges, bool mergmode)
             (void*)data, data_size, size, &conf, ranges);
 }
 
+/*
+ * Disk cache of the fonts atlas.
+ *
+ * Building the atlas rasterizes all the glyphs, so we save the result in
+ * the user directory, in a file named after a hash of the fonts data and
+ * of their configuration (including the size, that depends on the screen
+ * scale and the gui scale).  The next launches only have to read it back.
+ * The file contains the packed position of the custom rects, the metrics
+ * and glyphs of each font, and the alpha of the texture.
+ */
+
+#define FONTS_CACHE_VERSION 1
+
+typedef struct {
+    uint32_t    version;
+    int32_t     tex_size[2];
+    int32_t     nb_rects;
+    int32_t     nb_fonts;
+} fonts_cache_header_t;
+
+typedef struct {
+    float       ascent;
+    float       descent;
+    int32_t     nb_glyphs;
+} fonts_cache_font_t;
+
+static uint64_t get_fonts_cache_key(const ImFontAtlas *atlas)
+{
+    uint64_t key;
+    int n;
+    const int atlas_params[] = {atlas->Flags, atlas->TexDesiredWidth,
+                                atlas->TexGlyphPadding,
+                                (int)sizeof(ImFontGlyph)};
+
+    key = XXH64(IMGUI_VERSION, strlen(IMGUI_VERSION), FONTS_CACHE_VERSION);
+    key = XXH64(atlas_params, sizeof(atlas_params), key);
+    for (const ImFontConfig& cfg : atlas->ConfigData) {
+        const float params[] = {
+            cfg.SizePixels, (float)cfg.FontNo, (float)cfg.OversampleH,
+            (float)cfg.OversampleV, (float)cfg.PixelSnapH,
+            (float)cfg.MergeMode, cfg.GlyphExtraSpacing.x,
+            cfg.GlyphExtraSpacing.y, cfg.GlyphOffset.x, cfg.GlyphOffset.y,
+            cfg.GlyphMinAdvanceX, cfg.GlyphMaxAdvanceX,
+            cfg.RasterizerMultiply, cfg.RasterizerDensity,
+            (float)cfg.EllipsisChar};
+        key = XXH64(cfg.FontData, cfg.FontDataSize, key);
+        key = XXH64(params, sizeof(params), key);
+        for (n = 0; cfg.GlyphRanges && cfg.GlyphRanges[n]; n++);
+        key = XXH64(cfg.GlyphRanges, n * sizeof(ImWchar), key);
+    }
+    return key;
+}
+
+static void get_fonts_cache_path(uint64_t key, char *path, int size)
+{
+    snprintf(path, size, "%s/fonts/%016" PRIx64 ".bin",
+             sys_get_user_dir(), key);
+}
+
+// Read the next bytes of a cache file, return false if it is too short.
+static bool fonts_cache_read(const char **ptr, const char *end,
+                             void *out, size_t size)
+{
+    if ((size_t)(end - *ptr) < size) return false;
+    memcpy(out, *ptr, size);
+    *ptr += size;
+    return true;
+}
+
+// Setup the atlas from the cache instead of rasterizing the glyphs.  As
+// with the stb truetype builder, ImFontAtlasBuildFinish then renders the
+// default texture data and builds the lookup tables.
+static bool fonts_cache_load(ImFontAtlas *atlas, const char *path)
+{
+    char *data;
+    const char *ptr, *end;
+    fonts_cache_header_t header;
+    fonts_cache_font_t info;
+    ImFontAtlasCustomRect *rect;
+    ImFont *font;
+    int i, size;
+    bool ok;
+
+    data = read_file(path, &size);
+    if (!data) return false;
+    ptr = data;
+    end = data + size;
+    ok = fonts_cache_read(&ptr, end, &header, sizeof(header)) &&
+         header.version == FONTS_CACHE_VERSION &&
+         header.nb_rects == atlas->CustomRects.Size &&
+         header.nb_fonts == atlas->Fonts.Size &&
+         header.tex_size[0] > 0 && header.tex_size[0] <= 8192 &&
+         header.tex_size[1] > 0 && header.tex_size[1] <= 8192;
+    for (i = 0; ok && i < header.nb_rects; i++) {
+        rect = &atlas->CustomRects[i];
+        ok = fonts_cache_read(&ptr, end, &rect->X, sizeof(rect->X)) &&
+             fonts_cache_read(&ptr, end, &rect->Y, sizeof(rect->Y));
+    }
+    for (i = 0; ok && i < header.nb_fonts; i++) {
+        font = atlas->Fonts[i];
+        ok = fonts_cache_read(&ptr, end, &info, sizeof(info)) &&
+             info.nb_glyphs >= 0 &&
+             (size_t)(end - ptr) >= info.nb_glyphs * sizeof(ImFontGlyph);
+        if (!ok) break;
+        ImFontAtlasBuildSetupFont(atlas, font, (ImFontConfig*)font->ConfigData,
+                                  info.ascent, info.descent);
+        font->Glyphs.resize(info.nb_glyphs);
+        fonts_cache_read(&ptr, end, font->Glyphs.Data,
+                         info.nb_glyphs * sizeof(ImFontGlyph));
+        font->DirtyLookupTables = true;
+    }
+    ok = ok && (size_t)(end - ptr) ==
+               (size_t)header.tex_size[0] * header.tex_size[1];
+    if (!ok) {
+        LOG_W("Invalid fonts cache %s", path);
+        for (ImFont *f : atlas->Fonts) f->ClearOutputData();
+        free(data);
+        return false;
+    }
+    atlas->ClearTexData();
+    atlas->TexWidth = header.tex_size[0];
+    atlas->TexHeight = header.tex_size[1];
+    atlas->TexUvScale = ImVec2(1.0f / atlas->TexWidth,
+                               1.0f / atlas->TexHeight);
+    atlas->TexPixelsAlpha8 = (unsigned char*)IM_ALLOC(end - ptr);
+    memcpy(atlas->TexPixelsAlpha8, ptr, end - ptr);
+    free(data);
+    ImFontAtlasBuildFinish(atlas);
+    return true;
+}
+
+static void fonts_cache_save(const ImFontAtlas *atlas, const char *path)
+{
+    FILE *file;
+    fonts_cache_header_t header = {FONTS_CACHE_VERSION,
+                                   {atlas->TexWidth, atlas->TexHeight},
+                                   atlas->CustomRects.Size,
+                                   atlas->Fonts.Size};
+    fonts_cache_font_t info;
+
+    if (!atlas->TexPixelsAlpha8) return;
+    sys_make_dir(path);
+    file = fopen(path, "wb");
+    if (!file) {
+        LOG_W("Cannot save fonts cache %s: %s", path, strerror(errno));
+        return;
+    }
+    fwrite(&header, sizeof(header), 1, file);
+    for (const ImFontAtlasCustomRect& rect : atlas->CustomRects) {
+        fwrite(&rect.X, sizeof(rect.X), 1, file);
+        fwrite(&rect.Y, sizeof(rect.Y), 1, file);
+    }
+    for (const ImFont *font : atlas->Fonts) {
+        info.ascent = font->Ascent;
+        info.descent = font->Descent;
+        info.nb_glyphs = font->Glyphs.Size;
+        fwrite(&info, sizeof(info), 1, file);
+        fwrite(font->Glyphs.Data, sizeof(ImFontGlyph), font->Glyphs.Size,
+               file);
+    }
+    fwrite(atlas->TexPixelsAlpha8, atlas->TexWidth, atlas->TexHeight, file);
+    fclose(file);
+}
+
+// Font builder that first looks for the atlas in the disk cache.
+static bool build_fonts(ImFontAtlas *atlas)
+{
+    uint64_t key;
+    char path[1024];
+
+    // Rounds the fonts sizes, so we have to call it before the hash.
+    ImFontAtlasBuildInit(atlas);
+    if (!sys_get_user_dir())
+        return ImFontAtlasGetBuilderForStbTruetype()->FontBuilder_Build(atlas);
+    key = get_fonts_cache_key(atlas);
+    get_fonts_cache_path(key, path, sizeof(path));
+    if (fonts_cache_load(atlas, path)) return true;
+    if (!ImFontAtlasGetBuilderForStbTruetype()->FontBuilder_Build(atlas))
+        return false;
+    fonts_cache_save(atlas, path);
+    return true;
+}
+
 static void load_fonts_texture()
 {
     ImGuiIO& io = ImGui::GetIO();
+    static const ImFontBuilderIO builder = {build_fonts};
 
     unsigned char* pixels;
     int width, height;
@@ -394,6 +582,7 @@ static void load_fonts_texture()
         0
     };
 
+    profiler_trace_begin("fonts");
     io.Fonts->Clear();
     add_font("asset://data/fonts/DejaVuSans.ttf", ranges, false);
     add_font("asset://data/fonts/goxel-font.ttf", range_user, true);
@@ -407,6 +596,7 @@ static void load_fonts_texture()
             (void*)data, data_size, 14 * scale, &conf,
             io.Fonts->GetGlyphRangesJapanese());
     #endif
+    io.Fonts->FontBuilderIO = &builder;
     io.Fonts->Build();
 
     io.Fonts->GetTexDataAsRGBA32(&pixels, &width, &height);
@@ -420,6 +610,7 @@ static void load_fonts_texture()
     GL(glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, width, height, 0,
                     GL_RGBA, GL_UNSIGNED_BYTE, pixels));
     io.Fonts->TexID = (intptr_t)tex_id;
+    profiler_trace_end();
 }
 
 static void init_ImGui(void)
@@ -1277,6 +1468,13 @@ void gui_text_wrapped(const char *label, ...)
     ImGui::PopTextWrapPos();
 }
 
+void gui_plot(const char *label, const float *values, int nb, float max,
+              const char *overlay)
+{
+    ImGui::PlotLines(label, values, nb, 0, overlay, 0, max,
+                     ImVec2(ImGui::GetContentRegionAvail().x, 40));
+}
+
 void gui_dummy(int w, int h)
 {
     ImGui::Dummy(ImVec2(w, h));
@@ -1852,6 +2050,30 @@ bool gui_menu_item(int action, const char *label, bool enabled)
     return false;
 }
 
+bool gui_menu_item_image(const char *label, const texture_t *tex)
+{
+    const float size = GUI_ICON_HEIGHT;
+    const ImGuiStyle &style = ImGui::GetStyle();
+    ImDrawList *draw_list = ImGui::GetWindowDrawList();
+    ImVec2 pos = ImGui::GetCursorScreenPos();
+    ImVec2 text_size = ImGui::CalcTextSize(label);
+    bool ret;
+
+    ImGui::PushID(label);
+    ret = ImGui::Selectable("##item", false, 0,
+            ImVec2(size + style.ItemSpacing.x + text_size.x, size));
+    ImGui::PopID();
+    if (tex) {
+        draw_list->AddImage((intptr_t)tex->tex, pos, pos + ImVec2(size, size),
+                            ImVec2(0, 0), ImVec2((float)tex->w / tex->tex_w,
+                                                 (float)tex->h / tex->tex_h));
+    }
+    draw_list->AddText(pos + ImVec2(size + style.ItemSpacing.x,
+                                    (size - text_size.y) / 2),
+                       ImGui::GetColorU32(ImGuiCol_Text), label);
+    return ret;
+}
+
 void gui_tooltip(const char *str)
 {
     if (gui->scrolling) return;
@@ -1915,22 +2137,55 @@ bool gui_panel_header(const char *label)
     return ret;
 }
 
-bool gui_icons_grid(int nb, const gui_icon_info_t *icons, int *current)
+// Render a single icon of a grid, and return whether it was clicked.
+static bool icons_grid_item(const gui_icon_info_t *icon, int i,
+                            bool is_colors_grid, bool v, float *size)
 {
-    const gui_icon_info_t *icon;
     char label[128];
-    bool v;
+    bool clicked;
+    ImDrawList* draw_list = ImGui::GetWindowDrawList();
+
+    ImGui::PushID(i);
+    if (icon->sublabel) {
+        snprintf(label, sizeof(label), "%s (%s)",
+                 icon->label, icon->sublabel);
+    } else {
+        snprintf(label, sizeof(label), "%s", icon->label);
+    }
+    if (!is_colors_grid) {
+        *size = GUI_ICON_HEIGHT;
+        clicked = gui_selectable_icon(label, &v, icon->icon);
+    } else { // Color icon.
+        *size = gui_get_item_height();
+        ImGui::PushStyleColor(ImGuiCol_Button, icon->color);
+        ImGui::PushStyleColor(ImGuiCol_ButtonHovered, icon->color);
+        clicked = ImGui::Button("", ImVec2(*size, *size));
+        ImGui::PopStyleColor(2);
+        if (icon->label && ImGui::IsItemHovered())
+            gui_tooltip(icon->label);
+        if (v) {
+            ImVec2 c1 = ImGui::GetItemRectMin() - ImVec2(1, 1);
+            ImVec2 c2 = ImGui::GetItemRectMax() + ImVec2(1, 1);
+            draw_list->AddRect(c1, c2, 0xFF000000, 0, 0, 2);
+            draw_list->AddRect(c1, c2, 0xFFFFFFFF, 0, 0, 1);
+        }
+    }
+    ImGui::PopID();
+    return clicked;
+}
+
+bool gui_icons_grid(int nb, const gui_icon_info_t *icons, int *current)
+{
     bool ret = false;
-    int i;
+    int i, row, per_row, last;
     float last_button_x;
     float next_button_x;
     float max_x;
     const ImGuiStyle &style = ImGui::GetStyle();
-    ImDrawList* draw_list = ImGui::GetWindowDrawList();
-    bool clicked;
     float size;
     bool is_colors_grid;
     float spacing = 2;
+    ImGuiListClipper clipper;
 
     is_colors_grid = (nb > 0 && !icons[0].icon);
 
@@ -1940,35 +2195,34 @@ bool gui_icons_grid(int nb, const gui_icon_info_t *icons, int *current)
     max_x = ImGui::GetWindowPos().x + ImGui::GetContentRegionAvail().x;
     max_x += 16; // ?
 
-    for (i = 0; i < nb; i++) {
-        icon = &icons[i];
-        ImGui::PushID(i);
-        if (icon->sublabel) {
-            snprintf(label, sizeof(label), "%s (%s)",
-                     icon->label, icon->sublabel);
-        } else {
-            snprintf(label, sizeof(label), "%s", icon->label);
-        }
-        v = (i == *current);
-        if (!is_colors_grid) {
-            size = GUI_ICON_HEIGHT;
-            clicked = gui_selectable_icon(label, &v, icon->icon);
-        } else { // Color icon.
-            size = gui_get_item_height();
-            ImGui::PushStyleColor(ImGuiCol_Button, icon->color);
-            ImGui::PushStyleColor(ImGuiCol_ButtonHovered, icon->color);
-            clicked = ImGui::Button("", ImVec2(size, size));
-            ImGui::PopStyleColor(2);
-            if (icon->label && ImGui::IsItemHovered())
-                gui_tooltip(icon->label);
-            if (v) {
-                ImVec2 c1 = ImGui::GetItemRectMin() - ImVec2(1, 1);
-                ImVec2 c2 = ImGui::GetItemRectMax() + ImVec2(1, 1);
-                draw_list->AddRect(c1, c2, 0xFF000000, 0, 0, 2);
-                draw_list->AddRect(c1, c2, 0xFFFFFFFF, 0, 0, 1);
+    // The colors grids can be very large (generated palettes), so we only
+    // render their visible rows.  All the colors have the same size.
+    if (is_colors_grid) {
+        size = gui_get_item_height();
+        per_row = (max_x - ImGui::GetCursorScreenPos().x - size) /
+                  (size + spacing) + 1;
+        per_row = max(per_row, 1);
+        clipper.Begin((nb + per_row - 1) / per_row, size + spacing);
+        while (clipper.Step()) {
+            for (row = clipper.DisplayStart; row < clipper.DisplayEnd;
+                 row++) {
+                last = min((row + 1) * per_row, nb) - 1;
+                for (i = row * per_row; i <= last; i++) {
+                    if (icons_grid_item(&icons[i], i, true, i == *current,
+                                        &size)) {
+                        ret = true;
+                        *current = i;
+                    }
+                    if (i < last) ImGui::SameLine();
+                }
             }
         }
-        if (clicked) {
+        ImGui::PopStyleVar(1);
+        return ret;
+    }
+
+    for (i = 0; i < nb; i++) {
+        if (icons_grid_item(&icons[i], i, false, i == *current, &size)) {
             ret = true;
             *current = i;
         }
@@ -1976,9 +2230,6 @@ bool gui_icons_grid(int nb, const gui_icon_info_t *icons, int *current)
         next_button_x = last_button_x + style.ItemSpacing.x + size;
         if (i + 1 < nb && next_button_x < max_x)
             ImGui::SameLine();
-
-        ImGui::PopID();
-
     }
     ImGui::PopStyleVar(1);
 
@@ -2061,27 +2312,45 @@ struct list_item {
     list_item_t *next, *prev;
 };
 
+/*
+ * The items are put into an array, kept between the calls, so that we only
+ * render the visible rows: with thousands of layers the widgets are much
+ * more expensive than walking the list.
+ */
 void gui_list(const gui_list_t *list)
 {
     list_item_t **items = (list_item_t**)list->items;
     list_item_t *item;
     bool is_current;
-    int i;
-    int count;
+    int i, count = 0, current = -1;
+    static list_item_t **array = NULL;
+    static int capacity = 0;
+    ImGuiListClipper clipper;
 
-    DL_COUNT(*items, item, count);
+    DL_FOREACH(*items, item) {
+        if (count >= capacity) {
+            capacity = max(capacity * 2, 64);
+            array = (list_item_t**)realloc(array, capacity * sizeof(*array));
+        }
+        if (*list->current == item) current = count;
+        array[count++] = item;
+    }
 
     gui_group_begin(NULL);
-    i = 0;
-    DL_FOREACH(*items, item) {
-        is_current = *list->current == item;
-        if (list->render((void*)item, i, is_current)) {
-            *list->current = item;
-            if (is_current && list->can_be_null) {
-                *list->current = NULL;
+    clipper.Begin(count);
+    // Never clip the current item, since we might be editing its name.
+    if (current >= 0) clipper.IncludeItemByIndex(current);
+    while (clipper.Step()) {
+        for (i = clipper.DisplayStart; i < clipper.DisplayEnd; i++) {
+            item = array[i];
+            is_current = *list->current == item;
+            if (list->render((void*)item, i, is_current)) {
+                *list->current = item;
+                if (is_current && list->can_be_null) {
+                    *list->current = NULL;
+                }
             }
         }
-        i++;
     }
     gui_group_end();
 }
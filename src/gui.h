@@ -67,6 +67,9 @@ bool gui_panel_header(const char *label);
 bool gui_collapsing_header(const char *label, bool default_opened);
 void gui_text(const char *label, ...);
 void gui_text_wrapped(const char *label, ...);
+// Plot a graph of values in [0, max], using the full available width.
+void gui_plot(const char *label, const float *values, int nb, float max,
+              const char *overlay);
 bool gui_button(const char *label, float w, int icon);
 bool gui_button_right(const char *label, int icon);
 
@@ -183,6 +186,10 @@ bool gui_menu_begin(const char *label, bool enabled);
 void gui_menu_end(void);
 bool gui_menu_item(int action, const char *label, bool enabled);
 
+// Menu item with an image before the label, for the files previews.
+// The image can be NULL.
+bool gui_menu_item_image(const char *label, const texture_t *tex);
+
 void gui_tooltip(const char *str);
 
 bool gui_view_cube(float x, float y, float w, float h);
@@ -17,22 +17,157 @@
  */
 
 #include "goxel.h"
+#include "script.h"
+
+static void profiler_panel(void)
+{
+    bool enabled = profiler_is_enabled();
+    float values[PROFILER_HISTORY], max_value;
+    int i, s, nb;
+    char overlay[64];
+    const char *path;
+    const char *filters[] = {"*.csv", NULL};
+
+    if (gui_checkbox("Profiler", &enabled, NULL))
+        profiler_set_enabled(enabled);
+    if (!enabled) return;
+
+    for (s = 0; s < PROF_COUNT; s++) {
+        nb = profiler_get_history(s, values);
+        max_value = 1;
+        for (i = 0; i < nb; i++) max_value = max(max_value, values[i]);
+        snprintf(overlay, sizeof(overlay), "%s: %.2f ms",
+                 profiler_get_name(s), nb ? values[nb - 1] : 0);
+        gui_push_id(profiler_get_name(s));
+        gui_plot("", values, nb, max_value, overlay);
+        gui_pop_id();
+    }
+    if (gui_button("Export CSV", -1, 0)) {
+        path = sys_get_save_path("profile.csv", filters, "csv");
+        if (path) profiler_export_csv(path);
+    }
+#if TRACE
+    if (gui_button("Save trace", -1, 0)) {
+        path = sys_get_save_path("trace.json",
+                                 (const char*[]){"*.json", NULL}, "json");
+        if (path) profiler_scopes_save(path);
+    }
+#endif
+}
+
+static void on_cache_stats(void *user, const cache_stats_t *stats)
+{
+    int64_t total = stats->hits + stats->misses;
+    // Some caches use a cost of one per item, only show the size of the
+    // ones that use the memory size.
+    if (stats->max_size >= MB) {
+        gui_text("%s: %d items, %dM/%dM", stats->name, stats->nb_items,
+                 (int)(stats->size / MB), (int)(stats->max_size / MB));
+    } else {
+        gui_text("%s: %d/%d items", stats->name, stats->nb_items,
+                 (int)stats->max_size);
+    }
+    gui_text("  hits: %d%%, evictions: %d",
+             total ? (int)(stats->hits * 100 / total) : 0,
+             (int)stats->evictions);
+}
+
+static void scripts_timings(void)
+{
+    script_timing_t timings[SCRIPT_TIMINGS_HISTORY];
+    int i, nb;
+
+    nb = script_get_timings(timings);
+    if (!nb) return;
+    if (gui_section_begin("Scripts", GUI_SECTION_COLLAPSABLE_CLOSED)) {
+        for (i = nb - 1; i >= 0; i--) {
+            gui_text("%s: %.1f ms", timings[i].name, timings[i].time * 1000);
+        }
+    } gui_section_end();
+}
+
+// One line per layer, with its memory and rendering cost.
+static void layers_stats(void)
+{
+    layer_t *layer;
+    volume_stats_t stats;
+    render_volume_stats_t rstats;
+
+    DL_FOREACH(goxel.image->layers, layer) {
+        layer_get_stats(layer, &stats);
+        if (!render_get_volume_stats(layer->volume, &rstats))
+            memset(&rstats, 0, sizeof(rstats));
+        gui_text("%s: %d tiles, %dK (%dK shared), VRAM %dK, %.1f ms",
+                 layer->name, stats.tiles_count, (int)(stats.mem >> 10),
+                 (int)(stats.shared_mem >> 10), (int)(rstats.vram >> 10),
+                 rstats.meshing_time * 1000);
+    }
+}
+
+static void memory_stats(void)
+{
+    const mem_stats_t *stats = mem_tracker_get_stats();
+    char path[1024];
+    int i;
+
+    if (sys_get_time() - stats->time > 1) mem_tracker_update();
+    for (i = 0; i < MEM_COUNT; i++) {
+        gui_text("%s: %dM (peak %dM)", mem_tracker_get_name(i),
+                 (int)(stats->values[i] / MB), (int)(stats->peaks[i] / MB));
+    }
+    if (gui_button("Dump memory report", -1, 0)) {
+        snprintf(path, sizeof(path), "%s/memory.txt", sys_get_user_dir());
+        if (mem_tracker_dump(path) == 0)
+            LOG_I("Memory report saved to %s", path);
+    }
+}
 
 void gui_debug_panel(void)
 {
     volume_global_stats_t stats;
+    image_t *hist;
+    int i = 0;
 
     gui_text("FPS: %d", (int)round(goxel.fps));
     volume_get_global_stats(&stats);
     gui_text("Nb volumes: %d", stats.nb_volumes);
     gui_text("Nb tiles: %d", stats.nb_tiles);
     gui_text("Mem: %dM", (int)(stats.mem / (1 << 20)));
+    gui_text("Packed: %dM, spilled: %dM", (int)(stats.packed_mem / (1 << 20)),
+             (int)(stats.spilled_mem / (1 << 20)));
+    if (stats.shared_mem)
+        gui_text("Shared: %dM", (int)(stats.shared_mem / (1 << 20)));
+    gui_text("Pool: %d/%d (%dM)", stats.pool_items, stats.pool_capacity,
+             (int)(stats.pool_mem / (1 << 20)));
+
+    profiler_panel();
+    scripts_timings();
+
+    if (gui_section_begin("Layers", GUI_SECTION_COLLAPSABLE_CLOSED)) {
+        layers_stats();
+    } gui_section_end();
+
+    if (gui_section_begin("Caches", GUI_SECTION_COLLAPSABLE_CLOSED)) {
+        gui_text("Budget: %dM", (int)(cache_governor_get_budget() / MB));
+        cache_iter_stats(NULL, on_cache_stats);
+    } gui_section_end();
+
+    if (gui_section_begin("Memory", GUI_SECTION_COLLAPSABLE_CLOSED)) {
+        memory_stats();
+    } gui_section_end();
 
     if (!DEFINED(GLES2)) {
         gui_checkbox_flag("Show wireframe", &goxel.view_effects,
                           EFFECT_WIREFRAME, NULL);
     }
 
+    if (gui_section_begin("History", GUI_SECTION_COLLAPSABLE_CLOSED)) {
+        DL_FOREACH2(goxel.image->history, hist, history_next) {
+            gui_text("%d%s: %dK", i++, hist == goxel.image->history_pos ?
+                     "*" : "", (int)(image_history_get_mem(hist) >> 10));
+        }
+    } gui_section_end();
+
     if (gui_button("Clear undo history", -1, 0)) {
         image_history_resize(goxel.image, 0);
     }
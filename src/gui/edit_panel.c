@@ -36,6 +36,8 @@ void gui_edit_panel(void)
     gui_enabled_end();
     gui_group_end();
 
+    gui_action_button(ACTION_invert_selection, _("Invert selection"), 1.0);
+
     gui_group_begin(NULL);
     gui_enabled_begin(!volume_is_empty(goxel.image->selection_mask));
     gui_action_button(ACTION_copy, _("Copy"), 1.0);
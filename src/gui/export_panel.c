@@ -71,7 +71,7 @@ void gui_export_panel(void)
     if (g_current->export_gui)
         g_current->export_gui(g_current);
     if (gui_button(_("Export"), 1, 0))
-        goxel_export_to_file(NULL, g_current->name);
+        goxel_export_to_file_async(NULL, g_current->name);
 }
 
 #endif // GUI_CUSTOM_EXPORT_PANEL
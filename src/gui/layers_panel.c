@@ -80,6 +80,26 @@ static void layers_context_menu(void)
     if (gui_action_button(ACTION_img_new_shape_layer, buf, 1)) {
         action_exec2(ACTION_tool_set_move);
     }
+    snprintf(buf, sizeof(buf), "%s: %s", _("Add"), _("Stream"));
+    gui_action_button(ACTION_img_new_stream_layer, buf, 1);
+    if (!layer->region && image_layer_can_edit(goxel.image, layer))
+        gui_action_button(ACTION_layer_stream, _("Stream To Folder"), 1);
+}
+
+// Memory and rendering cost of a layer, to find the expensive ones.
+static void layer_stats(layer_t *layer)
+{
+    volume_stats_t stats;
+    render_volume_stats_t rstats;
+
+    layer_get_stats(layer, &stats);
+    gui_text("Tiles: %d", stats.tiles_count);
+    gui_text("Mem: %dK (%dK shared)", (int)(stats.mem >> 10),
+             (int)(stats.shared_mem >> 10));
+    if (render_get_volume_stats(layer->volume, &rstats)) {
+        gui_text("VRAM: %dK", (int)(rstats.vram >> 10));
+        gui_text("Meshing: %.1f ms", rstats.meshing_time * 1000);
+    }
 }
 
 static bool render_layer_item(void *item, int idx, bool current)
@@ -143,6 +163,8 @@ void gui_layers_panel(void)
         gui_action_button(ACTION_img_select_parent_layer, "Select parent", 1);
         gui_group_end();
     }
+    if (layer->region)
+        gui_text("%s", region_store_get_path(layer->region));
     if (layer->image) {
         snprintf(buf, sizeof(buf), "-> %s", _("Volume"));
         gui_action_button(ACTION_img_image_layer_to_volume, buf, 1);
@@ -184,4 +206,8 @@ void gui_layers_panel(void)
         }
         gui_combo_end();
     }
+
+    if (gui_section_begin(_("Stats"), GUI_SECTION_COLLAPSABLE_CLOSED)) {
+        layer_stats(layer);
+    } gui_section_end();
 }
@@ -42,7 +42,7 @@ static int import_gui(void *data)
 {
     g_import_format->import_gui(g_import_format);
     if (gui_button("OK", 0, 0)) {
-        goxel_import_file(NULL, g_import_format->name);
+        goxel_import_file_async(NULL, g_import_format->name);
         return 1;
     }
     return 0;
@@ -56,13 +56,13 @@ static void import_menu_callback(void *user, file_format_t *f)
         gui_open_popup("Import", 0, NULL, import_gui);
         return;
     }
-    goxel_import_file(NULL, f->name);
+    goxel_import_file_async(NULL, f->name);
 }
 
 static void export_menu_callback(void *user, file_format_t *f)
 {
     if (gui_menu_item(0, f->name, true))
-        goxel_export_to_file(NULL, f->name);
+        goxel_export_to_file_async(NULL, f->name);
 }
 
 static void on_script(void *user, const char *name)
@@ -101,7 +101,8 @@ void gui_menu(void)
         gui_menu_item(ACTION_open, _("Open"), true);
         if (gui_menu_begin("Open Recent", true)) {
             for (i = 0; i < arrlen(goxel.recent_files); i++) {
-                if (gui_menu_item(0, goxel.recent_files[i], true)) {
+                if (gui_menu_item_image(goxel.recent_files[i],
+                        thumbnail_get(goxel.recent_files[i]))) {
                     goxel_open_file(goxel.recent_files[i]);
                 }
             }
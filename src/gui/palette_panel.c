@@ -18,15 +18,52 @@
 
 #include "goxel.h"
 
+/*
+ * The icons grid of the current palette, only built again when the palette
+ * changes, since generated palettes can have thousands of colors.
+ */
+static struct {
+    const palette_t *palette;
+    const palette_entry_t *entries;
+    int size;
+    gui_icon_info_t *grid;
+} g_grid = {};
+
+static const gui_icon_info_t *get_palette_grid(const palette_t *p)
+{
+    int i;
+
+    if (g_grid.palette == p && g_grid.entries == p->entries &&
+            g_grid.size == p->size)
+        return g_grid.grid;
+    free(g_grid.grid);
+    g_grid.grid = calloc(p->size, sizeof(*g_grid.grid));
+    for (i = 0; i < p->size; i++) {
+        g_grid.grid[i] = (gui_icon_info_t) {
+            .label = p->entries[i].name,
+            .icon = 0,
+            .color = {VEC4_SPLIT(p->entries[i].color)},
+        };
+    }
+    g_grid.palette = p;
+    g_grid.entries = p->entries;
+    g_grid.size = p->size;
+    return g_grid.grid;
+}
+
 void gui_palette_panel(void)
 {
     int nb, i, current = -1;
     const palette_t *p;
-    const char **names;
-    gui_icon_info_t *grid;
+    static const char **names = NULL;
+    static int names_capacity = 0;
+    const gui_icon_info_t *grid;
 
-    DL_COUNT(goxel.palettes, p, nb);
-    names = (const char**)calloc(nb, sizeof(*names));
+    DL_COUNT(goxel_get_palettes(), p, nb);
+    if (nb > names_capacity) {
+        names_capacity = nb;
+        names = realloc(names, nb * sizeof(*names));
+    }
 
     i = 0;
     DL_FOREACH(goxel.palettes, p) {
@@ -37,21 +74,13 @@ void gui_palette_panel(void)
         goxel.palette = goxel.palettes;
         for (i = 0; i < current; i++) goxel.palette = goxel.palette->next;
     }
-    free(names);
 
-    p = goxel.palette;
-    grid = calloc(p->size, sizeof(*grid));
-    for (i = 0; i < p->size; i++) {
-        grid[i] = (gui_icon_info_t) {
-            .label = p->entries[i].name,
-            .icon = 0,
-            .color = {VEC4_SPLIT(p->entries[i].color)},
-        };
-        if (memcmp(goxel.painter.color, p->entries[i].color, 4) == 0)
-            current = i;
-    }
-    if (gui_icons_grid(p->size, grid, &current)) {
-        memcpy(goxel.painter.color, p->entries[current].color, 4);
+    grid = get_palette_grid(goxel.palette);
+    // Use the palette color lookup table, so that we don't search the
+    // current color linearly.  This does nothing if it already exists.
+    palette_lookup_begin(goxel.palette);
+    current = palette_search(goxel.palette, goxel.painter.color, true);
+    if (gui_icons_grid(goxel.palette->size, grid, &current)) {
+        memcpy(goxel.painter.color, goxel.palette->entries[current].color, 4);
     }
-    free(grid);
 }
@@ -22,6 +22,7 @@ void gui_render_panel(void)
 {
     int i;
     int maxsize;
+    bool adaptive;
     char buf[256];
     pathtracer_t *pt = &goxel.pathtracer;
     material_t *material;
@@ -48,6 +49,17 @@ void gui_render_panel(void)
     if (gui_input_int(_("Samples"), &pt->num_samples, 0, 0))
         pt->num_samples = clamp(pt->num_samples, 1, 10000);
 
+    adaptive = pt->adaptive > 0;
+    if (gui_checkbox(_("Adaptive"), &adaptive,
+                     _("Stop sampling the pixels once they are not noisy")))
+        pt->adaptive = adaptive ? 0.02 : 0;
+    if (pt->adaptive > 0) {
+        gui_input_float(_("Noise"), &pt->adaptive, 0.005, 0.001, 1, "%.3f");
+    }
+    gui_input_float(_("Time limit"), &pt->time_limit, 10, 0, 36000, "%.0f s");
+    gui_checkbox(_("Denoise"), &pt->denoise,
+                 _("Denoise the render using the albedo and normals"));
+
     if (pt->status == PT_STOPPED && gui_button(_("Start"), 1, 0))
         pt->status = PT_RUNNING;
     if (pt->status == PT_RUNNING && gui_button(_("Stop"), 1, 0)) {
@@ -63,6 +75,10 @@ void gui_render_panel(void)
         gui_text("%d/%d (%d%%)", pt->samples, pt->num_samples,
                  pt->samples * 100 / pt->num_samples);
     }
+    if (pt->status == PT_RUNNING) {
+        gui_text("%.1f samples/s, %.0f s left",
+                 pt->samples_per_sec, pt->time_left);
+    }
     if (    pt->status == PT_FINISHED &&
             gui_button(_("Save"), -1, 0))
     {
@@ -122,6 +138,25 @@ void gui_render_panel(void)
         gui_input_float(_("Intensity"), &goxel.rend.light.intensity,
                         0.1, 0, 10, NULL);
     } gui_section_end();
+
+    if (gui_section_begin(_("Traversal"), GUI_SECTION_COLLAPSABLE_CLOSED)) {
+        gui_group_begin(NULL);
+        gui_selectable_toggle(_("BVH"), &pt->traversal, PT_TRAVERSAL_BVH,
+                              NULL, -1);
+        gui_selectable_toggle(_("Voxels"), &pt->traversal,
+                              PT_TRAVERSAL_VOXELS,
+                              _("Trace the rays directly through the voxels "
+                                "grid, without building a bvh"), -1);
+        gui_group_end();
+    } gui_section_end();
+
+    if (gui_section_begin(_("Stats"), GUI_SECTION_COLLAPSABLE_CLOSED)) {
+        gui_text("%s: %.2f s", _("Sync"), pt->stats.sync_time);
+        gui_text("%s: %.2f s", _("Shapes"), pt->stats.shapes_time);
+        gui_text("%s: %.2f s", _("BVH"), pt->stats.bvh_time);
+        gui_text("%s: %.1f s", _("Render"), pt->stats.render_time);
+        gui_text("%.2f Mrays/s", pt->stats.rays_per_sec / 1e6);
+    } gui_section_end();
 }
 
 static void on_saved_to_photo(int ret) {
@@ -178,6 +178,43 @@ int gui_settings_popup(void *data)
         }
     } gui_section_end();
 
+    if (gui_section_begin(_("View"), GUI_SECTION_COLLAPSABLE_CLOSED)) {
+        if (gui_checkbox(_("Dynamic resolution"), &goxel.dynamic_resolution,
+                _("Lower the view resolution while the camera moves."))) {
+            settings_save();
+        }
+        if (goxel.dynamic_resolution) {
+            gui_input_float(_("Target FPS"), &goxel.target_fps, 5, 10, 144,
+                            "%.0f");
+            if (gui_is_item_deactivated()) settings_save();
+        }
+        if (gui_checkbox(_("Render thread"), &goxel.render_thread,
+                _("Draw the 3d view in a separate thread, one frame behind "
+                  "the interface."))) {
+            settings_save();
+        }
+    } gui_section_end();
+
+    if (gui_section_begin(_("Memory"), GUI_SECTION_COLLAPSABLE_CLOSED)) {
+        if (gui_input_int(_("Budget (MB)"), &goxel.tiles_mem_budget, 0, 0))
+            goxel.tiles_mem_budget = max(goxel.tiles_mem_budget, 0);
+        if (gui_is_item_deactivated()) settings_save();
+        gui_text(_("Compress the undo history above it, 0 for no limit."));
+        if (gui_input_int(_("History (MB)"), &goxel.history_mem_budget, 0, 0))
+            goxel.history_mem_budget = max(goxel.history_mem_budget, 0);
+        if (gui_is_item_deactivated()) settings_save();
+        gui_text(_("Forget the oldest undo steps above it."));
+        if (gui_checkbox(_("Keep old steps on disk"), &goxel.history_spill,
+                         _("Move the oldest undo steps to a temporary file "
+                           "instead of forgetting them."))) {
+            settings_save();
+        }
+        if (gui_input_int(_("Images (px)"), &goxel.image_max_size, 0, 0))
+            goxel.image_max_size = max(goxel.image_max_size, 0);
+        if (gui_is_item_deactivated()) settings_save();
+        gui_text(_("Downscale the bigger images planes, 0 for no limit."));
+    } gui_section_end();
+
     if (gui_section_begin(_("Paths"), GUI_SECTION_COLLAPSABLE_CLOSED)) {
         gui_text("Palettes: %s/palettes", sys_get_user_dir());
         gui_text("Progs: %s/progs", sys_get_user_dir());
@@ -263,6 +300,31 @@ static int settings_ini_handler(void *user, const char *section,
     if (strcmp(section, "keymaps") == 0) {
         add_keymap(name, value);
     }
+    if (strcmp(section, "view") == 0) {
+        if (strcmp(name, "dynamic_resolution") == 0) {
+            goxel.dynamic_resolution = strcmp(value, "true") == 0;
+        }
+        if (strcmp(name, "target_fps") == 0) {
+            goxel.target_fps = atof(value);
+        }
+        if (strcmp(name, "render_thread") == 0) {
+            goxel.render_thread = strcmp(value, "true") == 0;
+        }
+    }
+    if (strcmp(section, "memory") == 0) {
+        if (strcmp(name, "tiles_budget") == 0) {
+            goxel.tiles_mem_budget = max(atoi(value), 0);
+        }
+        if (strcmp(name, "history_budget") == 0) {
+            goxel.history_mem_budget = max(atoi(value), 0);
+        }
+        if (strcmp(name, "history_spill") == 0) {
+            goxel.history_spill = strcmp(value, "true") == 0;
+        }
+        if (strcmp(name, "image_max_size") == 0) {
+            goxel.image_max_size = max(atoi(value), 0);
+        }
+    }
     if (strcmp(section, "inputs") == 0) {
         if (strcmp(name, "emulate_three_buttons_mouse") == 0) {
             if (strcmp(value, "alt") == 0) {
@@ -280,6 +342,13 @@ void settings_load(void)
     LOG_I("Read settings file: %s", path);
     arrfree(goxel.keymaps);
     goxel.emulate_three_buttons_mouse = 0;
+    goxel.dynamic_resolution = true;
+    goxel.target_fps = 30;
+    goxel.render_thread = false;
+    goxel.tiles_mem_budget = 0;
+    goxel.history_mem_budget = 2048;
+    goxel.history_spill = true;
+    goxel.image_max_size = 4096;
     ini_parse(path, settings_ini_handler, NULL);
     actions_check_shortcuts();
     gesture_set_emulate_three_buttons_mouse(goxel.emulate_three_buttons_mouse);
@@ -350,6 +419,22 @@ void settings_save(void)
     fprintf(file, "scale=%f\n", gui_get_scale());
     fprintf(file, "\n");
 
+    fprintf(file, "[view]\n");
+    fprintf(file, "dynamic_resolution=%s\n",
+            goxel.dynamic_resolution ? "true" : "false");
+    fprintf(file, "target_fps=%f\n", goxel.target_fps);
+    fprintf(file, "render_thread=%s\n",
+            goxel.render_thread ? "true" : "false");
+    fprintf(file, "\n");
+
+    fprintf(file, "[memory]\n");
+    fprintf(file, "tiles_budget=%d\n", goxel.tiles_mem_budget);
+    fprintf(file, "history_budget=%d\n", goxel.history_mem_budget);
+    fprintf(file, "history_spill=%s\n",
+            goxel.history_spill ? "true" : "false");
+    fprintf(file, "image_max_size=%d\n", goxel.image_max_size);
+    fprintf(file, "\n");
+
     fprintf(file, "[shortcuts]\n");
     actions_iter(shortcut_save_callback, file);
 
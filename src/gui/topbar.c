@@ -52,6 +52,17 @@ static int gui_mode_select(void)
     return 0;
 }
 
+// Progress of the background import or export, with a cancel button.
+static void gui_file_task(void)
+{
+    bool import;
+    int progress = goxel_file_task_get_progress(&import);
+
+    if (progress < 0) return;
+    gui_text("%s %d%%", import ? _("Importing") : _("Exporting"), progress);
+    if (gui_button(_("Cancel"), 0, 0)) goxel_file_task_cancel();
+}
+
 void gui_top_bar(void)
 {
     gui_row_begin(0); {
@@ -65,6 +76,9 @@ void gui_top_bar(void)
             gui_action_button(ACTION_layer_clear, NULL, 0);
             gui_mode_select();
             gui_color("##color", goxel.painter.color);
+            if (save_get_progress() >= 0)
+                gui_text("%s %d%%", _("Saving"), save_get_progress());
+            gui_file_task();
         } gui_row_end();
     } gui_row_end();
 }
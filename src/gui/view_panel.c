@@ -44,6 +44,8 @@ void gui_view_panel(void)
         goxel.rend.settings.occlusion_strength =
             clamp(goxel.rend.settings.occlusion_strength, 0, 1);
     }
+    gui_checkbox_flag(_("Wide Occlusion"),
+            &goxel.rend.settings.effects, EFFECT_BAKED_AO, NULL);
     if (gui_input_float(_("Smoothness"), &goxel.rend.settings.smoothness,
                         0.1, 0, 1, NULL)) {
         goxel.rend.settings.smoothness =
@@ -60,6 +62,9 @@ void gui_view_panel(void)
             &goxel.rend.settings.effects, EFFECT_SEE_BACK, NULL);
     gui_checkbox_flag(_("Marching Cubes"),
                 &goxel.rend.settings.effects, EFFECT_MARCHING_CUBES, NULL);
+    gui_checkbox_flag(_("Raymarching"),
+                &goxel.rend.settings.effects, EFFECT_RAYMARCH,
+                _("Render the voxels directly, without meshing the tiles"));
 
     if (goxel.rend.settings.effects & EFFECT_MARCHING_CUBES) {
         gui_checkbox_flag(_("Smooth"), &goxel.rend.settings.effects,
@@ -19,6 +19,11 @@
 #include "goxel.h"
 #include "xxhash.h"
 
+// Current history transaction.
+static struct {
+    int     depth;
+    image_t *pending;   // Image that requested a push during the transaction.
+} g_transaction = {};
 
 static bool material_name_exists(void *user, const char *name)
 {
@@ -113,35 +118,211 @@ static layer_t *layer_clone(layer_t *other)
     return layer;
 }
 
-// Make sure the layer volume is up to date.
-void image_update(image_t *img)
+/*
+ * Dependency graph of the derived layers, rebuilt at each update.
+ *
+ * The clone layers depend on their base layer, and have to be re-evaluated
+ * after it.  We give each layer a depth in the graph (zero for the layers
+ * that don't have a base), and update the layers one depth at a time: the
+ * dirty layers of a given depth don't depend on each other, so they are
+ * evaluated in parallel on the job pool.
+ */
+typedef struct {
+    layer_t     *layer;
+    int         base;       // Index of the base node, or -1.
+    int         depth;      // -1 if not computed yet.
+    // Set by the main thread before the evaluation.
+    const volume_t *base_volume; // Only if the clone is dirty.
+    uint64_t    base_key;
+    uint32_t    shape_key;
+} layer_node_t;
+
+static int layer_node_cmp_id(const void *a, const void *b)
+{
+    const layer_node_t *na = a, *nb = b;
+    return cmp(na->layer->id, nb->layer->id);
+}
+
+static int layer_node_cmp_depth(const void *a, const void *b)
+{
+    const layer_node_t *na = a, *nb = b;
+    return cmp(na->depth, nb->depth);
+}
+
+static int layer_node_get_depth(layer_node_t *nodes, int i, int max_depth)
+{
+    // max_depth protects against cycles.
+    if (nodes[i].depth >= 0) return nodes[i].depth;
+    if (nodes[i].base == -1 || max_depth == 0) return (nodes[i].depth = 0);
+    nodes[i].depth =
+        layer_node_get_depth(nodes, nodes[i].base, max_depth - 1) + 1;
+    return nodes[i].depth;
+}
+
+static uint32_t layer_get_shape_key(const layer_t *layer)
 {
-    painter_t painter = {};
     uint32_t key;
-    layer_t *layer, *base;
+    key = XXH32(layer->mat, sizeof(layer->mat), 0);
+    key = XXH32(layer->shape, sizeof(layer->shape), key);
+    key = XXH32(layer->color, sizeof(layer->color), key);
+    return key;
+}
 
-    DL_FOREACH(img->layers, layer) {
-        base = img_get_layer(img, layer->base_id);
-        if (base && layer->base_volume_key != volume_get_key(base->volume)) {
-            volume_set(layer->volume, base->volume);
-            volume_move(layer->volume, layer->mat);
-            layer->base_volume_key = volume_get_key(base->volume);
+static void layer_node_eval(void *user, int i, int worker)
+{
+    layer_node_t *node = ((layer_node_t**)user)[i];
+    layer_t *layer = node->layer;
+    painter_t painter = {};
+
+    if (node->base_volume) {
+        volume_set(layer->volume, node->base_volume);
+        volume_move(layer->volume, layer->mat);
+    }
+    if (layer->shape && node->shape_key != layer->shape_key) {
+        painter.mode = MODE_OVER;
+        painter.shape = layer->shape;
+        painter.box = &goxel.image->box;
+        vec4_copy(layer->color, painter.color);
+        volume_clear(layer->volume);
+        volume_op(layer->volume, &painter, layer->mat);
+    }
+}
+
+void image_update_shape_layer(image_t *img, layer_t *layer)
+{
+    layer_node_t node = {.layer = layer, .base = -1, .depth = -1};
+    layer_node_t *nodes[1] = {&node};
+
+    if (!layer->shape || layer->base_id) return;
+    node.shape_key = layer_get_shape_key(layer);
+    if (node.shape_key == layer->shape_key) return;
+    layer_node_eval(nodes, 0, 0);
+    layer->shape_key = node.shape_key;
+}
+
+bool image_can_render_shape(const image_t *img, const layer_t *layer)
+{
+    const layer_t *l;
+    int aabb[2][3];
+
+    if (!layer->shape || !layer->visible || layer->mode != MODE_OVER)
+        return false;
+    if (layer->material && layer->material->base_color[3] < 1) return false;
+    // The shader walks at most 1024 voxels along each ray.
+    box_get_aabb(layer->mat, aabb);
+    if (    (aabb[1][0] - aabb[0][0]) + (aabb[1][1] - aabb[0][1]) +
+            (aabb[1][2] - aabb[0][2]) > 1000) return false;
+    DL_FOREACH(img->layers, l) {
+        if (l->base_id == layer->id) return false;
+    }
+    // The boolean layers are merged with the layers below them.
+    for (l = layer->next; l; l = l->next) {
+        if (l->visible && l->volume && l->mode != MODE_OVER) return false;
+    }
+    return true;
+}
+
+const layer_t *image_get_instance_base(const image_t *img,
+                                       const layer_t *layer)
+{
+    const layer_t *l, *base;
+    int i, j;
+
+    if (!layer->base_id || !layer->visible || layer->mode != MODE_OVER)
+        return NULL;
+    if (layer->material && layer->material->base_color[3] < 1) return NULL;
+    // Only whole voxels translations give the same voxels as volume_move.
+    for (i = 0; i < 4; i++) {
+        for (j = 0; j < 3; j++) {
+            if (i < 3 && layer->mat[i][j] != (i == j)) return NULL;
+            if (i == 3 && layer->mat[i][j] != roundf(layer->mat[i][j]))
+                return NULL;
         }
-        if (layer->shape) {
-            key = XXH32(layer->mat, sizeof(layer->mat), 0);
-            key = XXH32(layer->shape, sizeof(layer->shape), key);
-            key = XXH32(layer->color, sizeof(layer->color), key);
-            if (key != layer->shape_key) {
-                painter.mode = MODE_OVER;
-                painter.shape = layer->shape;
-                painter.box = &goxel.image->box;
-                vec4_copy(layer->color, painter.color);
-                volume_clear(layer->volume);
-                volume_op(layer->volume, &painter, layer->mat);
-                layer->shape_key = key;
+        if (layer->mat[i][3] != (i == 3)) return NULL;
+    }
+    base = img_get_layer(img, layer->base_id);
+    if (!base || !base->volume) return NULL;
+    DL_FOREACH(img->layers, l) {
+        if (l->base_id == layer->id) return NULL;
+    }
+    for (l = layer->next; l; l = l->next) {
+        if (l->visible && l->volume && l->mode != MODE_OVER) return NULL;
+    }
+    return base;
+}
+
+void image_update(image_t *img, bool shapes)
+{
+    int i, j, n = 0, nb_dirty;
+    layer_t *layer;
+    layer_node_t *nodes, key = {}, *base, **dirty;
+
+    DL_FOREACH(img->layers, layer) {
+        if (layer->base_id || layer->shape) break;
+    }
+    if (!layer) return; // No derived layers.
+
+    DL_COUNT(img->layers, layer, n);
+    nodes = calloc(n, sizeof(*nodes));
+    dirty = calloc(n, sizeof(*dirty));
+    i = 0;
+    DL_FOREACH(img->layers, layer) {
+        nodes[i++] = (layer_node_t){ .layer = layer, .base = -1, .depth = -1 };
+    }
+    qsort(nodes, n, sizeof(*nodes), layer_node_cmp_id);
+    for (i = 0; i < n; i++) {
+        if (!nodes[i].layer->base_id) continue;
+        key.layer = &(layer_t){ .id = nodes[i].layer->base_id };
+        base = bsearch(&key, nodes, n, sizeof(*nodes), layer_node_cmp_id);
+        assert(base);
+        nodes[i].base = base - nodes;
+    }
+    for (i = 0; i < n; i++) layer_node_get_depth(nodes, i, n);
+    // After the sort the base indices are not valid anymore, so keep
+    // pointers to the base layers instead.
+    for (i = 0; i < n; i++) {
+        if (nodes[i].base != -1)
+            nodes[i].base_volume = nodes[nodes[i].base].layer->volume;
+    }
+    qsort(nodes, n, sizeof(*nodes), layer_node_cmp_depth);
+
+    for (i = 0; i < n; i = j) {
+        // Collect the dirty layers of this depth.  Their bases have already
+        // been updated, so the keys are valid.
+        nb_dirty = 0;
+        for (j = i; j < n && nodes[j].depth == nodes[i].depth; j++) {
+            layer = nodes[j].layer;
+            if (nodes[j].base_volume) {
+                nodes[j].base_key = volume_get_key(nodes[j].base_volume);
+                if (nodes[j].base_key == layer->base_volume_key)
+                    nodes[j].base_volume = NULL;
             }
+            if (layer->shape) nodes[j].shape_key = layer_get_shape_key(layer);
+            if (!shapes && !nodes[j].base_volume &&
+                    image_can_render_shape(img, layer))
+                continue;
+            // The clone keeps its old voxels until we need them.
+            if (!shapes && image_get_instance_base(img, layer)) continue;
+            if (    nodes[j].base_volume ||
+                    (layer->shape && nodes[j].shape_key != layer->shape_key))
+                dirty[nb_dirty++] = &nodes[j];
+        }
+        if (!nb_dirty) continue;
+        // Don't use the job pool for a single layer, so that the layer
+        // evaluation itself can run in parallel.
+        if (nb_dirty == 1)
+            layer_node_eval(dirty, 0, 0);
+        else
+            jobs_parallel_for(nb_dirty, layer_node_eval, dirty);
+        for (j = 0; j < nb_dirty; j++) {
+            layer = dirty[j]->layer;
+            if (dirty[j]->base_volume)
+                layer->base_volume_key = dirty[j]->base_key;
+            if (layer->shape) layer->shape_key = dirty[j]->shape_key;
         }
     }
+    free(dirty);
+    free(nodes);
 }
 
 image_t *image_new(void)
@@ -167,59 +348,122 @@ image_t *image_new(void)
     return img;
 }
 
+// Update a layer from a snapshot of the same layer.  The volume is only
+// replaced if it changed, so that the render caches of the layer stay valid.
+static void layer_restore(layer_t *layer, const layer_t *snap)
+{
+    bool changed = layer->region != snap->region;
+
+    if (volume_get_key(layer->volume) != volume_get_key(snap->volume)) {
+        volume_set(layer->volume, snap->volume);
+        changed = true;
+    }
+    layer_copy_attributes(layer, snap);
+    // The tiles paged out since the snapshot are restored from the disk.
+    if (changed && layer->region)
+        region_store_reset(layer->region, layer->volume);
+}
+
+// Return the material of an image at the same position as a material of a
+// snapshot.
+static const material_t *get_restored_material(const image_t *img,
+                                               const image_t *snap,
+                                               const material_t *snap_mat)
+{
+    const material_t *mat, *m = img->materials;
+    DL_FOREACH(snap->materials, mat) {
+        if (mat == snap_mat) return m;
+        m = m->next;
+    }
+    return NULL;
+}
+
+/*
+ * Restore an image from a snapshot of the history.
+ *
+ * The layers, cameras and materials are updated in place when possible
+ * instead of being recreated, so that an undo only invalidates the render
+ * caches of what actually changed.  The layers are matched by id, and the
+ * cameras and materials by position.
+ */
 static void image_restore(image_t *img, const image_t *snap)
 {
-    layer_t *layer, *snap_layer;
-    camera_t *camera, *snap_camera;
-    material_t *material, *snap_material;
+    int ref;
+    layer_t *layer, *snap_layer, *old_layers;
+    camera_t *camera, *snap_camera, *old_cameras;
+    material_t *material, *snap_material, *old_materials;
     // Note: this would be easier if we has some generic object array
     // objects.
 
-    // First remove all the layer, cameras, and materials.
-    while ((layer = img->layers)) {
-        DL_DELETE(img->layers, layer);
-        layer_delete(layer);
-    }
-    while ((camera = img->cameras)) {
-        DL_DELETE(img->cameras, camera);
-        camera_delete(camera);
+    old_materials = img->materials;
+    img->materials = NULL;
+    img->active_material = NULL;
+    DL_FOREACH(snap->materials, snap_material) {
+        if ((material = old_materials)) {
+            DL_DELETE(old_materials, material);
+            ref = material->ref;
+            *material = *snap_material;
+            material->ref = ref;
+        } else {
+            material = material_copy(snap_material);
+        }
+        DL_APPEND(img->materials, material);
+        if (snap_material == snap->active_material)
+            img->active_material = material;
     }
-    while ((material = img->materials)) {
-        DL_DELETE(img->materials, material);
+    while ((material = old_materials)) {
+        DL_DELETE(old_materials, material);
         material_delete(material);
     }
 
-    // Set copy from the other.
-    img->layers = NULL;
-    img->active_layer = NULL;
-    DL_FOREACH(snap->layers, snap_layer) {
-        layer = layer_copy(snap_layer);
-        DL_APPEND(img->layers, layer);
-        if (snap_layer == snap->active_layer)
-            img->active_layer = layer;
-    }
-    assert(img->active_layer);
-
+    old_cameras = img->cameras;
     img->cameras = NULL;
     img->active_camera = NULL;
     DL_FOREACH(snap->cameras, snap_camera) {
-        camera = camera_copy(snap_camera);
+        if ((camera = old_cameras)) {
+            DL_DELETE(old_cameras, camera);
+            ref = camera->ref;
+            *camera = *snap_camera;
+            camera->ref = ref;
+        } else {
+            camera = camera_copy(snap_camera);
+        }
         DL_APPEND(img->cameras, camera);
         if (snap_camera == snap->active_camera)
             img->active_camera = camera;
     }
+    while ((camera = old_cameras)) {
+        DL_DELETE(old_cameras, camera);
+        camera_delete(camera);
+    }
 
-    img->materials = NULL;
-    img->active_material = NULL;
-    DL_FOREACH(snap->materials, snap_material) {
-        material = material_copy(snap_material);
-        DL_APPEND(img->materials, material);
-        if (snap_material == snap->active_material)
-            img->active_material = material;
-        DL_FOREACH(img->layers, layer) {
-            if (layer->material == snap_material)
-                layer->material = material;
+    // The layers are usually in the same order, so the search stops at the
+    // first remaining layer most of the time.
+    old_layers = img->layers;
+    img->layers = NULL;
+    img->active_layer = NULL;
+    DL_FOREACH(snap->layers, snap_layer) {
+        DL_FOREACH(old_layers, layer) {
+            if (layer->id == snap_layer->id) break;
+        }
+        if (layer) {
+            DL_DELETE(old_layers, layer);
+            layer_restore(layer, snap_layer);
+        } else {
+            layer = layer_copy(snap_layer);
+            if (layer->region)
+                region_store_reset(layer->region, layer->volume);
         }
+        layer->material = get_restored_material(img, snap,
+                                                snap_layer->material);
+        DL_APPEND(img->layers, layer);
+        if (snap_layer == snap->active_layer)
+            img->active_layer = layer;
+    }
+    assert(img->active_layer);
+    while ((layer = old_layers)) {
+        DL_DELETE(old_layers, layer);
+        layer_delete(layer);
     }
 
     // Copy other attributes.
@@ -278,6 +522,19 @@ static image_t *image_snapshot(const image_t *other)
     return img;
 }
 
+/*
+ * Function: image_copy
+ * Create a copy of an image, without its history.
+ *
+ * The volumes are copy on write, so this is cheap, and the copy can be
+ * read from an other thread while we keep editing the original image.
+ */
+image_t *image_copy(const image_t *img)
+{
+    image_t *ret = image_snapshot(img);
+    ret->ref = 1;
+    return ret;
+}
 
 void image_delete(image_t *img)
 {
@@ -288,6 +545,7 @@ void image_delete(image_t *img)
 
     if (!img) return;
     if (--img->ref > 0) return;
+    if (g_transaction.pending == img) g_transaction.pending = NULL;
 
     while ((layer = img->layers)) {
         DL_DELETE(img->layers, layer);
@@ -302,6 +560,7 @@ void image_delete(image_t *img)
         material_delete(mat);
     }
 
+    volume_delete(img->selection_mask);
     free(img->path);
     free(img->export_path);
 
@@ -453,7 +712,10 @@ void image_merge_visible_layers(image_t *img)
         }
         last = layer;
     }
-    if (last) img->active_layer = last;
+    if (last) {
+        img->active_layer = last;
+        volume_dedup(last->volume);
+    }
 }
 
 void image_merge_layer_down(image_t *img, layer_t *layer)
@@ -476,11 +738,57 @@ void image_merge_layer_down(image_t *img, layer_t *layer)
     }
 
     volume_merge(target->volume, layer->volume, layer->mode, NULL);
+    volume_dedup(target->volume);
     DL_DELETE(img->layers, layer);
     layer_delete(layer);
     img->active_layer = target;
 }
 
+void image_dedup(image_t *img)
+{
+    layer_t *layer;
+    int nb = 0;
+    DL_FOREACH(img->layers, layer) {
+        if (layer->volume) nb += volume_dedup(layer->volume);
+    }
+    if (nb) LOG_D("Deduplicated %d tiles", nb);
+}
+
+int image_save_tile_store(const image_t *img, const char *path)
+{
+    layer_t *layer;
+    volume_t **volumes;
+    int nb = 0, ret;
+
+    DL_FOREACH(img->layers, layer) nb++;
+    volumes = calloc(max(nb, 1), sizeof(*volumes));
+    nb = 0;
+    DL_FOREACH(img->layers, layer) {
+        if (layer->volume) volumes[nb++] = layer->volume;
+    }
+    ret = volume_store_save(path, volumes, nb);
+    free(volumes);
+    return ret;
+}
+
+int image_share_tiles(image_t *img)
+{
+    layer_t *layer;
+    image_t *hist;
+    int nb = 0;
+
+    DL_FOREACH(img->layers, layer) {
+        if (layer->volume) nb += volume_store_share(layer->volume);
+    }
+    // The history snapshots would otherwise keep the private copies alive.
+    DL_FOREACH2(img->history, hist, history_next) {
+        DL_FOREACH(hist->layers, layer) {
+            if (layer->volume) volume_store_share(layer->volume);
+        }
+    }
+    return nb;
+}
+
 camera_t *image_add_camera(image_t *img, camera_t *cam)
 {
     assert(img);
@@ -599,10 +907,30 @@ void debug_print_history(image_t *img)
 static void debug_print_history(image_t *img) {}
 #endif
 
+void image_history_begin(void)
+{
+    g_transaction.depth++;
+}
+
+void image_history_commit(void)
+{
+    image_t *img;
+    assert(g_transaction.depth > 0);
+    if (--g_transaction.depth > 0) return;
+    img = g_transaction.pending;
+    g_transaction.pending = NULL;
+    if (img) image_history_push(img);
+}
+
 void image_history_push(image_t *img)
 {
     image_t *snap;
 
+    if (g_transaction.depth > 0) {
+        g_transaction.pending = img;
+        return;
+    }
+
     // Don't do anything if the image didn't actually changed.
     if (img->history_pos) {
         if (image_get_key(img) == image_get_key(img->history_pos)) {
@@ -623,29 +951,110 @@ void image_history_push(image_t *img)
     DL_APPEND2(img->history, snap, history_prev, history_next);
     img->history_pos = snap;
     debug_print_history(img);
+
+    if (goxel.history_mem_budget > 0)
+        image_history_trim(img, (uint64_t)goxel.history_mem_budget << 20,
+                           goxel.history_spill);
+    if (goxel.tiles_mem_budget > 0)
+        image_pack_history(img, (uint64_t)goxel.tiles_mem_budget << 20);
+}
+
+static uint64_t get_tiles_mem(void)
+{
+    volume_global_stats_t stats;
+    volume_get_global_stats(&stats);
+    return stats.mem + stats.packed_mem;
+}
+
+void image_pack_history(image_t *img, uint64_t budget)
+{
+    int pass;
+    image_t *hist;
+    layer_t *layer;
+
+    // First pass: compress in memory, second pass: move to the disk.
+    for (pass = 0; pass < 2; pass++) {
+        DL_FOREACH2(img->history, hist, history_next) {
+            if (get_tiles_mem() <= budget) return;
+            DL_FOREACH(hist->layers, layer) {
+                volume_pack(layer->volume, pass == 1);
+            }
+        }
+    }
+}
+
+// Remove the oldest snapshot of the history.
+static void history_delete_oldest(image_t *img)
+{
+    image_t *hist = img->history;
+    assert(hist);
+    if (hist == img->history_pos) img->history_pos = NULL;
+    DL_DELETE2(img->history, hist, history_prev, history_next);
+    image_delete(hist);
 }
 
 void image_history_resize(image_t *img, int size)
 {
     int i, nb = 0;
     image_t *hist;
-    layer_t *layer, *layer_tmp;
 
     // First cound the size of the history to compute how many we are going
     // to remove.
-    for (hist = img->history; hist != img; hist = hist->history_next) nb++;
+    DL_FOREACH2(img->history, hist, history_next) nb++;
     nb = max(0, nb - size);
-    for (i = 0; i < nb; i++) {
-        hist = img->history;
-
-        // XXX: do that in a function!
-        DL_FOREACH_SAFE(hist->layers, layer, layer_tmp) {
-            assert(layer);
-            DL_DELETE(hist->layers, layer);
-            layer_delete(layer);
-        }
-        DL_DELETE2(img->history, hist, history_prev, history_next);
-        free(hist);
+    for (i = 0; i < nb; i++) history_delete_oldest(img);
+}
+
+uint64_t image_history_get_mem(const image_t *snap)
+{
+    uint64_t ret = 0;
+    const layer_t *layer;
+    DL_FOREACH(snap->layers, layer) {
+        ret += volume_get_unique_mem(layer->volume);
+    }
+    if (snap->selection_mask)
+        ret += volume_get_unique_mem(snap->selection_mask);
+    return ret;
+}
+
+// Move the unique tiles of the oldest snapshot that has some to the disk.
+static bool history_spill_oldest(image_t *img)
+{
+    image_t *hist;
+    layer_t *layer;
+    int64_t released;
+
+    DL_FOREACH2(img->history, hist, history_next) {
+        if (!image_history_get_mem(hist)) continue;
+        released = 0;
+        DL_FOREACH(hist->layers, layer)
+            released += volume_pack(layer->volume, true);
+        if (hist->selection_mask)
+            released += volume_pack(hist->selection_mask, true);
+        if (released > 0) return true;
+    }
+    return false;
+}
+
+void image_history_trim(image_t *img, uint64_t budget, bool spill)
+{
+    volume_global_stats_t stats;
+    image_t *hist;
+    uint64_t total;
+
+    // The history cannot use more than all the tiles memory.
+    volume_get_global_stats(&stats);
+    if (stats.mem + stats.packed_mem <= budget) return;
+
+    // Deleting a snapshot can give its shared tiles to the next one, so we
+    // recompute the total after each change.
+    while (img->history && img->history != img->history_pos) {
+        total = 0;
+        DL_FOREACH2(img->history, hist, history_next)
+            total += image_history_get_mem(hist);
+        if (total <= budget) break;
+        if (spill && history_spill_oldest(img)) continue;
+        history_delete_oldest(img);
     }
 }
 
@@ -720,28 +1129,28 @@ bool image_layer_can_edit(const image_t *img, const layer_t *layer)
  * Function: image_get_key
  * Return a value that is garantied to change when the image change.
  */
-uint32_t image_get_key(const image_t *img)
+uint64_t image_get_key(const image_t *img)
 {
-    uint32_t key = 0, k;
+    uint64_t key = 0, k;
     layer_t *layer;
     camera_t *camera;
     material_t *material;
 
     DL_FOREACH(img->layers, layer) {
         k = layer_get_key(layer);
-        key = XXH32(&k, sizeof(k), key);
+        key = XXH64(&k, sizeof(k), key);
     }
     DL_FOREACH(img->cameras, camera) {
         k = camera_get_key(camera);
-        key = XXH32(&k, sizeof(k), key);
+        key = XXH64(&k, sizeof(k), key);
     }
     DL_FOREACH(img->materials, material) {
         k = material_get_hash(material);
-        key = XXH32(&k, sizeof(k), key);
+        key = XXH64(&k, sizeof(k), key);
     }
-    key = XXH32(img->selection_box, sizeof(img->selection_box), key);
+    key = XXH64(img->selection_box, sizeof(img->selection_box), key);
     k = volume_get_key(img->selection_mask);
-    key = XXH32(&k, sizeof(k), key);
+    key = XXH64(&k, sizeof(k), key);
     return key;
 }
 
@@ -754,9 +1163,95 @@ bool image_is_empty(const image_t *img)
     return true;
 }
 
+// Size of the box of tiles kept in memory around the camera for the
+// streaming layers.  The box only moves by steps, so that we don't page
+// tiles in and out at each frame.
+#define STREAM_RADIUS 256
+#define STREAM_STEP 64
+
+void image_update_streams(image_t *img, const float pos[3])
+{
+    layer_t *layer;
+    int i, c, window[2][3];
+
+    for (i = 0; i < 3; i++) {
+        c = (int)floor(pos[i] / STREAM_STEP) * STREAM_STEP;
+        window[0][i] = c - STREAM_RADIUS;
+        window[1][i] = c + STREAM_RADIUS;
+    }
+    DL_FOREACH(img->layers, layer) {
+        if (!layer->region) continue;
+        region_store_update(layer->region, layer->volume, window);
+    }
+}
+
+void image_flush_streams(const image_t *img)
+{
+    layer_t *layer;
+    DL_FOREACH(img->layers, layer) {
+        if (!layer->region) continue;
+        region_store_flush(layer->region, layer->volume);
+    }
+}
+
 /*
  * Turn an image layer into a volume of 1 voxel depth.
  */
+// Position of a pixel of an image layer.
+static void get_image_pixel_pos(const layer_t *layer, int w, int h,
+                                int x, int y, float out[3])
+{
+    vec3_set(out, (x / (float)w) - 0.5, - ((y + 1) / (float)h) + 0.5, 0);
+    mat4_mul_vec3(layer->mat, out, out);
+}
+
+// Write the pixels of an image layer with a single span, if the layer
+// pixels map exactly to the voxels grid.  Return false otherwise.
+static bool image_layer_to_volume_span(layer_t *layer, const uint8_t *data,
+                                       int w, int h, int bpp)
+{
+    float p[3], px[3], py[3];
+    int i, x, y, v[3], pos[3], dx[3], dy[3], aabb[2][3], size[3];
+    uint8_t *buf, *c;
+
+    get_image_pixel_pos(layer, w, h, 0, 0, p);
+    get_image_pixel_pos(layer, w, h, 1, 0, px);
+    get_image_pixel_pos(layer, w, h, 0, 1, py);
+    for (i = 0; i < 3; i++) {
+        pos[i] = round(p[i]);
+        dx[i] = round(px[i] - p[i]);
+        dy[i] = round(py[i] - p[i]);
+        if (fabs(p[i] - pos[i]) > 0.01 ||
+            fabs(px[i] - p[i] - dx[i]) > 0.01 ||
+            fabs(py[i] - p[i] - dy[i]) > 0.01) return false;
+    }
+    // Both steps have to be along a different axis.
+    if (abs(dx[0]) + abs(dx[1]) + abs(dx[2]) != 1) return false;
+    if (abs(dy[0]) + abs(dy[1]) + abs(dy[2]) != 1) return false;
+    if (dx[0] * dy[0] + dx[1] * dy[1] + dx[2] * dy[2] != 0) return false;
+
+    for (i = 0; i < 3; i++) {
+        aabb[0][i] = pos[i] + min(dx[i] * (w - 1), 0) +
+                     min(dy[i] * (h - 1), 0);
+        aabb[1][i] = pos[i] + max(dx[i] * (w - 1), 0) +
+                     max(dy[i] * (h - 1), 0) + 1;
+        size[i] = aabb[1][i] - aabb[0][i];
+    }
+    buf = malloc((size_t)size[0] * size[1] * size[2] * 4);
+    for (y = 0; y < h; y++)
+    for (x = 0; x < w; x++) {
+        for (i = 0; i < 3; i++)
+            v[i] = pos[i] + x * dx[i] + y * dy[i] - aabb[0][i];
+        c = buf + (((size_t)v[2] * size[1] + v[1]) * size[0] + v[0]) * 4;
+        memset(c, 0, 4);
+        c[3] = 255;
+        memcpy(c, data + ((size_t)y * w + x) * bpp, bpp);
+    }
+    volume_set_span(layer->volume, aabb, buf, NULL);
+    free(buf);
+    return true;
+}
+
 static void image_image_layer_to_volume(image_t *img, layer_t *layer)
 {
     uint8_t *data;
@@ -767,13 +1262,14 @@ static void image_image_layer_to_volume(image_t *img, layer_t *layer)
     assert(layer);
     volume_accessor_t acc;
 
-    image_history_push(img);
     data = img_read(layer->image->path, &w, &h, &bpp);
+    if (!data) return;
+    image_history_push(img);
+    if (image_layer_to_volume_span(layer, data, w, h, bpp)) goto end;
     acc = volume_get_accessor(layer->volume);
     for (y = 0; y < h; y++)
     for (x = 0; x < w; x++) {
-        vec3_set(p, (x / (float)w) - 0.5, - ((y + 1) / (float)h) + 0.5, 0);
-        mat4_mul_vec3(layer->mat, p, p);
+        get_image_pixel_pos(layer, w, h, x, y, p);
         pos[0] = round(p[0]);
         pos[1] = round(p[1]);
         pos[2] = round(p[2]);
@@ -782,6 +1278,7 @@ static void image_image_layer_to_volume(image_t *img, layer_t *layer)
         memcpy(c, data + (y * w + x) * bpp, bpp);
         volume_set_at(layer->volume, &acc, pos, c);
     }
+end:
     texture_delete(layer->image);
     layer->image = NULL;
     free(data);
@@ -969,6 +1466,45 @@ ACTION_REGISTER(ACTION_img_new_shape_layer,
     .flags = ACTION_TOUCH_IMAGE,
 )
 
+static void a_img_new_stream_layer(void)
+{
+    const char *path;
+    layer_t *layer;
+
+    path = sys_open_folder_dialog("Open Stream", NULL);
+    if (!path) return;
+    layer = layer_new(NULL);
+    path_basename(path, layer->name, sizeof(layer->name));
+    if (!layer->name[0]) snprintf(layer->name, sizeof(layer->name), "Stream");
+    layer->region = region_store_open(path);
+    image_add_layer(goxel.image, layer);
+}
+
+ACTION_REGISTER(ACTION_img_new_stream_layer,
+    .help = N_("Creates a layer streamed from a folder of region files"),
+    .cfunc = a_img_new_stream_layer,
+    .flags = ACTION_TOUCH_IMAGE,
+)
+
+static void a_layer_stream(void)
+{
+    const char *path;
+    layer_t *layer = goxel.image->active_layer;
+
+    if (layer->region || !image_layer_can_edit(goxel.image, layer)) return;
+    path = sys_open_folder_dialog("Stream To", NULL);
+    if (!path) return;
+    layer->region = region_store_open(path);
+    region_store_flush(layer->region, layer->volume);
+}
+
+ACTION_REGISTER(ACTION_layer_stream,
+    .help = N_("Saves the layer into a folder of region files, and only "
+               "keeps the tiles around the camera in memory"),
+    .cfunc = a_layer_stream,
+    .flags = ACTION_TOUCH_IMAGE,
+)
+
 static void a_img_new_material(void)
 {
     image_add_material(goxel.image, NULL);
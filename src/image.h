@@ -54,7 +54,7 @@ struct image {
     int      export_width;
     int      export_height;
     bool     export_transparent_background;
-    uint32_t saved_key;     // image_get_key() value of saved file.
+    uint64_t saved_key;     // image_get_key() value of saved file.
 
     // Undo history.
     image_t *history;
@@ -63,18 +63,141 @@ struct image {
 };
 
 image_t *image_new(void);
+image_t *image_copy(const image_t *img);
 void image_delete(image_t *img);
 layer_t *image_add_layer(image_t *img, layer_t *layer);
 void image_delete_layer(image_t *img, layer_t *layer);
 layer_t *image_duplicate_layer(image_t *img, layer_t *layer);
+layer_t *image_clone_layer(image_t *img, layer_t *other);
+
+/*
+ * Function: image_update
+ * Make sure the volumes of the clone and shape layers are up to date.
+ *
+ * Parameters:
+ *   img    - The image.
+ *   shapes - If false, don't voxelize the shape layers that can be
+ *            rendered directly (see <image_can_render_shape>), and don't
+ *            update the clones rendered as instances (see
+ *            <image_get_instance_base>).
+ */
+void image_update(image_t *img, bool shapes);
+
+/*
+ * Function: image_update_shape_layer
+ * Same as <image_update>, but only voxelize a single shape layer, if its
+ * volume is not up to date.
+ */
+void image_update_shape_layer(image_t *img, layer_t *layer);
+
+/*
+ * Function: image_can_render_shape
+ * Test if a shape layer can be rendered directly from its shape, without
+ * voxelizing it.
+ *
+ * This is only possible if no other layer depends on the layer volume:
+ * the layer is not cloned, and no boolean layer is merged on top of it.
+ */
+bool image_can_render_shape(const image_t *img, const layer_t *layer);
+
+/*
+ * Function: image_get_instance_base
+ * Test if a clone layer can be rendered as an instance of its base layer:
+ * the meshes of the base volume drawn again with the layer matrix, without
+ * copying the voxels.
+ *
+ * This is only possible for the clones moved by a whole voxels
+ * translation, and with the same restrictions as for
+ * <image_can_render_shape>.
+ *
+ * Return:
+ *   The base layer, or NULL if the clone needs its own volume.
+ */
+const layer_t *image_get_instance_base(const image_t *img,
+                                       const layer_t *layer);
 void image_merge_visible_layers(image_t *img);
 void image_merge_layer_down(image_t *img, layer_t *layer);
 
+/*
+ * Function: image_dedup
+ * Share the identical tiles of all the layers volumes, see <volume_dedup>.
+ */
+void image_dedup(image_t *img);
+
+/*
+ * Function: image_save_tile_store
+ * Write the tiles of all the layers into a tile store file, see
+ * <volume_store_save>.
+ *
+ * Return:
+ *   The number of tiles written, or -1 in case of error.
+ */
+int image_save_tile_store(const image_t *img, const char *path);
+
+/*
+ * Function: image_share_tiles
+ * Map the tiles of the layers and of the history from the current tile
+ * store, see <volume_store_share>.
+ *
+ * Return:
+ *   The number of tiles of the layers whose data got replaced.
+ */
+int image_share_tiles(image_t *img);
+
 void image_history_push(image_t *img);
+
+/*
+ * Function: image_history_begin
+ * Start a compound operation that should only add a single undo step.
+ *
+ * Until the matching <image_history_commit>, the calls to
+ * <image_history_push> are deferred.  The transactions can be nested, only
+ * the outermost commit pushes the snapshot.
+ */
+void image_history_begin(void);
+
+/*
+ * Function: image_history_commit
+ * End a compound operation started with <image_history_begin>.
+ *
+ * If any push has been requested during the operation, add a single
+ * snapshot to the history of the last image that requested it.
+ */
+void image_history_commit(void);
+
 void image_undo(image_t *img);
 void image_redo(image_t *img);
 void image_history_resize(image_t *img, int size);
 
+/*
+ * Function: image_history_get_mem
+ * Return the tiles memory that only a history snapshot keeps alive.
+ */
+uint64_t image_history_get_mem(const image_t *snap);
+
+/*
+ * Function: image_history_trim
+ * Make the history tiles memory fit a budget.
+ *
+ * Parameters:
+ *   img    - The image.
+ *   budget - Max memory of the history tiles, in bytes.
+ *   spill  - If set, first move the oldest snapshots tiles to a temporary
+ *            file, they get loaded back on undo.  Otherwise, or if that's
+ *            not enough, delete the oldest snapshots.  The current snapshot
+ *            is always kept.
+ */
+void image_history_trim(image_t *img, uint64_t budget, bool spill);
+
+/*
+ * Function: image_pack_history
+ * Compress the undo history volumes until the tiles memory fits a budget.
+ *
+ * The oldest snapshots are packed first.  If compressing them in memory is
+ * not enough, the packed tiles are moved to the disk.
+ */
+void image_pack_history(image_t *img, uint64_t budget);
+
 bool image_layer_can_edit(const image_t *img, const layer_t *layer);
 
 material_t *image_add_material(image_t *img, material_t *mat);
@@ -89,7 +212,7 @@ void image_auto_resize(image_t *img);
  * Function: image_get_key
  * Return a value that is guarantied to change when the image change.
  */
-uint32_t image_get_key(const image_t *img);
+uint64_t image_get_key(const image_t *img);
 
 /*
  * Function: image_is_empty
@@ -97,4 +220,18 @@ uint32_t image_get_key(const image_t *img);
  */
 bool image_is_empty(const image_t *img);
 
+/*
+ * Function: image_update_streams
+ * Page the tiles of the streaming layers in and out around a position.
+ *
+ * See <region_store_update>.
+ */
+void image_update_streams(image_t *img, const float pos[3]);
+
+/*
+ * Function: image_flush_streams
+ * Write all the modified tiles of the streaming layers to the disk.
+ */
+void image_flush_streams(const image_t *img);
+
 #endif // IMAGE_H
@@ -36,54 +36,68 @@ void layer_delete(layer_t *layer)
     if (--layer->ref > 0) return;
     volume_delete(layer->volume);
     texture_delete(layer->image);
+    region_store_release(layer->region);
     free(layer);
 }
 
-uint32_t layer_get_key(const layer_t *layer)
+uint64_t layer_get_key(const layer_t *layer)
 {
-    uint32_t key;
+    uint64_t key;
     uint64_t volume_key;
-    uint32_t mat_key;
+    uint64_t mat_key;
 
     volume_key = volume_get_key(layer->volume);
     mat_key = layer->material ? material_get_hash(layer->material) : 0;
 
-    key = 0;
-    key = XXH32(&volume_key, sizeof(volume_key), key);
-    key = XXH32(&layer->visible, sizeof(layer->visible), key);
-    key = XXH32(&layer->name, sizeof(layer->name), key);
-    key = XXH32(&layer->box, sizeof(layer->box), key);
-    key = XXH32(&layer->mat, sizeof(layer->mat), key);
-    key = XXH32(&layer->shape, sizeof(layer->shape), key);
-    key = XXH32(&layer->color, sizeof(layer->color), key);
-    key = XXH32(&mat_key, sizeof(mat_key), key);
-    key = XXH32(&layer->mode, sizeof(layer->mode), key);
+    // Start from the volume key, that already changes on any edit.
+    key = volume_key;
+    key = XXH64(&layer->visible, sizeof(layer->visible), key);
+    key = XXH64(layer->name, strlen(layer->name), key);
+    key = XXH64(&layer->box, sizeof(layer->box), key);
+    key = XXH64(&layer->mat, sizeof(layer->mat), key);
+    key = XXH64(&layer->shape, sizeof(layer->shape), key);
+    key = XXH64(&layer->color, sizeof(layer->color), key);
+    key = XXH64(&mat_key, sizeof(mat_key), key);
+    key = XXH64(&layer->mode, sizeof(layer->mode), key);
 
     // Also hash the material pointer, to avoid some possible crashes with
     // goxel.render_layers cache.
-    key = XXH32(&layer->material, sizeof(layer->material), key);
+    key = XXH64(&layer->material, sizeof(layer->material), key);
     return key;
 }
 
-layer_t *layer_copy(layer_t *other)
+void layer_copy_attributes(layer_t *layer, const layer_t *other)
 {
-    layer_t *layer;
-    layer = calloc(1, sizeof(*layer));
-    layer->ref = 1;
+    if (layer->image != other->image) {
+        texture_delete(layer->image);
+        layer->image = texture_copy(other->image);
+    }
+    if (layer->region != other->region) {
+        if (layer->region) region_store_release(layer->region);
+        layer->region = other->region ? region_store_ref(other->region)
+                                      : NULL;
+    }
     memcpy(layer->name, other->name, sizeof(layer->name));
     layer->visible = other->visible;
-    layer->volume = volume_copy(other->volume);
-    layer->image = texture_copy(other->image);
-    layer->material = other->material;
     mat4_copy(other->box, layer->box);
     mat4_copy(other->mat, layer->mat);
-    layer->id = other->id;
     layer->base_id = other->base_id;
     layer->base_volume_key = other->base_volume_key;
     layer->shape = other->shape;
     layer->shape_key = other->shape_key;
     layer->mode = other->mode;
     memcpy(layer->color, other->color, sizeof(layer->color));
+}
+
+layer_t *layer_copy(layer_t *other)
+{
+    layer_t *layer;
+    layer = calloc(1, sizeof(*layer));
+    layer->ref = 1;
+    layer->volume = volume_copy(other->volume);
+    layer->material = other->material;
+    layer->id = other->id;
+    layer_copy_attributes(layer, other);
     return layer;
 }
 
@@ -103,3 +117,16 @@ void layer_get_bounding_box(const layer_t *layer, float box[4][4])
     if (aabb[0][0] > aabb[1][0]) memset(aabb, 0, sizeof(aabb));
     bbox_from_aabb(box, aabb);
 }
+
+void layer_get_stats(layer_t *layer, volume_stats_t *stats)
+{
+    uint64_t key = volume_get_key(layer->volume);
+    double time = sys_get_time();
+
+    if (key != layer->stats_key || time - layer->stats_time > 1.0) {
+        volume_get_stats(layer->volume, &layer->stats);
+        layer->stats_key = key;
+        layer->stats_time = time;
+    }
+    *stats = layer->stats;
+}
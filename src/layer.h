@@ -20,6 +20,7 @@
 #define LAYER_H
 
 #include "material.h"
+#include "region.h"
 #include "volume.h"
 #include "shape.h"
 #include "utils/texture.h"
@@ -46,13 +47,26 @@ struct layer {
     const shape_t *shape;
     uint32_t    shape_key;
     uint8_t     color[4];
+    // For streaming layers, shared between all the copies of the layer.
+    region_store_t *region;
+    // Cached value of <layer_get_stats>.
+    volume_stats_t stats;
+    uint64_t    stats_key;
+    double      stats_time;
 };
 
 layer_t *layer_new(const char *name);
 void layer_delete(layer_t *layer);
-uint32_t layer_get_key(const layer_t *layer);
+uint64_t layer_get_key(const layer_t *layer);
 layer_t *layer_copy(layer_t *other);
 
+/*
+ * Function: layer_copy_attributes
+ * Copy all the attributes of a layer into an other one, except the id, the
+ * volume and the material.
+ */
+void layer_copy_attributes(layer_t *layer, const layer_t *other);
+
 /*
  * Function: layer_get_bounding_box
  * Return the layer box if set, otherwise the bounding box of the layer
@@ -60,4 +74,14 @@ layer_t *layer_copy(layer_t *other);
  */
 void layer_get_bounding_box(const layer_t *layer, float box[4][4]);
 
+/*
+ * Function: layer_get_stats
+ * Get the memory usage of the layer volume.
+ *
+ * The value is cached, and only computed again when the volume changes, or
+ * after a second, since the part shared with other volumes can change
+ * without the volume key changing.
+ */
+void layer_get_stats(layer_t *layer, volume_stats_t *stats);
+
 #endif // LAYER_H
@@ -18,7 +18,21 @@
 
 #include "goxel.h"
 #include "script.h"
+#include <ctype.h>
 #include <getopt.h>
+#include <signal.h>
+
+#if !defined(WIN32) && !defined(__EMSCRIPTEN__)
+#   define HAS_SERVE 1
+#   include <errno.h>
+#   include <fcntl.h>
+#   include <sys/file.h>
+#   include <sys/socket.h>
+#   include <sys/stat.h>
+#   include <sys/un.h>
+#   include <sys/wait.h>
+#   include <unistd.h>
+#endif
 
 #include "../ext_src/nfd/nfd.h"
 #include "../ext_src/nfd/nfd_glfw3.h"
@@ -30,35 +44,88 @@
 
 static inputs_t     *g_inputs = NULL;
 static float        g_scale = 1;
+// Time of the last input event, and whether we got any since the last
+// frame.  Used to stop redrawing when goxel is idle.
+static double       g_last_event_time = 0;
+static bool         g_has_events = false;
+
+// After this time without input, we wait for events instead of redrawing.
+static const double IDLE_DELAY = 1.0;      // Seconds.
+// Max time we wait for an event, to still catch the changes that don't
+// come from the inputs.
+static const double IDLE_TIMEOUT = 0.25;   // Seconds.
 
 static void on_glfw_error(int code, const char *msg)
 {
     fprintf(stderr, "glfw error %d (%s)\n", code, msg);
 }
 
+static void on_event(void)
+{
+    g_has_events = true;
+}
+
 void on_scroll(GLFWwindow *win, double x, double y)
 {
+    on_event();
     g_inputs->mouse_wheel = y;
 }
 
 void on_char(GLFWwindow *win, unsigned int c)
 {
+    on_event();
     inputs_insert_char(g_inputs, c);
 }
 
 void on_drop(GLFWwindow* win, int count, const char** paths)
 {
     int i;
+    on_event();
     for (i = 0;  i < count;  i++)
         goxel_import_file(paths[i], NULL);
 }
 
 void on_close(GLFWwindow *win)
 {
+    on_event();
     glfwSetWindowShouldClose(win, GLFW_FALSE);
     gui_query_quit();
 }
 
+// The other inputs are polled in the loop, we only need to know that
+// something happened.
+static void on_cursor_pos(GLFWwindow *win, double x, double y)
+{
+    on_event();
+}
+
+static void on_mouse_button(GLFWwindow *win, int button, int action,
+                            int mods)
+{
+    on_event();
+}
+
+static void on_key(GLFWwindow *win, int key, int scancode, int action,
+                   int mods)
+{
+    on_event();
+}
+
+static void on_window_event(GLFWwindow *win)
+{
+    on_event();
+}
+
+static void on_window_size(GLFWwindow *win, int w, int h)
+{
+    on_event();
+}
+
+static void on_focus(GLFWwindow *win, int focused)
+{
+    on_event();
+}
+
 typedef struct
 {
     char *input;
@@ -68,11 +135,68 @@ typedef struct
     const char *script;
     int script_args_nb;
     const char *script_args[32];
+
+    const char *render;
+    int samples;
+    int size[2];
+    const char *camera;
+    int threads;
+    int snapshots;
+    float time_limit;
+    float adaptive;
+    bool denoise;
+    int region[4];
+    int tiles[2];
+    int workers;
+    const char *worker_command;
+    bool bench_pathtracer;
+    const char *batch;
+    const char *trace_startup;
+    bool bench_startup;
+    const char *bench_voxels;
+    const char *generate;
+    const char *perf_tests;
+    float perf_tolerance;
+    int frames;
+    const char *serve;
+    const char *tile_store;
+    float mem_log;
+    const char *record_inputs;
+    const char *bench_inputs;
+    const char *bench_results;
 } args_t;
 
 #define OPT_HELP 1
 #define OPT_VERSION 2
 #define OPT_SCRIPT 3
+#define OPT_RENDER 4
+#define OPT_SAMPLES 5
+#define OPT_SIZE 6
+#define OPT_CAMERA 7
+#define OPT_THREADS 8
+#define OPT_SNAPSHOTS 9
+#define OPT_TIME_LIMIT 10
+#define OPT_ADAPTIVE 11
+#define OPT_DENOISE 12
+#define OPT_REGION 13
+#define OPT_TILES 14
+#define OPT_WORKERS 15
+#define OPT_WORKER_COMMAND 16
+#define OPT_BENCH_PATHTRACER 17
+#define OPT_BATCH 18
+#define OPT_TRACE_STARTUP 19
+#define OPT_BENCH_STARTUP 20
+#define OPT_BENCH_VOXELS 21
+#define OPT_GENERATE 22
+#define OPT_PERF_TESTS 23
+#define OPT_PERF_TOLERANCE 24
+#define OPT_FRAMES 25
+#define OPT_SERVE 26
+#define OPT_TILE_STORE 27
+#define OPT_MEM_LOG 28
+#define OPT_RECORD_INPUTS 29
+#define OPT_BENCH_INPUTS 30
+#define OPT_BENCH_RESULTS 31
 
 typedef struct {
     const char *name;
@@ -88,6 +212,70 @@ static const gox_option_t OPTIONS[] = {
     {"scale", 's', required_argument, "FLOAT", .help="Set UI scale"},
     {"script", OPT_SCRIPT, required_argument, "FILENAME",
         .help="Run a script and exit"},
+    {"render", OPT_RENDER, required_argument, "FILENAME",
+        .help="Render the image with the path tracer and exit"},
+    {"samples", OPT_SAMPLES, required_argument, "INT",
+        .help="Number of render samples (default 512)"},
+    {"size", OPT_SIZE, required_argument, "WxH",
+        .help="Size of the render (default 1024x768)"},
+    {"camera", OPT_CAMERA, required_argument, "NAME",
+        .help="Camera used for the render"},
+    {"frames", OPT_FRAMES, required_argument, "INT",
+        .help="Render a turntable of INT frames into numbered files, with "
+              "--render or a png --export"},
+    {"threads", OPT_THREADS, required_argument, "INT",
+        .help="Number of render threads (default all the cores)"},
+    {"snapshots", OPT_SNAPSHOTS, required_argument, "INT",
+        .help="Also save the render every INT samples"},
+    {"time-limit", OPT_TIME_LIMIT, required_argument, "SECONDS",
+        .help="Stop the render after a given time"},
+    {"adaptive", OPT_ADAPTIVE, required_argument, "FLOAT",
+        .help="Adaptive sampling noise threshold (e.g. 0.02)"},
+    {"denoise", OPT_DENOISE, .help="Denoise the render"},
+    {"region", OPT_REGION, required_argument, "X,Y,W,H",
+        .help="Only render a region of the image"},
+    {"tiles", OPT_TILES, required_argument, "CxR",
+        .help="Split the render into tiles rendered by worker processes"},
+    {"workers", OPT_WORKERS, required_argument, "INT",
+        .help="Number of tiles rendered at the same time (default 1)"},
+    {"worker-command", OPT_WORKER_COMMAND, required_argument, "CMD",
+        .help="Command to start a worker, %d is the worker index"},
+    {"bench-pathtracer", OPT_BENCH_PATHTRACER,
+        .help="Render the path tracer benchmark scene and print the stats"},
+    {"batch", OPT_BATCH, required_argument, "FILENAME",
+        .help="Convert the 'INPUT OUTPUT' files listed in a file (- for "
+              "stdin) and exit"},
+    {"serve", OPT_SERVE, required_argument, "SOCKET",
+        .help="Run the conversion and render jobs sent to a unix socket "
+              "until killed"},
+    {"tile-store", OPT_TILE_STORE, required_argument, "FILENAME",
+        .help="Share the voxels of the render and serve workers through a "
+              "tile store file, created if needed"},
+    {"mem-log", OPT_MEM_LOG, required_argument, "SECONDS",
+        .help="Log the memory used by the tiles, caches, GPU and path "
+              "tracer every SECONDS"},
+    {"trace-startup", OPT_TRACE_STARTUP, required_argument, "FILENAME",
+        .help="Save a Chrome trace of the startup"},
+    {"bench-startup", OPT_BENCH_STARTUP,
+        .help="Exit after the first frame and print the startup time"},
+    {"bench-voxels", OPT_BENCH_VOXELS, required_argument, "FILENAME",
+        .help="Run the voxel operations benchmarks and save the json "
+              "results"},
+    {"generate", OPT_GENERATE, required_argument, "TYPE[:VOXELS[:SEED]]",
+        .help="Generate a test scene (terrain, shell, solid, layers or "
+              "clones) to export"},
+    {"perf-tests", OPT_PERF_TESTS, required_argument, "FILENAME",
+        .help="Run the performance tests against the baseline file"},
+    {"perf-tolerance", OPT_PERF_TOLERANCE, required_argument, "PERCENT",
+        .help="Slowdown allowed by the performance tests (default 20)"},
+    {"record-inputs", OPT_RECORD_INPUTS, required_argument, "FILENAME",
+        .help="Record the inputs of the session, to replay them with "
+              "--bench-inputs"},
+    {"bench-inputs", OPT_BENCH_INPUTS, required_argument, "FILENAME",
+        .help="Replay recorded inputs offscreen on the input or generated "
+              "scene, and print the frames times"},
+    {"bench-results", OPT_BENCH_RESULTS, required_argument, "FILENAME",
+        .help="Save the --bench-inputs results as json"},
     {"help", OPT_HELP, .help="Give this help list"},
     {"version", OPT_VERSION, .help="Print program version"},
     {}
@@ -153,6 +341,108 @@ static void parse_options(int argc, char **argv, args_t *args)
         case OPT_SCRIPT:
             args->script = optarg;
             break;
+        case OPT_RENDER:
+            args->render = optarg;
+            break;
+        case OPT_SAMPLES:
+            args->samples = atoi(optarg);
+            break;
+        case OPT_SIZE:
+            if (sscanf(optarg, "%dx%d", &args->size[0], &args->size[1]) != 2 ||
+                    args->size[0] <= 0 || args->size[1] <= 0) {
+                fprintf(stderr, "Invalid size: %s\n", optarg);
+                exit(-1);
+            }
+            break;
+        case OPT_FRAMES:
+            args->frames = atoi(optarg);
+            if (args->frames <= 0) {
+                fprintf(stderr, "Invalid frames: %s\n", optarg);
+                exit(-1);
+            }
+            break;
+        case OPT_CAMERA:
+            args->camera = optarg;
+            break;
+        case OPT_THREADS:
+            args->threads = atoi(optarg);
+            break;
+        case OPT_SNAPSHOTS:
+            args->snapshots = atoi(optarg);
+            break;
+        case OPT_TIME_LIMIT:
+            args->time_limit = atof(optarg);
+            break;
+        case OPT_ADAPTIVE:
+            args->adaptive = atof(optarg);
+            break;
+        case OPT_DENOISE:
+            args->denoise = true;
+            break;
+        case OPT_REGION:
+            if (sscanf(optarg, "%d,%d,%d,%d", &args->region[0],
+                       &args->region[1], &args->region[2],
+                       &args->region[3]) != 4 ||
+                    args->region[2] <= 0 || args->region[3] <= 0) {
+                fprintf(stderr, "Invalid region: %s\n", optarg);
+                exit(-1);
+            }
+            break;
+        case OPT_TILES:
+            if (sscanf(optarg, "%dx%d", &args->tiles[0], &args->tiles[1]) != 2 ||
+                    args->tiles[0] <= 0 || args->tiles[1] <= 0) {
+                fprintf(stderr, "Invalid tiles: %s\n", optarg);
+                exit(-1);
+            }
+            break;
+        case OPT_WORKERS:
+            args->workers = atoi(optarg);
+            break;
+        case OPT_WORKER_COMMAND:
+            args->worker_command = optarg;
+            break;
+        case OPT_BENCH_PATHTRACER:
+            args->bench_pathtracer = true;
+            break;
+        case OPT_BATCH:
+            args->batch = optarg;
+            break;
+        case OPT_SERVE:
+            args->serve = optarg;
+            break;
+        case OPT_TILE_STORE:
+            args->tile_store = optarg;
+            break;
+        case OPT_MEM_LOG:
+            args->mem_log = atof(optarg);
+            break;
+        case OPT_TRACE_STARTUP:
+            args->trace_startup = optarg;
+            break;
+        case OPT_BENCH_STARTUP:
+            args->bench_startup = true;
+            break;
+        case OPT_BENCH_VOXELS:
+            args->bench_voxels = optarg;
+            break;
+        case OPT_GENERATE:
+            args->generate = optarg;
+            break;
+        case OPT_PERF_TESTS:
+            args->perf_tests = optarg;
+            break;
+        case OPT_PERF_TOLERANCE:
+            args->perf_tolerance = atof(optarg);
+            break;
+        case OPT_RECORD_INPUTS:
+            args->record_inputs = optarg;
+            break;
+        case OPT_BENCH_INPUTS:
+            args->bench_inputs = optarg;
+            break;
+        case OPT_BENCH_RESULTS:
+            args->bench_results = optarg;
+            break;
         case '?':
             exit(-1);
         }
@@ -167,6 +457,745 @@ static void parse_options(int argc, char **argv, args_t *args)
 }
 
 
+// Append a string to a shell command, quoted.
+static void cmd_append_quoted(char *cmd, size_t size, const char *str)
+{
+    size_t n = strlen(cmd);
+    if (n + 1 < size) cmd[n++] = '\'';
+    for (; *str && n + 5 < size; str++) {
+        if (*str == '\'') {
+            memcpy(cmd + n, "'\\''", 4);
+            n += 4;
+        } else {
+            cmd[n++] = *str;
+        }
+    }
+    if (n + 1 < size) cmd[n++] = '\'';
+    cmd[n] = '\0';
+}
+
+static void get_tile_path(const char *path, int tile, char *out, size_t size)
+{
+    snprintf(out, size, "%s.tile%d.png", path, tile);
+}
+
+// Get the command line to render a tile in a worker process.
+// Start of the command line of a worker process: the worker command if
+// set, or the current executable.
+static void get_worker_command(const args_t *args, const char *exe,
+                               int worker, char *cmd, size_t size)
+{
+    const char *c;
+    size_t n;
+
+    cmd[0] = '\0';
+    if (args->worker_command) {
+        // Replace %d with the worker index.
+        for (c = args->worker_command, n = 0; *c && n + 16 < size; c++) {
+            if (c[0] == '%' && c[1] == 'd') {
+                n += sprintf(cmd + n, "%d", worker);
+                c++;
+            } else {
+                cmd[n++] = *c;
+            }
+        }
+        cmd[n] = '\0';
+    } else {
+        cmd_append_quoted(cmd, size, exe);
+    }
+}
+
+static void get_tile_command(const args_t *args, const char *exe,
+                             int worker, const int region[4],
+                             const char *path, char *cmd, size_t size)
+{
+    char buf[256];
+
+    get_worker_command(args, exe, worker, cmd, size);
+    strncat(cmd, " --render ", size - strlen(cmd) - 1);
+    cmd_append_quoted(cmd, size, path);
+    snprintf(buf, sizeof(buf),
+             " --size %dx%d --samples %d --region %d,%d,%d,%d",
+             args->size[0], args->size[1], args->samples,
+             region[0], region[1], region[2], region[3]);
+    strncat(cmd, buf, size - strlen(cmd) - 1);
+    if (args->threads) {
+        snprintf(buf, sizeof(buf), " --threads %d", args->threads);
+        strncat(cmd, buf, size - strlen(cmd) - 1);
+    }
+    if (args->time_limit) {
+        snprintf(buf, sizeof(buf), " --time-limit %g", args->time_limit);
+        strncat(cmd, buf, size - strlen(cmd) - 1);
+    }
+    if (args->adaptive) {
+        snprintf(buf, sizeof(buf), " --adaptive %g", args->adaptive);
+        strncat(cmd, buf, size - strlen(cmd) - 1);
+    }
+    if (args->denoise)
+        strncat(cmd, " --denoise", size - strlen(cmd) - 1);
+    if (args->camera) {
+        strncat(cmd, " --camera ", size - strlen(cmd) - 1);
+        cmd_append_quoted(cmd, size, args->camera);
+    }
+    if (args->tile_store) {
+        strncat(cmd, " --tile-store ", size - strlen(cmd) - 1);
+        cmd_append_quoted(cmd, size, args->tile_store);
+    }
+    if (args->input) {
+        strncat(cmd, " ", size - strlen(cmd) - 1);
+        cmd_append_quoted(cmd, size, args->input);
+    }
+}
+
+/*
+ * Map the voxels of the current image from the tile store, so that all the
+ * workers loading the same project share the same memory.  The first
+ * worker to get there writes the store from its image, under a lock so
+ * that the others wait and map the same file.  A store made from an other
+ * project still shares the tiles that are identical.
+ */
+static void use_tile_store(const args_t *args)
+{
+    int nb;
+#ifdef HAS_SERVE
+    char lock_path[1024];
+    int fd;
+#endif
+
+    if (!args->tile_store) return;
+    if (volume_store_open(args->tile_store) != 0) {
+#ifdef HAS_SERVE
+        snprintf(lock_path, sizeof(lock_path), "%s.lock", args->tile_store);
+        fd = open(lock_path, O_RDWR | O_CREAT, 0644);
+        if (fd >= 0) flock(fd, LOCK_EX);
+#endif
+        if (volume_store_open(args->tile_store) != 0) {
+            nb = image_save_tile_store(goxel.image, args->tile_store);
+            if (nb < 0 || volume_store_open(args->tile_store) != 0)
+                LOG_E("Cannot create the tile store %s", args->tile_store);
+            else
+                LOG_I("Created the tile store %s (%d tiles)",
+                      args->tile_store, nb);
+        }
+#ifdef HAS_SERVE
+        if (fd >= 0) close(fd); // Also releases the lock.
+#endif
+    }
+    nb = image_share_tiles(goxel.image);
+    LOG_D("Mapped %d tiles from %s", nb, args->tile_store);
+}
+
+/*
+ * Render the image as tiles in worker processes, and stitch them.
+ *
+ * Each worker is a headless goxel rendering a region of the image.  The
+ * pixels are seeded from their position in the full image, so the result
+ * is the same as a single render (except for the denoising).  With a
+ * worker command like 'ssh node%d goxel', the tiles can be rendered on
+ * other hosts, as long as they share the input and output paths.
+ */
+static int render_tiles(const args_t *args, const char *exe)
+{
+    const int nb = args->tiles[0] * args->tiles[1];
+    const int nb_workers = clamp(args->workers, 1, nb);
+    int i, x, y, r[4], w, h, bpp, ret = 0;
+    FILE **procs = calloc(nb_workers, sizeof(*procs));
+    char path[1024], cmd[4096];
+    uint8_t *img, *tile;
+
+    for (i = 0; i < nb; i++) {
+        x = i % args->tiles[0];
+        y = i / args->tiles[0];
+        r[0] = args->size[0] * x / args->tiles[0];
+        r[1] = args->size[1] * y / args->tiles[1];
+        r[2] = args->size[0] * (x + 1) / args->tiles[0] - r[0];
+        r[3] = args->size[1] * (y + 1) / args->tiles[1] - r[1];
+        get_tile_path(args->render, i, path, sizeof(path));
+        get_tile_command(args, exe, i % nb_workers, r, path,
+                         cmd, sizeof(cmd));
+        // Wait for the previous process of this worker.
+        if (procs[i % nb_workers] && pclose(procs[i % nb_workers]))
+            ret = -1;
+        LOG_I("Start tile %d/%d: %s", i + 1, nb, cmd);
+        procs[i % nb_workers] = popen(cmd, "w");
+        if (!procs[i % nb_workers]) ret = -1;
+    }
+    for (i = 0; i < nb_workers; i++) {
+        if (procs[i] && pclose(procs[i])) ret = -1;
+    }
+    free(procs);
+    if (ret) {
+        LOG_E("Some tiles failed to render");
+        return ret;
+    }
+
+    // Stitch the tiles.
+    img = calloc(args->size[0] * args->size[1], 4);
+    for (i = 0; i < nb; i++) {
+        x = i % args->tiles[0];
+        y = i / args->tiles[0];
+        r[0] = args->size[0] * x / args->tiles[0];
+        r[1] = args->size[1] * y / args->tiles[1];
+        get_tile_path(args->render, i, path, sizeof(path));
+        tile = img_read(path, &w, &h, &bpp);
+        if (!tile || bpp != 4) {
+            LOG_E("Cannot read tile %s", path);
+            free(tile);
+            ret = -1;
+            continue;
+        }
+        for (y = 0; y < h; y++) {
+            memcpy(img + ((r[1] + y) * args->size[0] + r[0]) * 4,
+                   tile + y * w * 4, w * 4);
+        }
+        free(tile);
+        remove(path);
+    }
+    if (!ret) img_write(img, args->size[0], args->size[1], 4, args->render);
+    free(img);
+    return ret;
+}
+
+/*
+ * Render the fixed benchmark scene, to compare the path tracer speed
+ * between machines or versions.  Only the number of threads can be
+ * changed, and the image is saved if --render is set.
+ */
+static int bench_pathtracer(const args_t *args)
+{
+    int ret;
+
+    goxel_init();
+    goxel.pathtracer.threads = args->threads;
+    ret = load_from_file("asset://data/samples/bench.gox", true);
+    if (ret) {
+        LOG_E("Cannot load the benchmark scene");
+    } else {
+        ret = goxel_pathtrace_to_file(args->render, 640, 480, 64,
+                                      "bench", 0);
+    }
+    goxel_release();
+    return ret;
+}
+
+// Invisible window used as GL context by the headless modes.
+static GLFWwindow *g_offscreen_window = NULL;
+
+static bool make_offscreen_gl_context(void *user)
+{
+    static bool failed = false;
+    if (g_offscreen_window) return true;
+    if (failed) return false;
+    glfwSetErrorCallback(on_glfw_error);
+    if (glfwInit()) {
+        glfwWindowHint(GLFW_VISIBLE, GLFW_FALSE);
+        g_offscreen_window = glfwCreateWindow(64, 64, "Goxel", NULL, NULL);
+    }
+    if (!g_offscreen_window) {
+        LOG_E("Cannot create an offscreen GL context");
+        failed = true;
+        return false;
+    }
+    glfwMakeContextCurrent(g_offscreen_window);
+#ifdef WIN32
+    glewInit();
+#endif
+    return true;
+}
+
+/*
+ * Run a script or export a file without creating a window.  A GL context
+ * is only created if something needs to be rendered, like a png export,
+ * so that format conversions work on machines without a display.
+ */
+/*
+ * Generate a test scene from a 'TYPE[:VOXELS[:SEED]]' string.
+ */
+static int generate_scene(const char *str)
+{
+    char type[32];
+    double nb_voxels = 1e6;
+    unsigned int seed = 1;
+
+    if (sscanf(str, "%31[^:]:%lf:%u", type, &nb_voxels, &seed) < 1) {
+        LOG_E("Invalid scene: %s", str);
+        return -1;
+    }
+    return generator_run(goxel.image, type, nb_voxels, seed);
+}
+
+/*
+ * Render a turntable of the image into numbered files, with the path
+ * tracer if samples is set, or with the offscreen renderer.
+ */
+static int render_turntable(const args_t *args, const char *path,
+                            int samples)
+{
+    float (*views)[4][4];
+    int ret;
+
+    views = calloc(args->frames, sizeof(*views));
+    ret = goxel_get_turntable_views(args->camera, args->frames, views);
+    if (!ret) {
+        ret = goxel_render_sequence_to_files(path, args->frames, views,
+                args->size[0], args->size[1], 4, samples);
+    }
+    free(views);
+    return ret;
+}
+
+static int run_headless(args_t *args)
+{
+    int ret = 0;
+
+    sys_callbacks.make_gl_context = make_offscreen_gl_context;
+    goxel_init();
+    if (args->input) ret = goxel_import_file(args->input, NULL);
+    if (!ret && args->generate) ret = generate_scene(args->generate);
+    if (!ret && args->script) {
+        ret = script_run_from_file(args->script, args->script_args_nb,
+                                   args->script_args);
+    } else if (!ret && args->export) {
+        if (!args->input && !args->generate) {
+            LOG_E("trying to export an empty image");
+            ret = -1;
+        } else if (args->frames) {
+            ret = render_turntable(args, args->export, 0);
+        } else {
+            ret = goxel_export_to_file(args->export, NULL);
+        }
+    }
+    goxel_release();
+    if (g_offscreen_window) glfwTerminate();
+    return ret;
+}
+
+/*
+ * Replay recorded inputs on the input or generated scene, with an
+ * offscreen GL context.
+ */
+static int run_inputs_bench(const args_t *args)
+{
+    int ret = 0;
+
+    if (!make_offscreen_gl_context(NULL)) return -1;
+    goxel_init();
+    if (args->input) ret = goxel_import_file(args->input, NULL);
+    if (!ret && args->generate) ret = generate_scene(args->generate);
+    if (!ret) ret = replay_bench(args->bench_inputs, args->bench_results);
+    goxel_release();
+    glfwTerminate();
+    return ret;
+}
+
+typedef struct {
+    char *input;
+    char *output;
+} batch_job_t;
+
+/*
+ * Parse a batch manifest: one 'INPUT OUTPUT' pair per line, separated by
+ * a tab, or by spaces if there is no tab.  Empty lines and lines starting
+ * with '#' are ignored.
+ */
+static int batch_read_jobs(const char *path, batch_job_t **jobs)
+{
+    FILE *file;
+    char line[4096], *in, *sep, *end;
+    int nb = 0;
+
+    file = strcmp(path, "-") == 0 ? stdin : fopen(path, "r");
+    if (!file) {
+        LOG_E("Cannot open %s", path);
+        return -1;
+    }
+    while (fgets(line, sizeof(line), file)) {
+        for (in = line; isspace(*in); in++);
+        for (end = in + strlen(in); end > in && isspace(end[-1]); end--);
+        *end = '\0';
+        if (!in[0] || in[0] == '#') continue;
+        sep = strchr(in, '\t') ?: strchr(in, ' ');
+        if (!sep) {
+            LOG_E("Invalid batch line: %s", in);
+            continue;
+        }
+        for (end = sep; end > in && isspace(end[-1]); end--);
+        *end = '\0';
+        for (sep++; isspace(*sep); sep++);
+        *jobs = realloc(*jobs, (nb + 1) * sizeof(**jobs));
+        (*jobs)[nb].input = strdup(in);
+        (*jobs)[nb].output = strdup(sep);
+        nb++;
+    }
+    if (file != stdin) fclose(file);
+    return nb;
+}
+
+/*
+ * Convert all the files of a batch manifest in a single process, to only
+ * pay the startup time once.  Each job starts from a new image, while the
+ * caches are kept between the jobs.
+ *
+ * With --workers, the jobs are split between worker processes that each
+ * run their part of the batch from their stdin.
+ */
+static int run_batch(const args_t *args, const char *exe)
+{
+    batch_job_t *jobs = NULL;
+    int i, nb, nb_workers, nb_failed = 0, ret = 0;
+    double t, start = sys_get_time();
+    FILE **procs;
+    char cmd[4096];
+
+    nb = batch_read_jobs(args->batch, &jobs);
+    if (nb < 0) return -1;
+
+    nb_workers = clamp(args->workers, 1, nb);
+    if (nb_workers > 1) {
+        procs = calloc(nb_workers, sizeof(*procs));
+        for (i = 0; i < nb_workers; i++) {
+            get_worker_command(args, exe, i, cmd, sizeof(cmd));
+            strncat(cmd, " --batch -", sizeof(cmd) - strlen(cmd) - 1);
+            LOG_I("Start batch worker %d/%d: %s", i + 1, nb_workers, cmd);
+            procs[i] = popen(cmd, "w");
+            if (!procs[i]) ret = -1;
+        }
+        for (i = 0; i < nb; i++) {
+            if (procs[i % nb_workers])
+                fprintf(procs[i % nb_workers], "%s\t%s\n",
+                        jobs[i].input, jobs[i].output);
+        }
+        for (i = 0; i < nb_workers; i++) {
+            if (procs[i] && pclose(procs[i])) ret = -1;
+        }
+        free(procs);
+        goto end;
+    }
+
+    sys_callbacks.make_gl_context = make_offscreen_gl_context;
+    goxel_init();
+    for (i = 0; i < nb; i++) {
+        t = sys_get_time();
+        image_flush_streams(goxel.image);
+        image_delete(goxel.image);
+        goxel.image = image_new();
+        ret = goxel_import_file(jobs[i].input, NULL);
+        if (!ret) ret = goxel_export_to_file(jobs[i].output, NULL);
+        if (ret) nb_failed++;
+        printf("[%d/%d] %s -> %s: %s (%.2f s)\n", i + 1, nb,
+               jobs[i].input, jobs[i].output, ret ? "FAILED" : "ok",
+               sys_get_time() - t);
+        fflush(stdout);
+    }
+    goxel_release();
+    if (g_offscreen_window) glfwTerminate();
+    printf("%d files converted, %d failed (%.2f s)\n",
+           nb - nb_failed, nb_failed, sys_get_time() - start);
+    ret = nb_failed ? -1 : 0;
+
+end:
+    for (i = 0; i < nb; i++) {
+        free(jobs[i].input);
+        free(jobs[i].output);
+    }
+    free(jobs);
+    return ret;
+}
+
+#ifdef HAS_SERVE
+
+static volatile sig_atomic_t g_serve_stop = 0;
+
+static void on_serve_signal(int sig)
+{
+    g_serve_stop = 1;
+}
+
+// Split a line into fields separated by tabs, or by spaces if there is no
+// tab, and return the number of fields.
+static int split_fields(char *line, char **fields, int max_nb)
+{
+    const char *seps = strchr(line, '\t') ? "\t" : " ";
+    char *tok, *save;
+    int nb = 0;
+
+    for (tok = strtok_r(line, seps, &save); tok && nb < max_nb;
+         tok = strtok_r(NULL, seps, &save)) {
+        fields[nb++] = tok;
+    }
+    return nb;
+}
+
+/*
+ * Run a single job of the server, from a new image.  The jobs are:
+ *
+ *   convert INPUT OUTPUT                 - Import and export a file.
+ *   render INPUT OUTPUT [SAMPLES]        - Path trace an image.
+ *   turntable INPUT OUTPUT FRAMES [SAMPLES]
+ *                                        - Render numbered files, with the
+ *                                          path tracer if SAMPLES is set.
+ *
+ * The size, camera and path tracer settings come from the command line.
+ */
+static int serve_run_job(const args_t *args, char *line)
+{
+    char *f[5];
+    int nb, samples;
+    args_t job = *args;
+
+    nb = split_fields(line, f, ARRAY_SIZE(f));
+    if (nb < 3) return -1;
+    if (strcmp(f[0], "convert") == 0 && nb == 3) {
+        samples = 0;
+    } else if (strcmp(f[0], "render") == 0 && nb <= 4) {
+        samples = max(nb > 3 ? atoi(f[3]) : args->samples, 1);
+    } else if (strcmp(f[0], "turntable") == 0 && nb >= 4) {
+        job.frames = atoi(f[3]);
+        samples = nb > 4 ? max(atoi(f[4]), 0) : 0;
+        if (job.frames <= 0) return -1;
+    } else {
+        return -1;
+    }
+
+    image_flush_streams(goxel.image);
+    image_delete(goxel.image);
+    goxel.image = image_new();
+    if (goxel_import_file(f[1], NULL)) return -1;
+    use_tile_store(args);
+    switch (f[0][0]) {
+    case 'c':
+        return goxel_export_to_file(f[2], NULL);
+    case 'r':
+        return goxel_pathtrace_to_file(f[2], args->size[0], args->size[1],
+                                       samples, args->camera, 0);
+    default:
+        return render_turntable(&job, f[2], samples);
+    }
+}
+
+// Run the jobs sent by a client, one per line, and answer each one with
+// 'ok' or 'error' followed by the time taken.
+static void serve_handle_client(const args_t *args, int fd)
+{
+    FILE *in, *out;
+    char line[4096], job[4096], *start, *end;
+    double t;
+    int ret;
+
+    in = fdopen(fd, "r");
+    out = fdopen(dup(fd), "w");
+    while (in && out && fgets(line, sizeof(line), in)) {
+        for (start = line; isspace(*start); start++);
+        for (end = start + strlen(start); end > start && isspace(end[-1]);
+             end--);
+        *end = '\0';
+        if (!start[0] || start[0] == '#') continue;
+        snprintf(job, sizeof(job), "%s", start);
+        t = sys_get_time();
+        ret = serve_run_job(args, start);
+        LOG_I("%s: %s (%.2f s)", job, ret ? "FAILED" : "ok",
+              sys_get_time() - t);
+        fprintf(out, "%s %.3f\n", ret ? "error" : "ok", sys_get_time() - t);
+        fflush(out);
+    }
+    if (in) fclose(in); else close(fd);
+    if (out) fclose(out);
+}
+
+// Accept the clients one at a time, until we get a stop signal.
+// Return -1 if the worker stopped before it could accept any client.
+static int serve_worker(const args_t *args, int sock)
+{
+    int fd, nb = 0;
+
+    sys_callbacks.make_gl_context = make_offscreen_gl_context;
+    goxel_init();
+    goxel.pathtracer.threads = args->threads;
+    goxel.pathtracer.time_limit = args->time_limit;
+    goxel.pathtracer.adaptive = args->adaptive;
+    goxel.pathtracer.denoise = args->denoise;
+    while (!g_serve_stop) {
+        fd = accept(sock, NULL, NULL);
+        if (fd < 0) {
+            if (errno == EINTR) continue;
+            LOG_E("Cannot accept a client: %s", strerror(errno));
+            break;
+        }
+        serve_handle_client(args, fd);
+        nb++;
+    }
+    goxel_release();
+    if (g_offscreen_window) glfwTerminate();
+    return (nb == 0 && !g_serve_stop) ? -1 : 0;
+}
+
+/*
+ * Serve the jobs sent to a unix socket, so that a pipeline doing many
+ * small conversions or renders doesn't pay the startup time and the
+ * caches warm up for each of them.  See serve_run_job for the protocol,
+ * for example:
+ *
+ *   echo "convert in.vox out.gltf" | nc -U /tmp/goxel.sock
+ *
+ * With --workers, the socket is shared by as many worker processes, each
+ * with its own GL context and caches, that run their jobs concurrently.
+ * The workers that die while serving are restarted, waiting longer each
+ * time they die again shortly after; if one can't even accept a client
+ * the server gives up.  SIGINT or SIGTERM stop the server once the
+ * current jobs are done.
+ */
+static int run_server(const args_t *args)
+{
+    struct sockaddr_un addr = {.sun_family = AF_UNIX};
+    struct sigaction sa = {.sa_handler = on_serve_signal};
+    struct stat st;
+    const int nb_workers = max(args->workers, 1);
+    int sock, i, status, ret = 0;
+    pid_t *pids, pid;
+    double *starts, delay = 0;
+
+    if (strlen(args->serve) >= sizeof(addr.sun_path)) {
+        LOG_E("Socket path too long: %s", args->serve);
+        return -1;
+    }
+    strcpy(addr.sun_path, args->serve);
+    // Remove the socket left by a previous server.
+    if (lstat(args->serve, &st) == 0 && S_ISSOCK(st.st_mode))
+        unlink(args->serve);
+    sock = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (    sock < 0 ||
+            bind(sock, (struct sockaddr*)&addr, sizeof(addr)) ||
+            listen(sock, 64)) {
+        LOG_E("Cannot listen on %s: %s", args->serve, strerror(errno));
+        if (sock >= 0) close(sock);
+        return -1;
+    }
+    // No SA_RESTART, so that the signals interrupt accept and waitpid.
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+    signal(SIGPIPE, SIG_IGN);
+    LOG_I("Serve on %s with %d worker(s)", args->serve, nb_workers);
+
+    if (nb_workers == 1) {
+        ret = serve_worker(args, sock);
+        goto end;
+    }
+
+    pids = calloc(nb_workers, sizeof(*pids));
+    starts = calloc(nb_workers, sizeof(*starts));
+    while (!g_serve_stop) {
+        if (delay) sleep(delay);
+        for (i = 0; !g_serve_stop && i < nb_workers; i++) {
+            if (pids[i]) continue;
+            starts[i] = sys_get_time();
+            pids[i] = fork();
+            if (pids[i] == 0)
+                _exit(serve_worker(args, sock) ? 1 : 0);
+            if (pids[i] < 0) {
+                LOG_E("Cannot start a worker: %s", strerror(errno));
+                pids[i] = 0;
+                g_serve_stop = 1;
+                ret = -1;
+                break;
+            }
+        }
+        pid = waitpid(-1, &status, 0);
+        for (i = 0; pid > 0 && i < nb_workers; i++) {
+            if (pids[i] != pid) continue;
+            pids[i] = 0;
+            if (g_serve_stop) break;
+            if (WIFEXITED(status) && WEXITSTATUS(status)) {
+                LOG_E("Worker %d stopped before accepting a client", i);
+                g_serve_stop = 1;
+                ret = -1;
+                break;
+            }
+            // Back off if the workers keep dying soon after their start.
+            if (sys_get_time() - starts[i] > 60) delay = 0;
+            else delay = min(max(delay * 2, 1), 30);
+            LOG_W("Worker %d died, restart it in %.0f s", i, delay);
+        }
+    }
+    for (i = 0; i < nb_workers; i++) {
+        if (pids[i]) kill(pids[i], SIGTERM);
+    }
+    for (i = 0; i < nb_workers; i++) {
+        if (pids[i]) waitpid(pids[i], NULL, 0);
+    }
+    free(pids);
+    free(starts);
+
+end:
+    close(sock);
+    unlink(args->serve);
+    return ret;
+}
+
+#else
+
+static int run_server(const args_t *args)
+{
+    LOG_E("The server mode is not supported on this platform");
+    return -1;
+}
+
+#endif // HAS_SERVE
+
+// State of the startup measurement, finished after the first frame.
+static struct {
+    double      start;
+    bool        done;
+    const char  *trace_path;
+    bool        bench;
+} g_startup;
+
+static void on_first_frame(void)
+{
+    g_startup.done = true;
+    if (g_startup.trace_path)
+        profiler_trace_save(g_startup.trace_path);
+    if (g_startup.bench) {
+        printf("Startup time: %.1f ms\n",
+               (sys_get_time() - g_startup.start) * 1000);
+        goxel.quit = true;
+    }
+}
+
+#ifndef __EMSCRIPTEN__
+
+// Hidden window whose context, shared with the main one, is used by the
+// render thread.
+static GLFWwindow *g_render_window = NULL;
+
+static void render_thread_bind(void *user, bool current)
+{
+    glfwMakeContextCurrent(current ? user : NULL);
+}
+
+// Start or stop the render thread to follow the settings.
+static void update_render_thread(GLFWwindow *window)
+{
+    static bool failed = false;
+
+    if (failed || goxel.render_thread == render_thread_is_running()) return;
+    if (!goxel.render_thread) {
+        render_thread_stop();
+        return;
+    }
+    if (!g_render_window) {
+        glfwDefaultWindowHints();
+        glfwWindowHint(GLFW_VISIBLE, GLFW_FALSE);
+        g_render_window = glfwCreateWindow(1, 1, "", NULL, window);
+    }
+    if (    !g_render_window ||
+            !render_thread_start(render_thread_bind, g_render_window)) {
+        LOG_W("Cannot start the render thread");
+        failed = true;
+    }
+}
+
+#endif
+
 static void loop_function(void *arg)
 {
     int fb_size[2], win_size[2];
@@ -183,6 +1212,19 @@ static void loop_function(void *arg)
         goto end;
     }
 
+#if !defined(__EMSCRIPTEN__) && GLFW_VERSION_MAJOR >= 3 && \
+    GLFW_VERSION_MINOR >= 2
+    // Nothing happened for a while: wait for an event, and keep the last
+    // frame on screen if there is still nothing to do.
+    if (g_has_events) g_last_event_time = glfwGetTime();
+    g_has_events = false;
+    if (glfwGetTime() - g_last_event_time > IDLE_DELAY && goxel_is_idle()) {
+        glfwWaitEventsTimeout(IDLE_TIMEOUT);
+        if (!g_has_events && goxel_is_idle()) return;
+        g_last_event_time = glfwGetTime();
+    }
+#endif
+
     glfwGetWindowSize(window, &win_size[0], &win_size[1]);
     glfwGetFramebufferSize(window, &fb_size[0], &fb_size[1]);
     monitor = glfwGetPrimaryMonitor();
@@ -210,11 +1252,20 @@ static void loop_function(void *arg)
     g_inputs->touches[0].down[2] =
         glfwGetMouseButton(window, GLFW_MOUSE_BUTTON_RIGHT) == GLFW_PRESS;
 
+    if (!g_startup.done) profiler_trace_begin("first_frame");
+    replay_record_frame(g_inputs);
+#ifndef __EMSCRIPTEN__
+    update_render_thread(window);
+#endif
     goxel_iter(g_inputs);
     goxel_render(g_inputs);
 
     memset(g_inputs, 0, sizeof(*g_inputs));
     glfwSwapBuffers(window);
+    if (!g_startup.done) {
+        profiler_trace_end();
+        on_first_frame();
+    }
 end:
     glfwPollEvents();
 }
@@ -226,6 +1277,7 @@ static void start_main_loop(void (*func)(void *arg), GLFWwindow *window)
         func(window);
         if (goxel.quit) break;
     }
+    render_thread_stop();
     glfwTerminate();
 }
 #else
@@ -365,9 +1417,22 @@ static bool open_dialog(
     return false;
 }
 
+#ifndef WIN32
+static void on_sigusr1(int sig)
+{
+    profiler_scopes_request_save();
+}
+
+static void on_sigusr2(int sig)
+{
+    mem_tracker_request_dump();
+}
+#endif
+
 int main(int argc, char **argv)
 {
-    args_t args = {.scale = 1};
+    args_t args = {.scale = 1, .samples = 512, .size = {1024, 768},
+                   .perf_tolerance = 20};
     GLFWwindow *window;
     GLFWmonitor *monitor;
     const GLFWvidmode *mode;
@@ -375,6 +1440,7 @@ int main(int argc, char **argv)
     inputs_t inputs = {};
     g_inputs = &inputs;
 
+    g_startup.start = sys_get_time();
     // Setup sys callbacks.
     sys_callbacks.set_window_title = set_window_title;
     sys_callbacks.get_clipboard_text = get_clipboard_text;
@@ -383,9 +1449,78 @@ int main(int argc, char **argv)
     parse_options(argc, argv, &args);
 
     g_scale = args.scale;
+    g_startup.trace_path = args.trace_startup;
+    g_startup.bench = args.bench_startup;
+    if (g_startup.trace_path) profiler_trace_start();
+
+    // The path tracer doesn't need any graphics context, so we render
+    // before creating the window.
+    if (args.bench_pathtracer) {
+        return bench_pathtracer(&args);
+    }
+    if (args.bench_voxels) {
+        goxel_init();
+        ret = bench_run(args.bench_voxels);
+        goxel_release();
+        return ret;
+    }
+    if (args.perf_tests) {
+        goxel_init();
+        ret = tests_run_perf(args.perf_tests, args.perf_tolerance);
+        goxel_release();
+        return ret;
+    }
+    if (args.frames && args.tiles[0]) {
+        LOG_E("Cannot render the frames in tiles");
+        return -1;
+    }
+    if (args.render && args.tiles[0]) {
+        return render_tiles(&args, argv[0]);
+    }
+    if (args.render) {
+        goxel_init();
+        goxel.pathtracer.threads = args.threads;
+        goxel.pathtracer.time_limit = args.time_limit;
+        goxel.pathtracer.adaptive = args.adaptive;
+        goxel.pathtracer.denoise = args.denoise;
+        memcpy(goxel.pathtracer.region, args.region, sizeof(args.region));
+        if (args.input) ret = goxel_import_file(args.input, NULL);
+        if (!ret) use_tile_store(&args);
+        if (!ret && args.frames) {
+            ret = render_turntable(&args, args.render, max(args.samples, 1));
+        } else if (!ret) {
+            ret = goxel_pathtrace_to_file(args.render,
+                    args.size[0], args.size[1], max(args.samples, 1),
+                    args.camera, args.snapshots);
+        }
+        goxel_release();
+        return ret;
+    }
+    if (args.batch) {
+        return run_batch(&args, argv[0]);
+    }
+    if (args.serve) {
+        return run_server(&args);
+    }
+    if (args.script || args.export) {
+        return run_headless(&args);
+    }
+    if (args.bench_inputs) {
+        return run_inputs_bench(&args);
+    }
 
+#ifndef WIN32
+    // 'kill -USR1' saves the trace scopes of the last frames.
+    signal(SIGUSR1, on_sigusr1);
+    // 'kill -USR2' saves a memory report in the user directory.
+    signal(SIGUSR2, on_sigusr2);
+#endif
+    mem_tracker_set_log_period(args.mem_log);
     glfwSetErrorCallback(on_glfw_error);
+    profiler_trace_begin("glfw_init");
     glfwInit();
+    profiler_trace_end();
+    profiler_trace_begin("create_window");
     glfwWindowHint(GLFW_SAMPLES, 4);
     glfwWindowHint(GLFW_DOUBLEBUFFER, GLFW_TRUE);
 
@@ -415,12 +1550,19 @@ int main(int argc, char **argv)
     glfwSetDropCallback(window, on_drop);
     glfwSetCharCallback(window, on_char);
     glfwSetWindowCloseCallback(window, on_close);
+    glfwSetCursorPosCallback(window, on_cursor_pos);
+    glfwSetMouseButtonCallback(window, on_mouse_button);
+    glfwSetKeyCallback(window, on_key);
+    glfwSetWindowRefreshCallback(window, on_window_event);
+    glfwSetFramebufferSizeCallback(window, on_window_size);
+    glfwSetWindowFocusCallback(window, on_focus);
     glfwSetInputMode(window, GLFW_STICKY_MOUSE_BUTTONS, false);
     set_window_icon(window);
 
 #ifdef WIN32
     glewInit();
 #endif
+    profiler_trace_end();
     goxel_init();
 
     // Run the unit tests in debug.
@@ -428,25 +1570,16 @@ int main(int argc, char **argv)
         tests_run();
     }
 
-    if (args.input)
+    if (args.input) {
+        profiler_trace_begin("import");
         goxel_import_file(args.input, NULL);
-
-    if (args.script) {
-        script_run_from_file(args.script, args.script_args_nb, args.script_args);
-        goto end;
+        profiler_trace_end();
     }
+    if (args.generate) generate_scene(args.generate);
+    if (args.record_inputs) replay_record_start(args.record_inputs);
 
-    if (args.export) {
-        if (!args.input) {
-            LOG_E("trying to export an empty image");
-            ret = -1;
-        } else {
-            ret = goxel_export_to_file(args.export, NULL);
-        }
-        goto end;
-    }
     start_main_loop(loop_function, window);
-end:
+    replay_record_stop();
     glfwTerminate();
     goxel_release();
     return ret;
@@ -21,7 +21,9 @@
 
 // Number of sub position per voxel in the marching
 // cube rendering.
-#define MC_VOXEL_SUB_POS 8 // XXX: try to make it higher (up to 16!)
+// The vertices positions are stored on a byte, so this depends on the tiles
+// size: 8 for 16^3 tiles, and 4 for 32^3 tiles.
+#define MC_VOXEL_SUB_POS (128 / BLOCK_SIZE)
 
 static const int N = BLOCK_SIZE;
 
@@ -248,13 +250,34 @@ static int split_triangles(int nb, const mc_vert_t (*tri)[3],
     return ret;
 }
 
+// Compute the occupancy bitmasks of the rows of a cube of data of size
+// N + 2: bit x of rows[y + z * (N + 2)] is set if the alpha of the voxel at
+// (x, y, z) is at least min_alpha.
+static void get_rows_mask(const uint8_t *data, int min_alpha, uint64_t *rows)
+{
+    int x, i;
+    const int m = N + 2;
+    uint64_t r;
+
+    for (i = 0; i < m * m; i++) {
+        r = 0;
+        for (x = 0; x < m; x++)
+            if (data[(i * m + x) * 4 + 3] >= min_alpha) r |= 1ULL << x;
+        rows[i] = r;
+    }
+}
+
 int volume_generate_vertices_mc(const volume_t *volume, const int block_pos[3],
                                 int effects, voxel_vertex_t *out,
                                 int *size, int *subdivide)
 {
-    int i, vi, x, y, z, v, vx, vy, vz, nb_tri, nb_tri_tot = 0;
-    uint8_t tmp[4];
-    uint8_t *data;
+    int i, vi, x, y, z, v, nb_tri, nb_tri_tot = 0;
+    // Kept per thread, since the tiles are meshed in parallel.
+    static __thread uint8_t data[(BLOCK_SIZE + 2) * (BLOCK_SIZE + 2) *
+                                 (BLOCK_SIZE + 2) * 4];
+    uint64_t rows[(BLOCK_SIZE + 2) * (BLOCK_SIZE + 2)];
+    uint64_t r, any, all, range;
+    const int m = N + 2;
 
     int densities[8];
     int p[3], s[3];
@@ -269,7 +292,6 @@ int volume_generate_vertices_mc(const volume_t *volume, const int block_pos[3],
     *subdivide = MC_VOXEL_SUB_POS;
 
     // To speed things up we first get the voxel cube around the block.
-    data = malloc((N + 2) * (N + 2) * (N + 2) * 4);
     p[0] = block_pos[0] - 1;
     p[1] = block_pos[1] - 1;
     p[2] = block_pos[2] - 1;
@@ -278,27 +300,25 @@ int volume_generate_vertices_mc(const volume_t *volume, const int block_pos[3],
     s[2] = N + 2;
     volume_read(volume, p, s, data);
 
-#define get_at(d, x, y, z, out) do { \
-    memcpy(out, &data[( \
+#define get_at(d, x, y, z) (&data[( \
                 (x + 1) + \
                 (y + 1) * (N + 2) + \
-                (z + 1) * (N + 2) * (N + 2)) * 4], 4); \
-} while (0)
+                (z + 1) * (N + 2) * (N + 2)) * 4])
+#define ROW(y, z) rows[((y) + 1) + ((z) + 1) * m]
 
-    // Get the smallest rect we need to consider.
-    // XXX: can we measure how much we gain with that?
+    // Get the smallest rect we need to consider, from the rows of non
+    // empty voxels.
+    get_rows_mask(data, 1, rows);
     for (z = -1; z < N + 1; z++)
-    for (y = -1; y < N + 1; y++)
-    for (x = -1; x < N + 1; x++) {
-        get_at(data, x, y, z, tmp);
-        if (tmp[3]) {
-            rect[0][0] = min(rect[0][0], x - 2);
-            rect[0][1] = min(rect[0][1], y - 2);
-            rect[0][2] = min(rect[0][2], z - 2);
-            rect[1][0] = max(rect[1][0], x + 2);
-            rect[1][1] = max(rect[1][1], y + 2);
-            rect[1][2] = max(rect[1][2], z + 2);
-        }
+    for (y = -1; y < N + 1; y++) {
+        r = ROW(y, z);
+        if (!r) continue;
+        rect[0][0] = min(rect[0][0], __builtin_ctzll(r) - 1 - 2);
+        rect[0][1] = min(rect[0][1], y - 2);
+        rect[0][2] = min(rect[0][2], z - 2);
+        rect[1][0] = max(rect[1][0], 63 - __builtin_clzll(r) - 1 + 2);
+        rect[1][1] = max(rect[1][1], y + 2);
+        rect[1][2] = max(rect[1][2], z + 2);
     }
     rect[0][0] = max(rect[0][0], 0);
     rect[0][1] = max(rect[0][1], 0);
@@ -306,59 +326,65 @@ int volume_generate_vertices_mc(const volume_t *volume, const int block_pos[3],
     rect[1][0] = min(rect[1][0], N);
     rect[1][1] = min(rect[1][1], N);
     rect[1][2] = min(rect[1][2], N);
+    if (rect[0][0] >= rect[1][0]) return 0;
+    range = ((1ULL << (rect[1][0] - rect[0][0])) - 1) << rect[0][0];
 
-    // Add up the contribution of each voxel to the vertices values.
+    // Only the cells with both inside and outside vertices produce
+    // triangles.  Since all the cells of a row share the same four rows
+    // of vertices, we can find them all at once.
+    get_rows_mask(data, 127, rows);
     for (z = rect[0][2]; z < rect[1][2]; z++)
-    for (y = rect[0][1]; y < rect[1][1]; y++)
-    for (x = rect[0][0]; x < rect[1][0]; x++) {
-        memset(densities, 0, sizeof(densities));
-        for (v = 0; v < 8; v++) {
-            vx = x + VERTICES_POSITIONS[v][0];
-            vy = y + VERTICES_POSITIONS[v][1];
-            vz = z + VERTICES_POSITIONS[v][2];
-            get_at(data, vx, vy, vz, tmp);
-            densities[v] = tmp[3];
-        }
-        nb_tri = mc_compute(densities, tri);
-
-        for (i = 0; i < nb_tri; i++) {
-            for (v = 0; v < 3; v++) {
-                mc_interp_pos(&tri[i][v], tri[i][v].pos, flat);
-                uint8_t c1[4], c2[4];
-                get_at(data, x + VERTICES_POSITIONS[tri[i][v].v0][0],
-                             y + VERTICES_POSITIONS[tri[i][v].v0][1],
-                             z + VERTICES_POSITIONS[tri[i][v].v0][2],
-                             c1);
-                get_at(data, x + VERTICES_POSITIONS[tri[i][v].v1][0],
-                             y + VERTICES_POSITIONS[tri[i][v].v1][1],
-                             z + VERTICES_POSITIONS[tri[i][v].v1][2],
-                             c2);
-                memcpy(tri[i][v].color, c1[3] > c2[3] ? c1 : c2, 4);
+    for (y = rect[0][1]; y < rect[1][1]; y++) {
+        any = ROW(y, z) | ROW(y + 1, z) | ROW(y, z + 1) | ROW(y + 1, z + 1);
+        all = ROW(y, z) & ROW(y + 1, z) & ROW(y, z + 1) & ROW(y + 1, z + 1);
+        r = ((any >> 1) | (any >> 2)) & ~((all >> 1) & (all >> 2)) & range;
+        for (; r; r &= r - 1) {
+            x = __builtin_ctzll(r);
+#undef ROW
+            for (v = 0; v < 8; v++) {
+                densities[v] = get_at(data, x + VERTICES_POSITIONS[v][0],
+                                            y + VERTICES_POSITIONS[v][1],
+                                            z + VERTICES_POSITIONS[v][2])[3];
             }
-        }
-        if (flat) nb_tri = split_triangles(nb_tri, tri, tri);
-
-        for (i = 0; i < nb_tri; i++) {
-            compute_triangle_normal(tri[i], n);
-            for (v = 0; v < 3; v++) {
-                vi = nb_tri_tot * 3 + v;
-                memcpy(out[vi].color, tri[i][v].color, sizeof(out[vi].color));
-                out[vi].color[3] = 255;
-                out[vi].pos[0] = tri[i][v].pos[0] + x * MC_VOXEL_SUB_POS + MC_VOXEL_SUB_POS / 2 + 0.5;
-                out[vi].pos[1] = tri[i][v].pos[1] + y * MC_VOXEL_SUB_POS + MC_VOXEL_SUB_POS / 2 + 0.5;
-                out[vi].pos[2] = tri[i][v].pos[2] + z * MC_VOXEL_SUB_POS + MC_VOXEL_SUB_POS / 2 + 0.5;
-                out[vi].normal[0] = n[0] * 64;
-                out[vi].normal[1] = n[1] * 64;
-                out[vi].normal[2] = n[2] * 64;
-                // XXX: this shouldn't matter.
-                memset(out[vi].occlusion_uv, 0, sizeof(out[vi].occlusion_uv));
-                memset(out[vi].bump_uv, 0, sizeof(out[vi].bump_uv));
-                memset(out[vi].gradient, 0, sizeof(out[vi].gradient));
+            nb_tri = mc_compute(densities, tri);
+
+            for (i = 0; i < nb_tri; i++) {
+                for (v = 0; v < 3; v++) {
+                    mc_interp_pos(&tri[i][v], tri[i][v].pos, flat);
+                    const uint8_t *c1, *c2;
+                    c1 = get_at(data, x + VERTICES_POSITIONS[tri[i][v].v0][0],
+                                      y + VERTICES_POSITIONS[tri[i][v].v0][1],
+                                      z + VERTICES_POSITIONS[tri[i][v].v0][2]);
+                    c2 = get_at(data, x + VERTICES_POSITIONS[tri[i][v].v1][0],
+                                      y + VERTICES_POSITIONS[tri[i][v].v1][1],
+                                      z + VERTICES_POSITIONS[tri[i][v].v1][2]);
+                    memcpy(tri[i][v].color, c1[3] > c2[3] ? c1 : c2, 4);
+                }
+            }
+            if (flat) nb_tri = split_triangles(nb_tri, tri, tri);
+
+            for (i = 0; i < nb_tri; i++) {
+                compute_triangle_normal(tri[i], n);
+                for (v = 0; v < 3; v++) {
+                    vi = nb_tri_tot * 3 + v;
+                    memcpy(out[vi].color, tri[i][v].color, sizeof(out[vi].color));
+                    out[vi].color[3] = 255;
+                    out[vi].pos[0] = tri[i][v].pos[0] + x * MC_VOXEL_SUB_POS + MC_VOXEL_SUB_POS / 2 + 0.5;
+                    out[vi].pos[1] = tri[i][v].pos[1] + y * MC_VOXEL_SUB_POS + MC_VOXEL_SUB_POS / 2 + 0.5;
+                    out[vi].pos[2] = tri[i][v].pos[2] + z * MC_VOXEL_SUB_POS + MC_VOXEL_SUB_POS / 2 + 0.5;
+                    out[vi].normal[0] = n[0] * 64;
+                    out[vi].normal[1] = n[1] * 64;
+                    out[vi].normal[2] = n[2] * 64;
+                    // XXX: this shouldn't matter.
+                    memset(out[vi].occlusion_uv, 0, sizeof(out[vi].occlusion_uv));
+                    memset(out[vi].bump_uv, 0, sizeof(out[vi].bump_uv));
+                    memset(out[vi].gradient, 0, sizeof(out[vi].gradient));
+                }
+                nb_tri_tot++;
             }
-            nb_tri_tot++;
         }
     }
-    free(data);
+#undef get_at
     return nb_tri_tot;
 }
 
@@ -48,11 +48,11 @@ material_t *material_copy(const material_t *other)
     return m;
 }
 
-uint32_t material_get_hash(const material_t *m)
+uint64_t material_get_hash(const material_t *m)
 {
-    uint32_t ret = 0;
-    ret = XXH32(&m->metallic, sizeof(m->metallic), ret);
-    ret = XXH32(&m->roughness, sizeof(m->roughness), ret);
-    ret = XXH32(&m->base_color, sizeof(m->base_color), ret);
+    uint64_t ret = 0;
+    ret = XXH64(&m->metallic, sizeof(m->metallic), ret);
+    ret = XXH64(&m->roughness, sizeof(m->roughness), ret);
+    ret = XXH64(&m->base_color, sizeof(m->base_color), ret);
     return ret;
 }
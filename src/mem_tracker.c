@@ -0,0 +1,300 @@
+/* Goxel 3D voxels editor
+ *
+ * copyright (c) 2026 Guillaume Chereau <guillaume@noctua-software.com>
+ *
+ * Goxel is free software: you can redistribute it and/or modify it under the
+ * terms of the GNU General Public License as published by the Free Software
+ * Foundation, either version 3 of the License, or (at your option) any later
+ * version.
+
+ * Goxel is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+
+ * You should have received a copy of the GNU General Public License along with
+ * goxel.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "goxel.h"
+
+#include <errno.h> // IWYU pragma: keep.
+#include <signal.h>
+
+static const char *NAMES[MEM_COUNT] = {
+    [MEM_TILES]         = "Tiles",
+    [MEM_TILES_LAYERS]  = "Layers",
+    [MEM_TILES_RENDER]  = "Render",
+    [MEM_TILES_TOOLS]   = "Tools",
+    [MEM_TILES_HISTORY] = "History",
+    [MEM_TILES_OTHER]   = "Other tiles",
+    [MEM_CACHES]        = "Caches",
+    [MEM_GPU]           = "GPU",
+    [MEM_PATHTRACER]    = "Path tracer",
+};
+
+static mem_stats_t g_stats = {};
+static double g_log_period = 0;
+static double g_log_time = 0;
+static volatile sig_atomic_t g_dump_requested = 0;
+
+// Open addressing set of non zero ids, to count the shared tiles data and
+// volumes only once.
+typedef struct {
+    uint64_t    *ids;
+    int         size;   // Power of two.
+    int         nb;
+} id_set_t;
+
+static int id_set_find(const id_set_t *set, uint64_t id)
+{
+    int i = (id * 0x9e3779b97f4a7c15ULL) >> 40 & (set->size - 1);
+    while (set->ids[i] && set->ids[i] != id) i = (i + 1) & (set->size - 1);
+    return i;
+}
+
+// Add an id to the set, return false if it was already in.
+static bool id_set_add(id_set_t *set, uint64_t id)
+{
+    uint64_t *old = set->ids;
+    int i, old_size = set->size;
+
+    if (set->nb * 2 >= set->size) {
+        set->size = old_size ? old_size * 2 : 1024;
+        set->ids = calloc(set->size, sizeof(*set->ids));
+        for (i = 0; i < old_size; i++) {
+            if (old[i]) set->ids[id_set_find(set, old[i])] = old[i];
+        }
+        free(old);
+    }
+    i = id_set_find(set, id);
+    if (set->ids[i]) return false;
+    set->ids[i] = id;
+    set->nb++;
+    return true;
+}
+
+/*
+ * Call a function for all the volumes we know, in the order of the parts
+ * they count for.  We don't list the volumes of the caches, nor the ones
+ * used temporarily in the middle of an operation.
+ */
+static void iter_volumes(void *user,
+                         void (*f)(void *user, int part, const char *name,
+                                   const volume_t *volume))
+{
+    const image_t *img = goxel.image, *hist;
+    const layer_t *layer;
+    const volume_stack_t *stack;
+    char name[512];
+    int i, k;
+
+    DL_FOREACH(img->layers, layer) {
+        snprintf(name, sizeof(name), "layer '%s'", layer->name);
+        f(user, MEM_TILES_LAYERS, name, layer->volume);
+    }
+    f(user, MEM_TILES_LAYERS, "selection", img->selection_mask);
+
+    for (k = 0; k < 2; k++) {
+        stack = k ? &goxel.render_stack : &goxel.layers_stack;
+        f(user, MEM_TILES_RENDER, k ? "render merge" : "layers merge",
+          stack->volume);
+        for (i = 0; i < stack->nb; i++) {
+            snprintf(name, sizeof(name), "%s input %d",
+                     k ? "render merge" : "layers merge", i);
+            f(user, MEM_TILES_RENDER, name, stack->inputs[i]);
+        }
+        DL_FOREACH(goxel.render_layers[k].layers, layer) {
+            snprintf(name, sizeof(name), "render layer '%s'%s", layer->name,
+                     k ? " (tool preview)" : "");
+            f(user, MEM_TILES_RENDER, name, layer->volume);
+        }
+    }
+    f(user, MEM_TILES_RENDER, "tool overlay", goxel.tool_overlay.volume);
+
+    f(user, MEM_TILES_TOOLS, "tool volume", goxel.tool_volume);
+    f(user, MEM_TILES_TOOLS, "tool moved volume", goxel.tool_moved_volume);
+    f(user, MEM_TILES_TOOLS, "clipboard", goxel.clipboard.volume);
+
+    i = 0;
+    DL_FOREACH2(img->history, hist, history_next) {
+        DL_FOREACH(hist->layers, layer) {
+            snprintf(name, sizeof(name), "history %d layer '%s'", i,
+                     layer->name);
+            f(user, MEM_TILES_HISTORY, name, layer->volume);
+        }
+        snprintf(name, sizeof(name), "history %d selection", i);
+        f(user, MEM_TILES_HISTORY, name, hist->selection_mask);
+        i++;
+    }
+}
+
+typedef struct {
+    id_set_t    tiles;
+    id_set_t    volumes;
+    uint64_t    values[MEM_COUNT];
+    // Memory of the last volume: all its tiles, and those not seen before.
+    uint64_t    mem;
+    uint64_t    own_mem;
+    FILE        *file; // Set for the dumps.
+} visit_ctx_t;
+
+static void on_tile_data(void *user, uint64_t id, uint64_t mem)
+{
+    visit_ctx_t *ctx = user;
+    ctx->mem += mem;
+    if (id_set_add(&ctx->tiles, id)) ctx->own_mem += mem;
+}
+
+static void on_volume(void *user, int part, const char *name,
+                      const volume_t *volume)
+{
+    visit_ctx_t *ctx = user;
+
+    if (!volume) return;
+    if (!id_set_add(&ctx->volumes, (uintptr_t)volume)) return;
+    ctx->mem = 0;
+    ctx->own_mem = 0;
+    volume_iter_tiles_data(volume, ctx, on_tile_data);
+    ctx->values[part] += ctx->own_mem;
+    if (ctx->file) {
+        fprintf(ctx->file, "%-8s %-40s %8d %10.1f %10.1f\n",
+                NAMES[part], name, volume_get_tiles_count(volume),
+                ctx->mem / 1024.0, ctx->own_mem / 1024.0);
+    }
+}
+
+static void on_cache_stats(void *user, const cache_stats_t *stats)
+{
+    visit_ctx_t *ctx = user;
+    // The GPU meshes cache cost is their buffers size.
+    if (strcmp(stats->name, "render_items") == 0)
+        ctx->values[MEM_GPU] += stats->size;
+    // Some caches use a cost of one per item.
+    else if (stats->max_size >= MB)
+        ctx->values[MEM_CACHES] += stats->size;
+    if (ctx->file) {
+        fprintf(ctx->file, "%-20s %8d items %10.1fK / %10.1fK\n",
+                stats->name, stats->nb_items, stats->size / 1024.0,
+                stats->max_size / 1024.0);
+    }
+}
+
+// Compute all the values, and write the details into a file if set.
+static void visit_all(FILE *file)
+{
+    visit_ctx_t ctx = {.file = file};
+    volume_global_stats_t stats;
+    uint64_t known = 0;
+    int i;
+
+    volume_get_global_stats(&stats);
+    if (file) {
+        fprintf(file, "# Volumes\n");
+        fprintf(file, "%-8s %-40s %8s %10s %10s\n",
+                "part", "volume", "tiles", "mem (K)", "own (K)");
+    }
+    iter_volumes(&ctx, on_volume);
+    if (file) {
+        fprintf(file, "\n%d volumes listed, %d in total (the others belong "
+                "to the caches, or leaked)\n",
+                ctx.volumes.nb, stats.nb_volumes);
+        fprintf(file, "\n# Caches\n");
+    }
+    cache_iter_stats(&ctx, on_cache_stats);
+    ctx.values[MEM_PATHTRACER] = pathtracer_get_mem(&goxel.pathtracer);
+
+    ctx.values[MEM_TILES] = stats.mem + stats.packed_mem;
+    for (i = MEM_TILES_LAYERS; i < MEM_TILES_OTHER; i++)
+        known += ctx.values[i];
+    ctx.values[MEM_TILES_OTHER] =
+        ctx.values[MEM_TILES] > known ? ctx.values[MEM_TILES] - known : 0;
+
+    for (i = 0; i < MEM_COUNT; i++) {
+        g_stats.values[i] = ctx.values[i];
+        g_stats.peaks[i] = max(g_stats.peaks[i], ctx.values[i]);
+    }
+    g_stats.time = sys_get_time();
+    free(ctx.tiles.ids);
+    free(ctx.volumes.ids);
+}
+
+void mem_tracker_update(void)
+{
+    visit_all(NULL);
+}
+
+const mem_stats_t *mem_tracker_get_stats(void)
+{
+    return &g_stats;
+}
+
+const char *mem_tracker_get_name(int part)
+{
+    return NAMES[part];
+}
+
+void mem_tracker_set_log_period(double period)
+{
+    g_log_period = period;
+}
+
+int mem_tracker_dump(const char *path)
+{
+    FILE *file;
+    int i;
+
+    file = fopen(path, "w");
+    if (!file) {
+        LOG_E("Cannot save to %s: %s", path, strerror(errno));
+        return -1;
+    }
+    visit_all(file);
+    fprintf(file, "\n# Parts\n");
+    fprintf(file, "%-12s %10s %10s\n", "part", "mem (K)", "peak (K)");
+    for (i = 0; i < MEM_COUNT; i++) {
+        fprintf(file, "%-12s %10.1f %10.1f\n", NAMES[i],
+                g_stats.values[i] / 1024.0, g_stats.peaks[i] / 1024.0);
+    }
+    fclose(file);
+    return 0;
+}
+
+void mem_tracker_request_dump(void)
+{
+    g_dump_requested = 1;
+}
+
+static void log_stats(void)
+{
+    char buf[512];
+    int i, n = 0;
+
+    for (i = 0; i < MEM_COUNT; i++) {
+        n += snprintf(buf + n, sizeof(buf) - n, "%s%s %dM (peak %dM)",
+                      i ? ", " : "", NAMES[i],
+                      (int)(g_stats.values[i] / MB),
+                      (int)(g_stats.peaks[i] / MB));
+        if (n >= (int)sizeof(buf)) break;
+    }
+    LOG_I("Memory: %s", buf);
+}
+
+void mem_tracker_iter(void)
+{
+    char path[1024];
+    double time;
+
+    if (g_dump_requested) {
+        g_dump_requested = 0;
+        snprintf(path, sizeof(path), "%s/memory.txt", sys_get_user_dir());
+        if (mem_tracker_dump(path) == 0)
+            LOG_I("Memory report saved to %s", path);
+    }
+    if (g_log_period <= 0) return;
+    time = sys_get_time();
+    if (time - g_log_time < g_log_period) return;
+    g_log_time = time;
+    mem_tracker_update();
+    log_stats();
+}
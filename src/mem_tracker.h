@@ -0,0 +1,127 @@
+/* Goxel 3D voxels editor
+ *
+ * copyright (c) 2026 Guillaume Chereau <guillaume@noctua-software.com>
+ *
+ * Goxel is free software: you can redistribute it and/or modify it under the
+ * terms of the GNU General Public License as published by the Free Software
+ * Foundation, either version 3 of the License, or (at your option) any later
+ * version.
+
+ * Goxel is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+
+ * You should have received a copy of the GNU General Public License along with
+ * goxel.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Section: Memory tracker
+ * Memory used by each part of goxel, to find out what makes a long session
+ * grow.
+ *
+ * The tiles memory is split between the volumes that use it: each tile
+ * data counts once, for the first of the layers, render copies, tools and
+ * undo history that references it.  What is left is kept by the caches, or
+ * leaked.  Since this walks all the tiles, the values are only sampled by
+ * <mem_tracker_update>, and the peaks are the highest sampled values.
+ */
+
+#ifndef MEM_TRACKER_H
+#define MEM_TRACKER_H
+
+#include <stdint.h>
+
+/*
+ * Enum: MEM
+ * The tracked parts.
+ *
+ *   MEM_TILES          - All the tiles data in memory, packed or not.
+ *   MEM_TILES_LAYERS   - Part of it used by the image layers and selection.
+ *   MEM_TILES_RENDER   - Only used by the merged and copied volumes of the
+ *                        rendering.
+ *   MEM_TILES_TOOLS    - Only used by the tools and the clipboard.
+ *   MEM_TILES_HISTORY  - Only used by the undo history.
+ *   MEM_TILES_OTHER    - Not used by any of those: kept by the caches, or
+ *                        leaked.
+ *   MEM_CACHES         - Size of the memory caches, except the GPU meshes.
+ *                        Includes some tiles counted above.
+ *   MEM_GPU            - Vertex buffers of the cached meshes.
+ *   MEM_PATHTRACER     - Path tracer scene, bvh and buffers.
+ */
+enum {
+    MEM_TILES,
+    MEM_TILES_LAYERS,
+    MEM_TILES_RENDER,
+    MEM_TILES_TOOLS,
+    MEM_TILES_HISTORY,
+    MEM_TILES_OTHER,
+    MEM_CACHES,
+    MEM_GPU,
+    MEM_PATHTRACER,
+
+    MEM_COUNT
+};
+
+/*
+ * Type: mem_stats_t
+ * Values and peaks of the tracked parts, in bytes.
+ */
+typedef struct {
+    uint64_t    values[MEM_COUNT];
+    uint64_t    peaks[MEM_COUNT];
+    double      time;   // Time of the last update.
+} mem_stats_t;
+
+/*
+ * Function: mem_tracker_update
+ * Sample the memory of all the parts, and update the peaks.
+ *
+ * This is linear in the number of tiles of all the volumes.
+ */
+void mem_tracker_update(void);
+
+/*
+ * Function: mem_tracker_get_stats
+ * Get the values of the last update.
+ */
+const mem_stats_t *mem_tracker_get_stats(void);
+
+/*
+ * Function: mem_tracker_get_name
+ * Return the display name of a part.
+ */
+const char *mem_tracker_get_name(int part);
+
+/*
+ * Function: mem_tracker_set_log_period
+ * Log a line with the memory of all the parts every period seconds, from
+ * <mem_tracker_iter>.  Zero to disable.
+ */
+void mem_tracker_set_log_period(double period);
+
+/*
+ * Function: mem_tracker_dump
+ * Save a text report of all the known volumes and what references them,
+ * and the stats of the caches.
+ *
+ * Return:
+ *   Zero on success.
+ */
+int mem_tracker_dump(const char *path);
+
+/*
+ * Function: mem_tracker_request_dump
+ * Dump the report into the user directory at the next iteration.  Safe to
+ * call from a signal handler.
+ */
+void mem_tracker_request_dump(void);
+
+/*
+ * Function: mem_tracker_iter
+ * Called once per frame, to do the periodic log and the requested dumps.
+ */
+void mem_tracker_iter(void);
+
+#endif // MEM_TRACKER_H
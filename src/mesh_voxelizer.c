@@ -0,0 +1,332 @@
+/* Goxel 3D voxels editor
+ *
+ * copyright (c) 2026 Guillaume Chereau <guillaume@noctua-software.com>
+ *
+ * Goxel is free software: you can redistribute it and/or modify it under the
+ * terms of the GNU General Public License as published by the Free Software
+ * Foundation, either version 3 of the License, or (at your option) any later
+ * version.
+
+ * Goxel is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+
+ * You should have received a copy of the GNU General Public License along with
+ * goxel.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "goxel.h"
+
+#include "mesh_voxelizer.h"
+
+#define N TILE_SIZE
+
+// Number of tiles voxelized between two calls to the progress function.
+#define CHUNK_SIZE 256
+
+// The triangles overlapping a tile.
+typedef struct {
+    UT_hash_handle  hh;
+    int             pos[3];
+    int             nb;     // Number of triangles.
+    int             ofs;    // Offset of the triangles in the list.
+} bin_t;
+
+typedef struct {
+    const voxelizer_mesh_t  *mesh;
+    bin_t                   *table;     // Hash table of the bins.
+    bin_t                   *last;      // Last bin used.
+    int                     nb_bins;
+    bin_t                   **bins;     // All the bins, sorted by position.
+    int                     *list;      // Triangles of all the bins.
+} ctx_t;
+
+/*
+ * A triangle prepared for the separating axis tests against voxel boxes
+ * (see "Fast 3D Triangle-Box Overlap Testing", Tomas Akenine-Möller): for
+ * each of the nine axes cross products of the edges and the box axes, we
+ * keep the range of the projection of the corners.
+ */
+typedef struct {
+    float   v[3][3];
+    float   n[3];       // Normal, not normalized.
+    float   d;          // Projection of the plane on the normal.
+    float   r;          // Projection of a unit box on the normal.
+    float   axes[9][3];
+    float   range[9][2];
+    float   radius[9];  // Projection of a unit box on the axes.
+} triangle_t;
+
+static int pos_cmp(const void *a_, const void *b_)
+{
+    const int *a = a_, *b = b_;
+    int i;
+    for (i = 0; i < 3; i++) {
+        if (a[i] != b[i]) return a[i] < b[i] ? -1 : 1;
+    }
+    return 0;
+}
+
+static int bin_cmp(const void *a, const void *b)
+{
+    return pos_cmp((*(const bin_t**)a)->pos, (*(const bin_t**)b)->pos);
+}
+
+static void triangle_init(triangle_t *t, const voxelizer_mesh_t *mesh,
+                          int idx)
+{
+    float e[3][3], u[3];
+    int i, j, k;
+    float p;
+
+    for (i = 0; i < 3; i++)
+        vec3_copy(mesh->vertices[mesh->triangles[idx][i]], t->v[i]);
+    for (i = 0; i < 3; i++)
+        vec3_sub(t->v[(i + 1) % 3], t->v[i], e[i]);
+    vec3_cross(e[0], e[1], t->n);
+    t->d = vec3_dot(t->n, t->v[0]);
+    t->r = 0.5 * (fabs(t->n[0]) + fabs(t->n[1]) + fabs(t->n[2]));
+    for (i = 0; i < 3; i++)
+    for (j = 0; j < 3; j++) {
+        vec3_set(u, j == 0, j == 1, j == 2);
+        vec3_cross(u, e[i], t->axes[i * 3 + j]);
+        t->radius[i * 3 + j] = 0.5 * (fabs(t->axes[i * 3 + j][0]) +
+                                      fabs(t->axes[i * 3 + j][1]) +
+                                      fabs(t->axes[i * 3 + j][2]));
+        t->range[i * 3 + j][0] = +FLT_MAX;
+        t->range[i * 3 + j][1] = -FLT_MAX;
+        for (k = 0; k < 3; k++) {
+            p = vec3_dot(t->axes[i * 3 + j], t->v[k]);
+            t->range[i * 3 + j][0] = min(t->range[i * 3 + j][0], p);
+            t->range[i * 3 + j][1] = max(t->range[i * 3 + j][1], p);
+        }
+    }
+}
+
+// Test if a triangle overlaps a box of a given size.  The box axes tests
+// are skipped, since we only test the boxes inside the triangle bounding
+// box.
+static bool triangle_overlap(const triangle_t *t, const float c[3],
+                             float size)
+{
+    int i;
+    float d;
+
+    d = vec3_dot(t->n, c);
+    if (fabs(d - t->d) > t->r * size) return false;
+    for (i = 0; i < 9; i++) {
+        d = vec3_dot(t->axes[i], c);
+        if (    t->range[i][0] - d > t->radius[i] * size ||
+                t->range[i][1] - d < -t->radius[i] * size)
+            return false;
+    }
+    return true;
+}
+
+static void triangle_get_aabb(const triangle_t *t, int aabb[2][3])
+{
+    int i;
+    for (i = 0; i < 3; i++) {
+        aabb[0][i] = floor(min3(t->v[0][i], t->v[1][i], t->v[2][i]));
+        aabb[1][i] = floor(max3(t->v[0][i], t->v[1][i], t->v[2][i])) + 1;
+    }
+}
+
+// Barycentric coordinates of the point of a triangle closest to a point.
+static void triangle_get_bary(const triangle_t *t, const float p[3],
+                              float out[3])
+{
+    float v0[3], v1[3], v2[3], d00, d01, d11, d20, d21, den, s;
+
+    vec3_sub(t->v[1], t->v[0], v0);
+    vec3_sub(t->v[2], t->v[0], v1);
+    vec3_sub(p, t->v[0], v2);
+    d00 = vec3_dot(v0, v0);
+    d01 = vec3_dot(v0, v1);
+    d11 = vec3_dot(v1, v1);
+    d20 = vec3_dot(v2, v0);
+    d21 = vec3_dot(v2, v1);
+    den = d00 * d11 - d01 * d01;
+    if (den == 0) {
+        vec3_set(out, 1, 0, 0);
+        return;
+    }
+    out[1] = max(0.f, (d11 * d20 - d01 * d21) / den);
+    out[2] = max(0.f, (d00 * d21 - d01 * d20) / den);
+    out[0] = max(0.f, 1 - out[1] - out[2]);
+    s = out[0] + out[1] + out[2];
+    vec3_imul(out, 1 / s);
+}
+
+static const float *get_uv(const voxelizer_mesh_t *mesh, int tri, int i)
+{
+    static const float zero[2] = {0, 0};
+    int idx;
+    if (!mesh->triangles_uv) return zero;
+    idx = mesh->triangles_uv[tri][i];
+    if (idx < 0 || idx >= mesh->nb_uvs) return zero;
+    return mesh->uvs[idx];
+}
+
+// Compute the color of a voxel, return false for the transparent pixels of
+// the textures.
+static bool get_color(const voxelizer_mesh_t *mesh, const triangle_t *t,
+                      int tri, const float p[3], uint8_t out[4])
+{
+    const voxelizer_material_t *mat = NULL;
+    const uint8_t *pix;
+    float bary[3], uv[2] = {};
+    int i, x, y, m;
+
+    m = mesh->materials ? mesh->materials[tri] : -1;
+    if (m >= 0 && m < mesh->nb_materials) mat = &mesh->materials_def[m];
+    if (!mat) {
+        memset(out, 255, 4);
+        return true;
+    }
+    memcpy(out, mat->color, 4);
+    if (!mat->texture) return true;
+
+    triangle_get_bary(t, p, bary);
+    for (i = 0; i < 3; i++) {
+        uv[0] += get_uv(mesh, tri, i)[0] * bary[i];
+        uv[1] += get_uv(mesh, tri, i)[1] * bary[i];
+    }
+    // Repeat the texture, with the rows stored from the top.
+    x = (uv[0] - floor(uv[0])) * mat->w;
+    y = (1 - (uv[1] - floor(uv[1]))) * mat->h;
+    x = clamp(x, 0, mat->w - 1);
+    y = clamp(y, 0, mat->h - 1);
+    pix = mat->texture + (y * mat->w + x) * mat->bpp;
+    if (mat->bpp == 4 && pix[3] < 128) return false;
+    for (i = 0; i < 3; i++) out[i] = (int)out[i] * pix[i] / 255;
+    return true;
+}
+
+static bin_t *get_bin(ctx_t *ctx, const int pos[3])
+{
+    bin_t *bin = ctx->last;
+
+    if (bin && memcmp(bin->pos, pos, sizeof(bin->pos)) == 0) return bin;
+    HASH_FIND(hh, ctx->table, pos, sizeof(bin->pos), bin);
+    if (!bin) {
+        bin = calloc(1, sizeof(*bin));
+        memcpy(bin->pos, pos, sizeof(bin->pos));
+        HASH_ADD(hh, ctx->table, pos, sizeof(bin->pos), bin);
+        ctx->nb_bins++;
+    }
+    ctx->last = bin;
+    return bin;
+}
+
+// Add a triangle to the bins of all the tiles it overlaps.  The first pass
+// only count the triangles.
+static void bin_triangle(ctx_t *ctx, int idx, bool fill)
+{
+    triangle_t t;
+    int aabb[2][3], p[3];
+    float c[3];
+    bool single;
+    bin_t *bin;
+
+    triangle_init(&t, ctx->mesh, idx);
+    triangle_get_aabb(&t, aabb);
+    single = (aabb[0][0] & ~(N - 1)) == ((aabb[1][0] - 1) & ~(N - 1)) &&
+             (aabb[0][1] & ~(N - 1)) == ((aabb[1][1] - 1) & ~(N - 1)) &&
+             (aabb[0][2] & ~(N - 1)) == ((aabb[1][2] - 1) & ~(N - 1));
+    for (p[2] = aabb[0][2] & ~(N - 1); p[2] < aabb[1][2]; p[2] += N)
+    for (p[1] = aabb[0][1] & ~(N - 1); p[1] < aabb[1][1]; p[1] += N)
+    for (p[0] = aabb[0][0] & ~(N - 1); p[0] < aabb[1][0]; p[0] += N) {
+        // The large triangles don't overlap all the tiles of their box.
+        if (!single) {
+            vec3_set(c, p[0] + N / 2., p[1] + N / 2., p[2] + N / 2.);
+            if (!triangle_overlap(&t, c, N)) continue;
+        }
+        bin = get_bin(ctx, p);
+        if (fill) ctx->list[bin->ofs + bin->nb] = idx;
+        bin->nb++;
+    }
+}
+
+static bool voxelize_tile(void *user, const int pos[3], uint8_t (*voxels)[4])
+{
+    const ctx_t *ctx = user;
+    const bin_t key = {.pos = {pos[0], pos[1], pos[2]}}, *key_ptr = &key;
+    bin_t **found;
+    const bin_t *bin;
+    triangle_t t;
+    int i, tri, aabb[2][3], x, y, z;
+    float c[3];
+    uint8_t color[4];
+    bool changed = false;
+
+    found = bsearch(&key_ptr, ctx->bins, ctx->nb_bins, sizeof(*ctx->bins),
+                    bin_cmp);
+    assert(found);
+    bin = *found;
+    for (i = 0; i < bin->nb; i++) {
+        tri = ctx->list[bin->ofs + i];
+        triangle_init(&t, ctx->mesh, tri);
+        triangle_get_aabb(&t, aabb);
+        for (z = max(aabb[0][2], pos[2]); z < min(aabb[1][2], pos[2] + N); z++)
+        for (y = max(aabb[0][1], pos[1]); y < min(aabb[1][1], pos[1] + N); y++)
+        for (x = max(aabb[0][0], pos[0]); x < min(aabb[1][0], pos[0] + N); x++)
+        {
+            vec3_set(c, x + 0.5, y + 0.5, z + 0.5);
+            if (!triangle_overlap(&t, c, 1)) continue;
+            if (!get_color(ctx->mesh, &t, tri, c, color)) continue;
+            memcpy(voxels[(x - pos[0]) + (y - pos[1]) * N +
+                          (z - pos[2]) * N * N], color, 4);
+            changed = true;
+        }
+    }
+    return changed;
+}
+
+int mesh_voxelize(volume_t *volume, const voxelizer_mesh_t *mesh,
+                  bool (*progress)(void *user, float p), void *user)
+{
+    ctx_t ctx = {.mesh = mesh};
+    int i, nb, ofs = 0, ret = 0;
+    int (*pos)[3];
+    bin_t *bin, *tmp;
+    TRACE_SCOPE("mesh_voxelize");
+
+    // Two passes: count the triangles of each tile, then fill the list.
+    for (i = 0; i < mesh->nb_triangles; i++) bin_triangle(&ctx, i, false);
+    ctx.bins = malloc(max(ctx.nb_bins, 1) * sizeof(*ctx.bins));
+    i = 0;
+    HASH_ITER(hh, ctx.table, bin, tmp) {
+        bin->ofs = ofs;
+        ofs += bin->nb;
+        bin->nb = 0;
+        ctx.bins[i++] = bin;
+    }
+    ctx.list = malloc(max(ofs, 1) * sizeof(*ctx.list));
+    for (i = 0; i < mesh->nb_triangles; i++) bin_triangle(&ctx, i, true);
+    qsort(ctx.bins, ctx.nb_bins, sizeof(*ctx.bins), bin_cmp);
+
+    pos = malloc(max(ctx.nb_bins, 1) * sizeof(*pos));
+    for (i = 0; i < ctx.nb_bins; i++)
+        memcpy(pos[i], ctx.bins[i]->pos, sizeof(pos[i]));
+    for (i = 0; i < ctx.nb_bins; i += CHUNK_SIZE) {
+        if (progress && !progress(user, (float)i / ctx.nb_bins)) {
+            ret = -1;
+            break;
+        }
+        nb = min(CHUNK_SIZE, ctx.nb_bins - i);
+        volume_apply_tiles(volume, nb, (const int (*)[3])(pos + i),
+                           voxelize_tile, &ctx);
+    }
+    if (!ret && progress) progress(user, 1);
+
+    HASH_ITER(hh, ctx.table, bin, tmp) {
+        HASH_DEL(ctx.table, bin);
+        free(bin);
+    }
+    free(ctx.bins);
+    free(ctx.list);
+    free(pos);
+    return ret;
+}
@@ -0,0 +1,103 @@
+/* Goxel 3D voxels editor
+ *
+ * copyright (c) 2026 Guillaume Chereau <guillaume@noctua-software.com>
+ *
+ * Goxel is free software: you can redistribute it and/or modify it under the
+ * terms of the GNU General Public License as published by the Free Software
+ * Foundation, either version 3 of the License, or (at your option) any later
+ * version.
+
+ * Goxel is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+
+ * You should have received a copy of the GNU General Public License along with
+ * goxel.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* ######## Section: Mesh voxelizer #######################################
+ * Convert triangle meshes into voxels.
+ *
+ * The triangles are first sorted by the tiles they overlap, then the tiles
+ * are voxelized in parallel, each one written at once into the volume.  A
+ * voxel is set if its box overlaps a triangle, and gets the color of the
+ * closest point of the triangle.
+ */
+
+#ifndef MESH_VOXELIZER_H
+#define MESH_VOXELIZER_H
+
+#include "volume.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/*
+ * Type: voxelizer_material_t
+ * Color of the triangles of a mesh.
+ *
+ * Attributes:
+ *   color   - The base color.
+ *   texture - RGB or RGBA pixels multiplied with the color, or NULL.
+ *   w, h    - Size of the texture.
+ *   bpp     - Bytes per pixel of the texture (3 or 4).
+ */
+typedef struct {
+    uint8_t         color[4];
+    const uint8_t   *texture;
+    int             w, h, bpp;
+} voxelizer_material_t;
+
+/*
+ * Type: voxelizer_mesh_t
+ * An indexed triangle mesh.
+ *
+ * Attributes:
+ *   nb_vertices   - Number of vertices.
+ *   vertices      - Position of the vertices, in voxel units.
+ *   nb_uvs        - Number of texture coordinates.
+ *   uvs           - Texture coordinates, with (0, 0) at the bottom left
+ *                   of the textures.
+ *   nb_triangles  - Number of triangles.
+ *   triangles     - Vertex indices of the triangles corners.
+ *   triangles_uv  - Texture coordinates indices of the corners, or NULL.
+ *                   The invalid indices give the coordinates (0, 0).
+ *   materials     - Material index of each triangle, or NULL.  Negative
+ *                   values use the default white material.
+ *   nb_materials  - Number of materials.
+ *   materials_def - The materials.
+ */
+typedef struct {
+    int                         nb_vertices;
+    const float                 (*vertices)[3];
+    int                         nb_uvs;
+    const float                 (*uvs)[2];
+    int                         nb_triangles;
+    const int                   (*triangles)[3];
+    const int                   (*triangles_uv)[3];
+    const int                   *materials;
+    int                         nb_materials;
+    const voxelizer_material_t  *materials_def;
+} voxelizer_mesh_t;
+
+/*
+ * Function: mesh_voxelize
+ * Add the voxels of a triangle mesh into a volume.
+ *
+ * Parameters:
+ *   volume   - The volume to write to.
+ *   mesh     - The mesh.
+ *   progress - Optional function called from the calling thread with the
+ *              progress between 0 and 1.  If it returns false the
+ *              voxelization stops, and the volume only contains the tiles
+ *              done so far.
+ *   user     - User data passed to the progress function.
+ *
+ * Return:
+ *   0 on success, -1 if the voxelization got cancelled.
+ */
+int mesh_voxelize(volume_t *volume, const voxelizer_mesh_t *mesh,
+                  bool (*progress)(void *user, float p), void *user);
+
+#endif // MESH_VOXELIZER_H
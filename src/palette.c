@@ -18,6 +18,72 @@
 
 #include "goxel.h"
 
+typedef struct {
+    UT_hash_handle  hh;
+    uint32_t        key;
+    int             value;
+} color_entry_t;
+
+// Hash tables of the colors of a palette.
+struct palette_lookup {
+    color_entry_t *exact;   // First index of each color.
+    color_entry_t *closest; // Cached closest color searches.
+};
+
+static uint32_t color_key(const uint8_t col[4])
+{
+    uint32_t key;
+    memcpy(&key, col, 4);
+    return key;
+}
+
+static int table_get(color_entry_t *table, uint32_t key)
+{
+    color_entry_t *entry;
+    HASH_FIND(hh, table, &key, sizeof(key), entry);
+    return entry ? entry->value : -1;
+}
+
+static void table_put(color_entry_t **table, uint32_t key, int value)
+{
+    color_entry_t *entry;
+    HASH_FIND(hh, *table, &key, sizeof(key), entry);
+    if (!entry) {
+        entry = calloc(1, sizeof(*entry));
+        entry->key = key;
+        HASH_ADD(hh, *table, key, sizeof(entry->key), entry);
+    }
+    entry->value = value;
+}
+
+static void table_clear(color_entry_t **table)
+{
+    color_entry_t *entry, *tmp;
+    HASH_ITER(hh, *table, entry, tmp) {
+        HASH_DEL(*table, entry);
+        free(entry);
+    }
+}
+
+// Index of the closest color, using the rgb manhattan distance.
+static int search_closest(const palette_t *palette, const uint8_t col[4])
+{
+    const uint8_t *c;
+    int i, dist, best = -1, best_dist = 1024;
+    for (i = 0; i < palette->size; i++) {
+        c = palette->entries[i].color;
+        dist = abs((int)c[0] - (int)col[0]) +
+               abs((int)c[1] - (int)col[1]) +
+               abs((int)c[2] - (int)col[2]);
+        if (dist < best_dist) {
+            best_dist = dist;
+            best = i;
+            if (dist == 0) break;
+        }
+    }
+    return best;
+}
+
 /*
  * Function: palette_search
  * Search a given color in a palette
@@ -35,12 +101,24 @@ int palette_search(const palette_t *palette, const uint8_t col[4],
                    bool exact)
 {
     int i;
-    assert(exact); // For the moment.
+    uint32_t key = color_key(col);
+    palette_lookup_t *lookup = palette->lookup;
+
+    if (lookup) {
+        i = table_get(lookup->exact, key);
+        if (i != -1 || exact) return i;
+        i = table_get(lookup->closest, key);
+        if (i != -1) return i;
+        i = search_closest(palette, col);
+        table_put(&lookup->closest, key, i);
+        return i;
+    }
+
     for (i = 0; i < palette->size; i++) {
         if (memcmp(col, palette->entries[i].color, 4) == 0)
             return i;
     }
-    return -1;
+    return exact ? -1 : search_closest(palette, col);
 }
 
 void palette_insert(palette_t *p, const uint8_t col[4], const char *name)
@@ -56,6 +134,11 @@ void palette_insert(palette_t *p, const uint8_t col[4], const char *name)
     memcpy(e->color, col, 4);
     if (name)
         snprintf(e->name, sizeof(e->name), "%s", name);
+    if (p->lookup) {
+        table_put(&p->lookup->exact, color_key(col), p->size);
+        // The new color can be closer than the cached results.
+        table_clear(&p->lookup->closest);
+    }
     p->size++;
 }
 
@@ -125,26 +208,48 @@ static int parse_png(const void *data, int len, palette_t *palette)
     img = img_read_from_mem((void*)data, len, &w, &h, &bpp);
     if (!img) return -1;
 
+    palette_lookup_begin(palette);
     for (i = 0; i < w * h; i++) {
         memcpy(color, (uint8_t[]){0, 0, 0, 255}, 4);
         memcpy(color, img + i * bpp, bpp);
         palette_insert(palette, color, NULL);
     }
+    palette_lookup_end(palette);
     free(img);
     return palette->size;
 }
 
 
-static int on_palette(int i, const char *path, void *user)
+palette_t *palette_load_asset(const char *path)
 {
-    palette_t **list = user;
     const char *data;
     palette_t *pal;
-    pal = calloc(1, sizeof(*pal));
+
     data = assets_get(path, NULL);
+    if (!data) return NULL;
+    pal = calloc(1, sizeof(*pal));
     pal->size = parse_gpl(data, pal->name, &pal->columns, NULL);
     pal->entries = calloc(pal->size, sizeof(*pal->entries));
     parse_gpl(data, NULL, NULL, pal->entries);
+    return pal;
+}
+
+static int on_palette(int i, const char *path, void *user)
+{
+    palette_t **list = user;
+    palette_t *pal, *other;
+
+    pal = palette_load_asset(path);
+    // Keep the palette already in the list, at the position of the asset.
+    DL_FOREACH(*list, other) {
+        if (strcmp(other->name, pal->name) == 0) break;
+    }
+    if (other) {
+        free(pal->entries);
+        free(pal);
+        DL_DELETE(*list, other);
+        pal = other;
+    }
     DL_APPEND(*list, pal);
     return 0;
 }
@@ -194,6 +299,27 @@ end:
 }
 
 
+void palette_lookup_begin(palette_t *palette)
+{
+    int i;
+    if (palette->lookup) return;
+    palette->lookup = calloc(1, sizeof(*palette->lookup));
+    // Iter backward so that we keep the first index of duplicated colors.
+    for (i = palette->size - 1; i >= 0; i--) {
+        table_put(&palette->lookup->exact,
+                  color_key(palette->entries[i].color), i);
+    }
+}
+
+void palette_lookup_end(palette_t *palette)
+{
+    if (!palette->lookup) return;
+    table_clear(&palette->lookup->exact);
+    table_clear(&palette->lookup->closest);
+    free(palette->lookup);
+    palette->lookup = NULL;
+}
+
 void palette_load_all(palette_t **list)
 {
     char dir[1024];
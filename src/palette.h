@@ -29,6 +29,8 @@ typedef struct {
     char     name[256];
 } palette_entry_t;
 
+typedef struct palette_lookup palette_lookup_t;
+
 typedef struct palette palette_t;
 struct palette {
     palette_t *next, *prev; // For the global list of palettes.
@@ -37,9 +39,20 @@ struct palette {
     int     size;
     int     allocated;
     palette_entry_t *entries;
+    palette_lookup_t *lookup; // Optional, see <palette_lookup_begin>.
 };
 
-// Load all the available palettes into a list.
+/*
+ * Function: palette_load_asset
+ * Load a palette from the assets.
+ *
+ * Return:
+ *   A new palette, or NULL if the asset doesn't exist.
+ */
+palette_t *palette_load_asset(const char *path);
+
+// Load all the available palettes into a list.  The bundled palettes that
+// are already in the list are kept instead of being loaded again.
 void palette_load_all(palette_t **list);
 
 /*
@@ -60,4 +73,22 @@ int palette_search(const palette_t *palette, const uint8_t col[4],
 
 void palette_insert(palette_t *p, const uint8_t col[4], const char *name);
 
+/*
+ * Function: palette_lookup_begin
+ * Build a hash table of the palette colors, so that <palette_search> and
+ * <palette_insert> don't do a linear search anymore.
+ *
+ * This is for the code looking up many colors, like the exporters.  Until
+ * <palette_lookup_end> is called, the palette should only be modified with
+ * <palette_insert>.  The non exact searches results are cached, so the
+ * palette should not be searched from several threads at the same time.
+ */
+void palette_lookup_begin(palette_t *palette);
+
+/*
+ * Function: palette_lookup_end
+ * Release the hash table created by <palette_lookup_begin>.
+ */
+void palette_lookup_end(palette_t *palette);
+
 #endif // PALETTE_H
@@ -34,11 +34,14 @@
 
 #pragma GCC diagnostic pop
 
+#include <array>
 #include <cstddef>
 #include <cstdio>
 #include <iterator>
 #include <future>
 #include <deque>
+#include <map>
+#include <unordered_map>
 
 extern "C" {
 #include "goxel.h"
@@ -60,6 +63,27 @@ enum {
     CHANGE_MATERIAL     = 1 << 7,
 };
 
+// Ids of the 27 tiles around a tile, plus the render effects: all we need
+// to know to generate the tile shape.
+typedef array<uint64_t, 28> tile_key_t;
+
+// Map of voxel face index (see get_face_index) to shape quad index.
+typedef unordered_map<int, int> face_map_t;
+
+// For the voxels traversal: a tile instance and its occupancy bits.
+struct voxel_tile_t {
+    int         instance;
+    uint64_t    mask[TILE_SIZE * TILE_SIZE * TILE_SIZE / 64];
+};
+
+// For the voxels traversal: dense grid of the tiles of a layer.
+struct voxel_grid_t {
+    int                  lo[3];  // Position of the first voxel.
+    int                  size[3]; // Size in tiles.
+    vector<int>          cells;  // Index into tiles, or -1.
+    vector<voxel_tile_t> tiles;
+};
+
 struct pathtracer_internal {
 
     // Different hash keys to quickly check for state changes.
@@ -85,6 +109,23 @@ struct pathtracer_internal {
     float exposure;
 
     int trace_sample;
+    double start_time; // Time when the current rendering started.
+    // Samples count and denoise flag of the current preview.
+    int preview_samples;
+    bool preview_denoise;
+
+    // Index of the shape of each tile in the scene, or -1 for empty
+    // shapes, so that we only generate the shapes of the modified tiles.
+    map<tile_key_t, int> tiles;
+    int light_instance;
+    int light_material;
+
+    // Voxels traversal data.  The faces maps are parallel to the scene
+    // shapes, and the bvh only contains the first nb_bvh_instances.
+    bool use_voxels;
+    vector<face_map_t> faces;
+    vector<voxel_grid_t> grids;
+    int nb_bvh_instances;
 };
 
 // Add a material to the scene and return its id.
@@ -103,20 +144,24 @@ static int add_material(pathtracer_t *pt, const material_t *mat)
     return pt->p->scene.materials.size() - 1;
 }
 
+/*
+ * Generate the shape of a tile.
+ *
+ * This is called from the jobs workers, so the vertices go into the
+ * thread scratch buffer.
+ */
 static shape_data create_shape_for_tile(
-        const volume_t *volume, const int tile_pos[3])
+        const volume_t *volume, const int tile_pos[3], int effects)
 {
     voxel_vertex_t* vertices;
     int i, nb, size, subdivide;
     shape_data shape = {};
 
-    vertices = (voxel_vertex_t*)calloc(
-                TILE_SIZE * TILE_SIZE * TILE_SIZE * 6 * 4,
-                sizeof(*vertices));
-    nb = volume_generate_vertices(volume, tile_pos,
-                                goxel.rend.settings.effects,
+    vertices = (voxel_vertex_t*)jobs_get_scratch(
+            TILE_SIZE * TILE_SIZE * TILE_SIZE * 6 * 4 * sizeof(*vertices));
+    nb = volume_generate_vertices(volume, tile_pos, effects,
                                 vertices, &size, &subdivide);
-    if (!nb) goto end;
+    if (!nb) return shape;
 
     // Set vertices data.
     shape.positions.resize(nb * size);
@@ -145,17 +190,14 @@ static shape_data create_shape_for_tile(
         for (i = 0; i < nb; i++)
             shape.triangles[i] = {i * 3 + 0, i * 3 + 1, i * 3 + 2};
     }
-
-end:
-    free(vertices);
     return shape;
 }
 
 
 static int check_changes(pathtracer_t *pt)
 {
-    uint32_t key, k;
-    const layer_t *layers, *layer;
+    uint64_t key, k;
+    const layer_t *layers, *layer, *base;
     float light_dir[3];
     const camera_t *camera;
     int changes = 0;
@@ -167,13 +209,22 @@ static int check_changes(pathtracer_t *pt)
     DL_FOREACH(layers, layer) {
         if (!layer->visible || !layer->volume) continue;
         k = volume_get_key(layer->volume);
-        key = XXH32(&k, sizeof(k), key);
+        key = XXH64(&k, sizeof(k), key);
     }
-    key = XXH32(goxel.back_color, sizeof(goxel.back_color), key);
-    key = XXH32(&goxel.rend.settings.effects,
+    DL_FOREACH(goxel.image->layers, layer) {
+        base = image_get_instance_base(goxel.image, layer);
+        if (!base) continue;
+        k = volume_get_key(base->volume);
+        key = XXH64(&k, sizeof(k), key);
+        key = XXH64(layer->mat[3], sizeof(layer->mat[3]), key);
+        key = XXH64(&layer->material, sizeof(layer->material), key);
+    }
+    key = XXH64(goxel.back_color, sizeof(goxel.back_color), key);
+    key = XXH64(&goxel.rend.settings.effects,
                 sizeof(goxel.rend.settings.effects), key);
-    key = XXH32(&pt->floor.type, sizeof(pt->floor.type), key);
-    key = XXH32(&pt->floor, sizeof(pt->floor), key);
+    key = XXH64(&pt->floor.type, sizeof(pt->floor.type), key);
+    key = XXH64(&pt->floor, sizeof(pt->floor), key);
+    key = XXH64(&pt->traversal, sizeof(pt->traversal), key);
     if (key != p->volume_key) {
         p->volume_key = key;
         changes |= CHANGE_VOLUME;
@@ -181,9 +232,9 @@ static int check_changes(pathtracer_t *pt)
 
     // Env changes.
     key = 0;
-    key = XXH32(&pt->world.type, sizeof(pt->world.type), key);
-    key = XXH32(&pt->world.energy, sizeof(pt->world.energy), key);
-    key = XXH32(&pt->world.color, sizeof(pt->world.color), key);
+    key = XXH64(&pt->world.type, sizeof(pt->world.type), key);
+    key = XXH64(&pt->world.energy, sizeof(pt->world.energy), key);
+    key = XXH64(&pt->world.color, sizeof(pt->world.color), key);
     if (key != p->world_key) {
         p->world_key = key;
         changes |= CHANGE_WORLD;
@@ -192,10 +243,10 @@ static int check_changes(pathtracer_t *pt)
     // Lights changes.
     key = 0;
     render_get_light_dir(&goxel.rend, light_dir);
-    key = XXH32(&pt->world, sizeof(pt->world), key);
-    key = XXH32(&goxel.rend.light.intensity,
+    key = XXH64(&pt->world, sizeof(pt->world), key);
+    key = XXH64(&goxel.rend.light.intensity,
                 sizeof(goxel.rend.light.intensity), key);
-    key = XXH32(light_dir, sizeof(light_dir), key);
+    key = XXH64(light_dir, sizeof(light_dir), key);
     if (key != p->light_key) {
         p->light_key = key;
         changes |= CHANGE_LIGHT;
@@ -203,7 +254,8 @@ static int check_changes(pathtracer_t *pt)
 
     // Options changes.
     key = 0;
-    key = XXH32(&pt->num_samples, sizeof(pt->num_samples), key);
+    key = XXH64(&pt->num_samples, sizeof(pt->num_samples), key);
+    key = XXH64(&pt->adaptive, sizeof(pt->adaptive), key);
     if (key != p->options_key) {
         p->options_key = key;
         changes |= CHANGE_OPTIONS;
@@ -212,10 +264,11 @@ static int check_changes(pathtracer_t *pt)
     // Camera changes.
     key = 0;
     camera = goxel.image->active_camera;
-    key = XXH32(camera->view_mat, sizeof(camera->view_mat), 0);
-    key = XXH32(camera->proj_mat, sizeof(camera->proj_mat), key);
-    key = XXH32(&pt->w, sizeof(pt->w), key);
-    key = XXH32(&pt->h, sizeof(pt->h), key);
+    key = XXH64(camera->view_mat, sizeof(camera->view_mat), 0);
+    key = XXH64(camera->proj_mat, sizeof(camera->proj_mat), key);
+    key = XXH64(&pt->w, sizeof(pt->w), key);
+    key = XXH64(&pt->h, sizeof(pt->h), key);
+    key = XXH64(pt->region, sizeof(pt->region), key);
     if (key != p->camera_key) {
         p->camera_key = key;
         changes |= CHANGE_CAMERA;
@@ -260,46 +313,353 @@ static void update_camera(pathtracer_t *pt)
     }
 }
 
-static void update_scene(pathtracer_t *pt)
+static tile_key_t get_tile_key(const volume_t *volume,
+                               volume_accessor_t *accessor,
+                               const int tile_pos[3], int effects)
+{
+    tile_key_t key;
+    int i, x, y, z, p[3];
+
+    for (i = 0, z = -1; z <= 1; z++)
+    for (y = -1; y <= 1; y++)
+    for (x = -1; x <= 1; x++, i++) {
+        p[0] = tile_pos[0] + x * TILE_SIZE;
+        p[1] = tile_pos[1] + y * TILE_SIZE;
+        p[2] = tile_pos[2] + z * TILE_SIZE;
+        volume_get_tile_data(volume, accessor, p, &key[i]);
+    }
+    key[27] = effects;
+    return key;
+}
+
+// Index of a voxel face in a tile: faces are numbered axis * 2 + 1 for the
+// positive normals.
+static int get_face_index(int x, int y, int z, int axis, bool positive)
+{
+    return ((z * TILE_SIZE + y) * TILE_SIZE + x) * 6 + axis * 2 + positive;
+}
+
+// Map each quad of a tile shape to the voxel face it covers.
+static face_map_t create_face_map(const shape_data &shape)
+{
+    face_map_t faces;
+    int i, j, axis, v[3];
+    vec3f center, n;
+    const vec3f *pos;
+
+    for (i = 0; i < (int)shape.quads.size(); i++) {
+        pos = &shape.positions[shape.quads[i].x];
+        center = (pos[0] + pos[1] + pos[2] + pos[3]) / 4;
+        n = shape.normals[shape.quads[i].x];
+        axis = 0;
+        for (j = 1; j < 3; j++)
+            if (fabs(n[j]) > fabs(n[axis])) axis = j;
+        center[axis] -= n[axis] > 0 ? 0.5f : -0.5f;
+        for (j = 0; j < 3; j++) v[j] = (int)floor(center[j]);
+        faces[get_face_index(v[0], v[1], v[2], axis, n[axis] > 0)] = i;
+    }
+    return faces;
+}
+
+// Build the occupancy grid of a layer tiles.  The positions are in the
+// scene, that is the volume tiles positions moved by ofs.
+static voxel_grid_t create_voxel_grid(const volume_t *volume,
+                                      const array<int, 3> &ofs,
+                                      const vector<array<int, 3>> &pos,
+                                      const vector<int> &instances)
+{
+    voxel_grid_t grid = {};
+    volume_accessor_t accessor;
+    int i, j, c, hi[3], idx, tile_pos[3];
+    voxel_tile_t tile;
+    uint8_t (*voxels)[4];
+
+    if (pos.empty()) return grid;
+    for (j = 0; j < 3; j++) {
+        grid.lo[j] = pos[0][j];
+        hi[j] = pos[0][j];
+    }
+    for (i = 1; i < (int)pos.size(); i++) {
+        for (j = 0; j < 3; j++) {
+            grid.lo[j] = min(grid.lo[j], pos[i][j]);
+            hi[j] = max(hi[j], pos[i][j]);
+        }
+    }
+    for (j = 0; j < 3; j++)
+        grid.size[j] = (hi[j] - grid.lo[j]) / TILE_SIZE + 1;
+    grid.cells.assign(grid.size[0] * grid.size[1] * grid.size[2], -1);
+
+    accessor = volume_get_accessor(volume);
+    voxels = (uint8_t(*)[4])jobs_get_scratch(
+            TILE_SIZE * TILE_SIZE * TILE_SIZE * sizeof(*voxels));
+    for (i = 0; i < (int)pos.size(); i++) {
+        tile = {.instance = instances[i]};
+        for (j = 0; j < 3; j++) tile_pos[j] = pos[i][j] - ofs[j];
+        volume_get_tile_voxels(volume, &accessor, tile_pos, voxels);
+        for (j = 0; j < TILE_SIZE * TILE_SIZE * TILE_SIZE; j++) {
+            if (voxels[j][3] >= 127)
+                tile.mask[j / 64] |= (uint64_t)1 << (j % 64);
+        }
+        idx = 0;
+        for (c = 2; c >= 0; c--) {
+            idx = idx * grid.size[c] +
+                  (pos[i][c] - grid.lo[c]) / TILE_SIZE;
+        }
+        grid.cells[idx] = (int)grid.tiles.size();
+        grid.tiles.push_back(tile);
+    }
+    return grid;
+}
+
+/*
+ * Intersect a ray with a voxel grid, with a 3D DDA: we step from voxel to
+ * voxel inside the occupied tiles, and jump over the empty ones.  The hit
+ * is reported on the face through which the ray enters a solid voxel, using
+ * the matching quad of the tile shape so that the shading is the same as
+ * with the bvh traversal.
+ */
+static scene_intersection intersect_voxel_grid(
+        const pathtracer_internal_t *p, const voxel_grid_t &grid,
+        const ray3f &ray, bool find_any)
+{
+    int i, a, v[3], step[3], hi[3], tile[3], bit, face, entry;
+    float t, t0, t1, tn, tf, tnext[3], tdelta[3];
+    vec3f h, e1, e2;
+    const voxel_tile_t *vtile;
+    const instance_data *instance;
+    const shape_data *shape;
+    const vec3f *qpos;
+    face_map_t::const_iterator it;
+
+    if (grid.tiles.empty()) return {};
+
+    // Clip the ray to the grid box, keeping track of the entry axis.
+    t0 = ray.tmin;
+    t1 = ray.tmax;
+    entry = -1;
+    for (i = 0; i < 3; i++) {
+        hi[i] = grid.lo[i] + grid.size[i] * TILE_SIZE;
+        if (ray.d[i] == 0) {
+            if (ray.o[i] < grid.lo[i] || ray.o[i] > hi[i]) return {};
+            continue;
+        }
+        tn = (grid.lo[i] - ray.o[i]) / ray.d[i];
+        tf = (hi[i] - ray.o[i]) / ray.d[i];
+        if (tn > tf) swap(tn, tf);
+        if (tn > t0) {
+            t0 = tn;
+            entry = i;
+        }
+        t1 = min(t1, tf);
+    }
+    if (t0 > t1) return {};
+
+    t = t0;
+    for (i = 0; i < 3; i++) {
+        step[i] = ray.d[i] > 0 ? 1 : ray.d[i] < 0 ? -1 : 0;
+        v[i] = (int)floor(ray.o[i] + ray.d[i] * t);
+        if (i == entry) v[i] = step[i] > 0 ? grid.lo[i] : hi[i] - 1;
+        v[i] = clamp(v[i], grid.lo[i], hi[i] - 1);
+        tdelta[i] = step[i] ? fabs(1 / ray.d[i]) : flt_max;
+        tnext[i] = step[i] ? (v[i] + (step[i] > 0) - ray.o[i]) / ray.d[i]
+                           : flt_max;
+    }
+
+    while (true) {
+        for (i = 0; i < 3; i++)
+            tile[i] = (v[i] - grid.lo[i]) / TILE_SIZE;
+        a = grid.cells[(tile[2] * grid.size[1] + tile[1]) * grid.size[0] +
+                       tile[0]];
+
+        // Empty tile: jump directly to its exit.
+        if (a < 0) {
+            for (i = 0; i < 3; i++) {
+                tile[i] = grid.lo[i] + tile[i] * TILE_SIZE;
+                tnext[i] = step[i] ? (tile[i] + (step[i] > 0) * TILE_SIZE -
+                                      ray.o[i]) / ray.d[i] : flt_max;
+            }
+            a = 0;
+            for (i = 1; i < 3; i++) if (tnext[i] < tnext[a]) a = i;
+            t = tnext[a];
+            if (t > t1) return {};
+            for (i = 0; i < 3; i++) {
+                if (i == a) {
+                    v[i] = step[i] > 0 ? tile[i] + TILE_SIZE : tile[i] - 1;
+                } else {
+                    v[i] = clamp((int)floor(ray.o[i] + ray.d[i] * t),
+                                 tile[i], tile[i] + TILE_SIZE - 1);
+                }
+                tnext[i] = step[i] ? (v[i] + (step[i] > 0) - ray.o[i]) /
+                                     ray.d[i] : flt_max;
+            }
+            entry = a;
+            if (v[a] < grid.lo[a] || v[a] >= hi[a]) return {};
+            continue;
+        }
+
+        // Solid voxel entered from outside: look for its face quad.
+        vtile = &grid.tiles[a];
+        bit = (v[0] - grid.lo[0]) % TILE_SIZE +
+              (v[1] - grid.lo[1]) % TILE_SIZE * TILE_SIZE +
+              (v[2] - grid.lo[2]) % TILE_SIZE * TILE_SIZE * TILE_SIZE;
+        if (entry >= 0 && (vtile->mask[bit / 64] >> (bit % 64)) & 1) {
+            instance = &p->scene.instances[vtile->instance];
+            face = get_face_index(
+                    (v[0] - grid.lo[0]) % TILE_SIZE,
+                    (v[1] - grid.lo[1]) % TILE_SIZE,
+                    (v[2] - grid.lo[2]) % TILE_SIZE,
+                    entry, step[entry] < 0);
+            it = p->faces[instance->shape].find(face);
+            if (it != p->faces[instance->shape].end()) {
+                shape = &p->scene.shapes[instance->shape];
+                qpos = &shape->positions[shape->quads[it->second].x];
+                h = ray.o + ray.d * t - instance->frame.o;
+                e1 = qpos[1] - qpos[0];
+                e2 = qpos[3] - qpos[0];
+                return {vtile->instance, it->second,
+                        {clamp(dot(h - qpos[0], e1) / dot(e1, e1), 0.f, 1.f),
+                         clamp(dot(h - qpos[0], e2) / dot(e2, e2), 0.f, 1.f)},
+                        t, true};
+            }
+        }
+
+        // Step to the next voxel.
+        a = 0;
+        for (i = 1; i < 3; i++) if (tnext[i] < tnext[a]) a = i;
+        t = tnext[a];
+        if (t > t1) return {};
+        v[a] += step[a];
+        tnext[a] += tdelta[a];
+        entry = a;
+        if (v[a] < grid.lo[a] || v[a] >= hi[a]) return {};
+    }
+}
+
+// Closest intersection of a ray with all the voxel grids.
+static scene_intersection intersect_voxels(const pathtracer_internal_t *p,
+                                           ray3f ray, bool find_any)
+{
+    scene_intersection ret = {}, hit;
+    for (const voxel_grid_t &grid : p->grids) {
+        hit = intersect_voxel_grid(p, grid, ray, find_any);
+        if (!hit.hit) continue;
+        ret = hit;
+        if (find_any) break;
+        ray.tmax = hit.distance;
+    }
+    return ret;
+}
+
+// A new tile shape to generate.
+struct shape_job_t {
+    const volume_t  *volume;
+    int             tile_pos[3];
+    int             shape;
+};
+
+// A volume to add to the scene.  The instanced clones use the volume of
+// their base layer, moved by their translation.
+struct layer_source_t {
+    const volume_t      *volume;
+    array<int, 3>       ofs;
+    const material_t    *material;
+};
+
+// A tile instance waiting for its shape.
+struct tile_instance_t {
+    array<int, 3>   pos;    // Position in the scene.
+    int             shape;
+    int             material;
+    int             layer;  // Index of the layer source.
+};
+
+struct shapes_ctx_t {
+    pathtracer_internal_t   *p;
+    const vector<shape_job_t> *jobs;
+    vector<shape_bvh>       *bvhs;
+    int                     effects;
+};
+
+// Generate a new tile shape with its bvh or faces map.  Each job writes
+// into its own slot of the pre-sized shapes vectors.
+static void create_shape_job(void *user, int i, int worker)
+{
+    shapes_ctx_t *ctx = (shapes_ctx_t*)user;
+    pathtracer_internal_t *p = ctx->p;
+    const shape_job_t *job = &(*ctx->jobs)[i];
+    shape_data shape;
+
+    shape = create_shape_for_tile(job->volume, job->tile_pos, ctx->effects);
+    if (!shape.positions.empty()) {
+        if (p->use_voxels) {
+            p->faces[job->shape] = create_face_map(shape);
+        } else {
+            (*ctx->bvhs)[job->shape] = make_shape_bvh(
+                    shape, p->params.highqualitybvh);
+        }
+    }
+    p->scene.shapes[job->shape] = std::move(shape);
+}
+
+/*
+ * Rebuild the scene shapes and instances.
+ *
+ * The shapes and their bvh of the tiles that didn't change are moved from
+ * the previous scene, so we only generate the modified tiles.  Tiles with
+ * the same key, like repeated patterns or cloned layers, share a single
+ * shape with one instance each.  For the clones that are instances of
+ * their base layer, we iterate the base layer tiles and move their
+ * instances by the clone translation, so that a clone moved by any number
+ * of voxels still shares the shapes.  The light is set up by update_light.
+ *
+ * The new shapes are generated in parallel on the jobs pool, once we know
+ * all of them, and the empty ones are removed after.
+ *
+ * With the voxels traversal, the tiles are meshed without greedy meshing
+ * so that each quad matches a single voxel face, and we create the voxels
+ * grids instead of the tiles bvh.  Only the floor and the light, added
+ * first, go into the bvh.
+ */
+static void update_shapes(pathtracer_t *pt)
 {
     volume_iterator_t iter;
+    volume_accessor_t accessor;
     const volume_t *volume;
-    int tile_pos[3];
-    shape_data shape;
+    int i, nb, tile_pos[3], material, shape_id, effects;
     pathtracer_internal_t *p = pt->p;
-    const layer_t *layers, *layer;
-    float light_dir[3];
-    float ke;
-    const float d = 10000;
-    bool has_sun = false;
-    float turbidity = 3;
+    const layer_t *layers, *layer, *base;
     float pos[3];
     vec4f color;
-    image_data image;
+    tile_key_t key;
+    vector<shape_data> old_shapes = std::move(p->scene.shapes);
+    vector<shape_bvh> old_bvhs = std::move(p->bvh.bvh.shapes);
+    vector<face_map_t> old_faces = std::move(p->faces);
+    map<tile_key_t, int> old_tiles = std::move(p->tiles);
+    map<tile_key_t, int>::iterator it;
+    vector<shape_bvh> bvhs;
+    vector<shape_job_t> jobs;
+    vector<tile_instance_t> tiles;
+    vector<layer_source_t> sources;
+    vector<int> remap;
+    vector<vector<array<int, 3>>> grid_pos;
+    vector<vector<int>> grid_instances;
+    shapes_ctx_t ctx;
 
-    p->scene = {};
-    p->lights = {};
+    p->scene.shapes = {};
+    p->scene.instances = {};
+    p->scene.materials = {};
+    p->bvh = {};
+    p->tiles = {};
+    p->faces = {};
+    p->grids = {};
 
-    layers = goxel_get_render_layers(false);
-    DL_FOREACH(layers, layer) {
-        if (!layer->visible || !layer->volume) continue;
-        volume = layer->volume;
-        iter = volume_get_iterator(volume,
-                        VOLUME_ITER_TILES | VOLUME_ITER_INCLUDES_NEIGHBORS);
-        while (volume_iter(&iter, tile_pos)) {
-            shape = create_shape_for_tile(volume, tile_pos);
-            if (shape.positions.empty()) continue;
-            p->scene.shapes.push_back(shape);
-            p->scene.instances.push_back({
-                .frame = translation_frame({
-                        (float)tile_pos[0],
-                        (float)tile_pos[1],
-                        (float)tile_pos[2]}),
-                .shape = (int)(p->scene.shapes.size() - 1),
-                .material = add_material(pt, layer->material),
-            });
-        }
-    }
+    effects = goxel.rend.settings.effects;
+    p->use_voxels = pt->traversal == PT_TRAVERSAL_VOXELS &&
+                    !(effects & EFFECT_MARCHING_CUBES);
+    if (p->use_voxels)
+        effects &= ~EFFECT_GREEDY_MESH;
+    else
+        effects |= EFFECT_GREEDY_MESH;
 
     // Add the floor.
     if (pt->floor.type != PT_FLOOR_NONE) {
@@ -324,6 +684,8 @@ static void update_scene(pathtracer_t *pt)
             .normals = {{0, 0, 1}, {0, 0, 1}, {0, 0, 1}, {0, 0, 1}},
             .colors = {color, color, color, color},
         });
+        bvhs.push_back(make_shape_bvh(p->scene.shapes.back()));
+        p->faces.push_back({});
         p->scene.instances.push_back({
             .frame = translation_frame({pos[0], pos[1], pos[2]}) *
                       scaling_frame({(float)pt->floor.size[0],
@@ -333,69 +695,427 @@ static void update_scene(pathtracer_t *pt)
         });
     }
 
-    // Add the env.
-    if (pt->world.type != PT_WORLD_NONE) {
-        color[0] = pt->world.color[0] / 255.f;
-        color[1] = pt->world.color[1] / 255.f;
-        color[2] = pt->world.color[2] / 255.f;
-        color[3] = 1.0;
-        switch (pt->world.type) {
-        case PT_WORLD_UNIFORM:
-            image = image_data {1, 1, true, vector<vec4f>(1, color)};
-            break;
-        case PT_WORLD_SKY:
-            image = make_sunsky(512, 256, M_PI / 4, turbidity, has_sun,
-                                1.0f, 0, {color.x, color.y, color.z});
-            break;
-        default:
-            assert(false);
-            break;
-        }
-        p->scene.textures.push_back(image_to_texture(image));
-        p->scene.environments.push_back({
-            .frame = rotation_frame(vec3f{1, 0, 0}, M_PI / 2),
-            .emission = vec3f{1, 1, 1} * pt->world.energy,
-            .emission_tex = (int)p->scene.textures.size() - 1,
-        });
-    }
-
-    // Add the light.
-    ke = goxel.rend.light.intensity;
-    render_get_light_dir(&goxel.rend, light_dir);
-    p->scene.materials.push_back({
-        .emission = {ke *d * d, ke * d * d, ke * d * d}});
+    // Add the light, its position and emission are set in update_light.
+    p->scene.materials.push_back({});
+    p->light_material = (int)p->scene.materials.size() - 1;
     p->scene.shapes.push_back({
         .triangles = {{0, 1, 2}},
         .positions = {{0.0, 0.0, 0.0}, {1.0, 0.0, 0.0}, {1.0, 1.0, 0.0}, {0.0, 1.0, 2.0}},
     });
+    bvhs.push_back(make_shape_bvh(p->scene.shapes.back()));
+    p->faces.push_back({});
     p->scene.instances.push_back({
-        .frame = translation_frame(
-            {light_dir[0] * d, light_dir[1] * d, light_dir[2] * d}),
         .shape = (int)p->scene.shapes.size() - 1,
-        .material = (int)p->scene.materials.size() - 1,
+        .material = p->light_material,
+    });
+    p->light_instance = (int)p->scene.instances.size() - 1;
+    p->nb_bvh_instances = p->scene.instances.size();
+
+    // The render layers don't include the clones that we can add as
+    // instances of the shapes of their base layer.
+    layers = goxel_get_render_layers(false);
+    DL_FOREACH(layers, layer) {
+        if (!layer->visible || !layer->volume) continue;
+        sources.push_back({layer->volume, {0, 0, 0}, layer->material});
+    }
+    DL_FOREACH(goxel.image->layers, layer) {
+        base = image_get_instance_base(goxel.image, layer);
+        if (!base) continue;
+        sources.push_back({base->volume,
+                           {(int)layer->mat[3][0], (int)layer->mat[3][1],
+                            (int)layer->mat[3][2]},
+                           layer->material});
+    }
+
+    // First pass: find the shapes of all the tiles, and queue the new ones.
+    for (const layer_source_t &source : sources) {
+        volume = source.volume;
+        material = add_material(pt, source.material);
+        accessor = volume_get_neighbors_accessor(volume);
+        iter = volume_get_iterator(volume,
+                        VOLUME_ITER_TILES | VOLUME_ITER_INCLUDES_NEIGHBORS);
+        while (volume_iter(&iter, tile_pos)) {
+            key = get_tile_key(volume, &accessor, tile_pos, effects);
+            it = p->tiles.find(key);
+            if (it != p->tiles.end()) {
+                shape_id = it->second;
+            } else {
+                it = old_tiles.find(key);
+                if (it != old_tiles.end()) {
+                    shape_id = it->second;
+                    if (shape_id >= 0) {
+                        p->scene.shapes.push_back(
+                                std::move(old_shapes[shape_id]));
+                        bvhs.push_back(std::move(old_bvhs[shape_id]));
+                        p->faces.push_back(std::move(old_faces[shape_id]));
+                        shape_id = p->scene.shapes.size() - 1;
+                    }
+                } else {
+                    shape_id = p->scene.shapes.size();
+                    p->scene.shapes.push_back({});
+                    bvhs.push_back({});
+                    p->faces.push_back({});
+                    jobs.push_back({volume,
+                                    {tile_pos[0], tile_pos[1], tile_pos[2]},
+                                    shape_id});
+                }
+                p->tiles[key] = shape_id;
+            }
+            if (shape_id < 0) continue;
+            tiles.push_back({{tile_pos[0] + source.ofs[0],
+                              tile_pos[1] + source.ofs[1],
+                              tile_pos[2] + source.ofs[2]},
+                             shape_id, material,
+                             (int)(&source - sources.data())});
+        }
+    }
+
+    // Generate the new shapes in parallel.
+    ctx = {p, &jobs, &bvhs, effects};
+    jobs_parallel_for(jobs.size(), create_shape_job, &ctx);
+
+    // Remove the empty shapes.
+    remap.resize(p->scene.shapes.size());
+    for (i = 0, nb = 0; i < (int)p->scene.shapes.size(); i++) {
+        remap[i] = -1;
+        if (p->scene.shapes[i].positions.empty()) continue;
+        remap[i] = nb;
+        if (i != nb) {
+            p->scene.shapes[nb] = std::move(p->scene.shapes[i]);
+            bvhs[nb] = std::move(bvhs[i]);
+            p->faces[nb] = std::move(p->faces[i]);
+        }
+        nb++;
+    }
+    p->scene.shapes.resize(nb);
+    bvhs.resize(nb);
+    p->faces.resize(nb);
+    for (auto &tile : p->tiles) {
+        if (tile.second >= 0) tile.second = remap[tile.second];
+    }
+
+    // Second pass: add the tiles instances.
+    grid_pos.resize(sources.size());
+    grid_instances.resize(sources.size());
+    for (const tile_instance_t &tile : tiles) {
+        shape_id = remap[tile.shape];
+        if (shape_id < 0) continue;
+        p->scene.instances.push_back({
+            .frame = translation_frame({
+                    (float)tile.pos[0],
+                    (float)tile.pos[1],
+                    (float)tile.pos[2]}),
+            .shape = shape_id,
+            .material = tile.material,
+        });
+        grid_pos[tile.layer].push_back(tile.pos);
+        grid_instances[tile.layer].push_back(p->scene.instances.size() - 1);
+    }
+    if (p->use_voxels) {
+        for (i = 0; i < (int)sources.size(); i++) {
+            p->grids.push_back(create_voxel_grid(
+                        sources[i].volume, sources[i].ofs, grid_pos[i],
+                        grid_instances[i]));
+        }
+    }
+
+    // The light sampling still needs the bvh of the emissive shapes.
+    if (p->use_voxels) {
+        for (i = p->nb_bvh_instances; i < (int)p->scene.instances.size(); i++) {
+            shape_id = p->scene.instances[i].shape;
+            if (p->scene.materials[p->scene.instances[i].material].emission ==
+                    vec3f{0, 0, 0}) continue;
+            if (!bvhs[shape_id].bvh.nodes.empty()) continue;
+            bvhs[shape_id] = make_shape_bvh(p->scene.shapes[shape_id],
+                                            p->params.highqualitybvh);
+        }
+    } else {
+        p->nb_bvh_instances = p->scene.instances.size();
+    }
+
+    p->bvh.bvh.shapes = std::move(bvhs);
+    if (p->use_voxels) {
+        p->bvh.custom = [p](const ray3f &ray, bool find_any) {
+            return intersect_voxels(p, ray, find_any);
+        };
+    }
+    LOG_D("Pathtracer scene: %d instances for %d shapes",
+          (int)p->scene.instances.size(), (int)p->scene.shapes.size());
+}
+
+/*
+ * Build the top level bvh of the instances, reusing the shapes bvh.
+ *
+ * Yocto doesn't expose the instances bvh build alone, so we call
+ * make_scene_bvh on a proxy scene where each shape is replaced by the two
+ * corners of its bounding box.  With the voxels traversal, only the first
+ * nb_bvh_instances are added.
+ */
+static void update_instances_bvh(pathtracer_t *pt)
+{
+    pathtracer_internal_t *p = pt->p;
+    scene_data proxy = {};
+    scene_bvh sbvh;
+    bbox3f bbox;
+    int i;
+
+    proxy.instances.assign(p->scene.instances.begin(),
+                           p->scene.instances.begin() + p->nb_bvh_instances);
+    proxy.shapes.resize(p->scene.shapes.size());
+    for (i = 0; i < (int)proxy.shapes.size(); i++) {
+        if (p->bvh.bvh.shapes[i].bvh.nodes.empty()) continue;
+        bbox = p->bvh.bvh.shapes[i].bvh.nodes[0].bbox;
+        proxy.shapes[i] = {
+            .points = {0, 1},
+            .positions = {bbox.min, bbox.max},
+            .radius = {0, 0},
+        };
+    }
+    sbvh = make_scene_bvh(proxy, p->params.highqualitybvh, true);
+    p->bvh.bvh.bvh = std::move(sbvh.bvh);
+}
+
+static void update_light(pathtracer_t *pt)
+{
+    pathtracer_internal_t *p = pt->p;
+    float light_dir[3];
+    float ke;
+    const float d = 10000;
+
+    ke = goxel.rend.light.intensity;
+    render_get_light_dir(&goxel.rend, light_dir);
+    p->scene.materials[p->light_material] = {
+        .emission = {ke *d * d, ke * d * d, ke * d * d}};
+    p->scene.instances[p->light_instance].frame = translation_frame(
+            {light_dir[0] * d, light_dir[1] * d, light_dir[2] * d});
+}
+
+static void update_world(pathtracer_t *pt)
+{
+    pathtracer_internal_t *p = pt->p;
+    bool has_sun = false;
+    float turbidity = 3;
+    vec4f color;
+    image_data image;
+
+    p->scene.textures = {};
+    p->scene.environments = {};
+    if (pt->world.type == PT_WORLD_NONE) return;
+
+    color[0] = pt->world.color[0] / 255.f;
+    color[1] = pt->world.color[1] / 255.f;
+    color[2] = pt->world.color[2] / 255.f;
+    color[3] = 1.0;
+    switch (pt->world.type) {
+    case PT_WORLD_UNIFORM:
+        image = image_data {1, 1, true, vector<vec4f>(1, color)};
+        break;
+    case PT_WORLD_SKY:
+        image = make_sunsky(512, 256, M_PI / 4, turbidity, has_sun,
+                            1.0f, 0, {color.x, color.y, color.z});
+        break;
+    default:
+        assert(false);
+        break;
+    }
+    p->scene.textures.push_back(image_to_texture(image));
+    p->scene.environments.push_back({
+        .frame = rotation_frame(vec3f{1, 0, 0}, M_PI / 2),
+        .emission = vec3f{1, 1, 1} * pt->world.energy,
+        .emission_tex = (int)p->scene.textures.size() - 1,
     });
+}
+
+/*
+ * Apply the volume, light and world changes to the scene.
+ *
+ * Only the modified tiles get new shapes.  The light and world changes only
+ * touch the materials, environments and instances frames, so we just refit
+ * the bvh for them.
+ */
+static void update_scene(pathtracer_t *pt, int changes)
+{
+    pathtracer_internal_t *p = pt->p;
+    double t;
+
+    if (changes & CHANGE_VOLUME) {
+        t = sys_get_time();
+        update_shapes(pt);
+        pt->stats.shapes_time = sys_get_time() - t;
+    }
+    if (changes & (CHANGE_VOLUME | CHANGE_LIGHT))
+        update_light(pt);
+    if (changes & (CHANGE_VOLUME | CHANGE_WORLD))
+        update_world(pt);
 
-    p->bvh = make_trace_bvh(p->scene, p->params);
+    t = sys_get_time();
+    if (changes & CHANGE_VOLUME)
+        update_instances_bvh(pt);
+    else if (changes & CHANGE_LIGHT)
+        update_scene_bvh(p->bvh.bvh, p->scene, {p->light_instance}, {});
+    pt->stats.bvh_time = sys_get_time() - t;
     p->lights = make_trace_lights(p->scene, p->params);
 }
 
-static void update_preview(pathtracer_t *pt, const image_data &img)
+#if YOCTO_DENOISE
+
+// Denoise the render with Intel Open Image Denoise.
+static image_data denoise(const trace_state &state)
+{
+    return get_denoised_image(state);
+}
+
+#else
+
+struct denoise_ctx_t {
+    const trace_state *state;
+    const vector<vec4f> *src;
+    vector<vec4f> *dst;
+    int step;
+};
+
+// One pass of the a-trous filter, for a single row.
+static void denoise_row_job(void *user, int j, int worker)
+{
+    const denoise_ctx_t *ctx = (const denoise_ctx_t*)user;
+    const trace_state &state = *ctx->state;
+    const vector<vec4f> &src = *ctx->src;
+    const float kernel[5] = {1 / 16.f, 1 / 4.f, 3 / 8.f, 1 / 4.f, 1 / 16.f};
+    const int w = state.width, h = state.height;
+    int i, x, y, idx, qdx, n;
+    float weight, total, sigma, dl;
+    vec4f sum;
+    vec3f dn, da;
+
+    for (i = 0; i < w; i++) {
+        idx = j * w + i;
+        // Expected noise of the pixel luminance, from its variance.
+        n = state.counts[idx];
+        sigma = n > 1 ? sqrtf(state.moments[idx].y / (n * (n - 1.0f))) : 1;
+        sigma = 4 * sigma + 0.2f;
+        sum = {0, 0, 0, 0};
+        total = 0;
+        for (y = -2; y <= 2; y++)
+        for (x = -2; x <= 2; x++) {
+            qdx = clamp(j + y * ctx->step, 0, h - 1) * w +
+                  clamp(i + x * ctx->step, 0, w - 1);
+            dn = state.normal[idx] - state.normal[qdx];
+            da = state.albedo[idx] - state.albedo[qdx];
+            dl = luminance(xyz(src[idx])) - luminance(xyz(src[qdx]));
+            weight = kernel[x + 2] * kernel[y + 2] *
+                     expf(-dot(dn, dn) / 0.1f - dot(da, da) / 0.02f -
+                         fabs(dl) / sigma);
+            sum += src[qdx] * weight;
+            total += weight;
+        }
+        (*ctx->dst)[idx] = sum / total;
+    }
+}
+
+/*
+ * Denoise the render when we don't have OIDN: edge avoiding a-trous
+ * wavelet filter, guided by the albedo and normal buffers.  The luminance
+ * edges are kept according to the expected noise of each pixel.
+ */
+static image_data denoise(const trace_state &state)
+{
+    int i;
+    image_data image = get_image(state);
+    vector<vec4f> tmp(image.pixels.size());
+    denoise_ctx_t ctx = {&state};
+
+    for (i = 0; i < 4; i++) {
+        ctx.src = &image.pixels;
+        ctx.dst = &tmp;
+        ctx.step = 1 << i;
+        jobs_parallel_for(state.height, denoise_row_job, &ctx);
+        swap(image.pixels, tmp);
+    }
+    return image;
+}
+
+#endif
+
+// Size of the linear to sRGB bytes lookup table.
+#define SRGB_LUT_SIZE 4096
+
+struct preview_ctx_t {
+    pathtracer_t        *pt;
+    int                 w, h; // Size of the buffer.
+    const image_data    *img;
+    const vector<int>   *cols; // Source column of each destination column.
+    const uint8_t       *lut;
+};
+
+static void update_preview_row_job(void *user, int i, int worker)
 {
-    int i, j, pi, pj;
-    vec4b v;
-    vec4f srgb;
-
-    for (i = 0; i < pt->h; i++) {
-        for (j = 0; j < pt->w; j++) {
-            pi = i * img.height / pt->h;
-            pj = j * img.width / pt->w;
-            srgb = rgb_to_srgb(img[{pj, pi}]);
-            v = float_to_byte(srgb);
-            memcpy(&pt->buf[(i * pt->w + j) * 4], &v, 4);
+    const preview_ctx_t *ctx = (const preview_ctx_t*)user;
+    const pathtracer_t *pt = ctx->pt;
+    const vec4f *src;
+    uint8_t *dst = &pt->buf[i * ctx->w * 4];
+    int j, c;
+    float v;
+
+    src = &ctx->img->pixels[i * ctx->img->height / ctx->h * ctx->img->width];
+    for (j = 0; j < ctx->w; j++, dst += 4) {
+        const vec4f &p = src[(*ctx->cols)[j]];
+        for (c = 0; c < 3; c++) {
+            v = clamp(p[c], 0.f, 1.f);
+            dst[c] = ctx->lut[(int)(v * (SRGB_LUT_SIZE - 1) + 0.5f)];
         }
+        dst[3] = float_to_byte(p.w);
     }
 }
 
+/*
+ * Convert the linear render into the sRGB preview buffer, in parallel
+ * over the rows.  The sRGB conversion uses a lookup table.
+ */
+static void update_preview(pathtracer_t *pt, const image_data &img)
+{
+    static uint8_t lut[SRGB_LUT_SIZE];
+    static bool lut_initialized = false;
+    const int w = pt->region[2] ?: pt->w;
+    const int h = pt->region[3] ?: pt->h;
+    vector<int> cols(w);
+    preview_ctx_t ctx = {pt, w, h, &img, &cols, lut};
+    int i;
+
+    if (!lut_initialized) {
+        for (i = 0; i < SRGB_LUT_SIZE; i++)
+            lut[i] = float_to_byte(rgb_to_srgb(i / (SRGB_LUT_SIZE - 1.f)));
+        lut_initialized = true;
+    }
+    for (i = 0; i < w; i++) cols[i] = i * img.width / w;
+    jobs_parallel_for(h, update_preview_row_job, &ctx);
+}
+
+/*
+ * Update the rendering speed and time left estimations, and return whether
+ * we are done: all the samples are done, all the pixels converged with the
+ * adaptive sampling, or we reached the time limit.
+ */
+static bool update_stats(pathtracer_t *pt)
+{
+    pathtracer_internal_t *p = pt->p;
+    float elapsed = sys_get_time() - p->start_time;
+
+    pt->time_left = 0;
+    pt->stats.render_time = elapsed;
+    pt->stats.rays = get_trace_rays(p->state);
+    pt->stats.rays_per_sec = elapsed > 0 ? pt->stats.rays / elapsed : 0;
+    if (pt->samples >= pt->num_samples || p->state.active == 0)
+        return true;
+    if (pt->time_limit > 0 && elapsed >= pt->time_limit)
+        return true;
+    pt->samples_per_sec = elapsed > 0 ? pt->samples / elapsed : 0;
+    if (pt->samples_per_sec > 0)
+        pt->time_left = (pt->num_samples - pt->samples) / pt->samples_per_sec;
+    if (pt->time_limit > 0)
+        pt->time_left = min(pt->time_left, pt->time_limit - elapsed);
+    return false;
+}
+
 /*
  * Function: pathtracer_iter
  * Iter the rendering process of the current volume.
@@ -409,6 +1129,7 @@ void pathtracer_iter(pathtracer_t *pt, const float viewport[4])
     pathtracer_internal_t *p;
     int changes;
     image_data image;
+    double sync_time = 0;
 
     if (!pt->p) {
         pt->p = new pathtracer_internal_t {
@@ -432,31 +1153,46 @@ void pathtracer_iter(pathtracer_t *pt, const float viewport[4])
 
     pt->status = PT_RUNNING;
 
+    if (p->to_sync) {
+        sync_time = sys_get_time();
+        pt->stats.shapes_time = 0;
+        pt->stats.bvh_time = 0;
+    }
     if (p->to_sync & (CHANGE_VOLUME | CHANGE_WORLD | CHANGE_LIGHT)) {
-        update_scene(pt);
+        update_scene(pt, p->to_sync);
         p->to_sync |= CHANGE_CAMERA;
     }
 
     if (p->to_sync) {
         update_camera(pt);
         p->params.samples = pt->num_samples;
+        p->params.threads = pt->threads;
+        p->params.adaptive = pt->adaptive;
         p->params.resolution = max(pt->w, pt->h);
+        p->params.region = {pt->region[0], pt->region[1],
+                            pt->region[2], pt->region[3]};
         p->state = make_trace_state(p->scene, p->params);
         image = make_image(p->state.width, p->state.height, true);
         trace_preview(image, p->context, p->state, p->scene, p->bvh,
                       p->lights, p->params);
         update_preview(pt, image);
         p->to_sync = 0;
-    } else {
-        image = get_image(p->state);
+        p->start_time = sys_get_time();
+        pt->stats.sync_time = p->start_time - sync_time;
+    } else if (p->state.samples != p->preview_samples ||
+               pt->denoise != p->preview_denoise) {
+        image = pt->denoise ? denoise(p->state) : get_image(p->state);
         update_preview(pt, image);
     }
-    trace_start(p->context, p->state, p->scene, p->bvh, p->lights, p->params);
+    p->preview_samples = p->state.samples;
+    p->preview_denoise = pt->denoise;
 
     pt->samples = p->state.samples;
-    if (pt->samples == pt->num_samples) {
+    if (update_stats(pt)) {
         pt->status = PT_FINISHED;
+        return;
     }
+    trace_start(p->context, p->state, p->scene, p->bvh, p->lights, p->params);
 }
 
 
@@ -472,6 +1208,55 @@ void pathtracer_stop(pathtracer_t *pt)
     pt->p = nullptr;
 }
 
+void pathtracer_wait(pathtracer_t *pt)
+{
+    pathtracer_internal_t *p = pt->p;
+    if (!p || !p->context.worker.valid()) return;
+    p->context.worker.wait();
+}
+
+template <typename T>
+static uint64_t vector_mem(const vector<T>& v)
+{
+    return v.capacity() * sizeof(T);
+}
+
+static uint64_t bvh_mem(const bvh_tree& bvh)
+{
+    return vector_mem(bvh.nodes) + vector_mem(bvh.primitives);
+}
+
+uint64_t pathtracer_get_mem(const pathtracer_t *pt)
+{
+    const pathtracer_internal_t *p = pt->p;
+    uint64_t ret = 0;
+
+    // The scene is only modified by pathtracer_iter, so it is safe to read
+    // while the tracing thread runs.
+    if (!p) return 0;
+    for (const shape_data& shape : p->scene.shapes) {
+        ret += vector_mem(shape.points) + vector_mem(shape.lines) +
+               vector_mem(shape.triangles) + vector_mem(shape.quads) +
+               vector_mem(shape.positions) + vector_mem(shape.normals) +
+               vector_mem(shape.texcoords) + vector_mem(shape.colors) +
+               vector_mem(shape.radius) + vector_mem(shape.tangents);
+    }
+    ret += vector_mem(p->scene.instances);
+    ret += bvh_mem(p->bvh.bvh.bvh);
+    for (const shape_bvh& bvh : p->bvh.bvh.shapes) ret += bvh_mem(bvh.bvh);
+    ret += vector_mem(p->state.image) + vector_mem(p->state.albedo) +
+           vector_mem(p->state.normal) + vector_mem(p->state.hits) +
+           vector_mem(p->state.rngs) + vector_mem(p->state.denoised) +
+           vector_mem(p->state.counts) + vector_mem(p->state.moments);
+    for (const voxel_grid_t& grid : p->grids)
+        ret += vector_mem(grid.cells) + vector_mem(grid.tiles);
+    // Rough estimate of the hash maps nodes.
+    for (const face_map_t& faces : p->faces)
+        ret += faces.size() * (sizeof(face_map_t::value_type) + 16);
+    ret += p->tiles.size() * (sizeof(tile_key_t) + 48);
+    return ret;
+}
+
 #else // Dummy implementation.
 
 extern "C" {
@@ -480,5 +1265,7 @@ extern "C" {
 
 void pathtracer_iter(pathtracer_t *pt, const float viewport[4]) {}
 void pathtracer_stop(pathtracer_t *pt) {}
+void pathtracer_wait(pathtracer_t *pt) {}
+uint64_t pathtracer_get_mem(const pathtracer_t *pt) { return 0; }
 
 #endif // YOCTO
@@ -29,6 +29,12 @@ enum {
     PT_FLOOR_PLANE,
 };
 
+// How the rays are intersected with the voxels.
+enum {
+    PT_TRAVERSAL_BVH = 0,   // Bvh of the tiles meshes.
+    PT_TRAVERSAL_VOXELS,    // Direct traversal of the voxels grid.
+};
+
 enum {
     PT_STOPPED = 0,
     PT_RUNNING,
@@ -41,12 +47,29 @@ typedef struct pathtracer_internal pathtracer_internal_t;
 typedef struct {
     int status;
     uint8_t *buf;       // RGBA buffer.
-    int w, h;           // Size of the buffer.
+    int w, h;           // Size of the image.
+    int region[4];      // Region of the image to render (x, y, w, h), and
+                        // size of the buffer.  Zero size for the full image.
     bool force_restart;
     texture_t *texture;
     pathtracer_internal_t *p;
     int num_samples;
     int samples;
+    int traversal;      // One of the PT_TRAVERSAL enum values.
+    int threads;        // Number of threads, 0 for all the cores.
+    float adaptive;     // Adaptive sampling noise threshold, 0 to disable.
+    float time_limit;   // Stop after this many seconds, 0 for no limit.
+    bool denoise;       // Denoise the preview and the final image.
+    float samples_per_sec;  // Current rendering speed.
+    float time_left;        // Estimated time until the end, in seconds.
+    struct {
+        float sync_time;    // Time of the last scene update, in seconds.
+        float shapes_time;  // Part of it spent meshing the tiles.
+        float bvh_time;     // Part of it spent building the scene bvh.
+        float render_time;  // Time spent tracing since the last update.
+        double rays;        // Number of rays traced since the last update.
+        float rays_per_sec;
+    } stats;
     struct {
         int type;
         float energy;
@@ -74,3 +97,18 @@ void pathtracer_iter(pathtracer_t *pt, const float viewport[4]);
  * Stop the pathtracer thread if it is running.
  */
 void pathtracer_stop(pathtracer_t *pt);
+
+/*
+ * Function: pathtracer_wait
+ * Block until the current batch of samples is done.
+ *
+ * This is for the non interactive rendering, where we call <pathtracer_iter>
+ * in a loop.
+ */
+void pathtracer_wait(pathtracer_t *pt);
+
+/*
+ * Function: pathtracer_get_mem
+ * Estimate the memory used by the scene, the bvh and the render buffers.
+ */
+uint64_t pathtracer_get_mem(const pathtracer_t *pt);
@@ -0,0 +1,414 @@
+/* Goxel 3D voxels editor
+ *
+ * copyright (c) 2019 Guillaume Chereau <guillaume@noctua-software.com>
+ *
+ * Goxel is free software: you can redistribute it and/or modify it under the
+ * terms of the GNU General Public License as published by the Free Software
+ * Foundation, either version 3 of the License, or (at your option) any later
+ * version.
+
+ * Goxel is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+
+ * You should have received a copy of the GNU General Public License along with
+ * goxel.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "goxel.h"
+
+#include <errno.h> // IWYU pragma: keep.
+#include <pthread.h>
+#include <signal.h>
+
+// Number of frames we wait before reading back the GPU queries.
+#define GPU_FRAMES 4
+#define GPU_QUERIES 16
+
+typedef struct {
+    GLuint  id;
+    int     section;
+} gpu_query_t;
+
+static bool g_enabled = false;
+// Set in the thread calling profiler_new_frame, the only one recorded.
+static __thread bool g_is_main_thread = false;
+static double g_start[PROF_COUNT];
+static double g_times[PROF_COUNT]; // Current frame timings (sec).
+static float g_history[PROFILER_HISTORY][PROF_COUNT]; // Ring buffer (ms).
+static int g_nb_frames = 0;
+
+static struct {
+    gpu_query_t queries[GPU_QUERIES];
+    int         nb;
+} g_gpu_frames[GPU_FRAMES];
+static int g_gpu_frame = 0;
+static bool g_gpu_active = false;
+
+// Recorded trace events.
+#define TRACE_MAX_EVENTS 1024
+static struct {
+    bool        enabled;
+    double      start;
+    int         nb;
+    struct {
+        const char  *name;
+        bool        end;
+        double      time;
+    } events[TRACE_MAX_EVENTS];
+    // Names of the opened spans.
+    const char  *stack[32];
+    int         depth;
+} g_trace;
+
+// Ring buffers of the trace scopes, one per thread.
+#define SCOPES_RING_SIZE 8192
+typedef struct {
+    const char  *name;
+    double      start;
+    double      duration;
+} scope_event_t;
+
+typedef struct scopes_ring scopes_ring_t;
+struct scopes_ring {
+    scopes_ring_t *next;
+    int tid;
+    unsigned nb; // Total number of events written.
+    scope_event_t events[SCOPES_RING_SIZE];
+};
+static scopes_ring_t *g_rings = NULL;
+static pthread_mutex_t g_rings_mutex = PTHREAD_MUTEX_INITIALIZER;
+static __thread scopes_ring_t *g_ring = NULL;
+static volatile sig_atomic_t g_scopes_save_requested = 0;
+
+static const char *NAMES[PROF_COUNT] = {
+    [PROF_ITER]             = "Iter",
+    [PROF_TOOL]             = "Tool",
+    [PROF_RENDER_LAYERS]    = "Render layers",
+    [PROF_MESHING]          = "Meshing",
+    [PROF_SUBMIT]           = "Render submit",
+    [PROF_GPU_SHADOW]       = "GPU shadow",
+    [PROF_GPU_MAIN]         = "GPU main",
+};
+
+static bool is_gpu_section(int section)
+{
+    return section == PROF_GPU_SHADOW || section == PROF_GPU_MAIN;
+}
+
+static bool has_timer_query(void)
+{
+#ifdef GL_TIME_ELAPSED
+    static int ret = -1;
+    if (ret == -1) ret = gl_has_extension("GL_ARB_timer_query");
+    return ret;
+#else
+    return false;
+#endif
+}
+
+void profiler_set_enabled(bool enabled)
+{
+    g_enabled = enabled;
+}
+
+bool profiler_is_enabled(void)
+{
+    return g_enabled;
+}
+
+// Add the results of the queries issued GPU_FRAMES frames ago to the
+// current frame timings.
+static void read_gpu_queries(void)
+{
+#ifdef GL_TIME_ELAPSED
+    int i;
+    GLuint available;
+    GLuint64 ns;
+    typeof(g_gpu_frames[0]) *frame = &g_gpu_frames[g_gpu_frame];
+
+    for (i = 0; i < frame->nb; i++) {
+        GL(glGetQueryObjectuiv(frame->queries[i].id,
+                               GL_QUERY_RESULT_AVAILABLE, &available));
+        if (!available) continue;
+        GL(glGetQueryObjectui64v(frame->queries[i].id,
+                                 GL_QUERY_RESULT, &ns));
+        g_times[frame->queries[i].section] += ns / 1e9;
+    }
+    frame->nb = 0;
+#endif
+}
+
+void profiler_new_frame(void)
+{
+    int i;
+    char path[1024];
+
+    if (g_scopes_save_requested) {
+        g_scopes_save_requested = 0;
+        snprintf(path, sizeof(path), "%s/trace.json", sys_get_user_dir());
+        if (profiler_scopes_save(path) == 0)
+            LOG_I("Trace saved to %s", path);
+    }
+    g_is_main_thread = true;
+    if (!g_enabled) return;
+    g_gpu_frame = (g_gpu_frame + 1) % GPU_FRAMES;
+    read_gpu_queries();
+    for (i = 0; i < PROF_COUNT; i++) {
+        g_history[g_nb_frames % PROFILER_HISTORY][i] = g_times[i] * 1000;
+        g_times[i] = 0;
+    }
+    g_nb_frames++;
+}
+
+static void gpu_begin(int section)
+{
+#ifdef GL_TIME_ELAPSED
+    gpu_query_t *query;
+    typeof(g_gpu_frames[0]) *frame = &g_gpu_frames[g_gpu_frame];
+
+    if (!has_timer_query() || g_gpu_active) return;
+    if (frame->nb >= GPU_QUERIES) return;
+    query = &frame->queries[frame->nb];
+    if (!query->id) GL(glGenQueries(1, &query->id));
+    query->section = section;
+    GL(glBeginQuery(GL_TIME_ELAPSED, query->id));
+    g_gpu_active = true;
+#endif
+}
+
+static void gpu_end(int section)
+{
+#ifdef GL_TIME_ELAPSED
+    if (!g_gpu_active) return;
+    GL(glEndQuery(GL_TIME_ELAPSED));
+    g_gpu_frames[g_gpu_frame].nb++;
+    g_gpu_active = false;
+#endif
+}
+
+void profiler_begin(int section)
+{
+    if (!g_enabled || !g_is_main_thread) return;
+    if (is_gpu_section(section)) {
+        gpu_begin(section);
+        return;
+    }
+    g_start[section] = sys_get_time();
+}
+
+void profiler_end(int section)
+{
+    if (!g_is_main_thread) return;
+    // Always close the GPU queries, even if we got disabled meanwhile.
+    if (is_gpu_section(section)) {
+        gpu_end(section);
+        return;
+    }
+    if (!g_enabled) return;
+    if (g_start[section] == 0) return;
+    g_times[section] += sys_get_time() - g_start[section];
+    g_start[section] = 0;
+}
+
+const char *profiler_get_name(int section)
+{
+    return NAMES[section];
+}
+
+int profiler_get_history(int section, float *out)
+{
+    int i, n, first;
+    n = min(g_nb_frames, PROFILER_HISTORY);
+    first = g_nb_frames - n;
+    for (i = 0; i < n; i++)
+        out[i] = g_history[(first + i) % PROFILER_HISTORY][section];
+    return n;
+}
+
+int profiler_export_csv(const char *path)
+{
+    FILE *file;
+    int i, s, n = 0;
+    float values[PROF_COUNT][PROFILER_HISTORY];
+
+    file = fopen(path, "w");
+    if (!file) {
+        LOG_E("Cannot save to %s: %s", path, strerror(errno));
+        return -1;
+    }
+    fprintf(file, "frame");
+    for (s = 0; s < PROF_COUNT; s++) {
+        fprintf(file, ",%s (ms)", NAMES[s]);
+        n = profiler_get_history(s, values[s]);
+    }
+    fprintf(file, "\n");
+    for (i = 0; i < n; i++) {
+        fprintf(file, "%d", g_nb_frames - n + i);
+        for (s = 0; s < PROF_COUNT; s++)
+            fprintf(file, ",%.3f", values[s][i]);
+        fprintf(file, "\n");
+    }
+    fclose(file);
+    return 0;
+}
+
+void profiler_trace_start(void)
+{
+    g_trace.enabled = true;
+    g_trace.start = sys_get_time();
+    g_trace.nb = 0;
+    g_trace.depth = 0;
+}
+
+// Write a Chrome trace event, the duration is only used if positive.
+static void write_event(FILE *file, bool first, const char *name,
+                        const char *ph, double time, double duration, int tid)
+{
+    fprintf(file, "%s  {\"name\": \"%s\", \"ph\": \"%s\", \"ts\": %.0f, ",
+            first ? "" : ",\n", name, ph, time * 1000000);
+    if (duration >= 0)
+        fprintf(file, "\"dur\": %.0f, ", duration * 1000000);
+    fprintf(file, "\"pid\": 1, \"tid\": %d}", tid);
+}
+
+static void trace_add(const char *name, bool end)
+{
+    if (g_trace.nb >= TRACE_MAX_EVENTS) return;
+    g_trace.events[g_trace.nb].name = name;
+    g_trace.events[g_trace.nb].end = end;
+    g_trace.events[g_trace.nb].time = sys_get_time() - g_trace.start;
+    g_trace.nb++;
+}
+
+void profiler_trace_begin(const char *name)
+{
+    if (!g_trace.enabled) return;
+    if (g_trace.depth < ARRAY_SIZE(g_trace.stack))
+        g_trace.stack[g_trace.depth] = name;
+    g_trace.depth++;
+    trace_add(name, false);
+}
+
+void profiler_trace_end(void)
+{
+    if (!g_trace.enabled || !g_trace.depth) return;
+    g_trace.depth--;
+    if (g_trace.depth < ARRAY_SIZE(g_trace.stack))
+        trace_add(g_trace.stack[g_trace.depth], true);
+}
+
+int profiler_trace_save(const char *path)
+{
+    FILE *file;
+    int i;
+
+    // Close the spans still opened.
+    while (g_trace.depth) profiler_trace_end();
+    g_trace.enabled = false;
+
+    file = fopen(path, "w");
+    if (!file) {
+        LOG_E("Cannot save to %s: %s", path, strerror(errno));
+        return -1;
+    }
+    fprintf(file, "{\"traceEvents\": [\n");
+    for (i = 0; i < g_trace.nb; i++) {
+        write_event(file, i == 0, g_trace.events[i].name,
+                    g_trace.events[i].end ? "E" : "B",
+                    g_trace.events[i].time, -1, 1);
+    }
+    fprintf(file, "\n]}\n");
+    fclose(file);
+    return 0;
+}
+
+profiler_scope_t profiler_scope_begin(const char *name)
+{
+    return (profiler_scope_t){name, sys_get_time()};
+}
+
+void profiler_scope_end(profiler_scope_t *scope)
+{
+    scopes_ring_t *ring = g_ring;
+    unsigned i;
+
+    if (!ring) {
+        ring = g_ring = calloc(1, sizeof(*ring));
+        pthread_mutex_lock(&g_rings_mutex);
+        ring->tid = g_rings ? g_rings->tid + 1 : 1;
+        LL_PREPEND(g_rings, ring);
+        pthread_mutex_unlock(&g_rings_mutex);
+    }
+    i = ring->nb % SCOPES_RING_SIZE;
+    ring->events[i].name = scope->name;
+    ring->events[i].start = scope->start;
+    ring->events[i].duration = sys_get_time() - scope->start;
+    __atomic_store_n(&ring->nb, ring->nb + 1, __ATOMIC_RELEASE);
+}
+
+/*
+ * The rings are read while the other threads keep writing into them, so
+ * the oldest events of a busy thread might be overwritten as we save them.
+ * This is acceptable for a debug tool.
+ */
+int profiler_scopes_save(const char *path)
+{
+    FILE *file;
+    const scopes_ring_t *ring;
+    const scope_event_t *event;
+    unsigned i, nb, start;
+    double origin = DBL_MAX;
+    bool first = true;
+
+    file = fopen(path, "w");
+    if (!file) {
+        LOG_E("Cannot save to %s: %s", path, strerror(errno));
+        return -1;
+    }
+    pthread_mutex_lock(&g_rings_mutex);
+    // Use the oldest event as time origin, to keep the values small.
+    LL_FOREACH(g_rings, ring) {
+        nb = __atomic_load_n(&ring->nb, __ATOMIC_ACQUIRE);
+        start = nb > SCOPES_RING_SIZE ? nb - SCOPES_RING_SIZE : 0;
+        if (nb) origin = min(origin,
+                             ring->events[start % SCOPES_RING_SIZE].start);
+    }
+    fprintf(file, "{\"traceEvents\": [\n");
+    LL_FOREACH(g_rings, ring) {
+        nb = __atomic_load_n(&ring->nb, __ATOMIC_ACQUIRE);
+        start = nb > SCOPES_RING_SIZE ? nb - SCOPES_RING_SIZE : 0;
+        for (i = start; i < nb; i++) {
+            event = &ring->events[i % SCOPES_RING_SIZE];
+            write_event(file, first, event->name, "X",
+                        event->start - origin, event->duration, ring->tid);
+            first = false;
+        }
+    }
+    pthread_mutex_unlock(&g_rings_mutex);
+    fprintf(file, "\n]}\n");
+    fclose(file);
+    return 0;
+}
+
+void profiler_scopes_request_save(void)
+{
+    g_scopes_save_requested = 1;
+}
+
+void profiler_release_graphics(void)
+{
+#ifdef GL_TIME_ELAPSED
+    int i, j;
+    for (i = 0; i < GPU_FRAMES; i++) {
+        for (j = 0; j < GPU_QUERIES; j++) {
+            if (g_gpu_frames[i].queries[j].id)
+                GL(glDeleteQueries(1, &g_gpu_frames[i].queries[j].id));
+            g_gpu_frames[i].queries[j].id = 0;
+        }
+        g_gpu_frames[i].nb = 0;
+    }
+    g_gpu_active = false;
+#endif
+}
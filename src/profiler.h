@@ -0,0 +1,201 @@
+/* Goxel 3D voxels editor
+ *
+ * copyright (c) 2019 Guillaume Chereau <guillaume@noctua-software.com>
+ *
+ * Goxel is free software: you can redistribute it and/or modify it under the
+ * terms of the GNU General Public License as published by the Free Software
+ * Foundation, either version 3 of the License, or (at your option) any later
+ * version.
+
+ * Goxel is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+
+ * You should have received a copy of the GNU General Public License along with
+ * goxel.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Section: Profiler
+ * Per frame timings of the main parts of the code, shown in the debug
+ * panel.
+ *
+ * The CPU sections accumulate the time spent between each call to
+ * <profiler_begin> and <profiler_end> during a frame.  The GPU sections
+ * use timer queries, and since we don't want to wait for the results, they
+ * get recorded a few frames after the commands have been issued.
+ *
+ * Only the thread calling <profiler_new_frame> is recorded, so the work of
+ * the render thread doesn't show in the sections.
+ */
+
+#ifndef PROFILER_H
+#define PROFILER_H
+
+#include <stdbool.h>
+
+enum {
+    PROF_ITER,
+    PROF_TOOL,
+    PROF_RENDER_LAYERS,
+    PROF_MESHING,
+    PROF_SUBMIT,
+    PROF_GPU_SHADOW,
+    PROF_GPU_MAIN,
+
+    PROF_COUNT
+};
+
+// Number of frames kept in the history.
+#define PROFILER_HISTORY 128
+
+/*
+ * Function: profiler_set_enabled
+ * Start or stop the recording.  Disabled by default.
+ */
+void profiler_set_enabled(bool enabled);
+
+bool profiler_is_enabled(void);
+
+/*
+ * Function: profiler_new_frame
+ * Record the timings of the last frame and start a new one.
+ */
+void profiler_new_frame(void);
+
+/*
+ * Function: profiler_begin
+ * Start timing a CPU or GPU section.
+ *
+ * The GPU sections can't be nested into each other.
+ */
+void profiler_begin(int section);
+
+/*
+ * Function: profiler_end
+ * Stop timing a section started with <profiler_begin>.
+ */
+void profiler_end(int section);
+
+/*
+ * Function: profiler_get_name
+ * Return the display name of a section.
+ */
+const char *profiler_get_name(int section);
+
+/*
+ * Function: profiler_get_history
+ * Get the recorded timings of a section, in ms.
+ *
+ * Parameters:
+ *   section    - One of the PROF_ enum values.
+ *   out        - Get the values, from the oldest to the newest frame.
+ *                Must have at least PROFILER_HISTORY elements.
+ *
+ * Returns:
+ *   The number of values set.
+ */
+int profiler_get_history(int section, float *out);
+
+/*
+ * Function: profiler_export_csv
+ * Save the recorded history into a csv file, one line per frame.
+ *
+ * Returns:
+ *   Zero on success.
+ */
+int profiler_export_csv(const char *path);
+
+/*
+ * Function: profiler_release_graphics
+ * Delete the GPU queries, called before the graphics context is destroyed.
+ */
+void profiler_release_graphics(void);
+
+/*
+ * Section: Trace
+ * Timeline of nested spans, saved in the Chrome trace event format that
+ * can be opened in chrome://tracing or Perfetto.  Used for the startup,
+ * the spans are not recorded until <profiler_trace_start> is called.
+ */
+
+/*
+ * Function: profiler_trace_start
+ * Start recording the spans.  The times are relative to this call.
+ */
+void profiler_trace_start(void);
+
+/*
+ * Function: profiler_trace_begin
+ * Start a span.  The name must be a static string.
+ */
+void profiler_trace_begin(const char *name);
+
+/*
+ * Function: profiler_trace_end
+ * End the last started span.
+ */
+void profiler_trace_end(void);
+
+/*
+ * Function: profiler_trace_save
+ * Save the recorded spans into a json file, and stop the recording.
+ *
+ * Returns:
+ *   Zero on success.
+ */
+int profiler_trace_save(const char *path);
+
+/*
+ * Section: Trace scopes
+ * Spans of the hot code paths, recorded all the time into a ring buffer
+ * per thread, so that we can look at what happened during the last
+ * seconds when a frame was slow.
+ *
+ * Use TRACE_SCOPE("name") at the start of a block to record its time.  The
+ * name must be a static string.  Build with TRACE=0 to remove them.
+ */
+
+#ifndef TRACE
+#   define TRACE 1
+#endif
+
+typedef struct {
+    const char  *name;
+    double      start;
+} profiler_scope_t;
+
+profiler_scope_t profiler_scope_begin(const char *name);
+void profiler_scope_end(profiler_scope_t *scope);
+
+#define TRACE_CONCAT_(a, b) a##b
+#define TRACE_CONCAT(a, b) TRACE_CONCAT_(a, b)
+
+#if TRACE
+#   define TRACE_SCOPE(name) \
+        profiler_scope_t TRACE_CONCAT(trace_scope_, __LINE__) \
+            __attribute__((cleanup(profiler_scope_end), unused)) = \
+            profiler_scope_begin(name)
+#else
+#   define TRACE_SCOPE(name)
+#endif
+
+/*
+ * Function: profiler_scopes_save
+ * Save the content of the scopes ring buffers into a Chrome trace file.
+ *
+ * Returns:
+ *   Zero on success.
+ */
+int profiler_scopes_save(const char *path);
+
+/*
+ * Function: profiler_scopes_request_save
+ * Ask to save the scopes at the next frame, into the user directory.
+ *
+ * This is safe to call from a signal handler.
+ */
+void profiler_scopes_request_save(void);
+
+#endif // PROFILER_H
@@ -29,22 +29,11 @@ typedef struct {
     UT_array *values;
 } bucket_t;
 
-static void bucket_add(bucket_t *b, const uint8_t c[4], int n, bool check)
+static void bucket_add(bucket_t *b, const uint8_t c[4], int n)
 {
+    value_t v;
     assert(b->values);
-    int size = utarray_len(b->values);
-    value_t v, *values = (value_t*)utarray_front(b->values);
-    int i;
-
     assert(n);
-    if (check) {
-        for (i = 0; i < size; i++) {
-            if (memcmp(values[i].c, c, 4) == 0) {
-                values[i].n += n;
-                return;
-            }
-        }
-    }
     memcpy(v.c, c, 4);
     v.n = n;
     utarray_push_back(b->values, &v);
@@ -89,10 +78,10 @@ static void bucket_split(const bucket_t *bucket, bucket_t *a, bucket_t *b)
     utarray_new(b->values, &value_icd);
     for (i = 0, j = 0; i < size; i++) {
         if (j < nb / 2)
-            bucket_add(a, values[i].c, min(values[i].n, nb / 2 - j), false);
+            bucket_add(a, values[i].c, min(values[i].n, nb / 2 - j));
         j += values[i].n;
         if (j > nb / 2)
-            bucket_add(b, values[i].c, min(values[i].n, j - nb / 2), false);
+            bucket_add(b, values[i].c, min(values[i].n, j - nb / 2));
     }
 }
 
@@ -117,13 +106,99 @@ static void bucket_average_color(const bucket_t *b, uint8_t out[4])
     out[3] = s[3] / n;
 }
 
-static int bucket_cmp(const void *a_, const void *b_)
+static int color_cmp(const void *a_, const void *b_)
+{
+    const value_t *a = a_;
+    const value_t *b = b_;
+    return memcmp(a->c, b->c, 4);
+}
+
+/*
+ * Sort an array of colors and merge the duplicated ones, adding their
+ * counts.  Return the new size of the array.
+ */
+static int merge_values(value_t *values, int n)
+{
+    int i, j;
+    if (n == 0) return 0;
+    qsort(values, n, sizeof(*values), color_cmp);
+    for (i = 1, j = 0; i < n; i++) {
+        if (memcmp(values[i].c, values[j].c, 4) == 0) {
+            values[j].n += values[i].n;
+        } else {
+            values[++j] = values[i];
+        }
+    }
+    return j + 1;
+}
+
+// Histogram of the colors of each tile of a volume.
+typedef struct {
+    const volume_t *volume;
+    int (*tiles)[3];
+    value_t **values;   // Distinct colors of each tile.
+    int *nb_values;
+} histogram_ctx_t;
+
+static void histogram_tile_job(void *user, int i, int worker)
+{
+    histogram_ctx_t *ctx = user;
+    uint8_t (*voxels)[4];
+    value_t *values;
+    int j, n = 0;
+
+    voxels = jobs_get_scratch(TILE_SIZE * TILE_SIZE * TILE_SIZE * 4);
+    values = calloc(TILE_SIZE * TILE_SIZE * TILE_SIZE, sizeof(*values));
+    volume_get_tile_voxels(ctx->volume, NULL, ctx->tiles[i], voxels);
+    for (j = 0; j < TILE_SIZE * TILE_SIZE * TILE_SIZE; j++) {
+        if (voxels[j][3] < 127) continue;
+        memcpy(values[n].c, voxels[j], 3);
+        values[n].c[3] = 255;
+        values[n++].n = 1;
+    }
+    ctx->nb_values[i] = merge_values(values, n);
+    ctx->values[i] = values;
+}
+
+/*
+ * Fill a bucket with all the distinct opaque colors of a volume.
+ *
+ * We first get the colors of each tile in parallel, and then merge them.
+ */
+static void bucket_fill(bucket_t *bucket, const volume_t *volume)
 {
-    const bucket_t *a = (void*)a_;
-    const bucket_t *b = (void*)b_;
-    int na = a->values ? utarray_len(a->values) : -1;
-    int nb = b->values ? utarray_len(b->values) : -1;
-    return cmp(nb, na);
+    histogram_ctx_t ctx = {.volume = volume};
+    volume_iterator_t iter;
+    int i, nb_tiles = 0, pos[3], n = 0;
+    value_t *values;
+
+    iter = volume_get_iterator(volume, VOLUME_ITER_TILES);
+    while (volume_iter(&iter, pos)) {
+        ctx.tiles = realloc(ctx.tiles, (nb_tiles + 1) * sizeof(*ctx.tiles));
+        memcpy(ctx.tiles[nb_tiles++], pos, sizeof(pos));
+    }
+    ctx.values = calloc(nb_tiles, sizeof(*ctx.values));
+    ctx.nb_values = calloc(nb_tiles, sizeof(*ctx.nb_values));
+    jobs_parallel_for(nb_tiles, histogram_tile_job, &ctx);
+
+    for (i = 0; i < nb_tiles; i++) n += ctx.nb_values[i];
+    values = calloc(max(n, 1), sizeof(*values));
+    for (i = 0, n = 0; i < nb_tiles; i++) {
+        memcpy(values + n, ctx.values[i],
+               ctx.nb_values[i] * sizeof(*values));
+        n += ctx.nb_values[i];
+        free(ctx.values[i]);
+    }
+    n = merge_values(values, n);
+    utarray_new(bucket->values, &value_icd);
+    utarray_reserve(bucket->values, n);
+    for (i = 0; i < n; i++)
+        utarray_push_back(bucket->values, &values[i]);
+
+    free(values);
+    free(ctx.values);
+    free(ctx.nb_values);
+    free(ctx.tiles);
 }
 
 // Generate an optimal palette whith a fixed number of colors from a volume.
@@ -131,32 +206,23 @@ static int bucket_cmp(const void *a_, const void *b_)
 void quantization_gen_palette(const volume_t *volume, int nb,
                               uint8_t (*palette)[4])
 {
-    uint8_t v[4];
-    int i, pos[3];
+    int i, best, nb_buckets;
     bucket_t *buckets, b;
-    volume_iterator_t iter;
 
     buckets = calloc(nb, sizeof(*buckets));
-
-    // Fill the initial bucket.
-    utarray_new(buckets[0].values, &value_icd);
-    iter = volume_get_iterator(volume, VOLUME_ITER_VOXELS);
-    while (volume_iter(&iter, pos)) {
-        volume_get_at(volume, &iter, pos, v);
-        if (v[3] < 127) continue;
-        v[3] = 255;
-        bucket_add(&buckets[0], v, 1, true);
-    }
-
-    // Split until we get nb buckets.  I do it a bit stupidly, by sorting
-    // the buckets at every iterations!  I should use a stack!
-    while (!buckets[nb - 1].values) {
-        assert(!buckets[nb - 1].values);
-        b = buckets[0];
-        memset(&buckets[0], 0, sizeof(buckets[0]));
-        bucket_split(&b, &buckets[0], &buckets[nb - 1]);
+    bucket_fill(&buckets[0], volume);
+
+    // Split the bucket with the most colors until we get nb buckets.
+    for (nb_buckets = 1; nb_buckets < nb; nb_buckets++) {
+        best = 0;
+        for (i = 1; i < nb_buckets; i++) {
+            if (    utarray_len(buckets[i].values) >
+                    utarray_len(buckets[best].values))
+                best = i;
+        }
+        b = buckets[best];
+        bucket_split(&b, &buckets[best], &buckets[nb_buckets]);
         utarray_free(b.values);
-        qsort(buckets, nb, sizeof(*buckets), bucket_cmp);
     }
 
     // Fill the palette colors and cleanup.
@@ -0,0 +1,553 @@
+/* Goxel 3D voxels editor
+ *
+ * copyright (c) 2024 Guillaume Chereau <guillaume@noctua-software.com>
+ *
+ * Goxel is free software: you can redistribute it and/or modify it under the
+ * terms of the GNU General Public License as published by the Free Software
+ * Foundation, either version 3 of the License, or (at your option) any later
+ * version.
+
+ * Goxel is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+
+ * You should have received a copy of the GNU General Public License along with
+ * goxel.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "goxel.h"
+#include <errno.h>
+
+#include "../ext_src/stb/stb_ds.h"
+
+// For the zlib decompression.
+#include "stb_image.h"
+
+/*
+ * Region file format, version 1 (little endian):
+ *
+ *   4 bytes: magic string "GXRG"
+ *   4 bytes: version
+ *   4 bytes: number of tiles
+ *   for each tile, sorted by index:
+ *       4 bytes: index of the tile in the region (x + y * S + z * S * S)
+ *       4 bytes: size of the tile data
+ *   the data of all the tiles, in the same order: the zlib compressed
+ *   RGBA voxels.
+ *
+ * Empty tiles are not saved.
+ */
+
+#define VERSION 1
+#define HEADER_SIZE 12
+#define REGION_VOXELS (REGION_SIZE * TILE_SIZE)
+#define TILE_NB_VOXELS (TILE_SIZE * TILE_SIZE * TILE_SIZE)
+
+typedef struct {
+    uint32_t    idx;
+    uint32_t    ofs;    // Offset of the data in the file.
+    uint32_t    size;
+} region_entry_t;
+
+typedef struct {
+    UT_hash_handle  hh;
+    int             pos[3];     // Position of the first voxel.
+    region_entry_t  *entries;   // stb array, sorted by index.
+    bool            invalid;    // The file could not be parsed.
+} region_t;
+
+// A tile paged in the volume.
+typedef struct {
+    UT_hash_handle  hh;
+    int             pos[3];
+    uint64_t        id;         // Tile data id when it was last synced.
+    bool            dirty;
+    int             gen;
+} resident_t;
+
+struct region_store {
+    int         ref;
+    char        *path;
+    region_t    *regions;
+    resident_t  *resident;
+    int         window[2][3];
+    bool        has_window;
+    int         gen;
+};
+
+// A tile to write, or to page in.
+typedef struct {
+    int             pos[3];
+    uint32_t        idx;
+    resident_t      *resident;
+    const volume_t  *volume;
+    // Compressed data.
+    const uint8_t   *src;
+    uint8_t         *data;
+    int             size;
+    tile_data_t     *tile_data;
+} tile_item_t;
+
+// Iter all the regions positions that overlap a box.
+#define REGION_FOR_EACH(aabb, p) \
+    for (p[2] = aabb[0][2] & ~(REGION_VOXELS - 1); p[2] < aabb[1][2]; \
+         p[2] += REGION_VOXELS) \
+    for (p[1] = aabb[0][1] & ~(REGION_VOXELS - 1); p[1] < aabb[1][1]; \
+         p[1] += REGION_VOXELS) \
+    for (p[0] = aabb[0][0] & ~(REGION_VOXELS - 1); p[0] < aabb[1][0]; \
+         p[0] += REGION_VOXELS)
+
+static void get_region_pos(const int tile_pos[3], int out[3])
+{
+    int i;
+    for (i = 0; i < 3; i++) out[i] = tile_pos[i] & ~(REGION_VOXELS - 1);
+}
+
+static uint32_t get_tile_index(const int tile_pos[3])
+{
+    int i, p[3];
+    for (i = 0; i < 3; i++)
+        p[i] = (tile_pos[i] & (REGION_VOXELS - 1)) / TILE_SIZE;
+    return p[0] + p[1] * REGION_SIZE + p[2] * REGION_SIZE * REGION_SIZE;
+}
+
+static void get_tile_pos(const int region_pos[3], uint32_t idx, int out[3])
+{
+    out[0] = region_pos[0] + (idx % REGION_SIZE) * TILE_SIZE;
+    out[1] = region_pos[1] + (idx / REGION_SIZE % REGION_SIZE) * TILE_SIZE;
+    out[2] = region_pos[2] + (idx / (REGION_SIZE * REGION_SIZE)) * TILE_SIZE;
+}
+
+static bool tile_in_window(const int pos[3], const int window[2][3])
+{
+    int i;
+    if (!window) return true;
+    for (i = 0; i < 3; i++) {
+        if (pos[i] + TILE_SIZE <= window[0][i]) return false;
+        if (pos[i] >= window[1][i]) return false;
+    }
+    return true;
+}
+
+static void get_region_path(const region_store_t *store, const int pos[3],
+                            char *buf, size_t size)
+{
+    snprintf(buf, size, "%s/r.%d.%d.%d.gxr", store->path,
+             pos[0] / REGION_VOXELS, pos[1] / REGION_VOXELS,
+             pos[2] / REGION_VOXELS);
+}
+
+// Parse the tiles list of a region file.
+static int region_read_index(region_t *region, const reader_t *reader)
+{
+    reader_t r = *reader;
+    char magic[4];
+    uint32_t i, nb, ofs;
+    region_entry_t entry;
+
+    reader_read(&r, magic, 4);
+    if (strncmp(magic, "GXRG", 4) != 0) return -1;
+    if (reader_u32(&r) != VERSION) return -1;
+    nb = reader_u32(&r);
+    if (r.error || nb > REGION_SIZE * REGION_SIZE * REGION_SIZE) return -1;
+    ofs = HEADER_SIZE + nb * 8;
+    for (i = 0; i < nb; i++) {
+        entry.idx = reader_u32(&r);
+        entry.size = reader_u32(&r);
+        entry.ofs = ofs;
+        if (r.error) return -1;
+        if (entry.idx >= REGION_SIZE * REGION_SIZE * REGION_SIZE) return -1;
+        if (i && entry.idx <= region->entries[i - 1].idx) return -1;
+        if (entry.size > r.size - ofs) return -1;
+        ofs += entry.size;
+        arrput(region->entries, entry);
+    }
+    return 0;
+}
+
+static region_t *get_region(region_store_t *store, const int pos[3])
+{
+    region_t *region;
+    reader_t reader;
+    char path[1024];
+
+    HASH_FIND(hh, store->regions, pos, sizeof(region->pos), region);
+    if (region) return region;
+    region = calloc(1, sizeof(*region));
+    memcpy(region->pos, pos, sizeof(region->pos));
+    HASH_ADD(hh, store->regions, pos, sizeof(region->pos), region);
+
+    get_region_path(store, pos, path, sizeof(path));
+    if (reader_open(&reader, path) != 0) return region; // New region.
+    if (region_read_index(region, &reader) != 0) {
+        LOG_E("Invalid region file %s", path);
+        arrfree(region->entries);
+        region->invalid = true;
+    }
+    reader_close(&reader);
+    return region;
+}
+
+static resident_t *get_resident(region_store_t *store, const int pos[3],
+                                bool create)
+{
+    resident_t *res;
+    HASH_FIND(hh, store->resident, pos, sizeof(res->pos), res);
+    if (res || !create) return res;
+    res = calloc(1, sizeof(*res));
+    memcpy(res->pos, pos, sizeof(res->pos));
+    res->dirty = true;
+    HASH_ADD(hh, store->resident, pos, sizeof(res->pos), res);
+    return res;
+}
+
+static void remove_resident(region_store_t *store, resident_t *res)
+{
+    HASH_DEL(store->resident, res);
+    free(res);
+}
+
+region_store_t *region_store_open(const char *dir)
+{
+    region_store_t *store = calloc(1, sizeof(*store));
+    store->ref = 1;
+    store->path = strdup(dir);
+    return store;
+}
+
+region_store_t *region_store_ref(region_store_t *store)
+{
+    // The layers copies can be released from other threads.
+    __atomic_add_fetch(&store->ref, 1, __ATOMIC_ACQ_REL);
+    return store;
+}
+
+void region_store_release(region_store_t *store)
+{
+    region_t *region, *region_tmp;
+    resident_t *res, *res_tmp;
+
+    if (!store) return;
+    if (__atomic_sub_fetch(&store->ref, 1, __ATOMIC_ACQ_REL) > 0) return;
+    HASH_ITER(hh, store->regions, region, region_tmp) {
+        HASH_DEL(store->regions, region);
+        arrfree(region->entries);
+        free(region);
+    }
+    HASH_ITER(hh, store->resident, res, res_tmp) {
+        remove_resident(store, res);
+    }
+    free(store->path);
+    free(store);
+}
+
+const char *region_store_get_path(const region_store_t *store)
+{
+    return store->path;
+}
+
+static void encode_tile_job(void *user, int i, int worker)
+{
+    tile_item_t *item = (tile_item_t*)user + i;
+    uint8_t (*voxels)[4] = jobs_get_scratch(TILE_NB_VOXELS * 4);
+    int j;
+
+    volume_get_tile_voxels(item->volume, NULL, item->pos, voxels);
+    for (j = 0; j < TILE_NB_VOXELS; j++) {
+        if (voxels[j][3]) break;
+    }
+    if (j == TILE_NB_VOXELS) return; // Empty tile, remove it from the file.
+    item->data = img_zlib_compress((void*)voxels, TILE_NB_VOXELS * 4,
+                                   &item->size);
+}
+
+static void decode_tile_job(void *user, int i, int worker)
+{
+    tile_item_t *item = (tile_item_t*)user + i;
+    uint8_t (*voxels)[4] = jobs_get_scratch(TILE_NB_VOXELS * 4);
+    int size;
+
+    size = stbi_zlib_decode_buffer((char*)voxels, TILE_NB_VOXELS * 4,
+                                   (const char*)item->src, item->size);
+    if (size != TILE_NB_VOXELS * 4) return;
+    item->tile_data = volume_tile_data_new((const uint8_t (*)[4])voxels);
+}
+
+static bool write_u32(FILE *file, uint32_t v)
+{
+    return fwrite(&v, 4, 1, file) == 1;
+}
+
+/*
+ * Rewrite a region file with some new tiles.  The items are sorted by
+ * index and already encoded.  The data of the other tiles are copied from
+ * the previous file.
+ */
+static int region_write(region_store_t *store, region_t *region,
+                        const tile_item_t *items, int nb)
+{
+    char path[1024], tmp_path[1040];
+    reader_t old = {0};
+    FILE *file;
+    int i = 0, j = 0, k;
+    bool ok = true;
+    region_entry_t *entries = NULL, e;
+    const uint8_t **srcs = NULL;
+    uint32_t ofs;
+
+    get_region_path(store, region->pos, path, sizeof(path));
+    if (region->invalid) {
+        LOG_E("Cannot write into invalid region file %s", path);
+        return -1;
+    }
+    if (arrlen(region->entries) && reader_open(&old, path) != 0) {
+        LOG_E("Cannot read region file %s", path);
+        return -1;
+    }
+
+    // Merge the previous entries with the new tiles.
+    while (i < arrlen(region->entries) || j < nb) {
+        if (j == nb || (i < arrlen(region->entries) &&
+                        region->entries[i].idx < items[j].idx)) {
+            e = region->entries[i++];
+            arrput(entries, e);
+            arrput(srcs, old.data + e.ofs);
+            continue;
+        }
+        if (i < arrlen(region->entries) &&
+                region->entries[i].idx == items[j].idx) {
+            i++;
+        }
+        if (items[j].data) {
+            e = (region_entry_t){.idx = items[j].idx, .size = items[j].size};
+            arrput(entries, e);
+            arrput(srcs, items[j].data);
+        }
+        j++;
+    }
+
+    snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", path);
+    sys_make_dir(tmp_path);
+    file = fopen(tmp_path, "wb");
+    if (!file) {
+        LOG_E("Cannot save to %s: %s", tmp_path, strerror(errno));
+        reader_close(&old);
+        arrfree(entries);
+        arrfree(srcs);
+        return -1;
+    }
+    ok = fwrite("GXRG", 4, 1, file) == 1 &&
+         write_u32(file, VERSION) &&
+         write_u32(file, arrlen(entries));
+    ofs = HEADER_SIZE + arrlen(entries) * 8;
+    for (k = 0; ok && k < arrlen(entries); k++) {
+        ok = write_u32(file, entries[k].idx) &&
+             write_u32(file, entries[k].size);
+        entries[k].ofs = ofs;
+        ofs += entries[k].size;
+    }
+    for (k = 0; ok && k < arrlen(entries); k++) {
+        ok = fwrite(srcs[k], 1, entries[k].size, file) == entries[k].size;
+    }
+    if (fclose(file) != 0) ok = false;
+    reader_close(&old);
+    arrfree(srcs);
+
+    if (ok && rename(tmp_path, path) != 0) {
+        // Windows rename doesn't replace existing files.
+        remove(path);
+        ok = rename(tmp_path, path) == 0;
+    }
+    if (!ok) {
+        LOG_E("Cannot save to %s: %s", path, strerror(errno));
+        remove(tmp_path);
+        arrfree(entries);
+        return -1;
+    }
+    arrfree(region->entries);
+    region->entries = entries;
+    return 0;
+}
+
+static int item_cmp(const void *a_, const void *b_)
+{
+    const tile_item_t *a = a_, *b = b_;
+    int i, ra[3], rb[3];
+    get_region_pos(a->pos, ra);
+    get_region_pos(b->pos, rb);
+    for (i = 2; i >= 0; i--) {
+        if (ra[i] != rb[i]) return ra[i] < rb[i] ? -1 : +1;
+    }
+    return a->idx < b->idx ? -1 : a->idx > b->idx ? +1 : 0;
+}
+
+/*
+ * Write all the modified resident tiles, and mark them as synced.  The
+ * resident tiles outside the window are removed from the resident list,
+ * and their positions added to the evict array.
+ */
+static int store_sync(region_store_t *store, const volume_t *volume,
+                      const int window[2][3], int **evict)
+{
+    volume_iterator_t iter;
+    int i, j, pos[3], rpos[3], ret = 0;
+    uint64_t id;
+    resident_t *res, *res_tmp;
+    tile_item_t *items = NULL, item;
+    region_t *region;
+    bool inside;
+
+    store->gen++;
+    iter = volume_get_iterator(volume, VOLUME_ITER_TILES);
+    while (volume_iter(&iter, pos)) {
+        res = get_resident(store, pos, true);
+        res->gen = store->gen;
+        volume_get_tile_data(volume, NULL, pos, &id);
+        if (id != res->id) res->dirty = true;
+        res->id = id;
+    }
+    // Resident tiles that are not in the volume anymore got deleted, they
+    // are written as empty.
+    HASH_ITER(hh, store->resident, res, res_tmp) {
+        if (res->gen != store->gen) res->dirty = true;
+        if (!res->dirty) continue;
+        item = (tile_item_t) {
+            .idx = get_tile_index(res->pos),
+            .resident = res,
+            .volume = volume,
+        };
+        memcpy(item.pos, res->pos, sizeof(item.pos));
+        arrput(items, item);
+    }
+    if (items) qsort(items, arrlen(items), sizeof(*items), item_cmp);
+    jobs_parallel_for(arrlen(items), encode_tile_job, items);
+
+    for (i = 0; i < arrlen(items); i = j) {
+        get_region_pos(items[i].pos, rpos);
+        for (j = i + 1; j < arrlen(items); j++) {
+            get_region_pos(items[j].pos, pos);
+            if (memcmp(pos, rpos, sizeof(pos)) != 0) break;
+        }
+        region = get_region(store, rpos);
+        if (region_write(store, region, items + i, j - i) != 0) {
+            ret = -1;
+            continue;
+        }
+        for (; i < j; i++) items[i].resident->dirty = false;
+    }
+
+    // Forget the tiles that are synced and out of the volume or the window.
+    HASH_ITER(hh, store->resident, res, res_tmp) {
+        if (res->dirty) continue;
+        inside = tile_in_window(res->pos, window);
+        if (res->gen == store->gen && inside) continue;
+        if (res->gen == store->gen && evict) {
+            for (i = 0; i < 3; i++) arrput(*evict, res->pos[i]);
+        }
+        remove_resident(store, res);
+    }
+
+    for (i = 0; i < arrlen(items); i++) free(items[i].data);
+    arrfree(items);
+    return ret;
+}
+
+// Page in all the stored tiles of the window that are not resident yet.
+static void store_load(region_store_t *store, volume_t *volume,
+                       const int window[2][3])
+{
+    int i, rpos[3];
+    region_t *region;
+    reader_t reader;
+    char path[1024];
+    tile_item_t *items = NULL, item;
+    resident_t *res;
+    bool error = false;
+
+    REGION_FOR_EACH(window, rpos) {
+        region = get_region(store, rpos);
+        if (!arrlen(region->entries)) continue;
+        for (i = 0; i < arrlen(region->entries); i++) {
+            item = (tile_item_t) {
+                .idx = region->entries[i].idx,
+                .size = region->entries[i].size,
+            };
+            get_tile_pos(rpos, item.idx, item.pos);
+            if (!tile_in_window(item.pos, window)) continue;
+            if (get_resident(store, item.pos, false)) continue;
+            // Store the offset for now, we set the pointer once the file
+            // is open.
+            item.src = (void*)(uintptr_t)region->entries[i].ofs;
+            arrput(items, item);
+        }
+        if (!arrlen(items)) continue;
+
+        get_region_path(store, rpos, path, sizeof(path));
+        if (reader_open(&reader, path) != 0) {
+            LOG_E("Cannot read region file %s", path);
+            arrsetlen(items, 0);
+            continue;
+        }
+        for (i = 0; i < arrlen(items); i++) {
+            items[i].src = reader.data + (uintptr_t)items[i].src;
+        }
+        jobs_parallel_for(arrlen(items), decode_tile_job, items);
+        for (i = 0; i < arrlen(items); i++) {
+            if (!items[i].tile_data) {
+                error = true;
+                continue;
+            }
+            volume_set_tile_data(volume, items[i].pos, items[i].tile_data);
+            volume_tile_data_release(items[i].tile_data);
+            res = get_resident(store, items[i].pos, true);
+            volume_get_tile_data(volume, NULL, items[i].pos, &res->id);
+            res->dirty = false;
+        }
+        if (error) LOG_E("Invalid tiles in region file %s", path);
+        error = false;
+        reader_close(&reader);
+        arrsetlen(items, 0);
+    }
+    arrfree(items);
+}
+
+int region_store_update(region_store_t *store, volume_t *volume,
+                        const int window[2][3])
+{
+    int i, ret, *evict = NULL;
+
+    if (    store->has_window &&
+            memcmp(store->window, window, sizeof(store->window)) == 0) {
+        return 0;
+    }
+    ret = store_sync(store, volume, window, &evict);
+    for (i = 0; i < arrlen(evict); i += 3)
+        volume_clear_tile(volume, NULL, evict + i);
+    arrfree(evict);
+    store_load(store, volume, window);
+    memcpy(store->window, window, sizeof(store->window));
+    store->has_window = true;
+    return ret;
+}
+
+int region_store_flush(region_store_t *store, const volume_t *volume)
+{
+    return store_sync(store, volume, NULL, NULL);
+}
+
+void region_store_reset(region_store_t *store, const volume_t *volume)
+{
+    resident_t *res, *res_tmp;
+    volume_iterator_t iter;
+    int pos[3];
+
+    HASH_ITER(hh, store->resident, res, res_tmp) {
+        remove_resident(store, res);
+    }
+    iter = volume_get_iterator(volume, VOLUME_ITER_TILES);
+    while (volume_iter(&iter, pos)) {
+        get_resident(store, pos, true);
+    }
+    store->has_window = false;
+}
@@ -0,0 +1,108 @@
+/* Goxel 3D voxels editor
+ *
+ * copyright (c) 2024 Guillaume Chereau <guillaume@noctua-software.com>
+ *
+ * Goxel is free software: you can redistribute it and/or modify it under the
+ * terms of the GNU General Public License as published by the Free Software
+ * Foundation, either version 3 of the License, or (at your option) any later
+ * version.
+
+ * Goxel is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+
+ * You should have received a copy of the GNU General Public License along with
+ * goxel.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* ######## Section: Region store #########################################
+ * On disk storage of the tiles of a volume, to edit volumes that do not fit
+ * in memory.
+ *
+ * The tiles are saved into region files of REGION_SIZE^3 tiles, each tile
+ * compressed separately.  Only the tiles inside a window are kept in the
+ * volume: when the window moves the tiles that leave it are written back to
+ * the disk if they changed, and removed from the volume, while the stored
+ * tiles that enter it are paged in.  The paged in tiles are regular volume
+ * tiles, so the tools and the rendering don't need to know about the store.
+ *
+ * The volume is the reference for all the tiles paged in: a tile that got
+ * removed from the volume is considered deleted.
+ */
+
+#ifndef REGION_H
+#define REGION_H
+
+#include "volume.h"
+
+// Size of the region files, in tiles.
+#define REGION_SIZE 32
+
+typedef struct region_store region_store_t;
+
+/*
+ * Function: region_store_open
+ * Open a store in a directory, creating it if needed.
+ *
+ * The returned store has a single reference, to release with
+ * <region_store_release>.
+ */
+region_store_t *region_store_open(const char *dir);
+
+/*
+ * Function: region_store_ref
+ * Add a reference to a store.
+ */
+region_store_t *region_store_ref(region_store_t *store);
+
+/*
+ * Function: region_store_release
+ * Release a reference to a store.  This does not write the modified tiles,
+ * see <region_store_flush>.
+ */
+void region_store_release(region_store_t *store);
+
+/*
+ * Function: region_store_get_path
+ * Return the directory of a store.
+ */
+const char *region_store_get_path(const region_store_t *store);
+
+/*
+ * Function: region_store_update
+ * Move the window of resident tiles of a volume.
+ *
+ * Parameters:
+ *   store  - The store.
+ *   volume - The volume backed by the store.
+ *   window - Box of the tiles to keep in the volume, as its min (included)
+ *            and max (excluded) corners.
+ *
+ * Return:
+ *   0 on success, -1 if some tiles could not be written.  In that case
+ *   the tiles are kept in the volume.
+ */
+int region_store_update(region_store_t *store, volume_t *volume,
+                        const int window[2][3]);
+
+/*
+ * Function: region_store_flush
+ * Write all the modified tiles of a volume to the disk.
+ *
+ * Return:
+ *   0 on success, -1 if some tiles could not be written.
+ */
+int region_store_flush(region_store_t *store, const volume_t *volume);
+
+/*
+ * Function: region_store_reset
+ * Forget the state of the resident tiles, after the volume got replaced.
+ *
+ * All the tiles of the new volume are considered modified, and the tiles
+ * that are not in it will be paged in again from the disk.  This is used
+ * after an undo.
+ */
+void region_store_reset(region_store_t *store, const volume_t *volume);
+
+#endif // REGION_H
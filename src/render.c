@@ -20,7 +20,14 @@
 #include "goxel.h"
 
 #include "shader_cache.h"
+#include "xxhash.h"
 
+#include <errno.h> // IWYU pragma: keep.
+#include <inttypes.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+// Size of the meshes cache, used if we cannot query the video memory.
 #ifndef RENDER_CACHE_SIZE
 #   define RENDER_CACHE_SIZE (1 * GB)
 #endif
@@ -43,43 +50,117 @@ enum {
     ITEM_VOLUME = 1,
     ITEM_MODEL3D,
     ITEM_GRID,
+    ITEM_SHAPE,
 };
 
 typedef struct {
     uint64_t ids[27];
     int effects;
+    int lod;
 } tile_item_key_t;
 
+enum {
+    TILES_FILTER_INCLUDE = 1,   // Only render the listed tiles.
+    TILES_FILTER_EXCLUDE,       // Render all the tiles but the listed ones.
+};
+
+// Subset of the tiles of a volume item, see <render_volume_overlay>.
+typedef struct {
+    int         mode;       // 0 or one of the TILES_FILTER values.
+    int         nb;
+    int         (*pos)[3];  // Sorted with pos_cmp.
+} tiles_filter_t;
+
 struct render_item_t
 {
     render_item_t   *next, *prev;   // The rendering queue.
     int             type;
     tile_item_key_t key;
 
-    union {
-        volume_t        *volume;
-        float           mat[4][4];
-    };
+    volume_t        *volume;
+    tiles_filter_t  filter;         // Tiles of the volume to render.
+    float           mat[4][4];      // Model matrix of the volume items.
     material_t      material;
     uint8_t         color[4];
     float           clip_box[4][4];
     bool            proj_screen; // Render with a 2d proj.
     model3d_t       *model3d;
     texture_t       *tex;
+    const shape_t   *shape;
     int             effects;
 
-    GLuint      vertex_buffer;
+    int         page;           // Vertex page of the tile mesh.
+    int         slot;           // First slot in the page.
+    int         nb_slots;
     int         size;           // 4 (quads) or 3 (triangles).
     int         nb_elements;    // Number of quads or triangle.
     int         subdivide;      // Unit per voxel (usually 1).
+    int         lod;            // The mesh unit is 2^lod voxels.
+    // Rest of a tile mesh too big to fit in a single vertex page.
+    render_item_t *part;
 };
 
+// The items added during a frame are allocated from the frame arena, and
+// released all at once at the end of the frame.
+static render_item_t *frame_item_new(void)
+{
+    return frame_alloc(sizeof(render_item_t));
+}
+
+// Batch model used to render several items with a single draw call.
+static model3d_t *g_batch_model = NULL;
+
 // The buffered item hash table.  For the moment it is only used of the tiles.
 // static render_item_t *g_items = NULL;
 
 // The cache of the g_items.
 static cache_t   *g_items_cache;
-static const int BATCH_QUAD_COUNT = 1 << 14;
+
+/*
+ * The tiles of a volume, with the data ids of their neighbors, in the
+ * volume iteration order.  Cached by volume key, so that rendering an
+ * unchanged volume doesn't need to look up the 27 tiles around each tile.
+ */
+typedef struct {
+    int         pos[3];
+    uint64_t    ids[27];
+} tile_neighbors_t;
+
+typedef struct {
+    int                 nb;
+    tile_neighbors_t    *tiles;
+} volume_tiles_t;
+
+static cache_t   *g_tiles_cache;
+
+// Get an item of one of the render caches.  The evicted items are only
+// deleted by cache_collect, at the start of each render with the render
+// mutex held, so the data stays valid until the end of the render.
+static void *render_cache_get(cache_t *cache, const void *key, int keylen)
+{
+    cache_item_t *ref;
+    void *data = cache_acquire(cache, key, keylen, &ref);
+    cache_release(cache, ref);
+    return data;
+}
+
+// Position of the tiles rendered in the last picking pass, by tile id - 1.
+static int (*g_pick_tiles)[3] = NULL;
+static int g_pick_tiles_nb = 0;
+static int g_pick_tiles_capacity = 0;
+// The tiles ids are stored on PICK_POS_SHIFT + 1 bits in the picking
+// buffer, see PICK_POS_SHIFT.
+static const int PICK_TILES_MAX = (1 << (PICK_POS_SHIFT + 1)) - 1;
+
+// The picking shader needs to know which channels the pos data bytes go to.
+static const shader_define_t PICK_DEFINES[] = {
+    {"POS_DATA_3_BYTES", PICK_POS_BYTES == 3},
+    {},
+};
+
+// Number of quads in a vertex page: as many as we can address with the
+// 16 bits indices.
+static const int BATCH_QUAD_COUNT = (1 << 16) / 4;
 static model3d_t *g_cube_model;
 static model3d_t *g_line_model;
 static model3d_t *g_wire_cube_model;
@@ -93,10 +174,382 @@ static GLuint g_index_buffer;
 static GLuint g_background_array_buffer;
 static GLuint g_occlusion_tex;
 static GLuint g_bump_tex;
-static GLuint g_shadow_map_fbo;
-static texture_t *g_shadow_map; // XXX: the fbo should be part of the tex.
+// The framebuffers and the queries are not shared between the OpenGL
+// contexts, so the objects using them are per thread, see
+// release_context_objects.
+static __thread GLuint g_shadow_map_fbo;
+// XXX: the fbo should be part of the tex.
+static __thread texture_t *g_shadow_map;
+// Key of the volumes and light used for the current shadow map, and its
+// projection matrix.  Zero if the shadow map needs to be rendered again.
+static __thread uint32_t g_shadow_map_key = 0;
+static __thread float g_shadow_map_mvp[4][4];
+// Number of tiles not rendered because their mesh is not ready yet.
+static int g_missing_tiles = 0;
+
+// The 3d view can be rendered in a separate thread, with its own context
+// sharing the objects of the main one, see render_thread_start.  The
+// contexts wait for each other commands with fences.
+#if !defined(GLES2) && !defined(__EMSCRIPTEN__) && \
+        defined(GL_SYNC_GPU_COMMANDS_COMPLETE)
+#   define HAS_RENDER_THREAD 1
+#else
+#   define HAS_RENDER_THREAD 0
+#endif
+
+// Held during all the renders, since the render thread shares the caches,
+// the vertex pages and the mesh tasks with the main thread.
+static pthread_mutex_t g_render_mutex = PTHREAD_MUTEX_INITIALIZER;
+// Set in the render thread.
+static __thread bool g_in_render_thread = false;
+
+// Weighted blended order independent transparency needs float render
+// targets and framebuffer blits.
+#if !defined(GLES2) && defined(GL_RGBA16F) && defined(GL_READ_FRAMEBUFFER)
+#   define HAS_OIT 1
+#else
+#   define HAS_OIT 0
+#endif
+
+/*
+ * Buffers of the order independent transparency pass, see oit_begin.
+ *
+ * The transparent volumes are all blended into two float targets, with a
+ * weight decreasing with the depth:
+ *   accum  - rgb: sum of the weighted premultiplied colors.
+ *            a:   product of the (1 - alpha), or revealage.
+ *   weight - r:   sum of the weighted alphas.
+ * Both use the same blend function, so we don't need per target blending.
+ */
+static __thread struct {
+    GLuint  fbo;
+    GLuint  accum;
+    GLuint  weight;
+    GLuint  depth;
+    int     w, h;
+    bool    failed;     // Set if the depth copy is not supported.
+    bool    active;     // Set while rendering into the buffers.
+} g_oit = {};
+
+// The raymarching renderer needs 3D textures.
+#if !defined(GLES2) && defined(GL_TEXTURE_3D)
+#   define HAS_RAYMARCH 1
+#else
+#   define HAS_RAYMARCH 0
+#endif
+
+/*
+ * Atlas of the tiles voxels used by the raymarching renderer.
+ *
+ * The RGBA voxels of the tiles are uploaded into the slots of a 3D
+ * texture, and the slots are looked up by tile data id, so that a tile
+ * only gets uploaded again when it changes.  When the atlas is full we
+ * reuse the least recently used slot, but never one used in the current
+ * frame.
+ */
+#define ATLAS_SIZE 256 // In texels, along x and y.  Half of it along z.
+
+typedef struct {
+    UT_hash_handle  hh;
+    uint64_t        id;         // Tile data id, or zero if free.
+    int             frame;      // Last frame the slot got used.
+    int             pos[3];     // Position in the atlas, in texels.
+} atlas_slot_t;
+
+static struct {
+    GLuint          tex;
+    int             nb;
+    atlas_slot_t    *slots;
+    atlas_slot_t    *table;     // The used slots, by tile data id.
+} g_atlas = {};
+
+/*
+ * The tiles vertices are sub-allocated from big shared buffers, so that
+ * consecutive tiles can be drawn without binding a new buffer and setting
+ * all the attributes again.  A page is divided into slots of four vertices
+ * (one quad), and contains BATCH_QUAD_COUNT slots, so that the shared index
+ * buffer can address any quad of the page with an index offset.
+ */
+typedef struct {
+    GLuint  buffer;
+    bool    packed;         // Contains packed_vertex_t.
+    int     nb_free;
+    int     (*free)[2];     // Sorted free ranges of slots: start, size.
+} vertex_page_t;
+static vertex_page_t *g_pages = NULL;
+static int g_nb_pages = 0;
+
+/*
+ * Compact vertex used for the quads meshes.  The normal, tangent and uv
+ * only depend on the face and the corner of the quad, and the occlusion and
+ * bump texture coordinates on the face masks, so the shader can compute
+ * them itself.  This is less than half the size of voxel_vertex_t.
+ */
+typedef struct {
+    uint8_t  pos[3];
+    uint8_t  face;              // face * 4 + quad corner.
+    uint8_t  color[4];
+    int8_t   gradient[3];
+    uint8_t  ao;                // Baked occlusion, if EFFECT_BAKED_AO.
+    uint8_t  masks[2];          // Occlusion and borders masks of the face.
+    uint8_t  pos_data[PICK_POS_BYTES];
+} packed_vertex_t;
+
+// Size of a vertex in the GPU buffers, for quads (4) or triangles (3).
+static int vertex_size(int size)
+{
+    return size == 4 ? sizeof(packed_vertex_t) : sizeof(voxel_vertex_t);
+}
+
+/*
+ * Pack the vertices of a quads mesh in place.  The packed vertices are
+ * smaller, so we never overwrite a vertex before reading it.
+ */
+static void pack_vertices(void *buf, int nb)
+{
+    int i, corner;
+    voxel_vertex_t v;
+    packed_vertex_t p;
+    const int ts = VOXEL_TEXTURE_SIZE;
+
+    for (i = 0; i < nb; i++) {
+        memcpy(&v, (uint8_t*)buf + i * sizeof(v), sizeof(v));
+        corner = v.uv[1] ? (v.uv[0] ? 2 : 3) : (v.uv[0] ? 1 : 0);
+        p = (packed_vertex_t) {
+            .pos = {v.pos[0], v.pos[1], v.pos[2]},
+            .face = ((v.pos_data >> PICK_DATA_SHIFT) & 7) * 4 + corner,
+            .color = {v.color[0], v.color[1], v.color[2], v.color[3]},
+            .gradient = {v.gradient[0], v.gradient[1], v.gradient[2]},
+            .masks = {v.occlusion_uv[0] / ts + v.occlusion_uv[1] / ts * 16,
+                      v.bump_uv[0] / 16 + v.bump_uv[1] / 16 * 16},
+            .ao = v.ao,
+        };
+        // The pos data bytes are read as is by the shader.
+        memcpy(p.pos_data, &v.pos_data, sizeof(p.pos_data));
+        memcpy((uint8_t*)buf + i * sizeof(p), &p, sizeof(p));
+    }
+}
+
+// A tile mesh being generated in the background.
+typedef struct mesh_task mesh_task_t;
+struct mesh_task {
+    UT_hash_handle  hh;
+    tile_item_key_t key;
+    volume_t        *volume;
+    int             tile_pos[3];
+    int             effects;
+    int             lod;
+    bool            disk_cache;     // Use the disk cache of the meshes.
+    float           priority;       // Higher values are meshed first.
+    bool            started;        // Given to the workers.
+    int             done;           // Set by the worker once finished.
+    int             last_frame;     // Last frame we needed the mesh.
+    void            *vertices;      // Packed if size is 4.
+    int             nb_elements;
+    int             size;
+    int             subdivide;
+    double          time;           // Time spent meshing, in seconds.
+};
+static mesh_task_t *g_mesh_tasks = NULL;
+static int g_frame = 0;
+// Per frame budgets of the asynchronous renderer.
+static double g_sync_mesh_deadline;
+static int g_upload_budget;
+static const double SYNC_MESH_TIME = 0.008;    // Seconds.
+static const int UPLOAD_BUDGET = 16 << 20;      // Bytes.
+// The tasks are only given to the workers a few at a time, so that the
+// ones with the highest priority at each frame are done first.  We keep
+// enough tasks running to keep the workers busy for about this time.
+static const double MESH_QUEUE_TIME = 0.03;     // Seconds.
+static double g_mesh_time_avg = 0.001;          // Seconds per task.
+
+/*
+ * Level of detail of the tiles, kept between frames so that we only change
+ * the level once the tile screen size is far enough from the threshold.
+ * The level only depends on the tile position and the camera, so all the
+ * volumes share the same values.
+ */
+typedef struct {
+    UT_hash_handle  hh;
+    int             pos[3];
+    int             lod;
+    int             last_frame;
+} tile_lod_t;
+static tile_lod_t *g_tile_lods = NULL;
+static const int LOD_MAX = 3;
+static const float LOD_HYSTERESIS = 0.25;
+
+// Hardware occlusion queries, used to skip the tiles hidden by the others.
+#if !defined(GLES2) && defined(GL_SAMPLES_PASSED)
+#   define HAS_OCCLUSION_QUERIES 1
+#else
+#   define HAS_OCCLUSION_QUERIES 0
+#endif
+
+/*
+ * Occlusion state of the tiles, kept between frames.
+ *
+ * Each rendered tile is wrapped into an occlusion query, whose result we
+ * only read in a later frame, once it is available, so that we never wait
+ * for the GPU.  The tiles found occluded are not rendered anymore: instead
+ * we test their bounding box after all the other tiles of the volume, and
+ * render them again as soon as the box is visible.  The cost is that a
+ * tile that gets uncovered can be missing for a frame.
+ */
+typedef struct {
+    int         pos[3];
+    uint64_t    id;             // Tile data id.
+    float       model[4][4];
+} tile_query_key_t;
+
+typedef struct {
+    UT_hash_handle      hh;
+    tile_query_key_t    key;
+    GLuint              query;
+    bool                pending;    // Set until we read the query result.
+    bool                occluded;
+    int                 last_frame;
+} tile_query_t;
+static __thread tile_query_t *g_tile_queries = NULL;
+
+/*
+ * Rendering cost of the volumes in the main passes, by volume key, for the
+ * stats panels.  g_volume_cost is the entry of the volume being rendered,
+ * if any.
+ */
+typedef struct {
+    UT_hash_handle          hh;
+    uint64_t                key;
+    render_volume_stats_t   stats;
+    int                     frame;  // Frame of nb_tiles and vram.
+} volume_cost_t;
+static volume_cost_t *g_volume_costs = NULL;
+static volume_cost_t *g_volume_cost = NULL;
+
+// Take nb_slots from the start of a free range of a page.
+static void page_take(int page, int range, int nb_slots, int *slot)
+{
+    vertex_page_t *p = &g_pages[page];
+
+    *slot = p->free[range][0];
+    p->free[range][0] += nb_slots;
+    p->free[range][1] -= nb_slots;
+    if (p->free[range][1] == 0) {
+        memmove(&p->free[range], &p->free[range + 1],
+                (p->nb_free - range - 1) * sizeof(*p->free));
+        p->nb_free--;
+    }
+}
+
+static bool page_is_empty(const vertex_page_t *p)
+{
+    return p->nb_free == 1 && p->free[0][1] == BATCH_QUAD_COUNT;
+}
+
+// Set the page buffer storage for its vertex format.
+static void page_set_storage(vertex_page_t *p)
+{
+    GL(glBindBuffer(GL_ARRAY_BUFFER, p->buffer));
+    GL(glBufferData(GL_ARRAY_BUFFER,
+                    BATCH_QUAD_COUNT * 4 * vertex_size(p->packed ? 4 : 3),
+                    NULL, GL_DYNAMIC_DRAW));
+}
+
+/*
+ * Allocate a range of slots, creating a new page if needed.
+ *
+ * We take the smallest free range that fits, so that the big ranges left
+ * by the evicted tiles stay available for the big meshes, and the pages
+ * don't get fragmented while the cache keeps replacing tiles.  Since the
+ * pages are never deleted, a page that got empty can also be reused for
+ * the other vertex format instead of creating a new buffer.
+ */
+static void page_alloc(int nb_slots, bool packed, int *page, int *slot)
+{
+    int i, j, best_page = -1, best_range = 0, empty = -1;
+    vertex_page_t *p;
+
+    for (i = 0; i < g_nb_pages; i++) {
+        p = &g_pages[i];
+        if (p->packed != packed) {
+            if (empty == -1 && page_is_empty(p)) empty = i;
+            continue;
+        }
+        for (j = 0; j < p->nb_free; j++) {
+            if (p->free[j][1] < nb_slots) continue;
+            if (best_page != -1 &&
+                    p->free[j][1] >= g_pages[best_page].free[best_range][1])
+                continue;
+            best_page = i;
+            best_range = j;
+            if (p->free[j][1] == nb_slots) goto found;
+        }
+    }
+    if (best_page != -1) goto found;
+
+    if (empty != -1) {
+        best_page = empty;
+        p = &g_pages[empty];
+        p->packed = packed;
+        page_set_storage(p);
+        goto found;
+    }
+
+    g_pages = realloc(g_pages, (g_nb_pages + 1) * sizeof(*g_pages));
+    p = &g_pages[g_nb_pages];
+    *p = (vertex_page_t){.packed = packed};
+    GL(glGenBuffers(1, &p->buffer));
+    page_set_storage(p);
+    p->free = malloc(sizeof(*p->free));
+    p->free[0][0] = 0;
+    p->free[0][1] = BATCH_QUAD_COUNT;
+    p->nb_free = 1;
+    best_page = g_nb_pages++;
+
+found:
+    *page = best_page;
+    page_take(best_page, best_range, nb_slots, slot);
+}
+
+// Give back a range of slots to its page, merging it with the adjacent
+// free ranges.
+static void page_free(int page, int slot, int nb_slots)
+{
+    int i;
+    vertex_page_t *p = &g_pages[page];
+
+    for (i = 0; i < p->nb_free; i++) {
+        if (p->free[i][0] > slot) break;
+    }
+    p->free = realloc(p->free, (p->nb_free + 1) * sizeof(*p->free));
+    memmove(&p->free[i + 1], &p->free[i],
+            (p->nb_free - i) * sizeof(*p->free));
+    p->free[i][0] = slot;
+    p->free[i][1] = nb_slots;
+    p->nb_free++;
+    if (i + 1 < p->nb_free && slot + nb_slots == p->free[i + 1][0]) {
+        p->free[i][1] += p->free[i + 1][1];
+        memmove(&p->free[i + 1], &p->free[i + 2],
+                (p->nb_free - i - 2) * sizeof(*p->free));
+        p->nb_free--;
+    }
+    if (i > 0 && p->free[i - 1][0] + p->free[i - 1][1] == slot) {
+        p->free[i - 1][1] += p->free[i][1];
+        memmove(&p->free[i], &p->free[i + 1],
+                (p->nb_free - i - 1) * sizeof(*p->free));
+        p->nb_free--;
+    }
+}
+
+static void mesh_task_delete(mesh_task_t *task)
+{
+    volume_delete(task->volume);
+    free(task->vertices);
+    free(task);
+}
 
 #define OFFSET(n) offsetof(voxel_vertex_t, n)
+#define PACKED_OFFSET(n) offsetof(packed_vertex_t, n)
 
 enum {
     A_POS_LOC = 0,
@@ -108,26 +561,46 @@ enum {
     A_UV_LOC,
     A_BUMP_UV_LOC,
     A_OCCLUSION_UV_LOC,
+    A_FACE_LOC,
+    A_MASKS_LOC,
+    A_AO_LOC,
+    A_NB
 };
 
-// The list of all the attributes used by the shaders.
-static const struct {
+typedef struct {
     int size;
     int type;
     int norm;
     int offset;
-} ATTRIBUTES[] = {
+} attribute_t;
+
+// The list of all the attributes used by the shaders.
+static const attribute_t ATTRIBUTES[A_NB] = {
     [A_POS_LOC] = {3, GL_UNSIGNED_BYTE, false, OFFSET(pos)},
     [A_NORMAL_LOC] = { 3, GL_BYTE, false, OFFSET(normal)},
     [A_TANGENT_LOC] = {3, GL_BYTE, false, OFFSET(tangent)},
     [A_GRADIENT_LOC] = {3, GL_BYTE, false, OFFSET(gradient)},
     [A_COLOR_LOC] = {4, GL_UNSIGNED_BYTE, true, OFFSET(color)},
-    [A_POS_DATA_LOC] = {2, GL_UNSIGNED_BYTE, true, OFFSET(pos_data)},
+    [A_POS_DATA_LOC] = {PICK_POS_BYTES, GL_UNSIGNED_BYTE, true,
+                        OFFSET(pos_data)},
     [A_UV_LOC] = {2, GL_UNSIGNED_BYTE, true,  OFFSET(uv)},
     [A_BUMP_UV_LOC] = {2, GL_UNSIGNED_BYTE, false, OFFSET(bump_uv)},
     [A_OCCLUSION_UV_LOC] = {2, GL_UNSIGNED_BYTE, false, OFFSET(occlusion_uv)},
 };
 
+// The attributes of the packed quads vertices.  The normal, tangent and uv
+// attributes are computed by the shader from the face and masks.
+static const attribute_t PACKED_ATTRIBUTES[A_NB] = {
+    [A_POS_LOC] = {3, GL_UNSIGNED_BYTE, false, PACKED_OFFSET(pos)},
+    [A_FACE_LOC] = {1, GL_UNSIGNED_BYTE, false, PACKED_OFFSET(face)},
+    [A_COLOR_LOC] = {4, GL_UNSIGNED_BYTE, true, PACKED_OFFSET(color)},
+    [A_GRADIENT_LOC] = {3, GL_BYTE, false, PACKED_OFFSET(gradient)},
+    [A_MASKS_LOC] = {2, GL_UNSIGNED_BYTE, false, PACKED_OFFSET(masks)},
+    [A_POS_DATA_LOC] = {PICK_POS_BYTES, GL_UNSIGNED_BYTE, true,
+                        PACKED_OFFSET(pos_data)},
+    [A_AO_LOC] = {1, GL_UNSIGNED_BYTE, true, PACKED_OFFSET(ao)},
+};
+
 static const char *ATTR_NAMES[] = {
     [A_POS_LOC] = "a_pos",
     [A_NORMAL_LOC] = "a_normal",
@@ -138,6 +611,9 @@ static const char *ATTR_NAMES[] = {
     [A_UV_LOC] = "a_uv",
     [A_BUMP_UV_LOC] = "a_bump_uv",
     [A_OCCLUSION_UV_LOC] = "a_occlusion_uv",
+    [A_FACE_LOC] = "a_face",
+    [A_MASKS_LOC] = "a_masks",
+    [A_AO_LOC] = "a_ao",
     NULL,
 };
 
@@ -299,6 +775,24 @@ static void shader_init(gl_shader_t *shader)
     gl_update_uniform(shader, "u_shadow_tex", 2);
 }
 
+// Return the size of the meshes cache, as a quarter of the video memory if
+// the driver tells us how much there is.
+static int64_t get_items_cache_size(void)
+{
+    GLint kb[4] = {};
+#ifndef GLES2
+    if (gl_has_extension("GL_NVX_gpu_memory_info")) {
+        // GL_GPU_MEMORY_INFO_TOTAL_AVAILABLE_MEMORY_NVX.
+        GL(glGetIntegerv(0x9048, kb));
+    } else if (gl_has_extension("GL_ATI_meminfo")) {
+        // GL_VBO_FREE_MEMORY_ATI, only gives the free memory.
+        GL(glGetIntegerv(0x87FB, kb));
+    }
+#endif
+    if (kb[0] <= 0) return RENDER_CACHE_SIZE;
+    return clamp((int64_t)kb[0] * 1024 / 4, 64 * MB, 4LL * GB);
+}
+
 void render_init()
 {
     // 6 vertices (2 triangles) per face.
@@ -333,8 +827,13 @@ void render_init()
     init_occlusion_texture();
     init_bump_texture();
 
-    // XXX: pick the proper memory size according to what is available.
-    g_items_cache = cache_create("render_items", RENDER_CACHE_SIZE);
+    // The meshes are in video memory, so they get their own budget.  The
+    // caches are also used by the render thread, while the main thread
+    // can evict their items.
+    g_items_cache = cache_create_with_flags("render_items",
+            get_items_cache_size(), CACHE_CONCURRENT | CACHE_DEFER_DELETE);
+    g_tiles_cache = cache_create_with_flags("render_tiles", 0,
+            CACHE_GOVERNED | CACHE_CONCURRENT | CACHE_DEFER_DELETE);
     g_cube_model = model3d_cube();
     g_line_model = model3d_line();
     g_wire_cube_model = model3d_wire_cube();
@@ -343,11 +842,73 @@ void render_init()
     g_rect_model = model3d_rect();
     g_wire_rect_model = model3d_wire_rect();
     g_cone_model = model3d_cone();
+    g_batch_model = calloc(1, sizeof(*g_batch_model));
+}
+
+// Delete the objects of the current thread that are not shared with the
+// other OpenGL contexts.
+static void release_context_objects(void)
+{
+    tile_query_t *query, *tmp;
+
+    HASH_ITER(hh, g_tile_queries, query, tmp) {
+        HASH_DEL(g_tile_queries, query);
+#if HAS_OCCLUSION_QUERIES
+        GL(glDeleteQueries(1, &query->query));
+#endif
+        free(query);
+    }
+#if HAS_OIT
+    if (g_oit.fbo) {
+        GL(glDeleteFramebuffers(1, &g_oit.fbo));
+        GL(glDeleteTextures(1, &g_oit.accum));
+        GL(glDeleteTextures(1, &g_oit.weight));
+        GL(glDeleteRenderbuffers(1, &g_oit.depth));
+    }
+#endif
+    memset(&g_oit, 0, sizeof(g_oit));
+    if (g_shadow_map_fbo) GL(glDeleteFramebuffers(1, &g_shadow_map_fbo));
+    g_shadow_map_fbo = 0;
+    texture_delete(g_shadow_map);
+    g_shadow_map = NULL;
+    g_shadow_map_key = 0;
 }
 
 void render_deinit(void)
 {
+    int i;
+    mesh_task_t *task, *tmp;
+    tile_lod_t *tile, *tile_tmp;
+    volume_cost_t *cost, *cost_tmp;
+
+    render_thread_stop();
+    HASH_ITER(hh, g_tile_lods, tile, tile_tmp) {
+        HASH_DEL(g_tile_lods, tile);
+        free(tile);
+    }
+    release_context_objects();
+    HASH_ITER(hh, g_volume_costs, cost, cost_tmp) {
+        HASH_DEL(g_volume_costs, cost);
+        free(cost);
+    }
+    // The tasks still running are left to the workers.
+    HASH_ITER(hh, g_mesh_tasks, task, tmp) {
+        HASH_DEL(g_mesh_tasks, task);
+        if (!task->started || __atomic_load_n(&task->done, __ATOMIC_ACQUIRE))
+            mesh_task_delete(task);
+    }
     cache_delete(g_items_cache);
+    cache_delete(g_tiles_cache);
+    free(g_pick_tiles);
+    g_pick_tiles = NULL;
+    g_pick_tiles_nb = g_pick_tiles_capacity = 0;
+    for (i = 0; i < g_nb_pages; i++) {
+        GL(glDeleteBuffers(1, &g_pages[i].buffer));
+        free(g_pages[i].free);
+    }
+    free(g_pages);
+    g_pages = NULL;
+    g_nb_pages = 0;
     GL(glDeleteBuffers(1, &g_index_buffer));
     g_index_buffer = 0;
     model3d_delete(g_cube_model);
@@ -358,127 +919,800 @@ void render_deinit(void)
     model3d_delete(g_rect_model);
     model3d_delete(g_wire_rect_model);
     model3d_delete(g_cone_model);
+    model3d_delete(g_batch_model);
+#if HAS_RAYMARCH
+    if (g_atlas.tex) GL(glDeleteTextures(1, &g_atlas.tex));
+    HASH_CLEAR(hh, g_atlas.table);
+    free(g_atlas.slots);
+    memset(&g_atlas, 0, sizeof(g_atlas));
+#endif
 }
 
 // A global buffer large enough to contain all the vertices for any tile.
 static voxel_vertex_t* g_vertices_buffer = NULL;
 
+// Size of the vertices of a tile mesh in the GPU buffers.
+static int get_item_vram(const render_item_t *item)
+{
+    int ret = 0;
+    for (; item; item = item->part)
+        ret += item->nb_elements * item->size * vertex_size(item->size);
+    return ret;
+}
+
 // Used for the cache.
 static int item_delete(void *item_)
 {
-    render_item_t *item = item_;
-    GL(glDeleteBuffers(1, &item->vertex_buffer));
-    free(item);
+    render_item_t *item = item_, *part;
+    while (item) {
+        part = item->part;
+        if (item->nb_slots) page_free(item->page, item->slot, item->nb_slots);
+        free(item);
+        item = part;
+    }
     return 0;
 }
 
-static render_item_t *get_item_for_tile(
-        const volume_t *volume,
-        volume_iterator_t *iter,
-        const int tile_pos[3],
-        int effects, float smoothness)
-{
-    render_item_t *item;
-    const int effects_mask = EFFECT_MARCHING_CUBES | EFFECT_MC_SMOOTH;
-    uint64_t tile_data_id;
-    int p[3], i, x, y, z;
-    tile_item_key_t key = {};
+/*
+ * Disk cache of the meshes generated in the background, so that a scene
+ * opened again doesn't need to be meshed again.  The items cache uses the
+ * tiles data ids, that change from one session to the other, so the files
+ * are named after the voxels hashes of the 27 tiles around the tile
+ * instead.  The oldest files are deleted once the cache gets too big.
+ *
+ * MESH_DISK_VERSION has to change with the meshes content or format.
+ */
+#define MESH_DISK_VERSION 1
+static const int64_t MESH_DISK_BUDGET = 512LL << 20; // Bytes.
 
-    memset(&key, 0, sizeof(key)); // Just to be sure!
-    key.effects = effects & effects_mask;
-    // The hash key take into consideration all the tiles adjacent to
-    // the current tile!
+typedef struct {
+    char        magic[4];   // "GXMS"
+    int32_t     version;
+    int32_t     nb_elements;
+    int32_t     size;
+    int32_t     subdivide;
+} mesh_file_header_t;
+
+// Name of the file of a tile mesh in the disk cache.
+static bool mesh_disk_get_path(const volume_t *volume, const int tile_pos[3],
+                               int effects, int lod, char *out, int size)
+{
+    int i, x, y, z, p[3];
+    uint64_t hash[2];
+    struct {
+        int32_t     version;
+        int32_t     tile_size;
+        int32_t     effects;
+        int32_t     lod;
+        uint64_t    hashes[27][2];  // Zero for the empty tiles.
+    } key = {MESH_DISK_VERSION, TILE_SIZE, effects, lod};
+
+    if (!sys_get_user_dir()) return false;
     for (i = 0, z = -1; z <= 1; z++)
     for (y = -1; y <= 1; y++)
     for (x = -1; x <= 1; x++, i++) {
         p[0] = tile_pos[0] + x * TILE_SIZE;
         p[1] = tile_pos[1] + y * TILE_SIZE;
         p[2] = tile_pos[2] + z * TILE_SIZE;
-        volume_get_tile_data(volume, NULL, p, &tile_data_id);
-        key.ids[i] = tile_data_id;
+        volume_get_tile_hash(volume, NULL, p, key.hashes[i]);
     }
+    hash[0] = XXH64(&key, sizeof(key), 0);
+    hash[1] = XXH64(&key, sizeof(key), 0x9e3779b97f4a7c15ULL);
+    snprintf(out, size, "%s/meshes/%016" PRIx64 "%016" PRIx64 ".bin",
+             sys_get_user_dir(), hash[0], hash[1]);
+    return true;
+}
 
-    item = cache_get(g_items_cache, &key, sizeof(key));
-    if (item) return item;
+static bool mesh_disk_load(const char *path, mesh_task_t *task)
+{
+    char *data;
+    int size;
+    mesh_file_header_t header;
+
+    data = read_file(path, &size);
+    if (!data) return false;
+    if (size < (int)sizeof(header)) goto error;
+    memcpy(&header, data, sizeof(header));
+    if (    memcmp(header.magic, "GXMS", 4) != 0 ||
+            header.version != MESH_DISK_VERSION ||
+            (header.size != 3 && header.size != 4) ||
+            header.nb_elements < 0 ||
+            header.nb_elements * header.size >
+                TILE_SIZE * TILE_SIZE * TILE_SIZE * 6 * 4 ||
+            size - sizeof(header) != header.nb_elements * header.size *
+                                     vertex_size(header.size))
+        goto error;
+    size -= sizeof(header);
+    task->vertices = malloc(max(size, 1));
+    memcpy(task->vertices, data + sizeof(header), size);
+    task->nb_elements = header.nb_elements;
+    task->size = header.size;
+    task->subdivide = header.subdivide;
+    free(data);
+    return true;
+
+error:
+    LOG_W("Invalid mesh cache file %s", path);
+    free(data);
+    sys_delete_file(path);
+    return false;
+}
+
+static void mesh_disk_save(const char *path, const mesh_task_t *task)
+{
+    char tmp_path[1100];
+    FILE *file;
+    mesh_file_header_t header = {
+        .magic = "GXMS",
+        .version = MESH_DISK_VERSION,
+        .nb_elements = task->nb_elements,
+        .size = task->size,
+        .subdivide = task->subdivide,
+    };
+
+    // Other tasks can save the same mesh at the same time, so we write
+    // into a file of our own, and rename it once it is complete.
+    snprintf(tmp_path, sizeof(tmp_path), "%s.%p.tmp", path, (void*)task);
+    sys_make_dir(tmp_path);
+    file = fopen(tmp_path, "wb");
+    if (!file) {
+        LOG_W("Cannot save mesh %s: %s", tmp_path, strerror(errno));
+        return;
+    }
+    fwrite(&header, sizeof(header), 1, file);
+    fwrite(task->vertices, task->nb_elements * task->size *
+           vertex_size(task->size), 1, file);
+    fclose(file);
+    if (rename(tmp_path, path) != 0) sys_delete_file(tmp_path);
+}
+
+typedef struct {
+    char        name[64];
+    int64_t     size;
+    time_t      time;
+} mesh_file_t;
+
+typedef struct {
+    mesh_file_t *files;
+    int         nb, capacity;
+    int64_t     size;
+} mesh_files_t;
+
+static int mesh_disk_on_file(const char *dir, const char *name, void *user)
+{
+    mesh_files_t *files = user;
+    char path[1024];
+    struct stat st;
+    mesh_file_t *file;
+
+    snprintf(path, sizeof(path), "%s/%s", dir, name);
+    if (strlen(name) >= sizeof(file->name) || stat(path, &st) != 0)
+        return 0;
+    if (files->nb >= files->capacity) {
+        files->capacity = max(files->capacity * 2, 256);
+        files->files = realloc(files->files,
+                               files->capacity * sizeof(*files->files));
+    }
+    file = &files->files[files->nb++];
+    snprintf(file->name, sizeof(file->name), "%s", name);
+    file->size = st.st_size;
+    file->time = st.st_mtime;
+    files->size += st.st_size;
+    return 0;
+}
+
+static int mesh_file_cmp(const void *a, const void *b)
+{
+    const mesh_file_t *fa = a, *fb = b;
+    return (fa->time > fb->time) - (fa->time < fb->time);
+}
+
+// Run in a job once per session: delete the oldest files of the disk
+// cache, until it is back under three quarters of the budget.
+static void mesh_disk_trim(void *user)
+{
+    char dir[1024], path[1100];
+    mesh_files_t files = {};
+    int i;
+
+    snprintf(dir, sizeof(dir), "%s/meshes", sys_get_user_dir());
+    sys_list_dir(dir, mesh_disk_on_file, &files);
+    if (files.size > MESH_DISK_BUDGET) {
+        qsort(files.files, files.nb, sizeof(*files.files), mesh_file_cmp);
+        for (i = 0; i < files.nb && files.size > MESH_DISK_BUDGET / 4 * 3;
+             i++) {
+            snprintf(path, sizeof(path), "%s/%s", dir, files.files[i].name);
+            sys_delete_file(path);
+            files.size -= files.files[i].size;
+        }
+    }
+    free(files.files);
+}
+
+static void mesh_task_run(void *user)
+{
+    mesh_task_t *task = user;
+    int size;
+    char path[1024];
+    bool use_disk;
+    double start = sys_get_time();
+    voxel_vertex_t *buf;
+
+    use_disk = task->disk_cache &&
+               mesh_disk_get_path(task->volume, task->tile_pos,
+                                  task->key.effects, task->lod,
+                                  path, sizeof(path));
+    if (use_disk && mesh_disk_load(path, task)) {
+        task->time = sys_get_time() - start;
+        __atomic_store_n(&task->done, 1, __ATOMIC_RELEASE);
+        return;
+    }
+
+    buf = jobs_get_scratch(
+            TILE_SIZE * TILE_SIZE * TILE_SIZE * 6 * 4 * sizeof(*buf));
+    task->nb_elements = volume_generate_vertices_lod(
+            task->volume, task->tile_pos, task->lod, task->effects, buf,
+            &task->size, &task->subdivide);
+    if (task->size == 4) pack_vertices(buf, task->nb_elements * 4);
+    size = task->nb_elements * task->size * vertex_size(task->size);
+    task->vertices = malloc(max(size, 1));
+    memcpy(task->vertices, buf, size);
+    if (use_disk) mesh_disk_save(path, task);
+    task->time = sys_get_time() - start;
+    __atomic_store_n(&task->done, 1, __ATOMIC_RELEASE);
+}
+
+// Create a render item and upload its vertices.  The meshes bigger than a
+// vertex page are split into several parts.
+static render_item_t *add_item(const tile_item_key_t *key,
+                               const void *vertices,
+                               int nb_elements, int size, int subdivide)
+{
+    render_item_t *item, *part, **next;
+    const int vsize = vertex_size(size);
+    const int part_max = BATCH_QUAD_COUNT * 4 / size;
+    int n;
 
     item = calloc(1, sizeof(*item));
-    item->key = key;
-    GL(glGenBuffers(1, &item->vertex_buffer));
-    GL(glBindBuffer(GL_ARRAY_BUFFER, item->vertex_buffer));
+    next = &item;
+    do {
+        part = *next ?: calloc(1, sizeof(*part));
+        *next = part;
+        n = min(nb_elements, part_max);
+        part->nb_elements = n;
+        part->size = size;
+        part->subdivide = subdivide;
+        part->lod = key->lod;
+        if (n != 0) {
+            part->nb_slots = (n * size + 3) / 4;
+            page_alloc(part->nb_slots, size == 4, &part->page, &part->slot);
+            GL(glBindBuffer(GL_ARRAY_BUFFER, g_pages[part->page].buffer));
+            GL(glBufferSubData(GL_ARRAY_BUFFER,
+                    part->slot * 4 * vsize, n * size * vsize, vertices));
+        }
+        vertices = (const uint8_t*)vertices + n * size * vsize;
+        nb_elements -= n;
+        next = &part->part;
+    } while (nb_elements > 0);
+    item->key = *key;
+    cache_add(g_items_cache, key, sizeof(*key), item,
+              get_item_vram(item), item_delete);
+    return item;
+}
+
+// Return any already cached mesh of a tile, at a different level of
+// detail.  Used while the proper level is generated in the background.
+static render_item_t *get_item_other_lod(const tile_item_key_t *key)
+{
+    int lod;
+    tile_item_key_t k = *key;
+    render_item_t *item;
+
+    for (lod = 0; lod <= LOD_MAX; lod++) {
+        if (lod == key->lod) continue;
+        k.lod = lod;
+        item = render_cache_get(g_items_cache, &k, sizeof(k));
+        if (item) return item;
+    }
+    return NULL;
+}
+
+static int volume_tiles_delete(void *tiles_)
+{
+    volume_tiles_t *tiles = tiles_;
+    free(tiles->tiles);
+    free(tiles);
+    return 0;
+}
+
+// Get the cached list of tiles of a volume, or create it.
+static const volume_tiles_t *get_volume_tiles(const volume_t *volume)
+{
+    uint64_t key = volume_get_key(volume);
+    volume_tiles_t *tiles;
+    volume_iterator_t iter;
+    volume_accessor_t accessor;
+    tile_neighbors_t *tile;
+    int i, x, y, z, p[3], pos[3], capacity = 0;
+
+    tiles = render_cache_get(g_tiles_cache, &key, sizeof(key));
+    if (tiles) return tiles;
+
+    tiles = calloc(1, sizeof(*tiles));
+    accessor = volume_get_neighbors_accessor(volume);
+    iter = volume_get_iterator(volume,
+            VOLUME_ITER_TILES | VOLUME_ITER_INCLUDES_NEIGHBORS);
+    while (volume_iter(&iter, pos)) {
+        if (tiles->nb >= capacity) {
+            capacity = max(capacity * 2, 64);
+            tiles->tiles = realloc(tiles->tiles,
+                                   capacity * sizeof(*tiles->tiles));
+        }
+        tile = &tiles->tiles[tiles->nb++];
+        memcpy(tile->pos, pos, sizeof(tile->pos));
+        // The render items keys take into consideration all the tiles
+        // adjacent to the tile!
+        for (i = 0, z = -1; z <= 1; z++)
+        for (y = -1; y <= 1; y++)
+        for (x = -1; x <= 1; x++, i++) {
+            p[0] = pos[0] + x * TILE_SIZE;
+            p[1] = pos[1] + y * TILE_SIZE;
+            p[2] = pos[2] + z * TILE_SIZE;
+            volume_get_tile_data(volume, &accessor, p, &tile->ids[i]);
+        }
+    }
+    cache_add(g_tiles_cache, &key, sizeof(key), tiles,
+              sizeof(*tiles) + tiles->nb * sizeof(*tiles->tiles),
+              volume_tiles_delete);
+    return tiles;
+}
+
+// Called on items cache miss: upload the mesh generated in the
+// background if it is ready, or start generating it.
+static render_item_t *create_item_for_tile(
+        const volume_t *volume, const int tile_pos[3],
+        const tile_item_key_t *key, int effects, int lod, bool async,
+        bool disk_cache, float priority)
+{
+    render_item_t *item;
+    mesh_task_t *task;
+    int nb_elements, size, subdivide;
+    double start;
+    static bool trimmed = false;
+
+    // Mesh being generated in the background: upload it once it's ready,
+    // as long as we don't exceed the frame upload budget.
+    HASH_FIND(hh, g_mesh_tasks, key, sizeof(*key), task);
+    if (task) {
+        task->last_frame = g_frame;
+        task->priority = priority;
+        if (!__atomic_load_n(&task->done, __ATOMIC_ACQUIRE) ||
+                g_upload_budget <= 0)
+            return get_item_other_lod(key);
+        g_upload_budget -= task->nb_elements * task->size *
+                           vertex_size(task->size);
+        item = add_item(key, task->vertices, task->nb_elements,
+                        task->size, task->subdivide);
+        if (g_volume_cost) g_volume_cost->stats.meshing_time += task->time;
+        g_mesh_time_avg = mix(g_mesh_time_avg, task->time, 0.1);
+        HASH_DEL(g_mesh_tasks, task);
+        mesh_task_delete(task);
+        return item;
+    }
+
+    if (async && sys_get_time() > g_sync_mesh_deadline) {
+        task = calloc(1, sizeof(*task));
+        task->key = *key;
+        task->volume = volume_copy(volume);
+        memcpy(task->tile_pos, tile_pos, sizeof(task->tile_pos));
+        task->effects = effects;
+        task->lod = lod;
+        task->disk_cache = disk_cache && sys_get_user_dir();
+        task->priority = priority;
+        task->last_frame = g_frame;
+        if (task->disk_cache && !trimmed) {
+            trimmed = true;
+            jobs_async(mesh_disk_trim, NULL);
+        }
+        // Started at the end of the frame, see mesh_tasks_dispatch.
+        HASH_ADD(hh, g_mesh_tasks, key, sizeof(task->key), task);
+        return get_item_other_lod(key);
+    }
+
     if (!g_vertices_buffer)
         g_vertices_buffer = calloc(
                 TILE_SIZE * TILE_SIZE * TILE_SIZE * 6 * 4,
                 sizeof(*g_vertices_buffer));
-    item->nb_elements = volume_generate_vertices(
-            volume, tile_pos, effects, g_vertices_buffer,
-            &item->size, &item->subdivide);
-    if (item->nb_elements > BATCH_QUAD_COUNT) {
-        LOG_W("Too many quads!");
-        item->nb_elements = BATCH_QUAD_COUNT;
-    }
-    if (item->nb_elements != 0) {
-        GL(glBufferData(GL_ARRAY_BUFFER,
-                item->nb_elements * item->size * sizeof(*g_vertices_buffer),
-                g_vertices_buffer, GL_STATIC_DRAW));
-    }
-
-    cache_add(g_items_cache, &key, sizeof(key), item,
-              item->nb_elements * item->size * sizeof(*g_vertices_buffer),
-              item_delete);
-    return item;
+    start = sys_get_time();
+    nb_elements = volume_generate_vertices_lod(
+            volume, tile_pos, lod, effects, g_vertices_buffer,
+            &size, &subdivide);
+    if (g_volume_cost)
+        g_volume_cost->stats.meshing_time += sys_get_time() - start;
+    if (size == 4) pack_vertices(g_vertices_buffer, nb_elements * 4);
+    return add_item(key, g_vertices_buffer, nb_elements, size, subdivide);
 }
 
-static void render_tile_(renderer_t *rend, volume_t *volume,
-                          volume_iterator_t *iter,
-                          const int tile_pos[3],
-                          int tile_id,
-                          const material_t *material,
-                          int effects, gl_shader_t *shader,
-                          const float model[4][4])
+static render_item_t *get_item_for_tile(
+        const volume_t *volume,
+        const tile_neighbors_t *tile,
+        int effects, int lod, float smoothness, bool async, bool disk_cache,
+        float priority)
 {
     render_item_t *item;
-    float tile_model[4][4];
-    int attr;
-    float tile_id_f[2];
-
-    item = get_item_for_tile(volume, iter, tile_pos, effects,
-                              rend->settings.smoothness);
-    if (item->nb_elements == 0) return;
-    GL(glBindBuffer(GL_ARRAY_BUFFER, item->vertex_buffer));
-    if (gl_has_uniform(shader, "u_tile_id")) {
-        tile_id_f[1] = ((tile_id >> 8) & 0xff) / 255.0;
-        tile_id_f[0] = ((tile_id >> 0) & 0xff) / 255.0;
-        gl_update_uniform(shader, "u_tile_id", tile_id_f);
-    }
-    gl_update_uniform(shader, "u_pos_scale", 1.f / item->subdivide);
-
-    for (attr = 0; attr < ARRAY_SIZE(ATTRIBUTES); attr++) {
-        GL(glVertexAttribPointer(attr,
-                                 ATTRIBUTES[attr].size,
-                                 ATTRIBUTES[attr].type,
-                                 ATTRIBUTES[attr].norm,
-                                 sizeof(voxel_vertex_t),
-                                 (void*)(intptr_t)ATTRIBUTES[attr].offset));
+    const int effects_mask = EFFECT_MARCHING_CUBES | EFFECT_MC_SMOOTH |
+                             EFFECT_GREEDY_MESH | EFFECT_BAKED_AO;
+    tile_item_key_t key = {};
+
+    memset(&key, 0, sizeof(key)); // Just to be sure!
+    key.effects = effects & effects_mask;
+    key.lod = lod;
+    memcpy(key.ids, tile->ids, sizeof(key.ids));
+
+    item = render_cache_get(g_items_cache, &key, sizeof(key));
+    if (item) return item;
+    TRACE_SCOPE("get_item_for_tile");
+
+    profiler_begin(PROF_MESHING);
+    item = create_item_for_tile(volume, tile->pos, &key, effects, lod, async,
+                                disk_cache, priority);
+    profiler_end(PROF_MESHING);
+    return item;
+}
+
+// Called at the start of each asynchronous render, to reset the budgets
+// and drop the finished meshes that nobody asked for in a while.
+static void mesh_tasks_new_frame(void)
+{
+    mesh_task_t *task, *tmp;
+
+    g_sync_mesh_deadline = sys_get_time() + SYNC_MESH_TIME;
+    g_upload_budget = UPLOAD_BUDGET;
+    HASH_ITER(hh, g_mesh_tasks, task, tmp) {
+        if (g_frame - task->last_frame < 60) continue;
+        if (task->started && !__atomic_load_n(&task->done, __ATOMIC_ACQUIRE))
+            continue;
+        HASH_DEL(g_mesh_tasks, task);
+        mesh_task_delete(task);
     }
+}
+
+static int mesh_task_cmp(const void *a, const void *b)
+{
+    const mesh_task_t *ta = *(mesh_task_t**)a, *tb = *(mesh_task_t**)b;
+    return cmp(tb->priority, ta->priority);
+}
+
+// Called at the end of each asynchronous render, to give the workers the
+// waiting tasks needed in this frame, highest priority first.  The tasks
+// no longer needed stay in the queue until they get dropped.
+static void mesh_tasks_dispatch(void)
+{
+    mesh_task_t *task, *tmp, **queue;
+    int i, nb = 0, nb_running = 0, max_running, nb_workers;
+
+    if (!g_mesh_tasks) return;
+    queue = frame_alloc(HASH_COUNT(g_mesh_tasks) * sizeof(*queue));
+    HASH_ITER(hh, g_mesh_tasks, task, tmp) {
+        if (!task->started) {
+            if (g_frame - task->last_frame <= 1) queue[nb++] = task;
+            continue;
+        }
+        if (!__atomic_load_n(&task->done, __ATOMIC_ACQUIRE)) nb_running++;
+    }
+    if (!nb) return;
+    nb_workers = max(jobs_get_nb_workers() - 1, 1);
+    max_running = nb_workers *
+                  clamp((int)(MESH_QUEUE_TIME / g_mesh_time_avg), 2, 256);
+    if (nb_running >= max_running) return;
+    qsort(queue, nb, sizeof(*queue), mesh_task_cmp);
+    for (i = 0; i < min(nb, max_running - nb_running); i++) {
+        queue[i]->started = true;
+        jobs_async(mesh_task_run, queue[i]);
+    }
+}
+
+// Drop the levels of detail of the tiles we didn't render in a while.
+static void tile_lods_new_frame(void)
+{
+    tile_lod_t *tile, *tmp;
+    HASH_ITER(hh, g_tile_lods, tile, tmp) {
+        if (g_frame - tile->last_frame < 60) continue;
+        HASH_DEL(g_tile_lods, tile);
+        free(tile);
+    }
+}
+
+// Drop the costs of the volumes we didn't render in a while.
+static void volume_costs_new_frame(void)
+{
+    volume_cost_t *cost, *tmp;
+    HASH_ITER(hh, g_volume_costs, cost, tmp) {
+        if (g_frame - cost->frame < 60) continue;
+        HASH_DEL(g_volume_costs, cost);
+        free(cost);
+    }
+}
+
+// Get the cost entry of a volume, with the tiles counts reset if it
+// wasn't rendered yet in this frame.
+static volume_cost_t *get_volume_cost(const volume_t *volume)
+{
+    volume_cost_t *cost;
+    uint64_t key = volume_get_key(volume);
+
+    HASH_FIND(hh, g_volume_costs, &key, sizeof(key), cost);
+    if (!cost) {
+        cost = calloc(1, sizeof(*cost));
+        cost->key = key;
+        HASH_ADD(hh, g_volume_costs, key, sizeof(cost->key), cost);
+    }
+    if (cost->frame != g_frame) {
+        cost->frame = g_frame;
+        cost->stats.nb_tiles = 0;
+        cost->stats.vram = 0;
+    }
+    return cost;
+}
+
+bool render_get_volume_stats(const volume_t *volume,
+                             render_volume_stats_t *stats)
+{
+    volume_cost_t *cost;
+    uint64_t key = volume_get_key(volume);
+
+    pthread_mutex_lock(&g_render_mutex);
+    HASH_FIND(hh, g_volume_costs, &key, sizeof(key), cost);
+    if (cost) *stats = cost->stats;
+    pthread_mutex_unlock(&g_render_mutex);
+    return cost != NULL;
+}
+
+/*
+ * Compute the level of detail of a tile from the size of a voxel on screen:
+ * we use the highest level where the voxels are still smaller than a
+ * pixel.  The level only changes once we pass the threshold by more than
+ * LOD_HYSTERESIS, to avoid popping when the camera moves slightly.
+ */
+static int get_tile_lod(const renderer_t *rend, const float viewport[4],
+                        const int tile_pos[3])
+{
+    float p[4], w, voxel_size, v;
+    int i;
+    tile_lod_t *tile;
+
+    for (i = 0; i < 3; i++) p[i] = tile_pos[i] + TILE_SIZE / 2;
+    p[3] = 1;
+    mat4_mul_vec4(rend->view_mat, p, p);
+    w = rend->proj_mat[2][3] * p[2] + rend->proj_mat[3][3];
+    if (w <= 0) return 0;
+    // Size in pixels of a voxel at the center of the tile.
+    voxel_size = rend->proj_mat[1][1] * viewport[3] * rend->scale / 2 / w;
+    v = -log2f(voxel_size);
+
+    HASH_FIND(hh, g_tile_lods, tile_pos, sizeof(tile->pos), tile);
+    if (!tile) {
+        tile = calloc(1, sizeof(*tile));
+        memcpy(tile->pos, tile_pos, sizeof(tile->pos));
+        tile->lod = clamp((int)floorf(v), 0, LOD_MAX);
+        HASH_ADD(hh, g_tile_lods, pos, sizeof(tile->pos), tile);
+    }
+    tile->last_frame = g_frame;
+    if (v > tile->lod + 1 + LOD_HYSTERESIS || v < tile->lod - LOD_HYSTERESIS)
+        tile->lod = clamp((int)floorf(v), 0, LOD_MAX);
+    return tile->lod;
+}
+
+#if HAS_OCCLUSION_QUERIES
+
+// Drop the occlusion state of the tiles we didn't render in a while.
+static void tile_queries_new_frame(void)
+{
+    tile_query_t *q, *tmp;
+    HASH_ITER(hh, g_tile_queries, q, tmp) {
+        if (g_frame - q->last_frame < 60) continue;
+        HASH_DEL(g_tile_queries, q);
+        GL(glDeleteQueries(1, &q->query));
+        free(q);
+    }
+}
+
+/*
+ * Get the occlusion state of a tile, reading the result of its last query
+ * if it is available.  The tiles around the camera, and the ones we didn't
+ * render in the last frames, are always considered visible.
+ */
+static tile_query_t *get_tile_query(const tile_neighbors_t *tile,
+                                    const float model[4][4],
+                                    const float cam_pos[3])
+{
+    tile_query_key_t key;
+    tile_query_t *q;
+    GLuint available, samples;
+    int i;
+    bool near = true;
+
+    memset(&key, 0, sizeof(key)); // Just to be sure!
+    memcpy(key.pos, tile->pos, sizeof(key.pos));
+    key.id = tile->ids[13];
+    mat4_copy(model, key.model);
+    HASH_FIND(hh, g_tile_queries, &key, sizeof(key), q);
+    if (!q) {
+        q = calloc(1, sizeof(*q));
+        q->key = key;
+        q->last_frame = g_frame;
+        GL(glGenQueries(1, &q->query));
+        HASH_ADD(hh, g_tile_queries, key, sizeof(q->key), q);
+    }
+    if (q->pending) {
+        GL(glGetQueryObjectuiv(q->query, GL_QUERY_RESULT_AVAILABLE,
+                               &available));
+        if (available) {
+            GL(glGetQueryObjectuiv(q->query, GL_QUERY_RESULT, &samples));
+            q->occluded = samples == 0;
+            q->pending = false;
+        }
+    }
+    // Keep a margin of one tile for the near clipping plane.
+    for (i = 0; i < 3; i++) {
+        if (cam_pos[i] < tile->pos[i] - TILE_SIZE ||
+            cam_pos[i] > tile->pos[i] + TILE_SIZE * 2) near = false;
+    }
+    if (near || g_frame - q->last_frame > 4) q->occluded = false;
+    q->last_frame = g_frame;
+    return q;
+}
+
+// Render the boxes of the occluded tiles into their queries, without
+// writing anything, to know if they are visible again.
+static void test_occluded_tiles(const renderer_t *rend,
+                                const float model[4][4],
+                                tile_query_t **queries, int nb)
+{
+    typedef struct {
+        int8_t  pos[3]       __attribute__((aligned(4)));
+    } vertex_t;
+    vertex_t vertices[24];
+    gl_shader_t *shader;
+    float box[4][4];
+    const int *p, *pos;
+    int f, i;
+
+    for (f = 0; f < 6; f++)
+    for (i = 0; i < 4; i++) {
+        p = VERTICES_POSITIONS[FACES_VERTICES[f][i]];
+        vertices[f * 4 + i] = (vertex_t){{p[0], p[1], p[2]}};
+    }
+
+    shader = shader_get("shadow_map", NULL, ATTR_NAMES, shader_init);
+    GL(glUseProgram(shader->prog));
+    gl_update_uniform(shader, "u_proj", rend->proj_mat);
+    gl_update_uniform(shader, "u_view", rend->view_mat);
+    gl_update_uniform(shader, "u_pos_scale", 1.0);
+
+    GL(glColorMask(false, false, false, false));
+    GL(glDepthMask(false));
+    GL(glDisable(GL_CULL_FACE));
+    GL(glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, g_index_buffer));
+    GL(glBindBuffer(GL_ARRAY_BUFFER, g_background_array_buffer));
+    GL(glBufferData(GL_ARRAY_BUFFER, sizeof(vertices),
+                    vertices, GL_DYNAMIC_DRAW));
+    GL(glEnableVertexAttribArray(A_POS_LOC));
+    GL(glVertexAttribPointer(A_POS_LOC, 3, GL_BYTE, false, sizeof(vertex_t),
+                             (void*)(intptr_t)offsetof(vertex_t, pos)));
+
+    for (i = 0; i < nb; i++) {
+        // Same margin of one voxel as the frustum culling.
+        pos = queries[i]->key.pos;
+        mat4_copy(model, box);
+        mat4_itranslate(box, pos[0] - 1, pos[1] - 1, pos[2] - 1);
+        mat4_iscale(box, TILE_SIZE + 2, TILE_SIZE + 2, TILE_SIZE + 2);
+        gl_update_uniform(shader, "u_model", box);
+        GL(glBeginQuery(GL_SAMPLES_PASSED, queries[i]->query));
+        GL(glDrawElements(GL_TRIANGLES, 36, GL_UNSIGNED_SHORT, 0));
+        GL(glEndQuery(GL_SAMPLES_PASSED));
+        queries[i]->pending = true;
+    }
+
+    GL(glDisableVertexAttribArray(A_POS_LOC));
+    GL(glEnable(GL_CULL_FACE));
+    GL(glDepthMask(true));
+    GL(glColorMask(true, true, true, true));
+}
+
+#else
+
+static void tile_queries_new_frame(void) {}
+
+static tile_query_t *get_tile_query(const tile_neighbors_t *tile,
+                                    const float model[4][4],
+                                    const float cam_pos[3])
+{
+    return NULL;
+}
+
+static void test_occluded_tiles(const renderer_t *rend,
+                                const float model[4][4],
+                                tile_query_t **queries, int nb)
+{
+}
+
+#endif // HAS_OCCLUSION_QUERIES
+
+// For the picking, record the position of a tile so that we can get it
+// back from its id, and get the tile id part of the picking buffer value,
+// as the RGBA color to render.
+static bool pick_add_tile(const int pos[3], float out[4])
+{
+    int i, tile_id;
+    uint32_t pick;
+
+    if (g_pick_tiles_nb >= PICK_TILES_MAX) return false;
+    if (g_pick_tiles_nb >= g_pick_tiles_capacity) {
+        g_pick_tiles_capacity = max(g_pick_tiles_capacity * 2, 256);
+        g_pick_tiles = realloc(g_pick_tiles, g_pick_tiles_capacity *
+                               sizeof(*g_pick_tiles));
+    }
+    memcpy(g_pick_tiles[g_pick_tiles_nb++], pos, sizeof(*g_pick_tiles));
+    tile_id = g_pick_tiles_nb;
+    pick = (tile_id & ((1u << PICK_POS_SHIFT) - 1)) |
+           ((uint32_t)(tile_id >> PICK_POS_SHIFT) << (PICK_POS_SHIFT + 3));
+    for (i = 0; i < 4; i++)
+        out[i] = ((pick >> (i * 8)) & 0xff) / 255.0;
+    return true;
+}
+
+// Draw one part of a tile mesh.
+static void render_item_part(const renderer_t *rend,
+                             const render_item_t *item,
+                             int effects, gl_shader_t *shader,
+                             int *bound_page)
+{
+    int attr, first, quads_ofs, lines_ofs;
+    const attribute_t *attrs;
+
+    // Only set the attributes when we change of vertex page.
+    if (item->page != *bound_page) {
+        *bound_page = item->page;
+        GL(glBindBuffer(GL_ARRAY_BUFFER, g_pages[item->page].buffer));
+        attrs = g_pages[item->page].packed ? PACKED_ATTRIBUTES : ATTRIBUTES;
+        for (attr = 0; attr < A_NB; attr++) {
+            if (!attrs[attr].size) {
+                GL(glDisableVertexAttribArray(attr));
+                continue;
+            }
+            GL(glEnableVertexAttribArray(attr));
+            GL(glVertexAttribPointer(attr,
+                                     attrs[attr].size,
+                                     attrs[attr].type,
+                                     attrs[attr].norm,
+                                     vertex_size(item->size),
+                                     (void*)(intptr_t)attrs[attr].offset));
+        }
+    }
+
+    // Offsets of the tile mesh in the page, and in the index buffer.
+    first = item->slot * 4;
+    quads_ofs = item->slot * 6 * 2;
+    lines_ofs = (BATCH_QUAD_COUNT * 6 + item->slot * 8) * 2;
 
-    mat4_copy(model, tile_model);
-    mat4_itranslate(tile_model, tile_pos[0], tile_pos[1], tile_pos[2]);
-    gl_update_uniform(shader, "u_model", tile_model);
     if (item->size == 4) {
         if (!(effects & (EFFECT_GRID | EFFECT_EDGES))) {
             GL(glDrawElements(GL_TRIANGLES, item->nb_elements * 6,
-                              GL_UNSIGNED_SHORT, 0));
+                              GL_UNSIGNED_SHORT,
+                              (void*)(uintptr_t)quads_ofs));
         } else {
             gl_update_uniform(shader, "u_l_amb", 0.0);
             gl_update_uniform(shader, "u_z_ofs", -0.001);
             GL(glDrawElements(GL_LINES, item->nb_elements * 8,
                               GL_UNSIGNED_SHORT,
-                              (void*)(uintptr_t)(BATCH_QUAD_COUNT * 6 * 2)));
+                              (void*)(uintptr_t)lines_ofs));
             gl_update_uniform(shader, "u_l_amb", rend->settings.ambient);
             gl_update_uniform(shader, "u_z_ofs", 0.0);
         }
     } else {
-        GL(glDrawArrays(GL_TRIANGLES, 0, item->nb_elements * item->size));
+        GL(glDrawArrays(GL_TRIANGLES, first,
+                        item->nb_elements * item->size));
     }
 
 #ifndef GLES2
@@ -487,15 +1721,117 @@ static void render_tile_(renderer_t *rend, volume_t *volume,
         GL(glPolygonMode(GL_FRONT_AND_BACK, GL_LINE));
         if (item->size == 4)
             GL(glDrawElements(GL_TRIANGLES, item->nb_elements * 6,
-                              GL_UNSIGNED_SHORT, 0));
+                              GL_UNSIGNED_SHORT,
+                              (void*)(uintptr_t)quads_ofs));
         else
-            GL(glDrawArrays(GL_TRIANGLES, 0, item->nb_elements * item->size));
+            GL(glDrawArrays(GL_TRIANGLES, first,
+                            item->nb_elements * item->size));
         GL(glPolygonMode(GL_FRONT_AND_BACK, GL_FILL));
         gl_update_uniform(shader, "u_l_amb", rend->settings.ambient);
     }
 #endif
 }
 
+// Render a tile, return false if its mesh is not ready yet.
+static bool render_tile_(renderer_t *rend, volume_t *volume,
+                         const tile_neighbors_t *tile,
+                         const material_t *material,
+                         int effects, gl_shader_t *shader,
+                         const float model[4][4],
+                         int lod, float priority, int *bound_page)
+{
+    render_item_t *item, *part;
+    float tile_model[4][4], tile_id[4];
+
+    item = get_item_for_tile(volume, tile, effects, lod,
+                              rend->settings.smoothness, rend->async,
+                              rend->disk_cache, priority);
+    if (!item) g_missing_tiles++;
+    if (!item) return false;
+    if (item->nb_elements == 0) return true;
+    if (g_volume_cost) {
+        g_volume_cost->stats.nb_tiles++;
+        g_volume_cost->stats.vram += get_item_vram(item);
+    }
+
+    if (effects & EFFECT_RENDER_POS) {
+        if (!pick_add_tile(tile->pos, tile_id)) return true;
+        gl_update_uniform(shader, "u_tile_id", tile_id);
+    }
+    gl_update_uniform(shader, "u_pos_scale",
+                      (float)(1 << item->lod) / item->subdivide);
+    mat4_copy(model, tile_model);
+    mat4_itranslate(tile_model, tile->pos[0], tile->pos[1], tile->pos[2]);
+    gl_update_uniform(shader, "u_model", tile_model);
+    for (part = item; part; part = part->part)
+        render_item_part(rend, part, effects, shader, bound_page);
+    return true;
+}
+
+/*
+ * Priority of the background meshing of a tile: the tiles under the cursor
+ * first, then the ones that look the biggest and are the closest to the
+ * cursor on screen.
+ */
+static float get_tile_priority(const renderer_t *rend, const float mvp[4][4],
+                               const int tile_pos[3])
+{
+    float p[4], size, dist;
+
+    p[0] = tile_pos[0] + TILE_SIZE / 2.0;
+    p[1] = tile_pos[1] + TILE_SIZE / 2.0;
+    p[2] = tile_pos[2] + TILE_SIZE / 2.0;
+    p[3] = 1;
+    mat4_mul_vec4(mvp, p, p);
+    // Tiles around or behind the camera are as big as it gets.
+    p[3] = max(p[3], 1.0f);
+    // Approximate tile size in normalized device coordinates.
+    size = TILE_SIZE * fabsf(rend->proj_mat[1][1]) / p[3];
+    dist = hypotf(p[0] / p[3] - rend->focus[0], p[1] / p[3] - rend->focus[1]);
+    dist = max(dist - size / 2, 0.0f);
+    return size / (dist + 0.05);
+}
+
+// Draw the bounding box of the tiles whose meshes are not ready yet, all
+// in a single draw call.
+static void render_placeholders(const renderer_t *rend,
+                                const float model[4][4],
+                                const material_t *material,
+                                int nb, const int (*pos)[3])
+{
+    const model3d_t *cube = g_wire_cube_model;
+    model_vertex_t *out;
+    float mat[4][4];
+    uint8_t color[4];
+    int i, j, count = nb * cube->nb_vertices;
+
+    for (i = 0; i < 4; i++)
+        color[i] = clamp(material->base_color[i] * 255, 0, 255);
+    color[3] = color[3] / 4;
+    if (count > g_batch_model->nb_vertices) {
+        g_batch_model->vertices = realloc(g_batch_model->vertices,
+                count * sizeof(*g_batch_model->vertices));
+    }
+    out = g_batch_model->vertices;
+    for (i = 0; i < nb; i++) {
+        mat4_set_identity(mat);
+        mat4_itranslate(mat, pos[i][0] + TILE_SIZE / 2.0,
+                             pos[i][1] + TILE_SIZE / 2.0,
+                             pos[i][2] + TILE_SIZE / 2.0);
+        mat4_iscale(mat, TILE_SIZE / 2.0, TILE_SIZE / 2.0, TILE_SIZE / 2.0);
+        for (j = 0; j < cube->nb_vertices; j++, out++) {
+            *out = cube->vertices[j];
+            mat4_mul_vec3(mat, cube->vertices[j].pos, out->pos);
+        }
+    }
+    g_batch_model->nb_vertices = count;
+    g_batch_model->solid = false;
+    g_batch_model->cull = false;
+    g_batch_model->dirty = true;
+    model3d_render(g_batch_model, model, rend->view_mat, rend->proj_mat,
+                   color, NULL, NULL, NULL, 0);
+}
+
 static void get_light_dir(const renderer_t *rend, float out[3])
 {
     float light_dir[4];
@@ -520,6 +1856,23 @@ void render_get_light_dir(const renderer_t *rend, float out[3])
     get_light_dir(rend, out);
 }
 
+bool render_is_busy(void)
+{
+    bool ret;
+    pthread_mutex_lock(&g_render_mutex);
+    ret = g_mesh_tasks != NULL;
+    pthread_mutex_unlock(&g_render_mutex);
+    return ret;
+}
+
+// The picking renders are only done by the main thread.
+bool render_get_pick_tile_pos(int id, int pos[3])
+{
+    if (id < 1 || id > g_pick_tiles_nb) return false;
+    memcpy(pos, g_pick_tiles[id - 1], sizeof(g_pick_tiles[id - 1]));
+    return true;
+}
+
 // Compute the minimum projection box to use for the shadow map.
 static void compute_shadow_map_box(
                 const renderer_t *rend,
@@ -559,6 +1912,7 @@ static void compute_shadow_map_box(
             for (i = 0; i < 8; i++) {
                 vec3_set(p, bpos[0], bpos[1], bpos[2]);
                 vec3_addk(p, POS[i], N, p);
+                mat4_mul_vec3(item->mat, p, p);
                 mat4_mul_vec3(view_mat, p, p);
                 rect[0] = min(rect[0], p[0]);
                 rect[1] = max(rect[1], p[0]);
@@ -571,41 +1925,377 @@ static void compute_shadow_map_box(
     }
 }
 
+// Test if a tile is fully outside of the projection frustum.  All the
+// corners of the tile box have to be on the outer side of the same clip
+// plane.
+static bool tile_is_culled(const float mvp[4][4], const int tile_pos[3])
+{
+    int i, j, outside[6] = {};
+    float p[4];
+    // Add a margin of one voxel, for the marching cubes meshes.
+    const float s = TILE_SIZE + 2;
+
+    for (i = 0; i < 8; i++) {
+        p[0] = tile_pos[0] - 1 + ((i >> 0) & 1) * s;
+        p[1] = tile_pos[1] - 1 + ((i >> 1) & 1) * s;
+        p[2] = tile_pos[2] - 1 + ((i >> 2) & 1) * s;
+        p[3] = 1;
+        mat4_mul_vec4(mvp, p, p);
+        for (j = 0; j < 3; j++) {
+            if (p[j] < -p[3]) outside[j * 2 + 0]++;
+            if (p[j] > +p[3]) outside[j * 2 + 1]++;
+        }
+    }
+    for (j = 0; j < 6; j++) {
+        if (outside[j] == 8) return true;
+    }
+    return false;
+}
+
+static int pos_cmp(const void *a_, const void *b_)
+{
+    const int *a = a_, *b = b_;
+    int i;
+    for (i = 0; i < 3; i++) {
+        if (a[i] != b[i]) return a[i] < b[i] ? -1 : 1;
+    }
+    return 0;
+}
+
+// Test if a tile is removed by the filter of a volume item.
+static bool tile_is_filtered(const tiles_filter_t *filter, const int pos[3])
+{
+    bool found;
+    if (!filter || !filter->mode) return false;
+    found = bsearch(pos, filter->pos, filter->nb, sizeof(*filter->pos),
+                    pos_cmp) != NULL;
+    return (filter->mode == TILES_FILTER_INCLUDE) != found;
+}
+
+static void get_volume_defines(const renderer_t *rend, int effects,
+                               bool shadow, shader_define_t defines[11])
+{
+    int i = 0;
+    defines[i++] = (shader_define_t){"SHADOW", shadow};
+    defines[i++] = (shader_define_t){"MATERIAL_UNLIT",
+        (rend->settings.effects & EFFECT_UNLIT) || (effects & EFFECT_EDGES)};
+    defines[i++] = (shader_define_t){"HAS_TANGENTS", effects & EFFECT_BORDERS};
+    defines[i++] = (shader_define_t){"ONLY_EDGES", effects & EFFECT_EDGES};
+    defines[i++] = (shader_define_t){"HAS_OCCLUSION_MAP",
+        rend->settings.occlusion_strength > 0};
+    defines[i++] = (shader_define_t){"VERTEX_LIGHTNING",
+        !(effects & (EFFECT_BORDERS | EFFECT_UNLIT))};
+    defines[i++] = (shader_define_t){"SMOOTHNESS",
+        rend->settings.smoothness > 0};
+    defines[i++] = (shader_define_t){"PACKED_VERTEX",
+        !(effects & EFFECT_MARCHING_CUBES)};
+    defines[i++] = (shader_define_t){"OIT", g_oit.active};
+    defines[i++] = (shader_define_t){"BAKED_AO",
+        (effects & EFFECT_BAKED_AO) && !(effects & EFFECT_MARCHING_CUBES) &&
+        rend->settings.occlusion_strength > 0};
+    defines[i++] = (shader_define_t){};
+}
+
+static gl_shader_t *get_volume_shader(const renderer_t *rend, int effects,
+                                      bool shadow)
+{
+    shader_define_t defines[11];
+    get_volume_defines(rend, effects, shadow, defines);
+    return shader_get("volume", defines, ATTR_NAMES, shader_init);
+}
+
+static bool warm_up(const renderer_t *rend)
+{
+    int i, effects;
+    bool shadow;
+    shader_define_t defines[11];
+    const int EFFECTS[] = {0, EFFECT_BORDERS, EFFECT_EDGES,
+                           EFFECT_MARCHING_CUBES};
+
+    if (!shader_is_cached("pos_data", PICK_DEFINES)) {
+        shader_get("pos_data", PICK_DEFINES, ATTR_NAMES, shader_init);
+        return true;
+    }
+    if (!shader_is_cached("shadow_map", NULL)) {
+        shader_get("shadow_map", NULL, ATTR_NAMES, shader_init);
+        return true;
+    }
+    for (i = 0; i < ARRAY_SIZE(EFFECTS) * 2; i++) {
+        effects = EFFECTS[i / 2];
+        shadow = i % 2;
+        get_volume_defines(rend, effects, shadow, defines);
+        if (shader_is_cached("volume", defines)) continue;
+        get_volume_shader(rend, effects, shadow);
+        return true;
+    }
+    return false;
+}
+
+bool render_warm_up(const renderer_t *rend)
+{
+    bool ret;
+    pthread_mutex_lock(&g_render_mutex);
+    ret = warm_up(rend);
+    pthread_mutex_unlock(&g_render_mutex);
+    return ret;
+}
+
+#if HAS_RAYMARCH
+
+static void atlas_init(void)
+{
+    int i, x, y, z;
+    const int n = ATLAS_SIZE / TILE_SIZE;
+
+    GL(glGenTextures(1, &g_atlas.tex));
+    GL(glBindTexture(GL_TEXTURE_3D, g_atlas.tex));
+    GL(glTexImage3D(GL_TEXTURE_3D, 0, GL_RGBA, ATLAS_SIZE, ATLAS_SIZE,
+                    ATLAS_SIZE / 2, 0, GL_RGBA, GL_UNSIGNED_BYTE, NULL));
+    GL(glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_MIN_FILTER, GL_NEAREST));
+    GL(glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_MAG_FILTER, GL_NEAREST));
+    GL(glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE));
+    GL(glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE));
+    GL(glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_WRAP_R, GL_CLAMP_TO_EDGE));
+
+    g_atlas.nb = n * n * n / 2;
+    g_atlas.slots = calloc(g_atlas.nb, sizeof(*g_atlas.slots));
+    for (i = 0, z = 0; z < n / 2; z++)
+    for (y = 0; y < n; y++)
+    for (x = 0; x < n; x++, i++) {
+        g_atlas.slots[i].frame = -1;
+        vec3_set(g_atlas.slots[i].pos,
+                 x * TILE_SIZE, y * TILE_SIZE, z * TILE_SIZE);
+    }
+}
+
+// Return the atlas slot of a tile, uploading its voxels if needed, or NULL
+// if all the slots are already used in this frame.
+static const atlas_slot_t *atlas_get_slot(const volume_t *volume,
+                                          volume_accessor_t *accessor,
+                                          const int pos[3], uint64_t id)
+{
+    atlas_slot_t *slot, *best = NULL;
+    uint8_t (*voxels)[4];
+    int i;
+
+    HASH_FIND(hh, g_atlas.table, &id, sizeof(id), slot);
+    if (slot) goto end;
+
+    for (i = 0; i < g_atlas.nb; i++) {
+        slot = &g_atlas.slots[i];
+        if (slot->frame == g_frame) continue;
+        if (!best || slot->frame < best->frame) best = slot;
+        if (!slot->id) break;
+    }
+    if (!best) return NULL;
+    slot = best;
+    if (slot->id) HASH_DEL(g_atlas.table, slot);
+    slot->id = id;
+    HASH_ADD(hh, g_atlas.table, id, sizeof(slot->id), slot);
+
+    voxels = frame_alloc(TILE_SIZE * TILE_SIZE * TILE_SIZE * 4);
+    volume_get_tile_voxels(volume, accessor, pos, voxels);
+    GL(glTexSubImage3D(GL_TEXTURE_3D, 0,
+                       slot->pos[0], slot->pos[1], slot->pos[2],
+                       TILE_SIZE, TILE_SIZE, TILE_SIZE,
+                       GL_RGBA, GL_UNSIGNED_BYTE, voxels));
+end:
+    slot->frame = g_frame;
+    return slot;
+}
+
+/*
+ * Render a volume with the raymarching shader, drawing the box of each
+ * tile.  Return false if the tiles do not fit in the atlas, in which case
+ * nothing is rendered.
+ */
+static bool render_volume_raymarch(renderer_t *rend, const volume_t *volume,
+                                   const tiles_filter_t *filter,
+                                   const material_t *material,
+                                   const float model[4][4], int effects,
+                                   const float shadow_mvp[4][4])
+{
+    typedef struct {
+        int8_t  pos[3]       __attribute__((aligned(4)));
+    } vertex_t;
+    vertex_t vertices[24];
+    gl_shader_t *shader;
+    const volume_tiles_t *tiles;
+    const tile_neighbors_t *tile;
+    const atlas_slot_t **slots;
+    volume_accessor_t accessor;
+    float mvp[4][4], camera[4][4], inv[4][4], cam_pos[4], cam_dir[4];
+    float light_dir[3], tile_pos[3], ofs[3], tile_id[4];
+    int f, i;
+    const int *p;
+    bool pick = effects & EFFECT_RENDER_POS;
+    bool shadow = rend->settings.shadow &&
+                  !(effects & (EFFECT_RENDER_POS | EFFECT_SHADOW_MAP));
+    const shader_define_t defines[] = {
+        {"PICK", pick},
+        {"POS_DATA_3_BYTES", PICK_POS_BYTES == 3},
+        {"SHADOW", shadow},
+        {"MATERIAL_UNLIT", rend->settings.effects & EFFECT_UNLIT},
+        {},
+    };
+
+    if (!g_atlas.tex) atlas_init();
+    GL(glActiveTexture(GL_TEXTURE3));
+    GL(glBindTexture(GL_TEXTURE_3D, g_atlas.tex));
+
+    // Get all the slots first, so that we can still use the meshes if
+    // there are too many tiles.
+    mat4_mul(rend->proj_mat, rend->view_mat, mvp);
+    mat4_imul(mvp, model);
+    tiles = get_volume_tiles(volume);
+    slots = frame_alloc(tiles->nb * sizeof(*slots));
+    accessor = volume_get_accessor(volume);
+    for (i = 0; i < tiles->nb; i++) {
+        tile = &tiles->tiles[i];
+        if (!tile->ids[13] || tile_is_culled(mvp, tile->pos)) continue;
+        if (tile_is_filtered(filter, tile->pos)) continue;
+        slots[i] = atlas_get_slot(volume, &accessor, tile->pos,
+                                  tile->ids[13]);
+        if (!slots[i]) return false;
+    }
+
+    for (f = 0; f < 6; f++)
+    for (i = 0; i < 4; i++) {
+        p = VERTICES_POSITIONS[FACES_VERTICES[f][i]];
+        vertices[f * 4 + i] = (vertex_t){{p[0] * 2 - 1, p[1] * 2 - 1,
+                                          p[2] * 2 - 1}};
+    }
+
+    shader = shader_get("raymarch", defines, ATTR_NAMES, NULL);
+    GL(glUseProgram(shader->prog));
+
+    // The rays are walked in the volume space.
+    mat4_invert(rend->view_mat, camera);
+    mat4_invert(model, inv);
+    mat4_mul_vec4(inv, camera[3], cam_pos);
+    mat4_mul_vec4(inv, VEC(-camera[2][0], -camera[2][1], -camera[2][2], 0),
+                  cam_dir);
+    get_light_dir(rend, light_dir);
+
+    gl_update_uniform(shader, "u_model", model);
+    gl_update_uniform(shader, "u_view", rend->view_mat);
+    gl_update_uniform(shader, "u_proj", rend->proj_mat);
+    gl_update_uniform(shader, "u_camera", cam_pos);
+    gl_update_uniform(shader, "u_camera_dir", cam_dir);
+    gl_update_uniform(shader, "u_ortho", rend->proj_mat[3][3] == 1 ? 1. : 0.);
+    gl_update_uniform(shader, "u_tile_size", (float)TILE_SIZE);
+    gl_update_uniform(shader, "u_atlas", 3);
+    gl_update_uniform(shader, "u_atlas_size",
+                      VEC(ATLAS_SIZE, ATLAS_SIZE, ATLAS_SIZE / 2));
+    gl_update_uniform(shader, "u_pick_scale", (float)(1 << PICK_DATA_SHIFT));
+    gl_update_uniform(shader, "u_m_base_color", material->base_color);
+    gl_update_uniform(shader, "u_m_emissive_factor", material->emission);
+    gl_update_uniform(shader, "u_l_dir", light_dir);
+    gl_update_uniform(shader, "u_l_int", rend->light.intensity);
+    gl_update_uniform(shader, "u_l_amb", rend->settings.ambient);
+    if (shadow) {
+        assert(shadow_mvp);
+        GL(glActiveTexture(GL_TEXTURE2));
+        GL(glBindTexture(GL_TEXTURE_2D, g_shadow_map->tex));
+        gl_update_uniform(shader, "u_shadow_mvp", shadow_mvp);
+        gl_update_uniform(shader, "u_shadow_tex", 2);
+        gl_update_uniform(shader, "u_shadow_strength", rend->settings.shadow);
+    }
+
+    GL(glEnable(GL_DEPTH_TEST));
+    GL(glDepthFunc(GL_LEQUAL));
+    GL(glDisable(GL_BLEND));
+    // Render the back faces, so that it also works when the camera is
+    // inside a tile.
+    GL(glEnable(GL_CULL_FACE));
+    GL(glCullFace(GL_FRONT));
+
+    GL(glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, g_index_buffer));
+    GL(glBindBuffer(GL_ARRAY_BUFFER, g_background_array_buffer));
+    GL(glBufferData(GL_ARRAY_BUFFER, sizeof(vertices),
+                    vertices, GL_DYNAMIC_DRAW));
+    GL(glEnableVertexAttribArray(A_POS_LOC));
+    GL(glVertexAttribPointer(A_POS_LOC, 3, GL_BYTE, false, sizeof(vertex_t),
+                             (void*)(intptr_t)offsetof(vertex_t, pos)));
+
+    if (pick) g_pick_tiles_nb = 0;
+    for (i = 0; i < tiles->nb; i++) {
+        if (!slots[i]) continue;
+        tile = &tiles->tiles[i];
+        if (pick) {
+            if (!pick_add_tile(tile->pos, tile_id)) break;
+            gl_update_uniform(shader, "u_tile_id", tile_id);
+        }
+        vec3_set(tile_pos, tile->pos[0], tile->pos[1], tile->pos[2]);
+        vec3_set(ofs, slots[i]->pos[0], slots[i]->pos[1], slots[i]->pos[2]);
+        gl_update_uniform(shader, "u_tile_pos", tile_pos);
+        gl_update_uniform(shader, "u_atlas_ofs", ofs);
+        GL(glDrawElements(GL_TRIANGLES, 36, GL_UNSIGNED_SHORT, 0));
+    }
+    GL(glDisableVertexAttribArray(A_POS_LOC));
+    GL(glCullFace(GL_BACK));
+    GL(glActiveTexture(GL_TEXTURE0));
+    return true;
+}
+
+#else
+
+static bool render_volume_raymarch(renderer_t *rend, const volume_t *volume,
+                                   const tiles_filter_t *filter,
+                                   const material_t *material,
+                                   const float model[4][4], int effects,
+                                   const float shadow_mvp[4][4])
+{
+    return false;
+}
+
+#endif // HAS_RAYMARCH
+
 static void render_volume_(renderer_t *rend, volume_t *volume,
-                         const material_t *material, int effects,
-                         const float shadow_mvp[4][4])
+                         const tiles_filter_t *filter,
+                         const material_t *material,
+                         const float model[4][4], int effects,
+                         const float shadow_mvp[4][4],
+                         const float viewport[4])
 {
     gl_shader_t *shader;
-    float model[4][4], camera[4][4];
-    int attr, tile_pos[3], tile_id;
+    float camera[4][4], mvp[4][4], inv[4][4], cam_pos[4];
+    int attr, i, bound_page = -1, lod = 0, nb_occluded = 0, nb_missing = 0;
+    int (*missing)[3] = NULL;
+    float priority = 0;
+    bool use_lod, occlusion, placeholders, drawn;
     float light_dir[3], alpha;
-    bool shadow = false;
-    volume_iterator_t iter;
+    bool shadow = false, oit;
+    const volume_tiles_t *tiles;
+    const tile_neighbors_t *tile;
+    tile_query_t *query, **occluded = NULL;
 
-    mat4_set_identity(model);
     get_light_dir(rend, light_dir);
+    oit = g_oit.active &&
+          !(effects & (EFFECT_RENDER_POS | EFFECT_SHADOW_MAP));
+
+    // The raymarching only renders opaque voxels.
+    if (effects & EFFECT_RAYMARCH) {
+        if (!oit && material->base_color[3] == 1 &&
+                !(effects & (EFFECT_SEE_BACK | EFFECT_SEMI_TRANSPARENT |
+                             EFFECT_MARCHING_CUBES)) &&
+                render_volume_raymarch(rend, volume, filter, material, model,
+                                       effects, shadow_mvp)) {
+            return;
+        }
+        effects &= ~EFFECT_RAYMARCH;
+    }
 
     if (effects & EFFECT_MARCHING_CUBES)
         effects &= ~EFFECT_BORDERS;
 
     if (effects & EFFECT_RENDER_POS)
-        shader = shader_get("pos_data", NULL, ATTR_NAMES, shader_init);
+        shader = shader_get("pos_data", PICK_DEFINES, ATTR_NAMES, shader_init);
     else if (effects & EFFECT_SHADOW_MAP)
         shader = shader_get("shadow_map", NULL, ATTR_NAMES, shader_init);
     else {
         shadow = rend->settings.shadow;
-        shader_define_t defines[] = {
-            {"SHADOW", shadow},
-            {"MATERIAL_UNLIT", (rend->settings.effects & EFFECT_UNLIT) ||
-                               (effects & EFFECT_EDGES)},
-            {"HAS_TANGENTS", effects & EFFECT_BORDERS},
-            {"ONLY_EDGES", effects & EFFECT_EDGES},
-            {"HAS_OCCLUSION_MAP", rend->settings.occlusion_strength > 0},
-            {"VERTEX_LIGHTNING", !(effects & (EFFECT_BORDERS | EFFECT_UNLIT))},
-            {"SMOOTHNESS", rend->settings.smoothness > 0},
-            {}
-        };
-        shader = shader_get("volume", defines, ATTR_NAMES, shader_init);
+        shader = get_volume_shader(rend, effects, shadow);
     }
 
     GL(glEnable(GL_DEPTH_TEST));
@@ -621,21 +2311,30 @@ static void render_volume_(renderer_t *rend, volume_t *volume,
 
     GL(glDisable(GL_BLEND));
 
-    if (effects & EFFECT_SEE_BACK) {
-        GL(glCullFace(GL_FRONT));
-        vec3_imul(light_dir, -0.5);
-    }
-
     alpha = material->base_color[3];
     if (effects & EFFECT_SEMI_TRANSPARENT) alpha *= 0.75;
 
-    if (alpha < 1) {
+    if (oit) {
+        // Both sides are blended in a single pass.
+        if (effects & EFFECT_SEE_BACK) GL(glDisable(GL_CULL_FACE));
         GL(glEnable(GL_BLEND));
-        GL(glBlendFunc(GL_CONSTANT_COLOR, GL_ONE_MINUS_CONSTANT_COLOR));
-        GL(glBlendColor(alpha, alpha, alpha, alpha));
+        GL(glBlendFuncSeparate(GL_ONE, GL_ONE,
+                               GL_ZERO, GL_ONE_MINUS_SRC_ALPHA));
+        GL(glDepthMask(false));
+    } else {
+        if (effects & EFFECT_SEE_BACK) {
+            GL(glCullFace(GL_FRONT));
+            vec3_imul(light_dir, -0.5);
+        }
+        if (alpha < 1) {
+            GL(glEnable(GL_BLEND));
+            GL(glBlendFunc(GL_CONSTANT_COLOR, GL_ONE_MINUS_CONSTANT_COLOR));
+            GL(glBlendColor(alpha, alpha, alpha, alpha));
+        }
     }
 
     GL(glUseProgram(shader->prog));
+    gl_update_uniform(shader, "u_alpha", alpha);
 
     if (shadow) {
         assert(shadow_mvp);
@@ -668,43 +2367,100 @@ static void render_volume_(renderer_t *rend, volume_t *volume,
     mat4_invert(rend->view_mat, camera);
     gl_update_uniform(shader, "u_camera", camera[3]);
 
-    for (attr = 0; attr < ARRAY_SIZE(ATTRIBUTES); attr++)
-        GL(glEnableVertexAttribArray(attr));
-
     GL(glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, g_index_buffer));
 
-    tile_id = 1;
-    iter = volume_get_iterator(volume,
-            VOLUME_ITER_TILES | VOLUME_ITER_INCLUDES_NEIGHBORS);
-    while (volume_iter(&iter, tile_pos)) {
-        render_tile_(rend, volume, &iter, tile_pos,
-                      tile_id++, material, effects, shader, model);
+    mat4_mul(rend->proj_mat, rend->view_mat, mvp);
+    mat4_imul(mvp, model);
+    // The picking and shadow map always use the full resolution meshes.
+    use_lod = rend->lod && viewport &&
+              !(effects & (EFFECT_RENDER_POS | EFFECT_SHADOW_MAP |
+                           EFFECT_MARCHING_CUBES));
+    // Only the opaque tiles of the main pass can hide the others.
+    occlusion = HAS_OCCLUSION_QUERIES && rend->occlusion_culling &&
+                viewport && !oit && alpha == 1 &&
+                !(effects & (EFFECT_RENDER_POS | EFFECT_SHADOW_MAP |
+                             EFFECT_SEE_BACK | EFFECT_SEMI_TRANSPARENT |
+                             EFFECT_GRID | EFFECT_EDGES));
+    // Only the main pass shows the tiles still being meshed.
+    placeholders = rend->async && viewport && !oit &&
+                   !(effects & (EFFECT_RENDER_POS | EFFECT_SHADOW_MAP |
+                                EFFECT_GRID | EFFECT_EDGES));
+    if (effects & EFFECT_RENDER_POS) g_pick_tiles_nb = 0;
+    tiles = get_volume_tiles(volume);
+    if (placeholders) missing = frame_alloc(tiles->nb * sizeof(*missing));
+    if (occlusion) {
+        occluded = frame_alloc(tiles->nb * sizeof(*occluded));
+        mat4_invert(model, inv);
+        mat4_mul_vec4(inv, camera[3], cam_pos);
+    }
+    // Only record the cost of the main passes.
+    if (viewport && !(effects & (EFFECT_RENDER_POS | EFFECT_SHADOW_MAP |
+                                 EFFECT_GRID | EFFECT_EDGES)))
+        g_volume_cost = get_volume_cost(volume);
+    for (i = 0; i < tiles->nb; i++) {
+        tile = &tiles->tiles[i];
+        if (tile_is_culled(mvp, tile->pos)) continue;
+        if (tile_is_filtered(filter, tile->pos)) continue;
+        query = NULL;
+        if (occlusion) {
+            query = get_tile_query(tile, model, cam_pos);
+            if (query->occluded) {
+                if (!query->pending) occluded[nb_occluded++] = query;
+                continue;
+            }
+            // Still waiting for the previous result.
+            if (query->pending) query = NULL;
+        }
+        if (use_lod) lod = get_tile_lod(rend, viewport, tile->pos);
+        if (rend->async) priority = get_tile_priority(rend, mvp, tile->pos);
+        if (query) GL(glBeginQuery(GL_SAMPLES_PASSED, query->query));
+        drawn = render_tile_(rend, volume, tile, material, effects, shader,
+                             model, lod, priority, &bound_page);
+        if (!drawn && missing)
+            memcpy(missing[nb_missing++], tile->pos, sizeof(tile->pos));
+        if (query) {
+            GL(glEndQuery(GL_SAMPLES_PASSED));
+            // Without a mesh the tile would pass for occluded.
+            query->pending = drawn;
+        }
     }
-    for (attr = 0; attr < ARRAY_SIZE(ATTRIBUTES); attr++)
+    g_volume_cost = NULL;
+    for (attr = 0; attr < A_NB; attr++)
         GL(glDisableVertexAttribArray(attr));
+    if (nb_occluded) test_occluded_tiles(rend, model, occluded, nb_occluded);
+    if (nb_missing)
+        render_placeholders(rend, model, material, nb_missing,
+                            (const int (*)[3])missing);
 
-    if (effects & EFFECT_SEE_BACK) {
+    if ((effects & EFFECT_SEE_BACK) && !oit) {
         effects &= ~EFFECT_SEE_BACK;
         effects |= EFFECT_SEMI_TRANSPARENT;
-        render_volume_(rend, volume, material, effects, shadow_mvp);
+        render_volume_(rend, volume, filter, material, model, effects,
+                       shadow_mvp, viewport);
     }
     GL(glDisable(GL_BLEND));
+    GL(glDepthMask(true));
 }
 
-void render_volume(renderer_t *rend, const volume_t *volume,
-                 const material_t *material, int effects)
+// Add the items to render a volume, with only the tiles that pass the
+// filter.
+static void add_volume_items(renderer_t *rend, const volume_t *volume,
+                             const tiles_filter_t *filter,
+                             const material_t *material,
+                             const float mat[4][4], int effects)
 {
     render_item_t *item;
     const material_t default_material = MATERIAL_DEFAULT;
     float alpha;
 
-    if (volume == NULL) return;
     material = material ?: &default_material;
 
     if (!(effects & EFFECT_GRID_ONLY)) {
-        item = calloc(1, sizeof(*item));
+        item = frame_item_new();
         item->type = ITEM_VOLUME;
         item->volume = volume_copy(volume);
+        if (filter) item->filter = *filter;
+        mat4_copy(mat, item->mat);
         item->material = *material;
         item->effects = effects | rend->settings.effects;
         item->effects &= ~(EFFECT_GRID | EFFECT_EDGES);
@@ -719,9 +2475,11 @@ void render_volume(renderer_t *rend, const volume_t *volume,
 
     if (effects & EFFECT_GRID) {
         alpha = 0.1;
-        item = calloc(1, sizeof(*item));
+        item = frame_item_new();
         item->type = ITEM_VOLUME;
         item->volume = volume_copy(volume);
+        if (filter) item->filter = *filter;
+        mat4_copy(mat, item->mat);
         item->effects = EFFECT_GRID | EFFECT_BORDERS;
         item->material = *material;
         vec4_set(item->material.base_color, 0, 0, 0, alpha);
@@ -730,9 +2488,11 @@ void render_volume(renderer_t *rend, const volume_t *volume,
 
     if (effects & EFFECT_EDGES) {
         alpha = 0.2;
-        item = calloc(1, sizeof(*item));
+        item = frame_item_new();
         item->type = ITEM_VOLUME;
         item->volume = volume_copy(volume);
+        if (filter) item->filter = *filter;
+        mat4_copy(mat, item->mat);
         item->effects = EFFECT_EDGES | EFFECT_BORDERS;
         item->material = *material;
         vec4_set(item->material.base_color, 0, 0, 0, alpha);
@@ -740,6 +2500,45 @@ void render_volume(renderer_t *rend, const volume_t *volume,
     }
 }
 
+void render_volume(renderer_t *rend, const volume_t *volume,
+                 const material_t *material, int effects)
+{
+    render_volume_transformed(rend, volume, material, mat4_identity, effects);
+}
+
+void render_volume_transformed(renderer_t *rend, const volume_t *volume,
+                               const material_t *material,
+                               const float mat[4][4], int effects)
+{
+    if (volume == NULL) return;
+    add_volume_items(rend, volume, NULL, material, mat, effects);
+}
+
+void render_volume_overlay(renderer_t *rend, const volume_t *volume,
+                           const volume_t *overlay,
+                           int nb, const int (*tiles)[3],
+                           const material_t *material, int effects)
+{
+    tiles_filter_t filter = {};
+
+    if (volume == NULL) return;
+    if (!overlay || !nb) {
+        render_volume(rend, volume, material, effects);
+        return;
+    }
+    // The list is shared by the items of the frame.
+    filter.nb = nb;
+    filter.pos = frame_alloc(nb * sizeof(*filter.pos));
+    memcpy(filter.pos, tiles, nb * sizeof(*filter.pos));
+    qsort(filter.pos, nb, sizeof(*filter.pos), pos_cmp);
+
+    filter.mode = TILES_FILTER_EXCLUDE;
+    add_volume_items(rend, volume, &filter, material, mat4_identity, effects);
+    filter.mode = TILES_FILTER_INCLUDE;
+    add_volume_items(rend, overlay, &filter, material, mat4_identity,
+                     effects);
+}
+
 static void render_model_item(renderer_t *rend, const render_item_t *item,
                               const float viewport[4])
 {
@@ -771,6 +2570,154 @@ static void render_model_item(renderer_t *rend, const render_item_t *item,
                    item->tex, light, item->clip_box, item->effects);
 }
 
+/*
+ * Test whether two following model items can be rendered with a single
+ * draw call, with their vertices transformed on the CPU.  Since the model
+ * shader doesn't transform the normals, only the positions and the colors
+ * change.  The grid effect uses the model matrix, so it cannot be batched.
+ */
+static bool items_can_batch(const render_item_t *a, const render_item_t *b)
+{
+    return a->type == ITEM_MODEL3D && b->type == ITEM_MODEL3D &&
+           !a->tex && !b->tex &&
+           !(a->effects & EFFECT_GRID) &&
+           a->effects == b->effects &&
+           a->proj_screen == b->proj_screen &&
+           a->model3d->solid == b->model3d->solid &&
+           a->model3d->cull == b->model3d->cull &&
+           memcmp(a->clip_box, b->clip_box, sizeof(a->clip_box)) == 0;
+}
+
+// Render nb following model items in a single draw call.
+static void render_model_batch(renderer_t *rend, const render_item_t *first,
+                               int nb, const float viewport[4])
+{
+    const render_item_t *item;
+    const model_vertex_t *v;
+    model_vertex_t *out;
+    render_item_t batch = *first;
+    int i, j, c, count = 0;
+
+    for (i = 0, item = first; i < nb; i++, item = item->next)
+        count += item->model3d->nb_vertices;
+    if (count > g_batch_model->nb_vertices) {
+        g_batch_model->vertices = realloc(g_batch_model->vertices,
+                count * sizeof(*g_batch_model->vertices));
+    }
+    out = g_batch_model->vertices;
+    for (i = 0, item = first; i < nb; i++, item = item->next) {
+        for (j = 0; j < item->model3d->nb_vertices; j++, out++) {
+            v = &item->model3d->vertices[j];
+            *out = *v;
+            mat4_mul_vec3(item->mat, v->pos, out->pos);
+            for (c = 0; c < 4; c++)
+                out->color[c] = (v->color[c] * item->color[c] + 127) / 255;
+        }
+    }
+    g_batch_model->nb_vertices = count;
+    g_batch_model->solid = first->model3d->solid;
+    g_batch_model->cull = first->model3d->cull;
+    g_batch_model->dirty = true;
+
+    batch.model3d = g_batch_model;
+    mat4_set_identity(batch.mat);
+    copy_color(NULL, batch.color);
+    render_model_item(rend, &batch, viewport);
+}
+
+static void render_shape_item(renderer_t *rend, const render_item_t *item)
+{
+    typedef struct {
+        int8_t  pos[3]       __attribute__((aligned(4)));
+    } vertex_t;
+    vertex_t vertices[24];
+    gl_shader_t *shader;
+    shader_define_t defines[2] = {};
+    float size[3], shape_mat[4][4], model[4][4], camera[4][4];
+    float light_dir[3], color[4], aabb_min[3], aabb_max[3];
+    int f, i, aabb[2][3], clip[2][3];
+    const int *p;
+
+    // Same transformation as in volume_op.
+    box_get_size(item->mat, size);
+    mat4_copy(item->mat, shape_mat);
+    mat4_iscale(shape_mat, 1 / size[0], 1 / size[1], 1 / size[2]);
+    mat4_invert(shape_mat, shape_mat);
+
+    // The voxels that can be inside the box, clipped by the image box.
+    box_get_aabb(item->mat, aabb);
+    if (!box_is_null(item->clip_box)) {
+        bbox_to_aabb(item->clip_box, clip);
+        for (i = 0; i < 3; i++) {
+            aabb[0][i] = max(aabb[0][i], clip[0][i]);
+            aabb[1][i] = min(aabb[1][i], clip[1][i]);
+        }
+    }
+    for (i = 0; i < 3; i++) {
+        if (aabb[0][i] >= aabb[1][i]) return;
+        aabb_min[i] = aabb[0][i];
+        aabb_max[i] = aabb[1][i];
+    }
+    bbox_from_aabb(model, aabb);
+
+    for (f = 0; f < 6; f++)
+    for (i = 0; i < 4; i++) {
+        p = VERTICES_POSITIONS[FACES_VERTICES[f][i]];
+        vertices[f * 4 + i] = (vertex_t){{p[0] * 2 - 1, p[1] * 2 - 1,
+                                          p[2] * 2 - 1}};
+    }
+
+    if (item->shape == &shape_sphere)
+        defines[0] = (shader_define_t){"SHAPE_SPHERE", true};
+    else if (item->shape == &shape_cylinder)
+        defines[0] = (shader_define_t){"SHAPE_CYLINDER", true};
+    else
+        defines[0] = (shader_define_t){"SHAPE_CUBE", true};
+    shader = shader_get("shape", defines, ATTR_NAMES, NULL);
+    GL(glUseProgram(shader->prog));
+
+    mat4_invert(rend->view_mat, camera);
+    get_light_dir(rend, light_dir);
+    vec4_set(color, item->color[0] / 255., item->color[1] / 255.,
+                    item->color[2] / 255., item->color[3] / 255.);
+    for (i = 0; i < 4; i++) color[i] *= item->material.base_color[i];
+
+    gl_update_uniform(shader, "u_model", model);
+    gl_update_uniform(shader, "u_view", rend->view_mat);
+    gl_update_uniform(shader, "u_proj", rend->proj_mat);
+    gl_update_uniform(shader, "u_camera", camera[3]);
+    gl_update_uniform(shader, "u_camera_dir",
+                      VEC(-camera[2][0], -camera[2][1], -camera[2][2]));
+    gl_update_uniform(shader, "u_ortho", rend->proj_mat[3][3] == 1 ? 1 : 0);
+    gl_update_uniform(shader, "u_shape_mat", shape_mat);
+    gl_update_uniform(shader, "u_shape_size", size);
+    gl_update_uniform(shader, "u_aabb_min", aabb_min);
+    gl_update_uniform(shader, "u_aabb_max", aabb_max);
+    gl_update_uniform(shader, "u_color", color);
+    gl_update_uniform(shader, "u_l_dir", light_dir);
+    gl_update_uniform(shader, "u_l_int", rend->light.intensity);
+    gl_update_uniform(shader, "u_l_amb", rend->settings.ambient);
+
+    GL(glEnable(GL_DEPTH_TEST));
+    GL(glDepthFunc(GL_LEQUAL));
+    GL(glDisable(GL_BLEND));
+    // Render the back faces, so that it also works when the camera is
+    // inside the box.
+    GL(glEnable(GL_CULL_FACE));
+    GL(glCullFace(GL_FRONT));
+
+    GL(glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, g_index_buffer));
+    GL(glBindBuffer(GL_ARRAY_BUFFER, g_background_array_buffer));
+    GL(glBufferData(GL_ARRAY_BUFFER, sizeof(vertices),
+                    vertices, GL_DYNAMIC_DRAW));
+    GL(glEnableVertexAttribArray(A_POS_LOC));
+    GL(glVertexAttribPointer(A_POS_LOC, 3, GL_BYTE, false, sizeof(vertex_t),
+                             (void*)(intptr_t)offsetof(vertex_t, pos)));
+    GL(glDrawElements(GL_TRIANGLES, 36, GL_UNSIGNED_SHORT, 0));
+    GL(glDisableVertexAttribArray(A_POS_LOC));
+    GL(glCullFace(GL_BACK));
+}
+
 static void render_grid_item(renderer_t *rend, const render_item_t *item)
 {
     int x, y, n;
@@ -791,7 +2738,7 @@ static void render_grid_item(renderer_t *rend, const render_item_t *item)
 void render_grid(renderer_t *rend, const float plane[4][4],
                  const uint8_t color[4], const float clip_box[4][4])
 {
-    render_item_t *item = calloc(1, sizeof(*item));
+    render_item_t *item = frame_item_new();
     item->type = ITEM_GRID;
     mat4_copy(plane, item->mat);
     mat4_iscale(item->mat, 1024, 1024, 1);
@@ -806,7 +2753,7 @@ void render_grid(renderer_t *rend, const float plane[4][4],
 void render_img(renderer_t *rend, texture_t *tex, const float mat[4][4],
                 int effects)
 {
-    render_item_t *item = calloc(1, sizeof(*item));
+    render_item_t *item = frame_item_new();
     item->type = ITEM_MODEL3D;
     mat ? mat4_copy(mat, item->mat) : mat4_set_identity(item->mat);
     item->proj_screen = !mat || (effects & EFFECT_PROJ_SCREEN);
@@ -823,7 +2770,7 @@ void render_img2(renderer_t *rend,
 {
     // Experimental for the moment!
     // Same as render_img, but we flip the texture!
-    render_item_t *item = calloc(1, sizeof(*item));
+    render_item_t *item = frame_item_new();
     item->type = ITEM_MODEL3D;
     mat ? mat4_copy(mat, item->mat) : mat4_set_identity(item->mat);
     mat4_iscale(item->mat, 1, -1, 1);
@@ -839,7 +2786,7 @@ void render_img2(renderer_t *rend,
 
 void render_rect(renderer_t *rend, const float plane[4][4], int effects)
 {
-    render_item_t *item = calloc(1, sizeof(*item));
+    render_item_t *item = frame_item_new();
     assert((effects & EFFECT_STRIP) == effects);
     item->type = ITEM_MODEL3D;
     mat4_copy(plane, item->mat);
@@ -853,7 +2800,7 @@ void render_rect(renderer_t *rend, const float plane[4][4], int effects)
 void render_rect_fill(renderer_t *rend, const float plane[4][4],
                       const uint8_t color[4])
 {
-    render_item_t *item = calloc(1, sizeof(*item));
+    render_item_t *item = frame_item_new();
     item->type = ITEM_MODEL3D;
     mat4_copy(plane, item->mat);
     item->model3d = g_rect_model;
@@ -875,7 +2822,7 @@ static void line_create_plane(const float a[3], const float b[3],
 void render_line(renderer_t *rend, const float a[3], const float b[3],
                  const uint8_t color[4], int effects)
 {
-    render_item_t *item = calloc(1, sizeof(*item));
+    render_item_t *item = frame_item_new();
     item->type = ITEM_MODEL3D;
     item->effects = effects;
     item->model3d = g_line_model;
@@ -890,7 +2837,7 @@ void render_cone(renderer_t *rend, const float mat[4][4],
                  const uint8_t color[4], int effects)
 {
     render_item_t *item;
-    item = calloc(1, sizeof(*item));
+    item = frame_item_new();
     item->type = ITEM_MODEL3D;
     item->model3d = g_cone_model;
     item->effects = EFFECT_NO_SHADING | effects;
@@ -902,7 +2849,7 @@ void render_cone(renderer_t *rend, const float mat[4][4],
 void render_box(renderer_t *rend, const float box[4][4],
                 const uint8_t color[4], int effects)
 {
-    render_item_t *item = calloc(1, sizeof(*item));
+    render_item_t *item = frame_item_new();
     assert((effects & (EFFECT_STRIP | EFFECT_WIREFRAME | EFFECT_SEE_BACK |
                        EFFECT_GRID | EFFECT_NO_DEPTH_TEST |
                        EFFECT_NO_SHADING)) == effects);
@@ -915,15 +2862,36 @@ void render_box(renderer_t *rend, const float box[4][4],
     DL_APPEND(rend->items, item);
 }
 
+void render_shape(renderer_t *rend, const shape_t *shape,
+                  const float mat[4][4], const uint8_t color[4],
+                  const material_t *material, const float clip_box[4][4])
+{
+    render_item_t *item = frame_item_new();
+    const material_t default_material = MATERIAL_DEFAULT;
+    item->type = ITEM_SHAPE;
+    item->shape = shape;
+    mat4_copy(mat, item->mat);
+    copy_color(color, item->color);
+    item->material = material ? *material : default_material;
+    if (clip_box) mat4_copy(clip_box, item->clip_box);
+    DL_APPEND(rend->items, item);
+}
+
 void render_sphere(renderer_t *rend, const float mat[4][4])
 {
-    render_item_t *item = calloc(1, sizeof(*item));
+    render_item_t *item = frame_item_new();
     item->type = ITEM_MODEL3D;
     mat4_copy(mat, item->mat);
     item->model3d = g_sphere_model;
     DL_APPEND(rend->items, item);
 }
 
+// Test whether a volume item is blended with the items behind it.
+static bool item_is_transparent(const render_item_t *item)
+{
+    return item->material.base_color[3] < 1;
+}
+
 static float item_sort_value(const render_item_t *a)
 {
     // Item with no depth test last.
@@ -934,10 +2902,13 @@ static float item_sort_value(const render_item_t *a)
             !(a->tex) && (a->color[3] == 255)) return 0;
 
     // Then all the non transparent volumes.
-    if (a->type == ITEM_VOLUME && a->material.base_color[3] == 1) return 2;
+    if (a->type == ITEM_VOLUME && !item_is_transparent(a)) return 2;
 
     // Then all the transparent volumes.
-    if (a->type == ITEM_VOLUME && a->material.base_color[3] < 1) return 4;
+    if (a->type == ITEM_VOLUME) return 4;
+
+    // Shapes are rendered like non transparent volumes.
+    if (a->type == ITEM_SHAPE) return 2;
 
     // Then the grids.
     if (a->type == ITEM_GRID) return 5;
@@ -952,11 +2923,43 @@ static int item_sort_cmp(const render_item_t *a, const render_item_t *b)
 }
 
 
+// Compute the key of all the state the shadow map depends on.
+static uint32_t get_shadow_map_key(const renderer_t *rend)
+{
+    render_item_t *item;
+    uint64_t volume_key;
+    int effects;
+    float light_dir[3];
+    uint32_t key = 1;
+
+    get_light_dir(rend, light_dir);
+    key = XXH32(light_dir, sizeof(light_dir), key);
+    DL_FOREACH(rend->items, item) {
+        if (item->type != ITEM_VOLUME) continue;
+        volume_key = volume_get_key(item->volume);
+        effects = item->effects & EFFECT_MARCHING_CUBES;
+        key = XXH32(&volume_key, sizeof(volume_key), key);
+        key = XXH32(item->mat, sizeof(item->mat), key);
+        key = XXH32(&effects, sizeof(effects), key);
+    }
+    return key ?: 1;
+}
+
 static void render_shadow_map(renderer_t *rend, float shadow_mvp[4][4])
 {
     render_item_t *item;
     float rect[6], light_dir[3];
     int effects;
+    uint32_t key;
+    TRACE_SCOPE("render_shadow_map");
+
+    // Reuse the last shadow map if nothing changed.
+    key = get_shadow_map_key(rend);
+    if (g_shadow_map && key == g_shadow_map_key) {
+        mat4_copy(g_shadow_map_mvp, shadow_mvp);
+        return;
+    }
+
     // Create a renderer looking at the scene from the light.
     compute_shadow_map_box(rend, rect);
     float bias_mat[4][4] = {{0.5, 0.0, 0.0, 0.0},
@@ -964,7 +2967,7 @@ static void render_shadow_map(renderer_t *rend, float shadow_mvp[4][4])
                             {0.0, 0.0, 0.5, 0.0},
                             {0.5, 0.5, 0.5, 1.0}};
     float ret[4][4];
-    renderer_t srend = {};
+    renderer_t srend = {.async = rend->async};
     get_light_dir(rend, light_dir);
     mat4_lookat(srend.view_mat, light_dir, VEC(0, 0, 0), VEC(0, 1, 0));
     mat4_ortho(srend.proj_mat,
@@ -992,19 +2995,29 @@ static void render_shadow_map(renderer_t *rend, float shadow_mvp[4][4])
 
     GL(glBindFramebuffer(GL_FRAMEBUFFER, g_shadow_map_fbo));
     GL(glViewport(0, 0, 2048, 2048));
+    profiler_begin(PROF_GPU_SHADOW);
     GL(glClear(GL_DEPTH_BUFFER_BIT));
 
+    g_missing_tiles = 0;
     DL_FOREACH(rend->items, item) {
         if (item->type == ITEM_VOLUME) {
-            effects = (item->effects & EFFECT_MARCHING_CUBES);
+            effects = item->effects &
+                      (EFFECT_MARCHING_CUBES | EFFECT_RAYMARCH);
             effects |= EFFECT_SHADOW_MAP;
-            render_volume_(&srend, item->volume, &item->material, effects, NULL);
+            render_volume_(&srend, item->volume, &item->filter,
+                           &item->material,
+                           item->mat, effects, NULL, NULL);
         }
     }
+    profiler_end(PROF_GPU_SHADOW);
     mat4_copy(bias_mat, ret);
     mat4_imul(ret, srend.proj_mat);
     mat4_imul(ret, srend.view_mat);
     mat4_copy(ret, shadow_mvp);
+
+    // Only keep the shadow map if all the tiles got rendered.
+    mat4_copy(ret, g_shadow_map_mvp);
+    g_shadow_map_key = g_missing_tiles ? 0 : key;
 }
 
 static void render_background(renderer_t *rend, const uint8_t col[4])
@@ -1015,7 +3028,7 @@ static void render_background(renderer_t *rend, const uint8_t col[4])
         float   color[4]     __attribute__((aligned(4)));
     } vertex_t;
     vertex_t vertices[4];
-    float c1[4], c2[4];
+    float c1[4], c2[4], c[3];
 
     if (!col || col[3] == 0) {
         GL(glClearColor(0, 0, 0, 0));
@@ -1028,6 +3041,11 @@ static void render_background(renderer_t *rend, const uint8_t col[4])
     vec4_set(c2, col[0] / 255., col[1] / 255., col[2] / 255., col[3] / 255.);
     vec3_iadd(c1, VEC(+0.2, +0.2, +0.2));
     vec3_iadd(c2, VEC(-0.2, -0.2, -0.2));
+    if (rend->tile_rect[3]) {
+        vec3_mix(c1, c2, rend->tile_rect[1], c);
+        vec3_mix(c1, c2, rend->tile_rect[1] + rend->tile_rect[3], c2);
+        vec3_copy(c, c1);
+    }
 
     vertices[0] = (vertex_t){{-1, -1, 0}, {c1[0], c1[1], c1[2], c1[3]}};
     vertices[1] = (vertex_t){{+1, -1, 0}, {c1[0], c1[1], c1[2], c1[3]}};
@@ -1053,14 +3071,259 @@ static void render_background(renderer_t *rend, const uint8_t col[4])
     GL(glDepthMask(true));
 }
 
+#if HAS_OIT
+
+static bool oit_is_supported(void)
+{
+    static int version = 0;
+    if (!version) sscanf((const char*)glGetString(GL_VERSION), "%d", &version);
+    return version >= 3 && !g_oit.failed;
+}
+
+static GLuint oit_create_target(int w, int h)
+{
+    GLuint tex;
+    GL(glGenTextures(1, &tex));
+    GL(glBindTexture(GL_TEXTURE_2D, tex));
+    GL(glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST));
+    GL(glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST));
+    GL(glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE));
+    GL(glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE));
+    GL(glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA16F, w, h, 0, GL_RGBA,
+                    GL_FLOAT, NULL));
+    return tex;
+}
+
+static void oit_create_buffers(int w, int h)
+{
+    if (g_oit.fbo) {
+        GL(glDeleteFramebuffers(1, &g_oit.fbo));
+        GL(glDeleteTextures(1, &g_oit.accum));
+        GL(glDeleteTextures(1, &g_oit.weight));
+        GL(glDeleteRenderbuffers(1, &g_oit.depth));
+    }
+    g_oit.w = w;
+    g_oit.h = h;
+    GL(glGenFramebuffers(1, &g_oit.fbo));
+    GL(glBindFramebuffer(GL_FRAMEBUFFER, g_oit.fbo));
+    g_oit.accum = oit_create_target(w, h);
+    g_oit.weight = oit_create_target(w, h);
+    GL(glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0,
+                              GL_TEXTURE_2D, g_oit.accum, 0));
+    GL(glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT1,
+                              GL_TEXTURE_2D, g_oit.weight, 0));
+    GL(glGenRenderbuffers(1, &g_oit.depth));
+    GL(glBindRenderbuffer(GL_RENDERBUFFER, g_oit.depth));
+    GL(glRenderbufferStorage(GL_RENDERBUFFER, GL_DEPTH24_STENCIL8, w, h));
+    GL(glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_DEPTH_STENCIL_ATTACHMENT,
+                                 GL_RENDERBUFFER, g_oit.depth));
+    GL(glDrawBuffers(2, (GLenum[]){GL_COLOR_ATTACHMENT0,
+                                   GL_COLOR_ATTACHMENT1}));
+    if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE) {
+        LOG_W("Cannot create the transparency buffers");
+        g_oit.failed = true;
+    }
+}
+
+/*
+ * Start to render the transparent volumes into the OIT buffers.
+ *
+ * The depth of the opaque items is copied from the frame buffer, so that
+ * they still hide the transparent volumes.  The transparent volumes don't
+ * write the depth, and are accumulated in any order, so we don't have to
+ * sort the tiles.  Return false if OIT is not supported, in which case the
+ * volumes are directly blended into the frame buffer.
+ */
+static bool oit_begin(renderer_t *rend, const float viewport[4])
+{
+    const float s = rend->scale;
+    const int x = viewport[0] * s, y = viewport[1] * s;
+    const int w = viewport[2] * s, h = viewport[3] * s;
+
+    if (!oit_is_supported() || w <= 0 || h <= 0) return false;
+    if (!g_oit.fbo || g_oit.w != w || g_oit.h != h)
+        oit_create_buffers(w, h);
+    if (g_oit.failed) goto error;
+
+    GL(glBindFramebuffer(GL_READ_FRAMEBUFFER, rend->fbo));
+    GL(glBindFramebuffer(GL_DRAW_FRAMEBUFFER, g_oit.fbo));
+    GL(glDisable(GL_SCISSOR_TEST));
+    // Not supported by all the frame buffers formats, so no GL macro here.
+    glBlitFramebuffer(x, y, x + w, y + h, 0, 0, w, h,
+                      GL_DEPTH_BUFFER_BIT, GL_NEAREST);
+    if (glGetError() != GL_NO_ERROR) {
+        LOG_W("Cannot copy the depth buffer, disable OIT");
+        g_oit.failed = true;
+        goto error;
+    }
+    GL(glBindFramebuffer(GL_FRAMEBUFFER, g_oit.fbo));
+    GL(glViewport(0, 0, w, h));
+    GL(glClearBufferfv(GL_COLOR, 0, (float[]){0, 0, 0, 1}));
+    GL(glClearBufferfv(GL_COLOR, 1, (float[]){0, 0, 0, 0}));
+    g_oit.active = true;
+    return true;
+
+error:
+    GL(glBindFramebuffer(GL_FRAMEBUFFER, rend->fbo));
+    GL(glViewport(x, y, w, h));
+    GL(glEnable(GL_SCISSOR_TEST));
+    return false;
+}
+
+// Composite the OIT buffers over the frame buffer.
+static void oit_end(renderer_t *rend, const float viewport[4])
+{
+    gl_shader_t *shader;
+    const float s = rend->scale;
+    const int8_t vertices[4][4] = {
+        {-1, -1, 0}, {+1, -1, 0}, {+1, +1, 0}, {-1, +1, 0}};
+
+    assert(g_oit.active);
+    g_oit.active = false;
+    GL(glBindFramebuffer(GL_FRAMEBUFFER, rend->fbo));
+    GL(glViewport(viewport[0] * s, viewport[1] * s,
+                  viewport[2] * s, viewport[3] * s));
+    GL(glEnable(GL_SCISSOR_TEST));
+
+    shader = shader_get("oit", NULL, ATTR_NAMES, NULL);
+    GL(glUseProgram(shader->prog));
+    GL(glActiveTexture(GL_TEXTURE0));
+    GL(glBindTexture(GL_TEXTURE_2D, g_oit.accum));
+    GL(glActiveTexture(GL_TEXTURE1));
+    GL(glBindTexture(GL_TEXTURE_2D, g_oit.weight));
+    gl_update_uniform(shader, "u_accum_tex", 0);
+    gl_update_uniform(shader, "u_weight_tex", 1);
+
+    GL(glDisable(GL_DEPTH_TEST));
+    GL(glEnable(GL_BLEND));
+    // The alpha of the frame buffer is kept.
+    GL(glBlendFuncSeparate(GL_ONE_MINUS_SRC_ALPHA, GL_SRC_ALPHA,
+                           GL_ZERO, GL_ONE));
+    GL(glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, g_index_buffer));
+    GL(glBindBuffer(GL_ARRAY_BUFFER, g_background_array_buffer));
+    GL(glBufferData(GL_ARRAY_BUFFER, sizeof(vertices), vertices,
+                    GL_DYNAMIC_DRAW));
+    GL(glEnableVertexAttribArray(A_POS_LOC));
+    GL(glVertexAttribPointer(A_POS_LOC, 3, GL_BYTE, false, 4, 0));
+    GL(glDrawElements(GL_TRIANGLES, 6, GL_UNSIGNED_SHORT, 0));
+    GL(glDisableVertexAttribArray(A_POS_LOC));
+    GL(glDisable(GL_BLEND));
+    GL(glEnable(GL_DEPTH_TEST));
+}
+
+#else
+
+static bool oit_begin(renderer_t *rend, const float viewport[4])
+{
+    return false;
+}
+
+static void oit_end(renderer_t *rend, const float viewport[4]) {}
+
+#endif // HAS_OIT
+
+#if HAS_RENDER_THREAD
+
+/*
+ * State of the render thread, see render_thread_start.
+ *
+ * The thread renders the passes queued by render_submit_async one at a
+ * time, into the target texture of the pass.  There are two passes, so
+ * that the main thread can use the target of the last one while the thread
+ * renders the next one.  The items of a pass are copied into its arena,
+ * and their textures are only released by the main thread, since the
+ * textures reference counts are not atomic.
+ */
+typedef struct {
+    renderer_t  rend;
+    float       viewport[4];
+    uint8_t     clear_color[4];
+    bool        clear;          // Set if clear_color is used.
+    int         w, h;           // Size of the render, in pixels.
+    texture_t   *target;        // Created and deleted by the thread.
+    arena_t     *arena;
+    int         nb_textures;
+    texture_t   **textures;     // Textures of the items.
+} render_pass_t;
+
+static struct {
+    pthread_t       thread;
+    pthread_mutex_t mutex;
+    pthread_cond_t  cond;
+    bool            running;
+    bool            stop;
+    void            (*bind)(void *user, bool current);
+    void            *user;
+    render_pass_t   passes[2];
+    int             nb_submitted;   // Total number of passes queued.
+    int             nb_done;        // Total number of passes rendered.
+} g_thread = {
+    .mutex = PTHREAD_MUTEX_INITIALIZER,
+    .cond = PTHREAD_COND_INITIALIZER,
+};
+
+// Fence after the commands of the last render, and whether they come from
+// the render thread.
+static GLsync g_sync = NULL;
+static bool g_sync_from_thread = false;
+
+// Make the current context wait for the commands of the last render, if
+// they were issued by the other context.
+static void context_wait(void)
+{
+    if (g_sync && g_sync_from_thread != g_in_render_thread)
+        GL(glWaitSync(g_sync, 0, GL_TIMEOUT_IGNORED));
+}
+
+// Add a fence after the commands of the current context.  They also need
+// to be flushed, or the other context could wait for them forever.
+static void context_signal(void)
+{
+    if (!g_thread.running) return;
+    if (g_sync) GL(glDeleteSync(g_sync));
+    GL(g_sync = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0));
+    GL(glFlush());
+    g_sync_from_thread = g_in_render_thread;
+}
+
+#else
+
+static void context_wait(void) {}
+static void context_signal(void) {}
+
+#endif // HAS_RENDER_THREAD
+
+// Remove an item from the frame queue.  The item memory itself belongs to
+// the frame arena.  The render thread leaves the textures to the main
+// thread, see render_wait_async.
+static void release_item(renderer_t *rend, render_item_t *item)
+{
+    DL_DELETE(rend->items, item);
+    if (!g_in_render_thread) texture_delete(item->tex);
+}
+
 void render_submit(renderer_t *rend, const float viewport[4],
                    const uint8_t clear_color[4])
 {
     render_item_t *item, *tmp;
+    int i, nb;
+    bool oit, oit_failed = false;
     float shadow_mvp[4][4];
     const float s = rend->scale;
     bool shadow = rend->settings.shadow &&
         !(rend->settings.effects & (EFFECT_RENDER_POS | EFFECT_SHADOW_MAP));
+    TRACE_SCOPE("render_submit");
+
+    pthread_mutex_lock(&g_render_mutex);
+    profiler_begin(PROF_SUBMIT);
+    cache_collect(g_items_cache);
+    cache_collect(g_tiles_cache);
+    context_wait();
+    g_frame++;
+    if (rend->async) mesh_tasks_new_frame();
+    if (rend->lod) tile_lods_new_frame();
+    if (rend->occlusion_culling) tile_queries_new_frame();
+    volume_costs_new_frame();
 
     if (shadow) {
         GL(glDisable(GL_SCISSOR_TEST));
@@ -1074,14 +3337,30 @@ void render_submit(renderer_t *rend, const float viewport[4],
     GL(glScissor(viewport[0] * s, viewport[1] * s,
                  viewport[2] * s, viewport[3] * s));
     GL(glLineWidth(rend->scale));
+    profiler_begin(PROF_GPU_MAIN);
     render_background(rend, clear_color);
 
+    // The sort is stable, so the batches keep the items order.
     DL_SORT(rend->items, item_sort_cmp);
-    DL_FOREACH_SAFE(rend->items, item, tmp) {
+    while ((item = rend->items)) {
+        for (nb = 1, tmp = item->next; tmp && items_can_batch(item, tmp);
+             tmp = tmp->next) nb++;
+        // The transparent volumes are consecutive, since they are sorted.
+        oit = item->type == ITEM_VOLUME && item_is_transparent(item) &&
+              !(item->effects & EFFECT_RENDER_POS);
+        if (g_oit.active && !oit) oit_end(rend, viewport);
+        if (oit && !g_oit.active && !oit_failed)
+            oit_failed = !oit_begin(rend, viewport);
+        if (nb > 1) {
+            render_model_batch(rend, item, nb, viewport);
+            for (i = 0; i < nb; i++) release_item(rend, rend->items);
+            continue;
+        }
         switch (item->type) {
         case ITEM_VOLUME:
-            render_volume_(rend, item->volume, &item->material, item->effects,
-                         shadow_mvp);
+            render_volume_(rend, item->volume, &item->filter,
+                           &item->material, item->mat,
+                           item->effects, shadow_mvp, viewport);
             volume_delete(item->volume);
             break;
         case ITEM_MODEL3D:
@@ -1090,17 +3369,214 @@ void render_submit(renderer_t *rend, const float viewport[4],
         case ITEM_GRID:
             render_grid_item(rend, item);
             break;
+        case ITEM_SHAPE:
+            render_shape_item(rend, item);
+            break;
         default:
             assert(false);
         }
-        DL_DELETE(rend->items, item);
-        texture_delete(item->tex);
-        free(item);
+        release_item(rend, item);
     }
+    if (g_oit.active) oit_end(rend, viewport);
     assert(rend->items == NULL);
+    if (rend->async) mesh_tasks_dispatch();
+    profiler_end(PROF_GPU_MAIN);
+    profiler_end(PROF_SUBMIT);
+    context_signal();
+    pthread_mutex_unlock(&g_render_mutex);
+}
+
+#if HAS_RENDER_THREAD
+
+// Render a pass in the render thread.
+static void render_pass(render_pass_t *pass)
+{
+    if (pass->target && (pass->target->tex_w < pass->w ||
+                         pass->target->tex_h < pass->h)) {
+        texture_delete(pass->target);
+        pass->target = NULL;
+    }
+    if (!pass->target)
+        pass->target = texture_new_buffer(pass->w, pass->h, TF_DEPTH);
+    // Only the bottom left part of the target is used, the texture size
+    // gives the uv scale when we render it.
+    pass->target->w = pass->w;
+    pass->target->h = pass->h;
+    pass->rend.fbo = pass->target->framebuffer;
+    render_submit(&pass->rend, pass->viewport,
+                  pass->clear ? pass->clear_color : NULL);
+    frame_reset();
+}
+
+static void *render_thread_func(void *user)
+{
+    int i;
+
+    g_in_render_thread = true;
+    g_thread.bind(g_thread.user, true);
+    GL(glEnable(GL_LINE_SMOOTH));
+
+    pthread_mutex_lock(&g_thread.mutex);
+    while (true) {
+        while (!g_thread.stop && g_thread.nb_done == g_thread.nb_submitted)
+            pthread_cond_wait(&g_thread.cond, &g_thread.mutex);
+        // The passes still queued are rendered before we stop.
+        if (g_thread.nb_done == g_thread.nb_submitted) break;
+        pthread_mutex_unlock(&g_thread.mutex);
+        render_pass(&g_thread.passes[g_thread.nb_done % 2]);
+        pthread_mutex_lock(&g_thread.mutex);
+        g_thread.nb_done++;
+        pthread_cond_broadcast(&g_thread.cond);
+    }
+    pthread_mutex_unlock(&g_thread.mutex);
+
+    for (i = 0; i < 2; i++) {
+        texture_delete(g_thread.passes[i].target);
+        g_thread.passes[i].target = NULL;
+    }
+    release_context_objects();
+    GL(glFinish());
+    g_thread.bind(g_thread.user, false);
+    return NULL;
+}
+
+bool render_thread_start(void (*bind)(void *user, bool current), void *user)
+{
+    assert(!g_thread.running);
+    if (!gl_has_extension("GL_ARB_sync")) return false;
+    g_thread.bind = bind;
+    g_thread.user = user;
+    g_thread.stop = false;
+    // Set first, so that the main thread fences its commands from now.
+    g_thread.running = true;
+    context_signal();
+    if (pthread_create(&g_thread.thread, NULL, render_thread_func, NULL)) {
+        LOG_E("Cannot create the render thread");
+        g_thread.running = false;
+        return false;
+    }
+    return true;
+}
+
+void render_thread_stop(void)
+{
+    int i;
+
+    if (!g_thread.running) return;
+    pthread_mutex_lock(&g_thread.mutex);
+    g_thread.stop = true;
+    pthread_cond_broadcast(&g_thread.cond);
+    pthread_mutex_unlock(&g_thread.mutex);
+    pthread_join(g_thread.thread, NULL);
+    render_wait_async();
+    for (i = 0; i < 2; i++) {
+        arena_delete(g_thread.passes[i].arena);
+        g_thread.passes[i].arena = NULL;
+    }
+    g_thread.nb_submitted = g_thread.nb_done = 0;
+    g_thread.running = false;
+    if (g_sync) {
+        GL(glWaitSync(g_sync, 0, GL_TIMEOUT_IGNORED));
+        GL(glDeleteSync(g_sync));
+        g_sync = NULL;
+    }
+}
+
+bool render_thread_is_running(void)
+{
+    return g_thread.running;
+}
+
+void render_submit_async(renderer_t *rend, const float viewport[4],
+                         const uint8_t clear_color[4], int w, int h)
+{
+    render_pass_t *pass;
+    render_item_t *item, *copy;
+    int nb = 0;
+    size_t size;
+
+    assert(g_thread.running);
+    // Wait for the last pass first, the other one can be reused.
+    render_wait_async();
+    pass = &g_thread.passes[g_thread.nb_submitted % 2];
+    if (!pass->arena) pass->arena = arena_create("render_pass", 64 << 10);
+    pass->rend = *rend;
+    pass->rend.items = NULL;
+    memcpy(pass->viewport, viewport, sizeof(pass->viewport));
+    pass->clear = clear_color != NULL;
+    if (clear_color) memcpy(pass->clear_color, clear_color, 4);
+    pass->w = w;
+    pass->h = h;
+
+    DL_COUNT(rend->items, item, nb);
+    pass->textures = arena_alloc(pass->arena,
+                                 max(nb, 1) * sizeof(*pass->textures));
+    while ((item = rend->items)) {
+        DL_DELETE(rend->items, item);
+        copy = arena_alloc(pass->arena, sizeof(*copy));
+        *copy = *item;
+        // The tiles filter positions are in the frame arena too.
+        if (item->filter.nb) {
+            size = item->filter.nb * sizeof(*item->filter.pos);
+            copy->filter.pos = arena_alloc(pass->arena, size);
+            memcpy(copy->filter.pos, item->filter.pos, size);
+        }
+        if (copy->tex) pass->textures[pass->nb_textures++] = copy->tex;
+        DL_APPEND(pass->rend.items, copy);
+    }
+
+    // So that the render thread sees the textures uploaded meanwhile.
+    pthread_mutex_lock(&g_render_mutex);
+    context_signal();
+    pthread_mutex_unlock(&g_render_mutex);
+
+    pthread_mutex_lock(&g_thread.mutex);
+    g_thread.nb_submitted++;
+    pthread_cond_broadcast(&g_thread.cond);
+    pthread_mutex_unlock(&g_thread.mutex);
+}
+
+texture_t *render_wait_async(void)
+{
+    render_pass_t *pass;
+    int i;
+
+    if (!g_thread.nb_submitted) return NULL;
+    pass = &g_thread.passes[(g_thread.nb_submitted - 1) % 2];
+    pthread_mutex_lock(&g_thread.mutex);
+    while (g_thread.nb_done < g_thread.nb_submitted)
+        pthread_cond_wait(&g_thread.cond, &g_thread.mutex);
+    pthread_mutex_unlock(&g_thread.mutex);
+    for (i = 0; i < pass->nb_textures; i++)
+        texture_delete(pass->textures[i]);
+    pass->nb_textures = 0;
+    arena_reset(pass->arena);
+    return pass->target;
+}
+
+#else
+
+bool render_thread_start(void (*bind)(void *user, bool current), void *user)
+{
+    return false;
 }
 
-void render_on_low_memory(renderer_t *rend)
+void render_thread_stop(void) {}
+
+bool render_thread_is_running(void)
+{
+    return false;
+}
+
+void render_submit_async(renderer_t *rend, const float viewport[4],
+                         const uint8_t clear_color[4], int w, int h)
 {
-    cache_clear(g_items_cache);
+    assert(false);
 }
+
+texture_t *render_wait_async(void)
+{
+    return NULL;
+}
+
+#endif // HAS_RENDER_THREAD
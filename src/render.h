@@ -22,6 +22,8 @@
 #include <stdint.h>
 #include <stdbool.h>
 
+#include "shape.h"
+
 enum {
     EFFECT_RENDER_POS       = 1 << 1,
     EFFECT_BORDERS          = 1 << 3,
@@ -45,6 +47,20 @@ enum {
     EFFECT_LINE_THICK       = 1 << 19,
 
     EFFECT_NO_DEPTH_TEST    = 1 << 20,
+
+    // Merge the coplanar faces of the same color into bigger quads.  The
+    // merged quads lose the per voxel picking data (pos_data), so this is
+    // only used for the renders that don't need it.
+    EFFECT_GREEDY_MESH      = 1 << 21,
+
+    // Bake a multi voxels radius ambient occlusion into the tiles vertices,
+    // instead of only using the direct neighbors.
+    EFFECT_BAKED_AO         = 1 << 22,
+
+    // Render the volumes by raymarching the tiles voxels uploaded into a 3D
+    // texture, instead of meshing them.  If not supported, or for the semi
+    // transparent volumes, the meshes are used instead.
+    EFFECT_RAYMARCH         = 1 << 23,
 };
 
 typedef struct {
@@ -73,6 +89,34 @@ struct renderer
 
     render_settings_t settings;
 
+    // If set, the tiles meshes that cannot be generated in the frame time
+    // budget are generated in the background, and not rendered until they
+    // are ready.
+    bool   async;
+
+    // If set, the meshes generated in the background are also saved in the
+    // user directory, and loaded from there the next time the same tiles
+    // are rendered, even after a restart.
+    bool   disk_cache;
+
+    // If set, the far tiles are rendered with lower resolution meshes.
+    bool   lod;
+
+    // If set, the tiles found hidden behind the others in the previous
+    // frame are not rendered.
+    bool   occlusion_culling;
+
+    // Part of the full view covered by the render, as x, y, w, h in the
+    // [0, 1] range, when a large image is rendered in several tiles.  The
+    // projection matrix already gives the tile frustum, but the background
+    // gradient still spans the full view.  Zero for the full view.
+    float  tile_rect[4];
+
+    // Position of the cursor in normalized device coordinates.  The tiles
+    // meshed in the background are done in order of distance to this
+    // point and screen size.
+    float  focus[2];
+
     render_item_t    *items;
 };
 
@@ -81,6 +125,41 @@ void render_deinit(void);
 void render_volume(renderer_t *rend, const volume_t *volume,
                  const material_t *material,
                  int effects);
+
+/*
+ * Function: render_volume_transformed
+ * Same as <render_volume>, but render the volume with a model matrix.
+ *
+ * The meshes of the tiles are reused as they are, so this is a cheap way
+ * to preview a transformation of a volume without moving its voxels.
+ */
+void render_volume_transformed(renderer_t *rend, const volume_t *volume,
+                               const material_t *material,
+                               const float mat[4][4], int effects);
+
+/*
+ * Function: render_volume_overlay
+ * Same as <render_volume>, but replace some tiles with the ones of an
+ * other volume.
+ *
+ * The other tiles keep their cached meshes, so this is a cheap way to
+ * preview a local edit of a large volume.
+ *
+ * Parameters:
+ *   rend     - The renderer.
+ *   volume   - The volume to render.
+ *   overlay  - The volume giving the replaced tiles.  It must also contain
+ *              the neighbors of the tiles, so that their meshes match.
+ *   nb       - Number of replaced tiles.
+ *   tiles    - Position of the replaced tiles.
+ *   material - The material, NULL for the default one.
+ *   effects  - Union of EFFECT_ values.
+ */
+void render_volume_overlay(renderer_t *rend, const volume_t *volume,
+                           const volume_t *overlay,
+                           int nb, const int (*tiles)[3],
+                           const material_t *material, int effects);
+
 void render_grid(renderer_t *rend, const float plane[4][4],
                  const uint8_t color[4], const float clip_box[4][4]);
 void render_line(renderer_t *rend, const float a[3], const float b[3],
@@ -90,6 +169,22 @@ void render_cone(renderer_t *rend, const float mat[4][4],
 void render_box(renderer_t *rend, const float box[4][4],
                 const uint8_t color[4], int effects);
 void render_sphere(renderer_t *rend, const float mat[4][4]);
+
+/*
+ * Function: render_shape
+ * Render a shape as the voxels volume_op would create, without voxelizing
+ * it.
+ *
+ * Parameters:
+ *   shape    - One of the sphere, cube or cylinder shapes.
+ *   mat      - The shape box.
+ *   color    - The voxels color.
+ *   material - The voxels material, or NULL for the default one.
+ *   clip_box - If set, only render the voxels inside this bbox.
+ */
+void render_shape(renderer_t *rend, const shape_t *shape,
+                  const float mat[4][4], const uint8_t color[4],
+                  const material_t *material, const float clip_box[4][4]);
 void render_img(renderer_t *rend, texture_t *tex, const float mat[4][4],
                 int efffects);
 
@@ -114,10 +209,81 @@ void render_rect_fill(renderer_t *rend, const float plane[4][4],
 //  clear_color: clear the screen with this first.
 void render_submit(renderer_t *rend, const float viewport[4],
                    const uint8_t clear_color[4]);
+
+/*
+ * Function: render_thread_start
+ * Start rendering the passes queued with <render_submit_async> in a
+ * separate thread.
+ *
+ * The thread needs its own OpenGL context, sharing the objects of the
+ * current one.  All the other renders still happen in the calling thread.
+ *
+ * Parameters:
+ *   bind   - Called from the render thread to make its context current,
+ *            or to release it before the thread stops.
+ *   user   - User data passed to the bind function.
+ *
+ * Returns:
+ *   False if the render thread is not supported.
+ */
+bool render_thread_start(void (*bind)(void *user, bool current), void *user);
+
+/*
+ * Function: render_thread_stop
+ * Render the queued pass, and stop the render thread.
+ */
+void render_thread_stop(void);
+
+bool render_thread_is_running(void);
+
+/*
+ * Function: render_submit_async
+ * Same as <render_submit>, but let the render thread do the render, into a
+ * texture of a given size.
+ *
+ * The queued items are copied, so this returns immediately, and we can
+ * start to add the items of the next frame.
+ */
+void render_submit_async(renderer_t *rend, const float viewport[4],
+                         const uint8_t clear_color[4], int w, int h);
+
+/*
+ * Function: render_wait_async
+ * Wait until the pass queued with <render_submit_async> is rendered.
+ *
+ * Returns:
+ *   The texture of the render, that stays valid until the second next
+ *   call to <render_submit_async>, or NULL if nothing was queued.
+ */
+texture_t *render_wait_async(void);
 // Compute the light direction in the model coordinates (toward the light)
 void render_get_light_dir(const renderer_t *rend, float out[3]);
 
-// Attempt to release some memory.
-void render_on_low_memory(renderer_t *rend);
+// Get the position of a tile from its id in the last picking render
+// (EFFECT_RENDER_POS).  Return false if the id is not valid.
+bool render_get_pick_tile_pos(int id, int pos[3]);
+
+// Create one of the commonly used shaders not used yet, so that we don't
+// stall the first time an effect is enabled.  Return false once they are
+// all ready.
+bool render_warm_up(const renderer_t *rend);
+
+// Return true if some tiles meshes are still generated in the background,
+// so that we need to render again once they are ready.
+bool render_is_busy(void);
+
+// Rendering cost of a volume, see <render_get_volume_stats>.
+typedef struct {
+    int      nb_tiles;      // Tiles rendered in the last frame.
+    int64_t  vram;          // Size of their meshes vertices, in bytes.
+    double   meshing_time;  // Time spent meshing this version (seconds).
+} render_volume_stats_t;
+
+// Get the rendering cost of a volume in the main render passes, as
+// recorded the last time it was rendered.  The stats are kept by volume
+// key, so the meshing time only counts the tiles meshed since the last
+// change.  Return false if the volume was not rendered recently.
+bool render_get_volume_stats(const volume_t *volume,
+                             render_volume_stats_t *stats);
 
 #endif // RENDER_H
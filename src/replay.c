@@ -0,0 +1,277 @@
+/* Goxel 3D voxels editor
+ *
+ * copyright (c) 2026 Guillaume Chereau <guillaume@noctua-software.com>
+ *
+ * Goxel is free software: you can redistribute it and/or modify it under the
+ * terms of the GNU General Public License as published by the Free Software
+ * Foundation, either version 3 of the License, or (at your option) any later
+ * version.
+
+ * Goxel is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+
+ * You should have received a copy of the GNU General Public License along with
+ * goxel.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "goxel.h"
+
+#include <errno.h> // IWYU pragma: keep.
+
+#define REPLAY_MAGIC "GXIN"
+#define REPLAY_VERSION 1
+
+// Max number of frames rendered to mesh the scene before the replay.
+#define REPLAY_WARMUP_FRAMES 10000
+
+static struct {
+    FILE    *file;
+    double  start;
+} g_record = {};
+
+// The frames are saved field by field, with the keys as a bitfield.
+static void write_frame(FILE *file, double time, const inputs_t *inputs)
+{
+    uint8_t keys[ARRAY_SIZE(inputs->keys) / 8] = {};
+    int i;
+
+    for (i = 0; i < ARRAY_SIZE(inputs->keys); i++) {
+        if (inputs->keys[i]) keys[i / 8] |= 1 << (i % 8);
+    }
+    fwrite(&time, sizeof(time), 1, file);
+    fwrite(inputs->window_size, sizeof(inputs->window_size), 1, file);
+    fwrite(&inputs->scale, sizeof(inputs->scale), 1, file);
+    fwrite(keys, sizeof(keys), 1, file);
+    fwrite(inputs->chars, sizeof(inputs->chars), 1, file);
+    for (i = 0; i < ARRAY_SIZE(inputs->touches); i++) {
+        fwrite(inputs->touches[i].pos, sizeof(inputs->touches[i].pos), 1,
+               file);
+        fwrite(inputs->touches[i].down, sizeof(inputs->touches[i].down), 1,
+               file);
+    }
+    fwrite(&inputs->mouse_wheel, sizeof(inputs->mouse_wheel), 1, file);
+}
+
+static bool read_frame(FILE *file, replay_frame_t *frame)
+{
+    uint8_t keys[ARRAY_SIZE(frame->inputs.keys) / 8];
+    inputs_t *inputs = &frame->inputs;
+    bool ok = true;
+    int i;
+
+    memset(frame, 0, sizeof(*frame));
+    ok = ok && fread(&frame->time, sizeof(frame->time), 1, file);
+    ok = ok && fread(inputs->window_size, sizeof(inputs->window_size), 1,
+                     file);
+    ok = ok && fread(&inputs->scale, sizeof(inputs->scale), 1, file);
+    ok = ok && fread(keys, sizeof(keys), 1, file);
+    ok = ok && fread(inputs->chars, sizeof(inputs->chars), 1, file);
+    for (i = 0; i < ARRAY_SIZE(inputs->touches); i++) {
+        ok = ok && fread(inputs->touches[i].pos,
+                         sizeof(inputs->touches[i].pos), 1, file);
+        ok = ok && fread(inputs->touches[i].down,
+                         sizeof(inputs->touches[i].down), 1, file);
+    }
+    ok = ok && fread(&inputs->mouse_wheel, sizeof(inputs->mouse_wheel), 1,
+                     file);
+    if (!ok) return false;
+    for (i = 0; i < ARRAY_SIZE(inputs->keys); i++)
+        inputs->keys[i] = keys[i / 8] & (1 << (i % 8));
+    return true;
+}
+
+int replay_record_start(const char *path)
+{
+    uint32_t version = REPLAY_VERSION;
+
+    replay_record_stop();
+    g_record.file = fopen(path, "wb");
+    if (!g_record.file) {
+        LOG_E("Cannot open %s: %s", path, strerror(errno));
+        return -1;
+    }
+    fwrite(REPLAY_MAGIC, 4, 1, g_record.file);
+    fwrite(&version, sizeof(version), 1, g_record.file);
+    g_record.start = sys_get_time();
+    return 0;
+}
+
+void replay_record_frame(const inputs_t *inputs)
+{
+    if (!g_record.file) return;
+    write_frame(g_record.file, sys_get_time() - g_record.start, inputs);
+}
+
+void replay_record_stop(void)
+{
+    if (!g_record.file) return;
+    fclose(g_record.file);
+    g_record.file = NULL;
+}
+
+int replay_load(const char *path, replay_frame_t **frames)
+{
+    FILE *file;
+    char magic[4];
+    uint32_t version;
+    int nb = 0, size = 0;
+
+    *frames = NULL;
+    file = fopen(path, "rb");
+    if (!file) {
+        LOG_E("Cannot open %s: %s", path, strerror(errno));
+        return -1;
+    }
+    if (    fread(magic, 4, 1, file) != 1 ||
+            memcmp(magic, REPLAY_MAGIC, 4) != 0 ||
+            fread(&version, sizeof(version), 1, file) != 1 ||
+            version != REPLAY_VERSION) {
+        LOG_E("Invalid inputs recording: %s", path);
+        fclose(file);
+        return -1;
+    }
+    while (true) {
+        if (nb == size) {
+            size = max(size * 2, 256);
+            *frames = realloc(*frames, size * sizeof(**frames));
+        }
+        if (!read_frame(file, &(*frames)[nb])) break;
+        nb++;
+    }
+    fclose(file);
+    return nb;
+}
+
+static int float_cmp(const void *a, const void *b)
+{
+    return cmp(*(const float*)a, *(const float*)b);
+}
+
+// Nearest rank percentile of sorted values.
+static float get_percentile(const float *values, int nb, float p)
+{
+    if (nb == 0) return 0;
+    return values[clamp((int)ceilf(p * nb) - 1, 0, nb - 1)];
+}
+
+// Render a frame into the offscreen buffer, and return its time.
+static double run_frame(const inputs_t *inputs_, double time,
+                        texture_t **fbo)
+{
+    inputs_t inputs = *inputs_;
+    int w = inputs.window_size[0] * inputs.scale;
+    int h = inputs.window_size[1] * inputs.scale;
+    double start;
+
+    if (!*fbo || (*fbo)->w != w || (*fbo)->h != h) {
+        texture_delete(*fbo);
+        *fbo = texture_new_buffer(w, h, TF_DEPTH);
+    }
+    inputs.framebuffer = (*fbo)->framebuffer;
+    goxel.replay_time = time;
+    start = sys_get_time();
+    goxel_iter(&inputs);
+    goxel_render(&inputs);
+    GL(glFinish());
+    return sys_get_time() - start;
+}
+
+// Sort the values of a section, log and save their percentiles.
+static void report(FILE *file, const char *name, float *values, int nb,
+                   bool first)
+{
+    float p50, p95, p99, max_v;
+
+    qsort(values, nb, sizeof(*values), float_cmp);
+    p50 = get_percentile(values, nb, 0.50);
+    p95 = get_percentile(values, nb, 0.95);
+    p99 = get_percentile(values, nb, 0.99);
+    max_v = nb ? values[nb - 1] : 0;
+    LOG_I("%-16s %8.2f %8.2f %8.2f %8.2f", name, p50, p95, p99, max_v);
+    if (!file) return;
+    fprintf(file, "%s    {\"name\": \"%s\", \"p50_ms\": %.3f, "
+            "\"p95_ms\": %.3f, \"p99_ms\": %.3f, \"max_ms\": %.3f}",
+            first ? "" : ",\n", name, p50, p95, p99, max_v);
+}
+
+int replay_bench(const char *path, const char *results_path)
+{
+    replay_frame_t *frames;
+    inputs_t warmup = {};
+    texture_t *fbo = NULL;
+    FILE *file = NULL;
+    float *times, *sections[PROF_COUNT], history[PROFILER_HISTORY];
+    bool profiler_enabled = profiler_is_enabled();
+    // The frames clock can't be zero, since it would mean the system time.
+    const double time_ofs = 1.0;
+    int nb, i, s, n;
+
+    nb = replay_load(path, &frames);
+    if (nb <= 0) {
+        if (nb == 0) LOG_E("No frames in %s", path);
+        free(frames);
+        return -1;
+    }
+    if (results_path) {
+        file = fopen(results_path, "w");
+        if (!file) {
+            LOG_E("Cannot open %s: %s", results_path, strerror(errno));
+            free(frames);
+            return -1;
+        }
+    }
+    times = calloc(nb, sizeof(*times));
+    for (s = 0; s < PROF_COUNT; s++)
+        sections[s] = calloc(nb, sizeof(*sections[s]));
+
+    // Mesh the scene first, with no keys or buttons pressed.
+    warmup.scale = frames[0].inputs.scale;
+    memcpy(warmup.window_size, frames[0].inputs.window_size,
+           sizeof(warmup.window_size));
+    for (i = 0; i < REPLAY_WARMUP_FRAMES; i++) {
+        run_frame(&warmup, time_ofs, &fbo);
+        if (goxel_is_idle()) break;
+    }
+
+    // The profiler records the timings of a frame at the start of the
+    // next one.
+    profiler_set_enabled(true);
+    for (i = 0; i <= nb; i++) {
+        if (i < nb) {
+            times[i] = run_frame(&frames[i].inputs,
+                                 time_ofs + frames[i].time, &fbo) * 1000;
+        } else {
+            profiler_new_frame();
+        }
+        if (i == 0) continue;
+        for (s = 0; s < PROF_COUNT; s++) {
+            n = profiler_get_history(s, history);
+            sections[s][i - 1] = n ? history[n - 1] : 0;
+        }
+    }
+    profiler_set_enabled(profiler_enabled);
+    goxel.replay_time = 0;
+
+    LOG_I("Replayed %d frames (%.1fs) of %s", nb, frames[nb - 1].time,
+          path);
+    LOG_I("%-16s %8s %8s %8s %8s", "(ms)", "p50", "p95", "p99", "max");
+    if (file) {
+        fprintf(file, "{\n  \"version\": \"%s\",\n  \"frames\": %d,\n"
+                "  \"sections\": [\n", GOXEL_VERSION_STR, nb);
+    }
+    report(file, "Frame", times, nb, true);
+    for (s = 0; s < PROF_COUNT; s++)
+        report(file, profiler_get_name(s), sections[s], nb, false);
+    if (file) {
+        fprintf(file, "\n  ]\n}\n");
+        fclose(file);
+    }
+
+    texture_delete(fbo);
+    for (s = 0; s < PROF_COUNT; s++) free(sections[s]);
+    free(times);
+    free(frames);
+    return 0;
+}
@@ -0,0 +1,104 @@
+/* Goxel 3D voxels editor
+ *
+ * copyright (c) 2026 Guillaume Chereau <guillaume@noctua-software.com>
+ *
+ * Goxel is free software: you can redistribute it and/or modify it under the
+ * terms of the GNU General Public License as published by the Free Software
+ * Foundation, either version 3 of the License, or (at your option) any later
+ * version.
+
+ * Goxel is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+
+ * You should have received a copy of the GNU General Public License along with
+ * goxel.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Section: Inputs replay
+ * Record the inputs of real editing sessions, and replay them offscreen
+ * to measure the interactive latency.
+ *
+ * Each frame of a recording keeps the inputs passed to <goxel_iter> and
+ * the time since the start of the recording.  The replay uses the recorded
+ * times as the frames clock, so that the gestures, double clicks and the
+ * dynamic resolution behave the same at each run whatever the speed of the
+ * machine.
+ */
+
+#ifndef REPLAY_H
+#define REPLAY_H
+
+#include "inputs.h"
+
+/*
+ * Type: replay_frame_t
+ * A recorded frame.
+ *
+ * Attributes:
+ *   time   - Seconds since the start of the recording.
+ *   inputs - The frame inputs.  The framebuffer and the safe margins are
+ *            not recorded.
+ */
+typedef struct {
+    double      time;
+    inputs_t    inputs;
+} replay_frame_t;
+
+/*
+ * Function: replay_record_start
+ * Start recording the inputs into a file.
+ *
+ * Returns:
+ *   Zero on success.
+ */
+int replay_record_start(const char *path);
+
+/*
+ * Function: replay_record_frame
+ * Add the inputs of a frame to the recording, if we are recording.
+ */
+void replay_record_frame(const inputs_t *inputs);
+
+/*
+ * Function: replay_record_stop
+ * Stop the recording and close the file.
+ */
+void replay_record_stop(void);
+
+/*
+ * Function: replay_load
+ * Load a recording.
+ *
+ * Parameters:
+ *   path   - The recording file.
+ *   frames - Get a newly allocated array of the frames.
+ *
+ * Returns:
+ *   The number of frames, or -1 in case of error.
+ */
+int replay_load(const char *path, replay_frame_t **frames);
+
+/*
+ * Function: replay_bench
+ * Replay a recording on the current image, and report the frames times.
+ *
+ * The frames are rendered into an offscreen buffer, and each one waits for
+ * the GPU to finish, so that the times include the drawing.  The scene is
+ * meshed before the first frame.  The p50, p95 and p99 of the frames times
+ * and of the profiler sections are logged, and saved as json if a results
+ * path is given.  The GPU sections are only read a few frames after they
+ * are issued, so the last frames don't count in them.
+ *
+ * Parameters:
+ *   path         - The recording file.
+ *   results_path - Json file for the results, or NULL.
+ *
+ * Returns:
+ *   Zero on success.
+ */
+int replay_bench(const char *path, const char *results_path);
+
+#endif // REPLAY_H
@@ -19,12 +19,16 @@
 #include "goxel.h"
 
 #include "file_format.h"
+#include "script.h"
 
 #include "../ext_src/quickjs/quickjs.h"
 #include "../ext_src/quickjs/quickjs-libc.h"
 
 #define STB_DS_IMPLEMENTATION
 #include "../ext_src/stb/stb_ds.h"
+#include "xxhash.h"
+
+#include <errno.h> // IWYU pragma: keep.
 
 static JSRuntime *g_rt = NULL;
 static JSContext *g_ctx = NULL;
@@ -88,11 +92,18 @@ static klass_t goxel_klass;
 typedef struct {
     char name[128];
     JSValue execute_fn;
+    // Source of the script, if it has not been evaluated yet.
+    char source[1024];
+    bool source_is_asset;
 } script_t;
 
 // stb array of registered scripts
 static script_t *g_scripts = NULL;
 
+// Number of formats registered, used to know if a script only registers
+// menu scripts.
+static int g_nb_formats = 0;
+
 typedef struct {
     int size;
     float *values;
@@ -134,6 +145,39 @@ static void get_vec_uint8(JSContext *ctx, JSValue val, int size, uint8_t *out,
     for (i = 0; i < size; i++) out[i] = buf[i];
 }
 
+// Parse an aabb given as two vectors [min, max], max being excluded.
+// Return the number of voxels, or -1 if the aabb is not valid.
+static int64_t get_aabb(JSContext *ctx, JSValue val, int aabb[2][3])
+{
+    int i;
+    JSValue v;
+    int64_t ret = 1;
+
+    for (i = 0; i < 2; i++) {
+        v = JS_GetPropertyUint32(ctx, val, i);
+        get_vec_int(ctx, v, 3, aabb[i], 0);
+        JS_FreeValue(ctx, v);
+    }
+    for (i = 0; i < 3; i++) {
+        if (aabb[1][i] < aabb[0][i]) return -1;
+        ret *= aabb[1][i] - aabb[0][i];
+    }
+    return ret;
+}
+
+// Create a new Uint8Array view over the whole of an ArrayBuffer.
+static JSValue new_uint8_array(JSContext *ctx, JSValue buf)
+{
+    JSValue global, ctor, ret;
+    global = JS_GetGlobalObject(ctx);
+    ctor = JS_GetPropertyStr(ctx, global, "Uint8Array");
+    ret = JS_CallConstructor(ctx, ctor, 1, &buf);
+    JS_FreeValue(ctx, ctor);
+    JS_FreeValue(ctx, global);
+    JS_FreeValue(ctx, buf);
+    return ret;
+}
+
 static JSValue js_vec_ctor(JSContext *ctx, JSValueConst new_target,
                            int argc, JSValueConst *argv)
 {
@@ -277,6 +321,34 @@ static JSValue js_box_from_ptr(
     return ret;
 }
 
+/*
+ * new Box(center, size)
+ * Create a box aligned with the axes.
+ */
+static JSValue js_box_ctor(JSContext *ctx, JSValueConst new_target,
+                           int argc, JSValueConst *argv)
+{
+    float box[4][4], pos[3] = {0, 0, 0}, size[3] = {1, 1, 1};
+    int i;
+    JSValue v;
+    double x;
+
+    for (i = 0; i < 3; i++) {
+        if (argc > 0) {
+            v = JS_GetPropertyUint32(ctx, argv[0], i);
+            if (!JS_ToFloat64(ctx, &x, v)) pos[i] = x;
+            JS_FreeValue(ctx, v);
+        }
+        if (argc > 1) {
+            v = JS_GetPropertyUint32(ctx, argv[1], i);
+            if (!JS_ToFloat64(ctx, &x, v)) size[i] = x;
+            JS_FreeValue(ctx, v);
+        }
+    }
+    bbox_from_extents(box, pos, size[0] / 2, size[1] / 2, size[2] / 2);
+    return js_box_from_ptr(ctx, JS_UNDEFINED, box, sizeof(box));
+}
+
 static JSValue js_box_iterVoxels(JSContext *ctx, JSValueConst this_val,
                                  int argc, JSValueConst *argv)
 {
@@ -331,6 +403,7 @@ static void js_box_finalizer(JSRuntime *rt, JSValue val)
 static klass_t box_klass = {
     .def.class_name = "Box",
     .def.finalizer = js_box_finalizer,
+    .ctor = js_box_ctor,
     .ctor_from_ptr = js_box_from_ptr,
     .attributes = {
         {"iterVoxels", .fn=js_box_iterVoxels},
@@ -339,6 +412,126 @@ static klass_t box_klass = {
     },
 };
 
+/*
+ * Get the matrix of a Box argument.  Throw an exception if the value is not
+ * a box, or if the box is degenerated.
+ */
+static int get_box(JSContext *ctx, JSValueConst val, float out[4][4])
+{
+    box_t *box;
+    float inv[4][4];
+    int i;
+
+    box = JS_GetOpaque2(ctx, val, box_klass.id);
+    if (!box) return -1;
+    for (i = 0; i < 16; i++) {
+        if (!isfinite(((float*)box->mat)[i])) goto invalid;
+    }
+    if (box_is_null(box->mat) || !mat4_invert(box->mat, inv)) goto invalid;
+    mat4_copy(box->mat, out);
+    return 0;
+invalid:
+    JS_ThrowRangeError(ctx, "invalid box");
+    return -1;
+}
+
+static const struct {
+    const char *name;
+    int mode;
+} MODES[] = {
+    {"over",            MODE_OVER},
+    {"sub",             MODE_SUB},
+    {"subClamp",        MODE_SUB_CLAMP},
+    {"paint",           MODE_PAINT},
+    {"max",             MODE_MAX},
+    {"intersect",       MODE_INTERSECT},
+    {"intersectFill",   MODE_INTERSECT_FILL},
+    {"multAlpha",       MODE_MULT_ALPHA},
+    {"replace",         MODE_REPLACE},
+};
+
+// Parse a mode name.  Undefined values give the default mode.
+static int get_mode(JSContext *ctx, JSValueConst val, int default_mode)
+{
+    const char *name;
+    int i, ret = -1;
+
+    if (JS_IsUndefined(val)) return default_mode;
+    name = JS_ToCString(ctx, val);
+    if (!name) return -1;
+    for (i = 0; i < ARRAY_SIZE(MODES); i++) {
+        if (strcmp(MODES[i].name, name) == 0) ret = MODES[i].mode;
+    }
+    if (ret == -1) JS_ThrowTypeError(ctx, "unknown mode '%s'", name);
+    JS_FreeCString(ctx, name);
+    return ret;
+}
+
+/*
+ * Parse a painter object:
+ *   {shape, mode, color, smoothness, symmetry, symmetryOrigin}
+ * shape is 'sphere', 'cube' or 'cylinder', and symmetry is a bitfield of
+ * the X, Y and Z axes.  All the attributes are optional.
+ */
+static int get_painter(JSContext *ctx, JSValueConst val, painter_t *painter)
+{
+    const shape_t *shapes[] = {&shape_sphere, &shape_cube, &shape_cylinder};
+    JSValue v;
+    const char *name;
+    double x;
+    int i, ret = 0;
+
+    *painter = (painter_t) {
+        .shape = &shape_cube,
+        .color = {255, 255, 255, 255},
+    };
+
+    v = JS_GetPropertyStr(ctx, val, "shape");
+    if (!JS_IsUndefined(v)) {
+        name = JS_ToCString(ctx, v);
+        painter->shape = NULL;
+        for (i = 0; name && i < ARRAY_SIZE(shapes); i++) {
+            if (strcmp(shapes[i]->id, name) == 0) painter->shape = shapes[i];
+        }
+        if (name && !painter->shape)
+            JS_ThrowTypeError(ctx, "unknown shape '%s'", name);
+        if (!painter->shape) ret = -1;
+        JS_FreeCString(ctx, name);
+    }
+    JS_FreeValue(ctx, v);
+    if (ret) return ret;
+
+    v = JS_GetPropertyStr(ctx, val, "mode");
+    painter->mode = get_mode(ctx, v, MODE_OVER);
+    JS_FreeValue(ctx, v);
+    if (painter->mode == -1) return -1;
+
+    v = JS_GetPropertyStr(ctx, val, "color");
+    if (!JS_IsUndefined(v)) get_vec_uint8(ctx, v, 4, painter->color, 255);
+    JS_FreeValue(ctx, v);
+
+    v = JS_GetPropertyStr(ctx, val, "smoothness");
+    if (!JS_IsUndefined(v) && !JS_ToFloat64(ctx, &x, v))
+        painter->smoothness = x;
+    JS_FreeValue(ctx, v);
+
+    v = JS_GetPropertyStr(ctx, val, "symmetry");
+    if (!JS_IsUndefined(v)) JS_ToInt32(ctx, &painter->symmetry, v);
+    painter->symmetry &= 7;
+    JS_FreeValue(ctx, v);
+
+    v = JS_GetPropertyStr(ctx, val, "symmetryOrigin");
+    if (!JS_IsUndefined(v)) {
+        for (i = 0; i < 3; i++) {
+            JSValue c = JS_GetPropertyUint32(ctx, v, i);
+            if (!JS_ToFloat64(ctx, &x, c)) painter->symmetry_origin[i] = x;
+            JS_FreeValue(ctx, c);
+        }
+    }
+    JS_FreeValue(ctx, v);
+    return 0;
+}
+
 static JSValue js_volume_ctor(JSContext *ctx, JSValueConst new_target,
                             int argc, JSValueConst *argv)
 {
@@ -407,6 +600,205 @@ static JSValue js_volume_setAt(JSContext *ctx, JSValueConst this_val,
     return JS_UNDEFINED;
 }
 
+/*
+ * Volume.getRegion(aabb)
+ * Return the voxels of a box as a Uint8Array of RGBA values, in xyz order.
+ */
+static JSValue js_volume_getRegion(JSContext *ctx, JSValueConst this_val,
+                                   int argc, JSValueConst *argv)
+{
+    volume_t *volume;
+    int aabb[2][3];
+    int64_t nb;
+    JSValue buf;
+    size_t size;
+    uint8_t *data;
+
+    volume = JS_GetOpaque2(ctx, this_val, volume_klass.id);
+    if (!volume) return JS_EXCEPTION;
+    nb = get_aabb(ctx, argv[0], aabb);
+    if (nb < 0 || nb > INT32_MAX / 4)
+        return JS_ThrowRangeError(ctx, "invalid region");
+    buf = JS_NewArrayBufferCopy(ctx, NULL, nb * 4);
+    if (JS_IsException(buf)) return buf;
+    data = JS_GetArrayBuffer(ctx, &size, buf);
+    volume_get_span(volume, aabb, data, NULL);
+    return new_uint8_array(ctx, buf);
+}
+
+/*
+ * Volume.setRegion(aabb, data)
+ * Set the voxels of a box from a Uint8Array of RGBA values, in xyz order.
+ */
+static JSValue js_volume_setRegion(JSContext *ctx, JSValueConst this_val,
+                                   int argc, JSValueConst *argv)
+{
+    volume_t *volume;
+    int aabb[2][3];
+    int64_t nb;
+    JSValue buf;
+    size_t offset, len, size;
+    uint8_t *data;
+
+    volume = JS_GetOpaque2(ctx, this_val, volume_klass.id);
+    if (!volume) return JS_EXCEPTION;
+    nb = get_aabb(ctx, argv[0], aabb);
+    if (nb < 0) return JS_ThrowRangeError(ctx, "invalid region");
+    buf = JS_GetTypedArrayBuffer(ctx, argv[1], &offset, &len, NULL);
+    if (JS_IsException(buf)) return buf;
+    data = JS_GetArrayBuffer(ctx, &size, buf);
+    JS_FreeValue(ctx, buf);
+    if (!data) return JS_EXCEPTION;
+    if (len != nb * 4) return JS_ThrowRangeError(ctx, "wrong data size");
+    volume_set_span(volume, aabb, data + offset, NULL);
+    return JS_UNDEFINED;
+}
+
+/*
+ * Volume.tiles(callback)
+ * Call a function for each non empty tile, with the position of the tile
+ * and a Uint8Array of its TILE_SIZE^3 RGBA voxels, in xyz order.
+ *
+ * The array is only valid during the call, and writing into it does not
+ * change the volume.
+ */
+static JSValue js_volume_tiles(JSContext *ctx, JSValueConst this_val,
+                               int argc, JSValueConst *argv)
+{
+    volume_t *volume;
+    volume_iterator_t iter;
+    volume_accessor_t acc;
+    int i, nb = 0, pos[3], (*tiles)[3] = NULL;
+    uint8_t (*voxels)[4];
+    JSValue buf, args[2], ret = JS_UNDEFINED;
+
+    volume = JS_GetOpaque2(ctx, this_val, volume_klass.id);
+    if (!volume) return JS_EXCEPTION;
+
+    // Get the list of tiles first, so that the callback can modify the
+    // volume.
+    iter = volume_get_iterator(volume,
+            VOLUME_ITER_TILES | VOLUME_ITER_SKIP_EMPTY);
+    while (volume_iter(&iter, pos)) {
+        tiles = realloc(tiles, (nb + 1) * sizeof(*tiles));
+        memcpy(tiles[nb++], pos, sizeof(pos));
+    }
+
+    // All the calls share the same buffer, that we detach after each call.
+    voxels = malloc(TILE_SIZE * TILE_SIZE * TILE_SIZE * 4);
+    acc = volume_get_accessor(volume);
+    for (i = 0; i < nb; i++) {
+        volume_get_tile_voxels(volume, &acc, tiles[i], voxels);
+        buf = JS_NewArrayBuffer(ctx, (uint8_t*)voxels,
+                                TILE_SIZE * TILE_SIZE * TILE_SIZE * 4,
+                                NULL, NULL, false);
+        args[0] = new_js_vec3(ctx, tiles[i][0], tiles[i][1], tiles[i][2]);
+        args[1] = new_uint8_array(ctx, JS_DupValue(ctx, buf));
+        ret = JS_Call(ctx, argv[0], JS_UNDEFINED, 2, args);
+        JS_DetachArrayBuffer(ctx, buf);
+        JS_FreeValue(ctx, buf);
+        JS_FreeValue(ctx, args[0]);
+        JS_FreeValue(ctx, args[1]);
+        if (JS_IsException(ret)) break;
+        JS_FreeValue(ctx, ret);
+        ret = JS_UNDEFINED;
+    }
+    free(voxels);
+    free(tiles);
+    return ret;
+}
+
+/*
+ * Volume.op(painter, box)
+ * Paint a shape into the volume, see <get_painter> for the painter
+ * attributes.
+ */
+static JSValue js_volume_op(JSContext *ctx, JSValueConst this_val,
+                            int argc, JSValueConst *argv)
+{
+    volume_t *volume;
+    painter_t painter;
+    float box[4][4];
+
+    volume = JS_GetOpaque2(ctx, this_val, volume_klass.id);
+    if (!volume) return JS_EXCEPTION;
+    if (get_painter(ctx, argv[0], &painter)) return JS_EXCEPTION;
+    if (get_box(ctx, argv[1], box)) return JS_EXCEPTION;
+    volume_op(volume, &painter, box);
+    return JS_UNDEFINED;
+}
+
+/*
+ * Volume.merge(other, mode, color)
+ * Merge an other volume into this one.  The mode defaults to 'over' and
+ * the color is optional.
+ */
+static JSValue js_volume_merge(JSContext *ctx, JSValueConst this_val,
+                               int argc, JSValueConst *argv)
+{
+    volume_t *volume, *other;
+    int mode;
+    uint8_t color[4];
+    const uint8_t *c = NULL;
+
+    volume = JS_GetOpaque2(ctx, this_val, volume_klass.id);
+    if (!volume) return JS_EXCEPTION;
+    other = JS_GetOpaque2(ctx, argv[0], volume_klass.id);
+    if (!other) return JS_EXCEPTION;
+    mode = get_mode(ctx, argc > 1 ? argv[1] : JS_UNDEFINED, MODE_OVER);
+    if (mode == -1) return JS_EXCEPTION;
+    if (argc > 2 && !JS_IsUndefined(argv[2])) {
+        get_vec_uint8(ctx, argv[2], 4, color, 255);
+        c = color;
+    }
+    volume_merge(volume, other, mode, c);
+    return JS_UNDEFINED;
+}
+
+/*
+ * Volume.move(mat)
+ * Transform the volume by a matrix given as an array of 16 numbers, in
+ * column major order.
+ */
+static JSValue js_volume_move(JSContext *ctx, JSValueConst this_val,
+                              int argc, JSValueConst *argv)
+{
+    volume_t *volume;
+    float mat[4][4], inv[4][4];
+    int i;
+    double x;
+    JSValue v;
+
+    volume = JS_GetOpaque2(ctx, this_val, volume_klass.id);
+    if (!volume) return JS_EXCEPTION;
+    for (i = 0; i < 16; i++) {
+        v = JS_GetPropertyUint32(ctx, argv[0], i);
+        if (JS_ToFloat64(ctx, &x, v)) x = NAN;
+        JS_FreeValue(ctx, v);
+        if (!isfinite(x)) return JS_ThrowRangeError(ctx, "invalid matrix");
+        mat[i / 4][i % 4] = x;
+    }
+    if (!mat4_invert(mat, inv))
+        return JS_ThrowRangeError(ctx, "invalid matrix");
+    volume_move(volume, mat);
+    return JS_UNDEFINED;
+}
+
+/*
+ * Volume.hash()
+ * Return a 32 bits hash of the visible voxels, to test if the volume
+ * changed.  Only the modified tiles are hashed again.
+ */
+static JSValue js_volume_hash(JSContext *ctx, JSValueConst this_val,
+                              int argc, JSValueConst *argv)
+{
+    volume_t *volume;
+
+    volume = JS_GetOpaque2(ctx, this_val, volume_klass.id);
+    if (!volume) return JS_EXCEPTION;
+    return JS_NewUint32(ctx, volume_crc32(volume));
+}
+
 static JSValue js_volume_save(JSContext *ctx, JSValueConst this_val,
                             int argc, JSValueConst *argv)
 {
@@ -448,6 +840,13 @@ static klass_t volume_klass = {
         {"copy", .fn=js_volume_copy},
         {"iter", .fn=js_volume_iter},
         {"setAt", .fn=js_volume_setAt},
+        {"getRegion", .fn=js_volume_getRegion},
+        {"setRegion", .fn=js_volume_setRegion},
+        {"tiles", .fn=js_volume_tiles},
+        {"op", .fn=js_volume_op},
+        {"merge", .fn=js_volume_merge},
+        {"move", .fn=js_volume_move},
+        {"hash", .fn=js_volume_hash},
         {"save", .fn=js_volume_save},
         { .name = NULL }
     }
@@ -489,11 +888,36 @@ static JSValue js_image_getLayersVolume(
     return ret;
 }
 
+/*
+ * image.generate(type, nbVoxels, seed)
+ * Generate a test scene into new layers, see generator.h.
+ */
+static JSValue js_image_generate(
+        JSContext *ctx, JSValueConst this_val, int argc, JSValueConst *argv)
+{
+    image_t *image;
+    const char *type;
+    double nb_voxels = 1e6;
+    uint32_t seed = 1;
+    int err;
+
+    image = JS_GetOpaque(this_val, image_klass.id);
+    type = JS_ToCString(ctx, argv[0]);
+    if (!type) return JS_EXCEPTION;
+    if (argc > 1) JS_ToFloat64(ctx, &nb_voxels, argv[1]);
+    if (argc > 2) JS_ToUint32(ctx, &seed, argv[2]);
+    err = generator_run(image, type, nb_voxels, seed);
+    if (err) JS_ThrowTypeError(ctx, "unknown scene type '%s'", type);
+    JS_FreeCString(ctx, type);
+    return err ? JS_EXCEPTION : JS_UNDEFINED;
+}
+
 static klass_t image_klass = {
     .def.class_name = "Image",
     .def.finalizer = js_image_finalizer,
     .attributes = {
         {"addLayer", .fn=js_image_addLayer},
+        {"generate", .fn=js_image_generate},
         {"activeLayer", .klass=&layer_klass, MEMBER(image_t, active_layer)},
         {"getLayersVolume", .fn=js_image_getLayersVolume},
         {"selectionBox", .klass=&box_klass, MEMBER(image_t, selection_box)},
@@ -622,6 +1046,135 @@ typedef struct {
     JSValue data;
 } script_file_format_t;
 
+/*
+ * Profiler of the scripts.
+ *
+ * The goxel.profile sections record their number of calls and total time.
+ * For the self time we use the QuickJS interrupt handler, called every few
+ * thousand bytecode instructions, as a sampler: the time since the last
+ * sample goes to the innermost running section.  The interrupt handler
+ * doesn't give access to the JS stack, so the time is only split between
+ * the sections, the outermost one being the script or format function that
+ * goxel called.
+ */
+typedef struct {
+    char    name[64];
+    int     count;
+    double  total;  // Seconds, including the sub sections.
+    double  self;   // Seconds, sampled.
+} profile_section_t;
+
+static profile_section_t *g_sections = NULL; // stb array.
+static int g_sections_stack[32];
+static int g_sections_depth = 0;
+static double g_last_sample = 0;
+
+// Recent timings of the scripts, as a ring buffer.
+static script_timing_t g_timings[SCRIPT_TIMINGS_HISTORY];
+static int g_nb_timings = 0;
+
+static void profile_sample(void)
+{
+    double now = sys_get_time();
+    int depth = min(g_sections_depth, ARRAY_SIZE(g_sections_stack));
+    if (depth)
+        g_sections[g_sections_stack[depth - 1]].self += now - g_last_sample;
+    g_last_sample = now;
+}
+
+static int on_interrupt(JSRuntime *rt, void *opaque)
+{
+    profile_sample();
+    return 0;
+}
+
+static double profile_begin(const char *name)
+{
+    int i;
+    profile_section_t section = {};
+
+    profile_sample();
+    for (i = 0; i < arrlen(g_sections); i++) {
+        if (strcmp(g_sections[i].name, name) == 0) break;
+    }
+    if (i == arrlen(g_sections)) {
+        snprintf(section.name, sizeof(section.name), "%s", name);
+        arrput(g_sections, section);
+    }
+    g_sections[i].count++;
+    if (g_sections_depth < ARRAY_SIZE(g_sections_stack))
+        g_sections_stack[g_sections_depth] = i;
+    g_sections_depth++;
+    return g_last_sample;
+}
+
+static void profile_end(double start)
+{
+    int depth;
+    profile_sample();
+    depth = min(g_sections_depth, ARRAY_SIZE(g_sections_stack));
+    g_sections[g_sections_stack[depth - 1]].total += g_last_sample - start;
+    g_sections_depth--;
+}
+
+// Start the profiling of a call from goxel into a script.
+static double profile_start(const char *name)
+{
+    if (g_sections_depth == 0) arrsetlen(g_sections, 0);
+    return profile_begin(name);
+}
+
+static int profile_section_cmp(const void *a_, const void *b_)
+{
+    const profile_section_t *a = a_, *b = b_;
+    return cmp(b->self, a->self);
+}
+
+// End the profiling of a call from goxel into a script, and print the
+// summary of the sections.
+static void profile_stop(double start)
+{
+    int i;
+    script_timing_t *timing;
+
+    profile_end(start);
+    if (g_sections_depth) return;
+
+    timing = &g_timings[g_nb_timings++ % SCRIPT_TIMINGS_HISTORY];
+    snprintf(timing->name, sizeof(timing->name), "%s", g_sections[0].name);
+    timing->time = g_sections[0].total;
+
+    qsort(g_sections, arrlen(g_sections), sizeof(*g_sections),
+          profile_section_cmp);
+    LOG_I("%-32s %6s %10s %10s", "Script profile", "calls", "total ms",
+          "self ms");
+    for (i = 0; i < arrlen(g_sections); i++) {
+        LOG_I("%-32s %6d %10.2f %10.2f", g_sections[i].name,
+              g_sections[i].count, g_sections[i].total * 1000,
+              g_sections[i].self * 1000);
+    }
+}
+
+int script_get_timings(script_timing_t out[SCRIPT_TIMINGS_HISTORY])
+{
+    int i, nb = min(g_nb_timings, SCRIPT_TIMINGS_HISTORY);
+    for (i = 0; i < nb; i++) {
+        out[i] = g_timings[(g_nb_timings - nb + i) % SCRIPT_TIMINGS_HISTORY];
+    }
+    return nb;
+}
+
+// Run the promise jobs, so that the promise callbacks are called before we
+// return to the main loop.
+static void run_pending_jobs(void)
+{
+    JSContext *ctx;
+    int err;
+    while ((err = JS_ExecutePendingJob(g_rt, &ctx))) {
+        if (err < 0) js_std_dump_error(ctx);
+    }
+}
+
 int script_format_import_func(const file_format_t *format_, image_t *image,
                               const char *path)
 {
@@ -629,6 +1182,7 @@ int script_format_import_func(const file_format_t *format_, image_t *image,
     const script_file_format_t *format = (void*)format_;
     JSValue js_import, js_image, js_path, val;
     JSValueConst argv[2];
+    double start;
     js_image = JS_NewObjectClass(ctx, image_klass.id);
     goxel.image->ref++;
     JS_SetOpaque(js_image, (void*)goxel.image);
@@ -636,7 +1190,10 @@ int script_format_import_func(const file_format_t *format_, image_t *image,
     argv[0] = js_image;
     argv[1] = js_path;
     js_import = JS_GetPropertyStr(ctx, format->data, "import");
+    start = profile_start(format->format.name);
     val = JS_Call(ctx, js_import, JS_NULL, 2, argv);
+    run_pending_jobs();
+    profile_stop(start);
     JS_FreeValue(ctx, val);
     JS_FreeValue(ctx, js_import);
     JS_FreeValue(ctx, js_image);
@@ -651,6 +1208,7 @@ int script_format_export_func(const file_format_t *format_,
     const script_file_format_t *format = (void*)format_;
     JSValue export, image;
     JSValueConst argv[2];
+    double start;
 
     image = JS_NewObjectClass(ctx, image_klass.id);
     goxel.image->ref++;
@@ -658,7 +1216,10 @@ int script_format_export_func(const file_format_t *format_,
     argv[0] = image;
     argv[1] = JS_NewString(ctx, path);
     export = JS_GetPropertyStr(ctx, format->data, "export");
+    start = profile_start(format->format.name);
     JS_Call(ctx, export, JS_NULL, 2, argv);
+    run_pending_jobs();
+    profile_stop(start);
     return 0;
 }
 
@@ -704,6 +1265,7 @@ static JSValue js_goxel_registerFormat(JSContext *ctx, JSValueConst this_val,
     JS_FreeValue(ctx, val);
 
     file_format_register(&format->format);
+    g_nb_formats++;
     return JS_UNDEFINED;
 }
 
@@ -711,19 +1273,199 @@ static JSValue js_goxel_registerScript(JSContext *ctx, JSValueConst this_val,
                                        int argc, JSValueConst *argv)
 {
     JSValueConst data;
-    script_t script = {};
+    script_t script = {.execute_fn = JS_UNDEFINED};
     const char *name;
 
+    int i;
+
     data = argv[0];
     name = JS_ToCString(ctx, JS_GetPropertyStr(ctx, data, "name"));
     LOG_I("Register script %s", name);
     snprintf(script.name, sizeof(script.name), "%s", name);
     script.execute_fn = JS_GetPropertyStr(ctx, data, "onExecute");
-    arrput(g_scripts, script);
     JS_FreeCString(ctx, name);
+
+    // The script might already have been registered from the cache, before
+    // its source got evaluated.
+    for (i = 0; i < arrlen(g_scripts); i++) {
+        if (strcmp(g_scripts[i].name, script.name) == 0) {
+            JS_FreeValue(ctx, g_scripts[i].execute_fn);
+            g_scripts[i] = script;
+            return JS_UNDEFINED;
+        }
+    }
+    arrput(g_scripts, script);
     return JS_UNDEFINED;
 }
 
+static void init_klass(JSContext *ctx, klass_t *klass);
+
+typedef struct {
+    char        *source;    // Source of the worker function expression.
+    char        **inputs;   // JSON of the inputs.
+    volume_t    **volumes;  // Returned volumes.
+    char        **errors;   // Error messages.
+} workers_t;
+
+// Run one call of the worker function, in its own runtime.
+static void worker_run(void *user, int i, int worker)
+{
+    workers_t *w = user;
+    JSRuntime *rt;
+    JSContext *ctx;
+    JSValue func, args[2], ret, exc;
+    volume_t *volume;
+    const char *msg;
+
+    rt = JS_NewRuntime();
+    ctx = JS_NewContext(rt);
+    init_klass(ctx, &vec_klass);
+    init_klass(ctx, &box_klass);
+    init_klass(ctx, &volume_klass);
+    js_std_add_helpers(ctx, 0, NULL);
+
+    volume = volume_new();
+    func = JS_Eval(ctx, w->source, strlen(w->source), "<worker>",
+                   JS_EVAL_TYPE_GLOBAL);
+    args[0] = JS_ParseJSON(ctx, w->inputs[i], strlen(w->inputs[i]),
+                           "<input>");
+    args[1] = JS_NewObjectClass(ctx, volume_klass.id);
+    JS_SetOpaque(args[1], volume);
+    ret = JS_IsException(func) ? JS_EXCEPTION :
+          JS_Call(ctx, func, JS_UNDEFINED, 2, args);
+    if (JS_IsException(ret)) {
+        exc = JS_GetException(ctx);
+        msg = JS_ToCString(ctx, exc);
+        w->errors[i] = strdup(msg ?: "error");
+        JS_FreeCString(ctx, msg);
+        JS_FreeValue(ctx, exc);
+    } else {
+        // The volume is owned by the worker runtime: hand a copy of it
+        // to the main runtime, the tiles are shared.
+        w->volumes[i] = volume_copy(volume);
+    }
+    JS_FreeValue(ctx, ret);
+    JS_FreeValue(ctx, args[0]);
+    JS_FreeValue(ctx, args[1]);
+    JS_FreeValue(ctx, func);
+    JS_FreeContext(ctx);
+    JS_FreeRuntime(rt);
+}
+
+/*
+ * goxel.runWorkers(func, inputs)
+ * Call a function for each input in parallel, each call in its own JS
+ * runtime.
+ *
+ * The function gets called as func(input, volume) with a new empty volume
+ * to fill.  It runs in a separate runtime, so it cannot access any
+ * variable from its scope, nor the goxel object, and the inputs are passed
+ * as JSON.
+ *
+ * Return a promise of the array of the volumes.
+ */
+static JSValue js_goxel_runWorkers(JSContext *ctx, JSValueConst this_val,
+                                   int argc, JSValueConst *argv)
+{
+    workers_t w = {};
+    int i, nb = 0;
+    JSValue v, str, promise, funcs[2], result;
+    const char *src, *err = NULL;
+    size_t len;
+
+    if (argc < 2 || !JS_IsFunction(ctx, argv[0]) || !JS_IsArray(ctx, argv[1]))
+        return JS_ThrowTypeError(ctx, "expected a function and an array");
+
+    v = JS_GetPropertyStr(ctx, argv[1], "length");
+    JS_ToInt32(ctx, &nb, v);
+    JS_FreeValue(ctx, v);
+
+    src = JS_ToCStringLen(ctx, &len, argv[0]);
+    if (!src) return JS_EXCEPTION;
+    w.source = malloc(len + 3);
+    sprintf(w.source, "(%s)", src);
+    JS_FreeCString(ctx, src);
+
+    w.inputs = calloc(nb, sizeof(*w.inputs));
+    w.volumes = calloc(nb, sizeof(*w.volumes));
+    w.errors = calloc(nb, sizeof(*w.errors));
+    for (i = 0; i < nb; i++) {
+        v = JS_GetPropertyUint32(ctx, argv[1], i);
+        str = JS_JSONStringify(ctx, v, JS_UNDEFINED, JS_UNDEFINED);
+        src = JS_IsString(str) ? JS_ToCString(ctx, str) : NULL;
+        w.inputs[i] = strdup(src ?: "null");
+        JS_FreeCString(ctx, src);
+        JS_FreeValue(ctx, str);
+        JS_FreeValue(ctx, v);
+    }
+
+    jobs_parallel_for(nb, worker_run, &w);
+
+    promise = JS_NewPromiseCapability(ctx, funcs);
+    result = JS_NewArray(ctx);
+    for (i = 0; i < nb; i++) {
+        if (w.errors[i] && !err) err = w.errors[i];
+        if (!w.volumes[i]) continue;
+        v = JS_NewObjectClass(ctx, volume_klass.id);
+        JS_SetOpaque(v, w.volumes[i]);
+        JS_SetPropertyUint32(ctx, result, i, v);
+    }
+    if (err) {
+        JS_FreeValue(ctx, result);
+        result = JS_NewError(ctx);
+        JS_SetPropertyStr(ctx, result, "message", JS_NewString(ctx, err));
+    }
+    v = JS_Call(ctx, funcs[err ? 1 : 0], JS_UNDEFINED, 1, &result);
+    JS_FreeValue(ctx, v);
+    JS_FreeValue(ctx, result);
+    JS_FreeValue(ctx, funcs[0]);
+    JS_FreeValue(ctx, funcs[1]);
+
+    for (i = 0; i < nb; i++) {
+        free(w.inputs[i]);
+        free(w.errors[i]);
+    }
+    free(w.inputs);
+    free(w.volumes);
+    free(w.errors);
+    free(w.source);
+    return promise;
+}
+
+/*
+ * goxel.time()
+ * Return the current time in milliseconds, with a sub millisecond
+ * precision.
+ */
+static JSValue js_goxel_time(JSContext *ctx, JSValueConst this_val,
+                             int argc, JSValueConst *argv)
+{
+    return JS_NewFloat64(ctx, sys_get_time() * 1000);
+}
+
+/*
+ * goxel.profile(name, fn)
+ * Call a function, and record its time in the section of the given name.
+ * Return the value returned by the function.
+ */
+static JSValue js_goxel_profile(JSContext *ctx, JSValueConst this_val,
+                                int argc, JSValueConst *argv)
+{
+    const char *name;
+    double start;
+    JSValue ret;
+
+    if (argc < 2 || !JS_IsFunction(ctx, argv[1]))
+        return JS_ThrowTypeError(ctx, "expected a name and a function");
+    name = JS_ToCString(ctx, argv[0]);
+    if (!name) return JS_EXCEPTION;
+    start = profile_begin(name);
+    JS_FreeCString(ctx, name);
+    ret = JS_Call(ctx, argv[1], JS_UNDEFINED, 0, NULL);
+    profile_end(start);
+    return ret;
+}
+
 static klass_t goxel_klass = {
     .def.class_name = "Goxel",
     .attributes = {
@@ -731,6 +1473,9 @@ static klass_t goxel_klass = {
         {"palette", .klass=&palette_klass, MEMBER(goxel_t, palette)},
         {"registerFormat", .fn=js_goxel_registerFormat},
         {"registerScript", .fn=js_goxel_registerScript},
+        {"runWorkers", .fn=js_goxel_runWorkers},
+        {"time", .fn=js_goxel_time},
+        {"profile", .fn=js_goxel_profile},
         { .name = NULL }
     },
 };
@@ -840,6 +1585,7 @@ static void init_runtime(void)
     g_rt = JS_NewRuntime();
     g_ctx = JS_NewContext(g_rt);
     ctx = g_ctx;
+    JS_SetInterruptHandler(g_rt, on_interrupt, NULL);
     js_init_module_std(ctx, "std");
     js_init_module_os(ctx, "os");
 
@@ -864,12 +1610,18 @@ static int script_run_from_str(
         const char **argv)
 {
     int ret = 0;
+    double start;
     JSValue val;
 
     init_runtime();
     js_std_add_helpers(g_ctx, argc, (char**)argv);
 
+    image_history_begin();
+    start = profile_start(filename);
     val = JS_Eval(g_ctx, script, len, filename, JS_EVAL_TYPE_MODULE);
+    run_pending_jobs();
+    profile_stop(start);
+    image_history_commit();
     if (JS_IsException(val)) {
         js_std_dump_error(g_ctx);
         ret = -1;
@@ -894,27 +1646,181 @@ int script_run_from_file(const char *filename, int argc, const char **argv)
     return ret;
 }
 
-static int on_script(int i, const char *path, void *user)
+/*
+ * Disk cache of the compiled scripts.
+ *
+ * The files are named after the hash of the script source, and contain a
+ * header, the names of the menu scripts it registers, and the bytecode.
+ * The names are only saved if registering menu scripts is all the script
+ * did the first time we evaluated it: in that case we can register them
+ * without evaluating the script, until one of them gets executed.
+ */
+typedef struct {
+    char     magic[4]; // "GXJS"
+    uint32_t nb_names;
+} bytecode_header_t;
+
+static uint32_t get_bytecode_hash(const char *code, int len,
+                                  const char *path)
+{
+    uint32_t hash;
+    hash = XXH32(GOXEL_VERSION_STR, strlen(GOXEL_VERSION_STR), 0);
+    hash = XXH32(path, strlen(path), hash);
+    return XXH32(code, len, hash);
+}
+
+static void get_bytecode_path(uint32_t hash, char *path, int size)
+{
+    snprintf(path, size, "%s/cache/scripts/%08x.bin",
+             sys_get_user_dir(), hash);
+}
+
+static void save_bytecode(uint32_t hash, const uint8_t *data, size_t size,
+                          int nb_names, const script_t *scripts)
+{
+    char path[1024];
+    FILE *file;
+    int i;
+    bytecode_header_t header = {{'G', 'X', 'J', 'S'}, nb_names};
+
+    get_bytecode_path(hash, path, sizeof(path));
+    sys_make_dir(path);
+    file = fopen(path, "wb");
+    if (!file) {
+        LOG_W("Cannot save script bytecode %s: %s", path, strerror(errno));
+        return;
+    }
+    fwrite(&header, sizeof(header), 1, file);
+    for (i = 0; i < nb_names; i++)
+        fwrite(scripts[i].name, sizeof(scripts[i].name), 1, file);
+    fwrite(data, size, 1, file);
+    fclose(file);
+}
+
+/*
+ * Evaluate a script source, using the bytecode cache.
+ *
+ * If lazy is set and the cache tells that the script only registers menu
+ * scripts, we register them without evaluating the script.
+ */
+static int script_load(const char *code, int len, const char *path,
+                       bool is_asset, bool lazy)
 {
-    const char *data;
+    uint32_t hash;
+    char cache_path[1024];
+    char *data;
+    int i, size, offset, nb_scripts, nb_formats, ret = 0;
+    bytecode_header_t header;
+    script_t script;
+    JSValue obj = JS_UNDEFINED, val;
+    uint8_t *bytecode = NULL;
+    size_t bytecode_size = 0;
+
+    init_runtime();
+    js_std_add_helpers(g_ctx, 0, NULL);
+
+    hash = get_bytecode_hash(code, len, path);
+    get_bytecode_path(hash, cache_path, sizeof(cache_path));
+    data = read_file(cache_path, &size);
+    if (data && size >= sizeof(header)) {
+        memcpy(&header, data, sizeof(header));
+        if (    memcmp(header.magic, "GXJS", 4) != 0 ||
+                size < sizeof(header) +
+                       (int64_t)header.nb_names * sizeof(script.name)) {
+            header.nb_names = 0;
+            size = 0;
+        }
+        if (lazy && header.nb_names) {
+            for (i = 0; i < header.nb_names; i++) {
+                script = (script_t){.execute_fn = JS_UNDEFINED};
+                memcpy(script.name, data + sizeof(header) +
+                       i * sizeof(script.name), sizeof(script.name));
+                script.name[sizeof(script.name) - 1] = '\0';
+                snprintf(script.source, sizeof(script.source), "%s", path);
+                script.source_is_asset = is_asset;
+                arrput(g_scripts, script);
+            }
+            free(data);
+            return 0;
+        }
+        offset = sizeof(header) + header.nb_names * sizeof(script.name);
+        if (size > offset) {
+            obj = JS_ReadObject(g_ctx, (uint8_t*)data + offset, size - offset,
+                                JS_READ_OBJ_BYTECODE);
+            if (JS_IsException(obj) || JS_ResolveModule(g_ctx, obj) < 0) {
+                LOG_W("Cannot load script bytecode %s", cache_path);
+                JS_FreeValue(g_ctx, JS_GetException(g_ctx));
+                JS_FreeValue(g_ctx, obj);
+                obj = JS_UNDEFINED;
+            }
+        }
+    }
+    free(data);
+
+    if (JS_IsUndefined(obj)) {
+        obj = JS_Eval(g_ctx, code, len, path,
+                      JS_EVAL_TYPE_MODULE | JS_EVAL_FLAG_COMPILE_ONLY);
+        if (JS_IsException(obj)) {
+            js_std_dump_error(g_ctx);
+            return -1;
+        }
+        bytecode = JS_WriteObject(g_ctx, &bytecode_size, obj,
+                                  JS_WRITE_OBJ_BYTECODE);
+    }
+
+    nb_scripts = arrlen(g_scripts);
+    nb_formats = g_nb_formats;
+    image_history_begin();
+    val = JS_EvalFunction(g_ctx, obj);
+    run_pending_jobs();
+    image_history_commit();
+    if (JS_IsException(val)) {
+        js_std_dump_error(g_ctx);
+        ret = -1;
+    }
+    JS_FreeValue(g_ctx, val);
 
+    if (bytecode && !ret) {
+        nb_scripts = (g_nb_formats == nb_formats) ?
+                     arrlen(g_scripts) - nb_scripts : 0;
+        save_bytecode(hash, bytecode, bytecode_size, nb_scripts,
+                      g_scripts + arrlen(g_scripts) - nb_scripts);
+    }
+    js_free(g_ctx, bytecode);
+    return ret;
+}
+
+// Load a script from its source path.
+static int script_load_path(const char *path, bool is_asset, bool lazy)
+{
+    const char *code;
+    char *data = NULL;
+    int size, ret;
+
+    if (is_asset) {
+        code = assets_get(path, &size);
+    } else {
+        code = data = read_file(path, &size);
+    }
+    if (!code) return -1;
+    ret = script_load(code, strlen(code), path, is_asset, lazy);
+    free(data);
+    return ret;
+}
+
+static int on_script(int i, const char *path, void *user)
+{
     LOG_D("Run script %s", path);
-    data = assets_get(path, NULL);
-    script_run_from_str(data, strlen(data), path, 0, NULL);
+    script_load_path(path, true, true);
     return 0;
 }
 
 static int on_user_script(const char *dir, const char *name, void *user)
 {
     char path[1024];
-    char *data;
-    int size;
 
     snprintf(path, sizeof(path), "%s/%s", dir, name);
-    data = read_file(path, &size);
-    if (!data) return -1;
-    script_run_from_str(data, strlen(data), path, 0, NULL);
-    return 0;
+    return script_load_path(path, false, true);
 }
 
 static int on_dir(void *arg, const char *path)
@@ -948,6 +1854,7 @@ int script_execute(const char *name)
 {
     int i;
     int ret = 0;
+    double start;
     script_t *script = NULL;
     JSContext *ctx = g_ctx;
     JSValue val;
@@ -959,8 +1866,26 @@ int script_execute(const char *name)
     if (i == arrlen(g_scripts)) return -1;
     assert(script);
 
+    // Evaluate the source of the script if it was deferred.
+    if (JS_IsUndefined(script->execute_fn) && *script->source) {
+        script_load_path(script->source, script->source_is_asset, false);
+        script = &g_scripts[i];
+        *script->source = '\0';
+    }
+    if (JS_IsUndefined(script->execute_fn)) {
+        LOG_E("Script %s has no onExecute function", name);
+        return -1;
+    }
+
     LOG_I("Run script %s", name);
+    // The whole script is a single undo step.
+    image_history_begin();
+    start = profile_start(name);
     val = JS_Call(ctx, script->execute_fn, JS_UNDEFINED, 0, NULL);
+    run_pending_jobs();
+    profile_stop(start);
+    if (goxel.image) image_history_push(goxel.image);
+    image_history_commit();
     if (JS_IsException(val)) {
         LOG_E("Error executing script");
         js_std_dump_error(ctx);
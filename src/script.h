@@ -37,5 +37,21 @@ void script_iter_all(void *user, void (*f)(void *user, const char *name));
  */
 int script_execute(const char *name);
 
+#define SCRIPT_TIMINGS_HISTORY 8
+
+typedef struct {
+    char    name[128];
+    double  time; // Seconds.
+} script_timing_t;
+
+/*
+ * Function: script_get_timings
+ * Get the times of the last scripts and format functions run.
+ *
+ * Return:
+ *   The number of timings, the most recent one last.
+ */
+int script_get_timings(script_timing_t out[SCRIPT_TIMINGS_HISTORY]);
+
 
 #endif // SCRIPT_H
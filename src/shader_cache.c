@@ -20,13 +20,120 @@
 #include "goxel.h"
 
 #include "shader_cache.h"
+#include "xxhash.h"
+
+#include <errno.h> // IWYU pragma: keep.
 
 typedef struct {
     char key[256];
     gl_shader_t *shader;
 } shader_t;
 
-static shader_t g_shaders[16] = {};
+static shader_t g_shaders[32] = {};
+
+// Hash of the driver strings and the shader sources, used as the name of
+// the file of the shader binary in the disk cache.
+static uint32_t get_binary_hash(const char *code, const char *pre,
+                                const char **attr_names)
+{
+    int i;
+    uint32_t hash = 0;
+    const char *str;
+    const GLenum NAMES[] = {GL_VENDOR, GL_RENDERER, GL_VERSION};
+
+    for (i = 0; i < ARRAY_SIZE(NAMES); i++) {
+        str = (const char*)glGetString(NAMES[i]) ?: "";
+        hash = XXH32(str, strlen(str), hash);
+    }
+    hash = XXH32(code, strlen(code), hash);
+    hash = XXH32(pre, strlen(pre), hash);
+    for (i = 0; attr_names && attr_names[i]; i++)
+        hash = XXH32(attr_names[i], strlen(attr_names[i]), hash);
+    return hash;
+}
+
+static void get_binary_path(uint32_t hash, char *path, int size)
+{
+    snprintf(path, size, "%s/shaders/%08x.bin", sys_get_user_dir(), hash);
+}
+
+// Try to create a shader from the disk cache.
+static gl_shader_t *load_binary(uint32_t hash)
+{
+    char path[1024];
+    char *data;
+    int size;
+    uint32_t format;
+    gl_shader_t *shader;
+
+    get_binary_path(hash, path, sizeof(path));
+    data = read_file(path, &size);
+    if (!data) return NULL;
+    shader = NULL;
+    if (size > 4) {
+        memcpy(&format, data, 4);
+        shader = gl_shader_create_from_binary(data + 4, size - 4, format);
+    }
+    free(data);
+    if (!shader) LOG_W("Cannot load shader binary %s", path);
+    return shader;
+}
+
+static void save_binary(uint32_t hash, const gl_shader_t *shader)
+{
+    char path[1024];
+    void *data;
+    int size;
+    uint32_t format;
+    FILE *file;
+
+    data = gl_shader_get_binary(shader, &size, &format);
+    if (!data) return;
+    get_binary_path(hash, path, sizeof(path));
+    sys_make_dir(path);
+    file = fopen(path, "wb");
+    if (!file) {
+        LOG_W("Cannot save shader binary %s: %s", path, strerror(errno));
+        free(data);
+        return;
+    }
+    fwrite(&format, 4, 1, file);
+    fwrite(data, size, 1, file);
+    fclose(file);
+    free(data);
+}
+
+// Create the key of the form:
+// <name>_define1_define2
+static void get_key(const char *name, const shader_define_t *defines,
+                    char key[256])
+{
+    const shader_define_t *define;
+    strcpy(key, name);
+    for (define = defines; define && define->name; define++) {
+        if (define->set) {
+            strcat(key, "_");
+            strcat(key, define->name);
+        }
+    }
+}
+
+static shader_t *find_shader(const char *key)
+{
+    int i;
+    for (i = 0; i < ARRAY_SIZE(g_shaders); i++) {
+        if (!*g_shaders[i].key) break;
+        if (strcmp(g_shaders[i].key, key) == 0) return &g_shaders[i];
+    }
+    return NULL;
+}
+
+bool shader_is_cached(const char *name, const shader_define_t *defines)
+{
+    char key[256];
+    get_key(name, defines, key);
+    return find_shader(key);
+}
 
 gl_shader_t *shader_get(const char *name, const shader_define_t *defines,
                         const char **attr_names,
@@ -39,23 +146,16 @@ gl_shader_t *shader_get(const char *name, const shader_define_t *defines,
     char path[128];
     char pre[256] = {};
     const shader_define_t *define;
+    uint32_t hash = 0;
 
 
-    // Create the key of the form:
-    // <name>_define1_define2
-    strcpy(key, name);
-    for (define = defines; define && define->name; define++) {
-        if (define->set) {
-            strcat(key, "_");
-            strcat(key, define->name);
-        }
-    }
+    get_key(name, defines, key);
+    s = find_shader(key);
+    if (s) return s->shader;
 
     for (i = 0; i < ARRAY_SIZE(g_shaders); i++) {
         s = &g_shaders[i];
         if (!*s->key) break;
-        if (strcmp(s->key, key) == 0)
-            return s->shader;
     }
     assert(i < ARRAY_SIZE(g_shaders));
     strcpy(s->key, key);
@@ -68,7 +168,16 @@ gl_shader_t *shader_get(const char *name, const shader_define_t *defines,
         if (define->set)
             sprintf(pre + strlen(pre), "#define %s\n", define->name);
     }
-    s->shader = gl_shader_create(code, code, pre, attr_names);
+    // Linking can be slow, so first look for the binary in the disk cache.
+    if (gl_has_program_binary()) {
+        hash = get_binary_hash(code, pre, attr_names);
+        s->shader = load_binary(hash);
+    }
+    if (!s->shader) {
+        s->shader = gl_shader_create(code, code, pre, attr_names);
+        if (s->shader && gl_has_program_binary())
+            save_binary(hash, s->shader);
+    }
     if (on_created) on_created(s->shader);
     return s->shader;
 }
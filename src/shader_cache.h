@@ -38,11 +38,20 @@ typedef struct {
  *                Can be NULL.
  *   attr_names - NULL terminated list of attribute names that will be binded.
  *   on_created - If set, called the first time the shader has been created.
+ *
+ * When the driver supports it, the linked programs are saved in the user
+ * directory, so that next time we only have to load the binaries.
  */
 gl_shader_t *shader_get(const char *name, const shader_define_t *defines,
                         const char **attr_names,
                         void (*on_created)(gl_shader_t *s));
 
+/*
+ * Function: shader_is_cached
+ * Check whether a shader has already been created by <shader_get>.
+ */
+bool shader_is_cached(const char *name, const shader_define_t *defines);
+
 /*
  * Function: shaders_release_all
  * Remove all the shaders from the cache.
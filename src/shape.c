@@ -19,6 +19,7 @@
 #include "shape.h"
 
 #include <math.h>
+#include <stdbool.h>
 
 static float min(float x, float y)
 {
@@ -50,6 +51,7 @@ static float vec3_norm(const float v[static 3])
 shape_t shape_sphere;
 shape_t shape_cube;
 shape_t shape_cylinder;
+shape_t shape_capsule;
 
 static float sphere_func(const float p[3], const float s[3], float smoothness)
 {
@@ -80,10 +82,10 @@ static float cube_func(const float p[3], const float s[3], float sm)
 
     for (i = 0; i < 3; i++) {
         if (p[i]) {
-            v = s[i] / fabs(p[i]);
+            v = s[i] / fabsf(p[i]);
             if (v < min_v) {
                 min_v = v;
-                ret = s[i] - fabs(p[i]);
+                ret = s[i] - fabsf(p[i]);
             }
         }
     }
@@ -103,18 +105,297 @@ static float cylinder_func(const float p[3], const float s[3],
     return min(rz, r - d);
 }
 
+/*
+ * Capsule shape: a sphere of radius min(s[0], s[1]) swept along the z
+ * axis, so that it fills the box, or an ellipsoid if s[0] != s[1].
+ * The point is moved to the closest point of the segment, which gives
+ * back the sphere function.
+ */
+static void capsule_to_sphere(const float p[3], const float s[3],
+                              float out_p[3], float out_s[3])
+{
+    float r = min(s[0], s[1]);
+    float h = max(s[2] - r, 0);
+    out_p[0] = p[0];
+    out_p[1] = p[1];
+    out_p[2] = p[2] - fmax(-h, fmin(p[2], h));
+    out_s[0] = s[0];
+    out_s[1] = s[1];
+    out_s[2] = min(r, s[2]);
+}
+
+static float capsule_func(const float p[3], const float s[3],
+                          float smoothness)
+{
+    float p2[3], s2[3];
+    capsule_to_sphere(p, s, p2, s2);
+    return sphere_func(p2, s2, smoothness);
+}
+
+/*
+ * Batch versions of the shape functions.
+ *
+ * The SIMD versions do the same float operations as the scalar functions,
+ * in the same order, so that they give exactly the same values.  The last
+ * points that don't fill a whole vector use the scalar functions.
+ */
+static void func_n_scalar(float (*func)(const float[3], const float[3],
+                                        float),
+                          int i, int n,
+                          const float *x, const float *y, const float *z,
+                          const float s[3], float smoothness, float *out)
+{
+    for (; i < n; i++) out[i] = func(VEC(x[i], y[i], z[i]), s, smoothness);
+}
+
+#if defined(__SSE2__)
+
+#include <emmintrin.h>
+
+static inline __m128 abs_ps(__m128 v)
+{
+    return _mm_andnot_ps(_mm_set1_ps(-0.0f), v);
+}
+
+static inline __m128 select_ps(__m128 mask, __m128 a, __m128 b)
+{
+    return _mm_or_ps(_mm_and_ps(mask, a), _mm_andnot_ps(mask, b));
+}
+
+static void sphere_func_n(int n, const float *x, const float *y,
+                          const float *z, const float s[3], float smoothness,
+                          float *out)
+{
+    const __m128 zero = _mm_setzero_ps();
+    const __m128 s12 = _mm_set1_ps(s[1] * s[2]);
+    const __m128 s02 = _mm_set1_ps(s[0] * s[2]);
+    const __m128 s01 = _mm_set1_ps(s[0] * s[1]);
+    const __m128 s012 = _mm_set1_ps(s[0] * s[1] * s[2]);
+    const __m128 smax = _mm_set1_ps(max3(s[0], s[1], s[2]));
+    __m128 px, py, pz, d, tx, ty, tz, r, center;
+    int i;
+
+    for (i = 0; i + 4 <= n; i += 4) {
+        px = _mm_loadu_ps(x + i);
+        py = _mm_loadu_ps(y + i);
+        pz = _mm_loadu_ps(z + i);
+        d = _mm_sqrt_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(px, px),
+                                              _mm_mul_ps(py, py)),
+                                   _mm_mul_ps(pz, pz)));
+        tx = _mm_div_ps(_mm_mul_ps(s12, px), d);
+        ty = _mm_div_ps(_mm_mul_ps(s02, py), d);
+        tz = _mm_div_ps(_mm_mul_ps(s01, pz), d);
+        r = _mm_div_ps(s012, _mm_sqrt_ps(_mm_add_ps(
+                _mm_add_ps(_mm_mul_ps(tx, tx), _mm_mul_ps(ty, ty)),
+                _mm_mul_ps(tz, tz))));
+        center = _mm_and_ps(_mm_and_ps(_mm_cmpeq_ps(px, zero),
+                                       _mm_cmpeq_ps(py, zero)),
+                            _mm_cmpeq_ps(pz, zero));
+        _mm_storeu_ps(out + i, select_ps(center, smax, _mm_sub_ps(r, d)));
+    }
+    func_n_scalar(sphere_func, i, n, x, y, z, s, smoothness, out);
+}
+
+static void cube_func_n(int n, const float *x, const float *y,
+                        const float *z, const float s[3], float sm,
+                        float *out)
+{
+    const __m128 zero = _mm_setzero_ps();
+    const __m128 inf = _mm_set1_ps(INFINITY);
+    __m128 p[3], a, v, min_v, ret, outside, inside, upd;
+    int i, j;
+
+    for (i = 0; i + 4 <= n; i += 4) {
+        p[0] = _mm_loadu_ps(x + i);
+        p[1] = _mm_loadu_ps(y + i);
+        p[2] = _mm_loadu_ps(z + i);
+        outside = zero;
+        inside = _mm_cmpeq_ps(zero, zero);
+        min_v = inf;
+        ret = inf;
+        for (j = 0; j < 3; j++) {
+            outside = _mm_or_ps(outside, _mm_or_ps(
+                    _mm_cmplt_ps(p[j], _mm_set1_ps(-s[j] - sm)),
+                    _mm_cmpge_ps(p[j], _mm_set1_ps(+s[j] + sm))));
+            inside = _mm_and_ps(inside, _mm_and_ps(
+                    _mm_cmpge_ps(p[j], _mm_set1_ps(-s[j] + sm)),
+                    _mm_cmplt_ps(p[j], _mm_set1_ps(+s[j] - sm))));
+            a = abs_ps(p[j]);
+            v = _mm_div_ps(_mm_set1_ps(s[j]), a);
+            upd = _mm_and_ps(_mm_cmpneq_ps(p[j], zero),
+                             _mm_cmplt_ps(v, min_v));
+            min_v = select_ps(upd, v, min_v);
+            ret = select_ps(upd, _mm_sub_ps(_mm_set1_ps(s[j]), a), ret);
+        }
+        ret = select_ps(inside, inf, ret);
+        ret = select_ps(outside, _mm_set1_ps(-INFINITY), ret);
+        _mm_storeu_ps(out + i, ret);
+    }
+    func_n_scalar(cube_func, i, n, x, y, z, s, sm, out);
+}
+
+static void cylinder_func_n(int n, const float *x, const float *y,
+                            const float *z, const float s[3],
+                            float smoothness, float *out)
+{
+    const __m128 zero = _mm_setzero_ps();
+    const __m128 s0 = _mm_set1_ps(s[0]);
+    const __m128 s1 = _mm_set1_ps(s[1]);
+    const __m128 s01 = _mm_set1_ps(s[0] * s[1]);
+    const __m128 smax = _mm_set1_ps(max3(s[0], s[1], s[2]));
+    __m128 px, py, d, rz, tx, ty, r, axis;
+    int i;
+
+    for (i = 0; i + 4 <= n; i += 4) {
+        px = _mm_loadu_ps(x + i);
+        py = _mm_loadu_ps(y + i);
+        d = _mm_sqrt_ps(_mm_add_ps(_mm_mul_ps(px, px), _mm_mul_ps(py, py)));
+        rz = _mm_sub_ps(_mm_set1_ps(s[2]), abs_ps(_mm_loadu_ps(z + i)));
+        tx = _mm_div_ps(_mm_mul_ps(s1, px), d);
+        ty = _mm_div_ps(_mm_mul_ps(s0, py), d);
+        r = _mm_div_ps(s01, _mm_sqrt_ps(_mm_add_ps(_mm_mul_ps(tx, tx),
+                                                   _mm_mul_ps(ty, ty))));
+        axis = _mm_and_ps(_mm_cmpeq_ps(px, zero), _mm_cmpeq_ps(py, zero));
+        _mm_storeu_ps(out + i, _mm_min_ps(rz, select_ps(axis, smax,
+                                                  _mm_sub_ps(r, d))));
+    }
+    func_n_scalar(cylinder_func, i, n, x, y, z, s, smoothness, out);
+}
+
+#else
+
+static void sphere_func_n(int n, const float *x, const float *y,
+                          const float *z, const float s[3], float smoothness,
+                          float *out)
+{
+    func_n_scalar(sphere_func, 0, n, x, y, z, s, smoothness, out);
+}
+
+static void cube_func_n(int n, const float *x, const float *y,
+                        const float *z, const float s[3], float sm,
+                        float *out)
+{
+    func_n_scalar(cube_func, 0, n, x, y, z, s, sm, out);
+}
+
+static void cylinder_func_n(int n, const float *x, const float *y,
+                            const float *z, const float s[3],
+                            float smoothness, float *out)
+{
+    func_n_scalar(cylinder_func, 0, n, x, y, z, s, smoothness, out);
+}
+
+#endif
+
+static void capsule_func_n(int n, const float *x, const float *y,
+                           const float *z, const float s[3],
+                           float smoothness, float *out)
+{
+    float p[3] = {0}, p2[3], s2[3], z2[64];
+    int i, k;
+
+    for (k = 0; k < n; k += 64) {
+        for (i = 0; i < 64 && k + i < n; i++) {
+            p[2] = z[k + i];
+            capsule_to_sphere(p, s, p2, s2);
+            z2[i] = p2[2];
+        }
+        sphere_func_n(i, x + k, y + k, z2, s2, smoothness, out + k);
+    }
+}
+
+/*
+ * Conservative classification of a ball of points against the shapes.
+ *
+ * The shape functions are never closer to zero than the real distance to
+ * the surface, so if all the points of a ball are further than the
+ * smoothness from the surface we know the exact value of the paint.  We
+ * add a small margin to be safe against rounding errors.
+ */
+static float classify_margin(const float s[3], float smoothness)
+{
+    return smoothness + 0.5 + 1e-4 * max3(s[0], s[1], s[2]);
+}
+
+// Classify a ball against an ellipse or ellipsoid of dimension n.
+static int classify_ellipsoid(int n, const float c[3], float r,
+                              const float s[3], float m)
+{
+    int i;
+    float d = 0, smin = INFINITY;
+    for (i = 0; i < n; i++) {
+        d += (c[i] / s[i]) * (c[i] / s[i]);
+        smin = min(smin, s[i]);
+    }
+    d = sqrt(d);
+    if (d + (r + m) / smin < 1) return +1;
+    if (d - (r + m) / smin > 1) return -1;
+    return 0;
+}
+
+static int sphere_classify(const float c[3], float r, const float s[3],
+                           float smoothness)
+{
+    return classify_ellipsoid(3, c, r, s, classify_margin(s, smoothness));
+}
+
+// The projection to the segment never increases the distance between two
+// points, so the moved ball stays inside a ball of the same radius.
+static int capsule_classify(const float c[3], float r, const float s[3],
+                            float smoothness)
+{
+    float c2[3], s2[3];
+    capsule_to_sphere(c, s, c2, s2);
+    return sphere_classify(c2, r, s2, smoothness);
+}
+
+static int cube_classify(const float c[3], float r, const float s[3],
+                         float smoothness)
+{
+    int i;
+    float m = classify_margin(s, smoothness);
+    bool inside = true;
+    for (i = 0; i < 3; i++) {
+        if (fabs(c[i]) - r - m > s[i]) return -1;
+        if (fabs(c[i]) + r + m >= s[i]) inside = false;
+    }
+    return inside ? +1 : 0;
+}
+
+static int cylinder_classify(const float c[3], float r, const float s[3],
+                             float smoothness)
+{
+    float m = classify_margin(s, smoothness);
+    int ret = classify_ellipsoid(2, c, r, s, m);
+    if (fabs(c[2]) - r - m > s[2]) return -1;
+    if (fabs(c[2]) + r + m >= s[2] && ret == +1) return 0;
+    return ret;
+}
+
 void shapes_init(void)
 {
     shape_sphere = (shape_t){
         .id     = "sphere",
         .func   = sphere_func,
+        .func_n = sphere_func_n,
+        .classify = sphere_classify,
     };
     shape_cube = (shape_t){
         .id     = "cube",
         .func   = cube_func,
+        .func_n = cube_func_n,
+        .classify = cube_classify,
     };
     shape_cylinder = (shape_t){
         .id     = "cylinder",
         .func = cylinder_func,
+        .func_n = cylinder_func_n,
+        .classify = cylinder_classify,
+    };
+    shape_capsule = (shape_t){
+        .id     = "capsule",
+        .func   = capsule_func,
+        .func_n = capsule_func_n,
+        .classify = capsule_classify,
     };
 }
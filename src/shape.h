@@ -28,11 +28,23 @@
 typedef struct shape {
     const char *id;
     float (*func)(const float p[3], const float s[3], float smoothness);
+    // Optional version of func for several points at once, given by their
+    // coordinates arrays.  Gives the same values as func.
+    void (*func_n)(int n, const float *x, const float *y, const float *z,
+                   const float s[3], float smoothness, float *out);
+    // Optional conservative test for a ball of center c and radius r.
+    // Returns +1 if func is above the smoothness for all the points of the
+    // ball, -1 if it is below minus the smoothness, and 0 if unknown.
+    int (*classify)(const float c[3], float r, const float s[3],
+                    float smoothness);
 } shape_t;
 
 void shapes_init(void);
 extern shape_t shape_sphere;
 extern shape_t shape_cube;
 extern shape_t shape_cylinder;
+// Sphere swept along the z axis, used to paint a whole brush segment at
+// once.
+extern shape_t shape_capsule;
 
 #endif // SHAPE_H
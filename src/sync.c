@@ -0,0 +1,314 @@
+/* Goxel 3D voxels editor
+ *
+ * copyright (c) 2026 Guillaume Chereau <guillaume@noctua-software.com>
+ *
+ * Goxel is free software: you can redistribute it and/or modify it under the
+ * terms of the GNU General Public License as published by the Free Software
+ * Foundation, either version 3 of the License, or (at your option) any later
+ * version.
+
+ * Goxel is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+
+ * You should have received a copy of the GNU General Public License along with
+ * goxel.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "goxel.h"
+
+#include "sync.h"
+
+#include "../ext_src/stb/stb_ds.h"
+
+/*
+ * Message format, version 1 (little endian):
+ *
+ *   4 bytes: magic string "GXSY"
+ *   4 bytes: version
+ *   4 bytes: size of the uncompressed entries
+ *   the zlib compressed entries:
+ *       1 byte: entry type (ENTRY_ values)
+ *       12 bytes: tile position
+ *       for ENTRY_REF and ENTRY_DATA:
+ *           16 bytes: hash of the tile voxels (see volume_get_tile_hash)
+ *       for ENTRY_DATA:
+ *           the RGBA voxels of the tile
+ */
+
+#define VERSION 1
+#define HEADER_SIZE 12
+#define TILE_NB_VOXELS (TILE_SIZE * TILE_SIZE * TILE_SIZE)
+// Limit of the uncompressed size of a message we accept.
+#define MAX_SIZE (1 << 30)
+
+enum {
+    ENTRY_REMOVE = 1,   // The tile is empty.
+    ENTRY_REF,          // The tile voxels are already known.
+    ENTRY_DATA,         // The tile voxels.
+};
+
+// A tile at a given position on the other end.
+typedef struct {
+    UT_hash_handle  hh;
+    int             pos[3];
+    uint64_t        hash[2];
+} remote_tile_t;
+
+// A tile known by both ends, kept in the store volume.
+typedef struct {
+    UT_hash_handle  hh;
+    uint64_t        hash[2];
+    int             slot;
+} block_t;
+
+struct sync_peer {
+    volume_t        *volume;
+    bool            server;
+    volume_cursor_t cursor;
+    bool            full;       // Send all the tiles on the next encode.
+    remote_tile_t   *remote;
+    block_t         *blocks;
+    // The data of the known blocks, one tile per slot.  The tiles are
+    // shared with the volume with volume_copy_tile, so the blocks that
+    // are still in the volume don't use more memory.
+    volume_t        *store;
+    int             nb_slots;
+};
+
+static void get_slot_pos(int slot, int out[3])
+{
+    out[0] = (slot % 1024) * TILE_SIZE;
+    out[1] = (slot / 1024 % 1024) * TILE_SIZE;
+    out[2] = (slot / (1024 * 1024)) * TILE_SIZE;
+}
+
+sync_peer_t *sync_peer_new(volume_t *volume, bool server)
+{
+    sync_peer_t *peer = calloc(1, sizeof(*peer));
+    peer->volume = volume;
+    peer->server = server;
+    peer->cursor = volume_journal_get_cursor(volume);
+    peer->full = true;
+    peer->store = volume_new();
+    return peer;
+}
+
+void sync_peer_delete(sync_peer_t *peer)
+{
+    remote_tile_t *remote, *tmp;
+    block_t *block, *tmp2;
+
+    if (!peer) return;
+    HASH_ITER(hh, peer->remote, remote, tmp) {
+        HASH_DEL(peer->remote, remote);
+        free(remote);
+    }
+    HASH_ITER(hh, peer->blocks, block, tmp2) {
+        HASH_DEL(peer->blocks, block);
+        free(block);
+    }
+    volume_delete(peer->store);
+    free(peer);
+}
+
+// Set the hash of a tile on the other end, NULL if the tile is empty.
+static void set_remote(sync_peer_t *peer, const int pos[3],
+                       const uint64_t hash[2])
+{
+    remote_tile_t *remote;
+
+    HASH_FIND(hh, peer->remote, pos, sizeof(remote->pos), remote);
+    if (!hash) {
+        if (!remote) return;
+        HASH_DEL(peer->remote, remote);
+        free(remote);
+        return;
+    }
+    if (!remote) {
+        remote = calloc(1, sizeof(*remote));
+        memcpy(remote->pos, pos, sizeof(remote->pos));
+        HASH_ADD(hh, peer->remote, pos, sizeof(remote->pos), remote);
+    }
+    memcpy(remote->hash, hash, sizeof(remote->hash));
+}
+
+static block_t *add_block(sync_peer_t *peer, const uint64_t hash[2])
+{
+    block_t *block = calloc(1, sizeof(*block));
+    memcpy(block->hash, hash, sizeof(block->hash));
+    block->slot = peer->nb_slots++;
+    HASH_ADD(hh, peer->blocks, hash, sizeof(block->hash), block);
+    return block;
+}
+
+static void put(uint8_t **buf, const void *data, int size)
+{
+    memcpy(arraddnptr(*buf, size), data, size);
+}
+
+static void encode_tile(sync_peer_t *peer, const int pos[3],
+                        uint8_t (*voxels)[4], uint8_t **buf)
+{
+    uint64_t hash[2];
+    bool set;
+    uint8_t type;
+    int slot_pos[3];
+    remote_tile_t *remote;
+    block_t *block;
+
+    set = volume_get_tile_hash(peer->volume, NULL, pos, hash);
+    HASH_FIND(hh, peer->remote, pos, sizeof(remote->pos), remote);
+    if (!set && !remote) return;
+    if (set && remote && memcmp(remote->hash, hash, sizeof(hash)) == 0)
+        return;
+    set_remote(peer, pos, set ? hash : NULL);
+
+    if (!set) {
+        type = ENTRY_REMOVE;
+        put(buf, &type, 1);
+        put(buf, pos, 12);
+        return;
+    }
+    HASH_FIND(hh, peer->blocks, hash, sizeof(block->hash), block);
+    type = block ? ENTRY_REF : ENTRY_DATA;
+    put(buf, &type, 1);
+    put(buf, pos, 12);
+    put(buf, hash, 16);
+    if (block) return;
+
+    volume_get_tile_voxels(peer->volume, NULL, pos, voxels);
+    put(buf, voxels, TILE_NB_VOXELS * 4);
+    block = add_block(peer, hash);
+    get_slot_pos(block->slot, slot_pos);
+    volume_copy_tile(peer->volume, pos, peer->store, slot_pos);
+}
+
+static void on_journal(void *user, const int pos[3])
+{
+    int (**list)[3] = user;
+    memcpy(arraddnptr(*list, 1), pos, sizeof(**list));
+}
+
+uint8_t *sync_peer_encode(sync_peer_t *peer, int *size)
+{
+    int (*list)[3] = NULL;
+    int i, pos[3], raw_size;
+    uint8_t *buf = NULL, *payload, *ret;
+    uint8_t (*voxels)[4];
+    uint32_t header[2] = {VERSION, 0};
+    volume_iterator_t iter;
+    remote_tile_t *remote, *tmp;
+    TRACE_SCOPE("sync_peer_encode");
+
+    if (volume_journal_read(peer->volume, &peer->cursor, on_journal,
+                            &list) == -1) {
+        peer->full = true;
+    }
+    // Without the journal we test all the tiles we have, and all the tiles
+    // the other end has.
+    if (peer->full) {
+        arrfree(list);
+        iter = volume_get_iterator(peer->volume, VOLUME_ITER_TILES);
+        while (volume_iter(&iter, pos))
+            memcpy(arraddnptr(list, 1), pos, sizeof(pos));
+        HASH_ITER(hh, peer->remote, remote, tmp)
+            memcpy(arraddnptr(list, 1), remote->pos, sizeof(pos));
+        peer->full = false;
+    }
+
+    voxels = malloc(TILE_NB_VOXELS * 4);
+    for (i = 0; i < arrlen(list); i++)
+        encode_tile(peer, list[i], voxels, &buf);
+    free(voxels);
+    arrfree(list);
+    if (!buf) return NULL;
+
+    raw_size = arrlen(buf);
+    payload = img_zlib_compress(buf, raw_size, size);
+    arrfree(buf);
+    header[1] = raw_size;
+    ret = malloc(HEADER_SIZE + *size);
+    memcpy(ret, "GXSY", 4);
+    memcpy(ret + 4, header, 8);
+    memcpy(ret + HEADER_SIZE, payload, *size);
+    free(payload);
+    *size += HEADER_SIZE;
+    return ret;
+}
+
+// Apply one entry, and return its size or -1 in case of error.
+static int apply_entry(sync_peer_t *peer, const uint8_t *data, int size)
+{
+    uint8_t type;
+    int pos[3], slot_pos[3];
+    uint64_t hash[2];
+    block_t *block;
+    tile_data_t *tile_data;
+    const int data_size = 29 + TILE_NB_VOXELS * 4;
+
+    if (size < 13) return -1;
+    type = data[0];
+    memcpy(pos, data + 1, 12);
+    if (pos[0] % TILE_SIZE || pos[1] % TILE_SIZE || pos[2] % TILE_SIZE)
+        return -1;
+
+    if (type == ENTRY_REMOVE) {
+        volume_clear_tile(peer->volume, NULL, pos);
+        if (!peer->server) set_remote(peer, pos, NULL);
+        return 13;
+    }
+    if (type != ENTRY_REF && type != ENTRY_DATA) return -1;
+    if (size < 29) return -1;
+    memcpy(hash, data + 13, 16);
+    HASH_FIND(hh, peer->blocks, hash, sizeof(block->hash), block);
+    if (type == ENTRY_REF && !block) return -1;
+    if (type == ENTRY_DATA && size < data_size) return -1;
+
+    // Both ends can send the same voxels at the same time, in that case
+    // we keep the block we already have.
+    if (!block) {
+        block = add_block(peer, hash);
+        get_slot_pos(block->slot, slot_pos);
+        tile_data = volume_tile_data_new((const void*)(data + 29));
+        volume_set_tile_data(peer->store, slot_pos, tile_data);
+        volume_tile_data_release(tile_data);
+    }
+    get_slot_pos(block->slot, slot_pos);
+    volume_copy_tile(peer->store, slot_pos, peer->volume, pos);
+    // The server sends the tiles back, see the header.
+    if (!peer->server) set_remote(peer, pos, hash);
+    return type == ENTRY_DATA ? data_size : 29;
+}
+
+int sync_peer_apply(sync_peer_t *peer, const uint8_t *data, int size)
+{
+    uint32_t header[2];
+    uint8_t *buf;
+    int ofs, n, ret = 0;
+    TRACE_SCOPE("sync_peer_apply");
+
+    if (size < HEADER_SIZE || memcmp(data, "GXSY", 4) != 0) return -1;
+    memcpy(header, data + 4, 8);
+    if (header[0] != VERSION || header[1] > MAX_SIZE) {
+        LOG_W("Unsupported sync message");
+        return -1;
+    }
+    buf = malloc(header[1]);
+    if (img_zlib_decompress(data + HEADER_SIZE, size - HEADER_SIZE,
+                            buf, header[1]) != header[1]) {
+        free(buf);
+        return -1;
+    }
+    for (ofs = 0; ofs < header[1]; ofs += n, ret++) {
+        n = apply_entry(peer, buf + ofs, header[1] - ofs);
+        if (n < 0) {
+            LOG_W("Invalid sync message");
+            ret = -1;
+            break;
+        }
+    }
+    free(buf);
+    return ret;
+}
@@ -0,0 +1,95 @@
+/* Goxel 3D voxels editor
+ *
+ * copyright (c) 2026 Guillaume Chereau <guillaume@noctua-software.com>
+ *
+ * Goxel is free software: you can redistribute it and/or modify it under the
+ * terms of the GNU General Public License as published by the Free Software
+ * Foundation, either version 3 of the License, or (at your option) any later
+ * version.
+
+ * Goxel is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+
+ * You should have received a copy of the GNU General Public License along with
+ * goxel.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* ######## Section: Volume sync ##########################################
+ * Keep the volumes of several editors in sync by sending only the tiles
+ * that changed.
+ *
+ * Each end of a connection has a peer attached to its copy of the volume.
+ * <sync_peer_encode> returns a message with the tiles written since the
+ * last call (using the volume journal), and <sync_peer_apply> writes the
+ * tiles of a message from the other end into the volume.  The transport of
+ * the messages is up to the caller.
+ *
+ * The tiles are addressed by the hash of their voxels: a tile that both
+ * ends already know (for example after a copy, or an undo) is only sent as
+ * a reference.  The peers also remember what the other end has at each
+ * position so that the tiles they just received are not sent back.
+ *
+ * With several clients, the server has one peer per client, all attached
+ * to the same volume.  The server peers send back the tiles they apply,
+ * as references, so that the clients that edited the same tiles at the
+ * same time end up with the server version.
+ *
+ * The peers are not thread safe, and must only be used from the main
+ * thread.
+ */
+
+#ifndef SYNC_H
+#define SYNC_H
+
+#include "volume.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+
+typedef struct sync_peer sync_peer_t;
+
+/*
+ * Function: sync_peer_new
+ * Create a new peer for a volume.
+ *
+ * The first message of the peer contains all the tiles of the volume.
+ *
+ * Parameters:
+ *   volume - The volume to sync, must stay alive as long as the peer.
+ *   server - Set for the server end of the connection, that has the
+ *            reference version of the volume.
+ */
+sync_peer_t *sync_peer_new(volume_t *volume, bool server);
+
+/*
+ * Function: sync_peer_delete
+ * Delete a peer.  The volume is not modified.
+ */
+void sync_peer_delete(sync_peer_t *peer);
+
+/*
+ * Function: sync_peer_encode
+ * Create a message with the changes of the volume since the last call.
+ *
+ * Parameters:
+ *   peer   - The peer.
+ *   size   - Receives the size of the message.
+ *
+ * Return:
+ *   A new buffer to release with free, or NULL if there is nothing to send.
+ */
+uint8_t *sync_peer_encode(sync_peer_t *peer, int *size);
+
+/*
+ * Function: sync_peer_apply
+ * Apply a message from the other end of the connection to the volume.
+ *
+ * Return:
+ *   The number of tiles written, or -1 if the message is not valid.  In
+ *   that case some of the tiles might have been applied already.
+ */
+int sync_peer_apply(sync_peer_t *peer, const uint8_t *data, int size);
+
+#endif // SYNC_H
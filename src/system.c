@@ -145,6 +145,20 @@ double sys_get_time(void)
     return (double)now.tv_sec + now.tv_usec / 1000000.0;
 }
 
+uint64_t sys_get_total_memory(void)
+{
+#if defined(WIN32)
+    MEMORYSTATUSEX status = {.dwLength = sizeof(status)};
+    return GlobalMemoryStatusEx(&status) ? status.ullTotalPhys : 0;
+#elif defined(_SC_PHYS_PAGES)
+    long pages = sysconf(_SC_PHYS_PAGES);
+    long size = sysconf(_SC_PAGE_SIZE);
+    return (pages > 0 && size > 0) ? (uint64_t)pages * size : 0;
+#else
+    return 0;
+#endif
+}
+
 int sys_make_dir(const char *path)
 {
     char tmp[PATH_MAX];
@@ -211,6 +225,16 @@ void sys_show_keyboard(bool has_text)
     sys_callbacks.show_keyboard(sys_callbacks.user, has_text);
 }
 
+/*
+ * Function: sys_make_gl_context
+ * Make sure that there is a current GL context.
+ */
+bool sys_make_gl_context(void)
+{
+    if (!sys_callbacks.make_gl_context) return true;
+    return sys_callbacks.make_gl_context(sys_callbacks.user);
+}
+
 /*
  * Function: sys_save_to_photos
  * Save a png file to the system photo album.
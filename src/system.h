@@ -51,6 +51,10 @@ typedef struct {
                         const char *default_path_and_file,
                         int nb_filters, const char * const *filters,
                         const char *filters_desc);
+
+    // Make a GL context current, creating it if needed.  Only set when
+    // running without a window.
+    bool (*make_gl_context)(void *user);
 } sys_callbacks_t;
 extern sys_callbacks_t sys_callbacks;
 
@@ -150,6 +154,12 @@ int sys_get_screen_framebuffer(void);
  */
 double sys_get_time(void); // Unix time.
 
+/*
+ * Function: sys_get_total_memory
+ * Return the size of the physical memory in bytes, or zero if unknown.
+ */
+uint64_t sys_get_total_memory(void);
+
 /*
  * Function: sys_set_window_title
  * Set the window title.
@@ -162,6 +172,15 @@ void sys_set_window_title(const char *title);
  */
 void sys_show_keyboard(bool has_text);
 
+/*
+ * Function: sys_make_gl_context
+ * Make sure that there is a current GL context.
+ *
+ * When running headless this creates an offscreen context the first time
+ * it is needed.  Return false if no context could be created.
+ */
+bool sys_make_gl_context(void);
+
 /*
  * Function: sys_save_to_photo
  * Save a png file to the system photo album.
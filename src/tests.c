@@ -28,6 +28,8 @@
         } \
     } while(0)
 
+static const int N = TILE_SIZE;
+
 static void test_file(const char *b64_data, uint32_t crc32)
 {
     FILE *file;
@@ -44,7 +46,9 @@ static void test_file(const char *b64_data, uint32_t crc32)
     free(data);
     err = goxel_import_file("/tmp/goxel_test.gox", NULL);
     TEST(err == 0);
-    TEST(volume_crc32(goxel.image->active_layer->volume) == crc32);
+    // The crc depends on the tiles size.
+    if (TILE_SIZE == 16)
+        TEST(volume_crc32(goxel.image->active_layer->volume) == crc32);
     image_delete(goxel.image);
     goxel.image = image_new();
     sys_delete_file("/tmp/goxel_test.gox");
@@ -66,7 +70,7 @@ static void test_load_file_v2(void)
         "AAAAAAAAAAAAAAAAAACAPwAAAAAAAAAAAAAAAAAAAAAAAIA/AAAAAAAAAAAA"
         "AAAAAAAAAAAAgD8CAAAAaWQEAAAAAQAAAAcAAABiYXNlX2lkBAAAAAAAAAAA"
         "AAAA";
-    test_file(b64_data, 0xc7c4c9ff);
+    test_file(b64_data, 0x37f69722);
 }
 
 static void test_load_file_v1_with_preview(void)
@@ -114,7 +118,34 @@ static void test_load_file_v1_with_preview(void)
         "bmFtZQoAAABiYWNrZ3JvdW5kAwAAAG1hdEAAAAAAAIA/AAAAAAAAAAAAAAAA"
         "AAAAAAAAgD8AAAAAAAAAAAAAAAAAAAAAAACAPwAAAAAAAAAAAAAAAAAAAAAA"
         "AIA/AgAAAGlkBAAAAAEAAAAHAAAAYmFzZV9pZAQAAAAAAAAAAAAAAA==";
-    test_file(b64_data, 0xb5e8d973);
+    test_file(b64_data, 0xe8f1be86);
+}
+
+static void test_load_file_v3(void)
+{
+    // Load a file with run length encoded blocks: one uniform tile, and
+    // one tile with a few voxels.
+    const char *b64_data =
+        "R09YIAMAAABJTUcgSwAAAAMAAABib3hAAAAAAACAQQAAAAAAAAAAAAAAAAAA"
+        "AAAAAIBBAAAAAAAAAAAAAAAAAAAAAAAAgEEAAAAAAAAAAAAAAAAAAIBBAACA"
+        "PwAAAABCTFJMCwAAADgWuTcBABAKFB7/AAAAAEJMUkw7AAAAH1HizwEBAIAU"
+        "Hv8BAIgUHv8BAJAUHv8BAJgUHv8BAKAUHv8BAKgUHv8BALAUHv8BALgUHv/4"
+        "DwAAAAAAAAAATUFURXgAAAAEAAAAbmFtZQoAAABNYXRlcmlhbC4xBQAAAGNv"
+        "bG9yEAAAAAAAgD8AAIA/AACAPwAAgD8IAAAAbWV0YWxsaWMEAAAAzcxMPgkA"
+        "AAByb3VnaG5lc3MEAAAAAAAAPwgAAABlbWlzc2lvbgwAAAAAAAAAAAAAAAAA"
+        "AAAAAAAATEFZUt8AAAACAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAABAAAAEAAA"
+        "AAAAAAAAAAAAAAAAAAQAAABuYW1lBwAAAExheWVyLjEDAAAAbWF0QAAAAAAA"
+        "gD8AAAAAAAAAAAAAAAAAAAAAAACAPwAAAAAAAAAAAAAAAAAAAAAAAIA/AAAA"
+        "AAAAAAAAAAAAAAAAAAAAgD8CAAAAaWQEAAAAAgAAAAcAAABiYXNlX2lkBAAA"
+        "AAAAAAAIAAAAbWF0ZXJpYWwEAAAAAAAAAAQAAABtb2RlBAAAAAAAAAAHAAAA"
+        "dmlzaWJsZQEAAAABAAAAAENBTVKLAAAABAAAAG5hbWUIAAAAQ2FtZXJhLjEE"
+        "AAAAZGlzdAQAAAAAAABDBQAAAG9ydGhvAQAAAAADAAAAbWF0QAAAAPMENT/z"
+        "BDU/AAAAAAAAAAD///++////PvMENT8AAAAA////Pv///77zBDU/AAAAAP//"
+        "f0L//3/C8wS1QgAAgD8GAAAAYWN0aXZlAAAAAAAAAABMSUdIaAAAAAUAAABw"
+        "aXRjaAQAAADCuLI+AwAAAHlhdwQAAACSCgZACQAAAGludGVuc2l0eQQAAAAA"
+        "AABABQAAAGZpeGVkAQAAAAAHAAAAYW1iaWVudAQAAACamZk+BgAAAHNoYWRv"
+        "dwQAAACamZk+AAAAAA==";
+    test_file(b64_data, 0x7627eb38);
 }
 
 static void test_load_corrupt(void)
@@ -129,9 +160,1501 @@ static void test_load_corrupt(void)
     sys_delete_file("/tmp/goxel_test.gox");
 }
 
+// Export and import back a sparse voxel DAG file.
+static void test_svdag(void)
+{
+    volume_t *volume, *imported;
+    volume_iterator_t iter;
+    int i, n, pos[3];
+    uint8_t v1[4], v2[4];
+    float box[4][4];
+    painter_t painter = {
+        .mode = MODE_OVER,
+        .shape = &shape_sphere,
+        .color = {255, 0, 0, 255},
+    };
+
+    // Many identical spheres, so most of the subtrees are shared.
+    volume = goxel.image->active_layer->volume;
+    for (i = 0; i < 8; i++) {
+        mat4_set_identity(box);
+        mat4_itranslate(box, i * 64 - 200, 30, -10);
+        mat4_iscale(box, 12, 12, 12);
+        volume_op(volume, &painter, box);
+    }
+    volume = volume_copy(volume);
+    TEST(goxel_export_to_file("/tmp/goxel_test.svdag", "svdag") == 0);
+    image_delete(goxel.image);
+    goxel.image = image_new();
+    TEST(goxel_import_file("/tmp/goxel_test.svdag", "svdag") == 0);
+    imported = goxel.image->active_layer->volume;
+
+    iter = volume_get_iterator(volume,
+                               VOLUME_ITER_VOXELS | VOLUME_ITER_SKIP_EMPTY);
+    for (n = 0; volume_iter(&iter, pos); n++) {
+        volume_get_at(volume, &iter, pos, v1);
+        volume_get_at(imported, NULL, pos, v2);
+        TEST(memcmp(v1, v2, 4) == 0);
+    }
+    iter = volume_get_iterator(imported,
+                               VOLUME_ITER_VOXELS | VOLUME_ITER_SKIP_EMPTY);
+    for (i = 0; volume_iter(&iter, pos); i++);
+    TEST(i == n && n > 0);
+
+    // Same with a background export and import.
+    goxel_export_to_file_async("/tmp/goxel_test.svdag", "svdag");
+    TEST(goxel_file_task_get_progress(NULL) >= 0);
+    goxel_file_task_update(true);
+    image_delete(goxel.image);
+    goxel.image = image_new();
+    goxel_import_file_async("/tmp/goxel_test.svdag", "svdag");
+    goxel_file_task_update(true);
+    TEST(goxel_file_task_get_progress(NULL) == -1);
+    TEST(volume_crc32(goxel.image->active_layer->volume) ==
+         volume_crc32(volume));
+
+    volume_delete(volume);
+    image_delete(goxel.image);
+    goxel.image = image_new();
+    sys_delete_file("/tmp/goxel_test.svdag");
+}
+
+static void test_volume_tiles(void)
+{
+    volume_t *volume, *copy;
+    volume_accessor_t accessor, copy_accessor;
+    volume_iterator_t iter;
+    uint8_t v[4];
+    int i, pos[3], bbox[2][3];
+    uint64_t key;
+    float box[4][4];
+
+    // Fill a volume with voxels spread over many tiles in all directions.
+    volume = volume_new();
+    accessor = volume_get_accessor(volume);
+    for (i = 0; i < 1000; i++) {
+        pos[0] = (i * 37) % 400 - 200;
+        pos[1] = (i * 91) % 400 - 200;
+        pos[2] = (i * 13) % 64 - 32;
+        volume_set_at(volume, &accessor, pos, (uint8_t[]){i, 0, 0, 255});
+    }
+    for (i = 0; i < 1000; i++) {
+        pos[0] = (i * 37) % 400 - 200;
+        pos[1] = (i * 91) % 400 - 200;
+        pos[2] = (i * 13) % 64 - 32;
+        volume_get_at(volume, NULL, pos, v);
+        TEST(v[3] == 255);
+    }
+
+    // Iteration and bounding box only see the set voxels.
+    iter = volume_get_iterator(volume,
+                               VOLUME_ITER_VOXELS | VOLUME_ITER_SKIP_EMPTY);
+    for (i = 0; volume_iter(&iter, pos); i++);
+    TEST(i == 1000);
+    volume_get_bbox(volume, bbox, true);
+    TEST(bbox[0][0] == -200 && bbox[0][2] == -32);
+    TEST(bbox[1][1] == 200 && bbox[1][2] == 32);
+
+    // Copy on write: clearing the copy doesn't change the original.
+    copy = volume_copy(volume);
+    volume_clear_tile(copy, NULL, (int[]){0, 0, 0});
+    TEST(volume_get_tiles_count(copy) == volume_get_tiles_count(volume) - 1);
+    volume_clear(copy);
+    TEST(volume_is_empty(copy));
+    TEST(!volume_is_empty(volume));
+    volume_delete(copy);
+
+    // The accessors of both volumes stay valid after a write in a shared
+    // tile, and see their own version of it.
+    copy = volume_copy(volume);
+    accessor = volume_get_accessor(volume);
+    copy_accessor = volume_get_accessor(copy);
+    volume_get_at(volume, &accessor, (int[]){-200, -200, -32}, v);
+    volume_get_at(copy, &copy_accessor, (int[]){-200, -200, -32}, v);
+    volume_set_at(copy, NULL, (int[]){-200, -200, -32},
+                  (uint8_t[]){0, 0, 0, 0});
+    volume_get_at(volume, &accessor, (int[]){-200, -200, -32}, v);
+    TEST(v[3] == 255);
+    volume_get_at(copy, &copy_accessor, (int[]){-200, -200, -32}, v);
+    TEST(v[3] == 0);
+    volume_delete(copy);
+    volume_delete(volume);
+
+    // Neighbors iteration yields the missing neighbor tiles, without
+    // modifying the volume.
+    volume = volume_new();
+    volume_set_at(volume, NULL, (int[]){0, 0, 0}, (uint8_t[]){1, 1, 1, 255});
+    key = volume_get_key(volume);
+    iter = volume_get_iterator(volume,
+            VOLUME_ITER_TILES | VOLUME_ITER_INCLUDES_NEIGHBORS);
+    for (i = 0; volume_iter(&iter, pos); i++);
+    TEST(i == 7);
+    TEST(volume_get_tiles_count(volume) == 1);
+    TEST(volume_get_key(volume) == key);
+    volume_delete(volume);
+
+    // Box iteration over a huge sparse volume.
+    volume = volume_new();
+    volume_set_at(volume, NULL, (int[]){-1000, -1000, -1000},
+                  (uint8_t[]){1, 1, 1, 255});
+    volume_set_at(volume, NULL, (int[]){1000, 1000, 1000},
+                  (uint8_t[]){1, 1, 1, 255});
+    mat4_set_identity(box);
+    mat4_iscale(box, 2000, 2000, 2000);
+    iter = volume_get_box_iterator(volume, box,
+                                   VOLUME_ITER_SKIP_EMPTY);
+    for (i = 0; volume_iter(&iter, pos); i++);
+    TEST(i == 2);
+    volume_clear_tile(volume, NULL, (int[]){-1000, -1000, -1000});
+    iter = volume_get_box_iterator(volume, box,
+                                   VOLUME_ITER_SKIP_EMPTY);
+    for (i = 0; volume_iter(&iter, pos); i++);
+    TEST(i == 1 && pos[0] == 1000);
+    volume_delete(volume);
+}
+
+static void test_volume_neighbors_accessor(void)
+{
+    volume_t *volume = volume_new();
+    volume_accessor_t acc = volume_get_neighbors_accessor(volume);
+    uint8_t v[4], v2[4];
+    int i, pos[3];
+    bool ok = true;
+
+    // Random walk of reads and writes, compared to the uncached accesses.
+    pos[0] = pos[1] = pos[2] = 0;
+    for (i = 0; i < 20000; i++) {
+        pos[i % 3] += (int)((i * 7919) % 13) - 6;
+        if (i % 5 == 0) {
+            volume_set_at(volume, &acc, pos, (uint8_t[]){i, i, i, 255});
+        } else if (i % 997 == 0) {
+            volume_clear_tile(volume, &acc, (int[]){
+                    pos[0] & ~(TILE_SIZE - 1), pos[1] & ~(TILE_SIZE - 1),
+                    pos[2] & ~(TILE_SIZE - 1)});
+        }
+        volume_get_at(volume, &acc, pos, v);
+        volume_get_at(volume, NULL, pos, v2);
+        ok = ok && memcmp(v, v2, 4) == 0;
+    }
+    TEST(ok);
+    volume_delete(volume);
+}
+
+static void test_volume_uniform_tiles(void)
+{
+    volume_t *volume, *other;
+    uint8_t v[4];
+    float box[4][4];
+    int bbox[2][3];
+
+    volume = volume_new();
+    volume_fill_tile(volume, NULL, (int[]){0, 0, 0},
+                     (uint8_t[]){10, 20, 30, 255});
+    TEST(volume_is_tile_uniform(volume, NULL, (int[]){0, 0, 0}, v));
+    TEST(v[0] == 10 && v[3] == 255);
+    TEST(volume_get_tile_data(volume, NULL, (int[]){0, 0, 0}, NULL) == NULL);
+
+    // Writing into a uniform tile expands it.
+    other = volume_copy(volume);
+    volume_set_at(other, NULL, (int[]){1, 2, 3}, (uint8_t[]){0, 0, 0, 0});
+    TEST(!volume_is_tile_uniform(other, NULL, (int[]){0, 0, 0}, v));
+    volume_get_at(other, NULL, (int[]){15, 15, 15}, v);
+    TEST(v[1] == 20 && v[3] == 255);
+    TEST(volume_get_alpha_at(other, NULL, (int[]){1, 2, 3}) == 0);
+    TEST(volume_get_alpha_at(volume, NULL, (int[]){1, 2, 3}) == 255);
+
+    volume_delete(other);
+
+    // Merging two uniform tiles gives a uniform tile.
+    other = volume_new();
+    volume_fill_tile(other, NULL, (int[]){0, 0, 0},
+                     (uint8_t[]){0, 0, 0, 100});
+    volume_merge(volume, other, MODE_SUB, NULL);
+    TEST(volume_is_tile_uniform(volume, NULL, (int[]){0, 0, 0}, v));
+    TEST(v[0] == 10 && v[3] == 155);
+    volume_delete(other);
+    volume_delete(volume);
+
+    // Big shapes operations fill whole tiles at once.
+    volume = volume_new();
+    mat4_set_identity(box);
+    mat4_iscale(box, 64, 64, 64);
+    volume_op(volume, &(painter_t){.mode = MODE_OVER, .shape = &shape_cube,
+                                   .color = {1, 2, 3, 255}}, box);
+    TEST(volume_is_tile_uniform(volume, NULL, (int[]){N, -2 * N, 0}, v));
+    TEST(v[0] == 1 && v[3] == 255);
+    volume_get_bbox(volume, bbox, true);
+    TEST(bbox[0][0] == -64 && bbox[1][2] == 64);
+    volume_delete(volume);
+}
+
+// Identical tiles created separately get the same data after dedup.
+static void test_volume_dedup(void)
+{
+    volume_t *a, *b;
+    float box[4][4];
+    uint64_t ha[2], hb[2], ida, idb;
+    uint8_t (*voxels)[4];
+    tile_data_t *data;
+    // b has the same tile as a, one tile further.
+    const int pos[3] = {0, 0, 0}, pos_b[3] = {N, 0, 0};
+    painter_t painter = {
+        .mode = MODE_OVER,
+        .shape = &shape_sphere,
+        .color = {255, 0, 0, 255},
+    };
+
+    mat4_set_identity(box);
+    mat4_iscale(box, 20, 20, 20);
+    a = volume_new();
+    b = volume_new();
+    volume_op(a, &painter, box);
+    // volume_op would reuse the tiles of a from its cache, so we make a
+    // new copy of the voxels.
+    voxels = malloc(N * N * N * 4);
+    volume_get_tile_voxels(a, NULL, pos, voxels);
+    data = volume_tile_data_new(voxels);
+    volume_set_tile_data(b, pos_b, data);
+    volume_tile_data_release(data);
+    free(voxels);
+    volume_get_tile_data(a, NULL, pos, &ida);
+    volume_get_tile_data(b, NULL, pos_b, &idb);
+    TEST(ida != idb);
+    TEST(volume_get_tile_hash(a, NULL, pos, ha));
+    TEST(volume_get_tile_hash(b, NULL, pos_b, hb));
+    TEST(memcmp(ha, hb, sizeof(ha)) == 0);
+
+    volume_dedup(a);
+    TEST(volume_dedup(b) > 0);
+    volume_get_tile_data(a, NULL, pos, &ida);
+    volume_get_tile_data(b, NULL, pos_b, &idb);
+    TEST(ida == idb);
+
+    // Writing into a shared tile doesn't change the other volume.
+    volume_set_at(b, NULL, pos_b, (uint8_t[]){0, 255, 0, 255});
+    TEST(volume_get_tile_hash(b, NULL, pos_b, hb));
+    TEST(memcmp(ha, hb, sizeof(ha)) != 0);
+    TEST(volume_get_tile_hash(a, NULL, pos, hb));
+    TEST(memcmp(ha, hb, sizeof(ha)) == 0);
+    volume_delete(a);
+    volume_delete(b);
+}
+
+// The same stamp at an other position reuses the tiles that match.
+static void test_volume_op_tiles_cache(void)
+{
+    volume_t *a, *b;
+    float box[4][4];
+    uint64_t ida, idb;
+    uint8_t v[4];
+    const int pos[3] = {0, 0, 0}, pos_b[3] = {N, 0, 0};
+    painter_t painter = {
+        .mode = MODE_OVER,
+        .shape = &shape_cylinder,
+        .color = {0, 255, 0, 255},
+        .smoothness = 1,
+    };
+
+    mat4_set_identity(box);
+    mat4_iscale(box, 11, 13, 7);
+    a = volume_new();
+    b = volume_new();
+    volume_op(a, &painter, box);
+    box[3][0] += N;
+    volume_op(b, &painter, box);
+    volume_get_tile_data(a, NULL, pos, &ida);
+    volume_get_tile_data(b, NULL, pos_b, &idb);
+    TEST(ida && ida == idb);
+    // Writing into a shared tile doesn't change the cached result.
+    volume_set_at(b, NULL, pos_b, (uint8_t[]){0, 0, 255, 255});
+    volume_clear(a);
+    box[3][0] -= N;
+    volume_op(a, &painter, box);
+    volume_get_at(a, NULL, pos, v);
+    TEST(v[1] == 255 && v[2] == 0);
+    volume_delete(a);
+    volume_delete(b);
+}
+
+// Symmetric operations must give the same result as running the operation
+// on each mirrored box.
+static void test_volume_op_symmetry(void)
+{
+    volume_t *volume, *expected;
+    volume_iterator_t iter;
+    int i, pos[3];
+    uint8_t v1[4], v2[4];
+    float box[4][4], boxes[4][4][4];
+    const float o[3] = {16, 0, 0};
+    painter_t painter = {
+        .mode = MODE_OVER,
+        .shape = &shape_sphere,
+        .color = {255, 0, 0, 200},
+        .smoothness = 1,
+        .symmetry = 3,
+        .symmetry_origin = {16, 0, 0},
+    };
+
+    mat4_set_identity(box);
+    mat4_itranslate(box, 30, 7, -3);
+    mat4_irotate(box, 0.5, 1, 1, 0);
+    mat4_iscale(box, 20, 12, 9);
+    volume = volume_new();
+    volume_op(volume, &(painter_t){.mode = MODE_OVER, .shape = &shape_cube,
+                                   .color = {0, 0, 255, 128}}, box);
+    expected = volume_copy(volume);
+    volume_op(volume, &painter, box);
+
+    // Same order as the passes of volume_op.
+    for (i = 0; i < 4; i++) {
+        mat4_set_identity(boxes[i]);
+        mat4_itranslate(boxes[i], o[0], o[1], o[2]);
+        mat4_iscale(boxes[i], (i & 1) ? 1 : -1, (i & 2) ? 1 : -1, 1);
+        mat4_itranslate(boxes[i], -o[0], -o[1], -o[2]);
+        mat4_imul(boxes[i], box);
+    }
+    painter.symmetry = 0;
+    volume_op(expected, &painter, boxes[0]);
+    volume_op(expected, &painter, boxes[2]);
+    volume_op(expected, &painter, boxes[1]);
+    volume_op(expected, &painter, box);
+
+    iter = volume_get_iterator(expected,
+                               VOLUME_ITER_VOXELS | VOLUME_ITER_SKIP_EMPTY);
+    for (i = 0; volume_iter(&iter, pos); i++) {
+        volume_get_at(expected, &iter, pos, v1);
+        volume_get_at(volume, NULL, pos, v2);
+        TEST(memcmp(v1, v2, 4) == 0);
+    }
+    TEST(i > 0);
+    iter = volume_get_iterator(volume,
+                               VOLUME_ITER_VOXELS | VOLUME_ITER_SKIP_EMPTY);
+    while (volume_iter(&iter, pos)) i--;
+    TEST(i == 0);
+    volume_delete(expected);
+    volume_delete(volume);
+}
+
+// The batch shape functions should give the same values as the scalar ones.
+static void test_shapes_func_n(void)
+{
+    const shape_t *shapes[] = {&shape_sphere, &shape_cube, &shape_cylinder,
+                               &shape_capsule};
+    const float s[3] = {5.5, 3, 8};
+    float x[7], y[7], z[7], k[7];
+    int i, j;
+
+    for (i = 0; i < 7; i++) {
+        x[i] = i - 3.5;
+        y[i] = (i % 3) * 1.7;
+        z[i] = i == 3 ? 0 : 9 - i * 2.5;
+    }
+    x[3] = 0;
+    y[3] = 0;
+    for (i = 0; i < ARRAY_SIZE(shapes); i++) {
+        if (!shapes[i]->func_n) continue;
+        shapes[i]->func_n(7, x, y, z, s, 1, k);
+        for (j = 0; j < 7; j++) {
+            TEST(k[j] == shapes[i]->func(VEC(x[j], y[j], z[j]), s, 1));
+        }
+    }
+}
+
+static void test_volume_indexed_tiles(void)
+{
+    volume_t *volume;
+    int i, pos[3];
+    uint8_t v[4];
+    bool ok = true;
+
+    // Write more colors than an indexed tile can hold.
+    volume = volume_new();
+    for (i = 0; i < 300; i++) {
+        pos[0] = i % N; pos[1] = (i / N) % N; pos[2] = i / (N * N);
+        volume_set_at(volume, NULL, pos, (uint8_t[]){i, i / 256, 7, 255});
+    }
+    for (i = 0; i < 300; i++) {
+        pos[0] = i % N; pos[1] = (i / N) % N; pos[2] = i / (N * N);
+        volume_get_at(volume, NULL, pos, v);
+        ok = ok && v[0] == (uint8_t)i && v[1] == i / 256 && v[2] == 7;
+    }
+    TEST(ok);
+
+    // Once all the voxels have the same value the tile gets compacted.
+    for (i = 0; i < N * N * N; i++) {
+        pos[0] = i % N; pos[1] = (i / N) % N; pos[2] = i / (N * N);
+        volume_set_at(volume, NULL, pos, (uint8_t[]){1, 2, 3, 255});
+    }
+    volume_remove_empty_tiles(volume, false);
+    TEST(volume_is_tile_uniform(volume, NULL, (int[]){0, 0, 0}, v));
+    TEST(v[0] == 1 && v[2] == 3);
+    volume_delete(volume);
+}
+
+static void test_volume_bits_tiles(void)
+{
+    volume_t *a, *b;
+    int i, pos[3];
+    uint8_t v[4], values[2][4];
+    uint64_t mask[TILE_SIZE * TILE_SIZE * TILE_SIZE / 64];
+    const uint8_t white[4] = {255, 255, 255, 255};
+    bool ok = true;
+
+    // Two masks overlapping on the voxels with 8 <= x < 12.
+    a = volume_new();
+    b = volume_new();
+    for (i = 0; i < N * N * N; i++) {
+        pos[0] = i % N; pos[1] = (i / N) % N; pos[2] = i / (N * N);
+        if (pos[0] < 12) volume_set_at(a, NULL, pos, white);
+        if (pos[0] >= 8) volume_set_at(b, NULL, pos, white);
+    }
+    volume_remove_empty_tiles(a, false);
+    volume_remove_empty_tiles(b, false);
+    TEST(volume_get_tile_bits(a, NULL, (int[]){0, 0, 0}, mask, values));
+    TEST(values[0][3] == 0 && values[1][3] == 255);
+
+    volume_merge(a, b, MODE_INTERSECT, NULL);
+    TEST(volume_get_tile_bits(a, NULL, (int[]){0, 0, 0}, mask, values));
+    for (i = 0; i < N * N * N; i++) {
+        pos[0] = i % N; pos[1] = (i / N) % N; pos[2] = i / (N * N);
+        volume_get_at(a, NULL, pos, v);
+        ok = ok && (v[3] == 255) == (pos[0] >= 8 && pos[0] < 12);
+    }
+    TEST(ok);
+
+    volume_invert_mask(a, b);
+    for (i = 0; i < N * N * N; i++) {
+        pos[0] = i % N; pos[1] = (i / N) % N; pos[2] = i / (N * N);
+        volume_get_at(a, NULL, pos, v);
+        ok = ok && (v[3] == 255) == (pos[0] >= 12);
+    }
+    TEST(ok);
+    volume_delete(a);
+    volume_delete(b);
+}
+
+static void test_volume_pack(void)
+{
+    volume_t *volume, *copy;
+    int i, pos[3];
+    uint8_t v[4];
+    bool ok = true;
+    uint64_t mem;
+    volume_stats_t stats;
+
+    volume = volume_new();
+    for (i = 0; i < 1000; i++) {
+        pos[0] = i % 40; pos[1] = (i / 40) % 40; pos[2] = i % 7;
+        volume_set_at(volume, NULL, pos, (uint8_t[]){i, 2, 3, 255});
+    }
+    mem = volume_get_unique_mem(volume);
+    TEST(mem > 0);
+
+    // Shared tiles don't count, and cannot be packed.
+    copy = volume_copy(volume);
+    TEST(volume_get_unique_mem(volume) == 0);
+    volume_get_stats(volume, &stats);
+    TEST(stats.mem == mem && stats.shared_mem == mem);
+    TEST(stats.tiles_count == volume_get_tiles_count(volume));
+    TEST(volume_pack(copy, false) == 0);
+    volume_delete(volume);
+    TEST(volume_get_unique_mem(copy) == mem);
+    volume_get_stats(copy, &stats);
+    TEST(stats.mem == mem && stats.shared_mem == 0);
+
+    TEST(volume_pack(copy, false) > 0);
+    TEST(volume_get_unique_mem(copy) < mem);
+    volume_pack(copy, true);
+    TEST(volume_get_unique_mem(copy) == 0);
+    for (i = 0; i < 1000; i++) {
+        pos[0] = i % 40; pos[1] = (i / 40) % 40; pos[2] = i % 7;
+        volume_get_at(copy, NULL, pos, v);
+        ok = ok && v[0] == (uint8_t)i && v[1] == 2 && v[3] == 255;
+    }
+    TEST(ok);
+    TEST(volume_get_unique_mem(copy) == mem);
+    volume_delete(copy);
+}
+
+static void test_volume_diff_func(void *user, const int pos[3], int change)
+{
+    int *changes = user;
+    changes[change]++;
+}
+
+static void test_volume_diff(void)
+{
+    volume_t *a, *b;
+    int changes[4] = {};
+
+    a = volume_new();
+    volume_set_at(a, NULL, (int[]){1, 2, 3}, (uint8_t[]){255, 0, 0, 255});
+    volume_set_at(a, NULL, (int[]){N + 4, 2, 3}, (uint8_t[]){255, 0, 0, 255});
+    b = volume_copy(a);
+    TEST(volume_diff(a, b, NULL, NULL) == 0);
+
+    // Change one tile, remove an other and add a new one.
+    volume_set_at(b, NULL, (int[]){1, 2, 3}, (uint8_t[]){0, 255, 0, 255});
+    volume_set_at(b, NULL, (int[]){N + 4, 2, 3}, (uint8_t[]){0, 0, 0, 0});
+    volume_set_at(b, NULL, (int[]){2 * N + 8, 2, 3}, (uint8_t[]){0, 0, 255, 255});
+    volume_pack(a, false);
+    TEST(volume_diff(a, b, test_volume_diff_func, changes) == 3);
+    TEST(changes[VOLUME_DIFF_ADDED] == 1);
+    TEST(changes[VOLUME_DIFF_REMOVED] == 1);
+    TEST(changes[VOLUME_DIFF_CHANGED] == 1);
+    TEST(volume_diff(b, b, NULL, NULL) == 0);
+    volume_delete(a);
+    volume_delete(b);
+}
+
+static void test_volume_journal_func(void *user, const int pos[3])
+{
+    (*(int*)user)++;
+}
+
+static void test_volume_journal(void)
+{
+    volume_t *volume, *other;
+    volume_cursor_t cursor;
+    int i, nb = 0;
+
+    volume = volume_new();
+    cursor = volume_journal_get_cursor(volume);
+    for (i = 0; i < 100; i++) {
+        volume_set_at(volume, NULL, (int[]){i, 0, 0},
+                      (uint8_t[]){255, 0, 0, 255});
+    }
+    // The successive writes to the same tile only count once.
+    TEST(volume_journal_read(volume, &cursor, test_volume_journal_func,
+                             &nb) == (100 + N - 1) / N);
+    TEST(nb == (100 + N - 1) / N);
+    TEST(volume_journal_read(volume, &cursor, NULL, NULL) == 0);
+    volume_set_at(volume, NULL, (int[]){99, 0, 0}, (uint8_t[]){0, 0, 0, 0});
+    TEST(volume_journal_read(volume, &cursor, NULL, NULL) == 1);
+
+    // volume_set only adds the tiles that changed.
+    other = volume_copy(volume);
+    volume_set_at(other, NULL, (int[]){0, 0, 50}, (uint8_t[]){0, 0, 0, 255});
+    volume_set(volume, other);
+    TEST(volume_journal_read(volume, &cursor, NULL, NULL) == 1);
+
+    // Too many changes, or a clear, invalidate the cursor.
+    for (i = 0; i < 300; i++)
+        volume_fill_tile(volume, NULL, (int[]){0, i * N, 0},
+                         (uint8_t[]){i, 0, 0, 255});
+    TEST(volume_journal_read(volume, &cursor, NULL, NULL) == -1);
+    TEST(volume_journal_read(volume, &cursor, NULL, NULL) == 0);
+    volume_clear(volume);
+    TEST(volume_journal_read(volume, &cursor, NULL, NULL) == -1);
+    volume_delete(other);
+    volume_delete(volume);
+}
+
+static void test_volume_span(void)
+{
+    volume_t *volume;
+    const int aabb[2][3] = {{-5, 3, -20}, {30, 17, 20}};
+    const int w = 35, h = 14, d = 40;
+    uint8_t *data, *out, v[4];
+    int x, y, z, i;
+    bool ok = true;
+
+    data = calloc(w * h * d, 4);
+    for (i = 0; i < w * h * d; i++) {
+        if (i % 3 == 0) continue;
+        memcpy(data + i * 4, (uint8_t[]){i % 256, i % 7, 0, 255}, 4);
+    }
+    volume = volume_new();
+    volume_set_span(volume, aabb, data, NULL);
+    for (z = 0; z < d; z++)
+    for (y = 0; y < h; y++)
+    for (x = 0; x < w; x++) {
+        i = x + y * w + z * w * h;
+        volume_get_at(volume, NULL, (int[]){x - 5, y + 3, z - 20}, v);
+        ok = ok && memcmp(v, data + i * 4, 4) == 0;
+    }
+    TEST(ok);
+
+    // Read back with a stride of one extra voxel per row.
+    out = calloc((w + 1) * h * d, 4);
+    volume_get_span(volume, aabb, out, (int[]){(w + 1) * 4, (w + 1) * h * 4});
+    for (z = 0; z < d; z++)
+    for (y = 0; y < h; y++) {
+        ok = ok && memcmp(out + (z * h + y) * (w + 1) * 4,
+                          data + (z * h + y) * w * 4, w * 4) == 0;
+    }
+    TEST(ok);
+    free(out);
+    free(data);
+    volume_delete(volume);
+}
+
+static void test_volume_stack(void)
+{
+    int i;
+    volume_t *volumes[3], *merged;
+    volume_stack_t stack = {};
+    uint8_t v1[4], v2[4];
+
+    for (i = 0; i < 3; i++) {
+        volumes[i] = volume_new();
+        volume_set_at(volumes[i], NULL, (int[]){i * 10, 0, 0},
+                      (uint8_t[]){255, i * 100, 0, 128});
+        volume_set_at(volumes[i], NULL, (int[]){0, 0, 0},
+                      (uint8_t[]){i * 100, 255, 0, 128});
+    }
+    volume_stack_update(&stack, 3, (const volume_t**)volumes);
+    volume_set_at(volumes[1], NULL, (int[]){40, 0, 0},
+                  (uint8_t[]){1, 2, 3, 255});
+    volume_set_at(volumes[2], NULL, (int[]){0, 0, 0},
+                  (uint8_t[]){0, 0, 0, 0});
+    volume_stack_update(&stack, 3, (const volume_t**)volumes);
+
+    merged = volume_new();
+    for (i = 0; i < 3; i++)
+        volume_merge(merged, volumes[i], MODE_OVER, NULL);
+    for (i = 0; i < 5; i++) {
+        volume_get_at(merged, NULL, (int[]){i * 10, 0, 0}, v1);
+        volume_get_at(stack.volume, NULL, (int[]){i * 10, 0, 0}, v2);
+        TEST(memcmp(v1, v2, 4) == 0);
+    }
+
+    volume_delete(merged);
+    for (i = 0; i < 3; i++) volume_delete(volumes[i]);
+    volume_stack_release(&stack);
+}
+
+static bool volumes_equal(const volume_t *a, const volume_t *b)
+{
+    volume_iterator_t iter;
+    int i, pos[3];
+    uint8_t v1[4], v2[4];
+    const volume_t *vols[2] = {a, b};
+
+    for (i = 0; i < 2; i++) {
+        iter = volume_get_iterator(vols[i],
+                VOLUME_ITER_VOXELS | VOLUME_ITER_SKIP_EMPTY);
+        while (volume_iter(&iter, pos)) {
+            volume_get_at(a, NULL, pos, v1);
+            volume_get_at(b, NULL, pos, v2);
+            if (memcmp(v1, v2, 4) != 0) return false;
+        }
+    }
+    return true;
+}
+
+// Send the changes of a client volume to a server, and back to an other
+// client.
+static void test_sync(void)
+{
+    volume_t *a, *b, *server;
+    sync_peer_t *peer_a, *peer_b, *server_a, *server_b;
+    uint8_t *msg;
+    int size, size_data;
+    float box[4][4];
+    painter_t painter = {
+        .mode = MODE_OVER,
+        .shape = &shape_sphere,
+        .color = {255, 0, 0, 255},
+    };
+
+    a = volume_new();
+    b = volume_new();
+    server = volume_new();
+    peer_a = sync_peer_new(a, false);
+    peer_b = sync_peer_new(b, false);
+    server_a = sync_peer_new(server, true);
+    server_b = sync_peer_new(server, true);
+    TEST(sync_peer_encode(peer_a, &size) == NULL);
+
+    mat4_set_identity(box);
+    mat4_iscale(box, 20, 20, 20);
+    volume_op(a, &painter, box);
+    msg = sync_peer_encode(peer_a, &size_data);
+    TEST(msg && sync_peer_apply(server_a, msg, size_data) > 0);
+    free(msg);
+    msg = sync_peer_encode(server_b, &size);
+    TEST(msg && sync_peer_apply(peer_b, msg, size) > 0);
+    free(msg);
+    TEST(volumes_equal(a, b) && volumes_equal(a, server));
+    // Nothing to send back to b.
+    TEST(sync_peer_encode(peer_b, &size) == NULL);
+
+    // The tiles already known are only sent as references.
+    volume_clear(a);
+    msg = sync_peer_encode(peer_a, &size);
+    TEST(msg && sync_peer_apply(server_a, msg, size) > 0);
+    free(msg);
+    msg = sync_peer_encode(server_b, &size);
+    TEST(msg && sync_peer_apply(peer_b, msg, size) > 0);
+    free(msg);
+    TEST(volume_is_empty(b));
+    volume_op(a, &painter, box);
+    msg = sync_peer_encode(peer_a, &size);
+    TEST(msg && size < size_data / 4);
+    TEST(sync_peer_apply(server_a, msg, size) > 0);
+    free(msg);
+    msg = sync_peer_encode(server_b, &size);
+    TEST(msg && sync_peer_apply(peer_b, msg, size) > 0);
+    free(msg);
+    TEST(volumes_equal(a, b) && !volume_is_empty(b));
+    TEST(sync_peer_apply(peer_b, (const uint8_t*)"GXSY", 4) == -1);
+
+    sync_peer_delete(peer_a);
+    sync_peer_delete(peer_b);
+    sync_peer_delete(server_a);
+    sync_peer_delete(server_b);
+    volume_delete(a);
+    volume_delete(b);
+    volume_delete(server);
+}
+
+static void test_image_clones(void)
+{
+    int i;
+    image_t *img = image_new();
+    layer_t *base, *layers[4];
+    uint8_t v[4];
+
+    base = layers[0] = img->active_layer;
+    volume_set_at(base->volume, NULL, (int[]){0, 0, 0},
+                  (uint8_t[]){255, 0, 0, 255});
+    // A chain of clones, each one moved by 20 voxels from its base.  We put
+    // the last clone first, to check that the update order doesn't depend
+    // on the layers order.
+    for (i = 1; i < 4; i++) {
+        layers[i] = image_clone_layer(img, layers[i - 1]);
+        mat4_itranslate(layers[i]->mat, 20, 0, 0);
+        layers[i]->base_volume_key = 0;
+    }
+    DL_DELETE(img->layers, layers[3]);
+    DL_PREPEND(img->layers, layers[3]);
+
+    image_update(img, true);
+    for (i = 0; i < 4; i++) {
+        volume_get_at(layers[i]->volume, NULL, (int[]){i * 20, 0, 0}, v);
+        TEST(v[0] == 255 && v[3] == 255);
+    }
+
+    volume_set_at(base->volume, NULL, (int[]){0, 0, 0},
+                  (uint8_t[]){0, 255, 0, 255});
+    image_update(img, true);
+    for (i = 0; i < 4; i++) {
+        volume_get_at(layers[i]->volume, NULL, (int[]){i * 20, 0, 0}, v);
+        TEST(v[1] == 255 && v[3] == 255);
+    }
+    image_delete(img);
+}
+
+static int test_select_cond(void *user, const volume_t *volume,
+                            const int base_pos[3], const int new_pos[3],
+                            volume_accessor_t *accessor)
+{
+    uint8_t v0[4], v1[4];
+    volume_get_at(volume, accessor, base_pos, v0);
+    volume_get_at(volume, accessor, new_pos, v1);
+    return memcmp(v0, v1, 4) == 0 ? 255 : 0;
+}
+
+static void test_volume_select(void)
+{
+    volume_t *volume = volume_new(), *sel = volume_new();
+    volume_t *expected = volume_new();
+    painter_t painter = {.shape = &shape_cube, .mode = MODE_OVER,
+                         .color = {255, 0, 0, 255}};
+    float box[4][4];
+
+    // Two cubes of different colors touching each other.
+    mat4_set_identity(box);
+    mat4_iscale(box, 20, 20, 20);
+    volume_op(volume, &painter, box);
+    memcpy(painter.color, (uint8_t[]){255, 255, 255, 255}, 4);
+    volume_op(expected, &painter, box);
+    mat4_itranslate(box, 2, 0, 0);
+    memcpy(painter.color, (uint8_t[]){0, 0, 255, 255}, 4);
+    volume_op(volume, &painter, box);
+
+    volume_select(volume, (int[]){-10, 0, 0}, test_select_cond, NULL, sel);
+    TEST(volumes_equal(sel, expected));
+    volume_select(volume, (int[]){100, 0, 0}, test_select_cond, NULL, sel);
+    TEST(volume_is_empty(sel));
+    volume_delete(volume);
+    volume_delete(sel);
+    volume_delete(expected);
+}
+
+static void test_volume_extract(void)
+{
+    volume_t *volume = volume_new(), *out = volume_new();
+    volume_t *mask = volume_new(), *expected, *rest;
+    painter_t painter = {.shape = &shape_cube, .mode = MODE_OVER,
+                         .color = {255, 0, 0, 255}};
+    const int aabb[2][3] = {{-5, -9, -40}, {17, 30, 3}};
+    int i, pos[3];
+    float box[4][4];
+
+    // A big uniform cube, and some voxels of different colors.
+    mat4_set_identity(box);
+    mat4_iscale(box, 32, 32, 32);
+    volume_op(volume, &painter, box);
+    for (i = 0; i < 5000; i++) {
+        pos[0] = i % 50 - 20; pos[1] = (i / 50) % 50; pos[2] = i % 13 - 40;
+        volume_set_at(volume, NULL, pos, (uint8_t[]){i, 2, 3, 255});
+    }
+
+    bbox_from_aabb(box, aabb);
+    painter.mode = MODE_INTERSECT;
+    expected = volume_copy(volume);
+    volume_op(expected, &painter, box);
+    painter.mode = MODE_SUB;
+    rest = volume_copy(volume);
+    volume_op(rest, &painter, box);
+
+    painter.mode = MODE_INTERSECT_FILL;
+    memcpy(painter.color, (uint8_t[]){255, 255, 255, 255}, 4);
+    volume_set(mask, volume);
+    volume_op(mask, &painter, box);
+
+    volume_extract(volume, NULL, aabb, NULL, false, out);
+    TEST(volumes_equal(out, expected));
+    volume_extract(volume, NULL, aabb, (uint8_t[]){255, 255, 255, 255},
+                   false, out);
+    TEST(volumes_equal(out, mask));
+    volume_extract(volume, mask, NULL, NULL, true, out);
+    TEST(volumes_equal(out, expected));
+    TEST(volumes_equal(volume, rest));
+
+    volume_delete(volume);
+    volume_delete(out);
+    volume_delete(mask);
+    volume_delete(expected);
+    volume_delete(rest);
+}
+
+static void test_volume_store(void)
+{
+    volume_t *volume = volume_new(), *copy;
+    painter_t painter = {.shape = &shape_cube, .mode = MODE_OVER,
+                         .color = {255, 0, 0, 255}};
+    volume_global_stats_t stats;
+    uint8_t v[4];
+    float box[4][4];
+    int i, pos[3];
+
+    if (DEFINED(WIN32)) return;
+    mat4_set_identity(box);
+    mat4_iscale(box, 20, 20, 20);
+    volume_op(volume, &painter, box);
+    for (i = 0; i < 2000; i++) {
+        pos[0] = i % 40 - 20; pos[1] = (i / 40) % 40; pos[2] = i % 7;
+        volume_set_at(volume, NULL, pos, (uint8_t[]){i, 2, 3, 255});
+    }
+    TEST(volume_store_save("/tmp/goxel_test.store", &volume, 1) > 0);
+    TEST(volume_store_open("/tmp/goxel_test.store") == 0);
+
+    copy = volume_copy(volume);
+    TEST(volume_store_share(copy) > 0);
+    TEST(volumes_equal(copy, volume));
+    volume_get_global_stats(&stats);
+    TEST(stats.shared_mem > 0);
+
+    // The writes go into private copies of the mapped tiles.
+    volume_set_at(copy, NULL, (int[]){0, 0, 0}, (uint8_t[]){0, 255, 0, 255});
+    volume_get_at(copy, NULL, (int[]){0, 0, 0}, v);
+    TEST(v[1] == 255);
+    volume_get_at(volume, NULL, (int[]){0, 0, 0}, v);
+    TEST(v[1] != 255);
+
+    volume_store_close();
+    volume_delete(copy);
+    volume_get_global_stats(&stats);
+    TEST(stats.shared_mem == 0);
+    volume_delete(volume);
+    sys_delete_file("/tmp/goxel_test.store");
+}
+
+// The tiles shared by several volumes are only counted once.
+static void test_mem_tracker(void)
+{
+    painter_t painter = {.shape = &shape_cube, .mode = MODE_OVER,
+                         .color = {255, 0, 0, 255}};
+    const mem_stats_t *stats;
+    layer_t *layer;
+    uint64_t layers_mem;
+    float box[4][4];
+
+    image_delete(goxel.image);
+    goxel.image = image_new();
+    layer = goxel.image->active_layer;
+    mat4_set_identity(box);
+    mat4_iscale(box, 40, 40, 40);
+    volume_op(layer->volume, &painter, box);
+    mem_tracker_update();
+    stats = mem_tracker_get_stats();
+    layers_mem = stats->values[MEM_TILES_LAYERS];
+    TEST(layers_mem > 0);
+    TEST(layers_mem <= stats->values[MEM_TILES]);
+
+    image_duplicate_layer(goxel.image, layer);
+    mem_tracker_update();
+    TEST(stats->values[MEM_TILES_LAYERS] == layers_mem);
+
+    image_delete(goxel.image);
+    goxel.image = image_new();
+}
+
+// Undoing a "Stream To" stops the streaming, and redo brings it back.
+static void test_layer_stream_undo(void)
+{
+    image_t *img = image_new();
+    layer_t *layer = img->active_layer;
+    const char *path = "/tmp/goxel_test_region";
+
+    layer->region = region_store_open(path);
+    image_history_push(img);
+    image_undo(img);
+    TEST(img->active_layer->region == NULL);
+    image_redo(img);
+    TEST(img->active_layer->region != NULL);
+    TEST(strcmp(region_store_get_path(img->active_layer->region), path) == 0);
+    image_delete(img);
+    sys_delete_file(path);
+}
+
+static void test_replay_record(void)
+{
+    inputs_t inputs = {.window_size = {640, 480}, .scale = 2,
+                       .mouse_wheel = 1};
+    replay_frame_t *frames;
+    const char *path = "/tmp/goxel_test_inputs.bin";
+
+    inputs.keys[KEY_LEFT_SHIFT] = true;
+    inputs.keys['Z'] = true;
+    inputs_insert_char(&inputs, 'z');
+    vec2_set(inputs.touches[0].pos, 10, 20);
+    inputs.touches[0].down[1] = true;
+    TEST(replay_record_start(path) == 0);
+    replay_record_frame(&inputs);
+    replay_record_frame(&(inputs_t){.window_size = {640, 480}});
+    replay_record_stop();
+
+    TEST(replay_load(path, &frames) == 2);
+    TEST(frames[0].time <= frames[1].time);
+    TEST(frames[0].inputs.window_size[1] == 480);
+    TEST(frames[0].inputs.scale == 2 && frames[0].inputs.mouse_wheel == 1);
+    TEST(memcmp(frames[0].inputs.keys, inputs.keys, sizeof(inputs.keys)) == 0);
+    TEST(frames[0].inputs.chars[0] == 'z');
+    TEST(frames[0].inputs.touches[0].pos[1] == 20);
+    TEST(frames[0].inputs.touches[0].down[1]);
+    TEST(!frames[1].inputs.keys['Z'] && !frames[1].inputs.touches[0].down[1]);
+    free(frames);
+    sys_delete_file(path);
+}
+
+static void test_image_instances(void)
+{
+    image_t *img = image_new();
+    layer_t *base, *clone, *clone2;
+    uint8_t v[4];
+
+    base = img->active_layer;
+    volume_set_at(base->volume, NULL, (int[]){0, 0, 0},
+                  (uint8_t[]){255, 0, 0, 255});
+    clone = image_clone_layer(img, base);
+    mat4_itranslate(clone->mat, 20, 0, 0);
+    clone->base_volume_key = 0;
+    TEST(image_get_instance_base(img, clone) == base);
+
+    // The instanced clone only gets its voxels when we need them.
+    image_update(img, false);
+    volume_get_at(clone->volume, NULL, (int[]){20, 0, 0}, v);
+    TEST(v[3] == 0);
+    image_update(img, true);
+    volume_get_at(clone->volume, NULL, (int[]){20, 0, 0}, v);
+    TEST(v[3] == 255);
+
+    // A clone with its own clone has to keep its voxels.
+    clone2 = image_clone_layer(img, clone);
+    TEST(image_get_instance_base(img, clone) == NULL);
+    TEST(image_get_instance_base(img, clone2) == clone);
+    mat4_irotate(clone2->mat, 0.5, 0, 0, 1);
+    TEST(image_get_instance_base(img, clone2) == NULL);
+    image_delete(img);
+}
+
+static void test_volume_lod(void)
+{
+    int x, y, z, size, subdivide;
+    volume_t *volume = volume_new();
+    voxel_vertex_t *verts = calloc(N * N * N * 6 * 4, sizeof(*verts));
+    volume_accessor_t accessor = volume_get_accessor(volume);
+
+    for (z = 0; z < N; z++)
+    for (y = 0; y < N; y++)
+    for (x = 0; x < N; x++) {
+        volume_set_at(volume, &accessor, (int[]){x, y, z},
+                      (uint8_t[]){255, 0, 0, 255});
+    }
+    TEST(volume_generate_vertices_lod(volume, (int[]){0, 0, 0}, 0, 0, verts,
+                                      &size, &subdivide) == 6 * N * N);
+    TEST(volume_generate_vertices_lod(volume, (int[]){0, 0, 0}, 1, 0, verts,
+                                      &size, &subdivide) == 6 * N * N / 4);
+    TEST(volume_generate_vertices_lod(volume, (int[]){0, 0, 0}, 3, 0, verts,
+                                      &size, &subdivide) == 6 * N * N / 64);
+    TEST(size == 4 && verts[0].color[0] == 255);
+    free(verts);
+    volume_delete(volume);
+}
+
+static void test_volume_raycast(void)
+{
+    int pos[3], normal[3];
+    volume_t *volume = volume_new();
+
+    volume_set_at(volume, NULL, (int[]){20, -5, 3},
+                  (uint8_t[]){255, 0, 0, 255});
+    volume_set_at(volume, NULL, (int[]){40, -5, 3},
+                  (uint8_t[]){255, 0, 0, 255});
+    TEST(volume_raycast(volume, (float[]){-100, -4.5, 3.5},
+                        (float[]){1, 0, 0}, pos, normal));
+    TEST(pos[0] == 20 && pos[1] == -5 && pos[2] == 3);
+    TEST(normal[0] == -1 && normal[1] == 0 && normal[2] == 0);
+    TEST(volume_raycast(volume, (float[]){100, -4.5, 3.5},
+                        (float[]){-1, 0, 0}, pos, normal));
+    TEST(pos[0] == 40 && normal[0] == 1);
+    TEST(volume_raycast(volume, (float[]){20.5, 50, 58},
+                        (float[]){0, -0.7071, -0.7071}, pos, normal));
+    TEST(pos[0] == 20 && pos[1] == -5 && pos[2] == 3);
+    TEST(!volume_raycast(volume, (float[]){-100, 10.5, 3.5},
+                         (float[]){1, 0, 0}, pos, normal));
+    volume_delete(volume);
+}
+
+static void test_jobs_func(void *user, int i, int worker)
+{
+    int (*sums)[2] = user;
+    sums[worker][0] += i;
+    sums[worker][1]++;
+}
+
+static void test_jobs_async_func(void *user)
+{
+    __atomic_store_n((int*)user, 1, __ATOMIC_RELEASE);
+}
+
+// Wait until the test sets the value to 1.
+static void test_jobs_wait_func(void *user)
+{
+    while (__atomic_load_n((int*)user, __ATOMIC_ACQUIRE) != 1) {}
+    __atomic_store_n((int*)user, 2, __ATOMIC_RELEASE);
+}
+
+static void test_jobs(void)
+{
+    int i, sums[64][2] = {}, total = 0, count = 0, done = 0;
+    jobs_parallel_for(10000, test_jobs_func, sums);
+    for (i = 0; i < jobs_get_nb_workers(); i++) {
+        total += sums[i][0];
+        count += sums[i][1];
+    }
+    TEST(count == 10000 && total == 10000 * 9999 / 2);
+
+    jobs_async(test_jobs_async_func, &done);
+    while (!__atomic_load_n(&done, __ATOMIC_ACQUIRE)) {}
+    TEST(done == 1);
+
+    // The loops don't wait for the running tasks.
+    if (jobs_get_nb_workers() > 1) {
+        done = 0;
+        jobs_async(test_jobs_wait_func, &done);
+        memset(sums, 0, sizeof(sums));
+        jobs_parallel_for(100, test_jobs_func, sums);
+        for (i = 0, count = 0; i < jobs_get_nb_workers(); i++)
+            count += sums[i][1];
+        TEST(count == 100);
+        __atomic_store_n(&done, 1, __ATOMIC_RELEASE);
+        while (__atomic_load_n(&done, __ATOMIC_ACQUIRE) != 2) {}
+    }
+}
+
+static int test_cache_del(void *data)
+{
+    return 0;
+}
+
+static void test_cache(void)
+{
+    cache_t *cache;
+    cache_stats_t stats;
+    char key[300] = {};
+
+    // The least recently used item gets evicted.
+    cache = cache_create("test", 3);
+    cache_add(cache, "a", 1, "a", 1, test_cache_del);
+    cache_add(cache, key, sizeof(key), "b", 1, test_cache_del);
+    TEST(cache_get(cache, "a", 1));
+    cache_add(cache, "c", 1, "c", 1, test_cache_del);
+    TEST(!cache_get(cache, key, sizeof(key)));
+    TEST(cache_get(cache, "a", 1) && cache_get(cache, "c", 1));
+    cache_get_stats(cache, &stats);
+    TEST(stats.nb_items == 2 && stats.size == 2);
+    TEST(stats.hits == 3 && stats.misses == 1 && stats.evictions == 1);
+    cache_delete(cache);
+}
+
+static int g_test_cache_nb_deleted = 0;
+
+static int test_cache_count_del(void *data)
+{
+    TEST(*(int*)data >= 0);
+    free(data);
+    __atomic_add_fetch(&g_test_cache_nb_deleted, 1, __ATOMIC_RELAXED);
+    return 0;
+}
+
+static void test_cache_concurrent_func(void *user, int i, int worker)
+{
+    cache_t *cache = user;
+    cache_item_t *ref;
+    int key = i % 64, *data;
+
+    data = cache_acquire(cache, &key, sizeof(key), &ref);
+    if (data) {
+        TEST(*data == key);
+        cache_release(cache, ref);
+        return;
+    }
+    data = malloc(sizeof(*data));
+    *data = key;
+    cache_add(cache, &key, sizeof(key), data, 1, test_cache_count_del);
+}
+
+static void test_cache_concurrent(void)
+{
+    cache_t *cache;
+    cache_stats_t stats;
+    cache_item_t *ref;
+    int key = 0, nb, *data;
+
+    // The evicted items are only deleted by cache_collect.
+    cache = cache_create_with_flags("test", 64,
+                                    CACHE_CONCURRENT | CACHE_DEFER_DELETE);
+    jobs_parallel_for(10000, test_cache_concurrent_func, cache);
+    cache_get_stats(cache, &stats);
+    TEST(stats.hits + stats.misses == 10000);
+    TEST(g_test_cache_nb_deleted == 0);
+    cache_collect(cache);
+    TEST(g_test_cache_nb_deleted == stats.misses - stats.nb_items);
+
+    // An acquired item stays alive after it has been evicted.
+    cache_clear(cache);
+    cache_collect(cache);
+    nb = g_test_cache_nb_deleted;
+    data = malloc(sizeof(*data));
+    *data = 0;
+    cache_add(cache, &key, sizeof(key), data, 1, test_cache_count_del);
+    TEST(cache_acquire(cache, &key, sizeof(key), &ref) == data);
+    cache_clear(cache);
+    cache_collect(cache);
+    TEST(g_test_cache_nb_deleted == nb);
+    cache_release(cache, ref);
+    cache_collect(cache);
+    TEST(g_test_cache_nb_deleted == nb + 1);
+    cache_delete(cache);
+}
+
+static void test_assets(void)
+{
+    const palette_t *palette;
+    int nb = 0;
+
+    TEST(assets_get("asset://data/palettes/db32.gpl", NULL));
+    TEST(!assets_get("data/palettes/db32", NULL));
+    TEST(assets_list("data/palettes/", NULL, NULL) > 1);
+
+    // The default palette is not loaded twice.
+    DL_FOREACH(goxel_get_palettes(), palette)
+        nb += strcmp(palette->name, "DB32") == 0 ? 1 : 0;
+    TEST(nb == 1);
+}
+
+static void test_palette_lookup(void)
+{
+    palette_t palette = {};
+    int i;
+
+    // The lookup gives the same results as the linear search.
+    for (i = 0; i < 1000; i++)
+        palette_insert(&palette, (uint8_t[]){i, i / 4, 0, 255}, NULL);
+    palette_insert(&palette, (uint8_t[]){10, 2, 0, 255}, NULL);
+    TEST(palette.size == 1000);
+    TEST(palette_search(&palette, (uint8_t[]){10, 2, 0, 255}, true) == 10);
+    TEST(palette_search(&palette, (uint8_t[]){10, 9, 0, 255}, true) == -1);
+    TEST(palette_search(&palette, (uint8_t[]){10, 9, 0, 255}, false) == 10);
+    palette_lookup_begin(&palette);
+    TEST(palette_search(&palette, (uint8_t[]){10, 2, 0, 255}, true) == 10);
+    TEST(palette_search(&palette, (uint8_t[]){10, 9, 0, 255}, true) == -1);
+    TEST(palette_search(&palette, (uint8_t[]){10, 9, 0, 255}, false) == 10);
+    palette_insert(&palette, (uint8_t[]){10, 9, 0, 255}, NULL);
+    TEST(palette_search(&palette, (uint8_t[]){10, 9, 0, 255}, false) == 1000);
+    palette_lookup_end(&palette);
+    free(palette.entries);
+}
+
+static void test_generator(void)
+{
+    volume_t *v1 = volume_new(), *v2 = volume_new();
+    image_t *image = image_new();
+    int nb = 0;
+    layer_t *layer;
+
+    // The scenes only depend on the seed.
+    generator_fill_volume(v1, "terrain", 100000, 1);
+    generator_fill_volume(v2, "terrain", 100000, 1);
+    TEST(!volume_is_empty(v1));
+    TEST(volume_crc32(v1) == volume_crc32(v2));
+    generator_fill_volume(v2, "terrain", 100000, 2);
+    TEST(volume_crc32(v1) != volume_crc32(v2));
+
+    TEST(generator_run(image, "clones", 100000, 1) == 0);
+    DL_COUNT(image->layers, layer, nb);
+    TEST(nb == 16);
+    TEST(!volume_is_empty(image->layers->prev->volume));
+    TEST(generator_run(image, "unknown", 100000, 1) == -1);
+
+    volume_delete(v1);
+    volume_delete(v2);
+    image_delete(image);
+}
+
+static bool test_mesh_voxelize_cancel(void *user, float p)
+{
+    return false;
+}
+
+static void test_mesh_voxelize(void)
+{
+    // A 80x80 red quad in the middle of the z = 10 voxels, over several
+    // tiles.
+    const float vertices[][3] = {
+        {-39.5, -39.5, 10.5}, {39.5, -39.5, 10.5},
+        {39.5, 39.5, 10.5}, {-39.5, 39.5, 10.5}};
+    const int triangles[][3] = {{0, 1, 2}, {0, 2, 3}};
+    const int materials[] = {0, 0};
+    const voxelizer_material_t material = {.color = {255, 0, 0, 255}};
+    const voxelizer_mesh_t mesh = {
+        .nb_vertices = 4, .vertices = vertices,
+        .nb_triangles = 2, .triangles = triangles,
+        .materials = materials, .nb_materials = 1,
+        .materials_def = &material,
+    };
+    volume_t *volume = volume_new();
+    int x, y, z, nb = 0;
+    uint8_t v[4];
+
+    TEST(mesh_voxelize(volume, &mesh, NULL, NULL) == 0);
+    for (z = 8; z < 13; z++)
+    for (y = -45; y < 45; y++)
+    for (x = -45; x < 45; x++) {
+        volume_get_at(volume, NULL, (int[]){x, y, z}, v);
+        if (!v[3]) continue;
+        TEST(z == 10 && memcmp(v, material.color, 4) == 0);
+        nb++;
+    }
+    TEST(nb == 80 * 80);
+
+    volume_clear(volume);
+    TEST(mesh_voxelize(volume, &mesh, test_mesh_voxelize_cancel, NULL) == -1);
+    TEST(volume_is_empty(volume));
+    volume_delete(volume);
+}
+
 void tests_run(void)
 {
+    test_volume_tiles();
+    test_volume_neighbors_accessor();
+    test_volume_uniform_tiles();
+    test_volume_op_symmetry();
+    test_shapes_func_n();
+    test_volume_dedup();
+    test_volume_op_tiles_cache();
+    test_volume_indexed_tiles();
+    test_volume_bits_tiles();
+    test_volume_pack();
+    test_volume_diff();
+    test_volume_journal();
+    test_volume_span();
+    test_volume_stack();
+    test_sync();
+    test_image_clones();
+    test_image_instances();
+    test_mem_tracker();
+    test_replay_record();
+    test_layer_stream_undo();
+    test_volume_select();
+    test_volume_extract();
+    test_volume_store();
+    test_volume_lod();
+    test_volume_raycast();
+    test_jobs();
+    test_cache();
+    test_cache_concurrent();
+    test_assets();
+    test_palette_lookup();
+    test_generator();
+    test_mesh_voxelize();
     test_load_file_v2();
     test_load_file_v1_with_preview();
+    test_load_file_v3();
     test_load_corrupt();
+    test_svdag();
+}
+
+/*
+ * Performance tests.
+ *
+ * Each case is timed and compared to a baseline stored in a text file, as
+ * one 'name milliseconds' line per case.  The baselines only make sense on
+ * the machine where they have been recorded.  The cases missing from the
+ * file get added to it.
+ */
+
+// Each case runs at least PERF_MIN_RUNS times, then until PERF_TIME
+// seconds, and we keep the fastest run.
+#define PERF_MIN_RUNS 3
+#define PERF_TIME 0.25
+
+typedef struct {
+    image_t     *image;
+    volume_t    *layers[8];
+    volume_t    *terrain;
+    char        path[1024];
+} perf_ctx_t;
+
+static void perf_merge(perf_ctx_t *ctx)
+{
+    volume_t *volume = volume_new();
+    int i;
+    for (i = 0; i < ARRAY_SIZE(ctx->layers); i++)
+        volume_merge(volume, ctx->layers[i], MODE_OVER, NULL);
+    volume_delete(volume);
+}
+
+static void perf_mesh(perf_ctx_t *ctx)
+{
+    volume_mesh_free(volume_generate_mesh(ctx->terrain, 0, NULL, 0));
+}
+
+static void perf_export(perf_ctx_t *ctx)
+{
+    image_t *image = goxel.image;
+    goxel.image = ctx->image;
+    goxel_export_to_file(ctx->path, "obj");
+    goxel.image = image;
+}
+
+static void perf_load_v2(perf_ctx_t *ctx)
+{
+    test_load_file_v2();
+}
+
+static void perf_load_v1(perf_ctx_t *ctx)
+{
+    test_load_file_v1_with_preview();
+}
+
+static const struct {
+    const char *name;
+    void (*func)(perf_ctx_t *ctx);
+} PERF_CASES[] = {
+    {"load_file_v2", perf_load_v2},
+    {"load_file_v1_with_preview", perf_load_v1},
+    {"merge", perf_merge},
+    {"mesh", perf_mesh},
+    {"export_obj", perf_export},
+};
+
+static double perf_time(perf_ctx_t *ctx, void (*func)(perf_ctx_t *ctx))
+{
+    double t, total = 0, ret = DBL_MAX;
+    int i;
+
+    for (i = 0; i < PERF_MIN_RUNS || total < PERF_TIME; i++) {
+        cache_on_low_memory();
+        t = sys_get_time();
+        func(ctx);
+        t = sys_get_time() - t;
+        total += t;
+        ret = min(ret, t);
+    }
+    return ret * 1000;
+}
+
+int tests_run_perf(const char *baseline_path, float tolerance)
+{
+    FILE *file;
+    char line[256], name[128];
+    double ms, baselines[ARRAY_SIZE(PERF_CASES)];
+    int i, nb_failed = 0, nb_new = 0;
+    perf_ctx_t ctx = {};
+
+    for (i = 0; i < ARRAY_SIZE(PERF_CASES); i++) baselines[i] = 0;
+    file = fopen(baseline_path, "r");
+    while (file && fgets(line, sizeof(line), file)) {
+        if (sscanf(line, "%127s %lf", name, &ms) != 2) continue;
+        for (i = 0; i < ARRAY_SIZE(PERF_CASES); i++) {
+            if (strcmp(name, PERF_CASES[i].name) == 0) baselines[i] = ms;
+        }
+    }
+    if (file) fclose(file);
+
+    ctx.image = image_new();
+    generator_run(ctx.image, "terrain", 100000, 1);
+    ctx.terrain = volume_new();
+    generator_fill_volume(ctx.terrain, "terrain", 300000, 1);
+    for (i = 0; i < ARRAY_SIZE(ctx.layers); i++) {
+        ctx.layers[i] = volume_new();
+        generator_fill_volume(ctx.layers[i], "shell", 100000, i + 1);
+    }
+    snprintf(ctx.path, sizeof(ctx.path), "%s/perf_test.obj",
+             sys_get_user_dir());
+
+    for (i = 0; i < ARRAY_SIZE(PERF_CASES); i++) {
+        ms = perf_time(&ctx, PERF_CASES[i].func);
+        if (!baselines[i]) {
+            LOG_I("Perf %-28s %8.2f ms (new)", PERF_CASES[i].name, ms);
+            baselines[i] = ms;
+            nb_new++;
+        } else if (ms > baselines[i] * (1 + tolerance / 100)) {
+            LOG_E("Perf %-28s %8.2f ms, %.0f%% slower than %.2f ms",
+                  PERF_CASES[i].name, ms,
+                  (ms / baselines[i] - 1) * 100, baselines[i]);
+            nb_failed++;
+        } else {
+            LOG_I("Perf %-28s %8.2f ms (baseline %.2f ms)",
+                  PERF_CASES[i].name, ms, baselines[i]);
+        }
+    }
+
+    sys_delete_file(ctx.path);
+    image_delete(ctx.image);
+    volume_delete(ctx.terrain);
+    for (i = 0; i < ARRAY_SIZE(ctx.layers); i++)
+        volume_delete(ctx.layers[i]);
+
+    if (nb_new) {
+        file = fopen(baseline_path, "w");
+        if (!file) {
+            LOG_E("Cannot write %s", baseline_path);
+            return -1;
+        }
+        for (i = 0; i < ARRAY_SIZE(PERF_CASES); i++)
+            fprintf(file, "%s %.3f\n", PERF_CASES[i].name, baselines[i]);
+        fclose(file);
+    }
+    if (nb_failed) {
+        LOG_E("%d perf tests failed", nb_failed);
+        return -1;
+    }
+    return 0;
 }
@@ -263,9 +263,11 @@ static void themes_init(void)
 {
     // Load all the themes.
     char dir[1024];
+    profiler_trace_begin("themes");
     assets_list("data/themes/", NULL, on_theme);
     snprintf(dir, sizeof(dir), "%s/themes", sys_get_user_dir());
     sys_list_dir(dir, on_theme2, NULL);
+    profiler_trace_end();
 }
 
 theme_t *theme_get(void)
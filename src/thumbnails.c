@@ -0,0 +1,158 @@
+/* Goxel 3D voxels editor
+ *
+ * copyright (c) 2026 Guillaume Chereau <guillaume@noctua-software.com>
+ *
+ * Goxel is free software: you can redistribute it and/or modify it under the
+ * terms of the GNU General Public License as published by the Free Software
+ * Foundation, either version 3 of the License, or (at your option) any later
+ * version.
+
+ * Goxel is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+
+ * You should have received a copy of the GNU General Public License along with
+ * goxel.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "goxel.h"
+
+#include "thumbnails.h"
+#include "xxhash.h"
+
+#include <errno.h> // IWYU pragma: keep.
+#include <inttypes.h>
+#include <sys/stat.h>
+
+/*
+ * The previews of the files, by path.  The entries are never removed, so
+ * that the jobs loading them can keep a pointer.  Only the main thread
+ * uses the hash table, the jobs only set the image and the done flag.
+ */
+typedef struct {
+    UT_hash_handle  hh;
+    char            path[1024];
+    int             done;       // Set by the job once finished.
+    uint8_t         *img;       // NULL if the file has no preview.
+    int             w, h, bpp;
+    texture_t       *tex;
+} thumbnail_t;
+
+static thumbnail_t *g_thumbnails = NULL;
+
+typedef struct {
+    char    *data;
+    int     size;
+} png_t;
+
+// Name of the file of a preview in the disk cache.
+static bool get_cache_path(const char *path, char *out, int size)
+{
+    struct stat st;
+    uint64_t hash;
+
+    if (!sys_get_user_dir() || stat(path, &st) != 0) return false;
+    hash = XXH64(path, strlen(path), 0);
+    hash = XXH64(&st.st_mtime, sizeof(st.st_mtime), hash);
+    hash = XXH64(&st.st_size, sizeof(st.st_size), hash);
+    snprintf(out, size, "%s/thumbnails/%016" PRIx64 ".png",
+             sys_get_user_dir(), hash);
+    return true;
+}
+
+static int on_gox_info(const char *attr, int size, void *value, void *user)
+{
+    png_t *png = user;
+    if (strcmp(attr, "PREV") != 0 || png->data) return 0;
+    png->data = malloc(size);
+    memcpy(png->data, value, size);
+    png->size = size;
+    return 0;
+}
+
+static void save_to_cache(const char *path, const char *png, int size)
+{
+    FILE *file;
+
+    sys_make_dir(path);
+    file = fopen(path, "wb");
+    if (!file) {
+        LOG_W("Cannot save thumbnail %s: %s", path, strerror(errno));
+        return;
+    }
+    fwrite(png, size, 1, file);
+    fclose(file);
+}
+
+// Run in a job: get the png from the disk cache or the file, and decode it.
+static void thumbnail_load(void *user)
+{
+    thumbnail_t *thumb = user;
+    char cache_path[1024];
+    bool cached;
+    png_t png = {};
+
+    cached = get_cache_path(thumb->path, cache_path, sizeof(cache_path));
+    if (cached) png.data = read_file(cache_path, &png.size);
+    if (!png.data) {
+        gox_iter_infos(thumb->path, on_gox_info, &png);
+        if (png.data && cached)
+            save_to_cache(cache_path, png.data, png.size);
+    }
+    if (png.data) {
+        thumb->img = img_read_from_mem(png.data, png.size,
+                                       &thumb->w, &thumb->h, &thumb->bpp);
+        free(png.data);
+    }
+    __atomic_store_n(&thumb->done, 1, __ATOMIC_RELEASE);
+}
+
+texture_t *thumbnail_get(const char *path)
+{
+    thumbnail_t *thumb;
+
+    HASH_FIND_STR(g_thumbnails, path, thumb);
+    if (!thumb) {
+        thumb = calloc(1, sizeof(*thumb));
+        snprintf(thumb->path, sizeof(thumb->path), "%s", path);
+        HASH_ADD_STR(g_thumbnails, path, thumb);
+        // Only the gox files have a preview.
+        if (str_endswith(path, ".gox"))
+            jobs_async(thumbnail_load, thumb);
+        else
+            thumb->done = 1;
+    }
+    if (!__atomic_load_n(&thumb->done, __ATOMIC_ACQUIRE)) return NULL;
+    if (!thumb->img) return NULL;
+    if (!thumb->tex) {
+        thumb->tex = texture_new_from_buf(thumb->img, thumb->w, thumb->h,
+                                          thumb->bpp, 0);
+    }
+    return thumb->tex;
+}
+
+void thumbnail_invalidate(const char *path)
+{
+    thumbnail_t *thumb;
+
+    HASH_FIND_STR(g_thumbnails, path, thumb);
+    // If the preview is still loading we keep it, the next change of the
+    // file will fix it.
+    if (!thumb || !__atomic_load_n(&thumb->done, __ATOMIC_ACQUIRE)) return;
+    texture_delete(thumb->tex);
+    thumb->tex = NULL;
+    free(thumb->img);
+    thumb->img = NULL;
+    thumb->done = 0;
+    jobs_async(thumbnail_load, thumb);
+}
+
+void thumbnails_release_graphics(void)
+{
+    thumbnail_t *thumb, *tmp;
+    HASH_ITER(hh, g_thumbnails, thumb, tmp) {
+        texture_delete(thumb->tex);
+        thumb->tex = NULL;
+    }
+}
@@ -0,0 +1,53 @@
+/* Goxel 3D voxels editor
+ *
+ * copyright (c) 2026 Guillaume Chereau <guillaume@noctua-software.com>
+ *
+ * Goxel is free software: you can redistribute it and/or modify it under the
+ * terms of the GNU General Public License as published by the Free Software
+ * Foundation, either version 3 of the License, or (at your option) any later
+ * version.
+
+ * Goxel is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+
+ * You should have received a copy of the GNU General Public License along with
+ * goxel.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef THUMBNAILS_H
+#define THUMBNAILS_H
+
+#include "utils/texture.h"
+
+/*
+ * Function: thumbnail_get
+ * Get the preview image of a gox file, as a texture.
+ *
+ * The previews are read from the PREV chunk of the files in the
+ * background, and saved in the user directory, keyed by the file path,
+ * modification time and size, so that we don't have to open the files
+ * again the next time.
+ *
+ * Return:
+ *   The preview texture, or NULL if it is not loaded yet, or if the file
+ *   has no preview.
+ */
+texture_t *thumbnail_get(const char *path);
+
+/*
+ * Function: thumbnail_invalidate
+ * Load the preview of a file again, after the file got saved.
+ */
+void thumbnail_invalidate(const char *path);
+
+/*
+ * Function: thumbnails_release_graphics
+ * Delete the textures of the previews, called before the graphics context
+ * gets destroyed.  The images are kept, so the textures can be created
+ * again.
+ */
+void thumbnails_release_graphics(void);
+
+#endif // THUMBNAILS_H
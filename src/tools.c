@@ -27,6 +27,10 @@ static void a_tool_set(void *data)
         volume_delete(goxel.tool_volume);
         goxel.tool_volume = NULL;
     }
+    if (goxel.tool_moved_volume) {
+        volume_delete(goxel.tool_moved_volume);
+        goxel.tool_moved_volume = NULL;
+    }
     goxel.tool = tool;
 }
 
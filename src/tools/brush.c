@@ -18,6 +18,8 @@
 
 #include "goxel.h"
 
+#include <limits.h>
+
 
 typedef struct {
     tool_t tool;
@@ -103,6 +105,38 @@ static void get_box(const float p0[3], const float p1[3], const float n[3],
     mat4_copy(box, out);
 }
 
+// Add to an aabb the box of a volume_op call, including its symmetries.
+static void add_op_aabb(const painter_t *painter, const float box[4][4],
+                        int aabb[2][3])
+{
+    int i, box_aabb[2][3];
+    painter_t painter2;
+    float box2[4][4];
+    const float *sym_o = painter->symmetry_origin;
+
+    if (painter->symmetry) {
+        // Same as in volume_op.
+        painter2 = *painter;
+        for (i = 0; i < 3; i++) {
+            if (!(painter->symmetry & (1 << i))) continue;
+            painter2.symmetry &= ~(1 << i);
+            mat4_set_identity(box2);
+            mat4_itranslate(box2, +sym_o[0], +sym_o[1], +sym_o[2]);
+            if (i == 0) mat4_iscale(box2, -1,  1,  1);
+            if (i == 1) mat4_iscale(box2,  1, -1,  1);
+            if (i == 2) mat4_iscale(box2,  1,  1, -1);
+            mat4_itranslate(box2, -sym_o[0], -sym_o[1], -sym_o[2]);
+            mat4_imul(box2, box);
+            add_op_aabb(&painter2, box2, aabb);
+        }
+    }
+    box_get_aabb(box, box_aabb);
+    for (i = 0; i < 3; i++) {
+        aabb[0][i] = min(aabb[0][i], box_aabb[0][i] - 1);
+        aabb[1][i] = max(aabb[1][i], box_aabb[1][i] + 1);
+    }
+}
+
 static int on_drag(gesture3d_t *gest)
 {
     tool_brush_t *brush = USER_GET(gest->user, 0);
@@ -112,12 +146,18 @@ static int on_drag(gesture3d_t *gest)
     float r = goxel.tool_radius;
     int nb, i;
     float pos[3];
+    // Box of the tiles changed by this event.
+    int aabb[2][3] = {{INT_MAX, INT_MAX, INT_MAX},
+                      {INT_MIN, INT_MIN, INT_MIN}};
 
     if (gest->state == GESTURE3D_STATE_BEGIN) {
         volume_set(brush->volume_orig, goxel.image->active_layer->volume);
         brush->last_op.mode = 0; // Discard last op.
         vec3_copy(gest->pos, brush->last_pos);
         volume_clear(brush->volume);
+        // Discard the hover preview.
+        if (!goxel.tool_volume) goxel.tool_volume = volume_new();
+        volume_set(goxel.tool_volume, brush->volume_orig);
 
         if (shift) {
             painter.shape = &shape_cylinder;
@@ -125,6 +165,7 @@ static int on_drag(gesture3d_t *gest)
             vec4_set(painter.color, 255, 255, 255, 255);
             get_box(brush->start_pos, gest->pos, gest->normal, r, NULL, box);
             volume_op(brush->volume, &painter, box);
+            add_op_aabb(&painter, box, aabb);
         }
     }
 
@@ -137,20 +178,42 @@ static int on_drag(gesture3d_t *gest)
     painter.mode = MODE_MAX;
     vec4_set(painter.color, 255, 255, 255, 255);
 
-    // Render several times if the space between the current pos
-    // and the last pos is larger than the size of the tool shape.
-    nb = ceil(vec3_dist(gest->pos, brush->last_pos) / (2 * r));
-    nb = max(nb, 1);
+    // With a sphere, paint the whole segment between the last pos and the
+    // current pos at once, with a capsule shape.
+    if (    painter.shape == &shape_sphere &&
+            vec3_dist(gest->pos, brush->last_pos) > 0) {
+        get_box(brush->last_pos, gest->pos, gest->normal, r, NULL, box);
+        // The capsule ends extend beyond the segment by the radius.
+        vec3_normalize(box[2], pos);
+        vec3_addk(box[2], pos, r, box[2]);
+        painter.shape = &shape_capsule;
+        volume_op(brush->volume, &painter, box);
+        add_op_aabb(&painter, box, aabb);
+        nb = 0;
+    } else {
+        // Render several times if the space between the current pos
+        // and the last pos is larger than the size of the tool shape.
+        nb = ceil(vec3_dist(gest->pos, brush->last_pos) / (2 * r));
+        nb = max(nb, 1);
+    }
     for (i = 0; i < nb; i++) {
         vec3_mix(brush->last_pos, gest->pos, (i + 1.0) / nb, pos);
         get_box(pos, NULL, gest->normal, r, NULL, box);
         volume_op(brush->volume, &painter, box);
+        add_op_aabb(&painter, box, aabb);
     }
 
+    // Only update the preview tiles that the new operations touched, so
+    // that the cost doesn't grow with the length of the stroke.
     painter = *(painter_t*)USER_GET(gest->user, 1);
-    if (!goxel.tool_volume) goxel.tool_volume = volume_new();
-    volume_set(goxel.tool_volume, brush->volume_orig);
-    volume_merge(goxel.tool_volume, brush->volume, painter.mode, painter.color);
+    if (!goxel.tool_volume) {
+        goxel.tool_volume = volume_copy(brush->volume_orig);
+        volume_merge(goxel.tool_volume, brush->volume, painter.mode,
+                     painter.color);
+    } else {
+        volume_merge_aabb(goxel.tool_volume, brush->volume_orig,
+                          brush->volume, aabb, painter.mode, painter.color);
+    }
     vec3_copy(gest->pos, brush->start_pos);
     brush->last_op.volume_key = volume_get_key(goxel.tool_volume);
 
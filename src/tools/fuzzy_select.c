@@ -22,6 +22,12 @@ typedef struct {
     tool_t tool;
     int mode; // MODE_REPLACE, MODE_OVER, MODE_SUB
     int threshold;
+
+    // The flood fill tests the six neighbors of a voxel one after the
+    // other, so we keep the color of the last base voxel.
+    bool    has_base;
+    int     base_pos[3];
+    uint8_t base_color[4];
 } tool_fuzzy_select_t;
 
 static int select_cond(void *user, const volume_t *volume,
@@ -30,10 +36,20 @@ static int select_cond(void *user, const volume_t *volume,
                        volume_accessor_t *volume_accessor)
 {
     tool_fuzzy_select_t *tool = (void*)user;
-    uint8_t v0[4], v1[4];
+    const uint8_t *v0 = tool->base_color;
+    uint8_t v1[4];
     int d;
 
-    volume_get_at(volume, volume_accessor, base_pos, v0);
+    // volume_select only gives us the positions of existing voxels, so
+    // without the colors condition we don't need to read them at all.
+    if (tool->threshold >= 255) return 255;
+
+    if (!tool->has_base || memcmp(tool->base_pos, base_pos,
+                                  sizeof(tool->base_pos)) != 0) {
+        volume_get_at(volume, volume_accessor, base_pos, tool->base_color);
+        memcpy(tool->base_pos, base_pos, sizeof(tool->base_pos));
+        tool->has_base = true;
+    }
     volume_get_at(volume, volume_accessor, new_pos, v1);
     if (!v0[3] || !v1[3]) return 0;
 
@@ -59,6 +75,7 @@ static int on_click(gesture3d_t *gest)
     pi[1] = floor(gest->pos[1]);
     pi[2] = floor(gest->pos[2]);
     sel = volume_new();
+    tool->has_base = false;
     volume_select(volume, pi, select_cond, tool, sel);
     if (img->selection_mask == NULL) img->selection_mask = volume_new();
     volume_merge(img->selection_mask, sel, mode, NULL);
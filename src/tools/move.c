@@ -93,6 +93,28 @@ static void normalize_box(const float box[4][4], float out[4][4])
     bbox_from_npoints(out, 8, vertices);
 }
 
+/*
+ * During a drag we only render the moved voxels with the gizmo transformation
+ * as model matrix, on top of the voxels that stay in place.  The voxels are
+ * actually moved once, when the drag ends.
+ */
+static void preview_begin(const volume_t *fixed, const volume_t *moved)
+{
+    assert(!goxel.tool_moved_volume);
+    if (goxel.tool_volume) volume_delete(goxel.tool_volume);
+    goxel.tool_volume = fixed ? volume_copy(fixed) : volume_new();
+    goxel.tool_moved_volume = volume_copy(moved);
+    mat4_set_identity(goxel.tool_moved_mat);
+}
+
+static void preview_end(void)
+{
+    volume_delete(goxel.tool_volume);
+    volume_delete(goxel.tool_moved_volume);
+    goxel.tool_volume = NULL;
+    goxel.tool_moved_volume = NULL;
+}
+
 static int iter_selection(tool_move_t *tool, const painter_t *painter,
                           const float viewport[4])
 {
@@ -119,17 +141,20 @@ static int iter_selection(tool_move_t *tool, const painter_t *painter,
         volume_merge(tool->start_volume, mask, MODE_SUB, NULL);
         tool->start_selection = volume_copy(layer->volume);
         volume_merge(tool->start_selection, mask, MODE_INTERSECT, NULL);
+        preview_begin(tool->start_volume, tool->start_selection);
     }
 
     mat4_mul(transf, tool->box, tool->box);
     get_transf(tool->start_box, tool->box, transf_tot);
-    tmp = volume_copy(tool->start_selection);
-    volume_move(tmp, transf_tot);
-    volume_set(layer->volume, tool->start_volume);
-    volume_merge(layer->volume, tmp, MODE_OVER, NULL);
-    volume_delete(tmp);
+    mat4_copy(transf_tot, goxel.tool_moved_mat);
 
     if (box_edit_state == GESTURE3D_STATE_END) {
+        preview_end();
+        tmp = volume_copy(tool->start_selection);
+        volume_move(tmp, transf_tot);
+        volume_set(layer->volume, tool->start_volume);
+        volume_merge(layer->volume, tmp, MODE_OVER, NULL);
+        volume_delete(tmp);
         volume_delete(tool->start_volume);
         volume_delete(tool->start_selection);
         tool->start_volume = NULL;
@@ -179,25 +204,49 @@ static int iter_volume_layer(
         tool_move_t *tool, const painter_t *painter, const float viewport[4])
 {
     float transf[4][4];
+    float transf_tot[4][4];
     float origin_box[4][4] = MAT4_IDENTITY;
-    float box[4][4];
     int box_edit_state;
     image_t *img = goxel.image;
     layer_t *layer = img->active_layer;
+    const bool dragging = goxel.tool_moved_volume != NULL;
 
-    volume_get_box(goxel.image->active_layer->volume, true, box);
+    // While dragging the box follows the gizmo, since the voxels only get
+    // moved at the end.
+    if (!dragging)
+        volume_get_box(layer->volume, true, tool->box);
 
-    box_edit_state = box_edit(box, GIZMO_TRANSLATION, transf);
-    if (box_edit_state) {
+    box_edit_state = box_edit(tool->box, GIZMO_TRANSLATION, transf);
+    if (box_edit_state && !layer_is_volume(layer)) {
         move(layer, transf);
         if (box_edit_state == GESTURE3D_STATE_END) {
             image_history_push(goxel.image);
         }
+        return 0;
+    }
+
+    if (box_edit_state == GESTURE3D_STATE_BEGIN) {
+        mat4_copy(tool->box, tool->start_box);
+        preview_begin(NULL, layer->volume);
+    }
+
+    if (box_edit_state) {
+        mat4_mul(transf, tool->box, tool->box);
+        get_transf(tool->start_box, tool->box, transf_tot);
+        mat4_copy(transf_tot, goxel.tool_moved_mat);
+    }
+
+    if (box_edit_state == GESTURE3D_STATE_END) {
+        preview_end();
+        move(layer, transf_tot);
+        image_history_push(goxel.image);
     }
 
     // Render the origin point.
     if (layer_is_volume(layer)) {
         vec3_copy(layer->mat[3], origin_box[3]);
+        if (goxel.tool_moved_volume)
+            vec3_iadd(origin_box[3], goxel.tool_moved_mat[3]);
         mat4_iscale(origin_box, 0.1, 0.1, 0.1);
         render_box(&goxel.rend, origin_box, ORIGIN_COLOR,
                    EFFECT_NO_DEPTH_TEST | EFFECT_NO_SHADING);
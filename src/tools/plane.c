@@ -49,31 +49,89 @@ static int iter(tool_t *tool, const painter_t *painter,
     return 0;
 }
 
+// Voxels closer than that to the plane are considered on the plane, and
+// are kept, so that the rounding errors don't make a noisy cut.
+#define CUT_EPSILON 1e-4
+
+typedef struct {
+    float origin[3];
+    float normal[3]; // Pointing toward the side to remove.
+} cut_ctx_t;
+
+static float cut_dist(const cut_ctx_t *ctx, float x, float y, float z)
+{
+    return (x - ctx->origin[0]) * ctx->normal[0] +
+           (y - ctx->origin[1]) * ctx->normal[1] +
+           (z - ctx->origin[2]) * ctx->normal[2];
+}
+
+// Called in parallel for the tiles that straddle the plane.
+static bool cut_tile(void *user, const int pos[3], uint8_t (*voxels)[4])
+{
+    const cut_ctx_t *ctx = user;
+    int x, y, z, i;
+    float d0;
+    bool changed = false;
+
+    for (i = 0, z = 0; z < TILE_SIZE; z++)
+    for (y = 0; y < TILE_SIZE; y++) {
+        // The distance is linear along the row.
+        d0 = cut_dist(ctx, pos[0] + 0.5, pos[1] + y + 0.5, pos[2] + z + 0.5);
+        for (x = 0; x < TILE_SIZE; x++, i++) {
+            if (d0 + x * ctx->normal[0] > CUT_EPSILON && voxels[i][3]) {
+                memset(voxels[i], 0, 4);
+                changed = true;
+            }
+        }
+    }
+    return changed;
+}
+
 /*
- * Algo provided by sariug <ugurcansari93@gmail.com>
- * Note: we could probably make it much faster by checking the volume blocks
- * first instead of the voxels.
+ * Remove all the voxels on one side of the plane.
+ *
+ * The tiles are first classified with the distance of their extreme voxels
+ * centers to the plane, so that only the tiles that straddle the plane are
+ * tested voxel by voxel.
  */
 static void cut(bool above)
 {
-    const uint8_t color[4] = {0, 0, 0, 0};
-    int vp[3];
-    float p[3], p_vec[3], d;
+    int i, vp[3], nb = 0, size = 0, (*tiles)[3] = NULL;
+    float d, dmin, dmax;
     volume_t *volume = goxel.image->active_layer->volume;
     volume_iterator_t iter;
-    volume_accessor_t accessor;
+    cut_ctx_t ctx;
+
+    vec3_copy(goxel.plane[3], ctx.origin);
+    vec3_normalize(goxel.plane[2], ctx.normal);
+    vec3_imul(ctx.normal, above ? +1 : -1);
 
     iter = volume_get_iterator(volume,
-            VOLUME_ITER_VOXELS | VOLUME_ITER_SKIP_EMPTY);
-    accessor = volume_get_accessor(volume);
+            VOLUME_ITER_TILES | VOLUME_ITER_SKIP_EMPTY);
     while (volume_iter(&iter, vp)) {
-        vec3_set(p, vp[0] + 0.5, vp[1] + 0.5, vp[2] + 0.5);
-        vec3_sub(p, goxel.plane[3], p_vec);
-        vec3_normalize(p_vec, p_vec);
-        d = vec3_dot(p_vec, goxel.plane[2]) * (above ? +1 : -1);
-        if (d > 0)
-            volume_set_at(volume, &accessor, vp, color);
+        dmin = +INFINITY;
+        dmax = -INFINITY;
+        for (i = 0; i < 8; i++) {
+            d = cut_dist(&ctx,
+                    vp[0] + ((i & 1) ? TILE_SIZE - 0.5 : 0.5),
+                    vp[1] + ((i & 2) ? TILE_SIZE - 0.5 : 0.5),
+                    vp[2] + ((i & 4) ? TILE_SIZE - 0.5 : 0.5));
+            dmin = min(dmin, d);
+            dmax = max(dmax, d);
+        }
+        if (dmax <= CUT_EPSILON) continue;
+        if (dmin > CUT_EPSILON) {
+            volume_clear_tile(volume, &iter, vp);
+            continue;
+        }
+        if (nb >= size) {
+            size = max(64, size * 2);
+            tiles = realloc(tiles, size * sizeof(*tiles));
+        }
+        memcpy(tiles[nb++], vp, sizeof(vp));
     }
+    volume_apply_tiles(volume, nb, (const int (*)[3])tiles, cut_tile, &ctx);
+    free(tiles);
     image_history_push(goxel.image);
 }
 
@@ -6,52 +6,146 @@
 
 #include "goxel.h"
 
+#define TILE_NB_VOXELS (TILE_SIZE * TILE_SIZE * TILE_SIZE)
+
 typedef struct {
     tool_t tool;
     int mode; // MODE_REPLACE, MODE_OVER, MODE_SUB
+    bool visible_only;
     float rect[4];
+    float viewport[4];
 } tool_rect_select_t;
 
-static void apply(const float rect_[4], int mode)
-{
-    int vp[3];
-    float p[4], rect[4];
-    uint8_t value[4];
-    uint8_t color[4] = {255, 255, 255, 255};
+typedef struct {
+    const volume_t *volume;
     float view_proj_mat[4][4];
+    float rect[4];
+    bool accept_all;
+    uint8_t color[4];
+} apply_ctx_t;
+
+enum {
+    TILE_OUTSIDE,
+    TILE_INSIDE,
+    TILE_BOUNDARY,
+};
+
+// Test the projection of a tile bounding box against the rectangle.
+static int classify_tile(const apply_ctx_t *ctx, const int pos[3])
+{
+    int i;
+    float p[4], bbox[4] = {INFINITY, INFINITY, -INFINITY, -INFINITY};
+
+    for (i = 0; i < 8; i++) {
+        vec4_set(p, pos[0] + ((i >> 0) & 1) * TILE_SIZE,
+                    pos[1] + ((i >> 1) & 1) * TILE_SIZE,
+                    pos[2] + ((i >> 2) & 1) * TILE_SIZE, 1.0);
+        mat4_mul_vec4(ctx->view_proj_mat, p, p);
+        // Corner behind the camera: we can't bound the projection.
+        if (p[3] <= 0) return TILE_BOUNDARY;
+        bbox[0] = min(bbox[0], p[0] / p[3]);
+        bbox[1] = min(bbox[1], p[1] / p[3]);
+        bbox[2] = max(bbox[2], p[0] / p[3]);
+        bbox[3] = max(bbox[3], p[1] / p[3]);
+    }
+    if (    bbox[2] < ctx->rect[0] || bbox[0] > ctx->rect[2] ||
+            bbox[3] < ctx->rect[1] || bbox[1] > ctx->rect[3])
+        return TILE_OUTSIDE;
+    if (    bbox[0] >= ctx->rect[0] && bbox[2] <= ctx->rect[2] &&
+            bbox[1] >= ctx->rect[1] && bbox[3] <= ctx->rect[3])
+        return TILE_INSIDE;
+    return TILE_BOUNDARY;
+}
+
+// Called in parallel for each tile of the selection mask to update.
+static bool apply_tile(void *user, const int pos[3], uint8_t (*voxels)[4])
+{
+    const apply_ctx_t *ctx = user;
+    int x, y, z, i, type;
+    float p[4];
+    bool changed = false;
+    uint8_t (*src)[4];
+
+    type = ctx->accept_all ? TILE_INSIDE : classify_tile(ctx, pos);
+    if (type == TILE_OUTSIDE) return false;
+
+    // The voxels given by volume_apply_tiles are in the scratch buffer.
+    src = malloc(TILE_NB_VOXELS * 4);
+    volume_get_tile_voxels(ctx->volume, NULL, pos, src);
+
+    for (i = 0, z = 0; z < TILE_SIZE; z++)
+    for (y = 0; y < TILE_SIZE; y++)
+    for (x = 0; x < TILE_SIZE; x++, i++) {
+        if (src[i][3] == 0) continue;
+        if (type == TILE_BOUNDARY) {
+            vec4_set(p, pos[0] + x + 0.5, pos[1] + y + 0.5,
+                        pos[2] + z + 0.5, 1.0);
+            mat4_mul_vec4(ctx->view_proj_mat, p, p);
+            if (p[3] <= 0) continue;
+            vec3_mul(p, 1 / p[3], p);
+            if (    p[0] < ctx->rect[0] || p[0] > ctx->rect[2] ||
+                    p[1] < ctx->rect[1] || p[1] > ctx->rect[3])
+                continue;
+        }
+        if (memcmp(voxels[i], ctx->color, 4) == 0) continue;
+        memcpy(voxels[i], ctx->color, 4);
+        changed = true;
+    }
+    free(src);
+    return changed;
+}
+
+static void apply(const float rect_[4], int mode, bool visible_only,
+                  const float viewport[4])
+{
+    int nb = 0, capacity = 0, tile_pos[3];
+    int (*tiles)[3] = NULL;
     image_t *img = goxel.image;
     volume_t *volume = img->active_layer->volume;
+    volume_t *visible = NULL;
     volume_iterator_t iter;
     const camera_t *cam = img->active_camera;
+    apply_ctx_t ctx = {
+        .volume = volume,
+        .color = {255, 255, 255, 255},
+    };
 
-    rect[0] = min(rect_[0], rect_[2]);
-    rect[1] = min(rect_[1], rect_[3]);
-    rect[2] = max(rect_[0], rect_[2]);
-    rect[3] = max(rect_[1], rect_[3]);
+    ctx.rect[0] = min(rect_[0], rect_[2]);
+    ctx.rect[1] = min(rect_[1], rect_[3]);
+    ctx.rect[2] = max(rect_[0], rect_[2]);
+    ctx.rect[3] = max(rect_[1], rect_[3]);
 
-    mat4_mul(cam->proj_mat, cam->view_mat, view_proj_mat);
+    mat4_mul(cam->proj_mat, cam->view_mat, ctx.view_proj_mat);
     if (img->selection_mask == NULL) img->selection_mask = volume_new();
     if (mode == MODE_SUB)
-        memset(color, 0, sizeof(color));
+        memset(ctx.color, 0, sizeof(ctx.color));
 
     if (mode == MODE_REPLACE)
         volume_clear(img->selection_mask);
 
-    // XXX: very slow implementation!
-
-    iter = volume_get_iterator(volume,
-            VOLUME_ITER_VOXELS | VOLUME_ITER_SKIP_EMPTY);
-    while (volume_iter(&iter, vp)) {
-        volume_get_at(volume, &iter, vp, value);
-        if (value[3] == 0) continue;
-        vec4_set(p, vp[0] + 0.5, vp[1] + 0.5, vp[2] + 0.5, 1.0);
-        mat4_mul_vec4(view_proj_mat, p, p);
-        vec3_mul(p, 1 / p[3], p);
-        if (    p[0] < rect[0] || p[0] > rect[2] ||
-                p[1] < rect[1] || p[1] > rect[3])
-            continue;
-        volume_set_at(img->selection_mask, NULL, vp, color);
+    // With visible only, we only keep the voxels seen by the pixels of the
+    // rectangle in the pick buffer.
+    if (visible_only) {
+        visible = volume_new();
+        goxel_get_visible_voxels(viewport, ctx.rect, volume, visible);
+        ctx.volume = visible;
+        ctx.accept_all = true;
+    }
+
+    iter = volume_get_iterator(ctx.volume,
+            VOLUME_ITER_TILES | VOLUME_ITER_SKIP_EMPTY);
+    while (volume_iter(&iter, tile_pos)) {
+        if (nb >= capacity) {
+            capacity = max(capacity * 2, 64);
+            tiles = realloc(tiles, capacity * sizeof(*tiles));
+        }
+        memcpy(tiles[nb++], tile_pos, sizeof(tile_pos));
     }
+
+    volume_apply_tiles(img->selection_mask, nb, (const int (*)[3])tiles,
+                       apply_tile, &ctx);
+    free(tiles);
+    if (visible) volume_delete(visible);
 }
 
 static const char *hint_for_mode(int mode)
@@ -89,7 +183,7 @@ static int on_drag(gesture3d_t *gest)
     vec2_copy(pos, &tool->rect[2]);
 
     if (gest->state == GESTURE3D_STATE_END) {
-        apply(tool->rect, mode);
+        apply(tool->rect, mode, tool->visible_only, tool->viewport);
         vec4_set(tool->rect, 0, 0, 0, 0);
     }
 
@@ -108,6 +202,7 @@ static int iter(tool_t *tool_, const painter_t *painter,
     float plane[4][4], w, h, center[2];
     tool_rect_select_t *tool = (tool_rect_select_t*)tool_;
 
+    vec4_copy(viewport, tool->viewport);
     goxel_gesture3d(&(gesture3d_t) {
         .type = GESTURE3D_TYPE_DRAG,
         .snap_mask = SNAP_CAMERA,
@@ -138,6 +233,8 @@ static int gui(tool_t *tool_)
 {
     tool_rect_select_t *tool = (void*)tool_;
     tool_gui_mask_mode(&tool->mode);
+    gui_checkbox(_("Visible only"), &tool->visible_only,
+                 _("Only select the voxels visible from the camera"));
     return 0;
 }
 
@@ -0,0 +1,118 @@
+/* Goxel 3D voxels editor
+ *
+ * copyright (c) 2024 Guillaume Chereau <guillaume@noctua-software.com>
+ *
+ * Goxel is free software: you can redistribute it and/or modify it under the
+ * terms of the GNU General Public License as published by the Free Software
+ * Foundation, either version 3 of the License, or (at your option) any later
+ * version.
+
+ * Goxel is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+
+ * You should have received a copy of the GNU General Public License along with
+ * goxel.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "arena.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#define FRAME_CHUNK_SIZE (64 * 1024)
+
+typedef struct chunk chunk_t;
+struct chunk {
+    chunk_t *next;
+    size_t  size;
+    size_t  used;
+    long double data[]; // Keeps the allocations properly aligned.
+};
+
+struct arena {
+    const char  *name; // For debugging only.
+    size_t      chunk_size;
+    chunk_t     *chunks; // The current chunk is the first one.
+    size_t      total; // Sum of the sizes of all the chunks.
+};
+
+// One per thread, so that the render thread has its own.
+static __thread arena_t *g_frame_arena = NULL;
+
+arena_t *arena_create(const char *name, size_t chunk_size)
+{
+    arena_t *arena = calloc(1, sizeof(*arena));
+    arena->name = name;
+    arena->chunk_size = chunk_size;
+    return arena;
+}
+
+static void free_chunks(arena_t *arena)
+{
+    chunk_t *chunk;
+    while ((chunk = arena->chunks)) {
+        arena->chunks = chunk->next;
+        free(chunk);
+    }
+    arena->total = 0;
+}
+
+void arena_delete(arena_t *arena)
+{
+    if (!arena) return;
+    free_chunks(arena);
+    free(arena);
+}
+
+static chunk_t *add_chunk(arena_t *arena, size_t size)
+{
+    chunk_t *chunk;
+    size = size > arena->chunk_size ? size : arena->chunk_size;
+    chunk = malloc(sizeof(*chunk) + size);
+    chunk->size = size;
+    chunk->used = 0;
+    chunk->next = arena->chunks;
+    arena->chunks = chunk;
+    arena->total += size;
+    return chunk;
+}
+
+void *arena_alloc(arena_t *arena, size_t size)
+{
+    const size_t align = sizeof(long double);
+    chunk_t *chunk = arena->chunks;
+    void *ret;
+
+    size = (size + align - 1) / align * align;
+    if (!chunk || chunk->used + size > chunk->size)
+        chunk = add_chunk(arena, size);
+    ret = (char*)chunk->data + chunk->used;
+    chunk->used += size;
+    memset(ret, 0, size);
+    return ret;
+}
+
+void arena_reset(arena_t *arena)
+{
+    size_t total = arena->total;
+    if (!arena->chunks) return;
+    if (arena->chunks->next) {
+        free_chunks(arena);
+        add_chunk(arena, total);
+    }
+    arena->chunks->used = 0;
+}
+
+void *frame_alloc(size_t size)
+{
+    if (!g_frame_arena)
+        g_frame_arena = arena_create("frame", FRAME_CHUNK_SIZE);
+    return arena_alloc(g_frame_arena, size);
+}
+
+void frame_reset(void)
+{
+    if (g_frame_arena) arena_reset(g_frame_arena);
+}
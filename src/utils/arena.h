@@ -0,0 +1,80 @@
+/* Goxel 3D voxels editor
+ *
+ * copyright (c) 2024 Guillaume Chereau <guillaume@noctua-software.com>
+ *
+ * Goxel is free software: you can redistribute it and/or modify it under the
+ * terms of the GNU General Public License as published by the Free Software
+ * Foundation, either version 3 of the License, or (at your option) any later
+ * version.
+
+ * Goxel is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+
+ * You should have received a copy of the GNU General Public License along with
+ * goxel.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <stddef.h>
+
+// Bump pointer allocator.
+//
+// The allocations are taken from big chunks of memory and cannot be freed
+// individually: they are all released at once by arena_reset.  When an
+// arena needed several chunks, the reset replaces them with a single one
+// large enough for all of them, so that after a few resets all the
+// allocations come from the same chunk.
+//
+// The arenas are not thread safe.
+
+typedef struct arena arena_t;
+
+/*
+ * Function: arena_create
+ * Create a new arena.
+ *
+ * Parameters:
+ *   name       - A global static string used for debugging only.
+ *   chunk_size - Initial size of the chunks.
+ */
+arena_t *arena_create(const char *name, size_t chunk_size);
+
+/*
+ * Function: arena_delete
+ * Delete an arena and all its allocations.
+ */
+void arena_delete(arena_t *arena);
+
+/*
+ * Function: arena_alloc
+ * Allocate memory from an arena.  The memory is set to zero.
+ */
+void *arena_alloc(arena_t *arena, size_t size);
+
+/*
+ * Function: arena_reset
+ * Release all the allocations of an arena.
+ */
+void arena_reset(arena_t *arena);
+
+/*
+ * Function: frame_alloc
+ * Allocate transient memory from the frame arena of the current thread.
+ *
+ * The memory is set to zero, and stays valid until the next call to
+ * <frame_reset> from the same thread, done by goxel at the end of each
+ * frame, and by the render thread after each render.
+ */
+void *frame_alloc(size_t size);
+
+/*
+ * Function: frame_reset
+ * Release all the allocations of the frame arena of the current thread.
+ */
+void frame_reset(void);
+
+#endif // ARENA_H
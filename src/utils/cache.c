@@ -18,87 +18,306 @@
 
 #include "cache.h"
 #include "uthash.h"
+#include "utlist.h"
 
 #include <assert.h>
+#include <pthread.h>
+#include <stdbool.h>
 #include <stdint.h>
 
+// Number of shards of the concurrent caches.
+#define NB_SHARDS 16
+
+// The items are kept in a list sorted from the least recently used to the
+// most recently used, so that we can evict them in order.
+//
+// In the concurrent caches the items are reference counted: the cache
+// holds one reference as long as the item is in it, and cache_acquire adds
+// one.  The item is deleted when the last reference is released.
 typedef struct item item_t;
 struct item {
     UT_hash_handle  hh;
-    char            key[256];
+    item_t          *prev, *next;
     void            *data;
-    int             cost;
-    uint64_t        last_used;
+    int64_t         cost;
     int             (*delfunc)(void *data);
+    int             ref;
+    int             keylen;
+    char            key[];
 };
 
+// A part of the items of a cache, with its own lock.  The plain caches
+// have a single shard, and don't use the lock.
+typedef struct {
+    pthread_mutex_t mutex;
+    item_t *items;  // Hash table.
+    item_t *lru;    // List of all the items, least recently used first.
+    int64_t size;
+    int64_t max_size;
+    int64_t hits;
+    int64_t misses;
+    int64_t evictions;
+    int nb_items;
+} shard_t;
+
 struct cache {
-    item_t *items;
-    uint64_t clock;
-    int size;
-    int max_size;
+    cache_t *next;  // All the caches, for the stats.
     const char *name; // For debuging only.
+    int flags;
+    int64_t max_size;
+    int nb_shards;
+    shard_t *shards;
+
+    // Unreferenced items waiting to be deleted by cache_collect.
+    pthread_mutex_t pending_mutex;
+    item_t *pending;
+
+    // Counters at the last rebalance of the governor.
+    struct {
+        int64_t hits;
+        int64_t misses;
+        int64_t evictions;
+    } last;
 };
 
-cache_t *cache_create(const char *name, int size)
+static cache_t *g_caches = NULL;
+
+// Total budget of the governed caches.
+static int64_t g_budget = 256 * (1 << 20);
+
+// Minimum number of lookups between two rebalances.
+#define REBALANCE_LOOKUPS 1024
+
+static void shard_lock(const cache_t *cache, shard_t *shard)
 {
-    cache_t *cache = calloc(1, sizeof(*cache));
+    if (cache->flags & CACHE_CONCURRENT) pthread_mutex_lock(&shard->mutex);
+}
+
+static void shard_unlock(const cache_t *cache, shard_t *shard)
+{
+    if (cache->flags & CACHE_CONCURRENT) pthread_mutex_unlock(&shard->mutex);
+}
+
+static shard_t *get_shard(const cache_t *cache, const void *key, int len)
+{
+    unsigned hashv;
+    if (cache->nb_shards == 1) return &cache->shards[0];
+    // uthash uses the low bits for the buckets, so use the high ones.
+    HASH_VALUE(key, len, hashv);
+    return &cache->shards[(hashv >> 24) % cache->nb_shards];
+}
+
+static void item_destroy(cache_t *cache, item_t *item)
+{
+    if (cache->flags & CACHE_DEFER_DELETE) {
+        pthread_mutex_lock(&cache->pending_mutex);
+        LL_PREPEND(cache->pending, item);
+        pthread_mutex_unlock(&cache->pending_mutex);
+        return;
+    }
+    item->delfunc(item->data);
+    free(item);
+}
+
+static void item_unref(cache_t *cache, item_t *item)
+{
+    if (__atomic_sub_fetch(&item->ref, 1, __ATOMIC_ACQ_REL) > 0) return;
+    item_destroy(cache, item);
+}
+
+// Remove an item from its shard, and release the cache reference to it.
+// Must be called with the shard locked.
+static void item_remove(cache_t *cache, shard_t *shard, item_t *item)
+{
+    HASH_DEL(shard->items, item);
+    DL_DELETE(shard->lru, item);
+    shard->size -= item->cost;
+    shard->nb_items--;
+    item_unref(cache, item);
+}
+
+static void cleanup(cache_t *cache, shard_t *shard)
+{
+    while (shard->size >= shard->max_size) {
+        assert(shard->lru);
+        item_remove(cache, shard, shard->lru);
+        shard->evictions++;
+    }
+}
+
+static void set_max_size(cache_t *cache, int64_t size)
+{
+    int i;
+    shard_t *shard;
+
     cache->max_size = size;
+    for (i = 0; i < cache->nb_shards; i++) {
+        shard = &cache->shards[i];
+        shard_lock(cache, shard);
+        shard->max_size = size / cache->nb_shards;
+        if (shard->size >= shard->max_size) cleanup(cache, shard);
+        shard_unlock(cache, shard);
+    }
+}
+
+static int get_nb_governed(void)
+{
+    const cache_t *cache;
+    int nb = 0;
+    LL_FOREACH(g_caches, cache) nb += (cache->flags & CACHE_GOVERNED) ? 1 : 0;
+    return nb;
+}
+
+// Scale the size of all the governed caches.
+static void scale_governed(int64_t num, int64_t den)
+{
+    cache_t *cache;
+    if (den <= 0) return;
+    LL_FOREACH(g_caches, cache) {
+        if (!(cache->flags & CACHE_GOVERNED)) continue;
+        set_max_size(cache, cache->max_size * num / den);
+    }
+}
+
+cache_t *cache_create_with_flags(const char *name, int64_t size, int flags)
+{
+    int i, nb;
+    cache_t *cache = calloc(1, sizeof(*cache));
+
     cache->name = name;
+    cache->flags = flags;
+    cache->nb_shards = (flags & CACHE_CONCURRENT) ? NB_SHARDS : 1;
+    cache->shards = calloc(cache->nb_shards, sizeof(*cache->shards));
+    for (i = 0; i < cache->nb_shards; i++)
+        pthread_mutex_init(&cache->shards[i].mutex, NULL);
+    pthread_mutex_init(&cache->pending_mutex, NULL);
+
+    // The governed caches start with an equal share of the budget.
+    if (flags & CACHE_GOVERNED) {
+        nb = get_nb_governed();
+        scale_governed(nb, nb + 1);
+        size = g_budget / (nb + 1);
+    }
+    set_max_size(cache, size);
+    LL_APPEND(g_caches, cache);
     return cache;
 }
 
-static void cleanup(cache_t *cache)
+cache_t *cache_create(const char *name, int64_t size)
 {
-    item_t *item;
-    while (cache->size >= cache->max_size) {
-        assert(cache->items);
-        item = cache->items;
-        HASH_DEL(cache->items, item);
-        assert(item != cache->items);
-        item->delfunc(item->data);
-        cache->size -= item->cost;
-        free(item);
-    }
+    return cache_create_with_flags(name, size, 0);
+}
+
+cache_t *cache_create_governed(const char *name)
+{
+    return cache_create_with_flags(name, 0, CACHE_GOVERNED);
 }
 
 void cache_add(cache_t *cache, const void *key, int len, void *data,
-               int cost, int (*delfunc)(void *data))
+               int64_t cost, int (*delfunc)(void *data))
 {
-    item_t *item = calloc(1, sizeof(*item));
-    assert(len <= sizeof(item->key));
+    item_t *item, *other;
+    shard_t *shard = get_shard(cache, key, len);
+
+    item = calloc(1, sizeof(*item) + len);
     memcpy(item->key, key, len);
+    item->keylen = len;
     item->data = data;
     item->cost = cost;
-    item->last_used = cache->clock++;
     item->delfunc = delfunc;
-    HASH_ADD(hh, cache->items, key, len, item);
-    cache->size += cost;
-    if (cache->size >= cache->max_size) cleanup(cache);
+    item->ref = 1;
+
+    shard_lock(cache, shard);
+    // Don't flush the whole cache for an item that doesn't fit anyway.
+    if (cost >= shard->max_size) {
+        shard_unlock(cache, shard);
+        item_unref(cache, item);
+        return;
+    }
+    // An other thread might have added the same key in the meantime.
+    HASH_FIND(hh, shard->items, key, len, other);
+    if (other) item_remove(cache, shard, other);
+    HASH_ADD_KEYPTR(hh, shard->items, item->key, len, item);
+    DL_APPEND(shard->lru, item);
+    shard->size += cost;
+    shard->nb_items++;
+    if (shard->size >= shard->max_size) cleanup(cache, shard);
+    shard_unlock(cache, shard);
+}
+
+// Find an item and move it at the end of the lru list.
+// Must be called with the shard locked.
+static item_t *find(shard_t *shard, const void *key, int keylen)
+{
+    item_t *item;
+    HASH_FIND(hh, shard->items, key, keylen, item);
+    if (!item) {
+        shard->misses++;
+        return NULL;
+    }
+    shard->hits++;
+    if (item->next) {
+        DL_DELETE(shard->lru, item);
+        DL_APPEND(shard->lru, item);
+    }
+    return item;
 }
 
 void *cache_get(cache_t *cache, const void *key, int keylen)
 {
     item_t *item;
-    HASH_FIND(hh, cache->items, key, keylen, item);
-    if (!item) return NULL;
-    item->last_used = cache->clock++;
-    // Reinsert item on top of the hash list so that it stays sorted.
-    HASH_DEL(cache->items, item);
-    HASH_ADD(hh, cache->items, key, keylen, item);
-    return item->data;
+    // The data could be deleted by an other thread as soon as we return.
+    assert(!(cache->flags & CACHE_CONCURRENT));
+    item = find(&cache->shards[0], key, keylen);
+    return item ? item->data : NULL;
 }
 
-void cache_clear(cache_t *cache)
+void *cache_acquire(cache_t *cache, const void *key, int keylen,
+                    cache_item_t **ref)
 {
     item_t *item;
-    while ((item = cache->items)) {
-        HASH_DEL(cache->items, item);
+    shard_t *shard = get_shard(cache, key, keylen);
+
+    shard_lock(cache, shard);
+    item = find(shard, key, keylen);
+    if (item) __atomic_add_fetch(&item->ref, 1, __ATOMIC_ACQ_REL);
+    shard_unlock(cache, shard);
+    *ref = (cache_item_t*)item;
+    return item ? item->data : NULL;
+}
+
+void cache_release(cache_t *cache, cache_item_t *ref)
+{
+    if (ref) item_unref(cache, (item_t*)ref);
+}
+
+void cache_collect(cache_t *cache)
+{
+    item_t *item, *pending;
+
+    pthread_mutex_lock(&cache->pending_mutex);
+    pending = cache->pending;
+    cache->pending = NULL;
+    pthread_mutex_unlock(&cache->pending_mutex);
+    while ((item = pending)) {
+        pending = item->next;
         item->delfunc(item->data);
-        cache->size -= item->cost;
         free(item);
     }
-    assert(cache->size == 0);
+}
+
+void cache_clear(cache_t *cache)
+{
+    int i;
+    shard_t *shard;
+
+    for (i = 0; i < cache->nb_shards; i++) {
+        shard = &cache->shards[i];
+        shard_lock(cache, shard);
+        while (shard->lru) item_remove(cache, shard, shard->lru);
+        assert(shard->size == 0);
+        shard_unlock(cache, shard);
+    }
 }
 
 /*
@@ -107,6 +326,105 @@ void cache_clear(cache_t *cache)
  */
 void cache_delete(cache_t *cache)
 {
+    int i;
+
     cache_clear(cache);
+    cache_collect(cache);
+    LL_DELETE(g_caches, cache);
+    for (i = 0; i < cache->nb_shards; i++)
+        pthread_mutex_destroy(&cache->shards[i].mutex);
+    pthread_mutex_destroy(&cache->pending_mutex);
+    free(cache->shards);
     free(cache);
 }
+
+void cache_governor_set_budget(int64_t size)
+{
+    scale_governed(size, g_budget);
+    g_budget = size;
+}
+
+int64_t cache_governor_get_budget(void)
+{
+    return g_budget;
+}
+
+/*
+ * Split the budget between the caches according to their recent activity.
+ *
+ * Each cache gets a minimum share, and the rest is split proportionally to
+ * the number of hits and evictions since the last rebalance: the hits tell
+ * that the cache is useful, the evictions that it is too small for its
+ * working set.  The sizes only move a quarter of the way to their target
+ * each time, to avoid oscillations.
+ */
+void cache_governor_update(void)
+{
+    cache_t *cache;
+    cache_stats_t stats;
+    int nb = 0;
+    int64_t lookups = 0, min_size, target;
+    double weight, total = 0;
+
+    LL_FOREACH(g_caches, cache) {
+        if (!(cache->flags & CACHE_GOVERNED)) continue;
+        cache_get_stats(cache, &stats);
+        nb++;
+        lookups += stats.hits - cache->last.hits;
+        lookups += stats.misses - cache->last.misses;
+        total += 1 + (stats.hits - cache->last.hits) +
+                     (stats.evictions - cache->last.evictions);
+    }
+    if (!nb || lookups < REBALANCE_LOOKUPS) return;
+
+    min_size = g_budget / (4 * nb);
+    LL_FOREACH(g_caches, cache) {
+        if (!(cache->flags & CACHE_GOVERNED)) continue;
+        cache_get_stats(cache, &stats);
+        weight = 1 + (stats.hits - cache->last.hits) +
+                     (stats.evictions - cache->last.evictions);
+        target = min_size + (g_budget - min_size * nb) * (weight / total);
+        cache->last.hits = stats.hits;
+        cache->last.misses = stats.misses;
+        cache->last.evictions = stats.evictions;
+        set_max_size(cache, (cache->max_size * 3 + target) / 4);
+    }
+}
+
+void cache_on_low_memory(void)
+{
+    cache_t *cache;
+    LL_FOREACH(g_caches, cache) cache_clear(cache);
+}
+
+void cache_get_stats(const cache_t *cache, cache_stats_t *stats)
+{
+    int i;
+    shard_t *shard;
+
+    *stats = (cache_stats_t) {
+        .name = cache->name,
+        .max_size = cache->max_size,
+    };
+    for (i = 0; i < cache->nb_shards; i++) {
+        shard = &cache->shards[i];
+        shard_lock(cache, shard);
+        stats->nb_items += shard->nb_items;
+        stats->size += shard->size;
+        stats->hits += shard->hits;
+        stats->misses += shard->misses;
+        stats->evictions += shard->evictions;
+        shard_unlock(cache, shard);
+    }
+}
+
+void cache_iter_stats(void *user,
+                      void (*f)(void *user, const cache_stats_t *stats))
+{
+    const cache_t *cache;
+    cache_stats_t stats;
+    LL_FOREACH(g_caches, cache) {
+        cache_get_stats(cache, &stats);
+        f(user, &stats);
+    }
+}
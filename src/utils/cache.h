@@ -19,11 +19,49 @@
 #ifndef CACHE_H
 #define CACHE_H
 
+#include <stdint.h>
+
 // Generic data cache structure.
 
 // Allow to cache blocks merge operations.
 typedef struct cache cache_t;
 
+// Reference to an item acquired with <cache_acquire>.
+typedef struct cache_item cache_item_t;
+
+/*
+ * Enum: CACHE_FLAGS
+ * Flags for <cache_create_with_flags>.
+ *
+ *   CACHE_GOVERNED     - The max size is managed by the memory governor,
+ *                        see <cache_create_governed>.
+ *   CACHE_CONCURRENT   - The cache can be used from several threads.  The
+ *                        items are split into shards with their own lock,
+ *                        and must be accessed with <cache_acquire>.
+ *   CACHE_DEFER_DELETE - The items are not deleted when they get evicted
+ *                        and released, but by <cache_collect>, so that the
+ *                        delete function always runs on the same thread.
+ */
+enum {
+    CACHE_GOVERNED      = 1 << 0,
+    CACHE_CONCURRENT    = 1 << 1,
+    CACHE_DEFER_DELETE  = 1 << 2,
+};
+
+/*
+ * Type: cache_stats_t
+ * Usage statistics of a cache, see <cache_get_stats>.
+ */
+typedef struct {
+    const char  *name;
+    int         nb_items;
+    int64_t     size;
+    int64_t     max_size;
+    int64_t     hits;
+    int64_t     misses;
+    int64_t     evictions;
+} cache_stats_t;
+
 /*
  * Function: cache_create
  * Create a new cache with a given max size (in byte).
@@ -32,7 +70,15 @@ typedef struct cache cache_t;
  *   name   - A global static string used for debugging only.
  *   size   - The max size of the cache.
  */
-cache_t *cache_create(const char *name, int size);
+cache_t *cache_create(const char *name, int64_t size);
+
+/*
+ * Function: cache_create_with_flags
+ * Create a new cache with some <CACHE_FLAGS>.
+ *
+ * The size is ignored for the governed caches.
+ */
+cache_t *cache_create_with_flags(const char *name, int64_t size, int flags);
 
 /*
  * Function: cache_add
@@ -48,7 +94,7 @@ cache_t *cache_create(const char *name, int size);
  *  delfunc     - Function that the cache can use to free the data.
  */
 void cache_add(cache_t *cache, const void *key, int keylen, void *data,
-               int cost, int (*delfunc)(void *data));
+               int64_t cost, int (*delfunc)(void *data));
 
 /*
  * Function: cache_get
@@ -62,9 +108,46 @@ void cache_add(cache_t *cache, const void *key, int keylen, void *data,
  * Returns:
  *   The data owned by the cache, or NULL if no item with this key is in
  *   the cache.
+ *
+ * This cannot be used with the concurrent caches, since the item could get
+ * deleted by an other thread, see <cache_acquire>.
  */
 void *cache_get(cache_t *cache, const void *key, int keylen);
 
+/*
+ * Function: cache_acquire
+ * Retreive an item from the cache, and keep it alive until it is released.
+ *
+ * The item can still be evicted from the cache meanwhile, but its data
+ * only gets deleted once all the references to it have been released.
+ *
+ * Parameters:
+ *   cache      - A cache_t instance.
+ *   key        - Unique key data for the item.
+ *   keylen     - Size of the key data.
+ *   ref        - Set to the reference to release with <cache_release>, or
+ *                NULL if the item is not in the cache.
+ *
+ * Returns:
+ *   The data owned by the cache, or NULL if no item with this key is in
+ *   the cache.
+ */
+void *cache_acquire(cache_t *cache, const void *key, int keylen,
+                    cache_item_t **ref);
+
+/*
+ * Function: cache_release
+ * Release a reference returned by <cache_acquire>.  Accept NULL.
+ */
+void cache_release(cache_t *cache, cache_item_t *ref);
+
+/*
+ * Function: cache_collect
+ * Delete the evicted items of a CACHE_DEFER_DELETE cache that are not
+ * referenced anymore.
+ */
+void cache_collect(cache_t *cache);
+
 /*
  * Function: cache_clear
  * Delete all the cached items.
@@ -77,5 +160,59 @@ void cache_clear(cache_t *cache);
  */
 void cache_delete(cache_t *cache);
 
+/*
+ * Section: Memory governor
+ * The caches created with <cache_create_governed> share a global memory
+ * budget, that gets split between them according to their hit rates.
+ */
+
+/*
+ * Function: cache_create_governed
+ * Create a new cache whose max size is managed by the governor.
+ *
+ * The cost of the items must be their size in bytes.
+ */
+cache_t *cache_create_governed(const char *name);
+
+/*
+ * Function: cache_governor_set_budget
+ * Set the total size in bytes of all the governed caches.
+ */
+void cache_governor_set_budget(int64_t size);
+
+/*
+ * Function: cache_governor_get_budget
+ * Return the total size in bytes of all the governed caches.
+ */
+int64_t cache_governor_get_budget(void);
+
+/*
+ * Function: cache_governor_update
+ * Rebalance the budget between the governed caches.
+ *
+ * This is cheap and can be called every frame: it only does something
+ * after enough lookups happened since the last rebalance.
+ */
+void cache_governor_update(void);
+
+/*
+ * Function: cache_on_low_memory
+ * Evict all the items of all the caches.
+ */
+void cache_on_low_memory(void);
+
+/*
+ * Function: cache_get_stats
+ * Get the usage statistics of a cache.
+ */
+void cache_get_stats(const cache_t *cache, cache_stats_t *stats);
+
+/*
+ * Function: cache_iter_stats
+ * Call a function with the usage statistics of all the existing caches.
+ */
+void cache_iter_stats(void *user,
+                      void (*f)(void *user, const cache_stats_t *stats));
+
 
 #endif // CACHE_H
@@ -222,6 +222,32 @@ bool gl_has_extension(const char *ext)
     return strstr(str, ext);
 }
 
+// Create a gl_shader_t from a linked program, with all its uniforms.
+static gl_shader_t *shader_from_prog(GLint prog)
+{
+    int i, count;
+    gl_shader_t *shader;
+    gl_uniform_t *uni;
+
+    shader = calloc(1, sizeof(*shader));
+    shader->prog = prog;
+
+    GL(glGetProgramiv(shader->prog, GL_ACTIVE_UNIFORMS, &count));
+    for (i = 0; i < count; i++) {
+        uni = &shader->uniforms[i];
+        GL(glGetActiveUniform(shader->prog, i, sizeof(uni->name),
+                              NULL, &uni->size, &uni->type, uni->name));
+        // Special case for array uniforms: remove the '[0]'
+        if (uni->size > 1) {
+            assert(uni->type == GL_FLOAT);
+            *strchr(uni->name, '[') = '\0';
+        }
+        GL(uni->loc = glGetUniformLocation(shader->prog, uni->name));
+    }
+
+    return shader;
+}
+
 /*
  * Function: gl_shader_create
  * Helper function that compiles an opengl shader.
@@ -238,12 +264,10 @@ bool gl_has_extension(const char *ext)
 gl_shader_t *gl_shader_create(const char *vert, const char *frag,
                               const char *include, const char **attr_names)
 {
-    int i, status, len, count;
+    int i, status, len;
     int vertex_shader, fragment_shader;
     char log[1024];
-    gl_shader_t *shader;
     GLint prog;
-    gl_uniform_t *uni;
 
     vertex_shader = glCreateShader(GL_VERTEX_SHADER);
     include = include ? : "";
@@ -277,25 +301,91 @@ gl_shader_t *gl_shader_create(const char *vert, const char *frag,
         return NULL;
     }
 
-    shader = calloc(1, sizeof(*shader));
-    shader->prog = prog;
+    return shader_from_prog(prog);
+}
 
-    GL(glGetProgramiv(shader->prog, GL_ACTIVE_UNIFORMS, &count));
-    for (i = 0; i < count; i++) {
-        uni = &shader->uniforms[i];
-        GL(glGetActiveUniform(shader->prog, i, sizeof(uni->name),
-                              NULL, &uni->size, &uni->type, uni->name));
-        // Special case for array uniforms: remove the '[0]'
-        if (uni->size > 1) {
-            assert(uni->type == GL_FLOAT);
-            *strchr(uni->name, '[') = '\0';
-        }
-        GL(uni->loc = glGetUniformLocation(shader->prog, uni->name));
+/*
+ * Function: gl_has_program_binary
+ * Check whether we can save and load the shaders binaries.
+ */
+bool gl_has_program_binary(void)
+{
+#ifdef GL_NUM_PROGRAM_BINARY_FORMATS
+    static int ret = -1;
+    GLint nb = 0;
+    if (ret == -1) {
+        if (gl_has_extension("GL_ARB_get_program_binary"))
+            GL(glGetIntegerv(GL_NUM_PROGRAM_BINARY_FORMATS, &nb));
+        ret = nb > 0;
     }
+    return ret;
+#else
+    return false;
+#endif
+}
 
-    return shader;
+/*
+ * Function: gl_shader_get_binary
+ * Retreive the driver binary of a linked shader.
+ *
+ * Parameters:
+ *   shader     - A shader.
+ *   size       - Get the size of the returned data.
+ *   format     - Get the driver binary format.
+ *
+ * Return:
+ *   A newly allocated buffer with the binary, or NULL if not supported.
+ */
+void *gl_shader_get_binary(const gl_shader_t *shader, int *size,
+                           uint32_t *format)
+{
+#ifdef GL_NUM_PROGRAM_BINARY_FORMATS
+    GLint len = 0;
+    GLenum fmt;
+    void *data;
+
+    if (!gl_has_program_binary()) return NULL;
+    GL(glGetProgramiv(shader->prog, GL_PROGRAM_BINARY_LENGTH, &len));
+    if (len <= 0) return NULL;
+    data = malloc(len);
+    GL(glGetProgramBinary(shader->prog, len, &len, &fmt, data));
+    *size = len;
+    *format = fmt;
+    return data;
+#else
+    return NULL;
+#endif
+}
+
+/*
+ * Function: gl_shader_create_from_binary
+ * Create a shader from a binary returned by <gl_shader_get_binary>.
+ *
+ * Return:
+ *   A new gl_shader_t instance, or NULL if the driver rejected the binary,
+ *   in which case the shader has to be compiled again.
+ */
+gl_shader_t *gl_shader_create_from_binary(const void *data, int size,
+                                          uint32_t format)
+{
+#ifdef GL_NUM_PROGRAM_BINARY_FORMATS
+    GLint prog, status;
+
+    if (!gl_has_program_binary()) return NULL;
+    prog = glCreateProgram();
+    glProgramBinary(prog, format, data, size);
+    glGetProgramiv(prog, GL_LINK_STATUS, &status);
+    if (status != GL_TRUE) {
+        glDeleteProgram(prog);
+        return NULL;
+    }
+    return shader_from_prog(prog);
+#else
+    return NULL;
+#endif
 }
 
+
 void gl_shader_delete(gl_shader_t *shader)
 {
     if (!shader) return;
@@ -326,6 +416,9 @@ void gl_update_uniform(gl_shader_t *shader, const char *name, ...)
     switch (uni->type) {
     case GL_INT:
     case GL_SAMPLER_2D:
+#ifdef GL_SAMPLER_3D
+    case GL_SAMPLER_3D:
+#endif
         GL(glUniform1i(uni->loc, va_arg(args, int)));
         break;
     case GL_FLOAT:
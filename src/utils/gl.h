@@ -20,6 +20,7 @@
 #define GL_H
 
 #include <stdbool.h>
+#include <stdint.h>
 
 // Set the DEBUG macro if needed.
 #ifndef DEBUG
@@ -117,6 +118,38 @@ int gl_gen_fbo(int w, int h, GLenum format, int msaa,
 gl_shader_t *gl_shader_create(const char *vert, const char *frag,
                               const char *include, const char **attr_names);
 
+/*
+ * Function: gl_has_program_binary
+ * Check whether we can save and load the shaders binaries.
+ */
+bool gl_has_program_binary(void);
+
+/*
+ * Function: gl_shader_get_binary
+ * Retreive the driver binary of a linked shader.
+ *
+ * Parameters:
+ *   shader     - A shader.
+ *   size       - Get the size of the returned data.
+ *   format     - Get the driver binary format.
+ *
+ * Return:
+ *   A newly allocated buffer with the binary, or NULL if not supported.
+ */
+void *gl_shader_get_binary(const gl_shader_t *shader, int *size,
+                           uint32_t *format);
+
+/*
+ * Function: gl_shader_create_from_binary
+ * Create a shader from a binary returned by <gl_shader_get_binary>.
+ *
+ * Return:
+ *   A new gl_shader_t instance, or NULL if the driver rejected the binary,
+ *   in which case the shader has to be compiled again.
+ */
+gl_shader_t *gl_shader_create_from_binary(const void *data, int size,
+                                          uint32_t format);
+
 void gl_shader_delete(gl_shader_t *shader);
 
 bool gl_has_uniform(gl_shader_t *shader, const char *name);
@@ -17,6 +17,7 @@
  */
 
 #include "img.h"
+#include "reader.h"
 
 #include <stdbool.h>
 
@@ -53,29 +54,6 @@
 #pragma GCC diagnostic pop
 #endif
 
-static char *read_file(const char *path, int *size)
-{
-    FILE *file;
-    char *ret = NULL;
-    long read_size __attribute__((unused));
-    int size_default;
-
-    size = size ?: &size_default; // Allow to pass NULL as size;
-    *size = 0;
-    file = fopen(path, "rb");
-    if (!file) return NULL;
-    fseek(file, 0, SEEK_END);
-    *size = (int)ftell(file);
-    fseek(file, 0, SEEK_SET);
-    ret = malloc(*size + 1);
-    read_size = fread(ret, *size, 1, file);
-    assert(read_size == 1 || *size == 0);
-    ret[*size] = '\0';
-    fclose(file);
-    return ret;
-}
-
-
 uint8_t *img_read_from_mem(const char *data, int size,
                            int *w, int *h, int *bpp)
 {
@@ -85,15 +63,16 @@ uint8_t *img_read_from_mem(const char *data, int size,
 
 uint8_t *img_read(const char *path, int *width, int *height, int *bpp)
 {
-    int size;
-    char *data;
+    reader_t reader;
     uint8_t *img;
 
-    data = read_file(path, &size);
-    if (!data) LOG_E("Cannot open image %s", path);
-    assert(data);
-    img = img_read_from_mem(data, size, width, height, bpp);
-    free(data);
+    if (reader_open(&reader, path) != 0) {
+        LOG_E("Cannot open image %s", path);
+        return NULL;
+    }
+    img = img_read_from_mem((const char*)reader.data, (int)reader.size,
+                            width, height, bpp);
+    reader_close(&reader);
     return img;
 }
 
@@ -151,11 +130,154 @@ void img_write(const uint8_t *img, int w, int h, int bpp, const char *path)
 
 #endif
 
+#if !HAVE_LIBPNG
+
+// Without libpng we can only buffer the rows until the image is closed.
+struct img_writer {
+    char *path;
+    int w, h, bpp;
+    int row;
+    uint8_t *img;
+};
+
+img_writer_t *img_writer_open(const char *path, int w, int h, int bpp)
+{
+    img_writer_t *writer = calloc(1, sizeof(*writer));
+    writer->path = strdup(path);
+    writer->w = w;
+    writer->h = h;
+    writer->bpp = bpp;
+    writer->img = calloc((size_t)w * h, bpp);
+    return writer;
+}
+
+void img_writer_write_rows(img_writer_t *writer, const uint8_t *rows,
+                           int nb)
+{
+    size_t row_size = (size_t)writer->w * writer->bpp;
+    assert(writer->row + nb <= writer->h);
+    memcpy(writer->img + writer->row * row_size, rows, nb * row_size);
+    writer->row += nb;
+}
+
+int img_writer_close(img_writer_t *writer)
+{
+    int ret;
+    ret = stbi_write_png(writer->path, writer->w, writer->h, writer->bpp,
+                         writer->img, 0) ? 0 : -1;
+    free(writer->img);
+    free(writer->path);
+    free(writer);
+    return ret;
+}
+
+#else
+
+struct img_writer {
+    FILE *fp;
+    png_structp png_ptr;
+    png_infop info_ptr;
+    int w, h, bpp;
+    int row;
+    bool error;
+};
+
+img_writer_t *img_writer_open(const char *path, int w, int h, int bpp)
+{
+    img_writer_t *writer = calloc(1, sizeof(*writer));
+
+    writer->w = w;
+    writer->h = h;
+    writer->bpp = bpp;
+    writer->fp = fopen(path, "wb");
+    if (!writer->fp) {
+        LOG_E("Cannot open %s", path);
+        free(writer);
+        return NULL;
+    }
+    writer->png_ptr = png_create_write_struct(PNG_LIBPNG_VER_STRING,
+                                              NULL, NULL, NULL);
+    if (!writer->png_ptr) {
+        LOG_E("Libpng error");
+        fclose(writer->fp);
+        free(writer);
+        return NULL;
+    }
+    writer->info_ptr = png_create_info_struct(writer->png_ptr);
+    if (setjmp(png_jmpbuf(writer->png_ptr))) {
+        png_destroy_write_struct(&writer->png_ptr, &writer->info_ptr);
+        fclose(writer->fp);
+        free(writer);
+        return NULL;
+    }
+#ifdef PNG_SET_USER_LIMITS_SUPPORTED
+    // The default limit of one million pixels per row is too small for
+    // large atlases.
+    png_set_user_limits(writer->png_ptr, PNG_UINT_31_MAX, PNG_UINT_31_MAX);
+#endif
+    png_init_io(writer->png_ptr, writer->fp);
+    png_set_IHDR(writer->png_ptr, writer->info_ptr, w, h, 8,
+                 bpp == 3 ? PNG_COLOR_TYPE_RGB : PNG_COLOR_TYPE_RGB_ALPHA,
+                 PNG_INTERLACE_NONE,
+                 PNG_COMPRESSION_TYPE_DEFAULT,
+                 PNG_FILTER_TYPE_DEFAULT);
+    png_write_info(writer->png_ptr, writer->info_ptr);
+    return writer;
+}
+
+void img_writer_write_rows(img_writer_t *writer, const uint8_t *rows,
+                           int nb)
+{
+    int i;
+    size_t row_size = (size_t)writer->w * writer->bpp;
+
+    assert(writer->row + nb <= writer->h);
+    if (writer->error) return;
+    if (setjmp(png_jmpbuf(writer->png_ptr))) {
+        writer->error = true;
+        return;
+    }
+    for (i = 0; i < nb; i++)
+        png_write_row(writer->png_ptr, (png_bytep)(rows + i * row_size));
+    writer->row += nb;
+}
+
+int img_writer_close(img_writer_t *writer)
+{
+    int ret;
+
+    if (!writer->error && writer->row == writer->h &&
+            !setjmp(png_jmpbuf(writer->png_ptr))) {
+        png_write_end(writer->png_ptr, writer->info_ptr);
+    } else {
+        writer->error = true;
+    }
+    png_destroy_write_struct(&writer->png_ptr, &writer->info_ptr);
+    ret = (fclose(writer->fp) == 0 && !writer->error) ? 0 : -1;
+    free(writer);
+    return ret;
+}
+
+#endif
+
 uint8_t *img_write_to_mem(const uint8_t *img, int w, int h, int bpp, int *size)
 {
     return stbi_write_png_to_mem((void*)img, 0, w, h, bpp, size);
 }
 
+uint8_t *img_zlib_compress(const uint8_t *data, int size, int *out_size)
+{
+    return stbi_zlib_compress((unsigned char*)data, size, out_size,
+                              stbi_write_png_compression_level);
+}
+
+int img_zlib_decompress(const uint8_t *data, int size, uint8_t *out,
+                        int out_size)
+{
+    return stbi_zlib_decode_buffer((char*)out, out_size,
+                                   (const char*)data, size);
+}
+
 void img_downsample(const uint8_t *img, int w, int h, int bpp,
                     uint8_t *out)
 {
@@ -175,3 +297,25 @@ void img_downsample(const uint8_t *img, int w, int h, int bpp,
     }
 #undef IX
 }
+
+void img_downscale(const uint8_t *img, int w, int h, int bpp, int factor,
+                   uint8_t *out)
+{
+    int i, j, k, x, y;
+    const int out_w = w / factor, out_h = h / factor;
+    const int n = factor * factor;
+    uint32_t sum[4];
+
+    for (i = 0; i < out_h; i++)
+    for (j = 0; j < out_w; j++) {
+        memset(sum, 0, sizeof(sum));
+        for (y = i * factor; y < (i + 1) * factor; y++) {
+            for (x = j * factor; x < (j + 1) * factor; x++) {
+                for (k = 0; k < bpp; k++)
+                    sum[k] += img[((size_t)y * w + x) * bpp + k];
+            }
+        }
+        for (k = 0; k < bpp; k++)
+            out[((size_t)i * out_w + j) * bpp + k] = (sum[k] + n / 2) / n;
+    }
+}
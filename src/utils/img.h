@@ -45,6 +45,36 @@ uint8_t *img_read_from_mem(const char *data, int size,
  */
 void img_write(const uint8_t *img, int w, int h, int bpp, const char *path);
 
+/*
+ * Type: img_writer_t
+ * Opaque writer used to save an image progressively, a few rows at a time.
+ */
+typedef struct img_writer img_writer_t;
+
+/*
+ * Function: img_writer_open
+ * Start writing a png image to a file.
+ *
+ * With libpng the rows are compressed as they are written, so the full
+ * image never has to be in memory.  Returns NULL in case of error.
+ */
+img_writer_t *img_writer_open(const char *path, int w, int h, int bpp);
+
+/*
+ * Function: img_writer_write_rows
+ * Write the next rows of an image opened with <img_writer_open>.
+ */
+void img_writer_write_rows(img_writer_t *writer, const uint8_t *rows,
+                           int nb);
+
+/*
+ * Function: img_writer_close
+ * Finish writing the image and release the writer.
+ *
+ * Returns 0 on success.
+ */
+int img_writer_close(img_writer_t *writer);
+
 /*
  * Function: img_write_to_mem
  * Write an image to memory.
@@ -52,6 +82,25 @@ void img_write(const uint8_t *img, int w, int h, int bpp, const char *path);
 uint8_t *img_write_to_mem(const uint8_t *img, int w, int h, int bpp,
                           int *size);
 
+/*
+ * Function: img_zlib_compress
+ * Compress some data with the zlib encoder of the png export.
+ *
+ * Return:
+ *   A new buffer to release with free, and its size in out_size.
+ */
+uint8_t *img_zlib_compress(const uint8_t *data, int size, int *out_size);
+
+/*
+ * Function: img_zlib_decompress
+ * Decompress some data compressed with <img_zlib_compress>.
+ *
+ * Return:
+ *   The number of bytes written to out, or -1 in case of error.
+ */
+int img_zlib_decompress(const uint8_t *data, int size, uint8_t *out,
+                        int out_size);
+
 /*
  * Function: img_downsample
  * Downsample an image by half, using interpolation.
@@ -59,4 +108,15 @@ uint8_t *img_write_to_mem(const uint8_t *img, int w, int h, int bpp,
 void img_downsample(const uint8_t *img, int w, int h, int bpp,
                     uint8_t *out);
 
+/*
+ * Function: img_downscale
+ * Downscale an image by an integer factor, averaging each block of
+ * factor x factor pixels.
+ *
+ * The output size is (w / factor) x (h / factor), the pixels left over on
+ * the right and bottom borders are ignored.
+ */
+void img_downscale(const uint8_t *img, int w, int h, int bpp, int factor,
+                   uint8_t *out);
+
 #endif // IMG_H
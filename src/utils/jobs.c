@@ -0,0 +1,385 @@
+/* Goxel 3D voxels editor
+ *
+ * copyright (c) 2024 Guillaume Chereau <guillaume@noctua-software.com>
+ *
+ * Goxel is free software: you can redistribute it and/or modify it under the
+ * terms of the GNU General Public License as published by the Free Software
+ * Foundation, either version 3 of the License, or (at your option) any later
+ * version.
+
+ * Goxel is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+
+ * You should have received a copy of the GNU General Public License along with
+ * goxel.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "jobs.h"
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#define MAX_WORKERS 64
+
+// The loops started by the background tasks run in batches of this number
+// of indices per worker, so that the other loops never wait more than a
+// batch to get the workers.
+#define TASK_BATCH 4
+
+// Disable the threads on platforms that don't support them.  The
+// emscripten builds only have threads if compiled with -pthread.
+#ifndef JOBS_THREADS
+#   if defined(__EMSCRIPTEN__) && !defined(__EMSCRIPTEN_PTHREADS__)
+#       define JOBS_THREADS 0
+#   else
+#       define JOBS_THREADS 1
+#   endif
+#endif
+
+#ifdef __EMSCRIPTEN_PTHREADS__
+#   include <emscripten/threading.h>
+#endif
+
+// A background task.
+typedef struct task task_t;
+struct task {
+    void    (*func)(void *user);
+    void    *user;
+    task_t  *next;
+};
+
+typedef struct {
+    // Remaining range of indices of the worker, packed as
+    // begin | (end << 32), so that the owner and the thieves can both
+    // update it atomically.
+    uint64_t    range;
+    pthread_t   thread;
+} worker_t;
+
+static struct {
+    int             nb_workers;
+    worker_t        workers[MAX_WORKERS];
+    pthread_mutex_t mutex;
+    pthread_cond_t  start_cond;
+    pthread_cond_t  done_cond;
+    pthread_mutex_t run_mutex; // Only one parallel for at a time.
+    bool            task_loop; // The current loop comes from a task.
+    int             nb_waiting; // Loops waiting for a task loop batch.
+    uint64_t        generation;
+    bool            loop_open; // Workers can still join the current loop.
+    int             nb_running; // Workers that joined the current loop.
+    bool            quit;
+    // Current loop.
+    void            (*func)(void *user, int i, int worker);
+    void            *user;
+    // Queue of background tasks.
+    task_t          *tasks;
+    task_t          *tasks_last;
+} g_jobs = {
+    .mutex = PTHREAD_MUTEX_INITIALIZER,
+    .start_cond = PTHREAD_COND_INITIALIZER,
+    .done_cond = PTHREAD_COND_INITIALIZER,
+    .run_mutex = PTHREAD_MUTEX_INITIALIZER,
+};
+
+// Index of the worker running in the current thread, or -1.
+static __thread int g_worker_idx = -1;
+
+// Set in the worker threads (not in the calling thread).
+static __thread bool g_in_worker_thread = false;
+
+static __thread void *g_scratch = NULL;
+static __thread size_t g_scratch_size = 0;
+
+#define RANGE(begin, end) ((uint64_t)(uint32_t)(begin) | \
+                           ((uint64_t)(uint32_t)(end) << 32))
+#define RANGE_BEGIN(r) ((int)((r) & 0xffffffff))
+#define RANGE_END(r) ((int)((r) >> 32))
+
+// Take the next index from the worker own range, or return -1.
+static int worker_pop(worker_t *worker)
+{
+    uint64_t r = __atomic_load_n(&worker->range, __ATOMIC_ACQUIRE);
+    while (RANGE_BEGIN(r) < RANGE_END(r)) {
+        if (__atomic_compare_exchange_n(&worker->range, &r,
+                RANGE(RANGE_BEGIN(r) + 1, RANGE_END(r)), false,
+                __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+            return RANGE_BEGIN(r);
+        }
+    }
+    return -1;
+}
+
+// Steal the second half of the range of an other worker.
+static bool worker_steal(int idx)
+{
+    int i, mid;
+    worker_t *victim;
+    uint64_t r;
+
+    for (i = 1; i < g_jobs.nb_workers; i++) {
+        victim = &g_jobs.workers[(idx + i) % g_jobs.nb_workers];
+        r = __atomic_load_n(&victim->range, __ATOMIC_ACQUIRE);
+        while (RANGE_BEGIN(r) < RANGE_END(r)) {
+            mid = RANGE_BEGIN(r) + (RANGE_END(r) - RANGE_BEGIN(r)) / 2;
+            if (__atomic_compare_exchange_n(&victim->range, &r,
+                    RANGE(RANGE_BEGIN(r), mid), false,
+                    __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+                __atomic_store_n(&g_jobs.workers[idx].range,
+                                 RANGE(mid, RANGE_END(r)), __ATOMIC_RELEASE);
+                return true;
+            }
+        }
+    }
+    return false;
+}
+
+static void worker_run(int idx)
+{
+    int i;
+    g_worker_idx = idx;
+    while (true) {
+        i = worker_pop(&g_jobs.workers[idx]);
+        if (i == -1) {
+            if (!worker_steal(idx)) break;
+            continue;
+        }
+        g_jobs.func(g_jobs.user, i, idx);
+    }
+    g_worker_idx = -1;
+}
+
+static void *worker_main(void *arg)
+{
+    int idx = (int)(intptr_t)arg;
+    uint64_t generation = 0;
+    task_t *task;
+
+    g_in_worker_thread = true;
+    pthread_mutex_lock(&g_jobs.mutex);
+    while (true) {
+        while (!g_jobs.quit && g_jobs.generation == generation &&
+               !g_jobs.tasks)
+            pthread_cond_wait(&g_jobs.start_cond, &g_jobs.mutex);
+        if (g_jobs.quit) break;
+
+        // Loops have the priority over the background tasks.  A worker
+        // that was busy with a task when a loop started only joins it if
+        // the loop is still running.
+        if (g_jobs.generation != generation) {
+            generation = g_jobs.generation;
+            if (!g_jobs.loop_open) continue;
+            g_jobs.nb_running++;
+            pthread_mutex_unlock(&g_jobs.mutex);
+            worker_run(idx);
+            pthread_mutex_lock(&g_jobs.mutex);
+            if (--g_jobs.nb_running == 0)
+                pthread_cond_signal(&g_jobs.done_cond);
+            continue;
+        }
+
+        // The loops started by the task can use the idle workers.
+        task = g_jobs.tasks;
+        g_jobs.tasks = task->next;
+        if (!g_jobs.tasks) g_jobs.tasks_last = NULL;
+        pthread_mutex_unlock(&g_jobs.mutex);
+        task->func(task->user);
+        free(task);
+        pthread_mutex_lock(&g_jobs.mutex);
+    }
+    pthread_mutex_unlock(&g_jobs.mutex);
+    free(g_scratch);
+    return NULL;
+}
+
+void jobs_init(int nb_workers)
+{
+    int i;
+    if (!JOBS_THREADS) return;
+    if (nb_workers <= 0) {
+#if defined(__EMSCRIPTEN_PTHREADS__)
+        // navigator.hardwareConcurrency.  The build must create at least
+        // as many threads in its pool (PTHREAD_POOL_SIZE), since the
+        // browser only starts new workers once we return to the event
+        // loop.
+        nb_workers = emscripten_num_logical_cores();
+#elif defined(_SC_NPROCESSORS_ONLN)
+        nb_workers = sysconf(_SC_NPROCESSORS_ONLN);
+#else
+        nb_workers = 4;
+#endif
+    }
+    nb_workers = nb_workers < 1 ? 1 :
+                 nb_workers > MAX_WORKERS ? MAX_WORKERS : nb_workers;
+    g_jobs.quit = false;
+    g_jobs.nb_workers = 1;
+    for (i = 1; i < nb_workers; i++) {
+        if (pthread_create(&g_jobs.workers[i].thread, NULL, worker_main,
+                           (void*)(intptr_t)i)) {
+            LOG_W("Cannot create worker thread");
+            break;
+        }
+        g_jobs.nb_workers++;
+    }
+}
+
+void jobs_release(void)
+{
+    int i;
+    task_t *task;
+    pthread_mutex_lock(&g_jobs.mutex);
+    g_jobs.quit = true;
+    pthread_cond_broadcast(&g_jobs.start_cond);
+    pthread_mutex_unlock(&g_jobs.mutex);
+    for (i = 1; i < g_jobs.nb_workers; i++)
+        pthread_join(g_jobs.workers[i].thread, NULL);
+    g_jobs.nb_workers = 0;
+    while (g_jobs.tasks) {
+        task = g_jobs.tasks;
+        g_jobs.tasks = task->next;
+        free(task);
+    }
+    g_jobs.tasks_last = NULL;
+}
+
+int jobs_get_nb_workers(void)
+{
+    return g_jobs.nb_workers ?: 1;
+}
+
+// Run a loop with all the workers.  Called with the run mutex locked.
+static void run_loop(int n, void (*func)(void *user, int i, int worker),
+                     void *user)
+{
+    int i, nb = g_jobs.nb_workers;
+
+    g_jobs.func = func;
+    g_jobs.user = user;
+    for (i = 0; i < nb; i++) {
+        __atomic_store_n(&g_jobs.workers[i].range,
+                         RANGE((int64_t)n * i / nb, (int64_t)n * (i + 1) / nb),
+                         __ATOMIC_RELEASE);
+    }
+    pthread_mutex_lock(&g_jobs.mutex);
+    g_jobs.generation++;
+    g_jobs.loop_open = true;
+    g_jobs.nb_running = 0;
+    pthread_cond_broadcast(&g_jobs.start_cond);
+    pthread_mutex_unlock(&g_jobs.mutex);
+
+    // We steal the ranges of the workers that didn't join, so once we
+    // are done all the indices have been taken, and we only wait for the
+    // calls still running in the other workers.
+    worker_run(0);
+
+    pthread_mutex_lock(&g_jobs.mutex);
+    g_jobs.loop_open = false;
+    while (g_jobs.nb_running)
+        pthread_cond_wait(&g_jobs.done_cond, &g_jobs.mutex);
+    pthread_mutex_unlock(&g_jobs.mutex);
+}
+
+typedef struct {
+    void    (*func)(void *user, int i, int worker);
+    void    *user;
+    int     ofs;
+} batch_t;
+
+static void batch_func(void *user, int i, int worker)
+{
+    batch_t *batch = user;
+    batch->func(batch->user, batch->ofs + i, worker);
+}
+
+// Loop started from a background task.  Each batch uses the idle workers,
+// unless an other loop is waiting for them, in which case the task runs the
+// batch alone.
+static void run_task_loop(int n, void (*func)(void *user, int i, int worker),
+                          void *user)
+{
+    batch_t batch = {func, user};
+    int i, size;
+
+    for (batch.ofs = 0; batch.ofs < n; batch.ofs += size) {
+        size = g_jobs.nb_workers * TASK_BATCH;
+        if (size > n - batch.ofs) size = n - batch.ofs;
+        if (    __atomic_load_n(&g_jobs.nb_waiting, __ATOMIC_ACQUIRE) ||
+                pthread_mutex_trylock(&g_jobs.run_mutex) != 0) {
+            for (i = 0; i < size; i++) func(user, batch.ofs + i, 0);
+            continue;
+        }
+        __atomic_store_n(&g_jobs.task_loop, true, __ATOMIC_RELEASE);
+        run_loop(size, batch_func, &batch);
+        __atomic_store_n(&g_jobs.task_loop, false, __ATOMIC_RELEASE);
+        pthread_mutex_unlock(&g_jobs.run_mutex);
+    }
+}
+
+void jobs_parallel_for(int n, void (*func)(void *user, int i, int worker),
+                       void *user)
+{
+    int i;
+
+    if (n <= 0) return;
+    if (g_jobs.nb_workers <= 1 || n == 1 || g_worker_idx != -1) {
+        for (i = 0; i < n; i++) func(user, i, 0);
+        return;
+    }
+    if (g_in_worker_thread) {
+        run_task_loop(n, func, user);
+        return;
+    }
+    if (pthread_mutex_trylock(&g_jobs.run_mutex) != 0) {
+        // We only wait for the end of the current batch of a task loop.
+        if (!__atomic_load_n(&g_jobs.task_loop, __ATOMIC_ACQUIRE)) {
+            for (i = 0; i < n; i++) func(user, i, 0);
+            return;
+        }
+        __atomic_add_fetch(&g_jobs.nb_waiting, 1, __ATOMIC_ACQ_REL);
+        pthread_mutex_lock(&g_jobs.run_mutex);
+        __atomic_sub_fetch(&g_jobs.nb_waiting, 1, __ATOMIC_ACQ_REL);
+    }
+    run_loop(n, func, user);
+    pthread_mutex_unlock(&g_jobs.run_mutex);
+}
+
+void jobs_async(void (*func)(void *user), void *user)
+{
+    task_t *task;
+
+    if (g_jobs.nb_workers <= 1) {
+        func(user);
+        return;
+    }
+    task = calloc(1, sizeof(*task));
+    task->func = func;
+    task->user = user;
+    pthread_mutex_lock(&g_jobs.mutex);
+    if (g_jobs.tasks_last)
+        g_jobs.tasks_last->next = task;
+    else
+        g_jobs.tasks = task;
+    g_jobs.tasks_last = task;
+    pthread_cond_signal(&g_jobs.start_cond);
+    pthread_mutex_unlock(&g_jobs.mutex);
+}
+
+bool jobs_in_worker_thread(void)
+{
+    return g_in_worker_thread;
+}
+
+void *jobs_get_scratch(size_t size)
+{
+    if (size > g_scratch_size) {
+        free(g_scratch);
+        g_scratch = malloc(size);
+        g_scratch_size = size;
+    }
+    return g_scratch;
+}
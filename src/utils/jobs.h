@@ -0,0 +1,113 @@
+/* Goxel 3D voxels editor
+ *
+ * copyright (c) 2024 Guillaume Chereau <guillaume@noctua-software.com>
+ *
+ * Goxel is free software: you can redistribute it and/or modify it under the
+ * terms of the GNU General Public License as published by the Free Software
+ * Foundation, either version 3 of the License, or (at your option) any later
+ * version.
+
+ * Goxel is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+
+ * You should have received a copy of the GNU General Public License along with
+ * goxel.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef JOBS_H
+#define JOBS_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+// Small thread pool to run parallel jobs.
+//
+// The main primitive is a parallel for loop.  The range of indices is split
+// between all the workers, and a worker that is done with its part steals
+// half of the remaining part of an other worker.
+//
+// The calling thread takes part in the work as worker zero.  Nested calls,
+// or calls from an other thread while a loop is already running, are
+// executed serially by the calling thread.
+//
+// The workers also run background tasks, when they are not busy with a
+// loop.  The workers busy with a task don't take part in the loops started
+// meanwhile, so a loop never waits for the tasks.  The tasks can start
+// loops themselves, that use the idle workers, but give them back to the
+// other loops between small batches of indices.
+
+/*
+ * Function: jobs_init
+ * Start the worker threads.
+ *
+ * Parameters:
+ *   nb_workers - Number of workers, including the calling thread.  If
+ *                zero, use the number of CPUs.
+ */
+void jobs_init(int nb_workers);
+
+/*
+ * Function: jobs_release
+ * Stop all the worker threads.
+ */
+void jobs_release(void);
+
+/*
+ * Function: jobs_get_nb_workers
+ * Return the number of workers, including the calling thread.
+ */
+int jobs_get_nb_workers(void);
+
+/*
+ * Function: jobs_parallel_for
+ * Call a function for each index in a range, using all the workers, and
+ * wait until all the calls are done.
+ *
+ * Parameters:
+ *   n      - Number of indices.
+ *   func   - Function called for each index i in [0, n).  worker is the
+ *            index of the worker running the call, between zero and
+ *            <jobs_get_nb_workers> - 1.  Two calls of the loop running at
+ *            the same time never get the same worker index, so it can be
+ *            used to index per-worker data.
+ *   user   - User data passed to the function.
+ */
+void jobs_parallel_for(int n, void (*func)(void *user, int i, int worker),
+                       void *user);
+
+/*
+ * Function: jobs_async
+ * Run a function in the background on one of the worker threads.
+ *
+ * The function should signal its completion itself if needed.  If there
+ * are no worker threads, the function is called immediately.  Tasks that
+ * didn't start yet when <jobs_release> is called are never run.
+ *
+ * Parameters:
+ *   func - The function to call.
+ *   user - User data passed to the function.
+ */
+void jobs_async(void (*func)(void *user), void *user);
+
+/*
+ * Function: jobs_in_worker_thread
+ * Return true if we are running in one of the worker threads, and not in
+ * the thread that created them.
+ *
+ * The global caches are only safe to use from the main thread, so the
+ * functions that can run in parallel jobs check this before using them.
+ */
+bool jobs_in_worker_thread(void);
+
+/*
+ * Function: jobs_get_scratch
+ * Return a scratch buffer of at least a given size for the current thread.
+ *
+ * The buffer is kept between calls, so that jobs can use it as temporary
+ * memory without allocating it each time.  Its content is undefined.
+ */
+void *jobs_get_scratch(size_t size);
+
+#endif // JOBS_H
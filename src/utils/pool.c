@@ -0,0 +1,136 @@
+/* Goxel 3D voxels editor
+ *
+ * copyright (c) 2024 Guillaume Chereau <guillaume@noctua-software.com>
+ *
+ * Goxel is free software: you can redistribute it and/or modify it under the
+ * terms of the GNU General Public License as published by the Free Software
+ * Foundation, either version 3 of the License, or (at your option) any later
+ * version.
+
+ * Goxel is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+
+ * You should have received a copy of the GNU General Public License along with
+ * goxel.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "pool.h"
+#include "utlist.h"
+
+#include <assert.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+typedef struct slab slab_t;
+
+// Header put before each item, so that we can find its slab when freed.
+// The union keeps the items properly aligned.
+typedef union item item_t;
+union item {
+    struct {
+        slab_t *slab;
+        item_t *next_free;
+    };
+    long double align_;
+};
+
+struct slab {
+    slab_t  *next, *prev; // Slabs with free items.
+    item_t  *free;
+    int     nb_used;
+    long double data[];
+};
+
+struct pool {
+    pthread_mutex_t mutex; // So that the pool can be used by the jobs.
+    const char  *name; // For debugging only.
+    size_t      item_size; // Including the header.
+    int         slab_items;
+    slab_t      *partial; // List of slabs that still have free items.
+    int         nb_slabs;
+    int         nb_items;
+};
+
+pool_t *pool_create(const char *name, size_t item_size, int slab_items)
+{
+    pool_t *pool = calloc(1, sizeof(*pool));
+    const size_t align = sizeof(item_t);
+    pthread_mutex_init(&pool->mutex, NULL);
+    pool->name = name;
+    pool->item_size = sizeof(item_t) + (item_size + align - 1) / align * align;
+    pool->slab_items = slab_items;
+    return pool;
+}
+
+static slab_t *slab_new(pool_t *pool)
+{
+    int i;
+    item_t *item;
+    slab_t *slab = malloc(sizeof(*slab) + pool->item_size * pool->slab_items);
+    slab->nb_used = 0;
+    slab->free = NULL;
+    for (i = pool->slab_items - 1; i >= 0; i--) {
+        item = (item_t*)((char*)slab->data + i * pool->item_size);
+        item->slab = slab;
+        item->next_free = slab->free;
+        slab->free = item;
+    }
+    pool->nb_slabs++;
+    return slab;
+}
+
+void *pool_alloc(pool_t *pool)
+{
+    slab_t *slab;
+    item_t *item;
+
+    pthread_mutex_lock(&pool->mutex);
+    if (!pool->partial) {
+        slab = slab_new(pool);
+        DL_APPEND(pool->partial, slab);
+    }
+    slab = pool->partial;
+    item = slab->free;
+    slab->free = item->next_free;
+    slab->nb_used++;
+    pool->nb_items++;
+    if (!slab->free) DL_DELETE(pool->partial, slab);
+    pthread_mutex_unlock(&pool->mutex);
+    memset(item + 1, 0, pool->item_size - sizeof(*item));
+    return item + 1;
+}
+
+void pool_free(pool_t *pool, void *ptr)
+{
+    item_t *item = (item_t*)ptr - 1;
+    slab_t *slab = item->slab;
+
+    pthread_mutex_lock(&pool->mutex);
+    assert(slab->nb_used > 0);
+    if (!slab->free) DL_APPEND(pool->partial, slab);
+    item->next_free = slab->free;
+    slab->free = item;
+    slab->nb_used--;
+    pool->nb_items--;
+
+    // Release the slab if it is empty, and we have other free items.
+    if (slab->nb_used == 0 && (slab->next || slab->prev != slab)) {
+        DL_DELETE(pool->partial, slab);
+        free(slab);
+        pool->nb_slabs--;
+    }
+    pthread_mutex_unlock(&pool->mutex);
+}
+
+void pool_get_stats(const pool_t *pool, pool_stats_t *stats)
+{
+    if (!pool) return;
+    stats->nb_slabs += pool->nb_slabs;
+    stats->nb_items += pool->nb_items;
+    stats->capacity += pool->nb_slabs * pool->slab_items;
+    stats->mem += (uint64_t)pool->nb_slabs *
+                  (sizeof(slab_t) + pool->item_size * pool->slab_items);
+}
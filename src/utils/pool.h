@@ -0,0 +1,70 @@
+/* Goxel 3D voxels editor
+ *
+ * copyright (c) 2024 Guillaume Chereau <guillaume@noctua-software.com>
+ *
+ * Goxel is free software: you can redistribute it and/or modify it under the
+ * terms of the GNU General Public License as published by the Free Software
+ * Foundation, either version 3 of the License, or (at your option) any later
+ * version.
+
+ * Goxel is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+
+ * You should have received a copy of the GNU General Public License along with
+ * goxel.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef POOL_H
+#define POOL_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Fixed size items allocator.
+//
+// Items are allocated from big slabs of memory, and freed items are kept
+// in free lists so that they can be reused without going through malloc.
+// Slabs that become entirely free are released, except for one that we
+// keep around to avoid allocating a new slab on the next allocation.
+
+typedef struct pool pool_t;
+
+typedef struct {
+    int         nb_slabs;
+    int         nb_items;   // Number of items currently allocated.
+    int         capacity;   // Total number of items the slabs can hold.
+    uint64_t    mem;        // Memory used by the slabs.
+} pool_stats_t;
+
+/*
+ * Function: pool_create
+ * Create a new pool of fixed size items.
+ *
+ * Parameters:
+ *   name       - A global static string used for debugging only.
+ *   item_size  - Size of the items.
+ *   slab_items - Number of items per slab.
+ */
+pool_t *pool_create(const char *name, size_t item_size, int slab_items);
+
+/*
+ * Function: pool_alloc
+ * Allocate a new item from a pool.  The memory is set to zero.
+ */
+void *pool_alloc(pool_t *pool);
+
+/*
+ * Function: pool_free
+ * Return an item to its pool.
+ */
+void pool_free(pool_t *pool, void *ptr);
+
+/*
+ * Function: pool_get_stats
+ * Add the occupancy of a pool to a stats structure.
+ */
+void pool_get_stats(const pool_t *pool, pool_stats_t *stats);
+
+#endif // POOL_H
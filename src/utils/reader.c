@@ -0,0 +1,159 @@
+/* Goxel 3D voxels editor
+ *
+ * copyright (c) 2024 Guillaume Chereau <guillaume@noctua-software.com>
+ *
+ * Goxel is free software: you can redistribute it and/or modify it under the
+ * terms of the GNU General Public License as published by the Free Software
+ * Foundation, either version 3 of the License, or (at your option) any later
+ * version.
+
+ * Goxel is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+
+ * You should have received a copy of the GNU General Public License along with
+ * goxel.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "reader.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Use mmap on the platforms that support it.
+#ifndef READER_MMAP
+#   if defined(WIN32) || defined(__EMSCRIPTEN__)
+#       define READER_MMAP 0
+#   else
+#       define READER_MMAP 1
+#   endif
+#endif
+
+#if READER_MMAP
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#if READER_MMAP
+
+static int open_file(reader_t *reader, const char *path)
+{
+    int fd;
+    struct stat st;
+    void *map;
+
+    fd = open(path, O_RDONLY);
+    if (fd == -1) return -1;
+    if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode)) {
+        close(fd);
+        return -1;
+    }
+    if (st.st_size == 0) {
+        close(fd);
+        reader_open_mem(reader, "", 0);
+        return 0;
+    }
+    map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) return -1;
+    reader_open_mem(reader, map, st.st_size);
+    reader->map = map;
+    reader->map_size = st.st_size;
+    return 0;
+}
+
+#else
+
+// Fallback to reading the whole file in memory.
+static int open_file(reader_t *reader, const char *path)
+{
+    FILE *file;
+    long size;
+    uint8_t *data;
+
+    file = fopen(path, "rb");
+    if (!file) return -1;
+    if (fseek(file, 0, SEEK_END) != 0 || (size = ftell(file)) < 0) {
+        fclose(file);
+        return -1;
+    }
+    fseek(file, 0, SEEK_SET);
+    data = malloc(size + 1);
+    if (size && fread(data, size, 1, file) != 1) {
+        free(data);
+        fclose(file);
+        return -1;
+    }
+    fclose(file);
+    reader_open_mem(reader, data, size);
+    reader->owned = true;
+    return 0;
+}
+
+#endif
+
+int reader_open(reader_t *reader, const char *path)
+{
+    memset(reader, 0, sizeof(*reader));
+    return open_file(reader, path);
+}
+
+void reader_open_mem(reader_t *reader, const void *data, size_t size)
+{
+    memset(reader, 0, sizeof(*reader));
+    reader->data = data;
+    reader->size = size;
+}
+
+void reader_close(reader_t *reader)
+{
+#if READER_MMAP
+    if (reader->map) munmap(reader->map, reader->map_size);
+#endif
+    if (reader->owned) free((void*)reader->data);
+    memset(reader, 0, sizeof(*reader));
+}
+
+const void *reader_read_bytes(reader_t *reader, size_t size)
+{
+    const void *ret;
+    if (size > reader->size - reader->pos) {
+        reader->pos = reader->size;
+        reader->error = true;
+        return NULL;
+    }
+    ret = reader->data + reader->pos;
+    reader->pos += size;
+    return ret;
+}
+
+bool reader_read(reader_t *reader, void *out, size_t size)
+{
+    const void *data = reader_read_bytes(reader, size);
+    if (!data) {
+        memset(out, 0, size);
+        return false;
+    }
+    memcpy(out, data, size);
+    return true;
+}
+
+bool reader_skip(reader_t *reader, size_t size)
+{
+    return reader_read_bytes(reader, size) != NULL;
+}
+
+bool reader_seek(reader_t *reader, size_t pos)
+{
+    if (pos > reader->size) {
+        reader->pos = reader->size;
+        reader->error = true;
+        return false;
+    }
+    reader->pos = pos;
+    return true;
+}
@@ -0,0 +1,164 @@
+/* Goxel 3D voxels editor
+ *
+ * copyright (c) 2024 Guillaume Chereau <guillaume@noctua-software.com>
+ *
+ * Goxel is free software: you can redistribute it and/or modify it under the
+ * terms of the GNU General Public License as published by the Free Software
+ * Foundation, either version 3 of the License, or (at your option) any later
+ * version.
+
+ * Goxel is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+
+ * You should have received a copy of the GNU General Public License along with
+ * goxel.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef READER_H
+#define READER_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Bounded reader over the content of a file, to parse binary formats.
+//
+// The file is memory mapped when possible, so the data can be parsed
+// directly without copies.  All the read functions check the bounds: a
+// read past the end of the data returns zeros and sets the error flag, so
+// that the parsers only have to check the flag once they are done.
+
+/*
+ * Type: reader_t
+ * A cursor over some read only data.
+ *
+ * Attributes:
+ *   data  - The full data.
+ *   size  - Size of the data in bytes.
+ *   pos   - Current position of the cursor.
+ *   error - Set after any read out of the data.
+ */
+typedef struct {
+    const uint8_t   *data;
+    size_t          size;
+    size_t          pos;
+    bool            error;
+    // Private.
+    void            *map;
+    size_t          map_size;
+    bool            owned;
+} reader_t;
+
+/*
+ * Function: reader_open
+ * Open a reader over the content of a file.
+ *
+ * Return:
+ *   0 on success, or -1 if the file cannot be read.
+ */
+int reader_open(reader_t *reader, const char *path);
+
+/*
+ * Function: reader_open_mem
+ * Open a reader over some data in memory.  The data is not copied.
+ */
+void reader_open_mem(reader_t *reader, const void *data, size_t size);
+
+/*
+ * Function: reader_close
+ * Release the resources of a reader.
+ */
+void reader_close(reader_t *reader);
+
+/*
+ * Function: reader_read_bytes
+ * Return a pointer to the next bytes of the data, and move the cursor.
+ *
+ * Return:
+ *   A pointer into the reader data, or NULL if there are not enough bytes
+ *   left, in which case the cursor moves to the end of the data.
+ */
+const void *reader_read_bytes(reader_t *reader, size_t size);
+
+/*
+ * Function: reader_read
+ * Copy the next bytes of the data.
+ *
+ * If there are not enough bytes left, the output is filled with zeros.
+ *
+ * Return:
+ *   true on success.
+ */
+bool reader_read(reader_t *reader, void *out, size_t size);
+
+/*
+ * Function: reader_skip
+ * Move the cursor forward.
+ */
+bool reader_skip(reader_t *reader, size_t size);
+
+/*
+ * Function: reader_seek
+ * Move the cursor to an absolute position.
+ */
+bool reader_seek(reader_t *reader, size_t pos);
+
+/*
+ * Function: reader_remaining
+ * Return the number of bytes after the cursor.
+ */
+static inline size_t reader_remaining(const reader_t *reader)
+{
+    return reader->size - reader->pos;
+}
+
+/*
+ * Functions: reader_u8, reader_u16, reader_u32, reader_i32, reader_i64,
+ *            reader_f32
+ * Read a value in the native byte order.
+ */
+static inline uint8_t reader_u8(reader_t *reader)
+{
+    uint8_t v;
+    reader_read(reader, &v, sizeof(v));
+    return v;
+}
+
+static inline uint16_t reader_u16(reader_t *reader)
+{
+    uint16_t v;
+    reader_read(reader, &v, sizeof(v));
+    return v;
+}
+
+static inline uint32_t reader_u32(reader_t *reader)
+{
+    uint32_t v;
+    reader_read(reader, &v, sizeof(v));
+    return v;
+}
+
+static inline int32_t reader_i32(reader_t *reader)
+{
+    int32_t v;
+    reader_read(reader, &v, sizeof(v));
+    return v;
+}
+
+static inline int64_t reader_i64(reader_t *reader)
+{
+    int64_t v;
+    reader_read(reader, &v, sizeof(v));
+    return v;
+}
+
+static inline float reader_f32(reader_t *reader)
+{
+    float v;
+    reader_read(reader, &v, sizeof(v));
+    return v;
+}
+
+#endif // READER_H
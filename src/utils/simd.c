@@ -0,0 +1,99 @@
+/* Goxel 3D voxels editor
+ *
+ * copyright (c) 2024 Guillaume Chereau <guillaume@noctua-software.com>
+ *
+ * Goxel is free software: you can redistribute it and/or modify it under the
+ * terms of the GNU General Public License as published by the Free Software
+ * Foundation, either version 3 of the License, or (at your option) any later
+ * version.
+
+ * Goxel is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+
+ * You should have received a copy of the GNU General Public License along with
+ * goxel.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "simd.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+static const struct {
+    int         feature;
+    const char  *name;
+} NAMES[] = {
+    {SIMD_SSE2,     "sse2"},
+    {SIMD_SSE42,    "sse4.2"},
+    {SIMD_AVX2,     "avx2"},
+    {SIMD_NEON,     "neon"},
+    {SIMD_WASM,     "wasm"},
+};
+
+// Zero until the features have been detected.  The detection always gives
+// the same result, so it doesn't matter if two threads do it.
+static int g_features = 0;
+#define DETECTED (1 << 30)
+
+static int detect(void)
+{
+    int ret = 0, i;
+    const char *disable;
+
+#if SIMD_X86 && (defined(__GNUC__) || defined(__clang__))
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("sse2")) ret |= SIMD_SSE2;
+    if (__builtin_cpu_supports("sse4.2")) ret |= SIMD_SSE42;
+    if (__builtin_cpu_supports("avx2")) ret |= SIMD_AVX2;
+#endif
+#if defined(__ARM_NEON)
+    ret |= SIMD_NEON;
+#endif
+#if defined(__wasm_simd128__)
+    ret |= SIMD_WASM;
+#endif
+
+    // None of the names is contained in an other one, so we don't need to
+    // split the list.
+    disable = getenv("GOXEL_SIMD_DISABLE");
+    if (disable) {
+        if (strstr(disable, "all")) ret = 0;
+        for (i = 0; i < sizeof(NAMES) / sizeof(NAMES[0]); i++) {
+            if (strstr(disable, NAMES[i].name)) ret &= ~NAMES[i].feature;
+        }
+    }
+    return ret;
+}
+
+int simd_get_features(void)
+{
+    int features = __atomic_load_n(&g_features, __ATOMIC_RELAXED);
+    if (!features) {
+        features = detect() | DETECTED;
+        __atomic_store_n(&g_features, features, __ATOMIC_RELAXED);
+    }
+    return features & ~DETECTED;
+}
+
+bool simd_has(int features)
+{
+    return (simd_get_features() & features) == features;
+}
+
+const char *simd_get_features_str(void)
+{
+    static char buf[128];
+    int i, features = simd_get_features();
+
+    buf[0] = '\0';
+    for (i = 0; i < sizeof(NAMES) / sizeof(NAMES[0]); i++) {
+        if (!(features & NAMES[i].feature)) continue;
+        if (buf[0]) strcat(buf, " ");
+        strcat(buf, NAMES[i].name);
+    }
+    if (!buf[0]) strcpy(buf, "none");
+    return buf;
+}
@@ -0,0 +1,70 @@
+/* Goxel 3D voxels editor
+ *
+ * copyright (c) 2024 Guillaume Chereau <guillaume@noctua-software.com>
+ *
+ * Goxel is free software: you can redistribute it and/or modify it under the
+ * terms of the GNU General Public License as published by the Free Software
+ * Foundation, either version 3 of the License, or (at your option) any later
+ * version.
+
+ * Goxel is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+
+ * You should have received a copy of the GNU General Public License along with
+ * goxel.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef SIMD_H
+#define SIMD_H
+
+#include <stdbool.h>
+
+// Runtime detection of the CPU SIMD extensions.
+//
+// The kernels using the baseline extension of the target (SSE2 on x86_64,
+// NEON on arm64, SIMD128 on wasm if enabled) are compiled normally.  The
+// kernels using optional extensions are compiled with SIMD_TARGET, so that
+// we don't need a separate build per CPU, and must only be called if
+// simd_has returns true.  Usually the kernel is picked once and kept in a
+// function pointer.
+//
+// The GOXEL_SIMD_DISABLE environment variable can contain a comma separated
+// list of extensions (or 'all') to disable, to test the fallback paths.
+
+enum {
+    SIMD_SSE2   = 1 << 0,
+    SIMD_SSE42  = 1 << 1,
+    SIMD_AVX2   = 1 << 2,
+    SIMD_NEON   = 1 << 3,
+    SIMD_WASM   = 1 << 4,
+};
+
+#if defined(__x86_64__) || defined(__i386__)
+#   define SIMD_X86 1
+#   define SIMD_TARGET(x) __attribute__((target(x)))
+#else
+#   define SIMD_X86 0
+#   define SIMD_TARGET(x)
+#endif
+
+/*
+ * Function: simd_get_features
+ * Return the bitmask of the SIMD_ extensions supported by the CPU.
+ */
+int simd_get_features(void);
+
+/*
+ * Function: simd_has
+ * Test whether all the given SIMD_ extensions are supported.
+ */
+bool simd_has(int features);
+
+/*
+ * Function: simd_get_features_str
+ * Return the names of the supported extensions, for the logs.
+ */
+const char *simd_get_features_str(void);
+
+#endif // SIMD_H
@@ -50,6 +50,7 @@ typedef struct sound_backend sound_backend_t;
 typedef struct sound {
     UT_hash_handle  hh;
     int state;
+    const char      *wav;     // Data of the wav, decoded on first play.
     sound_source_t  *source;
     sound_backend_t *backend;
 } sound_t;
@@ -140,9 +141,7 @@ void sound_register(const char *name, const char *wav)
     assert(!sound);
 
     sound = calloc(1, sizeof(*sound));
-    sound->source = wav_create(wav);
-    assert(sound->source);
-    sound->backend = sound_backend_create(sound->source);
+    sound->wav = wav;
     HASH_ADD_KEYPTR(hh, g_sounds, name, strlen(name), sound);
 }
 
@@ -152,6 +151,11 @@ void sound_play(const char *name, float volume, float pitch)
     if (!g_enabled) return;
     HASH_FIND_STR(g_sounds, name, sound);
     assert(sound);
+    if (!sound->source) {
+        sound->source = wav_create(sound->wav);
+        assert(sound->source);
+        sound->backend = sound_backend_create(sound->source);
+    }
     sound->source->reset(sound->source);
     sound_backend_stop_sound(sound);
     sound->state = 1;
@@ -162,6 +166,7 @@ void sound_iter(void)
 {
     sound_t *sound, *tmp;
     HASH_ITER(hh, g_sounds, sound, tmp) {
+        if (!sound->backend) continue;
         sound->state = sound_backend_iter_sound(sound);
     }
     sound_backend_iter();
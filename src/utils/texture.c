@@ -51,20 +51,59 @@ static void texture_create_empty(texture_t *tex)
         GL(glTexParameterf(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER,
             (tex->flags & TF_MIPMAP)? GL_LINEAR_MIPMAP_NEAREST : GL_LINEAR));
     } else {
+        // With mipmaps, only the magnification is nearest, so that the
+        // big textures don't alias when seen from far.
         GL(glTexParameterf(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST));
-        GL(glTexParameterf(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST));
+        GL(glTexParameterf(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER,
+            (tex->flags & TF_MIPMAP)? GL_LINEAR_MIPMAP_NEAREST : GL_NEAREST));
     }
     GL(glTexImage2D(GL_TEXTURE_2D, 0, tex->format, tex->tex_w, tex->tex_h,
             0, tex->format, GL_UNSIGNED_BYTE, NULL));
 }
 
+// Copy an image into the top left corner of a bigger one, and set the rest
+// of the destination to zero.
 static void blit(const uint8_t *src, int src_w, int src_h, int bpp,
                  uint8_t *dst, int dst_w, int dst_h)
 {
-    int i, j;
-    for (i = 0; i < src_h; i++) for (j = 0; j < src_w; j++) {
-        memcpy(&dst[(i * dst_w + j) * bpp], &src[(i * src_w + j) * bpp], bpp);
+    int i;
+    const size_t row = (size_t)src_w * bpp, dst_row = (size_t)dst_w * bpp;
+    for (i = 0; i < src_h; i++) {
+        memcpy(dst + i * dst_row, src + i * row, row);
+        memset(dst + i * dst_row + row, 0, dst_row - row);
+    }
+    memset(dst + src_h * dst_row, 0, (dst_h - src_h) * dst_row);
+}
+
+// Upload the data padded to the texture size through a pixel buffer, so
+// that we don't need a temporary copy, and the driver can do the transfer
+// without stalling.  Return false if the buffer cannot be mapped.
+static bool set_data_pbo(texture_t *tex,
+                         const uint8_t *data, int w, int h, int bpp)
+{
+#ifndef GLES2
+    uint32_t pbo;
+    uint8_t *buf;
+
+    GL(glGenBuffers(1, &pbo));
+    GL(glBindBuffer(GL_PIXEL_UNPACK_BUFFER, pbo));
+    GL(glBufferData(GL_PIXEL_UNPACK_BUFFER,
+                    (size_t)tex->tex_w * tex->tex_h * bpp, NULL,
+                    GL_STREAM_DRAW));
+    buf = glMapBuffer(GL_PIXEL_UNPACK_BUFFER, GL_WRITE_ONLY);
+    if (buf) {
+        blit(data, w, h, bpp, buf, tex->tex_w, tex->tex_h);
+        GL(glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER));
+        GL(glTexImage2D(GL_TEXTURE_2D, 0, tex->format, tex->tex_w,
+                    tex->tex_h, 0, tex->format, GL_UNSIGNED_BYTE, NULL));
     }
+    GL(glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0));
+    // The buffer is only released once the upload is done.
+    GL(glDeleteBuffers(1, &pbo));
+    return buf != NULL;
+#else
+    return false;
+#endif
 }
 
 void texture_set_data(texture_t *tex,
@@ -72,15 +111,17 @@ void texture_set_data(texture_t *tex,
 {
     uint8_t *buf = NULL;
     assert(tex->tex);
-    if (!is_pow2(w) || !is_pow2(h)) {
-        buf = calloc(bpp, tex->tex_w * tex->tex_h);
+    GL(glBindTexture(GL_TEXTURE_2D, tex->tex));
+    if (is_pow2(w) && is_pow2(h)) {
+        GL(glTexImage2D(GL_TEXTURE_2D, 0, tex->format, tex->tex_w,
+                    tex->tex_h, 0, tex->format, GL_UNSIGNED_BYTE, data));
+    } else if (!set_data_pbo(tex, data, w, h, bpp)) {
+        buf = malloc((size_t)bpp * tex->tex_w * tex->tex_h);
         blit(data, w, h, bpp, buf, tex->tex_w, tex->tex_h);
-        data = buf;
+        GL(glTexImage2D(GL_TEXTURE_2D, 0, tex->format, tex->tex_w,
+                    tex->tex_h, 0, tex->format, GL_UNSIGNED_BYTE, buf));
+        free(buf);
     }
-    GL(glBindTexture(GL_TEXTURE_2D, tex->tex));
-    GL(glTexImage2D(GL_TEXTURE_2D, 0, tex->format, tex->tex_w, tex->tex_h,
-                0, tex->format, GL_UNSIGNED_BYTE, data));
-    free(buf);
     if (tex->flags & TF_MIPMAP)
         GL(glGenerateMipmap(GL_TEXTURE_2D));
 }
@@ -150,6 +191,8 @@ void texture_delete(texture_t *tex)
     }
     if (tex->tex)
         GL(glDeleteTextures(1, &tex->tex));
+    if (tex->pbo)
+        GL(glDeleteBuffers(1, &tex->pbo));
     free(tex);
 }
 
@@ -160,22 +203,53 @@ texture_t *texture_copy(texture_t *tex)
     return tex;
 }
 
-void texture_get_data(const texture_t *tex, int w, int h, int bpp,
+void texture_read_async(texture_t *tex, int w, int h)
+{
+#ifndef GLES2
+    if (!tex->pbo) GL(glGenBuffers(1, &tex->pbo));
+    GL(glBindFramebuffer(GL_FRAMEBUFFER, tex->framebuffer));
+    GL(glBindBuffer(GL_PIXEL_PACK_BUFFER, tex->pbo));
+    GL(glBufferData(GL_PIXEL_PACK_BUFFER, w * h * 4, NULL, GL_STREAM_READ));
+    GL(glReadPixels(0, 0, w, h, GL_RGBA, GL_UNSIGNED_BYTE, NULL));
+    GL(glBindBuffer(GL_PIXEL_PACK_BUFFER, 0));
+    tex->pbo_pending = true;
+#endif
+}
+
+void texture_get_data(texture_t *tex, int w, int h, int bpp,
                       uint8_t *buf)
 {
-    uint8_t *tmp;
+    uint8_t *tmp = NULL;
+    const uint8_t *src = NULL;
     size_t i, j;
-    tmp = calloc(w * h, 4);
-    GL(glBindFramebuffer(GL_FRAMEBUFFER, tex->framebuffer));
-    GL(glReadPixels(0, 0, w, h, GL_RGBA, GL_UNSIGNED_BYTE, tmp));
+
+#ifndef GLES2
+    if (tex->pbo_pending) {
+        tex->pbo_pending = false;
+        GL(glBindBuffer(GL_PIXEL_PACK_BUFFER, tex->pbo));
+        src = glMapBuffer(GL_PIXEL_PACK_BUFFER, GL_READ_ONLY);
+        if (!src) GL(glBindBuffer(GL_PIXEL_PACK_BUFFER, 0));
+    }
+#endif
+    if (!src) {
+        src = tmp = calloc(w * h, 4);
+        GL(glBindFramebuffer(GL_FRAMEBUFFER, tex->framebuffer));
+        GL(glReadPixels(0, 0, w, h, GL_RGBA, GL_UNSIGNED_BYTE, tmp));
+    }
     // Flip output y and remove alpha if needed.
     for (i = 0; i < h; i++) {
         for (j = 0; j < w; j++) {
             memcpy(&buf[(i * w + j) * bpp],
-                   &tmp[((h - i - 1) * w  + j) * 4],
+                   &src[((h - i - 1) * w  + j) * 4],
                    bpp);
         }
     }
+#ifndef GLES2
+    if (!tmp) {
+        GL(glUnmapBuffer(GL_PIXEL_PACK_BUFFER));
+        GL(glBindBuffer(GL_PIXEL_PACK_BUFFER, 0));
+    }
+#endif
     free(tmp);
 }
 
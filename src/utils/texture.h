@@ -48,15 +48,29 @@ struct texture {
     int flags;
     // This is only used for buffer textures.
     uint32_t framebuffer, depth, stencil;
+    // Pixel buffer of the last texture_read_async call.
+    uint32_t pbo;
+    bool     pbo_pending;
 };
 
 texture_t *texture_new_from_buf(const uint8_t *data,
                                 int w, int h, int bpp, int flags);
 texture_t *texture_new_surface(int w, int h, int flags);
 texture_t *texture_new_buffer(int w, int h, int flags);
-void texture_get_data(const texture_t *tex, int w, int h, int bpp,
+void texture_get_data(texture_t *tex, int w, int h, int bpp,
                       uint8_t *buf);
 
+/*
+ * Function: texture_read_async
+ * Start to read back the content of a buffer texture.
+ *
+ * The pixels are copied into a pixel buffer object without waiting for the
+ * GPU, and the next call to <texture_get_data> with the same size gets
+ * them from there.  This does nothing on GLES2, where pixel buffers are
+ * not available.
+ */
+void texture_read_async(texture_t *tex, int w, int h);
+
 texture_t *texture_copy(texture_t *tex);
 void texture_delete(texture_t *tex);
 
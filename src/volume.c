@@ -17,10 +17,26 @@
  */
 
 #include "volume.h"
+#include "utils/img.h"
+#include "utils/jobs.h"
+#include "utils/pool.h"
 #include "uthash.h"
+#include "xxhash.h"
 #include <assert.h>
 #include <limits.h>
 #include <math.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if !defined(WIN32) && !defined(__EMSCRIPTEN__)
+#   define HAS_TILE_STORE
+#   include <fcntl.h>
+#   include <sys/mman.h>
+#   include <sys/stat.h>
+#   include <unistd.h>
+#endif
 
 #define min(a, b) ({ \
       __typeof__ (a) _a = (a); \
@@ -39,36 +55,206 @@ enum {
     VOLUME_ITER_FINISHED                  = 1 << 9,
     VOLUME_ITER_BOX                       = 1 << 10,
     VOLUME_ITER_VOLUME2                     = 1 << 11,
+    VOLUME_ITER_NEIGHBORS_PASS            = 1 << 12,
 };
 
-typedef struct tile_data tile_data_t;
+/*
+ * Enum: TILE_FORMAT
+ * The different ways the voxels of a tile data can be stored.
+ *
+ * TILE_FORMAT_RGBA     - Array of RGBA voxels.
+ * TILE_FORMAT_UNIFORM  - All the voxels have the same value, only this
+ *                        value is stored.
+ * TILE_FORMAT_INDEXED  - A table of up to 256 colors, followed by one byte
+ *                        color index per voxel.  Converted to RGBA as soon
+ *                        as we need more colors.
+ * TILE_FORMAT_BITS     - Only two values: one for all the empty voxels
+ *                        and one for all the others.  Only the occupancy
+ *                        mask is stored, so that masks like the selection
+ *                        only use one bit per voxel.
+ * TILE_FORMAT_PACKED   - The compressed voxels of an RGBA or indexed tile,
+ *                        in memory or in the spill file (see volume_pack).
+ *                        Only the number of set voxels can be accessed
+ *                        without unpacking the data first.
+ */
+enum {
+    TILE_FORMAT_RGBA,
+    TILE_FORMAT_UNIFORM,
+    TILE_FORMAT_INDEXED,
+    TILE_FORMAT_BITS,
+    TILE_FORMAT_PACKED,
+};
+
+typedef struct tile_store tile_store_t;
+
 struct tile_data
 {
     int         ref;
     uint64_t    id;
-    uint8_t     voxels[TILE_SIZE * TILE_SIZE * TILE_SIZE][4]; // RGBA voxels.
+    int         format;
+    int         nb_colors;  // Size of the colors table of indexed tiles.
+    int         last_color; // Last color index written, to speed up writes.
+    int         nb_set;     // Number of voxels with a non zero alpha.
+    uint8_t     value[4];   // Value of all the voxels of uniform tiles.
+    // Hash of the voxels, computed the first time we need it, and reset on
+    // write.  Unlike the id, it is the same for all the data with the same
+    // visible voxels.
+    int         has_hash;
+    uint64_t    hash[2];
+    // Set if the voxels are mapped from a tile store (see
+    // volume_store_open), in which case they are read only.
+    tile_store_t *store;
+    // RGBA voxels, or colors table followed by the indices for indexed
+    // tiles, or the empty and set values for bits tiles.  In all cases
+    // followed by the occupancy mask (one bit per voxel, set if the alpha
+    // is not zero).  Points to the storage, or into the tile store.
+    uint8_t     (*voxels)[4];
+    // Not allocated for uniform and mapped tiles.
+    uint8_t     storage[][4] __attribute__((aligned(8)));
 };
 
+// Header of the voxels of packed tile data.
+typedef struct {
+    int         format;     // Format of the unpacked data.
+    int         size;       // Size of the payload.
+    bool        compressed; // Set if the payload is zlib compressed.
+    int64_t     spill_ofs;  // Offset of the payload in the spill file, or -1.
+    uint8_t     payload[];  // If not spilled.
+} packed_t;
+
+#define PACKED(d) ((packed_t*)(d)->storage)
+
+/*
+ * The tiles are shared between the tables of the volumes copies, and only
+ * get copied when one of the volumes writes into them (see
+ * tiles_table_own).  So splitting a shared table only copies its arrays.
+ */
 struct tile
 {
-    UT_hash_handle  hh;     // The hash table of pos -> tiles in a volume.
+    int             ref;
     tile_data_t     *data;
     int             pos[3];
     uint64_t        id;
 };
 
+/*
+ * The table of pos -> tiles of a volume.
+ *
+ * The tiles are stored in a dense array, in insertion order, so that the
+ * iteration order is stable.  Removed tiles leave a NULL hole in the array,
+ * that only get compacted when we need to grow it.
+ *
+ * The lookup is done with an open addressing (linear probing) hash table
+ * of the packed tile coordinates, pointing into the dense array.  Removed
+ * entries are marked as tombstones, so that a removal never moves the other
+ * entries.
+ */
+typedef struct {
+    uint64_t    key;    // Packed tile position.
+    int         idx;    // Index in the tiles array, or SLOT_EMPTY/SLOT_DEL.
+} tile_slot_t;
+
+enum {
+    SLOT_EMPTY  = -1,
+    SLOT_DEL    = -2,
+};
+
+/*
+ * Coarse index of the tiles, by bricks of 8x8x8 tiles.
+ *
+ * Each entry counts the tiles of a brick, so that the box iterators can
+ * skip the empty regions of huge sparse volumes without probing every tile
+ * position.  The entries are never removed: an emptied brick keeps a zero
+ * count until the next rehash of the index.
+ */
+#define BRICK_BITS 3
+
+typedef struct {
+    uint64_t    key;    // Packed brick position.
+    int         count;  // Number of tiles in the brick, or SLOT_EMPTY.
+} brick_slot_t;
+
+typedef struct tiles_table tiles_table_t;
+struct tiles_table
+{
+    int         ref;            // Used to implement copy on write.
+    int         count;          // Number of tiles in the table.
+    int         nb;             // Size used in the tiles array (with holes).
+    int         capacity;       // Allocated size of the tiles array.
+    tile_t      **tiles;
+    int         slots_used;     // Number of non empty slots (with tombstones).
+    int         slots_size;     // Always a power of two (or zero).
+    tile_slot_t *slots;
+    int         nb_packed;      // Number of tiles with packed data.
+    int         bricks_count;   // Number of non empty bricks.
+    int         bricks_used;    // Number of non empty slots in the index.
+    int         bricks_size;    // Always a power of two (or zero).
+    brick_slot_t *bricks;
+};
+
+/*
+ * Bounded journal of the positions of the tiles written in a volume.
+ *
+ * The entries are kept in a ring buffer, so the cursors older than
+ * JOURNAL_SIZE entries cannot be used anymore.  The id changes when the
+ * whole volume gets replaced, to invalidate all the cursors.
+ */
+#define JOURNAL_SIZE 256
+
+typedef struct {
+    uint64_t    id;
+    uint64_t    count;      // Number of entries added since the creation.
+    uint64_t    read;       // Last count returned to a consumer.
+    int         pos[JOURNAL_SIZE][3];
+} journal_t;
+
 struct volume
 {
     int ref;
-    tile_t *tiles;
-    int *tiles_ref;   // Used to implement copy on write of the tiles.
+    tiles_table_t *tiles;
     uint64_t key; // Two volumes with the same key have the same value.
+    journal_t *journal; // Only created once a cursor has been requested.
 };
 
 static uint64_t g_uid = 2; // Global id counter.
 
+// Atomic counters, so that the volumes can be used from the jobs threads.
+#define ATOMIC_INC(x) __atomic_add_fetch(&(x), 1, __ATOMIC_ACQ_REL)
+#define ATOMIC_DEC(x) __atomic_sub_fetch(&(x), 1, __ATOMIC_ACQ_REL)
+#define ATOMIC_ADD(x, v) __atomic_add_fetch(&(x), (v), __ATOMIC_RELAXED)
+
+static uint64_t new_uid(void)
+{
+    return ATOMIC_INC(g_uid);
+}
+
 static volume_global_stats_t g_global_stats = {};
 
+// Add a tile position to the journal of a volume.  The successive writes
+// to the same tile only add one entry, as long as no consumer read it.
+static void journal_add(volume_t *volume, const int pos[3])
+{
+    journal_t *journal = volume->journal;
+    int *last;
+    if (!journal) return;
+    if (journal->count > journal->read) {
+        last = journal->pos[(journal->count - 1) % JOURNAL_SIZE];
+        if (last[0] == pos[0] && last[1] == pos[1] && last[2] == pos[2])
+            return;
+    }
+    memcpy(journal->pos[journal->count % JOURNAL_SIZE], pos, sizeof(int[3]));
+    journal->count++;
+}
+
+// Invalidate all the cursors of the journal of a volume.
+static void journal_reset(volume_t *volume)
+{
+    if (!volume->journal) return;
+    volume->journal->id = new_uid();
+    volume->journal->count = 0;
+    volume->journal->read = 0;
+}
+
 #define N TILE_SIZE
 
 #define vec3_copy(a, b) do {b[0] = a[0]; b[1] = a[1]; b[2] = a[2];} while (0)
@@ -79,8 +265,134 @@ static volume_global_stats_t g_global_stats = {};
         for (y = 0; y < N; y++) \
             for (x = 0; x < N; x++)
 
-#define DATA_AT(d, x, y, z) (d->voxels[x + y * N + z * N * N])
-#define TILE_AT(c, x, y, z) (DATA_AT(c->data, x, y, z))
+#define INDEXED_COLORS(d) ((d)->voxels)
+#define INDEXED_INDICES(d) ((uint8_t*)((d)->voxels + 256))
+#define BITS_VALUES(d) ((d)->voxels)
+#define MASK_SIZE (N * N * N / 64)
+
+// Storage order of the voxels of the RGBA tiles.  By default the voxels
+// are stored linearly, in x + y * N + z * N * N order.  With TILE_BRICKS
+// the tile is split into bricks of 4x4x4 contiguous voxels instead, so that
+// the 3D neighborhoods touch less cache lines.  This only affects the
+// storage: the voxels indices, the occupancy masks, the other formats and
+// all the voxels passed through the API keep the linear order.
+#ifndef TILE_BRICKS
+#   define TILE_BRICKS 0
+#endif
+
+// Return the offset in the RGBA voxels array of a voxel from its index.
+static inline int voxel_ofs(int i)
+{
+#if TILE_BRICKS
+    int x = i % N, y = i / N % N, z = i / (N * N);
+    return ((x / 4) + (y / 4) * (N / 4) + (z / 4) * (N / 4) * (N / 4)) * 64 +
+           (x % 4) + (y % 4) * 4 + (z % 4) * 16;
+#else
+    return i;
+#endif
+}
+
+// Return the occupancy mask of a non uniform tile data.
+static inline uint64_t *data_mask(const tile_data_t *data)
+{
+    if (data->format == TILE_FORMAT_RGBA)
+        return (uint64_t*)(data->voxels + N * N * N);
+    if (data->format == TILE_FORMAT_BITS)
+        return (uint64_t*)(BITS_VALUES(data) + 2);
+    assert(data->format == TILE_FORMAT_INDEXED);
+    return (uint64_t*)(INDEXED_INDICES(data) + N * N * N);
+}
+
+static inline void data_set_mask(tile_data_t *data, int i, bool v)
+{
+    uint64_t *mask = data_mask(data), bit = 1ULL << (i % 64);
+    if (!(mask[i / 64] & bit) == !v) return;
+    mask[i / 64] ^= bit;
+    data->nb_set += v ? 1 : -1;
+}
+
+// Copy the occupancy of a tile data into an other one with the same voxels.
+static void data_copy_mask(tile_data_t *data, const tile_data_t *src)
+{
+    if (src->format == TILE_FORMAT_UNIFORM)
+        memset(data_mask(data), src->value[3] ? 0xff : 0, MASK_SIZE * 8);
+    else
+        memcpy(data_mask(data), data_mask(src), MASK_SIZE * 8);
+    data->nb_set = src->nb_set;
+}
+
+// Return the value of a voxel of a tile data from its index.
+static inline const uint8_t *data_get(const tile_data_t *data, int i)
+{
+    if (data->format == TILE_FORMAT_RGBA) return data->voxels[voxel_ofs(i)];
+    if (data->format == TILE_FORMAT_UNIFORM) return data->value;
+    if (data->format == TILE_FORMAT_BITS)
+        return BITS_VALUES(data)[(data_mask(data)[i / 64] >> (i % 64)) & 1];
+    return INDEXED_COLORS(data)[INDEXED_INDICES(data)[i]];
+}
+
+static inline const uint8_t *data_get_at(const tile_data_t *data,
+                                         int x, int y, int z)
+{
+    return data_get(data, x + y * N + z * N * N);
+}
+
+// Copy the w successive voxels starting at index i into a RGBA buffer,
+// doing the format test only once.
+static void data_get_row(const tile_data_t *data, int i, int w, uint8_t *out)
+{
+    int x, n __attribute__((unused));
+    const uint64_t *mask;
+    const uint8_t (*colors)[4];
+    const uint8_t *indices;
+
+    switch (data->format) {
+    case TILE_FORMAT_RGBA:
+#if TILE_BRICKS
+        // The rows are only contiguous inside a brick.
+        for (x = 0; x < w; x += n, i += n) {
+            n = min(4 - i % 4, w - x);
+            memcpy(out + x * 4, data->voxels[voxel_ofs(i)], n * 4);
+        }
+#else
+        memcpy(out, data->voxels[i], w * 4);
+#endif
+        return;
+    case TILE_FORMAT_UNIFORM:
+        if (!memcmp(data->value, (uint8_t[4]){0}, 4)) {
+            memset(out, 0, w * 4);
+            return;
+        }
+        for (x = 0; x < w; x++) memcpy(out + x * 4, data->value, 4);
+        return;
+    case TILE_FORMAT_BITS:
+        mask = data_mask(data);
+        colors = BITS_VALUES(data);
+        for (x = 0; x < w; x++, i++)
+            memcpy(out + x * 4, colors[(mask[i / 64] >> (i % 64)) & 1], 4);
+        return;
+    default:
+        colors = INDEXED_COLORS(data);
+        indices = INDEXED_INDICES(data);
+        for (x = 0; x < w; x++)
+            memcpy(out + x * 4, colors[indices[i + x]], 4);
+        return;
+    }
+}
+
+// Recompute the occupancy mask of a tile data from its voxels.
+static void data_update_mask(tile_data_t *data)
+{
+    int i;
+    uint64_t *mask = data_mask(data);
+    memset(mask, 0, MASK_SIZE * 8);
+    data->nb_set = 0;
+    for (i = 0; i < N * N * N; i++) {
+        if (!data_get(data, i)[3]) continue;
+        mask[i / 64] |= 1ULL << (i % 64);
+        data->nb_set++;
+    }
+}
 
 static void mat4_mul_vec4(float mat[4][4], const float v[4], float out[4])
 {
@@ -132,88 +444,490 @@ static void bbox_intersection(int a[2][3], int b[2][3], int out[2][3])
 
 static tile_data_t *get_empty_data(void)
 {
-    static tile_data_t *data = NULL;
-    if (!data) {
-        data = calloc(1, sizeof(*data));
-        data->ref = 1;
-        data->id = 0;
+    // Statically allocated, so that it is safe to use from any thread.
+    static tile_data_t data = {
+        .ref = 1,
+        .id = 0,
+        .format = TILE_FORMAT_UNIFORM,
+    };
+    return &data;
+}
+
+static size_t tile_data_size(int format)
+{
+    switch (format) {
+    case TILE_FORMAT_UNIFORM:
+        return sizeof(tile_data_t);
+    case TILE_FORMAT_INDEXED:
+        return sizeof(tile_data_t) + 256 * 4 + N * N * N + MASK_SIZE * 8;
+    case TILE_FORMAT_BITS:
+        return sizeof(tile_data_t) + 2 * 4 + MASK_SIZE * 8;
+    default:
+        return sizeof(tile_data_t) + N * N * N * 4 + MASK_SIZE * 8;
+    }
+}
+
+// Pools used to allocate the tiles and the tile data of each format.
+static pool_t *g_data_pools[4] = {};
+static pool_t *g_tiles_pool = NULL;
+
+static pool_t *get_data_pool(int format)
+{
+    // The data can be created from the jobs workers.
+    static pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+    pool_t *pool = __atomic_load_n(&g_data_pools[format], __ATOMIC_ACQUIRE);
+    // Allocate the data by slabs of about 256KB.
+    size_t size = tile_data_size(format);
+
+    if (pool) return pool;
+    pthread_mutex_lock(&mutex);
+    if (!g_data_pools[format]) {
+        pool = pool_create("tile_data", size, max(16, (256 << 10) / size));
+        __atomic_store_n(&g_data_pools[format], pool, __ATOMIC_RELEASE);
     }
+    pthread_mutex_unlock(&mutex);
+    return g_data_pools[format];
+}
+
+static pool_t *get_tiles_pool(void)
+{
+    if (!g_tiles_pool)
+        g_tiles_pool = pool_create("tiles", sizeof(tile_t), 1024);
+    return g_tiles_pool;
+}
+
+static tile_data_t *tile_data_new(int format)
+{
+    tile_data_t *data;
+    size_t size = tile_data_size(format);
+    data = pool_alloc(get_data_pool(format));
+    data->ref = 1;
+    data->format = format;
+    data->id = new_uid();
+    data->has_hash = 0;
+    data->voxels = data->storage;
+    ATOMIC_ADD(g_global_stats.nb_tiles, 1);
+    ATOMIC_ADD(g_global_stats.mem, size);
     return data;
 }
 
-static bool tile_is_empty(const tile_t *tile, bool fast)
+// A free range of the spill file.
+typedef struct {
+    int64_t     ofs;
+    int64_t     size;
+} spill_extent_t;
+
+/*
+ * Temporary file where the packed tiles data get spilled, deleted at the
+ * end of the session.  The released ranges are kept in a sorted free list
+ * so that a long session doesn't make the file grow forever.  Only used
+ * from the main thread.
+ */
+static struct {
+    FILE            *file;
+    int64_t         end;
+    spill_extent_t  *free;
+    int             nb_free;
+    int             free_capacity;
+} g_spill = {};
+
+// Find some space for a payload in the spill file, first fit.
+static int64_t spill_alloc(int size)
+{
+    int i;
+    int64_t ret;
+    spill_extent_t *e;
+
+    for (i = 0; i < g_spill.nb_free; i++) {
+        e = &g_spill.free[i];
+        if (e->size < size) continue;
+        ret = e->ofs;
+        e->ofs += size;
+        e->size -= size;
+        if (!e->size) {
+            memmove(e, e + 1, (g_spill.nb_free - i - 1) * sizeof(*e));
+            g_spill.nb_free--;
+        }
+        return ret;
+    }
+    ret = g_spill.end;
+    g_spill.end += size;
+    return ret;
+}
+
+static void spill_free(int64_t ofs, int size)
 {
-    int x, y, z;
-    if (!tile) return true;
-    if (tile->data->id == 0) return true;
-    if (fast) return false;
+    int i;
+    spill_extent_t *e;
+
+    for (i = 0; i < g_spill.nb_free; i++) {
+        if (g_spill.free[i].ofs > ofs) break;
+    }
+    // Merge with the previous and next ranges if possible.
+    if (i > 0 && g_spill.free[i - 1].ofs + g_spill.free[i - 1].size == ofs) {
+        i--;
+        g_spill.free[i].size += size;
+    } else {
+        if (g_spill.nb_free == g_spill.free_capacity) {
+            g_spill.free_capacity = max(16, g_spill.free_capacity * 2);
+            g_spill.free = realloc(g_spill.free, g_spill.free_capacity *
+                                   sizeof(*g_spill.free));
+        }
+        e = &g_spill.free[i];
+        memmove(e + 1, e, (g_spill.nb_free - i) * sizeof(*e));
+        g_spill.nb_free++;
+        *e = (spill_extent_t){ofs, size};
+    }
+    e = &g_spill.free[i];
+    if (i + 1 < g_spill.nb_free && e->ofs + e->size == e[1].ofs) {
+        e->size += e[1].size;
+        memmove(e + 1, e + 2, (g_spill.nb_free - i - 2) * sizeof(*e));
+        g_spill.nb_free--;
+    }
+    // Give back the space at the end of the file.
+    if (i == g_spill.nb_free - 1 && e->ofs + e->size == g_spill.end) {
+        g_spill.end = e->ofs;
+        g_spill.nb_free--;
+    }
+}
+
+static void packed_data_release(tile_data_t *data)
+{
+    packed_t *packed = PACKED(data);
+    if (packed->spill_ofs >= 0) {
+        ATOMIC_ADD(g_global_stats.spilled_mem, -packed->size);
+        spill_free(packed->spill_ofs, packed->size);
+    } else {
+        ATOMIC_ADD(g_global_stats.packed_mem, -packed->size);
+    }
+    ATOMIC_ADD(g_global_stats.nb_tiles, -1);
+    free(data);
+}
+
+static void mapped_data_release(tile_data_t *data);
+
+static void tile_data_release(tile_data_t *data)
+{
+    if (ATOMIC_DEC(data->ref) > 0) return;
+    if (data->format == TILE_FORMAT_PACKED) {
+        packed_data_release(data);
+        return;
+    }
+    if (data->store) {
+        mapped_data_release(data);
+        return;
+    }
+    ATOMIC_ADD(g_global_stats.nb_tiles, -1);
+    ATOMIC_ADD(g_global_stats.mem, -tile_data_size(data->format));
+    pool_free(get_data_pool(data->format), data);
+}
 
-    TILE_ITER(x, y, z) {
-        if (TILE_AT(tile, x, y, z)[3]) return false;
+// Return a new reference to a uniform tile data of a given value.
+static tile_data_t *tile_data_new_uniform(const uint8_t v[4])
+{
+    tile_data_t *data;
+    if (!v[0] && !v[1] && !v[2] && !v[3]) {
+        data = get_empty_data();
+        ATOMIC_INC(data->ref);
+        return data;
+    }
+    data = tile_data_new(TILE_FORMAT_UNIFORM);
+    memcpy(data->value, v, 4);
+    data->nb_set = v[3] ? N * N * N : 0;
+    return data;
+}
+
+// Test if all the voxels of a tile data have the same value.
+static bool tile_data_is_uniform(const tile_data_t *data)
+{
+    int i;
+    const uint8_t *v;
+    if (data->format == TILE_FORMAT_UNIFORM) return true;
+    if (data->nb_set != 0 && data->nb_set != N * N * N) return false;
+    v = data_get(data, 0);
+    for (i = 1; i < N * N * N; i++) {
+        if (memcmp(data_get(data, i), v, 4)) return false;
     }
     return true;
 }
 
+// Return the index of a color in an indexed tile data table, or -1.
+static int indexed_find_color(tile_data_t *data, const uint8_t v[4])
+{
+    int i;
+    uint32_t c, *colors = (uint32_t*)INDEXED_COLORS(data);
+    memcpy(&c, v, 4);
+    if (data->last_color < data->nb_colors && colors[data->last_color] == c)
+        return data->last_color;
+    for (i = 0; i < data->nb_colors; i++) {
+        if (colors[i] == c) return i;
+    }
+    return -1;
+}
+
+// Remove the unused colors from the table of an indexed tile data.
+static void indexed_remove_unused_colors(tile_data_t *data)
+{
+    int i, nb = 0;
+    int remap[256];
+    bool used[256] = {};
+    uint8_t *indices = INDEXED_INDICES(data);
+
+    for (i = 0; i < N * N * N; i++) used[indices[i]] = true;
+    for (i = 0; i < data->nb_colors; i++) {
+        if (!used[i]) continue;
+        memcpy(INDEXED_COLORS(data)[nb], INDEXED_COLORS(data)[i], 4);
+        remap[i] = nb++;
+    }
+    for (i = 0; i < N * N * N; i++) indices[i] = remap[indices[i]];
+    data->nb_colors = nb;
+    data->last_color = 0;
+}
+
+/*
+ * Create a new tile data with a given format from an other one.
+ * Returns NULL if the data cannot be represented with this format.
+ */
+static tile_data_t *tile_data_convert(const tile_data_t *src, int format)
+{
+    tile_data_t *data;
+    int i, idx;
+    uint32_t c;
+    uint8_t *indices, values[2][4];
+    const uint8_t *v;
+    bool found[2];
+    // Small open addressing hash table of color -> index.
+    struct { uint32_t color; int idx; } table[512];
+
+    if (format == TILE_FORMAT_UNIFORM) {
+        if (!tile_data_is_uniform(src)) return NULL;
+        return tile_data_new_uniform(data_get(src, 0));
+    }
+
+    if (format == src->format) {
+        data = tile_data_new(format);
+        memcpy(data->voxels, src->voxels, tile_data_size(format) -
+                                          sizeof(*data));
+        data->nb_colors = src->nb_colors;
+        data->nb_set = src->nb_set;
+        return data;
+    }
+
+    if (format == TILE_FORMAT_RGBA) {
+        data = tile_data_new(format);
+        for (i = 0; i < N * N * N; i++)
+            memcpy(data->voxels[voxel_ofs(i)], data_get(src, i), 4);
+        data_copy_mask(data, src);
+        return data;
+    }
+
+    if (format == TILE_FORMAT_BITS) {
+        // The first empty and the first set voxels give the two values,
+        // all the others have to match them.
+        memset(values, 0, sizeof(values));
+        memset(found, 0, sizeof(found));
+        for (i = 0; i < N * N * N; i++) {
+            v = data_get(src, i);
+            idx = v[3] ? 1 : 0;
+            if (!found[idx]) {
+                memcpy(values[idx], v, 4);
+                found[idx] = true;
+            } else if (memcmp(values[idx], v, 4)) {
+                return NULL;
+            }
+        }
+        data = tile_data_new(format);
+        memcpy(BITS_VALUES(data), values, sizeof(values));
+        data_copy_mask(data, src);
+        return data;
+    }
+
+    assert(format == TILE_FORMAT_INDEXED);
+    data = tile_data_new(format);
+    if (src->format == TILE_FORMAT_UNIFORM) {
+        memcpy(INDEXED_COLORS(data)[0], src->value, 4);
+        data->nb_colors = 1;
+        data_copy_mask(data, src);
+        return data;
+    }
+    memset(table, 0xff, sizeof(table));
+    indices = INDEXED_INDICES(data);
+    for (i = 0; i < N * N * N; i++) {
+        memcpy(&c, data_get(src, i), 4);
+        for (idx = (c * 2654435761u) >> 23; ; idx = (idx + 1) % 512) {
+            if (table[idx].idx == -1 || table[idx].color == c) break;
+        }
+        if (table[idx].idx == -1) {
+            if (data->nb_colors == 256) {
+                tile_data_release(data);
+                return NULL;
+            }
+            table[idx].color = c;
+            table[idx].idx = data->nb_colors;
+            memcpy(INDEXED_COLORS(data)[data->nb_colors++], &c, 4);
+        }
+        indices[i] = table[idx].idx;
+    }
+    data_copy_mask(data, src);
+    return data;
+}
+
+static bool tile_is_empty(const tile_t *tile)
+{
+    return !tile || tile->data->nb_set == 0;
+}
+
+// Return the index of the first non empty voxel of a tile at or after
+// the index i, or -1 if there is none.
+static int tile_next_voxel(const tile_t *tile, int i)
+{
+    const uint64_t *mask;
+    uint64_t word;
+    if (tile_is_empty(tile) || i >= N * N * N) return -1;
+    if (tile->data->nb_set == N * N * N) return i;
+    mask = data_mask(tile->data);
+    word = mask[i / 64] & (~0ULL << (i % 64));
+    while (!word) {
+        i = (i / 64 + 1) * 64;
+        if (i >= N * N * N) return -1;
+        word = mask[i / 64];
+    }
+    return (i / 64) * 64 + __builtin_ctzll(word);
+}
+
+// Compute the bounding box of the non empty voxels of a tile, relative to
+// the tile position.
+static void tile_get_bbox(const tile_t *tile, int bbox[2][3])
+{
+    int r, x0, x1;
+    uint64_t bits;
+    const uint64_t *mask;
+    int ret[2][3] = {{N, N, N}, {0, 0, 0}};
+
+    if (tile->data->nb_set == N * N * N) {
+        memcpy(bbox, (int[2][3]){{0, 0, 0}, {N, N, N}}, sizeof(ret));
+        return;
+    }
+    mask = data_mask(tile->data);
+    // Each mask word contains 64 / N rows of voxels along x.
+    for (r = 0; r < N * N; r++) {
+        bits = (mask[r / (64 / N)] >> ((r % (64 / N)) * N)) &
+               ((1ULL << N) - 1);
+        if (!bits) continue;
+        x0 = __builtin_ctzll(bits);
+        x1 = 64 - __builtin_clzll(bits);
+        ret[0][0] = min(ret[0][0], x0);
+        ret[0][1] = min(ret[0][1], r % N);
+        ret[0][2] = min(ret[0][2], r / N);
+        ret[1][0] = max(ret[1][0], x1);
+        ret[1][1] = max(ret[1][1], r % N + 1);
+        ret[1][2] = max(ret[1][2], r / N + 1);
+    }
+    memcpy(bbox, ret, sizeof(ret));
+}
+
 static tile_t *tile_new(const int pos[3])
 {
-    tile_t *tile = calloc(1, sizeof(*tile));
+    tile_t *tile = pool_alloc(get_tiles_pool());
     memcpy(tile->pos, pos, sizeof(tile->pos));
+    tile->ref = 1;
     tile->data = get_empty_data();
-    tile->data->ref++;
-    tile->id = g_uid++;
+    ATOMIC_INC(tile->data->ref);
+    tile->id = new_uid();
     return tile;
 }
 
-static void tile_delete(tile_t *tile)
+static void tile_release(tile_t *tile)
 {
-    tile->data->ref--;
-    if (tile->data->ref == 0) {
-        free(tile->data);
-        g_global_stats.nb_tiles--;
-        g_global_stats.mem -= sizeof(*tile->data);
-    }
-    free(tile);
+    if (ATOMIC_DEC(tile->ref) > 0) return;
+    tile_data_release(tile->data);
+    pool_free(get_tiles_pool(), tile);
 }
 
 static tile_t *tile_copy(const tile_t *other)
 {
-    tile_t *tile = malloc(sizeof(*tile));
+    tile_t *tile = pool_alloc(get_tiles_pool());
     *tile = *other;
-    memset(&tile->hh, 0, sizeof(tile->hh));
-    tile->data->ref++;
-    tile->id = g_uid++;
+    tile->ref = 1;
+    ATOMIC_INC(tile->data->ref);
+    tile->id = new_uid();
     return tile;
 }
 
 static void tile_set_data(tile_t *tile, tile_data_t *data)
 {
-    tile->data->ref--;
-    if (tile->data->ref == 0) {
-        free(tile->data);
-        g_global_stats.nb_tiles--;
-        g_global_stats.mem -= sizeof(*tile->data);
-    }
+    ATOMIC_INC(data->ref);
+    tile_data_release(tile->data);
     tile->data = data;
-    data->ref++;
 }
 
 // Copy the data if there are any other tiles having reference to it.
+// Uniform and bits data get converted to indexed data, so that we can write
+// into it.
 static void tile_prepare_write(tile_t *tile)
 {
-    if (tile->data->ref == 1) {
-        tile->data->id = ++g_uid;
+    tile_data_t *data = tile->data;
+    if (    data->ref == 1 && !data->store &&
+            data->format != TILE_FORMAT_UNIFORM &&
+            data->format != TILE_FORMAT_BITS) {
+        data->id = new_uid();
+        data->has_hash = 0;
         return;
     }
-    tile->data->ref--;
-    tile_data_t *data;
-    data = calloc(1, sizeof(*tile->data));
-    memcpy(data->voxels, tile->data->voxels, N * N * N * 4);
-    data->ref = 1;
-    tile->data = data;
-    tile->data->id = ++g_uid;
+    tile->data = tile_data_convert(data,
+            data->format == TILE_FORMAT_RGBA ? TILE_FORMAT_RGBA :
+                                               TILE_FORMAT_INDEXED);
+    tile_data_release(data);
+}
+
+// Set a voxel of a tile that has been prepared for writing.
+static void tile_set_voxel(tile_t *tile, int i, const uint8_t v[4])
+{
+    tile_data_t *data = tile->data, *rgba;
+    int idx;
+
+    data_set_mask(data, i, v[3]);
+    if (data->format == TILE_FORMAT_INDEXED) {
+        idx = indexed_find_color(data, v);
+        if (idx == -1 && data->nb_colors == 256)
+            indexed_remove_unused_colors(data);
+        if (idx == -1 && data->nb_colors < 256) {
+            idx = data->nb_colors++;
+            memcpy(INDEXED_COLORS(data)[idx], v, 4);
+        }
+        if (idx != -1) {
+            INDEXED_INDICES(data)[i] = idx;
+            data->last_color = idx;
+            return;
+        }
+        // Too many colors, switch to RGBA.
+        rgba = tile_data_convert(data, TILE_FORMAT_RGBA);
+        tile_data_release(data);
+        tile->data = data = rgba;
+    }
+    assert(data->format == TILE_FORMAT_RGBA);
+    memcpy(data->voxels[voxel_ofs(i)], v, 4);
+}
+
+// Replace the tile data with the most compact format that can represent it.
+// Same as tile_compact, but directly on a tile data reference.
+static tile_data_t *tile_data_compact(tile_data_t *data)
+{
+    tile_data_t *ret = NULL;
+    if (data->format == TILE_FORMAT_UNIFORM) return data;
+    ret = tile_data_convert(data, TILE_FORMAT_UNIFORM);
+    if (!ret && data->format != TILE_FORMAT_BITS)
+        ret = tile_data_convert(data, TILE_FORMAT_BITS);
+    if (!ret && data->format == TILE_FORMAT_RGBA)
+        ret = tile_data_convert(data, TILE_FORMAT_INDEXED);
+    if (!ret) return data;
+    tile_data_release(data);
+    return ret;
+}
 
-    g_global_stats.nb_tiles++;
-    g_global_stats.mem += sizeof(*tile->data);
+static void tile_compact(tile_t *tile)
+{
+    tile->data = tile_data_compact(tile->data);
 }
 
 static void tile_get_at(const tile_t *tile, const int pos[3],
@@ -230,149 +944,584 @@ static void tile_get_at(const tile_t *tile, const int pos[3],
     assert(x >= 0 && x < N);
     assert(y >= 0 && y < N);
     assert(z >= 0 && z < N);
-    memcpy(out, TILE_AT(tile, x, y, z), 4);
+    memcpy(out, data_get_at(tile->data, x, y, z), 4);
 }
 
-/*
- * Function: volume_get_bbox
- *
- * Get the bounding box of a volume.
- *
- * Inputs:
- *   volume   - The volume
- *   exact  - If true, compute the exact bounding box.  If false, returns
- *            an approximation that might be slightly bigger than the
- *            actual box, but faster to compute.
- *
- * Outputs:
- *   bbox  - The bounding box as the bottom left and top right corner of
- *           the volume.  If the volume is empty, this will contain all zero.
- *
- * Returns:
- *   true if the volume is not empty.
- */
-bool volume_get_bbox(const volume_t *volume, int bbox[2][3], bool exact)
+// Pack a tile position into a single 64 bits key.
+static inline uint64_t tile_pos_key(const int pos[3])
 {
-    tile_t *tile;
-    int ret[2][3] = {{INT_MAX, INT_MAX, INT_MAX},
-                     {INT_MIN, INT_MIN, INT_MIN}};
-    int pos[3];
-    volume_iterator_t iter;
-    bool empty = false;
-
-    if (!exact) {
-        for (tile = volume->tiles; tile; tile = tile->hh.next) {
-            if (tile_is_empty(tile, true)) continue;
-            ret[0][0] = min(ret[0][0], tile->pos[0]);
-            ret[0][1] = min(ret[0][1], tile->pos[1]);
-            ret[0][2] = min(ret[0][2], tile->pos[2]);
-            ret[1][0] = max(ret[1][0], tile->pos[0] + N);
-            ret[1][1] = max(ret[1][1], tile->pos[1] + N);
-            ret[1][2] = max(ret[1][2], tile->pos[1] + N);
-        }
-    } else {
-        iter = volume_get_iterator(volume, VOLUME_ITER_SKIP_EMPTY);
-        while (volume_iter(&iter, pos)) {
-            if (!volume_get_alpha_at(volume, &iter, pos)) continue;
-            ret[0][0] = min(ret[0][0], pos[0]);
-            ret[0][1] = min(ret[0][1], pos[1]);
-            ret[0][2] = min(ret[0][2], pos[2]);
-            ret[1][0] = max(ret[1][0], pos[0] + 1);
-            ret[1][1] = max(ret[1][1], pos[1] + 1);
-            ret[1][2] = max(ret[1][2], pos[2] + 1);
-        }
-    }
-    empty = ret[0][0] >= ret[1][0];
-    if (empty) memset(ret, 0, sizeof(ret));
-    memcpy(bbox, ret, sizeof(ret));
-    return !empty;
+    const uint64_t mask = (1 << 21) - 1;
+    return (((uint64_t)(pos[0] >> TILE_BITS) & mask) << 42) |
+           (((uint64_t)(pos[1] >> TILE_BITS) & mask) << 21) |
+           (((uint64_t)(pos[2] >> TILE_BITS) & mask) <<  0);
 }
 
-static void volume_prepare_write(volume_t *volume)
+// Pack the position of the brick containing a tile into a 64 bits key.
+static inline uint64_t brick_pos_key(const int pos[3])
 {
-    tile_t *tiles, *tile, *new_tile;
-    assert(*volume->tiles_ref > 0);
-    volume->key = g_uid++;
-    if (*volume->tiles_ref == 1)
-        return;
-    (*volume->tiles_ref)--;
-    volume->tiles_ref = calloc(1, sizeof(*volume->tiles_ref));
-    *volume->tiles_ref = 1;
-    tiles = volume->tiles;
-    volume->tiles = NULL;
-    for (tile = tiles; tile; tile = tile->hh.next) {
-        tile->id = g_uid++; // Invalidate all accessors.
-        new_tile = tile_copy(tile);
-        HASH_ADD(hh, volume->tiles, pos, sizeof(new_tile->pos), new_tile);
-    }
-    g_global_stats.nb_volumes++;
+    const uint64_t mask = (1 << 21) - 1;
+    const int shift = TILE_BITS + BRICK_BITS;
+    return (((uint64_t)(pos[0] >> shift) & mask) << 42) |
+           (((uint64_t)(pos[1] >> shift) & mask) << 21) |
+           (((uint64_t)(pos[2] >> shift) & mask) <<  0);
 }
 
-static tile_t *volume_add_tile(volume_t *volume, const int pos[3]);
-
-static void volume_add_neighbors_tiles(volume_t *volume)
+static inline uint32_t tile_key_hash(uint64_t key)
 {
-    const int POS[6][3] = {
-        {0, 0, -1}, {0, 0, +1},
-        {0, -1, 0}, {0, +1, 0},
-        {-1, 0, 0}, {+1, 0, 0},
-    };
-    int i, p[3] = {};
-    uint64_t key = volume->key;
-    tile_t *tile, *tmp, *other;
+    key ^= key >> 33;
+    key *= 0xff51afd7ed558ccdULL;
+    key ^= key >> 33;
+    return (uint32_t)key;
+}
 
-    volume_prepare_write(volume);
-    HASH_ITER(hh, volume->tiles, tile, tmp) {
-        if (tile_is_empty(tile, true)) continue;
-        for (i = 0; i < 6; i++) {
-            p[0] = tile->pos[0] + POS[i][0] * N;
-            p[1] = tile->pos[1] + POS[i][1] * N;
-            p[2] = tile->pos[2] + POS[i][2] * N;
-            HASH_FIND(hh, volume->tiles, p, 3 * sizeof(int), other);
-            if (!other) volume_add_tile(volume, p);
-        }
-    }
-    // Adding empty tiles shouldn't change the key of the volume.
-    volume->key = key;
+static tiles_table_t *tiles_table_new(void)
+{
+    tiles_table_t *table = calloc(1, sizeof(*table));
+    table->ref = 1;
+    return table;
 }
 
-void volume_remove_empty_tiles(volume_t *volume, bool fast)
+// Return the slot of a given key, or the empty slot where it should be
+// inserted if the key is not in the table.
+static tile_slot_t *tiles_table_find_slot(const tiles_table_t *table,
+                                          uint64_t key)
 {
-    tile_t *tile, *tmp;
-    uint64_t key = volume->key;
-    volume_prepare_write(volume);
-    HASH_ITER(hh, volume->tiles, tile, tmp) {
-        if (tile_is_empty(tile, false)) {
-            HASH_DEL(volume->tiles, tile);
-            assert(volume->tiles != tile);
-            tile_delete(tile);
-        }
+    uint32_t i, mask = table->slots_size - 1;
+    tile_slot_t *slot;
+    for (i = tile_key_hash(key) & mask; ; i = (i + 1) & mask) {
+        slot = &table->slots[i];
+        if (slot->idx == SLOT_EMPTY) return slot;
+        if (slot->idx != SLOT_DEL && slot->key == key) return slot;
     }
-    // Empty tiles shouldn't change the key of the volume.
-    volume->key = key;
 }
 
-bool volume_is_empty(const volume_t *volume)
+// Return the index of a tile in the table, or -1.
+static int tiles_table_find_idx(const tiles_table_t *table, const int pos[3])
 {
-    return volume == NULL || volume->tiles == NULL;
+    tile_slot_t *slot;
+    if (!table->count) return -1;
+    slot = tiles_table_find_slot(table, tile_pos_key(pos));
+    return slot->idx >= 0 ? slot->idx : -1;
 }
 
-volume_t *volume_new(void)
+static void tiles_table_unpack(tiles_table_t *table);
+
+static tile_t *tiles_table_find(const tiles_table_t *table, const int pos[3])
+{
+    int idx;
+    if (table->nb_packed) tiles_table_unpack((tiles_table_t*)table);
+    idx = tiles_table_find_idx(table, pos);
+    return idx >= 0 ? table->tiles[idx] : NULL;
+}
+
+// Rebuild the slots array with a given size.  This removes the tombstones,
+// but doesn't change the tiles indices, so it is safe to call while
+// iterating the table.
+static void tiles_table_rehash(tiles_table_t *table, int size)
+{
+    int i;
+    tile_slot_t *slot;
+    uint64_t key;
+
+    free(table->slots);
+    table->slots_size = size;
+    table->slots_used = table->count;
+    table->slots = malloc(size * sizeof(*table->slots));
+    for (i = 0; i < size; i++) table->slots[i].idx = SLOT_EMPTY;
+    for (i = 0; i < table->nb; i++) {
+        if (!table->tiles[i]) continue;
+        key = tile_pos_key(table->tiles[i]->pos);
+        slot = tiles_table_find_slot(table, key);
+        slot->key = key;
+        slot->idx = i;
+    }
+}
+
+// Remove the holes from the tiles array.
+static void tiles_table_compact(tiles_table_t *table)
+{
+    int i, nb = 0;
+    for (i = 0; i < table->nb; i++) {
+        if (table->tiles[i]) table->tiles[nb++] = table->tiles[i];
+    }
+    assert(nb == table->count);
+    table->nb = nb;
+    tiles_table_rehash(table, table->slots_size);
+}
+
+static brick_slot_t *bricks_find_slot(const tiles_table_t *table,
+                                      uint64_t key)
+{
+    uint32_t i, mask = table->bricks_size - 1;
+    brick_slot_t *slot;
+    for (i = tile_key_hash(key) & mask; ; i = (i + 1) & mask) {
+        slot = &table->bricks[i];
+        if (slot->count == SLOT_EMPTY || slot->key == key) return slot;
+    }
+}
+
+// Change the tiles count of the brick containing a tile position.
+static void bricks_update(tiles_table_t *table, const int pos[3], int delta)
+{
+    brick_slot_t *slot;
+    uint64_t key = brick_pos_key(pos);
+    slot = bricks_find_slot(table, key);
+    if (slot->count == SLOT_EMPTY) {
+        slot->key = key;
+        slot->count = 0;
+        table->bricks_used++;
+    }
+    if (slot->count == 0) table->bricks_count++;
+    slot->count += delta;
+    if (slot->count == 0) table->bricks_count--;
+    assert(slot->count >= 0);
+}
+
+// Rebuild the bricks index from the tiles, dropping the emptied bricks.
+static void bricks_rehash(tiles_table_t *table)
+{
+    int i, size = 16;
+    while (size < (table->bricks_count + 1) * 2) size *= 2;
+    free(table->bricks);
+    table->bricks_size = size;
+    table->bricks_used = table->bricks_count = 0;
+    table->bricks = malloc(size * sizeof(*table->bricks));
+    for (i = 0; i < size; i++) table->bricks[i].count = SLOT_EMPTY;
+    for (i = 0; i < table->nb; i++) {
+        if (table->tiles[i]) bricks_update(table, table->tiles[i]->pos, 1);
+    }
+}
+
+// Return true if there are no tiles in the brick of a tile position.
+static bool tiles_table_brick_is_empty(const tiles_table_t *table,
+                                       const int pos[3])
+{
+    if (!table->count) return true;
+    return bricks_find_slot(table, brick_pos_key(pos))->count <= 0;
+}
+
+static void tiles_table_add(tiles_table_t *table, tile_t *tile)
+{
+    tile_slot_t *slot;
+    uint64_t key = tile_pos_key(tile->pos);
+    int size;
+
+    if (table->nb == table->capacity) {
+        if (table->nb - table->count > table->count) {
+            tiles_table_compact(table);
+        } else {
+            table->capacity = table->capacity ? table->capacity * 2 : 8;
+            table->tiles = realloc(table->tiles,
+                                   table->capacity * sizeof(*table->tiles));
+        }
+    }
+    // Keep the load factor under 3/4.
+    if ((table->slots_used + 1) * 4 > table->slots_size * 3) {
+        size = 16;
+        while (size < (table->count + 1) * 2) size *= 2;
+        tiles_table_rehash(table, size);
+    }
+    if ((table->bricks_used + 1) * 4 > table->bricks_size * 3)
+        bricks_rehash(table);
+    slot = tiles_table_find_slot(table, key);
+    assert(slot->idx == SLOT_EMPTY);
+    slot->key = key;
+    slot->idx = table->nb;
+    table->tiles[table->nb++] = tile;
+    table->slots_used++;
+    table->count++;
+    bricks_update(table, tile->pos, 1);
+}
+
+static void tiles_table_remove(tiles_table_t *table, tile_t *tile)
+{
+    tile_slot_t *slot;
+    slot = tiles_table_find_slot(table, tile_pos_key(tile->pos));
+    assert(slot->idx >= 0 && table->tiles[slot->idx] == tile);
+    table->tiles[slot->idx] = NULL;
+    slot->idx = SLOT_DEL;
+    table->count--;
+    bricks_update(table, tile->pos, -1);
+    // The tile can still be used by other tables, make sure that no
+    // accessor keeps using it for this one.
+    if (tile->ref > 1) tile->id = new_uid();
+}
+
+// Return the first tile at or after a given index of the tiles array, and
+// set the index to its position.
+static tile_t *tiles_table_next(const tiles_table_t *table, int *idx)
+{
+    if (table->nb_packed) tiles_table_unpack((tiles_table_t*)table);
+    for (; *idx < table->nb; (*idx)++) {
+        if (table->tiles[*idx]) return table->tiles[*idx];
+    }
+    return NULL;
+}
+
+// Delete all the tiles in a table.
+static void tiles_table_clear(tiles_table_t *table)
+{
+    int i;
+    for (i = 0; i < table->nb; i++) {
+        if (table->tiles[i]) tile_release(table->tiles[i]);
+    }
+    free(table->tiles);
+    free(table->slots);
+    free(table->bricks);
+    table->tiles = NULL;
+    table->slots = NULL;
+    table->bricks = NULL;
+    table->count = table->nb = table->capacity = 0;
+    table->slots_used = table->slots_size = 0;
+    table->nb_packed = 0;
+    table->bricks_count = table->bricks_used = table->bricks_size = 0;
+}
+
+// Allocate a copy of an array, or return NULL if it is empty.
+static void *array_dup(const void *src, size_t size)
+{
+    void *ret;
+    if (!size) return NULL;
+    ret = malloc(size);
+    memcpy(ret, src, size);
+    return ret;
+}
+
+// Create a copy of a table, sharing the same tiles.
+static tiles_table_t *tiles_table_copy(const tiles_table_t *other)
+{
+    int i;
+    tiles_table_t *table;
+    if (other->nb_packed) tiles_table_unpack((tiles_table_t*)other);
+    table = tiles_table_new();
+    table->count = other->count;
+    table->nb = other->nb;
+    table->capacity = other->nb;
+    table->slots_used = other->slots_used;
+    table->slots_size = other->slots_size;
+    table->tiles = array_dup(other->tiles, table->nb * sizeof(*table->tiles));
+    table->slots = array_dup(other->slots,
+                             table->slots_size * sizeof(*table->slots));
+    table->bricks_count = other->bricks_count;
+    table->bricks_used = other->bricks_used;
+    table->bricks_size = other->bricks_size;
+    table->bricks = array_dup(other->bricks,
+                              table->bricks_size * sizeof(*table->bricks));
+    for (i = 0; i < table->nb; i++) {
+        if (table->tiles[i]) ATOMIC_INC(table->tiles[i]->ref);
+    }
+    return table;
+}
+
+// Make sure that a tile of a table is not shared with any other table
+// before we write into it, and return the tile to write to.  The shared
+// tile gets a new id, so that no accessor keeps using it for this table.
+static tile_t *tiles_table_own(tiles_table_t *table, tile_t *tile,
+                               volume_accessor_t *it)
+{
+    tile_t *copy;
+    int idx;
+
+    if (tile->ref == 1) return tile;
+    idx = tiles_table_find_idx(table, tile->pos);
+    assert(idx >= 0 && table->tiles[idx] == tile);
+    copy = tile_copy(tile);
+    table->tiles[idx] = copy;
+    tile->id = new_uid();
+    tile_release(tile);
+    if (it && it->tile == tile) {
+        it->tile = copy;
+        it->tile_id = copy->id;
+    }
+    return copy;
+}
+
+// Release a reference to a table, and delete it if it was the last one.
+static void tiles_table_release(tiles_table_t *table)
+{
+    if (ATOMIC_DEC(table->ref) > 0) return;
+    tiles_table_clear(table);
+    free(table);
+    ATOMIC_ADD(g_global_stats.nb_volumes, -1);
+}
+
+// Read the payload of a packed data from the spill file.
+static bool spill_read(const packed_t *packed, uint8_t *out)
+{
+    return fseek(g_spill.file, packed->spill_ofs, SEEK_SET) == 0 &&
+           fread(out, packed->size, 1, g_spill.file) == 1;
+}
+
+// Move the payload of a packed data into the spill file.
+static tile_data_t *spill_write(tile_data_t *data)
+{
+    packed_t *packed = PACKED(data);
+    tile_data_t *ret;
+    int64_t ofs;
+
+    if (!g_spill.file) g_spill.file = tmpfile();
+    if (!g_spill.file) return data;
+    ofs = spill_alloc(packed->size);
+    if (    fseek(g_spill.file, ofs, SEEK_SET) != 0 ||
+            fwrite(packed->payload, packed->size, 1, g_spill.file) != 1) {
+        spill_free(ofs, packed->size);
+        return data;
+    }
+    ret = malloc(sizeof(*ret) + sizeof(packed_t));
+    memcpy(ret, data, sizeof(*ret) + sizeof(packed_t));
+    PACKED(ret)->spill_ofs = ofs;
+    ATOMIC_ADD(g_global_stats.packed_mem, -packed->size);
+    ATOMIC_ADD(g_global_stats.spilled_mem, packed->size);
+    free(data);
+    return ret;
+}
+
+// Get back the original data of a packed data.
+static tile_data_t *packed_data_unpack(const tile_data_t *data)
+{
+    const packed_t *packed = PACKED(data);
+    tile_data_t *ret;
+    const uint8_t *payload = packed->payload;
+    uint8_t *buf = NULL;
+    size_t size = tile_data_size(packed->format) - sizeof(*ret);
+    bool ok;
+
+    ret = tile_data_new(packed->format);
+    ret->id = data->id;
+    ret->has_hash = data->has_hash;
+    memcpy(ret->hash, data->hash, sizeof(ret->hash));
+    ret->nb_colors = data->nb_colors;
+    ret->nb_set = data->nb_set;
+    if (packed->spill_ofs >= 0) {
+        buf = malloc(packed->size);
+        ok = spill_read(packed, buf);
+        assert(ok);
+        payload = buf;
+    }
+    if (packed->compressed) {
+        ok = img_zlib_decompress(payload, packed->size,
+                                 (uint8_t*)ret->voxels, size) == (int)size;
+        assert(ok);
+    } else {
+        memcpy(ret->voxels, payload, size);
+    }
+    (void)ok;
+    free(buf);
+    return ret;
+}
+
+static void tiles_table_unpack(tiles_table_t *table)
+{
+    int i;
+    tile_t *tile;
+    tile_data_t *data;
+
+    for (i = 0; i < table->nb; i++) {
+        tile = table->tiles[i];
+        if (!tile || tile->data->format != TILE_FORMAT_PACKED) continue;
+        data = packed_data_unpack(tile->data);
+        tile_data_release(tile->data);
+        tile->data = data;
+    }
+    table->nb_packed = 0;
+}
+
+typedef struct {
+    tile_t      *tile;
+    uint8_t     *payload;
+    int         size;
+    bool        compressed;
+} pack_item_t;
+
+static void pack_job(void *user, int i, int worker)
+{
+    pack_item_t *item = (pack_item_t*)user + i;
+    const tile_data_t *data = item->tile->data;
+    int size = tile_data_size(data->format) - sizeof(*data);
+
+    item->payload = img_zlib_compress((const uint8_t*)data->voxels, size,
+                                      &item->size);
+    item->compressed = true;
+    if (item->payload && item->size < size) return;
+    // No gain, keep the raw payload.
+    free(item->payload);
+    item->payload = malloc(size);
+    memcpy(item->payload, data->voxels, size);
+    item->size = size;
+    item->compressed = false;
+}
+
+int64_t volume_pack(volume_t *volume, bool spill)
+{
+    tiles_table_t *table = volume->tiles;
+    tile_t *tile;
+    tile_data_t *data;
+    pack_item_t *items = NULL;
+    int i, nb = 0;
+    int64_t released = 0;
+
+    // We can only pack the data that are not shared with any other volume.
+    if (table->ref > 1) return 0;
+    items = calloc(table->nb, sizeof(*items));
+    for (i = 0; i < table->nb; i++) {
+        tile = table->tiles[i];
+        if (!tile || tile->ref > 1 || tile->data->ref > 1) continue;
+        if (    tile->data->format != TILE_FORMAT_RGBA &&
+                tile->data->format != TILE_FORMAT_INDEXED) continue;
+        items[nb++].tile = tile;
+    }
+    jobs_parallel_for(nb, pack_job, items);
+
+    for (i = 0; i < nb; i++) {
+        tile = items[i].tile;
+        // Keep the data that don't compress in memory.
+        if (!spill && !items[i].compressed) {
+            free(items[i].payload);
+            continue;
+        }
+        data = malloc(sizeof(*data) + sizeof(packed_t) + items[i].size);
+        *data = (tile_data_t) {
+            .ref = 1,
+            .id = tile->data->id,
+            .format = TILE_FORMAT_PACKED,
+            .nb_colors = tile->data->nb_colors,
+            .nb_set = tile->data->nb_set,
+            .has_hash = tile->data->has_hash,
+            .hash = {tile->data->hash[0], tile->data->hash[1]},
+        };
+        *PACKED(data) = (packed_t) {
+            .format = tile->data->format,
+            .size = items[i].size,
+            .compressed = items[i].compressed,
+            .spill_ofs = -1,
+        };
+        memcpy(PACKED(data)->payload, items[i].payload, items[i].size);
+        free(items[i].payload);
+        ATOMIC_ADD(g_global_stats.packed_mem, items[i].size);
+        ATOMIC_ADD(g_global_stats.nb_tiles, 1);
+        released += tile_data_size(tile->data->format) - items[i].size;
+        tile_data_release(tile->data);
+        tile->data = data;
+        table->nb_packed++;
+    }
+    free(items);
+
+    if (spill) {
+        for (i = 0; i < table->nb; i++) {
+            tile = table->tiles[i];
+            if (!tile || tile->data->format != TILE_FORMAT_PACKED) continue;
+            if (PACKED(tile->data)->spill_ofs >= 0) continue;
+            released += PACKED(tile->data)->size;
+            tile->data = spill_write(tile->data);
+        }
+    }
+    return released;
+}
+
+/*
+ * Function: volume_get_bbox
+ *
+ * Get the bounding box of a volume.
+ *
+ * Inputs:
+ *   volume   - The volume
+ *   exact  - If true, compute the exact bounding box.  If false, returns
+ *            an approximation that might be slightly bigger than the
+ *            actual box, but faster to compute.
+ *
+ * Outputs:
+ *   bbox  - The bounding box as the bottom left and top right corner of
+ *           the volume.  If the volume is empty, this will contain all zero.
+ *
+ * Returns:
+ *   true if the volume is not empty.
+ */
+bool volume_get_bbox(const volume_t *volume, int bbox[2][3], bool exact)
+{
+    tile_t *tile;
+    int ret[2][3] = {{INT_MAX, INT_MAX, INT_MAX},
+                     {INT_MIN, INT_MIN, INT_MIN}};
+    int i, j, tile_bbox[2][3] = {{0, 0, 0}, {N, N, N}};
+    bool empty = false;
+
+    for (i = 0; (tile = tiles_table_next(volume->tiles, &i)); i++) {
+        if (tile_is_empty(tile)) continue;
+        if (exact) tile_get_bbox(tile, tile_bbox);
+        for (j = 0; j < 3; j++) {
+            ret[0][j] = min(ret[0][j], tile->pos[j] + tile_bbox[0][j]);
+            ret[1][j] = max(ret[1][j], tile->pos[j] + tile_bbox[1][j]);
+        }
+    }
+    empty = ret[0][0] >= ret[1][0];
+    if (empty) memset(ret, 0, sizeof(ret));
+    memcpy(bbox, ret, sizeof(ret));
+    return !empty;
+}
+
+static void volume_prepare_write(volume_t *volume)
+{
+    tiles_table_t *tiles;
+    assert(volume->tiles->ref > 0);
+    volume->key = new_uid();
+    if (volume->tiles->ref == 1)
+        return;
+    // The tiles stay shared, and keep their ids until we write into them,
+    // so the accessors remain valid.
+    tiles = volume->tiles;
+    volume->tiles = tiles_table_copy(tiles);
+    ATOMIC_ADD(g_global_stats.nb_volumes, 1);
+    // Release after the copy, in case an other volume released the table
+    // in the meantime.
+    tiles_table_release(tiles);
+}
+
+void volume_remove_empty_tiles(volume_t *volume, bool fast)
+{
+    tile_t *tile;
+    int i;
+    uint64_t key = volume->key;
+    volume_prepare_write(volume);
+    for (i = 0; (tile = tiles_table_next(volume->tiles, &i)); i++) {
+        if (tile_is_empty(tile)) {
+            tiles_table_remove(volume->tiles, tile);
+            tile_release(tile);
+        } else if (!fast) {
+            tile = tiles_table_own(volume->tiles, tile, NULL);
+            tile_compact(tile);
+        }
+    }
+    // Empty tiles shouldn't change the key of the volume.
+    volume->key = key;
+}
+
+bool volume_is_empty(const volume_t *volume)
+{
+    tile_t *tile;
+    int i;
+    if (!volume) return true;
+    for (i = 0; (tile = tiles_table_next(volume->tiles, &i)); i++) {
+        if (!tile_is_empty(tile)) return false;
+    }
+    return true;
+}
+
+volume_t *volume_new(void)
 {
     volume_t *volume;
     volume = calloc(1, sizeof(*volume));
     volume->ref = 1;
-    volume->tiles_ref = calloc(1, sizeof(*volume->tiles_ref));
+    volume->tiles = tiles_table_new();
     volume->key = 1; // Empty volume key.
-    *volume->tiles_ref = 1;
-    g_global_stats.nb_volumes++;
+    ATOMIC_ADD(g_global_stats.nb_volumes, 1);
     return volume;
 }
 
 volume_t *volume_dup(const volume_t *volume)
 {
     volume_t *ret = (volume_t*)volume;
-    ret->ref++;
+    // Unpack now, since the volume could then be used from other threads.
+    if (ret->tiles->nb_packed) tiles_table_unpack(ret->tiles);
+    ATOMIC_INC(ret->ref);
     return ret;
 }
 
@@ -418,36 +1567,27 @@ volume_accessor_t volume_get_accessor(const volume_t *volume)
     return (volume_accessor_t){0};
 }
 
+volume_accessor_t volume_get_neighbors_accessor(const volume_t *volume)
+{
+    return (volume_accessor_t){.flags = VOLUME_ACCESSOR_NEIGHBORS};
+}
+
 
 void volume_clear(volume_t *volume)
 {
     assert(volume);
-    tile_t *tile, *tmp;
     volume_prepare_write(volume);
-    HASH_ITER(hh, volume->tiles, tile, tmp) {
-        HASH_DEL(volume->tiles, tile);
-        assert(volume->tiles != tile);
-        tile_delete(tile);
-    }
+    tiles_table_clear(volume->tiles);
     volume->key = 1; // Empty volume key.
-    volume->tiles = NULL;
+    journal_reset(volume);
 }
 
 void volume_delete(volume_t *volume)
 {
-    tile_t *tile, *tmp;
     if (!volume) return;
-    if (--volume->ref > 0) return;
-    (*volume->tiles_ref)--;
-    if (*volume->tiles_ref == 0) {
-        HASH_ITER(hh, volume->tiles, tile, tmp) {
-            HASH_DEL(volume->tiles, tile);
-            assert(volume->tiles != tile);
-            tile_delete(tile);
-        }
-        free(volume->tiles_ref);
-        g_global_stats.nb_volumes--;
-    }
+    if (ATOMIC_DEC(volume->ref) > 0) return;
+    tiles_table_release(volume->tiles);
+    free(volume->journal);
     free(volume);
 }
 
@@ -456,34 +1596,33 @@ volume_t *volume_copy(const volume_t *volume)
     volume_t *ret;
 
     if (!volume) return volume_new();
+    // Unpack now, since the copy could then be used from other threads.
+    if (volume->tiles->nb_packed) tiles_table_unpack(volume->tiles);
     ret = calloc(1, sizeof(*volume));
     ret->ref = 1;
     ret->tiles = volume->tiles;
-    ret->tiles_ref = volume->tiles_ref;
     ret->key = volume->key;
-    (*ret->tiles_ref)++;
+    ATOMIC_INC(ret->tiles->ref);
     return ret;
 }
 
+static void journal_diff_func(void *user, const int pos[3], int change)
+{
+    journal_add(user, pos);
+}
+
 void volume_set(volume_t *volume, const volume_t *other)
 {
-    tile_t *tile, *tmp;
     assert(volume && other);
     if (volume->tiles == other->tiles) return; // Already the same.
-    (*volume->tiles_ref)--;
-    if (*volume->tiles_ref == 0) {
-        HASH_ITER(hh, volume->tiles, tile, tmp) {
-            HASH_DEL(volume->tiles, tile);
-            assert(volume->tiles != tile);
-            tile_delete(tile);
-        }
-        free(volume->tiles_ref);
-        g_global_stats.nb_volumes--;
-    }
+    // Only journal the tiles that differ, so that the consumers don't have
+    // to update everything after an edit committed with volume_set.
+    if (volume->journal) volume_diff(volume, other, journal_diff_func, volume);
+    if (other->tiles->nb_packed) tiles_table_unpack(other->tiles);
+    ATOMIC_INC(other->tiles->ref);
+    tiles_table_release(volume->tiles);
     volume->tiles = other->tiles;
-    volume->tiles_ref = other->tiles_ref;
     volume->key = other->key;
-    (*volume->tiles_ref)++;
 }
 
 static uint64_t get_tile_id(const tile_t *tile)
@@ -491,6 +1630,37 @@ static uint64_t get_tile_id(const tile_t *tile)
     return tile ? tile->id : 1;
 }
 
+// Index of a tile in the neighbors cache of an accessor.  The tiles are
+// indexed by their coordinates modulo 3, so that all the tiles of a 3x3x3
+// neighborhood have different slots, whatever its position.  The offset is
+// a multiple of 3 that makes all the coordinates positive.
+static inline int neighbors_slot(const int pos[3])
+{
+    int x, y, z;
+    x = (int)(((unsigned)(pos[0] >> TILE_BITS) + 0x80000001u) % 3);
+    y = (int)(((unsigned)(pos[1] >> TILE_BITS) + 0x80000001u) % 3);
+    z = (int)(((unsigned)(pos[2] >> TILE_BITS) + 0x80000001u) % 3);
+    return x + y * 3 + z * 9;
+}
+
+// Find a tile using the neighbors cache of an accessor.
+static tile_t *neighbors_find(const volume_t *volume, volume_accessor_t *it,
+                              const int pos[3])
+{
+    int i = neighbors_slot(pos);
+    tile_t *tile = it->neighbors.tiles[i];
+
+    if (    it->neighbors.ids[i] &&
+            it->neighbors.ids[i] == (tile ? tile->id : volume->key) &&
+            vec3_equal(it->neighbors.pos[i], pos))
+        return tile;
+    tile = tiles_table_find(volume->tiles, pos);
+    it->neighbors.tiles[i] = tile;
+    it->neighbors.ids[i] = tile ? tile->id : volume->key;
+    vec3_copy(pos, it->neighbors.pos[i]);
+    return tile;
+}
+
 static tile_t *volume_get_tile_at(const volume_t *volume, const int pos[3],
                                   volume_accessor_t *it)
 {
@@ -499,16 +1669,16 @@ static tile_t *volume_get_tile_at(const volume_t *volume, const int pos[3],
     p[0] = pos[0] & ~(int)(N - 1);
     p[1] = pos[1] & ~(int)(N - 1);
     p[2] = pos[2] & ~(int)(N - 1);
-    if (!it) {
-        HASH_FIND(hh, volume->tiles, p, sizeof(p), tile);
-        return tile;
-    }
+    if (!it) return tiles_table_find(volume->tiles, p);
 
     if (    it->tile_id && it->tile_id == get_tile_id(it->tile) &&
             vec3_equal(it->tile_pos, p)) {
         return it->tile;
     }
-    HASH_FIND(hh, volume->tiles, p, sizeof(p), tile);
+    if (it->flags & VOLUME_ACCESSOR_NEIGHBORS)
+        tile = neighbors_find(volume, it, p);
+    else
+        tile = tiles_table_find(volume->tiles, p);
     it->tile = tile;
     it->tile_id = get_tile_id(tile);
     vec3_copy(p, it->tile_pos);
@@ -524,7 +1694,7 @@ static tile_t *volume_add_tile(volume_t *volume, const int pos[3])
     assert(!volume_get_tile_at(volume, pos, NULL));
     volume_prepare_write(volume);
     tile = tile_new(pos);
-    HASH_ADD(hh, volume->tiles, pos, sizeof(tile->pos), tile);
+    tiles_table_add(volume->tiles, tile);
     return tile;
 }
 
@@ -544,7 +1714,8 @@ void volume_get_at(const volume_t *volume, volume_iterator_t *it,
             if (!it->tile)
                 memset(out, 0, 4);
             else
-                memcpy(out, TILE_AT(it->tile, p[0], p[1], p[2]), 4);
+                memcpy(out, data_get_at(it->tile->data, p[0], p[1], p[2]),
+                       4);
             return;
         }
     }
@@ -572,6 +1743,8 @@ void volume_set_at(volume_t *volume, volume_iterator_t *iter,
         }
     }
 
+    tile = tiles_table_own(volume->tiles, tile, iter);
+    journal_add(volume, tile->pos);
     tile_prepare_write(tile);
     p[0] = pos[0] - tile->pos[0];
     p[1] = pos[1] - tile->pos[1];
@@ -579,7 +1752,7 @@ void volume_set_at(volume_t *volume, volume_iterator_t *iter,
     assert(p[0] >= 0 && p[0] < N);
     assert(p[1] >= 0 && p[1] < N);
     assert(p[2] >= 0 && p[2] < N);
-    memcpy(TILE_AT(tile, p[0], p[1], p[2]), v, 4);
+    tile_set_voxel(tile, p[0] + p[1] * N + p[2] * N * N, v);
 }
 
 void volume_clear_tile(volume_t *volume, volume_iterator_t *it, const int pos[3])
@@ -588,10 +1761,13 @@ void volume_clear_tile(volume_t *volume, volume_iterator_t *it, const int pos[3]
     volume_prepare_write(volume);
     tile = volume_get_tile_at(volume, pos, it);
     if (!tile) return;
-    HASH_DEL(volume->tiles, tile);
-    assert(volume->tiles != tile);
-    tile_delete(tile);
-    if (it) it->tile = NULL;
+    journal_add(volume, tile->pos);
+    tiles_table_remove(volume->tiles, tile);
+    tile_release(tile);
+    if (it) {
+        it->tile = NULL;
+        memset(it->neighbors.ids, 0, sizeof(it->neighbors.ids));
+    }
 }
 
 
@@ -599,6 +1775,8 @@ static bool volume_iter_next_tile_box(volume_iterator_t *it)
 {
     int i;
     const volume_t *volume = it->volume;
+    bool skip_empty = it->flags & VOLUME_ITER_SKIP_EMPTY;
+
     if (!it->tile_id) {
         it->tile_pos[0] = it->bbox[0][0] & ~(int)(N - 1);
         it->tile_pos[1] = it->bbox[0][1] & ~(int)(N - 1);
@@ -606,6 +1784,7 @@ static bool volume_iter_next_tile_box(volume_iterator_t *it)
         goto end;
     }
 
+next:
     for (i = 0; i < 3; i++) {
         it->tile_pos[i] += N;
         if (it->tile_pos[i] <= it->bbox[1][i]) break;
@@ -614,7 +1793,13 @@ static bool volume_iter_next_tile_box(volume_iterator_t *it)
     if (i == 3) return false;
 
 end:
-    HASH_FIND(hh, volume->tiles, it->tile_pos, 3 * sizeof(int), it->tile);
+    // Jump over the rest of the row of an empty brick.
+    if (skip_empty &&
+            tiles_table_brick_is_empty(volume->tiles, it->tile_pos)) {
+        it->tile_pos[0] |= (N << BRICK_BITS) - N;
+        goto next;
+    }
+    it->tile = tiles_table_find(volume->tiles, it->tile_pos);
     it->tile_id = get_tile_id(it->tile);
     vec3_copy(it->tile_pos, it->pos);
     return true;
@@ -622,9 +1807,13 @@ end:
 
 static bool volume_iter_next_tile_union(volume_iterator_t *it)
 {
-    it->tile = it->tile ? it->tile->hh.next : it->volume->tiles;
+    const volume_t *volume;
+    volume = (it->flags & VOLUME_ITER_VOLUME2) ? it->volume2 : it->volume;
+    it->tile_idx = it->tile_id ? it->tile_idx + 1 : 0;
+    it->tile = tiles_table_next(volume->tiles, &it->tile_idx);
     if (!it->tile && !(it->flags & VOLUME_ITER_VOLUME2)) {
-        it->tile = it->volume2->tiles;
+        it->tile_idx = 0;
+        it->tile = tiles_table_next(it->volume2->tiles, &it->tile_idx);
         it->flags |= VOLUME_ITER_VOLUME2;
     }
     if (!it->tile) return false;
@@ -640,6 +1829,47 @@ static bool volume_iter_next_tile_union(volume_iterator_t *it)
     return true;
 }
 
+/*
+ * Second pass of the VOLUME_ITER_INCLUDES_NEIGHBORS iteration: yield the
+ * positions of the missing neighbors of the non empty tiles, as empty
+ * tiles.  The iterator tile_idx encodes the current tile index and the
+ * direction of the neighbor.  To yield each position only once, we only
+ * consider a position from the non empty tile with the lowest index.
+ */
+static bool volume_iter_next_neighbor(volume_iterator_t *it)
+{
+    const int POS[6][3] = {
+        {0, 0, -1}, {0, 0, +1},
+        {0, -1, 0}, {0, +1, 0},
+        {-1, 0, 0}, {+1, 0, 0},
+    };
+    const tiles_table_t *table = it->volume->tiles;
+    const tile_t *tile;
+    int i, j, k, idx, p[3], q[3];
+
+    for (; it->tile_idx < table->nb * 6; it->tile_idx++) {
+        j = it->tile_idx / 6;
+        tile = table->tiles[j];
+        if (!tile || tile_is_empty(tile)) continue;
+        for (i = 0; i < 3; i++)
+            p[i] = tile->pos[i] + POS[it->tile_idx % 6][i] * N;
+        if (tiles_table_find_idx(table, p) != -1) continue;
+        for (k = 0; k < 6; k++) {
+            for (i = 0; i < 3; i++) q[i] = p[i] + POS[k][i] * N;
+            idx = tiles_table_find_idx(table, q);
+            if (idx != -1 && idx < j && !tile_is_empty(table->tiles[idx]))
+                break;
+        }
+        if (k < 6) continue;
+        it->tile = NULL;
+        it->tile_id = get_tile_id(NULL);
+        vec3_copy(p, it->tile_pos);
+        vec3_copy(p, it->pos);
+        return true;
+    }
+    return false;
+}
+
 static bool volume_iter_next_tile(volume_iterator_t *it)
 {
     if (it->tile_id && it->tile_id != get_tile_id(it->tile)) {
@@ -652,7 +1882,18 @@ static bool volume_iter_next_tile(volume_iterator_t *it)
     if (it->flags & VOLUME_ITER_BOX) return volume_iter_next_tile_box(it);
     if (it->volume2) return volume_iter_next_tile_union(it);
 
-    it->tile = it->tile ? it->tile->hh.next : it->volume->tiles;
+    if (it->flags & VOLUME_ITER_NEIGHBORS_PASS) {
+        it->tile_idx++;
+        return volume_iter_next_neighbor(it);
+    }
+
+    it->tile_idx = it->tile_id ? it->tile_idx + 1 : 0;
+    it->tile = tiles_table_next(it->volume->tiles, &it->tile_idx);
+    if (!it->tile && (it->flags & VOLUME_ITER_INCLUDES_NEIGHBORS)) {
+        it->flags |= VOLUME_ITER_NEIGHBORS_PASS;
+        it->tile_idx = 0;
+        return volume_iter_next_neighbor(it);
+    }
     if (!it->tile) return false;
     it->tile_id = it->tile->id;
     vec3_copy(it->tile->pos, it->tile_pos);
@@ -660,19 +1901,48 @@ static bool volume_iter_next_tile(volume_iterator_t *it)
     return true;
 }
 
+/*
+ * Move a skip empty iterator to the first non empty voxel of its current
+ * tile at or after the index i.  In tiles mode only check that the tile is
+ * not empty.  Return false if there were no such voxel.
+ */
+static bool volume_iter_skip_empty(volume_iterator_t *it, int i)
+{
+    tile_t *tile = it->tile;
+    if (it->tile_id != get_tile_id(tile)) {
+        tile = volume_get_tile_at(
+            (it->flags & VOLUME_ITER_VOLUME2) ? it->volume2 : it->volume,
+            it->tile_pos, it);
+    }
+    if (it->flags & VOLUME_ITER_TILES) return !tile_is_empty(tile);
+    i = tile_next_voxel(tile, i);
+    if (i == -1) return false;
+    it->pos[0] = it->tile_pos[0] + i % N;
+    it->pos[1] = it->tile_pos[1] + (i / N) % N;
+    it->pos[2] = it->tile_pos[2] + i / (N * N);
+    return true;
+}
+
 int volume_iter(volume_iterator_t *it, int pos[3])
 {
     int i;
+    bool skip_empty = it->flags & VOLUME_ITER_SKIP_EMPTY;
+
     if (!it->tile_id) { // First call.
-        // XXX: this is not good: volume_iter shouldn't make change to the
-        // volume.
-        if (it->flags & VOLUME_ITER_INCLUDES_NEIGHBORS)
-            volume_add_neighbors_tiles((volume_t*)it->volume);
         if (!volume_iter_next_tile(it)) return 0;
+        if (skip_empty && !volume_iter_skip_empty(it, 0)) goto next_tile;
         goto end;
     }
     if (it->flags & VOLUME_ITER_TILES) goto next_tile;
 
+    if (skip_empty) {
+        i = (it->pos[0] - it->tile_pos[0]) +
+            (it->pos[1] - it->tile_pos[1]) * N +
+            (it->pos[2] - it->tile_pos[2]) * N * N;
+        if (volume_iter_skip_empty(it, i + 1)) goto end;
+        goto next_tile;
+    }
+
     for (i = 0; i < 3; i++) {
         if (++it->pos[i] < it->tile_pos[i] + N) break;
         it->pos[i] = it->tile_pos[i];
@@ -680,13 +1950,9 @@ int volume_iter(volume_iterator_t *it, int pos[3])
     if (i < 3) goto end;
 
 next_tile:
-    if (!volume_iter_next_tile(it)) {
-        // XXX: this is not good: volume_iter shouldn't make changes to the
-        // volume.
-        if (it->flags & VOLUME_ITER_INCLUDES_NEIGHBORS)
-            volume_remove_empty_tiles((volume_t*)it->volume, true);
-        return 0;
-    }
+    do {
+        if (!volume_iter_next_tile(it)) return 0;
+    } while (skip_empty && !volume_iter_skip_empty(it, 0));
 
 end:
     if (pos) vec3_copy(it->pos, pos);
@@ -707,11 +1973,118 @@ void *volume_get_tile_data(const volume_t *volume, volume_accessor_t *iter,
             iter->tile_id == get_tile_id(iter->tile) &&
             memcmp(&iter->pos, bpos, sizeof(iter->pos)) == 0) {
         tile = iter->tile;
+    } else if (iter && (iter->flags & VOLUME_ACCESSOR_NEIGHBORS)) {
+        tile = neighbors_find(volume, iter, bpos);
     } else {
-        HASH_FIND(hh, volume->tiles, bpos, sizeof(iter->pos), tile);
+        tile = tiles_table_find(volume->tiles, bpos);
     }
     if (id) *id = tile ? tile->data->id : 0;
-    return tile ? tile->data->voxels : NULL;
+    if (!tile || tile->data->format != TILE_FORMAT_RGBA) return NULL;
+    if (TILE_BRICKS) return NULL; // Not in linear order.
+    return tile->data->voxels;
+}
+
+void volume_get_tile_voxels(const volume_t *volume, volume_accessor_t *it,
+                            const int pos[3], uint8_t (*out)[4])
+{
+    tile_t *tile = volume_get_tile_at(volume, pos, it);
+    if (!tile) {
+        memset(out, 0, N * N * N * 4);
+        return;
+    }
+    data_get_row(tile->data, 0, N * N * N, (uint8_t*)out);
+}
+
+bool volume_is_tile_uniform(const volume_t *volume, volume_accessor_t *it,
+                            const int pos[3], uint8_t out[4])
+{
+    tile_t *tile = volume_get_tile_at(volume, pos, it);
+    if (!tile) {
+        memset(out, 0, 4);
+        return true;
+    }
+    if (tile->data->format != TILE_FORMAT_UNIFORM) return false;
+    memcpy(out, tile->data->value, 4);
+    return true;
+}
+
+bool volume_get_tile_bits(const volume_t *volume, volume_accessor_t *it,
+                          const int pos[3], uint64_t mask[],
+                          uint8_t values[2][4])
+{
+    tile_t *tile = volume_get_tile_at(volume, pos, it);
+    const tile_data_t *data = tile ? tile->data : get_empty_data();
+
+    if (data->format == TILE_FORMAT_UNIFORM) {
+        memset(mask, data->value[3] ? 0xff : 0, MASK_SIZE * 8);
+        memcpy(values[0], data->value, 4);
+        memcpy(values[1], data->value, 4);
+        return true;
+    }
+    memcpy(mask, data_mask(data), MASK_SIZE * 8);
+    if (data->format != TILE_FORMAT_BITS) return false;
+    memcpy(values, BITS_VALUES(data), 2 * 4);
+    return true;
+}
+
+void volume_set_tile_bits(volume_t *volume, volume_iterator_t *it,
+                          const int pos[3], const uint64_t mask[],
+                          const uint8_t values[2][4])
+{
+    tile_t *tile;
+    tile_data_t *data;
+    int i, nb_set = 0;
+
+    for (i = 0; i < MASK_SIZE; i++) nb_set += __builtin_popcountll(mask[i]);
+    assert(!values[0][3] && (values[1][3] || !nb_set));
+    if (nb_set == 0 || nb_set == N * N * N) {
+        volume_fill_tile(volume, it, pos, values[nb_set ? 1 : 0]);
+        return;
+    }
+    data = tile_data_new(TILE_FORMAT_BITS);
+    memcpy(BITS_VALUES(data), values, 2 * 4);
+    memcpy(data_mask(data), mask, MASK_SIZE * 8);
+    data->nb_set = nb_set;
+
+    volume_prepare_write(volume);
+    tile = volume_get_tile_at(volume, pos, it);
+    if (!tile) {
+        tile = volume_add_tile(volume, pos);
+        if (it) {
+            it->tile = tile;
+            it->tile_id = get_tile_id(tile);
+            vec3_copy(pos, it->tile_pos);
+        }
+    }
+    tile = tiles_table_own(volume->tiles, tile, it);
+    journal_add(volume, tile->pos);
+    tile_data_release(tile->data);
+    tile->data = data;
+}
+
+void volume_fill_tile(volume_t *volume, volume_iterator_t *it,
+                      const int pos[3], const uint8_t v[4])
+{
+    tile_t *tile;
+    tile_data_t *data;
+    int p[3] = {pos[0] & ~(int)(N - 1),
+                pos[1] & ~(int)(N - 1),
+                pos[2] & ~(int)(N - 1)};
+    volume_prepare_write(volume);
+    tile = volume_get_tile_at(volume, p, it);
+    if (!tile) {
+        tile = volume_add_tile(volume, p);
+        if (it) {
+            it->tile = tile;
+            it->tile_id = get_tile_id(tile);
+            vec3_copy(p, it->tile_pos);
+        }
+    }
+    tile = tiles_table_own(volume->tiles, tile, it);
+    journal_add(volume, tile->pos);
+    data = tile_data_new_uniform(v);
+    tile_data_release(tile->data);
+    tile->data = data;
 }
 
 uint8_t volume_get_alpha_at(const volume_t *volume, volume_iterator_t *iter,
@@ -722,109 +2095,933 @@ uint8_t volume_get_alpha_at(const volume_t *volume, volume_iterator_t *iter,
     return v[3];
 }
 
+tile_data_t *volume_tile_data_new(const uint8_t (*voxels)[4])
+{
+    tile_data_t *data = tile_data_new(TILE_FORMAT_RGBA);
+    int i;
+    if (TILE_BRICKS) {
+        for (i = 0; i < N * N * N; i++)
+            memcpy(data->voxels[voxel_ofs(i)], voxels[i], 4);
+    } else {
+        memcpy(data->voxels, voxels, N * N * N * 4);
+    }
+    data_update_mask(data);
+    return tile_data_compact(data);
+}
+
+tile_data_t *volume_get_tile_data_ref(const volume_t *volume,
+                                      const int pos[3])
+{
+    tile_t *tile = tiles_table_find(volume->tiles, pos);
+    if (!tile) return NULL;
+    ATOMIC_INC(tile->data->ref);
+    return tile->data;
+}
+
+void volume_tile_data_release(tile_data_t *data)
+{
+    tile_data_release(data);
+}
+
+static uint64_t tile_data_get_mem(const tile_data_t *data)
+{
+    if (data->store) return sizeof(*data);
+    if (data->format != TILE_FORMAT_PACKED)
+        return tile_data_size(data->format);
+    return PACKED(data)->spill_ofs < 0 ? PACKED(data)->size : 0;
+}
+
+uint64_t volume_tile_data_get_mem(const tile_data_t *data)
+{
+    return tile_data_get_mem(data);
+}
+
+void volume_set_tile_data(volume_t *volume, const int pos[3],
+                          tile_data_t *data)
+{
+    tile_t *tile;
+    volume_prepare_write(volume);
+    tile = tiles_table_find(volume->tiles, pos);
+    if (!tile) tile = volume_add_tile(volume, pos);
+    tile = tiles_table_own(volume->tiles, tile, NULL);
+    journal_add(volume, pos);
+    tile_set_data(tile, data);
+}
+
 void volume_copy_tile(const volume_t *src, const int src_pos[3],
                      volume_t *dst, const int dst_pos[3])
 {
     tile_t *b1, *b2;
-    volume_prepare_write(dst);
     b1 = volume_get_tile_at(src, src_pos, NULL);
+    if (!b1) {
+        volume_clear_tile(dst, NULL, dst_pos);
+        return;
+    }
+    volume_prepare_write(dst);
     b2 = volume_get_tile_at(dst, dst_pos, NULL);
     if (!b2) b2 = volume_add_tile(dst, dst_pos);
+    b2 = tiles_table_own(dst->tiles, b2, NULL);
+    journal_add(dst, dst_pos);
     tile_set_data(b2, b1->data);
 }
 
-void volume_read(const volume_t *volume,
-               const int pos[3], const int size[3],
-               uint8_t *data)
-{
-    // For the moment we only support the case where we get the rectangle
-    // of a tile plus a one voxel border around it!
-    assert(pos[0] - (pos[0] & ~(int)(N - 1)) == N - 1);
-    assert(pos[1] - (pos[1] & ~(int)(N - 1)) == N - 1);
-    assert(pos[2] - (pos[2] & ~(int)(N - 1)) == N - 1);
-    assert(size[0] == N + 2);
-    assert(size[1] == N + 2);
-    assert(size[2] == N + 2);
+// Compute the voxels hash of a tile data if needed.  The hash only depends
+// on the voxels, not on the format of the data, and the voxels with a zero
+// alpha all count as empty, whatever their color.  Safe to call from
+// several threads, since they all compute the same value.
+static void tile_data_update_hash(tile_data_t *data)
+{
+    uint8_t (*voxels)[4];
+    uint64_t hash[2];
+    int i;
+
+    if (__atomic_load_n(&data->has_hash, __ATOMIC_ACQUIRE)) return;
+    assert(data->format != TILE_FORMAT_PACKED);
+    voxels = malloc(N * N * N * 4);
+    data_get_row(data, 0, N * N * N, (uint8_t*)voxels);
+    for (i = 0; i < N * N * N; i++) {
+        if (!voxels[i][3]) memset(voxels[i], 0, 4);
+    }
+    // Our xxhash version has no XXH3, so we use two XXH64 seeds.
+    hash[0] = XXH64(voxels, N * N * N * 4, 0);
+    hash[1] = XXH64(voxels, N * N * N * 4, 0x9e3779b97f4a7c15ULL);
+    free(voxels);
+    memcpy(data->hash, hash, sizeof(hash));
+    __atomic_store_n(&data->has_hash, 1, __ATOMIC_RELEASE);
+}
+
+bool volume_get_tile_hash(const volume_t *volume, volume_accessor_t *it,
+                          const int pos[3], uint64_t out[2])
+{
+    tile_t *tile = volume_get_tile_at(volume, pos, it);
+    if (!tile || !tile->data->nb_set) return false;
+    tile_data_update_hash(tile->data);
+    memcpy(out, tile->data->hash, sizeof(tile->data->hash));
+    return true;
+}
+
+/*
+ * Table of the tile data by voxels hash, used to share the same data
+ * between all the volumes.  The table keeps a reference to the data, so
+ * that any write to the shared data makes a copy first.  The entries that
+ * nobody else uses are removed once the table doubled its size.  Only used
+ * from the main thread.
+ */
+typedef struct {
+    UT_hash_handle  hh;
+    uint64_t        hash[2];
+    tile_data_t     *data;
+} intern_item_t;
+
+static struct {
+    intern_item_t   *table;
+    int             gc_count;   // Size of the table after the last gc.
+} g_intern = {};
+
+static void intern_gc(void)
+{
+    intern_item_t *item, *tmp;
+
+    if (HASH_COUNT(g_intern.table) < max(1024, g_intern.gc_count * 2))
+        return;
+    HASH_ITER(hh, g_intern.table, item, tmp) {
+        if (item->data->ref > 1) continue;
+        HASH_DEL(g_intern.table, item);
+        tile_data_release(item->data);
+        free(item);
+    }
+    g_intern.gc_count = HASH_COUNT(g_intern.table);
+}
+
+static void dedup_hash_job(void *user, int i, int worker)
+{
+    tile_t **tiles = user;
+    tile_data_update_hash(tiles[i]->data);
+}
+
+int volume_dedup(volume_t *volume)
+{
+    tiles_table_t *table;
+    tile_t *tile, **tiles;
+    intern_item_t *item;
+    int i, nb = 0, ret = 0;
+
+    intern_gc();
+    // The uniform tiles are small enough, and the packed ones would need
+    // to be unpacked first.
+    table = volume->tiles;
+    tiles = malloc(max(1, table->nb) * sizeof(*tiles));
+    for (i = 0; i < table->nb; i++) {
+        tile = table->tiles[i];
+        if (!tile) continue;
+        if (    tile->data->format == TILE_FORMAT_UNIFORM ||
+                tile->data->format == TILE_FORMAT_PACKED) continue;
+        tiles[nb++] = tile;
+    }
+    jobs_parallel_for(nb, dedup_hash_job, tiles);
+
+    for (i = 0; i < nb; i++) {
+        HASH_FIND(hh, g_intern.table, tiles[i]->data->hash,
+                  sizeof(item->hash), item);
+        if (!item) {
+            item = calloc(1, sizeof(*item));
+            memcpy(item->hash, tiles[i]->data->hash, sizeof(item->hash));
+            item->data = tiles[i]->data;
+            ATOMIC_INC(item->data->ref);
+            HASH_ADD(hh, g_intern.table, hash, sizeof(item->hash), item);
+            continue;
+        }
+        if (item->data == tiles[i]->data) continue;
+        // Only copy the tiles table if we change something.
+        if (volume->tiles->ref > 1) {
+            volume_prepare_write(volume);
+            free(tiles);
+            return ret + volume_dedup(volume);
+        }
+        volume->key = new_uid();
+        tiles[i] = tiles_table_own(volume->tiles, tiles[i], NULL);
+        journal_add(volume, tiles[i]->pos);
+        tile_set_data(tiles[i], item->data);
+        ret++;
+    }
+    free(tiles);
+    return ret;
+}
+
+/*
+ * Tile store: a read only file of tile data sorted by voxels hash, that
+ * the processes map in memory, so that the identical tiles of all the
+ * processes use the same physical pages.  The file uses the native byte
+ * order and tile layout, so it can only be read by the same build of
+ * goxel on the same machine.
+ *
+ * The data mapped from the store get one header per entry, created on
+ * first use and owned by the store, so that the writes always make a
+ * private copy first.  The store itself stays mapped until all its data
+ * got released.  Only used from the main thread, except for the release.
+ */
+
+#define STORE_VERSION 1
+
+typedef struct {
+    char        magic[4];   // "GXTS"
+    int32_t     version;
+    int32_t     tile_size;
+    int32_t     bricks;     // Value of TILE_BRICKS.
+    int64_t     nb;         // Number of entries.
+} store_header_t;
+
+typedef struct {
+    uint64_t    hash[2];
+    int32_t     format;
+    int32_t     nb_colors;
+    int32_t     nb_set;
+    int32_t     pad;
+    int64_t     ofs;        // Offset of the voxels in the file.
+} store_entry_t;
+
+struct tile_store {
+    int                 ref;
+    uint8_t             *map;
+    size_t              size;
+    const store_entry_t *entries;
+    int                 nb;
+    tile_data_t         **datas;
+    // To tell if the file changed when we open it again.
+    uint64_t            dev, ino, mtime;
+};
+
+static tile_store_t *g_store = NULL;
+
+// Size of the voxels of a data format.
+static size_t store_payload_size(int format)
+{
+    return tile_data_size(format) - sizeof(tile_data_t);
+}
+
+static void store_release(tile_store_t *store)
+{
+    if (ATOMIC_DEC(store->ref) > 0) return;
+#ifdef HAS_TILE_STORE
+    munmap(store->map, store->size);
+#endif
+    free(store->datas);
+    free(store);
+}
+
+static void mapped_data_release(tile_data_t *data)
+{
+    ATOMIC_ADD(g_global_stats.nb_tiles, -1);
+    ATOMIC_ADD(g_global_stats.shared_mem,
+               -store_payload_size(data->format));
+    store_release(data->store);
+    free(data);
+}
+
+// Return the data of a store entry, owned by the store.
+static tile_data_t *store_get_data(tile_store_t *store, int i)
+{
+    const store_entry_t *entry = &store->entries[i];
+    tile_data_t *data;
+
+    if (store->datas[i]) return store->datas[i];
+    data = calloc(1, sizeof(*data));
+    data->ref = 1;
+    data->id = new_uid();
+    data->format = entry->format;
+    data->nb_colors = entry->nb_colors;
+    data->nb_set = entry->nb_set;
+    data->has_hash = 1;
+    memcpy(data->hash, entry->hash, sizeof(data->hash));
+    data->store = store;
+    data->voxels = (void*)(store->map + entry->ofs);
+    ATOMIC_INC(store->ref);
+    ATOMIC_ADD(g_global_stats.nb_tiles, 1);
+    ATOMIC_ADD(g_global_stats.shared_mem, store_payload_size(data->format));
+    store->datas[i] = data;
+    return data;
+}
+
+// Index of the store entry with a given hash, or -1.
+static int store_find(const tile_store_t *store, const uint64_t hash[2])
+{
+    int a = 0, b = store->nb - 1, i, c;
+    while (a <= b) {
+        i = (a + b) / 2;
+        c = memcmp(store->entries[i].hash, hash, sizeof(uint64_t[2]));
+        if (c == 0) return i;
+        if (c < 0) a = i + 1;
+        else b = i - 1;
+    }
+    return -1;
+}
+
+static void store_close(void)
+{
+    tile_store_t *store = g_store;
+    int i;
+    if (!store) return;
+    g_store = NULL;
+    for (i = 0; i < store->nb; i++) {
+        if (store->datas[i]) tile_data_release(store->datas[i]);
+        store->datas[i] = NULL;
+    }
+    store_release(store);
+}
+
+static int store_data_cmp(const void *a, const void *b)
+{
+    const tile_data_t *d1 = *(const tile_data_t**)a;
+    const tile_data_t *d2 = *(const tile_data_t**)b;
+    return memcmp(d1->hash, d2->hash, sizeof(d1->hash));
+}
+
+static void store_hash_job(void *user, int i, int worker)
+{
+    tile_data_t **datas = user;
+    tile_data_update_hash(datas[i]);
+}
+
+#ifdef HAS_TILE_STORE
+
+int volume_store_save(const char *path, volume_t *const *volumes, int nb)
+{
+    tile_data_t **datas = NULL, *data;
+    store_header_t header = {.magic = "GXTS", .version = STORE_VERSION,
+                             .tile_size = N, .bricks = TILE_BRICKS};
+    store_entry_t entry = {};
+    tiles_table_t *table;
+    int i, j, nb_datas = 0, size = 0, count = 0;
+    int64_t ofs;
+    char *tmp_path;
+    FILE *file;
+    bool ok;
+    static const uint8_t zeros[64] = {};
+
+    for (i = 0; i < nb; i++) {
+        table = volumes[i]->tiles;
+        if (table->nb_packed) tiles_table_unpack(table);
+        for (j = 0; j < table->nb; j++) {
+            if (!table->tiles[j]) continue;
+            data = table->tiles[j]->data;
+            if (data->format == TILE_FORMAT_UNIFORM) continue;
+            if (nb_datas >= size) {
+                size = max(1024, size * 2);
+                datas = realloc(datas, size * sizeof(*datas));
+            }
+            datas[nb_datas++] = data;
+        }
+    }
+    jobs_parallel_for(nb_datas, store_hash_job, datas);
+    qsort(datas, nb_datas, sizeof(*datas), store_data_cmp);
+    for (i = 0; i < nb_datas; i++) {
+        if (count && !store_data_cmp(&datas[count - 1], &datas[i]))
+            continue;
+        datas[count++] = datas[i];
+    }
+
+    // Write into a temporary file first, so that the processes reading the
+    // store never see a partial file.
+    tmp_path = malloc(strlen(path) + 32);
+    sprintf(tmp_path, "%s.%d.tmp", path, (int)getpid());
+    file = fopen(tmp_path, "wb");
+    if (!file) {
+        free(tmp_path);
+        free(datas);
+        return -1;
+    }
+    header.nb = count;
+    ok = fwrite(&header, sizeof(header), 1, file) == 1;
+    ofs = sizeof(header) + count * sizeof(entry);
+    for (i = 0; ok && i < count; i++) {
+        // Aligned so that we can read the mask as 64 bits words.
+        ofs = (ofs + 63) / 64 * 64;
+        entry.hash[0] = datas[i]->hash[0];
+        entry.hash[1] = datas[i]->hash[1];
+        entry.format = datas[i]->format;
+        entry.nb_colors = datas[i]->nb_colors;
+        entry.nb_set = datas[i]->nb_set;
+        entry.ofs = ofs;
+        ok = fwrite(&entry, sizeof(entry), 1, file) == 1;
+        ofs += store_payload_size(datas[i]->format);
+    }
+    ofs = sizeof(header) + count * sizeof(entry);
+    for (i = 0; ok && i < count; i++) {
+        size = (64 - ofs % 64) % 64;
+        ok = fwrite(zeros, 1, size, file) == (size_t)size;
+        size = store_payload_size(datas[i]->format);
+        ok = ok && fwrite(datas[i]->voxels, 1, size, file) == (size_t)size;
+        ofs += (64 - ofs % 64) % 64 + size;
+    }
+    ok = (fclose(file) == 0) && ok;
+    ok = ok && rename(tmp_path, path) == 0;
+    if (!ok) remove(tmp_path);
+    free(tmp_path);
+    free(datas);
+    return ok ? count : -1;
+}
+
+// Check that the entries of a mapped store file are valid.
+static bool store_check(const uint8_t *map, size_t size)
+{
+    const store_header_t *header = (const void*)map;
+    const store_entry_t *entries = (const void*)(map + sizeof(*header));
+    int64_t i;
+
+    if (size < sizeof(*header)) return false;
+    if (    memcmp(header->magic, "GXTS", 4) ||
+            header->version != STORE_VERSION || header->tile_size != N ||
+            header->bricks != TILE_BRICKS || header->nb < 0 ||
+            header->nb > INT_MAX ||
+            header->nb > (int64_t)((size - sizeof(*header)) /
+                                   sizeof(*entries)))
+        return false;
+    for (i = 0; i < header->nb; i++) {
+        if (    entries[i].format != TILE_FORMAT_RGBA &&
+                entries[i].format != TILE_FORMAT_INDEXED &&
+                entries[i].format != TILE_FORMAT_BITS) return false;
+        if (    entries[i].ofs % 64 || entries[i].ofs < 0 ||
+                entries[i].ofs + store_payload_size(entries[i].format) > size)
+            return false;
+        if (i && memcmp(entries[i - 1].hash, entries[i].hash,
+                        sizeof(entries[i].hash)) >= 0) return false;
+    }
+    return true;
+}
+
+int volume_store_open(const char *path)
+{
+    struct stat st;
+    tile_store_t *store;
+    uint8_t *map;
+    int fd;
+
+    fd = open(path, O_RDONLY);
+    if (fd < 0) return -1;
+    if (fstat(fd, &st) != 0 || st.st_size == 0) {
+        close(fd);
+        return -1;
+    }
+    if (    g_store && g_store->dev == (uint64_t)st.st_dev &&
+            g_store->ino == (uint64_t)st.st_ino &&
+            g_store->mtime == (uint64_t)st.st_mtime &&
+            g_store->size == (size_t)st.st_size) {
+        close(fd);
+        return 0;
+    }
+    map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) return -1;
+    if (!store_check(map, st.st_size)) {
+        munmap(map, st.st_size);
+        return -1;
+    }
+    store_close();
+    store = calloc(1, sizeof(*store));
+    store->ref = 1;
+    store->map = map;
+    store->size = st.st_size;
+    store->nb = ((const store_header_t*)map)->nb;
+    store->entries = (const void*)(map + sizeof(store_header_t));
+    store->datas = calloc(max(1, store->nb), sizeof(*store->datas));
+    store->dev = st.st_dev;
+    store->ino = st.st_ino;
+    store->mtime = st.st_mtime;
+    g_store = store;
+    return 0;
+}
+
+#else
 
+int volume_store_save(const char *path, volume_t *const *volumes, int nb)
+{
+    return -1;
+}
+
+int volume_store_open(const char *path)
+{
+    return -1;
+}
+
+#endif // HAS_TILE_STORE
+
+void volume_store_close(void)
+{
+    store_close();
+}
+
+int volume_store_share(volume_t *volume)
+{
+    tiles_table_t *table;
     tile_t *tile;
-    int tile_pos[3] = {pos[0] + 1, pos[1] + 1, pos[2] + 1};
-    int i, z, y, x, dx, dy, dz, p[3];
-    uint8_t v[4];
-    volume_accessor_t accessor;
+    tile_data_t **datas;
+    int i, idx, nb = 0, ret = 0;
+
+    if (!g_store) return 0;
+    // Like for volume_dedup, we don't unpack the packed tiles.
+    table = volume->tiles;
+    datas = malloc(max(1, table->nb) * sizeof(*datas));
+    for (i = 0; i < table->nb; i++) {
+        tile = table->tiles[i];
+        if (!tile || tile->data->store) continue;
+        if (    tile->data->format == TILE_FORMAT_UNIFORM ||
+                tile->data->format == TILE_FORMAT_PACKED) continue;
+        datas[nb++] = tile->data;
+    }
+    jobs_parallel_for(nb, store_hash_job, datas);
+    free(datas);
+
+    for (i = 0; i < table->nb; i++) {
+        tile = table->tiles[i];
+        if (!tile || tile->data->store) continue;
+        if (    tile->data->format == TILE_FORMAT_UNIFORM ||
+                tile->data->format == TILE_FORMAT_PACKED) continue;
+        idx = store_find(g_store, tile->data->hash);
+        if (idx == -1) continue;
+        // Only copy the tiles table if we change something.
+        if (volume->tiles->ref > 1) {
+            volume_prepare_write(volume);
+            return ret + volume_store_share(volume);
+        }
+        volume->key = new_uid();
+        tile = tiles_table_own(volume->tiles, tile, NULL);
+        journal_add(volume, tile->pos);
+        tile_set_data(tile, store_get_data(g_store, idx));
+        ret++;
+    }
+    return ret;
+}
+
+typedef struct {
+    const volume_t *volume;
+    const int (*pos)[3];
+    bool (*func)(void *user, const int pos[3], uint8_t (*voxels)[4]);
+    void *user;
+    tile_data_t **results;
+} apply_tiles_ctx_t;
+
+static void apply_tiles_job(void *user, int i, int worker)
+{
+    apply_tiles_ctx_t *ctx = user;
+    uint8_t (*voxels)[4] = jobs_get_scratch(N * N * N * 4);
+
+    volume_get_tile_voxels(ctx->volume, NULL, ctx->pos[i], voxels);
+    if (!ctx->func(ctx->user, ctx->pos[i], voxels)) return;
+    ctx->results[i] = volume_tile_data_new(voxels);
+}
+
+void volume_apply_tiles(volume_t *volume, int nb, const int (*pos)[3],
+        bool (*func)(void *user, const int pos[3], uint8_t (*voxels)[4]),
+        void *user)
+{
+    int i;
+    tile_t *tile;
+    bool changed = false;
+    apply_tiles_ctx_t ctx = {
+        .volume = volume,
+        .pos = pos,
+        .func = func,
+        .user = user,
+        .results = calloc(nb, sizeof(*ctx.results)),
+    };
 
-    memset(data, 0, size[0] * size[1] * size[2] * 4);
-    tile = volume_get_tile_at(volume, tile_pos, NULL);
-    if (!tile) goto rest;
+    jobs_parallel_for(nb, apply_tiles_job, &ctx);
+
+    // Commit all the modified tiles.
+    for (i = 0; i < nb; i++) {
+        if (!ctx.results[i]) continue;
+        if (!changed) volume_prepare_write(volume);
+        changed = true;
+        tile = tiles_table_find(volume->tiles, pos[i]);
+        if (!tile) tile = volume_add_tile(volume, pos[i]);
+        tile = tiles_table_own(volume->tiles, tile, NULL);
+        journal_add(volume, pos[i]);
+        tile_data_release(tile->data);
+        tile->data = ctx.results[i];
+    }
+    free(ctx.results);
+}
+
+// Compute the intersection of a tile with a box.
+static void span_clip(const int tile_pos[3], const int aabb[2][3],
+                      int out[2][3])
+{
+    int i;
+    for (i = 0; i < 3; i++) {
+        out[0][i] = max(aabb[0][i], tile_pos[i]);
+        out[1][i] = min(aabb[1][i], tile_pos[i] + N);
+    }
+}
+
+// Iter all the tiles positions that overlap a box.
+#define SPAN_FOR_EACH_TILE(aabb, p) \
+    for (p[2] = aabb[0][2] & ~(int)(N - 1); p[2] < aabb[1][2]; p[2] += N) \
+    for (p[1] = aabb[0][1] & ~(int)(N - 1); p[1] < aabb[1][1]; p[1] += N) \
+    for (p[0] = aabb[0][0] & ~(int)(N - 1); p[0] < aabb[1][0]; p[0] += N)
+
+void volume_get_span(const volume_t *volume, const int aabb[2][3],
+                     uint8_t *data, const int stride[2])
+{
+    int tile_pos[3], a[2][3], y, z, w, i;
+    int sy = stride ? stride[0] : (aabb[1][0] - aabb[0][0]) * 4;
+    int sz = stride ? stride[1] : (aabb[1][1] - aabb[0][1]) * sy;
+    const tile_t *tile;
+    const tile_data_t *tdata;
+    uint8_t *row;
+
+    SPAN_FOR_EACH_TILE(aabb, tile_pos) {
+        span_clip(tile_pos, aabb, a);
+        tile = tiles_table_find(volume->tiles, tile_pos);
+        tdata = tile ? tile->data : get_empty_data();
+        w = a[1][0] - a[0][0];
+        for (z = a[0][2]; z < a[1][2]; z++)
+        for (y = a[0][1]; y < a[1][1]; y++) {
+            row = data + (z - aabb[0][2]) * sz + (y - aabb[0][1]) * sy +
+                  (a[0][0] - aabb[0][0]) * 4;
+            i = (a[0][0] - tile_pos[0]) + (y - tile_pos[1]) * N +
+                (z - tile_pos[2]) * N * N;
+            data_get_row(tdata, i, w, row);
+        }
+    }
+}
+
+typedef struct {
+    const volume_t *volume;
+    const int (*pos)[3];
+    const int (*aabb)[3];
+    const uint8_t *data;
+    int sy, sz;
+    tile_data_t **results;
+} set_span_ctx_t;
+
+// Build the new data of a tile fully covered by a span.
+static void set_span_job(void *user, int i, int worker)
+{
+    set_span_ctx_t *ctx = user;
+    const int *tile_pos = ctx->pos[i];
+    uint8_t (*voxels)[4] = jobs_get_scratch(N * N * N * 4);
+    const uint8_t *row;
+    int y, z, x;
+    bool empty = true;
 
     for (z = 0; z < N; z++)
-    for (y = 0; y < N; y++)
-    for (x = 0; x < N; x++) {
-        dx = x + 1;
-        dy = y + 1;
-        dz = z + 1;
-        memcpy(&data[(dz * size[1] * size[0] + dy * size[0] + dx) * 4],
-               &tile->data->voxels[z * N * N + y * N + x],
-               4);
-    }
-
-rest:
-    // Fill the rest.
-    // In order to optimize access, we iter in such a way to avoid changing
-    // the current tile: start with the planes, then the edges, and finally
-    // the 8 corners.
-    accessor = volume_get_accessor(volume);
-    const int ranges[26][3][2] = {
-        // 6 planes.
-        {{0,         1}, {1,     N + 1}, {1,     N + 1}},
-        {{N + 1, N + 2}, {1,     N + 1}, {1,     N + 1}},
-        {{1,     N + 1}, {0,         1}, {1,     N + 1}},
-        {{1,     N + 1}, {N + 1, N + 2}, {1,     N + 1}},
-        {{1,     N + 1}, {1,     N + 1}, {0,         1}},
-        {{1,     N + 1}, {1,     N + 1}, {N + 1, N + 2}},
-        // 4 edges moving along X.
-        {{1,     N + 1}, {0,         1}, {0,         1}},
-        {{1,     N + 1}, {N + 1, N + 2}, {0,         1}},
-        {{1,     N + 1}, {0,         1}, {N + 1, N + 2}},
-        {{1,     N + 1}, {N + 1, N + 2}, {N + 1, N + 2}},
-        // 4 edges moving along Y.
-        {{0,         1}, {1,     N + 1}, {0,         1}},
-        {{N + 1, N + 2}, {1,     N + 1}, {0,         1}},
-        {{0,         1}, {1,     N + 1}, {1,     N + 2}},
-        {{N + 1, N + 2}, {1,     N + 1}, {1,     N + 2}},
-        // 4 edges moving along Z.
-        {{0,         1}, {0,         1}, {1,     N + 1}},
-        {{N + 1, N + 2}, {0,         1}, {1,     N + 1}},
-        {{0,         1}, {N + 1, N + 2}, {1,     N + 1}},
-        {{N + 1, N + 2}, {N + 1, N + 2}, {1,     N + 1}},
-        // 8 Corners.
-        {{0,     1    }, {0,     1    }, {0,     1    }},
-        {{N + 1, N + 2}, {0,     1    }, {0,     1    }},
-        {{0,     1    }, {N + 1, N + 2}, {0,     1    }},
-        {{N + 1, N + 2}, {N + 1, N + 2}, {0,     1    }},
-        {{0,     1    }, {0,     1    }, {N + 1, N + 2}},
-        {{N + 1, N + 2}, {0,     1    }, {N + 1, N + 2}},
-        {{0,     1    }, {N + 1, N + 2}, {N + 1, N + 2}},
-        {{N + 1, N + 2}, {N + 1, N + 2}, {N + 1, N + 2}},
+    for (y = 0; y < N; y++) {
+        row = ctx->data + (tile_pos[2] + z - ctx->aabb[0][2]) * ctx->sz +
+                          (tile_pos[1] + y - ctx->aabb[0][1]) * ctx->sy +
+                          (tile_pos[0] - ctx->aabb[0][0]) * 4;
+        memcpy(voxels[y * N + z * N * N], row, N * 4);
+        for (x = 0; empty && x < N; x++) {
+            if (row[x * 4 + 3]) empty = false;
+        }
+    }
+    // Don't create new tiles for empty parts of the span.
+    if (empty && !tiles_table_find(ctx->volume->tiles, tile_pos)) return;
+    ctx->results[i] = volume_tile_data_new(voxels);
+}
+
+void volume_set_span(volume_t *volume, const int aabb[2][3],
+                     const uint8_t *data, const int stride[2])
+{
+    int tile_pos[3], a[2][3], x, y, z, w, i, nb_full = 0;
+    int sy = stride ? stride[0] : (aabb[1][0] - aabb[0][0]) * 4;
+    int sz = stride ? stride[1] : (aabb[1][1] - aabb[0][1]) * sy;
+    tile_t *tile;
+    const uint8_t *row;
+    bool empty;
+    int (*full_pos)[3] = NULL;
+    set_span_ctx_t ctx;
+
+    volume_prepare_write(volume);
+
+    // The tiles fully covered by the span are built in parallel first.
+    SPAN_FOR_EACH_TILE(aabb, tile_pos) {
+        span_clip(tile_pos, aabb, a);
+        if (a[1][0] - a[0][0] == N && a[1][1] - a[0][1] == N &&
+                a[1][2] - a[0][2] == N)
+            nb_full++;
+    }
+    if (nb_full) {
+        full_pos = malloc(nb_full * sizeof(*full_pos));
+        i = 0;
+        SPAN_FOR_EACH_TILE(aabb, tile_pos) {
+            span_clip(tile_pos, aabb, a);
+            if (a[1][0] - a[0][0] == N && a[1][1] - a[0][1] == N &&
+                    a[1][2] - a[0][2] == N)
+                memcpy(full_pos[i++], tile_pos, sizeof(tile_pos));
+        }
+        ctx = (set_span_ctx_t) {
+            .volume = volume,
+            .pos = (const int (*)[3])full_pos,
+            .aabb = aabb,
+            .data = data,
+            .sy = sy,
+            .sz = sz,
+            .results = calloc(nb_full, sizeof(*ctx.results)),
+        };
+        jobs_parallel_for(nb_full, set_span_job, &ctx);
+        for (i = 0; i < nb_full; i++) {
+            if (!ctx.results[i]) continue;
+            tile = tiles_table_find(volume->tiles, full_pos[i]);
+            if (!tile) tile = volume_add_tile(volume, full_pos[i]);
+            tile = tiles_table_own(volume->tiles, tile, NULL);
+            journal_add(volume, full_pos[i]);
+            tile_data_release(tile->data);
+            tile->data = ctx.results[i];
+        }
+        free(ctx.results);
+        free(full_pos);
+    }
+
+    // Then the tiles on the borders of the span, voxel by voxel.
+    SPAN_FOR_EACH_TILE(aabb, tile_pos) {
+        span_clip(tile_pos, aabb, a);
+        w = a[1][0] - a[0][0];
+        if (w == N && a[1][1] - a[0][1] == N && a[1][2] - a[0][2] == N)
+            continue;
+        tile = tiles_table_find(volume->tiles, tile_pos);
+
+        // Don't create new tiles for empty parts of the span.
+        if (!tile) {
+            empty = true;
+            for (z = a[0][2]; empty && z < a[1][2]; z++)
+            for (y = a[0][1]; empty && y < a[1][1]; y++) {
+                row = data + (z - aabb[0][2]) * sz + (y - aabb[0][1]) * sy +
+                      (a[0][0] - aabb[0][0]) * 4;
+                for (x = 0; x < w; x++) {
+                    if (row[x * 4 + 3]) empty = false;
+                }
+            }
+            if (empty) continue;
+            tile = volume_add_tile(volume, tile_pos);
+        }
+
+        tile = tiles_table_own(volume->tiles, tile, NULL);
+        journal_add(volume, tile_pos);
+        tile_prepare_write(tile);
+        for (z = a[0][2]; z < a[1][2]; z++)
+        for (y = a[0][1]; y < a[1][1]; y++) {
+            row = data + (z - aabb[0][2]) * sz + (y - aabb[0][1]) * sy +
+                  (a[0][0] - aabb[0][0]) * 4;
+            i = (a[0][0] - tile_pos[0]) + (y - tile_pos[1]) * N +
+                (z - tile_pos[2]) * N * N;
+            for (x = 0; x < w; x++)
+                tile_set_voxel(tile, i + x, row + x * 4);
+        }
+    }
+}
+
+void volume_read(const volume_t *volume,
+                 const int pos[3], const int size[3],
+                 uint8_t *data)
+{
+    const int aabb[2][3] = {
+        {pos[0], pos[1], pos[2]},
+        {pos[0] + size[0], pos[1] + size[1], pos[2] + size[2]},
     };
+    volume_get_span(volume, aabb, data, NULL);
+}
+
+uint64_t volume_get_unique_mem(const volume_t *volume)
+{
+    const tiles_table_t *table = volume->tiles;
+    const tile_data_t *data;
+    uint64_t ret = 0;
+    int i;
 
-    for (i = 0; i < 26; i++)
-    for (z = ranges[i][2][0]; z < ranges[i][2][1]; z++)
-    for (y = ranges[i][1][0]; y < ranges[i][1][1]; y++)
-    for (x = ranges[i][0][0]; x < ranges[i][0][1]; x++) {
-        p[0] = pos[0] + x;
-        p[1] = pos[1] + y;
-        p[2] = pos[2] + z;
-        volume_get_at(volume, &accessor, p, v);
-        memcpy(&data[(z * size[1] * size[0] + y * size[0] + x) * 4], v, 4);
+    if (table->ref > 1) return 0;
+    // Don't use tiles_table_next, that would unpack the tiles.
+    for (i = 0; i < table->nb; i++) {
+        if (!table->tiles[i] || table->tiles[i]->ref > 1) continue;
+        data = table->tiles[i]->data;
+        if (data->ref > 1) continue;
+        ret += tile_data_get_mem(data);
+    }
+    return ret;
+}
+
+uint64_t volume_get_mem(const volume_t *volume)
+{
+    const tiles_table_t *table = volume->tiles;
+    uint64_t ret = 0;
+    int i;
+
+    for (i = 0; i < table->nb; i++) {
+        if (!table->tiles[i]) continue;
+        ret += tile_data_get_mem(table->tiles[i]->data);
+    }
+    return ret;
+}
+
+void volume_iter_tiles_data(const volume_t *volume, void *user,
+                            void (*f)(void *user, uint64_t id, uint64_t mem))
+{
+    const tiles_table_t *table = volume->tiles;
+    const tile_data_t *data;
+    int i;
+
+    for (i = 0; i < table->nb; i++) {
+        if (!table->tiles[i]) continue;
+        data = table->tiles[i]->data;
+        if (data == get_empty_data()) continue;
+        f(user, data->id, tile_data_get_mem(data));
     }
 }
 
 int volume_get_tiles_count(const volume_t *volume)
 {
-    return HASH_COUNT(volume->tiles);
+    return volume->tiles->count;
+}
+
+void volume_get_stats(const volume_t *volume, volume_stats_t *stats)
+{
+    const tiles_table_t *table = volume->tiles;
+    const tile_data_t *data;
+    uint64_t mem;
+    int i;
+
+    memset(stats, 0, sizeof(*stats));
+    stats->tiles_count = table->count;
+    // Don't use tiles_table_next, that would unpack the tiles.
+    for (i = 0; i < table->nb; i++) {
+        if (!table->tiles[i]) continue;
+        data = table->tiles[i]->data;
+        mem = tile_data_get_mem(data);
+        stats->mem += mem;
+        if (table->ref > 1 || table->tiles[i]->ref > 1 || data->ref > 1)
+            stats->shared_mem += mem;
+    }
+}
+
+// Return the tile of a table at a given position, without unpacking it.
+static const tile_t *tiles_table_get(const tiles_table_t *table,
+                                     const int pos[3])
+{
+    int idx = tiles_table_find_idx(table, pos);
+    return idx >= 0 ? table->tiles[idx] : NULL;
+}
+
+int volume_diff(const volume_t *a, const volume_t *b,
+                void (*callback)(void *user, const int pos[3], int change),
+                void *user)
+{
+    const tiles_table_t *ta = a->tiles, *tb = b->tiles;
+    const tile_t *tile, *other;
+    int i, nb = 0;
+
+    if (ta == tb || a->key == b->key) return 0;
+    // Don't use tiles_table_next, that would unpack the tiles.
+    for (i = 0; i < ta->nb; i++) {
+        if (!(tile = ta->tiles[i])) continue;
+        other = tiles_table_get(tb, tile->pos);
+        if (    other && (other->data == tile->data ||
+                          other->data->id == tile->data->id))
+            continue;
+        if (tile_is_empty(tile) && tile_is_empty(other)) continue;
+        nb++;
+        if (callback) {
+            callback(user, tile->pos,
+                     tile_is_empty(other) ? VOLUME_DIFF_REMOVED :
+                     tile_is_empty(tile) ? VOLUME_DIFF_ADDED :
+                     VOLUME_DIFF_CHANGED);
+        }
+    }
+    // The tiles only in the second volume.
+    for (i = 0; i < tb->nb; i++) {
+        if (!(tile = tb->tiles[i])) continue;
+        if (tile_is_empty(tile) || tiles_table_get(ta, tile->pos)) continue;
+        nb++;
+        if (callback) callback(user, tile->pos, VOLUME_DIFF_ADDED);
+    }
+    return nb;
+}
+
+volume_cursor_t volume_journal_get_cursor(const volume_t *volume_)
+{
+    volume_t *volume = (volume_t*)volume_; // The journal is not the value.
+    if (!volume->journal) {
+        volume->journal = calloc(1, sizeof(*volume->journal));
+        volume->journal->id = new_uid();
+    }
+    volume->journal->read = volume->journal->count;
+    return (volume_cursor_t) {
+        .id = volume->journal->id,
+        .count = volume->journal->count,
+    };
+}
+
+int volume_journal_read(const volume_t *volume, volume_cursor_t *cursor,
+                        void (*callback)(void *user, const int pos[3]),
+                        void *user)
+{
+    const journal_t *journal = volume->journal;
+    uint64_t i;
+    int ret;
+
+    if (    !journal || cursor->id != journal->id ||
+            cursor->count > journal->count ||
+            journal->count - cursor->count > JOURNAL_SIZE) {
+        *cursor = volume_journal_get_cursor(volume);
+        return -1;
+    }
+    ret = journal->count - cursor->count;
+    ((journal_t*)journal)->read = journal->count;
+    if (callback) {
+        for (i = cursor->count; i < journal->count; i++)
+            callback(user, journal->pos[i % JOURNAL_SIZE]);
+    }
+    cursor->count = journal->count;
+    return ret;
 }
 
 void volume_get_global_stats(volume_global_stats_t *stats)
 {
+    int i;
+    pool_stats_t pool_stats = {};
     *stats = g_global_stats;
+    for (i = 0; i < (int)(sizeof(g_data_pools) / sizeof(*g_data_pools)); i++)
+        pool_get_stats(g_data_pools[i], &pool_stats);
+    pool_get_stats(g_tiles_pool, &pool_stats);
+    stats->pool_items = pool_stats.nb_items;
+    stats->pool_capacity = pool_stats.capacity;
+    stats->pool_mem = pool_stats.mem;
 }
@@ -22,7 +22,25 @@
 #include <stdbool.h>
 #include <stdint.h>
 
-#define TILE_SIZE 16
+/*
+ * Define: TILE_SIZE
+ * Size of the tiles of the volumes, 16 by default, and can be set to 32 at
+ * build time.  Bigger tiles make less tiles and draw calls for large dense
+ * volumes, at the cost of more work for each small edit.
+ *
+ * TILE_BITS is the log2 of the tile size.
+ */
+#ifndef TILE_SIZE
+#   define TILE_SIZE 16
+#endif
+
+#if TILE_SIZE == 16
+#   define TILE_BITS 4
+#elif TILE_SIZE == 32
+#   define TILE_BITS 5
+#else
+#   error "TILE_SIZE can only be 16 or 32"
+#endif
 
 /* Type: volume_t
  * Opaque type that represents a voxel volume.
@@ -31,6 +49,12 @@ typedef struct volume volume_t;
 
 typedef struct tile tile_t;
 
+/* Type: tile_data_t
+ * Opaque, reference counted, voxels content of a tile.  The same data can
+ * be shared by several tiles.
+ */
+typedef struct tile_data tile_data_t;
+
 /* Enum: VOLUME_ITER
  * Some flags that can be used to modify the behavior of the iteration
  * function.
@@ -39,14 +63,20 @@ typedef struct tile tile_t;
  * VOLUME_ITER_TILES - Iter on the tiles: the iterator return successive
  *                    tiles positions.
  * VOLUME_ITER_INCLUDES_NEIGHBORS - Also yield one position for each
- *                                neighbor of the voxels.
+ *                                neighbor of the voxels.  The missing
+ *                                neighbor tiles are yielded last, as
+ *                                empty tiles, without modifying the volume.
  * VOLUME_ITER_SKIP_EMPTY - Don't yield empty voxels/tiles.
+ * VOLUME_ACCESSOR_NEIGHBORS - Only for the accessors: also cache the tiles
+ *                             around the current one, see
+ *                             <volume_get_neighbors_accessor>.
  */
 enum {
     VOLUME_ITER_VOXELS                = 1 << 0,
     VOLUME_ITER_TILES                 = 1 << 1,
     VOLUME_ITER_INCLUDES_NEIGHBORS    = 1 << 2,
     VOLUME_ITER_SKIP_EMPTY            = 1 << 3,
+    VOLUME_ACCESSOR_NEIGHBORS         = 1 << 4,
 };
 
 /* Type volume
@@ -69,6 +99,16 @@ typedef struct {
     tile_t *tile;
     int tile_pos[3];
     uint64_t tile_id;
+    int tile_idx; // Index of the tile in the volume tiles table.
+
+    // The last tiles accessed, with VOLUME_ACCESSOR_NEIGHBORS, so that we
+    // can keep a whole 3x3x3 neighborhood.  The ids are zero for the unused
+    // slots, and the volume key for the missing tiles.
+    struct {
+        int         pos[27][3];
+        tile_t      *tiles[27];
+        uint64_t    ids[27];
+    } neighbors;
 
     int pos[3];
     float box[4][4];
@@ -117,6 +157,17 @@ volume_t *volume_copy(const volume_t *volume);
 void volume_set(volume_t *volume, const volume_t *other);
 
 volume_accessor_t volume_get_accessor(const volume_t *volume);
+
+/*
+ * Function: volume_get_neighbors_accessor
+ * Same as <volume_get_accessor>, but the accessor caches all the tiles
+ * around the last accessed one, instead of only that tile.
+ *
+ * This is for the stencil accesses that read the voxels or tiles neighbors
+ * across the tiles borders, where a single cached tile would be replaced
+ * at almost every access.
+ */
+volume_accessor_t volume_get_neighbors_accessor(const volume_t *volume);
 void volume_get_at(const volume_t *volume, volume_iterator_t *it,
                  const int pos[3], uint8_t out[4]);
 uint8_t volume_get_alpha_at(const volume_t *volume, volume_iterator_t *it,
@@ -138,6 +189,8 @@ void volume_set_at(volume_t *volume, volume_iterator_t *it,
                  const int pos[3], const uint8_t v[4]);
 
 // XXX: we should remove this one I guess.
+// If fast is not set, this also replaces the tiles that have all their
+// voxels set to the same value with compact uniform tiles.
 void volume_remove_empty_tiles(volume_t *volume, bool fast);
 
 /*
@@ -217,23 +270,482 @@ int volume_iter(volume_iterator_t *it, int pos[3]);
  */
 uint64_t volume_get_key(const volume_t *volume);
 
+/*
+ * Function: volume_get_tile_data
+ * Return a pointer to the voxels data of a tile.
+ *
+ * Returns NULL if there is no tile at this position, or if the tile doesn't
+ * store its voxels as a plain RGBA array (uniform or indexed tiles).  Use
+ * <volume_get_tile_voxels> to get the voxels of any tile.
+ *
+ * Parameters:
+ *   volume     - The volume.
+ *   accessor   - Optional accessor.
+ *   bpos       - Position of the tile.
+ *   id         - If set, get the id of the tile data.  Two tiles with the
+ *                same data id have the same content.
+ */
 void *volume_get_tile_data(const volume_t *volume, volume_accessor_t *accessor,
                            const int bpos[3], uint64_t *id);
 
+/*
+ * Function: volume_get_tile_voxels
+ * Copy the RGBA voxels of a tile into a buffer.
+ *
+ * This works whatever the storage format of the tile.  A non existing tile
+ * gives zero voxels.
+ *
+ * Parameters:
+ *   volume     - The volume.
+ *   accessor   - Optional accessor.
+ *   bpos       - Position of the tile.
+ *   out        - Output buffer of TILE_SIZE^3 RGBA voxels.
+ */
+void volume_get_tile_voxels(const volume_t *volume, volume_accessor_t *accessor,
+                            const int bpos[3], uint8_t (*out)[4]);
+
+/*
+ * Function: volume_get_tile_bits
+ * Get the occupancy mask of a tile, one bit per voxel.
+ *
+ * The bit of a voxel is set if its alpha is not zero, with the voxels in
+ * the same order as <volume_get_tile_voxels>, 64 per word.  Tiles that
+ * only contain two values, one for the empty voxels and one for the
+ * others (like the selection mask), are fully described by the mask and
+ * those two values.
+ *
+ * Parameters:
+ *   volume     - The volume.
+ *   accessor   - Optional accessor.
+ *   pos        - Position of the tile.
+ *   mask       - Output buffer of TILE_SIZE^3 / 64 words.
+ *   values     - Get the values of the empty and set voxels, if the tile
+ *                only contains two values.
+ *
+ * Returns:
+ *   true if the tile only contains two values.
+ */
+bool volume_get_tile_bits(const volume_t *volume, volume_accessor_t *accessor,
+                          const int pos[3], uint64_t mask[],
+                          uint8_t values[2][4]);
+
+/*
+ * Function: volume_set_tile_bits
+ * Set a tile from an occupancy mask and two values.
+ *
+ * The tile is stored with one bit per voxel.
+ *
+ * Parameters:
+ *   volume     - The volume.
+ *   accessor   - Optional accessor.
+ *   pos        - Position of the tile.
+ *   mask       - TILE_SIZE^3 / 64 words, as returned by
+ *                <volume_get_tile_bits>.
+ *   values     - Value of the voxels with a zero and a one bit.  Only the
+ *                second one can have a non zero alpha.
+ */
+void volume_set_tile_bits(volume_t *volume, volume_accessor_t *accessor,
+                          const int pos[3], const uint64_t mask[],
+                          const uint8_t values[2][4]);
+
+/*
+ * Function: volume_is_tile_uniform
+ * Test whether all the voxels of a tile have the same value.
+ *
+ * Uniform tiles use a compact representation that only stores a single
+ * value.  A non existing tile is considered uniform with a zero value.
+ *
+ * Parameters:
+ *   volume     - The volume.
+ *   accessor   - Optional accessor.
+ *   pos        - Position of the tile.
+ *   out        - Get the value of the voxels if the tile is uniform.
+ *
+ * Returns:
+ *   true if the tile is uniform.
+ */
+bool volume_is_tile_uniform(const volume_t *volume, volume_accessor_t *accessor,
+                            const int pos[3], uint8_t out[4]);
+
+/*
+ * Function: volume_fill_tile
+ * Set all the voxels of a tile to the same value.
+ *
+ * The tile uses a compact uniform representation, that only gets expanded
+ * to a full array of voxels when we write into it.
+ */
+void volume_fill_tile(volume_t *volume, volume_iterator_t *it,
+                      const int pos[3], const uint8_t v[4]);
+
+/*
+ * Function: volume_tile_data_new
+ * Create a new tile data from an array of voxels.
+ *
+ * The data is stored in the most compact format that can represent it.
+ *
+ * Parameters:
+ *   voxels - TILE_SIZE^3 RGBA voxels.
+ *
+ * Return:
+ *   A new reference to the data, to release with <volume_tile_data_release>.
+ */
+tile_data_t *volume_tile_data_new(const uint8_t (*voxels)[4]);
+
+/*
+ * Function: volume_get_tile_data_ref
+ * Get a new reference to the data of a tile.
+ *
+ * Return:
+ *   The data, to release with <volume_tile_data_release>, or NULL if there
+ *   is no tile at this position.
+ */
+tile_data_t *volume_get_tile_data_ref(const volume_t *volume,
+                                      const int pos[3]);
+
+/*
+ * Function: volume_tile_data_release
+ * Release a reference to a tile data.
+ */
+void volume_tile_data_release(tile_data_t *data);
+
+/*
+ * Function: volume_tile_data_get_mem
+ * Return the memory used by a tile data.
+ */
+uint64_t volume_tile_data_get_mem(const tile_data_t *data);
+
+/*
+ * Function: volume_set_tile_data
+ * Set the content of a tile.
+ *
+ * The data is shared, the caller keeps its own reference to it.
+ */
+void volume_set_tile_data(volume_t *volume, const int pos[3],
+                          tile_data_t *data);
+
 // Maybe replace this with a generic volume_copy_part function?
 void volume_copy_tile(const volume_t *src, const int src_pos[3],
                       volume_t *dst, const int dst_pos[3]);
 
+/*
+ * Function: volume_get_tile_hash
+ * Get the 128 bits hash of the voxels of a tile.
+ *
+ * Unlike the tile data ids, the hash only depends on the voxels, so it is
+ * the same for the tiles created separately, or loaded from different
+ * files.  The color of the voxels with a zero alpha is ignored.  It is
+ * computed the first time it is needed, and kept with the tile data until
+ * the next write.  The function is thread safe if the volume is not
+ * packed.
+ *
+ * Return:
+ *   false if the tile is not set or empty.
+ */
+bool volume_get_tile_hash(const volume_t *volume, volume_accessor_t *accessor,
+                          const int pos[3], uint64_t out[2]);
+
+/*
+ * Function: volume_dedup
+ * Share the data of the tiles with the same voxels.
+ *
+ * The tiles data are looked up by hash in a global table, so that the
+ * identical tiles of all the deduplicated volumes use the same memory.
+ * Should be called after creating a lot of new tiles, like after loading
+ * a file.  The uniform tiles are already small and are not deduplicated.
+ *
+ * Return:
+ *   The number of tiles whose data got replaced.
+ */
+int volume_dedup(volume_t *volume);
+
+/*
+ * Function: volume_store_save
+ * Write the tiles of some volumes into a tile store file.
+ *
+ * A tile store is a read only file of all the unique non uniform tiles,
+ * sorted by voxels hash, that several processes can map in memory with
+ * <volume_store_open>, so that a fleet of workers loading the same
+ * project only keep one copy of the voxels in physical memory.  The file
+ * is first written to a temporary file, then renamed, so that the readers
+ * never see a partial file.  It can only be read by the same build of
+ * goxel.  Not supported on Windows and the web version.
+ *
+ * Return:
+ *   The number of tiles written, or -1 in case of error.
+ */
+int volume_store_save(const char *path, volume_t *const *volumes, int nb);
+
+/*
+ * Function: volume_store_open
+ * Map a tile store file as the current store.
+ *
+ * The tiles data of the previous store stay valid until no volume uses
+ * them anymore.  Opening the store that is already open does nothing,
+ * unless the file got replaced.
+ *
+ * Return:
+ *   0 on success, -1 if the file doesn't exist or is not a valid store.
+ */
+int volume_store_open(const char *path);
+
+/*
+ * Function: volume_store_close
+ * Stop using the current tile store for the next shares.
+ */
+void volume_store_close(void);
+
+/*
+ * Function: volume_store_share
+ * Replace the tiles data of a volume by the ones of the current tile store.
+ *
+ * Similar to <volume_dedup>, but the data are mapped from the store file,
+ * so they are shared with all the processes using the same store.  The
+ * shared data are read only: any write to a tile makes a private copy
+ * first.
+ *
+ * Return:
+ *   The number of tiles whose data got replaced.
+ */
+int volume_store_share(volume_t *volume);
+
+/*
+ * Function: volume_get_span
+ * Copy the voxels of an arbitrary box of a volume into a buffer.
+ *
+ * Parameters:
+ *   volume - The volume.
+ *   aabb   - The box to read, as its min (included) and max (excluded)
+ *            corners.
+ *   data   - Output RGBA buffer, in xyz order.
+ *   stride - Optional distance in bytes between two successive rows and
+ *            two successive planes of the buffer.  If NULL, the buffer is
+ *            packed.
+ */
+void volume_get_span(const volume_t *volume, const int aabb[2][3],
+                     uint8_t *data, const int stride[2]);
+
+/*
+ * Function: volume_set_span
+ * Copy a buffer of voxels into an arbitrary box of a volume.
+ *
+ * This is a lot faster than setting the voxels one by one: whole tiles are
+ * copied row by row, and no tile is created for empty parts of the buffer.
+ *
+ * Parameters:
+ *   volume - The volume.
+ *   aabb   - The box to write, as its min (included) and max (excluded)
+ *            corners.
+ *   data   - Input RGBA buffer, in xyz order.
+ *   stride - Optional distance in bytes between two successive rows and
+ *            two successive planes of the buffer.  If NULL, the buffer is
+ *            packed.
+ */
+void volume_set_span(volume_t *volume, const int aabb[2][3],
+                     const uint8_t *data, const int stride[2]);
+
+/*
+ * Function: volume_apply_tiles
+ * Modify the voxels of a list of tiles in parallel.
+ *
+ * The function gets called from the jobs workers with a private copy of
+ * the voxels of each tile.  The modified tiles are only written back into
+ * the volume once all the calls are done, so the function can still read
+ * the volume.  The copy is stored in the worker scratch buffer, so the
+ * function cannot use <jobs_get_scratch>.
+ *
+ * Parameters:
+ *   volume - The volume.
+ *   nb     - Number of tiles.
+ *   pos    - Positions of the tiles.  They should all be different.
+ *   func   - Function called for each tile.  It should return true if it
+ *            changed the voxels.
+ *   user   - User data passed to the function.
+ */
+void volume_apply_tiles(volume_t *volume, int nb, const int (*pos)[3],
+        bool (*func)(void *user, const int pos[3], uint8_t (*voxels)[4]),
+        void *user);
+
+/*
+ * Function: volume_read
+ * Copy the voxels of a box of a volume into a packed buffer.
+ *
+ * Same as <volume_get_span>, with the box given as a position and a size.
+ */
 void volume_read(const volume_t *volume,
                  const int pos[3], const int size[3],
                  uint8_t *data);
 
+/*
+ * Function: volume_pack
+ * Compress the tiles of a volume that won't be accessed soon.
+ *
+ * Only the tiles that are not shared with any other volume get packed, so
+ * this is mostly useful for the undo history snapshots.  The tiles get
+ * unpacked automatically the next time the volume is accessed.
+ *
+ * Parameters:
+ *   volume - The volume.
+ *   spill  - If set, move all the packed tiles to a temporary file on the
+ *            disk, instead of keeping them in memory.
+ *
+ * Return:
+ *   An estimation of the number of bytes of memory released.
+ */
+int64_t volume_pack(volume_t *volume, bool spill);
+
+/*
+ * Function: volume_get_unique_mem
+ * Return the memory used by the tiles that only this volume references.
+ *
+ * This is the memory that would be released by deleting the volume.
+ * Spilled tiles don't count.
+ */
+uint64_t volume_get_unique_mem(const volume_t *volume);
+
+/*
+ * Function: volume_get_mem
+ * Return the memory used by all the tiles of a volume, shared or not.
+ *
+ * This is the memory that keeping the volume can retain.
+ */
+uint64_t volume_get_mem(const volume_t *volume);
+
+/*
+ * Function: volume_iter_tiles_data
+ * Call a function with the id and memory of the data of each tile.
+ *
+ * The ids tell which volumes share the same data.  This doesn't unpack
+ * the tiles, and skips the empty ones.
+ */
+void volume_iter_tiles_data(const volume_t *volume, void *user,
+                            void (*f)(void *user, uint64_t id, uint64_t mem));
+
+/*
+ * Function: volume_get_tiles_count
+ * Return the number of tiles of a volume, including the empty ones.
+ */
 int volume_get_tiles_count(const volume_t *volume);
 
+/*
+ * Type: volume_stats_t
+ * Memory usage of a volume, see <volume_get_stats>.
+ *
+ *   tiles_count    - Number of tiles, including the empty ones.
+ *   mem            - Memory used by all the tiles data.
+ *   shared_mem     - Part of mem used by tiles data also referenced by
+ *                    other volumes, clones or the undo history.
+ */
+typedef struct {
+    int         tiles_count;
+    uint64_t    mem;
+    uint64_t    shared_mem;
+} volume_stats_t;
+
+/*
+ * Function: volume_get_stats
+ * Compute the memory usage of a volume in a single pass over its tiles.
+ *
+ * This doesn't unpack the tiles, but is still linear in the number of
+ * tiles, so callers running every frame should keep the result until the
+ * volume changes.  Spilled tiles don't count.
+ */
+void volume_get_stats(const volume_t *volume, volume_stats_t *stats);
+
+/*
+ * Enum: VOLUME_DIFF
+ * The kinds of tile changes reported by <volume_diff>.
+ *
+ * VOLUME_DIFF_ADDED    - The tile is only set in the second volume.
+ * VOLUME_DIFF_REMOVED  - The tile is only set in the first volume.
+ * VOLUME_DIFF_CHANGED  - The tile is set in both volumes, with different
+ *                        data.
+ */
+enum {
+    VOLUME_DIFF_ADDED   = 1,
+    VOLUME_DIFF_REMOVED,
+    VOLUME_DIFF_CHANGED,
+};
+
+/*
+ * Function: volume_diff
+ * Report the tiles that differ between two volumes.
+ *
+ * The tiles are compared by their data ids, so a changed tile can still
+ * have the same voxels, but a tile with different voxels is always
+ * reported.  Missing and empty tiles are considered the same.  If both
+ * volumes share the same tiles (for example a volume and a copy of it that
+ * hasn't been modified), nothing is reported without iterating the tiles.
+ * The packed tiles are not unpacked.
+ *
+ * Parameters:
+ *   a          - The first volume.
+ *   b          - The second volume.
+ *   callback   - Function called for each different tile with its position
+ *                and one of the VOLUME_DIFF values.
+ *   user       - User data passed to the callback.
+ *
+ * Return:
+ *   The number of different tiles.
+ */
+int volume_diff(const volume_t *a, const volume_t *b,
+                void (*callback)(void *user, const int pos[3], int change),
+                void *user);
+
+/*
+ * Type: volume_cursor_t
+ * Position of a consumer in the journal of a volume.
+ */
+typedef struct {
+    uint64_t id;
+    uint64_t count;
+} volume_cursor_t;
+
+/*
+ * Function: volume_journal_get_cursor
+ * Return a cursor to the current position of the journal of a volume.
+ *
+ * The volumes can keep a bounded journal of the positions of the tiles
+ * written since a cursor, so that the consumers can only update the
+ * tiles that changed.  The journal is only created by the first call to
+ * this function, so the volumes that nobody follows don't pay for it.
+ */
+volume_cursor_t volume_journal_get_cursor(const volume_t *volume);
+
+/*
+ * Function: volume_journal_read
+ * Report the tiles written in a volume since a cursor, and move the cursor
+ * to the current position.
+ *
+ * A tile can be reported several times, or even if its voxels didn't
+ * change.
+ *
+ * Parameters:
+ *   volume     - The volume.
+ *   cursor     - A cursor returned by <volume_journal_get_cursor>.
+ *   callback   - Function called for each tile written.  Can be NULL.
+ *   user       - User data passed to the callback.
+ *
+ * Return:
+ *   The number of tiles reported, or -1 if the journal cannot tell what
+ *   changed since the cursor (the cursor is too old, comes from an other
+ *   volume, or the volume got cleared).  In that case the consumer should
+ *   update everything, and the cursor is reset to the current position.
+ */
+int volume_journal_read(const volume_t *volume, volume_cursor_t *cursor,
+                        void (*callback)(void *user, const int pos[3]),
+                        void *user);
+
 typedef struct {
     int       nb_volumes;
     int       nb_tiles;
     uint64_t  mem;
+    uint64_t  packed_mem;   // Compressed tiles kept in memory.
+    uint64_t  spilled_mem;  // Compressed tiles moved to the disk.
+    uint64_t  shared_mem;   // Tiles mapped from the tile store.
+    // Occupancy of the tiles allocation pools.
+    int       pool_items;
+    int       pool_capacity;
+    uint64_t  pool_mem;
 } volume_global_stats_t;
 
 void volume_get_global_stats(volume_global_stats_t *stats);
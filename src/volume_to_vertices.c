@@ -21,9 +21,13 @@
 #include "utils/color.h"
 
 #include "../ext_src/meshoptimizer/meshoptimizer.h"
+#include "../ext_src/stb/stb_ds.h"
 
 static const int N = BLOCK_SIZE;
 
+// Radius in voxels of the baked ambient occlusion.
+#define AO_RADIUS 3
+
 // Return the next power of 2 larger or equal to x.
 static int next_pow2(int x)
 {
@@ -43,17 +47,6 @@ int volume_generate_vertices_mc(const volume_t *volume, const int block_pos[3],
                               int effects, voxel_vertex_t *out,
                               int *size, int *pos_scale);
 
-static bool block_is_face_visible(uint32_t neighboors_mask, int f)
-{
-#define M(x, y, z) (1 << ((x + 1) + (y + 1) * 3 + (z + 1) * 9))
-    static const uint32_t MASKS[6] = {
-        M(0, -1, 0), M(0, +1, 0), M(0, 0, -1),
-        M(0, 0, +1), M(+1, 0, 0), M(-1, 0, 0),
-    };
-#undef M
-    return !(MASKS[f] & neighboors_mask);
-}
-
 static void block_get_normal(int f, int8_t normal[3], int8_t tangent[3])
 {
     normal[0] = FACES_NORMALS[f][0];
@@ -184,61 +177,346 @@ static uint8_t block_get_border_mask(uint32_t neighboors_mask, int f)
 #undef M
 }
 
-#define data_get_at(d, x, y, z, out) do { \
-    memcpy(out, &data[( \
+// Get a voxel from a cube of data of size n, with a border of one voxel.
+#define data_get_at(d, n, x, y, z, out) do { \
+    memcpy(out, &(d)[( \
                 ((x) + 1) + \
-                ((y) + 1) * (N + 2) + \
-                ((z) + 1) * (N + 2) * (N + 2)) * 4], 4); \
+                ((y) + 1) * ((n) + 2) + \
+                ((z) + 1) * ((n) + 2) * ((n) + 2)) * 4], 4); \
 } while (0)
 
-static uint32_t get_neighboors(const uint8_t *data,
-                               const int pos[3],
+/*
+ * Compute the occupancy bitmask of all the rows of a cube of data of size n
+ * with a border of one voxel.  Bit x of rows[y + z * (n + 2)] is set if the
+ * voxel (x - 1, y - 1, z - 1) is visible.
+ */
+static void get_rows_mask(const uint8_t *data, int n, uint64_t *rows)
+{
+    int x, i;
+    const int m = n + 2;
+    uint64_t r;
+
+    assert(m <= 64);
+    for (i = 0; i < m * m; i++) {
+        r = 0;
+        for (x = 0; x < m; x++)
+            if (data[(i * m + x) * 4 + 3] >= 127) r |= 1ULL << x;
+        rows[i] = r;
+    }
+}
+
+// Get the 27 bits neighbors mask of a voxel from the rows masks, and the
+// alpha values of the neighbors.
+static uint32_t get_neighboors(const uint8_t *data, int n,
+                               const uint64_t *rows, const int pos[3],
                                uint8_t neighboors[27])
 {
     int xx, yy, zz, i = 0;
-    uint8_t v[4];
+    const int m = n + 2;
     uint32_t ret = 0;
-    for (zz = -1; zz <= 1; zz++)
-    for (yy = -1; yy <= 1; yy++)
-    for (xx = -1; xx <= 1; xx++) {
-        data_get_at(data, pos[0] + xx, pos[1] + yy, pos[2] + zz, v);
-        neighboors[i] = v[3];
-        if (neighboors[i] >= 127) ret |= 1 << i;
+    for (zz = 0; zz <= 2; zz++)
+    for (yy = 0; yy <= 2; yy++) {
+        ret |= ((rows[(pos[1] + yy) + (pos[2] + zz) * m] >> pos[0]) & 7)
+                    << (i * 3);
+        for (xx = 0; xx <= 2; xx++) {
+            neighboors[i * 3 + xx] = data[((pos[0] + xx) +
+                                           (pos[1] + yy) * m +
+                                           (pos[2] + zz) * m * m) * 4 + 3];
+        }
         i++;
     }
     return ret;
 }
 
-/* Packing of block id, pos, and face:
- *
- *    x   :  4 bits
- *    y   :  4 bits
- *    z   :  4 bits
- *    pad :  1 bit
- *    face:  3 bits
- *    -------------
- *    tot : 16 bits
+// Packing of the voxel pos and face used for the picking, see
+// PICK_POS_SHIFT.
+static uint32_t get_pos_data(uint32_t x, uint32_t y, uint32_t z, uint32_t f)
+{
+    return ((x << (2 * TILE_BITS + 4)) | (y << (TILE_BITS + 4)) |
+            (z << 4) | f) << PICK_DATA_SHIFT;
+}
+
+// Data of a visible voxel face.
+typedef struct {
+    bool    visible;
+    uint8_t color[4];
+    int8_t  gradient[3];
+    uint8_t shadow_mask;
+    uint8_t borders_mask;
+    uint8_t ao[4];          // Baked occlusion of the vertices, 255 if none.
+} face_t;
+
+/*
+ * Compute the summed volume table of the occupancy of a cube of data of
+ * size n with a border of AO_RADIUS voxels, so that we can count the
+ * visible voxels of any box with only eight lookups.  The table has an
+ * extra zero row in each direction.
+ */
+static void get_ao_sums(const uint8_t *data, int n, uint16_t *sums)
+{
+    int x, y, z;
+    const int d = n + 2 * AO_RADIUS;
+    const int m = d + 1;
+
+#define S(x, y, z) sums[(x) + (y) * m + (z) * m * m]
+    memset(sums, 0, m * m * m * sizeof(*sums));
+    for (z = 1; z < m; z++)
+    for (y = 1; y < m; y++)
+    for (x = 1; x < m; x++) {
+        S(x, y, z) = (data[((x - 1) + (y - 1) * d + (z - 1) * d * d) * 4 + 3]
+                        >= 127) +
+            S(x - 1, y, z) + S(x, y - 1, z) + S(x, y, z - 1)
+            - S(x - 1, y - 1, z) - S(x - 1, y, z - 1) - S(x, y - 1, z - 1)
+            + S(x - 1, y - 1, z - 1);
+    }
+#undef S
+}
+
+// Number of visible voxels in the box from lo (included) to hi (excluded),
+// in the block coordinates.
+static int get_ao_box_sum(const uint16_t *sums, int n,
+                          const int lo_[3], const int hi_[3])
+{
+    const int m = n + 2 * AO_RADIUS + 1;
+    int lo[3], hi[3], i;
+    for (i = 0; i < 3; i++) {
+        lo[i] = lo_[i] + AO_RADIUS;
+        hi[i] = hi_[i] + AO_RADIUS;
+    }
+#define S(x, y, z) (int)sums[(x) + (y) * m + (z) * m * m]
+    return S(hi[0], hi[1], hi[2]) - S(lo[0], hi[1], hi[2])
+         - S(hi[0], lo[1], hi[2]) - S(hi[0], hi[1], lo[2])
+         + S(lo[0], lo[1], hi[2]) + S(lo[0], hi[1], lo[2])
+         + S(hi[0], lo[1], lo[2]) - S(lo[0], lo[1], lo[2]);
+#undef S
+}
+
+/*
+ * Compute the ambient occlusion of a face vertex from the average fraction
+ * of visible voxels in boxes of growing size in front of the vertex, so
+ * that the close voxels count more than the far ones.
  */
-static uint16_t get_pos_data(uint16_t x, uint16_t y, uint16_t z, uint16_t f)
+static uint8_t get_vertex_ao(const uint16_t *sums, int n, int f,
+                             const int corner[3])
 {
-    assert(BLOCK_SIZE == 16);
-    return (x << 12) | (y << 8) | (z << 4) | (f << 0);
+    int r, a, lo[3], hi[3];
+    const int *normal = FACES_NORMALS[f];
+    float occ = 0;
+
+    for (r = 1; r <= AO_RADIUS; r++) {
+        for (a = 0; a < 3; a++) {
+            lo[a] = normal[a] > 0 ? corner[a] : corner[a] - r;
+            hi[a] = normal[a] < 0 ? corner[a] : corner[a] + r;
+        }
+        occ += get_ao_box_sum(sums, n, lo, hi) / (float)(4 * r * r * r);
+    }
+    // Squared so that the contact edges are as dark as with the occlusion
+    // texture.
+    occ = 1 - occ / AO_RADIUS;
+    return occ * occ * 255;
 }
 
+/*
+ * Add a quad covering the faces f of all the voxels from lo to hi
+ * (included).  For a single voxel face lo and hi are the same.
+ */
+static int add_face(voxel_vertex_t *out, int nb, int f, const face_t *face,
+                    const int lo[3], const int hi[3])
+{
+    int i, a;
+    int8_t normal[3], tangent[3];
+    const int ts = VOXEL_TEXTURE_SIZE;
+    const int *vpos;
+    voxel_vertex_t *vert;
+
+    block_get_normal(f, normal, tangent);
+    for (i = 0; i < 4; i++) {
+        vert = &out[nb * 4 + i];
+        vpos = VERTICES_POSITIONS[FACES_VERTICES[f][i]];
+        for (a = 0; a < 3; a++)
+            vert->pos[a] = vpos[a] ? hi[a] + 1 : lo[a];
+        memcpy(vert->normal, normal, sizeof(normal));
+        memcpy(vert->tangent, tangent, sizeof(tangent));
+        memcpy(vert->gradient, face->gradient, sizeof(face->gradient));
+        memcpy(vert->color, face->color, sizeof(face->color));
+        vert->color[3] = vert->color[3] ? 255 : 0;
+        vert->occlusion_uv[0] =
+            face->shadow_mask % 16 * ts + VERTICE_UV[i][0] * (ts - 1);
+        vert->occlusion_uv[1] =
+            face->shadow_mask / 16 * ts + VERTICE_UV[i][1] * (ts - 1);
+        vert->uv[0] = VERTICE_UV[i][0] * 255;
+        vert->uv[1] = VERTICE_UV[i][1] * 255;
+        // For testing:
+        // This put a border bump on all the edges of the voxel.
+        vert->bump_uv[0] = (face->borders_mask % 16) * 16;
+        vert->bump_uv[1] = (face->borders_mask / 16) * 16;
+        vert->pos_data = get_pos_data(lo[0], lo[1], lo[2], f);
+        vert->ao = face->ao[i];
+    }
+    return nb + 1;
+}
+
+// Only the faces without occlusion or borders can be merged, so that the
+// merged quads still render the same.
+static bool face_can_merge(const face_t *face)
+{
+    return face->visible && !face->shadow_mask && !face->borders_mask &&
+           (face->ao[0] & face->ao[1] & face->ao[2] & face->ao[3]) == 255;
+}
+
+static bool faces_can_merge(const face_t *a, const face_t *b)
+{
+    return face_can_merge(b) &&
+           memcmp(a->color, b->color, sizeof(a->color)) == 0 &&
+           memcmp(a->gradient, b->gradient, sizeof(a->gradient)) == 0;
+}
+
+/*
+ * Greedy meshing: for each face direction and slice of the block, grow
+ * rectangles of identical faces, first along the u axis, then along the v
+ * axis, and emit a single quad for each of them.
+ */
+static int merge_faces(const face_t *faces, voxel_vertex_t *out)
+{
+    int f, n, u, v, d, i, j, k, w, h, nb = 0;
+    int lo[3], hi[3], p[3];
+    const face_t *face;
+    bool *used = calloc(N * N * N, sizeof(*used));
+
+#define IDX(p) ((p)[0] + (p)[1] * N + (p)[2] * N * N)
+    for (f = 0; f < 6; f++, faces += N * N * N) {
+        memset(used, 0, N * N * N * sizeof(*used));
+        n = FACES_NORMALS[f][0] ? 0 : FACES_NORMALS[f][1] ? 1 : 2;
+        u = (n + 1) % 3;
+        v = (n + 2) % 3;
+        for (d = 0; d < N; d++)
+        for (j = 0; j < N; j++)
+        for (i = 0; i < N; i++) {
+            lo[n] = d;
+            lo[u] = i;
+            lo[v] = j;
+            face = &faces[IDX(lo)];
+            if (!face->visible || used[IDX(lo)]) continue;
+            w = 1;
+            h = 1;
+            if (face_can_merge(face)) {
+                memcpy(p, lo, sizeof(p));
+                for (p[u] = i + 1; p[u] < N; p[u]++, w++) {
+                    if (used[IDX(p)] || !faces_can_merge(face, &faces[IDX(p)]))
+                        break;
+                }
+                for (p[v] = j + 1; p[v] < N; p[v]++, h++) {
+                    for (k = 0; k < w; k++) {
+                        p[u] = i + k;
+                        if (    used[IDX(p)] ||
+                                !faces_can_merge(face, &faces[IDX(p)]))
+                            break;
+                    }
+                    if (k < w) break;
+                }
+            }
+            memcpy(hi, lo, sizeof(hi));
+            hi[u] += w - 1;
+            hi[v] += h - 1;
+            memcpy(p, lo, sizeof(p));
+            for (p[v] = lo[v]; p[v] <= hi[v]; p[v]++)
+            for (p[u] = lo[u]; p[u] <= hi[u]; p[u]++)
+                used[IDX(p)] = true;
+            nb = add_face(out, nb, f, face, lo, hi);
+        }
+    }
+#undef IDX
+    free(used);
+    return nb;
+}
+
+/*
+ * Generate the quads of a cube of n^3 voxels.  The data contains the voxels
+ * of the cube plus a border of one voxel.  If ao_sums is set, it is the
+ * summed occupancy table used to bake the ambient occlusion of the
+ * vertices (see get_ao_sums).
+ */
+static int generate_cubes(const uint8_t *data, int n, int effects,
+                          const uint16_t *ao_sums, voxel_vertex_t *out)
+{
+    int x, y, z, f, i, a, corner[3];
+    int nb = 0;
+    const int m = n + 2;
+    uint32_t neighboors_mask;
+    uint64_t row, r, visible[6];
+    uint64_t rows[(BLOCK_SIZE + 2) * (BLOCK_SIZE + 2)];
+    uint8_t neighboors[27], v[4];
+    int pos[3];
+    face_t face, *faces = NULL;
+
+    // In greedy mode, first collect all the faces, and merge them after.
+    if (effects & EFFECT_GREEDY_MESH)
+        faces = calloc(6 * N * N * N, sizeof(*faces));
+
+    // Compute the visible faces of a full row at once from the rows masks,
+    // and only look at the neighbors of the voxels that have some.
+    assert(n <= BLOCK_SIZE);
+    get_rows_mask(data, n, rows);
+    for (z = 0; z < n; z++)
+    for (y = 0; y < n; y++) {
+#define ROW(y, z) rows[((y) + 1) + ((z) + 1) * m]
+        row = ROW(y, z);
+        r = row & (((1ULL << n) - 1) << 1); // Skip the border voxels.
+        if (!r) continue;
+        visible[0] = r & ~ROW(y - 1, z);
+        visible[1] = r & ~ROW(y + 1, z);
+        visible[2] = r & ~ROW(y, z - 1);
+        visible[3] = r & ~ROW(y, z + 1);
+        visible[4] = r & ~(row >> 1);
+        visible[5] = r & ~(row << 1);
+#undef ROW
+        for (r = visible[0] | visible[1] | visible[2] |
+                 visible[3] | visible[4] | visible[5]; r; r &= r - 1) {
+            x = __builtin_ctzll(r) - 1;
+            pos[0] = x;
+            pos[1] = y;
+            pos[2] = z;
+            data_get_at(data, n, x, y, z, v);
+            neighboors_mask = get_neighboors(data, n, rows, pos, neighboors);
+            for (f = 0; f < 6; f++) {
+                if (!(visible[f] & (2ULL << x))) continue;
+                face.visible = true;
+                memcpy(face.color, v, sizeof(v));
+                block_get_gradient(neighboors_mask, neighboors, f,
+                                   face.gradient);
+                face.shadow_mask = block_get_shadow_mask(neighboors_mask, f);
+                face.borders_mask = block_get_border_mask(neighboors_mask, f);
+                for (i = 0; i < 4; i++) {
+                    face.ao[i] = 255;
+                    if (!ao_sums) continue;
+                    for (a = 0; a < 3; a++) {
+                        corner[a] = pos[a] + VERTICES_POSITIONS[
+                                            FACES_VERTICES[f][i]][a];
+                    }
+                    face.ao[i] = get_vertex_ao(ao_sums, n, f, corner);
+                }
+                if (faces)
+                    faces[f * N * N * N + x + y * N + z * N * N] = face;
+                else
+                    nb = add_face(out, nb, f, &face, pos, pos);
+            }
+        }
+    }
+    if (faces) {
+        nb = merge_faces(faces, out);
+        free(faces);
+    }
+    return nb;
+}
 
 int volume_generate_vertices(const volume_t *volume, const int block_pos[3],
                            int effects, voxel_vertex_t *out,
                            int *size, int *subdivide)
 {
-    int x, y, z, f;
-    int i, nb = 0;
-    uint32_t neighboors_mask;
-    uint8_t shadow_mask, borders_mask;
-    const int ts = VOXEL_TEXTURE_SIZE;
-    uint8_t *data, neighboors[27], v[4];
-    int8_t normal[3], tangent[3], gradient[3];
-    int pos[3];
-    const int *vpos;
+    int nb, z, y;
+    uint8_t *data, *big;
+    uint16_t *ao_sums = NULL;
+    const int r = AO_RADIUS, d = N + 2 * AO_RADIUS, m = N + 2;
 
     if (effects & EFFECT_MARCHING_CUBES)
         return volume_generate_vertices_mc(volume, block_pos, effects, out,
@@ -251,50 +529,94 @@ int volume_generate_vertices(const volume_t *volume, const int block_pos[3],
     // XXX: can we do this while still using volume iterators somehow?
 #define IVEC(...) ((int[]){__VA_ARGS__})
     data = malloc((N + 2) * (N + 2) * (N + 2) * 4);
-    volume_read(volume,
-              IVEC(block_pos[0] - 1, block_pos[1] - 1, block_pos[2] - 1),
-              IVEC(N + 2, N + 2, N + 2), data);
-
-    for (z = 0; z < N; z++)
-    for (y = 0; y < N; y++)
-    for (x = 0; x < N; x++) {
-        pos[0] = x;
-        pos[1] = y;
-        pos[2] = z;
-        data_get_at(data, x, y, z, v);
-        if (v[3] < 127) continue;    // Non visible
-        neighboors_mask = get_neighboors(data, pos, neighboors);
-        for (f = 0; f < 6; f++) {
-            if (!block_is_face_visible(neighboors_mask, f)) continue;
-            block_get_normal(f, normal, tangent);
-            block_get_gradient(neighboors_mask, neighboors, f, gradient);
-            shadow_mask = block_get_shadow_mask(neighboors_mask, f);
-            borders_mask = block_get_border_mask(neighboors_mask, f);
-            for (i = 0; i < 4; i++) {
-                vpos = VERTICES_POSITIONS[FACES_VERTICES[f][i]];
-                out[nb * 4 + i].pos[0] = x + vpos[0];
-                out[nb * 4 + i].pos[1] = y + vpos[1];
-                out[nb * 4 + i].pos[2] = z + vpos[2];
-                memcpy(out[nb * 4 + i].normal, normal, sizeof(normal));
-                memcpy(out[nb * 4 + i].tangent, tangent, sizeof(tangent));
-                memcpy(out[nb * 4 + i].gradient, gradient, sizeof(gradient));
-                memcpy(out[nb * 4 + i].color, v, sizeof(v));
-                out[nb * 4 + i].color[3] = out[nb * 4 + i].color[3] ? 255 : 0;
-                out[nb * 4 + i].occlusion_uv[0] =
-                    shadow_mask % 16 * ts + VERTICE_UV[i][0] * (ts - 1);
-                out[nb * 4 + i].occlusion_uv[1] =
-                    shadow_mask / 16 * ts + VERTICE_UV[i][1] * (ts - 1);
-                out[nb * 4 + i].uv[0] = VERTICE_UV[i][0] * 255;
-                out[nb * 4 + i].uv[1] = VERTICE_UV[i][1] * 255;
-                // For testing:
-                // This put a border bump on all the edges of the voxel.
-                out[nb * 4 + i].bump_uv[0] = (borders_mask % 16) * 16;
-                out[nb * 4 + i].bump_uv[1] = (borders_mask / 16) * 16;
-                out[nb * 4 + i].pos_data = get_pos_data(x, y, z, f);
-            }
-            nb++;
+    if (effects & EFFECT_BAKED_AO) {
+        // Read a bigger cube for the occlusion, and extract the cube with
+        // a border of one voxel from it.
+        big = malloc(d * d * d * 4);
+        volume_read(volume,
+                  IVEC(block_pos[0] - r, block_pos[1] - r, block_pos[2] - r),
+                  IVEC(d, d, d), big);
+        for (z = 0; z < m; z++)
+        for (y = 0; y < m; y++) {
+            memcpy(&data[(y * m + z * m * m) * 4],
+                   &big[((r - 1) + (y + r - 1) * d +
+                         (z + r - 1) * d * d) * 4], m * 4);
         }
+        ao_sums = malloc((d + 1) * (d + 1) * (d + 1) * sizeof(*ao_sums));
+        get_ao_sums(big, N, ao_sums);
+        free(big);
+    } else {
+        volume_read(volume,
+                  IVEC(block_pos[0] - 1, block_pos[1] - 1, block_pos[2] - 1),
+                  IVEC(N + 2, N + 2, N + 2), data);
     }
+    nb = generate_cubes(data, N, effects, ao_sums, out);
+    free(ao_sums);
+    free(data);
+    return nb;
+}
+
+/*
+ * Downsample a cube of voxels by a factor s.  A coarse voxel is visible if
+ * any of its voxels is, so that the thin walls don't disappear, and gets
+ * the average color of the visible ones.
+ *
+ * The input cube has a border of s voxels, and the output a border of one
+ * voxel.
+ */
+static void downsample(const uint8_t *data, int n, int s, uint8_t *out)
+{
+    int x, y, z, i, j, k, c, count, sum[3];
+    const int d = n * s + 2 * s;    // Size of the input cube.
+    const int m = n + 2;            // Size of the output cube.
+    const uint8_t *v;
+    uint8_t *o;
+
+    for (z = 0; z < m; z++)
+    for (y = 0; y < m; y++)
+    for (x = 0; x < m; x++) {
+        count = 0;
+        sum[0] = sum[1] = sum[2] = 0;
+        for (k = 0; k < s; k++)
+        for (j = 0; j < s; j++)
+        for (i = 0; i < s; i++) {
+            v = &data[((x * s + i) + (y * s + j) * d +
+                       (z * s + k) * d * d) * 4];
+            if (v[3] < 127) continue;
+            for (c = 0; c < 3; c++) sum[c] += v[c];
+            count++;
+        }
+        o = &out[(x + y * m + z * m * m) * 4];
+        for (c = 0; c < 3; c++) o[c] = count ? sum[c] / count : 0;
+        o[3] = count ? 255 : 0;
+    }
+}
+
+int volume_generate_vertices_lod(const volume_t *volume,
+                                 const int block_pos[3], int lod,
+                                 int effects, voxel_vertex_t *out,
+                                 int *size, int *subdivide)
+{
+    int nb, n, s, d;
+    uint8_t *data, *mip;
+
+    if (lod == 0 || (effects & EFFECT_MARCHING_CUBES))
+        return volume_generate_vertices(volume, block_pos, effects, out,
+                                        size, subdivide);
+    *size = 4;
+    *subdivide = 1;
+    s = 1 << lod;
+    n = N / s;
+    d = N + 2 * s;
+    data = malloc(d * d * d * 4);
+    mip = malloc((n + 2) * (n + 2) * (n + 2) * 4);
+    volume_read(volume,
+              IVEC(block_pos[0] - s, block_pos[1] - s, block_pos[2] - s),
+              IVEC(d, d, d), data);
+    downsample(data, n, s, mip);
+    // The far tiles don't get the baked occlusion.
+    nb = generate_cubes(mip, n, effects, NULL, out);
+    free(mip);
     free(data);
     return nb;
 }
@@ -368,35 +690,50 @@ static void fill_mesh(volume_mesh_t *mesh,
     mesh->vertices_count += nb * size;
 }
 
-static void optimize_mesh(volume_mesh_t *mesh, float simplify)
+// Merge the duplicated vertices of a mesh.
+static void merge_vertices(volume_mesh_t *mesh)
 {
-    unsigned int *remap;
-    unsigned int *tmp_indices;
-    typeof(*mesh->vertices) *tmp_vertices;
+    unsigned int *remap, *indices;
+    typeof(*mesh->vertices) *vertices;
     size_t vertices_count;
-    size_t indices_count;
-    int target_index_count;
-	float target_error = 1e-2f;
 
-    // Merge duplicated vertices.
+    if (mesh->vertices_count == 0) return;
     remap = calloc(mesh->vertices_count, sizeof(unsigned int));
     vertices_count = meshopt_generateVertexRemap(
             remap, mesh->indices, mesh->indices_count, mesh->vertices,
             mesh->vertices_count, sizeof(*mesh->vertices));
 
-    tmp_indices = malloc(mesh->indices_count * sizeof(*tmp_indices));
+    indices = malloc(mesh->indices_count * sizeof(*indices));
     meshopt_remapIndexBuffer(
-            tmp_indices, mesh->indices, mesh->indices_count, remap);
+            indices, mesh->indices, mesh->indices_count, remap);
 
-    tmp_vertices = malloc(vertices_count * sizeof(*mesh->vertices));
+    vertices = malloc(vertices_count * sizeof(*mesh->vertices));
     meshopt_remapVertexBuffer(
-            tmp_vertices, mesh->vertices, mesh->vertices_count,
+            vertices, mesh->vertices, mesh->vertices_count,
             sizeof(*mesh->vertices), remap);
 
     free(remap);
-    SWAP(mesh->vertices, tmp_vertices);
-    SWAP(mesh->indices, tmp_indices);
+    free(mesh->vertices);
+    free(mesh->indices);
+    mesh->vertices = vertices;
+    mesh->indices = indices;
     mesh->vertices_count = vertices_count;
+}
+
+static void optimize_mesh(volume_mesh_t *mesh, float simplify)
+{
+    unsigned int *tmp_indices;
+    typeof(*mesh->vertices) *tmp_vertices;
+    size_t vertices_count;
+    size_t indices_count;
+    int target_index_count;
+	float target_error = 1e-2f;
+
+    // Merge the duplicated vertices at the tiles boundaries, the vertices
+    // of each tile have already been merged.
+    merge_vertices(mesh);
+    tmp_indices = malloc(mesh->indices_count * sizeof(*tmp_indices));
+    tmp_vertices = malloc(mesh->vertices_count * sizeof(*mesh->vertices));
 
     // Also simplify the mesh if required.
 	target_index_count = (int)(mesh->indices_count * (1 - simplify));
@@ -407,41 +744,33 @@ static void optimize_mesh(volume_mesh_t *mesh, float simplify)
                 (const float*)mesh->vertices, mesh->vertices_count,
                 sizeof(*mesh->vertices), target_index_count, target_error,
                 0, NULL);
-        vertices_count = meshopt_optimizeVertexFetch(
-                tmp_vertices, tmp_indices, indices_count,
-                mesh->vertices, mesh->vertices_count, sizeof(*mesh->vertices));
-        SWAP(mesh->vertices, tmp_vertices);
         SWAP(mesh->indices, tmp_indices);
-        mesh->vertices_count = vertices_count;
         mesh->indices_count = indices_count;
     }
 
+    // Reorder the triangles for the post transform cache and to reduce
+    // overdraw, then the vertices in the order they are fetched (this also
+    // removes the vertices no longer used after the simplification).
+    meshopt_optimizeVertexCache(
+            tmp_indices, mesh->indices, mesh->indices_count,
+            mesh->vertices_count);
+    meshopt_optimizeOverdraw(
+            mesh->indices, tmp_indices, mesh->indices_count,
+            (const float*)mesh->vertices, mesh->vertices_count,
+            sizeof(*mesh->vertices), 1.05f);
+    vertices_count = meshopt_optimizeVertexFetch(
+            tmp_vertices, mesh->indices, mesh->indices_count,
+            mesh->vertices, mesh->vertices_count, sizeof(*mesh->vertices));
+    SWAP(mesh->vertices, tmp_vertices);
+    mesh->vertices_count = vertices_count;
+
     free(tmp_vertices);
     free(tmp_indices);
 }
 
-volume_mesh_t *volume_generate_mesh(
-        const volume_t *volume, int effects, const palette_t *palette,
-        float simplify)
+static void mesh_compute_bounds(volume_mesh_t *mesh)
 {
-    volume_iterator_t iter;
-    int bpos[3];
-    voxel_vertex_t *verts;
-    int i, nb, size, subdivide;
-    volume_mesh_t *mesh = calloc(1, sizeof(*mesh));
-
-    verts = calloc(N * N * N * 6 * 4, sizeof(*verts));
-    iter = volume_get_iterator(volume,
-            VOLUME_ITER_TILES | VOLUME_ITER_INCLUDES_NEIGHBORS);
-    while (volume_iter(&iter, bpos)) {
-        nb = volume_generate_vertices(volume, bpos, effects, verts,
-                                      &size, &subdivide);
-        if (nb == 0) continue;
-        fill_mesh(mesh, verts, nb, size, subdivide, bpos, palette);
-    }
-    free(verts);
-
-    optimize_mesh(mesh, simplify);
+    int i;
 
     mesh->pos_min[0] = +FLT_MAX;
     mesh->pos_min[1] = +FLT_MAX;
@@ -457,7 +786,110 @@ volume_mesh_t *volume_generate_mesh(
         mesh->pos_max[1] = max(mesh->vertices[i].pos[1], mesh->pos_max[1]);
         mesh->pos_max[2] = max(mesh->vertices[i].pos[2], mesh->pos_max[2]);
     }
+}
 
+// The mesh of a single tile, generated in a parallel job.
+typedef struct {
+    const volume_t  *volume;
+    int             effects;
+    const palette_t *palette;
+    int             pos[3];
+    volume_mesh_t   chunk;
+    int             vertices_ofs; // Position in the final mesh.
+    int             indices_ofs;
+    volume_mesh_t   *mesh;
+} tile_mesh_t;
+
+static void tile_mesh_job(void *user, int i, int worker)
+{
+    tile_mesh_t *item = (tile_mesh_t*)user + i;
+    voxel_vertex_t *buf = jobs_get_scratch(N * N * N * 6 * 4 * sizeof(*buf));
+    int nb, size, subdivide;
+
+    nb = volume_generate_vertices(item->volume, item->pos, item->effects,
+                                  buf, &size, &subdivide);
+    if (nb == 0) return;
+    fill_mesh(&item->chunk, buf, nb, size, subdivide, item->pos,
+              item->palette);
+    merge_vertices(&item->chunk);
+}
+
+// Copy the mesh of a tile into its place in the final mesh.
+static void tile_mesh_copy_job(void *user, int i, int worker)
+{
+    tile_mesh_t *item = (tile_mesh_t*)user + i;
+    volume_mesh_t *mesh = item->mesh;
+    int j;
+
+    if (item->chunk.vertices_count == 0) return;
+    memcpy(mesh->vertices + item->vertices_ofs, item->chunk.vertices,
+           item->chunk.vertices_count * sizeof(*mesh->vertices));
+    for (j = 0; j < item->chunk.indices_count; j++) {
+        mesh->indices[item->indices_ofs + j] =
+            item->chunk.indices[j] + item->vertices_ofs;
+    }
+    free(item->chunk.vertices);
+    free(item->chunk.indices);
+}
+
+volume_mesh_t *volume_generate_mesh(
+        const volume_t *volume, int effects, const palette_t *palette,
+        float simplify)
+{
+    volume_iterator_t iter;
+    int i, bpos[3];
+    tile_mesh_t item, *items = NULL;
+    volume_mesh_t *mesh = calloc(1, sizeof(*mesh));
+
+    // Generate the mesh of each tile in parallel, and then concatenate them
+    // in the iteration order, so that the mesh is always the same.  The
+    // tiles meshes have their vertices already merged, so that we never
+    // have to keep all the non merged vertices in memory.
+    iter = volume_get_iterator(volume,
+            VOLUME_ITER_TILES | VOLUME_ITER_INCLUDES_NEIGHBORS);
+    while (volume_iter(&iter, bpos)) {
+        item = (tile_mesh_t) {
+            .volume = volume,
+            .effects = effects,
+            .palette = palette,
+            .mesh = mesh,
+        };
+        memcpy(item.pos, bpos, sizeof(item.pos));
+        arrput(items, item);
+    }
+    jobs_parallel_for(arrlen(items), tile_mesh_job, items);
+    for (i = 0; i < arrlen(items); i++) {
+        items[i].vertices_ofs = mesh->vertices_count;
+        items[i].indices_ofs = mesh->indices_count;
+        mesh->vertices_count += items[i].chunk.vertices_count;
+        mesh->indices_count += items[i].chunk.indices_count;
+    }
+    mesh->vertices = malloc(mesh->vertices_count * sizeof(*mesh->vertices));
+    mesh->indices = malloc(mesh->indices_count * sizeof(*mesh->indices));
+    jobs_parallel_for(arrlen(items), tile_mesh_copy_job, items);
+    arrfree(items);
+
+    optimize_mesh(mesh, simplify);
+    mesh_compute_bounds(mesh);
+    return mesh;
+}
+
+volume_mesh_t *volume_generate_tile_mesh(
+        const volume_t *volume, const int pos[3], int effects,
+        const palette_t *palette, float simplify)
+{
+    volume_mesh_t *mesh = calloc(1, sizeof(*mesh));
+    voxel_vertex_t *buf = jobs_get_scratch(N * N * N * 6 * 4 * sizeof(*buf));
+    int nb, size, subdivide;
+
+    nb = volume_generate_vertices(volume, pos, effects, buf,
+                                  &size, &subdivide);
+    if (nb) {
+        fill_mesh(mesh, buf, nb, size, subdivide, (int[]){0, 0, 0},
+                  palette);
+    }
+    optimize_mesh(mesh, simplify);
+    mesh_compute_bounds(mesh);
     return mesh;
 }
 
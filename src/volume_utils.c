@@ -31,6 +31,92 @@ static int volume_del(void *data_)
     return 0;
 }
 
+static int tile_data_del(void *data)
+{
+    volume_tile_data_release(data);
+    return 0;
+}
+
+// State of a tile during volume_select.
+typedef struct {
+    UT_hash_handle  hh;
+    int             pos[3];
+    uint64_t        occupied[N * N * N / 64];   // Voxels of the volume.
+    uint64_t        selected[N * N * N / 64];
+    uint8_t         *alpha; // Only if some selected voxels are not opaque.
+} select_tile_t;
+
+typedef struct {
+    const volume_t      *volume;
+    volume_accessor_t   accessor;
+    select_tile_t       *tiles;
+    select_tile_t       *last;
+} select_ctx_t;
+
+// Get the state of the tile of a voxel, and the voxel index in the tile.
+static select_tile_t *select_get_tile(select_ctx_t *ctx, const int p[3],
+                                      int *idx)
+{
+    int pos[3] = {p[0] & ~(N - 1), p[1] & ~(N - 1), p[2] & ~(N - 1)};
+    uint8_t values[2][4];
+    select_tile_t *tile = ctx->last;
+
+    *idx = (p[0] - pos[0]) + (p[1] - pos[1]) * N + (p[2] - pos[2]) * N * N;
+    if (tile && memcmp(tile->pos, pos, sizeof(pos)) == 0) return tile;
+    HASH_FIND(hh, ctx->tiles, pos, sizeof(pos), tile);
+    if (!tile) {
+        tile = calloc(1, sizeof(*tile));
+        memcpy(tile->pos, pos, sizeof(pos));
+        volume_get_tile_bits(ctx->volume, &ctx->accessor, pos,
+                             tile->occupied, values);
+        HASH_ADD(hh, ctx->tiles, pos, sizeof(pos), tile);
+    }
+    ctx->last = tile;
+    return tile;
+}
+
+static void select_set(select_tile_t *tile, int idx, int a)
+{
+    tile->selected[idx / 64] |= 1ULL << (idx % 64);
+    if (a == 255 && !tile->alpha) return;
+    if (!tile->alpha) {
+        tile->alpha = malloc(N * N * N);
+        memset(tile->alpha, 255, N * N * N);
+    }
+    tile->alpha[idx] = a;
+}
+
+// Write the selected voxels of a tile into the selection volume.
+static void select_commit(select_tile_t *tile, volume_t *selection,
+                          volume_accessor_t *accessor)
+{
+    const uint8_t values[2][4] = {{0, 0, 0, 0}, {255, 255, 255, 255}};
+    uint8_t (*voxels)[4];
+    tile_data_t *data;
+    int i;
+
+    if (!tile->alpha) {
+        volume_set_tile_bits(selection, accessor, tile->pos, tile->selected,
+                             values);
+        return;
+    }
+    voxels = calloc(N * N * N, sizeof(*voxels));
+    for (i = 0; i < N * N * N; i++) {
+        if (!(tile->selected[i / 64] & (1ULL << (i % 64)))) continue;
+        memcpy(voxels[i], (uint8_t[]){255, 255, 255, tile->alpha[i]}, 4);
+    }
+    data = volume_tile_data_new((const void*)voxels);
+    volume_set_tile_data(selection, tile->pos, data);
+    volume_tile_data_release(data);
+    free(voxels);
+}
+
+/*
+ * The flood fill keeps the occupancy of the volume and the selected voxels
+ * as one bit per voxel in a table of the visited tiles, instead of going
+ * through the volumes for each neighbor test, and the selection is written
+ * one tile at a time at the end.
+ */
 int volume_select(const volume_t *volume,
                 const int start_pos[3],
                 int (*cond)(void *user, const volume_t *volume,
@@ -39,144 +125,475 @@ int volume_select(const volume_t *volume,
                             volume_accessor_t *volume_accessor),
                 void *user, volume_t *selection)
 {
-    int i, a;
+    int i, a, idx, base_idx, head = 0, nb = 0, size = 0;
     int pos[3], p[3];
-    bool keep = true;
-    volume_iterator_t iter;
-    volume_accessor_t volume_accessor, selection_accessor;
+    int (*queue)[3] = NULL;
+    uint64_t bit;
+    select_ctx_t ctx = {.volume = volume};
+    select_tile_t *tile, *base, *tmp;
+    volume_accessor_t selection_accessor;
     volume_clear(selection);
 
-    volume_accessor = volume_get_accessor(volume);
+    ctx.accessor = volume_get_neighbors_accessor(volume);
     selection_accessor = volume_get_accessor(selection);
 
-    if (!volume_get_alpha_at(volume, &volume_accessor, start_pos))
-        return 0;
-    volume_set_at(selection, &selection_accessor, start_pos,
-                (uint8_t[]){255, 255, 255, 255});
-
-    // XXX: Very inefficient algorithm!
-    // Iter and test all the neighbors of the selection until there is
-    // no more possible changes.
-    while (keep) {
-        keep = false;
-        iter = volume_get_iterator(selection, VOLUME_ITER_VOXELS);
-        while (volume_iter(&iter, pos)) {
-            // Shouldn't be needed if the iter function did filter the voxels.
-            if (!volume_get_alpha_at(selection, &selection_accessor, pos))
-                continue;
+    tile = select_get_tile(&ctx, start_pos, &idx);
+    if (tile->occupied[idx / 64] & (1ULL << (idx % 64))) {
+        select_set(tile, idx, 255);
 
-            for (i = 0; i < 6; i++) {
-                p[0] = pos[0] + FACES_NORMALS[i][0];
-                p[1] = pos[1] + FACES_NORMALS[i][1];
-                p[2] = pos[2] + FACES_NORMALS[i][2];
-                if (volume_get_alpha_at(selection, &selection_accessor, p))
-                    continue; // Already done.
-                if (!volume_get_alpha_at(volume, &volume_accessor, p))
-                    continue; // No voxel here.
-                a = cond(user, volume, pos, p, &volume_accessor);
-                if (a) {
-                    volume_set_at(selection, &selection_accessor, p,
-                                (uint8_t[]){255, 255, 255, a});
-                    keep = true;
-                }
+        // Flood fill: each selected voxel is added to the queue once, and
+        // we test its neighbors that are not selected yet.
+        size = 1024;
+        queue = malloc(size * sizeof(*queue));
+        memcpy(queue[nb++], start_pos, sizeof(queue[0]));
+    }
+    while (head < nb) {
+        memcpy(pos, queue[head++], sizeof(pos));
+        base = select_get_tile(&ctx, pos, &base_idx);
+        for (i = 0; i < 6; i++) {
+            p[0] = pos[0] + FACES_NORMALS[i][0];
+            p[1] = pos[1] + FACES_NORMALS[i][1];
+            p[2] = pos[2] + FACES_NORMALS[i][2];
+            // Most neighbors are in the same tile.
+            if ((((p[0] ^ pos[0]) | (p[1] ^ pos[1]) | (p[2] ^ pos[2])) &
+                 ~(N - 1)) == 0) {
+                tile = base;
+                idx = base_idx + FACES_NORMALS[i][0] +
+                      FACES_NORMALS[i][1] * N + FACES_NORMALS[i][2] * N * N;
+            } else {
+                tile = select_get_tile(&ctx, p, &idx);
+            }
+            bit = 1ULL << (idx % 64);
+            if (tile->selected[idx / 64] & bit)
+                continue; // Already done.
+            if (!(tile->occupied[idx / 64] & bit))
+                continue; // No voxel here.
+            a = cond(user, volume, pos, p, &ctx.accessor);
+            if (!a) continue;
+            select_set(tile, idx, a);
+            // Reuse the front of the queue before growing it.
+            if (nb >= size && head >= size / 2) {
+                memmove(queue, queue + head, (nb - head) * sizeof(*queue));
+                nb -= head;
+                head = 0;
+            }
+            if (nb >= size) {
+                size *= 2;
+                queue = realloc(queue, size * sizeof(*queue));
             }
+            memcpy(queue[nb++], p, sizeof(p));
         }
     }
+    free(queue);
+
+    HASH_ITER(hh, ctx.tiles, tile, tmp) {
+        HASH_DEL(ctx.tiles, tile);
+        for (i = 0; i < N * N * N / 64; i++) {
+            if (tile->selected[i]) break;
+        }
+        if (i < N * N * N / 64)
+            select_commit(tile, selection, &selection_accessor);
+        free(tile->alpha);
+        free(tile);
+    }
     return 0;
 }
 
+bool volume_raycast(const volume_t *volume, const float origin[3],
+                    const float dir[3], int pos[3], int normal[3])
+{
+    int i, axis = -1, bbox[2][3], step[3], tile_pos[3], tile[3];
+    float t0 = 0, t1 = FLT_MAX, a, b, t_max[3], t_delta[3], p;
+    uint8_t value[4];
+    bool uniform = false, visible = false;
+    volume_accessor_t accessor;
+
+    if (!volume_get_bbox(volume, bbox, false)) return false;
+
+    // Clip the ray to the volume bounding box.
+    for (i = 0; i < 3; i++) {
+        if (dir[i] == 0) {
+            if (origin[i] < bbox[0][i] || origin[i] >= bbox[1][i])
+                return false;
+            continue;
+        }
+        a = (bbox[0][i] - origin[i]) / dir[i];
+        b = (bbox[1][i] - origin[i]) / dir[i];
+        if (a > b) SWAP(a, b);
+        if (a > t0) {
+            t0 = a;
+            axis = i;
+        }
+        t1 = min(t1, b);
+    }
+    if (t0 > t1) return false;
+
+    for (i = 0; i < 3; i++) {
+        p = origin[i] + dir[i] * t0;
+        pos[i] = floor(p);
+        // Make sure we start inside the box, despite the rounding errors.
+        if (i == axis || pos[i] < bbox[0][i] || pos[i] >= bbox[1][i])
+            pos[i] = clamp(pos[i], bbox[0][i], bbox[1][i] - 1);
+        step[i] = dir[i] > 0 ? 1 : -1;
+        t_delta[i] = dir[i] ? fabs(1 / dir[i]) : FLT_MAX;
+        t_max[i] = dir[i] ? (pos[i] + (dir[i] > 0) - origin[i]) / dir[i]
+                          : FLT_MAX;
+        tile_pos[i] = INT_MIN;
+    }
+    // If the ray starts inside the box, we use the main axis of the ray for
+    // the normal.
+    if (axis == -1) {
+        axis = fabs(dir[0]) > fabs(dir[1]) ? 0 : 1;
+        if (fabs(dir[2]) > fabs(dir[axis])) axis = 2;
+    }
+
+    accessor = volume_get_accessor(volume);
+    while (true) {
+        for (i = 0; i < 3; i++) tile[i] = pos[i] & ~(TILE_SIZE - 1);
+        if (memcmp(tile, tile_pos, sizeof(tile)) != 0) {
+            memcpy(tile_pos, tile, sizeof(tile_pos));
+            uniform = volume_is_tile_uniform(volume, &accessor, tile, value);
+        }
+        visible = uniform ? value[3] >= 127 :
+                  volume_get_alpha_at(volume, &accessor, pos) >= 127;
+        if (visible) break;
+
+        // Step to the next voxel.
+        axis = t_max[0] < t_max[1] ? 0 : 1;
+        if (t_max[2] < t_max[axis]) axis = 2;
+        if (t_max[axis] > t1) return false;
+        pos[axis] += step[axis];
+        t_max[axis] += t_delta[axis];
+    }
+
+    for (i = 0; i < 3; i++) normal[i] = 0;
+    normal[axis] = -step[axis];
+    return true;
+}
+
+typedef struct {
+    int     aabb[2][3];     // The extruded box.
+    int     sec_aabb[2][3]; // The cross-section box.
+    const uint8_t (*section)[4];
+} extrude_ctx_t;
+
+// Called in parallel for each tile of the extruded box.
+static bool extrude_tile(void *user, const int pos[3], uint8_t (*voxels)[4])
+{
+    const extrude_ctx_t *ctx = user;
+    int x, y, z, i, j, p[3], s[3], sec_size[3];
+    bool changed = false;
+
+    for (j = 0; j < 3; j++)
+        sec_size[j] = ctx->sec_aabb[1][j] - ctx->sec_aabb[0][j];
+    for (i = 0, z = 0; z < N; z++)
+    for (y = 0; y < N; y++)
+    for (x = 0; x < N; x++, i++) {
+        p[0] = pos[0] + x;
+        p[1] = pos[1] + y;
+        p[2] = pos[2] + z;
+        if (    p[0] < ctx->aabb[0][0] || p[0] >= ctx->aabb[1][0] ||
+                p[1] < ctx->aabb[0][1] || p[1] >= ctx->aabb[1][1] ||
+                p[2] < ctx->aabb[0][2] || p[2] >= ctx->aabb[1][2]) {
+            memset(voxels[i], 0, 4);
+            continue;
+        }
+        // Project into the cross-section.
+        for (j = 0; j < 3; j++)
+            s[j] = (sec_size[j] == 1) ? 0 : p[j] - ctx->sec_aabb[0][j];
+        memcpy(voxels[i], ctx->section[s[0] + s[1] * sec_size[0] +
+                                       s[2] * sec_size[0] * sec_size[1]], 4);
+        changed = changed || voxels[i][3];
+    }
+    return changed;
+}
 
-// XXX: need to redo this function from scratch.  Even the API is a bit
-// stupid.
 void volume_extrude(volume_t *volume,
                   const float plane[4][4],
                   const float box[4][4])
 {
-    float proj[4][4];
-    float n[3], pos[3], p[3];
-    volume_iterator_t iter;
-    int vpos[3];
-    uint8_t value[4];
+    extrude_ctx_t ctx;
+    volume_t *out;
+    uint8_t (*section)[4];
+    int i, nb = 0, p[3], sec_size[3], (*tiles)[3];
+
+    // The voxels whose corner is inside the box.
+    for (i = 0; i < 3; i++) {
+        ctx.aabb[0][i] = ceil(box[3][i] - box[i][i]);
+        ctx.aabb[1][i] = ceil(box[3][i] + box[i][i]);
+        if (ctx.aabb[0][i] >= ctx.aabb[1][i]) {
+            volume_clear(volume);
+            return;
+        }
+    }
+
+    // Build the cross-section by flattening the axes along the plane
+    // normal to the plane position.
+    memcpy(ctx.sec_aabb, ctx.aabb, sizeof(ctx.aabb));
+    for (i = 0; i < 3; i++) {
+        if (fabs(plane[2][i]) <= 0.1) continue;
+        ctx.sec_aabb[0][i] = floor(plane[3][i]);
+        ctx.sec_aabb[1][i] = ctx.sec_aabb[0][i] + 1;
+    }
+    for (i = 0; i < 3; i++)
+        sec_size[i] = ctx.sec_aabb[1][i] - ctx.sec_aabb[0][i];
+    section = malloc(sec_size[0] * sec_size[1] * sec_size[2] * 4);
+    volume_get_span(volume, ctx.sec_aabb, (uint8_t*)section, NULL);
+    ctx.section = (void*)section;
+
+    // Stamp it along the normal, tile by tile.
+    tiles = malloc(((ctx.aabb[1][0] - ctx.aabb[0][0]) / N + 2) *
+                   ((ctx.aabb[1][1] - ctx.aabb[0][1]) / N + 2) *
+                   ((ctx.aabb[1][2] - ctx.aabb[0][2]) / N + 2) *
+                   sizeof(*tiles));
+    for (p[2] = ctx.aabb[0][2] & ~(N - 1); p[2] < ctx.aabb[1][2]; p[2] += N)
+    for (p[1] = ctx.aabb[0][1] & ~(N - 1); p[1] < ctx.aabb[1][1]; p[1] += N)
+    for (p[0] = ctx.aabb[0][0] & ~(N - 1); p[0] < ctx.aabb[1][0]; p[0] += N)
+        memcpy(tiles[nb++], p, sizeof(p));
+    out = volume_new();
+    volume_apply_tiles(out, nb, (const int (*)[3])tiles, extrude_tile, &ctx);
+    volume_set(volume, out);
 
-    vec3_normalize(plane[2], n);
-    vec3_copy(plane[3], pos);
+    volume_delete(out);
+    free(tiles);
+    free(section);
+}
+
+typedef struct {
+    const volume_t *src;
+    float   imat[4][4];     // Inverse of the move matrix.
+    int     rot[3][3];      // Integer version of imat, for the fast path.
+    int     ofs[3];
+} move_ctx_t;
 
-    // Generate the projection into the plane.
-    // XXX: *very* ugly code, fix this!
-    mat4_set_identity(proj);
+/*
+ * Test if the inverse of a move matrix only swaps and flips the axes, with
+ * an integer translation, so that we can move the voxels without any
+ * resampling.  Translations at exactly half a voxel are excluded, since
+ * the rounding would depend on the sign of the position.
+ */
+static bool move_get_int_transform(move_ctx_t *ctx)
+{
+    int i, j;
+    const float (*m)[4] = ctx->imat;
+    const float eps = 1e-5;
 
-    if (fabs(plane[2][0]) > 0.1) {
-        proj[0][0] = 0;
-        proj[3][0] = pos[0];
+    for (i = 0; i < 3; i++) {
+        if (fabs(m[i][3]) > eps) return false;
+        for (j = 0; j < 3; j++) {
+            ctx->rot[i][j] = round(m[j][i]);
+            if (fabs(m[j][i] - ctx->rot[i][j]) > eps) return false;
+            if (abs(ctx->rot[i][j]) > 1) return false;
+        }
+        if (fabs(fabs(m[3][i] - floor(m[3][i])) - 0.5) < eps) return false;
+        ctx->ofs[i] = round(m[3][i]);
     }
-    if (fabs(plane[2][1]) > 0.1) {
-        proj[1][1] = 0;
-        proj[3][1] = pos[1];
+    if (fabs(m[3][3] - 1) > eps) return false;
+    // Each row and column should have a single non zero value.
+    for (i = 0; i < 3; i++) {
+        if (    abs(ctx->rot[i][0]) + abs(ctx->rot[i][1]) +
+                abs(ctx->rot[i][2]) != 1) return false;
+        if (    abs(ctx->rot[0][i]) + abs(ctx->rot[1][i]) +
+                abs(ctx->rot[2][i]) != 1) return false;
     }
-    if (fabs(plane[2][2]) > 0.1) {
-        proj[2][2] = 0;
-        proj[3][2] = pos[2];
+    return true;
+}
+
+// Source position of a voxel with an integer transform.
+static void move_src_pos(const move_ctx_t *ctx, const int p[3], int out[3])
+{
+    int i;
+    for (i = 0; i < 3; i++) {
+        out[i] = ctx->rot[i][0] * p[0] + ctx->rot[i][1] * p[1] +
+                 ctx->rot[i][2] * p[2] + ctx->ofs[i];
     }
+}
 
-    // XXX: use an accessor to speed up access.
-    iter = volume_get_box_iterator(volume, box, 0);
-    while (volume_iter(&iter, vpos)) {
-        vec3_set(p, vpos[0], vpos[1], vpos[2]);
-        if (!bbox_contains_vec(box, p)) {
-            memset(value, 0, 4);
-        } else {
-            mat4_mul_vec3(proj, p, p);
-            int pi[3] = {floor(p[0]), floor(p[1]), floor(p[2])};
-            volume_get_at(volume, NULL, pi, value);
-        }
-        volume_set_at(volume, NULL, vpos, value);
+// Min corner of the source of a tile with an integer transform.
+static void move_src_tile_pos(const move_ctx_t *ctx, const int pos[3],
+                              int out[3])
+{
+    int i;
+    move_src_pos(ctx, pos, out);
+    for (i = 0; i < 3; i++) {
+        out[i] += min(0, ctx->rot[i][0] + ctx->rot[i][1] + ctx->rot[i][2]) *
+                  (N - 1);
+    }
+}
+
+// Called in parallel for each tile with an integer transform.
+static bool move_tile_int(void *user, const int pos[3], uint8_t (*voxels)[4])
+{
+    const move_ctx_t *ctx = user;
+    uint8_t (*src)[4];
+    int x, y, z, i, p[3], s[3], src_pos[3];
+
+    // Too big for the workers stack, and the jobs scratch buffer already
+    // holds the voxels.
+    src = malloc(N * N * N * 4);
+    move_src_tile_pos(ctx, pos, src_pos);
+    volume_read(ctx->src, src_pos, (int[]){N, N, N}, (uint8_t*)src);
+    for (i = 0, z = 0; z < N; z++)
+    for (y = 0; y < N; y++)
+    for (x = 0; x < N; x++, i++) {
+        p[0] = pos[0] + x;
+        p[1] = pos[1] + y;
+        p[2] = pos[2] + z;
+        move_src_pos(ctx, p, s);
+        memcpy(voxels[i], src[(s[0] - src_pos[0]) +
+                              (s[1] - src_pos[1]) * N +
+                              (s[2] - src_pos[2]) * N * N], 4);
     }
+    free(src);
+    return true;
+}
+
+// Called in parallel for each tile with a generic transform.
+static bool move_tile_resample(void *user, const int pos[3],
+                               uint8_t (*voxels)[4])
+{
+    const move_ctx_t *ctx = user;
+    volume_accessor_t acc = volume_get_neighbors_accessor(ctx->src);
+    int x, y, z, i, pi[3];
+    float p[3];
+    bool changed = false;
 
+    for (i = 0, z = 0; z < N; z++)
+    for (y = 0; y < N; y++)
+    for (x = 0; x < N; x++, i++) {
+        vec3_set(p, pos[0] + x, pos[1] + y, pos[2] + z);
+        mat4_mul_vec3(ctx->imat, p, p);
+        pi[0] = round(p[0]);
+        pi[1] = round(p[1]);
+        pi[2] = round(p[2]);
+        volume_get_at(ctx->src, &acc, pi, voxels[i]);
+        changed = changed || voxels[i][3];
+    }
+    return changed;
 }
 
-static void volume_fill(
-        volume_t *volume,
-        const float box[4][4],
-        void (*get_color)(const int pos[3], uint8_t out[4], void *user_data),
-        void *user_data)
+static int tile_pos_cmp(const void *a_, const void *b_)
+{
+    const int *a = a_, *b = b_;
+    if (a[2] != b[2]) return a[2] < b[2] ? -1 : 1;
+    if (a[1] != b[1]) return a[1] < b[1] ? -1 : 1;
+    if (a[0] != b[0]) return a[0] < b[0] ? -1 : 1;
+    return 0;
+}
+
+// Add the destination tiles covered by a source tile to a list.
+static void move_add_tiles(const move_ctx_t *ctx, const int src_pos[3],
+                           int (**tiles)[3], int *nb, int *size)
+{
+    int i, j, corner[3], p[3], box[2][3] = {{INT_MAX, INT_MAX, INT_MAX},
+                                            {INT_MIN, INT_MIN, INT_MIN}};
+    // Forward transform of the source tile corners, using the transposed
+    // rotation.
+    for (i = 0; i < 8; i++) {
+        for (j = 0; j < 3; j++)
+            corner[j] = src_pos[j] + ((i >> j) & 1) * (N - 1) - ctx->ofs[j];
+        for (j = 0; j < 3; j++) {
+            p[j] = ctx->rot[0][j] * corner[0] + ctx->rot[1][j] * corner[1] +
+                   ctx->rot[2][j] * corner[2];
+            box[0][j] = min(box[0][j], p[j] & ~(N - 1));
+            box[1][j] = max(box[1][j], p[j] & ~(N - 1));
+        }
+    }
+    for (p[2] = box[0][2]; p[2] <= box[1][2]; p[2] += N)
+    for (p[1] = box[0][1]; p[1] <= box[1][1]; p[1] += N)
+    for (p[0] = box[0][0]; p[0] <= box[1][0]; p[0] += N) {
+        if (*nb >= *size) {
+            *size = max(64, *size * 2);
+            *tiles = realloc(*tiles, *size * sizeof(**tiles));
+        }
+        memcpy((*tiles)[(*nb)++], p, sizeof(p));
+    }
+}
+
+/*
+ * Move with an integer transform.  Translations by a multiple of the tile
+ * size just move the tiles, otherwise each tile gets its voxels from a
+ * single box of the source.
+ */
+static void volume_move_int(volume_t *volume, move_ctx_t *ctx)
 {
-    int pos[3];
-    uint8_t color[4];
     volume_iterator_t iter;
-    volume_accessor_t accessor;
+    int i, n, pos[3], src_pos[3], nb = 0, size = 0;
+    int (*tiles)[3] = NULL;
+    uint8_t v[4];
+    bool identity = true;
+
+    for (i = 0; i < 9; i++)
+        identity = identity && ctx->rot[i / 3][i % 3] == (i % 4 == 0);
 
     volume_clear(volume);
-    accessor = volume_get_accessor(volume);
-    iter = volume_get_box_iterator(volume, box, 0);
+    iter = volume_get_iterator(ctx->src,
+            VOLUME_ITER_TILES | VOLUME_ITER_SKIP_EMPTY);
     while (volume_iter(&iter, pos)) {
-        get_color(pos, color, user_data);
-        volume_set_at(volume, &accessor, pos, color);
+        if (    identity && !(ctx->ofs[0] % N) && !(ctx->ofs[1] % N) &&
+                !(ctx->ofs[2] % N)) {
+            vec3_set(src_pos, pos[0] - ctx->ofs[0], pos[1] - ctx->ofs[1],
+                     pos[2] - ctx->ofs[2]);
+            volume_copy_tile(ctx->src, pos, volume, src_pos);
+            continue;
+        }
+        move_add_tiles(ctx, pos, &tiles, &nb, &size);
     }
-}
+    if (!nb) return;
 
-static void volume_move_get_color(const int pos[3], uint8_t c[4], void *user)
-{
-    float p[3] = {pos[0], pos[1], pos[2]};
-    volume_t *volume = USER_GET(user, 0);
-    float (*mat)[4][4] = USER_GET(user, 1);
-    mat4_mul_vec3(*mat, p, p);
-    int pi[3] = {round(p[0]), round(p[1]), round(p[2])};
-    volume_get_at(volume, NULL, pi, c);
+    // Remove the duplicated tiles, and directly set the ones that only
+    // come from a single uniform source tile.
+    qsort(tiles, nb, sizeof(*tiles), tile_pos_cmp);
+    for (i = 0, n = 0; i < nb; i++) {
+        if (i && tile_pos_cmp(tiles[i], tiles[i - 1]) == 0) continue;
+        move_src_tile_pos(ctx, tiles[i], src_pos);
+        if (    !(src_pos[0] % N) && !(src_pos[1] % N) && !(src_pos[2] % N) &&
+                volume_is_tile_uniform(ctx->src, NULL, src_pos, v)) {
+            if (v[3]) volume_fill_tile(volume, NULL, tiles[i], v);
+            continue;
+        }
+        memcpy(tiles[n++], tiles[i], sizeof(tiles[i]));
+    }
+    volume_apply_tiles(volume, n, (const int (*)[3])tiles, move_tile_int,
+                       ctx);
+    free(tiles);
 }
 
 void volume_move(volume_t *volume, const float mat[4][4])
 {
     float box[4][4];
-    volume_t *src_volume = volume_copy(volume);
-    float imat[4][4];
+    int bbox[2][3], pos[3], nb = 0, size = 0;
+    int (*tiles)[3] = NULL;
+    move_ctx_t ctx = {};
 
-    mat4_invert(mat, imat);
     volume_get_box(volume, true, box);
     if (box_is_null(box)) return;
-    mat4_mul(mat, box, box);
-    volume_fill(volume, box, volume_move_get_color,
-                USER_PASS(src_volume, &imat));
-    volume_delete(src_volume);
+    ctx.src = volume_copy(volume);
+    mat4_invert(mat, ctx.imat);
+
+    if (move_get_int_transform(&ctx)) {
+        volume_move_int(volume, &ctx);
+    } else {
+        // Generic transform: resample all the voxels of the tiles covered
+        // by the moved box.
+        mat4_mul(mat, box, box);
+        box_get_aabb(box, bbox);
+        volume_clear(volume);
+        for (pos[2] = bbox[0][2] & ~(N - 1); pos[2] <= bbox[1][2]; pos[2] += N)
+        for (pos[1] = bbox[0][1] & ~(N - 1); pos[1] <= bbox[1][1]; pos[1] += N)
+        for (pos[0] = bbox[0][0] & ~(N - 1); pos[0] <= bbox[1][0]; pos[0] += N)
+        {
+            if (nb >= size) {
+                size = max(64, size * 2);
+                tiles = realloc(tiles, size * sizeof(*tiles));
+            }
+            memcpy(tiles[nb++], pos, sizeof(pos));
+        }
+        volume_apply_tiles(volume, nb, (const int (*)[3])tiles,
+                           move_tile_resample, &ctx);
+        free(tiles);
+    }
+    volume_delete((volume_t*)ctx.src);
     volume_remove_empty_tiles(volume, false);
 }
 
@@ -184,16 +601,10 @@ void volume_blit(volume_t *volume, const uint8_t *data,
                int x, int y, int z, int w, int h, int d,
                volume_iterator_t *iter)
 {
-    volume_iterator_t default_iter = {0};
-    int pos[3];
-    if (!iter) iter = &default_iter;
-    for (pos[2] = z; pos[2] < z + d; pos[2]++)
-    for (pos[1] = y; pos[1] < y + h; pos[1]++)
-    for (pos[0] = x; pos[0] < x + w; pos[0]++) {
-        volume_set_at(volume, iter, pos, data);
-        data += 4;
-    }
-    volume_remove_empty_tiles(volume, false);
+    const int aabb[2][3] = {{x, y, z}, {x + w, y + h, z + d}};
+    volume_set_span(volume, aabb, data, NULL);
+    // Full tiles already got compacted by volume_set_span.
+    volume_remove_empty_tiles(volume, true);
 }
 
 void volume_shift_alpha(volume_t *volume, int v)
@@ -274,214 +685,1699 @@ static void combine(const uint8_t a[4], const uint8_t b[4], int mode,
     memcpy(out, ret, 4);
 }
 
+/*
+ * Whole tile versions of color_mul and combine.
+ *
+ * The simple modes only need byte min/max/saturated operations, and the
+ * division by 255 of a product of two bytes can be computed exactly as
+ * (x + 1 + (x >> 8)) >> 8, so all those kernels give the exact same results
+ * as the scalar functions.  MODE_OVER and MODE_PAINT are left to the scalar
+ * code.
+ *
+ * Each SIMD function returns the number of voxels it processed, the
+ * remaining ones are done with the scalar code.  The function for the
+ * current CPU is picked the first time we use it.
+ */
+
+typedef int (*color_mul_tile_func_t)(int n, const uint8_t (*a)[4],
+                                     const uint8_t color[4],
+                                     uint8_t (*out)[4]);
+typedef int (*combine_tile_func_t)(int mode, int n, const uint8_t (*a)[4],
+                                   const uint8_t (*b)[4], uint8_t (*out)[4]);
 
-void volume_op(volume_t *volume, const painter_t *painter, const float box[4][4])
+static int color_mul_tile_none(int n, const uint8_t (*a)[4],
+                               const uint8_t color[4], uint8_t (*out)[4])
 {
-    int i, vp[3];
-    uint8_t value[4], new_value[4], c[4];
-    volume_iterator_t iter;
-    volume_accessor_t accessor;
-    float size[3], p[3];
-    float mat[4][4];
-    float (*shape_func)(const float[3], const float[3], float smoothness);
-    float k, v;
-    int mode = painter->mode;
-    bool use_box, skip_src_empty, skip_dst_empty;
-    painter_t painter2;
-    float box2[4][4];
-    int aabb[2][3];
-    volume_t *cached;
-    static cache_t *cache = NULL;
-    const float *sym_o = painter->symmetry_origin;
+    return 0;
+}
 
-    // Check if the operation has been cached.
-    if (!cache) cache = cache_create("volume_op", 32);
-    struct {
-        uint64_t  id;
-        float     box[4][4];
-        painter_t painter;
-    } key;
-    memset(&key, 0, sizeof(key));
-    key.id = volume_get_key(volume);
-    mat4_copy(box, key.box);
-    key.painter = *painter;
-    cached = cache_get(cache, &key, sizeof(key));
-    if (cached) {
-        volume_set(volume, cached);
-        return;
+static int combine_tile_none(int mode, int n, const uint8_t (*a)[4],
+                             const uint8_t (*b)[4], uint8_t (*out)[4])
+{
+    return 0;
+}
+
+// The modes supported by the SIMD combine functions.
+static bool combine_tile_simd_supports(int mode)
+{
+    switch (mode) {
+    case MODE_MAX:
+    case MODE_SUB:
+    case MODE_SUB_CLAMP:
+    case MODE_MULT_ALPHA:
+    case MODE_INTERSECT:
+    case MODE_INTERSECT_FILL:
+        return true;
+    default:
+        return false;
     }
+}
 
-    if (painter->symmetry) {
-        painter2 = *painter;
-        for (i = 0; i < 3; i++) {
-            if (!(painter->symmetry & (1 << i))) continue;
-            painter2.symmetry &= ~(1 << i);
-            mat4_set_identity(box2);
-            mat4_itranslate(box2, +sym_o[0], +sym_o[1], +sym_o[2]);
-            if (i == 0) mat4_iscale(box2, -1,  1,  1);
-            if (i == 1) mat4_iscale(box2,  1, -1,  1);
-            if (i == 2) mat4_iscale(box2,  1,  1, -1);
-            mat4_itranslate(box2, -sym_o[0], -sym_o[1], -sym_o[2]);
-            mat4_imul(box2, box);
-            volume_op(volume, &painter2, box2);
-        }
+#if defined(__SSE2__)
+
+#include <emmintrin.h>
+
+// a * b / 255 for all the bytes.
+static inline __m128i mul_u8(__m128i a, __m128i b)
+{
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i one = _mm_set1_epi16(1);
+    __m128i lo, hi;
+    lo = _mm_mullo_epi16(_mm_unpacklo_epi8(a, zero),
+                         _mm_unpacklo_epi8(b, zero));
+    hi = _mm_mullo_epi16(_mm_unpackhi_epi8(a, zero),
+                         _mm_unpackhi_epi8(b, zero));
+    lo = _mm_srli_epi16(_mm_add_epi16(_mm_add_epi16(lo, one),
+                                      _mm_srli_epi16(lo, 8)), 8);
+    hi = _mm_srli_epi16(_mm_add_epi16(_mm_add_epi16(hi, one),
+                                      _mm_srli_epi16(hi, 8)), 8);
+    return _mm_packus_epi16(lo, hi);
+}
+
+static int color_mul_tile_sse2(int n, const uint8_t (*a)[4],
+                               const uint8_t color[4], uint8_t (*out)[4])
+{
+    int i;
+    uint32_t c;
+    __m128i vc;
+    memcpy(&c, color, 4);
+    vc = _mm_set1_epi32(c);
+    for (i = 0; i + 4 <= n; i += 4) {
+        _mm_storeu_si128((__m128i*)out[i],
+                mul_u8(_mm_loadu_si128((const __m128i*)a[i]), vc));
     }
+    return i;
+}
 
-    shape_func = painter->shape->func;
-    box_get_size(box, size);
-    mat4_copy(box, mat);
-    mat4_iscale(mat, 1 / size[0], 1 / size[1], 1 / size[2]);
-    mat4_invert(mat, mat);
-    use_box = painter->box && !box_is_null(*painter->box);
-    skip_src_empty = mode == MODE_SUB ||
-                     mode == MODE_SUB_CLAMP ||
-                     mode == MODE_MULT_ALPHA;
-    skip_dst_empty = mode == MODE_SUB ||
-                     mode == MODE_SUB_CLAMP ||
-                     mode == MODE_MULT_ALPHA ||
-                     mode == MODE_INTERSECT ||
-                     mode == MODE_INTERSECT_FILL;
+static int combine_tile_sse2(int mode, int n, const uint8_t (*a)[4],
+                             const uint8_t (*b)[4], uint8_t (*out)[4])
+{
+    const __m128i amask = _mm_set1_epi32(0xff000000);
+    const __m128i rgbmask = _mm_set1_epi32(0x00ffffff);
+    const __m128i zero = _mm_setzero_si128();
+    __m128i va, vb, r, t;
+    int i;
 
-    // for intersection start by deleting all the tiles that are not in
-    // the box and then iter all the rest.
-    if (mode == MODE_INTERSECT || mode == MODE_INTERSECT_FILL) {
-        iter = volume_get_iterator(volume, VOLUME_ITER_TILES);
-        while (volume_iter(&iter, vp)) {
-            volume_get_tile_aabb(vp, aabb);
-            if (box_intersect_aabb(box, aabb)) continue;
-            volume_clear_tile(volume, &iter, vp);
+    if (!combine_tile_simd_supports(mode)) return 0;
+
+    for (i = 0; i + 4 <= n; i += 4) {
+        va = _mm_loadu_si128((const __m128i*)a[i]);
+        vb = _mm_loadu_si128((const __m128i*)b[i]);
+        switch (mode) {
+        case MODE_MAX:
+            r = _mm_or_si128(_mm_and_si128(vb, rgbmask),
+                             _mm_and_si128(_mm_max_epu8(va, vb), amask));
+            break;
+        case MODE_SUB:
+            r = _mm_subs_epu8(va, _mm_and_si128(vb, amask));
+            break;
+        case MODE_SUB_CLAMP:
+            r = _mm_min_epu8(va, _mm_or_si128(_mm_andnot_si128(vb, amask),
+                                              rgbmask));
+            break;
+        case MODE_MULT_ALPHA:
+            t = _mm_srli_epi32(vb, 24);
+            t = _mm_or_si128(t, _mm_slli_epi32(t, 8));
+            t = _mm_or_si128(t, _mm_slli_epi32(t, 16));
+            r = mul_u8(va, t);
+            break;
+        case MODE_INTERSECT:
+            r = _mm_min_epu8(va, _mm_or_si128(vb, rgbmask));
+            break;
+        case MODE_INTERSECT_FILL:
+            r = _mm_min_epu8(va, _mm_or_si128(vb, rgbmask));
+            // Lanes where the resulting alpha is zero keep the 'a' color.
+            t = _mm_cmpeq_epi32(_mm_and_si128(r, amask), zero);
+            r = _mm_or_si128(_mm_and_si128(t, r), _mm_andnot_si128(t,
+                    _mm_or_si128(_mm_and_si128(vb, rgbmask),
+                                 _mm_and_si128(r, amask))));
+            break;
+        default: // Unreachable, checked by combine_tile_simd_supports.
+            r = va;
+            break;
         }
-        iter = volume_get_iterator(
-                volume, skip_dst_empty ? VOLUME_ITER_SKIP_EMPTY : 0);
-    } else {
-        iter = volume_get_box_iterator(
-                volume, box, skip_dst_empty ? VOLUME_ITER_SKIP_EMPTY : 0);
+        _mm_storeu_si128((__m128i*)out[i], r);
     }
+    return i;
+}
 
-    // XXX: for the moment we cannot use the same accessor for both
-    // setting and getting!  Need to fix that!!
-    accessor = volume_get_accessor(volume);
-    while (volume_iter(&iter, vp)) {
-        vec3_set(p, vp[0] + 0.5, vp[1] + 0.5, vp[2] + 0.5);
-        if (use_box && !bbox_contains_vec(*painter->box, p)) continue;
-        mat4_mul_vec3(mat, p, p);
-        k = shape_func(p, size, painter->smoothness);
-        if (painter->smoothness) {
-            v = clamp(k / painter->smoothness, -1.0f, 1.0f) / 2.0f + 0.5f;
-        } else {
-            v = (k >= 0.f) ? 1.f : 0.f;
-        }
-        if (!v && skip_src_empty) continue;
-        memcpy(c, painter->color, 4);
-        c[3] *= v;
-        if (!c[3] && skip_src_empty) continue;
-        volume_get_at(volume, &accessor, vp, value);
-        if (!value[3] && skip_dst_empty) continue;
-        combine(value, c, mode, new_value);
-        if (!vec4_equal(value, new_value))
-            volume_set_at(volume, &accessor, vp, new_value);
-    }
+#elif defined(__ARM_NEON)
 
-    cache_add(cache, &key, sizeof(key), volume_copy(volume), 1, volume_del);
-}
+#include <arm_neon.h>
 
-// XXX: remove this function!
-void volume_get_box(const volume_t *volume, bool exact, float box[4][4])
+// a * b / 255 for all the bytes.
+static inline uint8x16_t mul_u8(uint8x16_t a, uint8x16_t b)
 {
-    int bbox[2][3];
-    volume_get_bbox(volume, bbox, exact);
-    bbox_from_aabb(box, bbox);
+    const uint16x8_t one = vdupq_n_u16(1);
+    uint16x8_t lo, hi;
+    lo = vmull_u8(vget_low_u8(a), vget_low_u8(b));
+    hi = vmull_u8(vget_high_u8(a), vget_high_u8(b));
+    lo = vaddq_u16(vaddq_u16(lo, one), vshrq_n_u16(lo, 8));
+    hi = vaddq_u16(vaddq_u16(hi, one), vshrq_n_u16(hi, 8));
+    return vcombine_u8(vshrn_n_u16(lo, 8), vshrn_n_u16(hi, 8));
 }
 
-static void tile_merge(volume_t *volume, const volume_t *other, const int pos[3],
-                        int mode, const uint8_t color[4])
+static int color_mul_tile_neon(int n, const uint8_t (*a)[4],
+                               const uint8_t color[4], uint8_t (*out)[4])
 {
-    int p[3];
-    int x, y, z;
-    uint64_t id1, id2;
-    volume_t *tile;
-    uint8_t v1[4], v2[4];
-    static cache_t *cache = NULL;
-    volume_accessor_t a1, a2, a3;
+    int i;
+    uint32_t c;
+    uint8x16_t vc;
+    memcpy(&c, color, 4);
+    vc = vreinterpretq_u8_u32(vdupq_n_u32(c));
+    for (i = 0; i + 4 <= n; i += 4)
+        vst1q_u8(out[i], mul_u8(vld1q_u8(a[i]), vc));
+    return i;
+}
 
-    volume_get_tile_data(volume,  NULL, pos, &id1);
-    volume_get_tile_data(other, NULL, pos, &id2);
+static int combine_tile_neon(int mode, int n, const uint8_t (*a)[4],
+                             const uint8_t (*b)[4], uint8_t (*out)[4])
+{
+    const uint8_t amask_bytes[16] = {0, 0, 0, 255, 0, 0, 0, 255,
+                                     0, 0, 0, 255, 0, 0, 0, 255};
+    const uint8x16_t amask = vld1q_u8(amask_bytes);
+    const uint8x16_t rgbmask = vmvnq_u8(amask);
+    uint8x16_t va, vb, r, t;
+    uint32x4_t z;
+    int i;
 
-    // XXX: cleanup this code!
+    if (!combine_tile_simd_supports(mode)) return 0;
 
-    if (    (mode == MODE_OVER ||
-             mode == MODE_MAX ||
-             mode == MODE_SUB ||
-             mode == MODE_SUB_CLAMP) && id2 == 0)
-    {
-        return;
+    for (i = 0; i + 4 <= n; i += 4) {
+        va = vld1q_u8(a[i]);
+        vb = vld1q_u8(b[i]);
+        switch (mode) {
+        case MODE_MAX:
+            r = vbslq_u8(amask, vmaxq_u8(va, vb), vb);
+            break;
+        case MODE_SUB:
+            r = vqsubq_u8(va, vandq_u8(vb, amask));
+            break;
+        case MODE_SUB_CLAMP:
+            r = vminq_u8(va, vorrq_u8(vmvnq_u8(vb), rgbmask));
+            break;
+        case MODE_MULT_ALPHA:
+            t = vreinterpretq_u8_u32(vmulq_n_u32(
+                    vshrq_n_u32(vreinterpretq_u32_u8(vb), 24), 0x01010101));
+            r = mul_u8(va, t);
+            break;
+        case MODE_INTERSECT:
+            r = vminq_u8(va, vorrq_u8(vb, rgbmask));
+            break;
+        case MODE_INTERSECT_FILL:
+            r = vminq_u8(va, vorrq_u8(vb, rgbmask));
+            // Lanes where the resulting alpha is zero keep the 'a' color.
+            z = vceqq_u32(vreinterpretq_u32_u8(vandq_u8(r, amask)),
+                          vdupq_n_u32(0));
+            r = vbslq_u8(vreinterpretq_u8_u32(z), r,
+                         vbslq_u8(amask, r, vb));
+            break;
+        default: // Unreachable, checked by combine_tile_simd_supports.
+            r = va;
+            break;
+        }
+        vst1q_u8(out[i], r);
     }
+    return i;
+}
 
-    if ((mode == MODE_OVER || mode == MODE_MAX) && id1 == 0 && !color) {
-        volume_copy_tile(other, pos, volume, pos);
-        return;
-    }
+#elif defined(__wasm_simd128__)
 
-    if ((mode == MODE_MULT_ALPHA) && id1 == 0) return;
-    if ((mode == MODE_MULT_ALPHA) && id2 == 0) {
-        // XXX: could just delete the tile.
-    }
+#include <wasm_simd128.h>
 
-    // Check if the merge op has been cached.
-    if (!cache) cache = cache_create("tile_merge", 2048);
-    struct {
-        uint64_t id1;
-        uint64_t id2;
-        int      mode;
-        uint8_t  color[4];
-    } key = { id1, id2, mode };
-    if (color) memcpy(key.color, color, 4);
-    _Static_assert(sizeof(key) == 24, "");
-    tile = cache_get(cache, &key, sizeof(key));
-    if (tile) goto end;
+// a * b / 255 for all the bytes.
+static inline v128_t mul_u8(v128_t a, v128_t b)
+{
+    const v128_t one = wasm_i16x8_splat(1);
+    v128_t lo, hi;
+    lo = wasm_u16x8_extmul_low_u8x16(a, b);
+    hi = wasm_u16x8_extmul_high_u8x16(a, b);
+    lo = wasm_u16x8_shr(wasm_i16x8_add(wasm_i16x8_add(lo, one),
+                                       wasm_u16x8_shr(lo, 8)), 8);
+    hi = wasm_u16x8_shr(wasm_i16x8_add(wasm_i16x8_add(hi, one),
+                                       wasm_u16x8_shr(hi, 8)), 8);
+    return wasm_u8x16_narrow_i16x8(lo, hi);
+}
+
+static int color_mul_tile_wasm(int n, const uint8_t (*a)[4],
+                               const uint8_t color[4], uint8_t (*out)[4])
+{
+    int i;
+    uint32_t c;
+    v128_t vc;
+    memcpy(&c, color, 4);
+    vc = wasm_i32x4_splat(c);
+    for (i = 0; i + 4 <= n; i += 4)
+        wasm_v128_store(out[i], mul_u8(wasm_v128_load(a[i]), vc));
+    return i;
+}
 
-    tile = volume_new();
-    a1 = volume_get_accessor(volume);
-    a2 = volume_get_accessor(other);
-    a3 = volume_get_accessor(tile);
+static int combine_tile_wasm(int mode, int n, const uint8_t (*a)[4],
+                             const uint8_t (*b)[4], uint8_t (*out)[4])
+{
+    const v128_t amask = wasm_i32x4_splat(0xff000000);
+    const v128_t rgbmask = wasm_i32x4_splat(0x00ffffff);
+    v128_t va, vb, r, t;
+    int i;
 
-    for (z = 0; z < N; z++)
-    for (y = 0; y < N; y++)
-    for (x = 0; x < N; x++) {
-        p[0] = pos[0] + x;
-        p[1] = pos[1] + y;
-        p[2] = pos[2] + z;
-        volume_get_at(volume, &a1, p, v1);
-        volume_get_at(other, &a2, p, v2);
-        if (color) color_mul(v2, color, v2);
-        combine(v1, v2, mode, v1);
-        volume_set_at(tile, &a3, (int[]){x, y, z}, v1);
+    if (!combine_tile_simd_supports(mode)) return 0;
+
+    for (i = 0; i + 4 <= n; i += 4) {
+        va = wasm_v128_load(a[i]);
+        vb = wasm_v128_load(b[i]);
+        switch (mode) {
+        case MODE_MAX:
+            r = wasm_v128_bitselect(wasm_u8x16_max(va, vb), vb, amask);
+            break;
+        case MODE_SUB:
+            r = wasm_u8x16_sub_sat(va, wasm_v128_and(vb, amask));
+            break;
+        case MODE_SUB_CLAMP:
+            r = wasm_u8x16_min(va, wasm_v128_or(wasm_v128_not(vb), rgbmask));
+            break;
+        case MODE_MULT_ALPHA:
+            t = wasm_i32x4_mul(wasm_u32x4_shr(vb, 24),
+                               wasm_i32x4_splat(0x01010101));
+            r = mul_u8(va, t);
+            break;
+        case MODE_INTERSECT:
+            r = wasm_u8x16_min(va, wasm_v128_or(vb, rgbmask));
+            break;
+        case MODE_INTERSECT_FILL:
+            r = wasm_u8x16_min(va, wasm_v128_or(vb, rgbmask));
+            // Lanes where the resulting alpha is zero keep the 'a' color.
+            t = wasm_i32x4_eq(wasm_v128_and(r, amask), wasm_i32x4_splat(0));
+            r = wasm_v128_bitselect(r, wasm_v128_bitselect(r, vb, amask), t);
+            break;
+        default: // Unreachable, checked by combine_tile_simd_supports.
+            r = va;
+            break;
+        }
+        wasm_v128_store(out[i], r);
     }
-    cache_add(cache, &key, sizeof(key), tile, 1, volume_del);
+    return i;
+}
 
-end:
-    volume_copy_tile(tile, (int[]){0, 0, 0}, volume, pos);
-    return;
+#endif
+
+#if SIMD_X86
+
+#include <immintrin.h>
+
+// Same as the SSE2 functions, with eight voxels at a time.
+
+SIMD_TARGET("avx2")
+static inline __m256i mul_u8_avx2(__m256i a, __m256i b)
+{
+    const __m256i zero = _mm256_setzero_si256();
+    const __m256i one = _mm256_set1_epi16(1);
+    __m256i lo, hi;
+    lo = _mm256_mullo_epi16(_mm256_unpacklo_epi8(a, zero),
+                            _mm256_unpacklo_epi8(b, zero));
+    hi = _mm256_mullo_epi16(_mm256_unpackhi_epi8(a, zero),
+                            _mm256_unpackhi_epi8(b, zero));
+    lo = _mm256_srli_epi16(_mm256_add_epi16(_mm256_add_epi16(lo, one),
+                                            _mm256_srli_epi16(lo, 8)), 8);
+    hi = _mm256_srli_epi16(_mm256_add_epi16(_mm256_add_epi16(hi, one),
+                                            _mm256_srli_epi16(hi, 8)), 8);
+    return _mm256_packus_epi16(lo, hi);
 }
 
-void volume_merge(volume_t *volume, const volume_t *other, int mode,
-                const uint8_t color[4])
+SIMD_TARGET("avx2")
+static int color_mul_tile_avx2(int n, const uint8_t (*a)[4],
+                               const uint8_t color[4], uint8_t (*out)[4])
 {
-    volume_t *cached;
-    assert(volume && other);
-    static cache_t *cache = NULL;
-    volume_iterator_t iter;
-    int bpos[3];
-    uint64_t id1, id2;
+    int i;
+    uint32_t c;
+    __m256i vc;
+    memcpy(&c, color, 4);
+    vc = _mm256_set1_epi32(c);
+    for (i = 0; i + 8 <= n; i += 8) {
+        _mm256_storeu_si256((__m256i*)out[i],
+                mul_u8_avx2(_mm256_loadu_si256((const __m256i*)a[i]), vc));
+    }
+    return i;
+}
 
-    // Simple case for replace.
-    if (mode == MODE_REPLACE) {
+SIMD_TARGET("avx2")
+static int combine_tile_avx2(int mode, int n, const uint8_t (*a)[4],
+                             const uint8_t (*b)[4], uint8_t (*out)[4])
+{
+    const __m256i amask = _mm256_set1_epi32(0xff000000);
+    const __m256i rgbmask = _mm256_set1_epi32(0x00ffffff);
+    const __m256i zero = _mm256_setzero_si256();
+    __m256i va, vb, r, t;
+    int i;
+
+    if (!combine_tile_simd_supports(mode)) return 0;
+
+    for (i = 0; i + 8 <= n; i += 8) {
+        va = _mm256_loadu_si256((const __m256i*)a[i]);
+        vb = _mm256_loadu_si256((const __m256i*)b[i]);
+        switch (mode) {
+        case MODE_MAX:
+            r = _mm256_or_si256(_mm256_and_si256(vb, rgbmask),
+                    _mm256_and_si256(_mm256_max_epu8(va, vb), amask));
+            break;
+        case MODE_SUB:
+            r = _mm256_subs_epu8(va, _mm256_and_si256(vb, amask));
+            break;
+        case MODE_SUB_CLAMP:
+            r = _mm256_min_epu8(va, _mm256_or_si256(
+                    _mm256_andnot_si256(vb, amask), rgbmask));
+            break;
+        case MODE_MULT_ALPHA:
+            t = _mm256_srli_epi32(vb, 24);
+            t = _mm256_or_si256(t, _mm256_slli_epi32(t, 8));
+            t = _mm256_or_si256(t, _mm256_slli_epi32(t, 16));
+            r = mul_u8_avx2(va, t);
+            break;
+        case MODE_INTERSECT:
+            r = _mm256_min_epu8(va, _mm256_or_si256(vb, rgbmask));
+            break;
+        case MODE_INTERSECT_FILL:
+            r = _mm256_min_epu8(va, _mm256_or_si256(vb, rgbmask));
+            // Lanes where the resulting alpha is zero keep the 'a' color.
+            t = _mm256_cmpeq_epi32(_mm256_and_si256(r, amask), zero);
+            r = _mm256_or_si256(_mm256_and_si256(t, r), _mm256_andnot_si256(t,
+                    _mm256_or_si256(_mm256_and_si256(vb, rgbmask),
+                                    _mm256_and_si256(r, amask))));
+            break;
+        default: // Unreachable, checked by combine_tile_simd_supports.
+            r = va;
+            break;
+        }
+        _mm256_storeu_si256((__m256i*)out[i], r);
+    }
+    return i;
+}
+
+#endif
+
+static color_mul_tile_func_t get_color_mul_tile_func(void)
+{
+#if SIMD_X86
+    if (simd_has(SIMD_AVX2)) return color_mul_tile_avx2;
+#endif
+#if defined(__SSE2__)
+    if (simd_has(SIMD_SSE2)) return color_mul_tile_sse2;
+#elif defined(__ARM_NEON)
+    if (simd_has(SIMD_NEON)) return color_mul_tile_neon;
+#elif defined(__wasm_simd128__)
+    if (simd_has(SIMD_WASM)) return color_mul_tile_wasm;
+#endif
+    return color_mul_tile_none;
+}
+
+static combine_tile_func_t get_combine_tile_func(void)
+{
+#if SIMD_X86
+    if (simd_has(SIMD_AVX2)) return combine_tile_avx2;
+#endif
+#if defined(__SSE2__)
+    if (simd_has(SIMD_SSE2)) return combine_tile_sse2;
+#elif defined(__ARM_NEON)
+    if (simd_has(SIMD_NEON)) return combine_tile_neon;
+#elif defined(__wasm_simd128__)
+    if (simd_has(SIMD_WASM)) return combine_tile_wasm;
+#endif
+    return combine_tile_none;
+}
+
+static int color_mul_tile_simd(int n, const uint8_t (*a)[4],
+                               const uint8_t color[4], uint8_t (*out)[4])
+{
+    static color_mul_tile_func_t g_func = NULL;
+    color_mul_tile_func_t func = __atomic_load_n(&g_func, __ATOMIC_RELAXED);
+    if (!func) {
+        func = get_color_mul_tile_func();
+        __atomic_store_n(&g_func, func, __ATOMIC_RELAXED);
+    }
+    return func(n, a, color, out);
+}
+
+static int combine_tile_simd(int mode, int n, const uint8_t (*a)[4],
+                             const uint8_t (*b)[4], uint8_t (*out)[4])
+{
+    static combine_tile_func_t g_func = NULL;
+    combine_tile_func_t func = __atomic_load_n(&g_func, __ATOMIC_RELAXED);
+    if (!func) {
+        func = get_combine_tile_func();
+        __atomic_store_n(&g_func, func, __ATOMIC_RELAXED);
+    }
+    return func(mode, n, a, b, out);
+}
+
+// Multiply n voxels by a color.
+static void color_mul_tile(int n, const uint8_t (*a)[4],
+                           const uint8_t color[4], uint8_t (*out)[4])
+{
+    int i;
+    for (i = color_mul_tile_simd(n, a, color, out); i < n; i++)
+        color_mul(a[i], color, out[i]);
+}
+
+// Combine n voxels of a with n voxels of b.  out can be the same as a.
+static void combine_tile(int mode, int n, const uint8_t (*a)[4],
+                         const uint8_t (*b)[4], uint8_t (*out)[4])
+{
+    int i;
+    for (i = combine_tile_simd(mode, n, a, b, out); i < n; i++)
+        combine(a[i], b[i], mode, out[i]);
+}
+
+typedef struct sym_tiles sym_tiles_t;
+
+// Parameters of the volume_op kernel, shared by all the tiles.
+typedef struct {
+    const painter_t *painter;
+    float (*shape_func)(const float[3], const float[3], float smoothness);
+    // Optional, see shape_t.
+    void (*shape_func_n)(int n, const float *x, const float *y,
+                         const float *z, const float s[3], float smoothness,
+                         float *out);
+    float size[3];
+    float mat[4][4];
+    bool use_box, skip_src_empty, skip_dst_empty;
+    float box_min[3], box_max[3];   // Voxels bounds if use_box is set.
+    // For the symmetry fast path, see volume_op_sym.
+    const sym_tiles_t *sym;
+    int flip;           // Mirrored axes of the pass.
+} volume_op_ctx_t;
+
+/*
+ * Alpha of the color of the shape at a voxel, for the symmetry fast path.
+ * The tiles fully inside or outside the shape have a single value, the
+ * others have the value of each voxel.
+ */
+typedef struct {
+    int     pos[3];
+    int     alpha;      // Alpha of all the voxels, or -1.
+    uint8_t *alphas;    // Only set if alpha is -1.
+} sym_tile_t;
+
+struct sym_tiles {
+    const volume_op_ctx_t *ctx; // Of the original box.
+    int         ofs[3];     // Twice the symmetry origin.
+    int         nb;
+    sym_tile_t  *tiles;     // Sorted by position.
+};
+
+// Alpha of the painter color for a value of the shape function.
+static uint8_t volume_op_k_to_alpha(const volume_op_ctx_t *ctx, float k)
+{
+    const painter_t *painter = ctx->painter;
+    uint8_t a = painter->color[3];
+    float v;
+
+    if (painter->smoothness) {
+        v = clamp(k / painter->smoothness, -1.0f, 1.0f) / 2.0f + 0.5f;
+    } else {
+        v = (k >= 0.f) ? 1.f : 0.f;
+    }
+    a *= v;
+    return a;
+}
+
+// Alpha of the painter color at a voxel center, in the volume space.
+static uint8_t volume_op_get_alpha(const volume_op_ctx_t *ctx, float p[3])
+{
+    mat4_mul_vec3(ctx->mat, p, p);
+    return volume_op_k_to_alpha(ctx, ctx->shape_func(p, ctx->size,
+                                                     ctx->painter->smoothness));
+}
+
+// Get the shape function values of a row of voxels along x, from x0 to x1.
+static void volume_op_get_row(const volume_op_ctx_t *ctx, const int pos[3],
+                              int x0, int x1, int y, int z,
+                              float k[TILE_SIZE])
+{
+    const float (*m)[4] = ctx->mat;
+    float p[3][TILE_SIZE], py, pz, b, c, d;
+    int i, x, n = x1 - x0;
+
+    // Same operations as mat4_mul_vec3, so that we get the same values
+    // as volume_op_get_alpha, but the y and z terms are only computed
+    // once per row.
+    py = pos[1] + y + 0.5;
+    pz = pos[2] + z + 0.5;
+    for (i = 0; i < 3; i++) {
+        b = m[1][i] * py;
+        c = m[2][i] * pz;
+        d = m[3][i];
+        for (x = 0; x < n; x++) {
+            p[i][x] = (((0.f + m[0][i] * (float)(pos[0] + x0 + x + 0.5)) +
+                        b) + c) + d;
+        }
+    }
+    if (ctx->shape_func_n) {
+        ctx->shape_func_n(n, p[0], p[1], p[2], ctx->size,
+                          ctx->painter->smoothness, k + x0);
+        return;
+    }
+    for (x = 0; x < n; x++) {
+        k[x0 + x] = ctx->shape_func(VEC(p[0][x], p[1][x], p[2][x]),
+                                    ctx->size, ctx->painter->smoothness);
+    }
+}
+
+// Test if a voxel center coordinate is inside the painter box.
+static bool volume_op_in_box(const volume_op_ctx_t *ctx, int i, float v)
+{
+    return ctx->box_min[i] <= v && ctx->box_max[i] > v;
+}
+
+static bool volume_op_tile(void *user, const int pos[3], uint8_t (*voxels)[4])
+{
+    const volume_op_ctx_t *ctx = user;
+    const painter_t *painter = ctx->painter;
+    int x, y, z, i, x0, x1;
+    uint8_t new_value[4], c[4];
+    float k[TILE_SIZE];
+    bool changed = false;
+
+    memcpy(c, painter->color, 4);
+    for (z = 0; z < TILE_SIZE; z++)
+    for (y = 0; y < TILE_SIZE; y++) {
+        i = (z * TILE_SIZE + y) * TILE_SIZE;
+        x0 = 0;
+        x1 = TILE_SIZE;
+        if (ctx->use_box) {
+            if (!volume_op_in_box(ctx, 1, pos[1] + y + 0.5) ||
+                !volume_op_in_box(ctx, 2, pos[2] + z + 0.5)) continue;
+            while (x0 < x1 && !volume_op_in_box(ctx, 0, pos[0] + x0 + 0.5))
+                x0++;
+            while (x1 > x0 && !volume_op_in_box(ctx, 0,
+                                                pos[0] + x1 - 1 + 0.5))
+                x1--;
+        }
+        if (ctx->skip_dst_empty) {
+            while (x0 < x1 && !voxels[i + x0][3]) x0++;
+            while (x1 > x0 && !voxels[i + x1 - 1][3]) x1--;
+        }
+        if (x0 == x1) continue;
+        volume_op_get_row(ctx, pos, x0, x1, y, z, k);
+        for (x = x0; x < x1; x++) {
+            if (!voxels[i + x][3] && ctx->skip_dst_empty) continue;
+            c[3] = volume_op_k_to_alpha(ctx, k[x]);
+            if (!c[3] && ctx->skip_src_empty) continue;
+            combine(voxels[i + x], c, painter->mode, new_value);
+            if (vec4_equal(voxels[i + x], new_value)) continue;
+            memcpy(voxels[i + x], new_value, 4);
+            changed = true;
+        }
+    }
+    return changed;
+}
+
+static const sym_tile_t *sym_tiles_find(const sym_tiles_t *sym,
+                                        const int pos[3])
+{
+    return bsearch(pos, sym->tiles, sym->nb, sizeof(*sym->tiles),
+                   tile_pos_cmp);
+}
+
+// Same as volume_op_tile for the symmetry passes, but we get the alpha of
+// the voxels from the mirrored voxels of the original box.
+static bool volume_op_tile_sym(void *user, const int pos[3],
+                               uint8_t (*voxels)[4])
+{
+    const volume_op_ctx_t *ctx = user;
+    const painter_t *painter = ctx->painter;
+    const sym_tile_t *tile;
+    int x, y, z, i, j, src[3], s[3];
+    uint8_t new_value[4], c[4];
+    float p[3];
+    bool changed = false;
+
+    for (j = 0; j < 3; j++) {
+        src[j] = (ctx->flip & (1 << j)) ? ctx->sym->ofs[j] - pos[j] - N
+                                        : pos[j];
+    }
+    tile = sym_tiles_find(ctx->sym, src);
+    memcpy(c, painter->color, 4);
+    if (tile && tile->alpha != -1) c[3] = tile->alpha;
+
+    for (i = 0, z = 0; z < TILE_SIZE; z++)
+    for (y = 0; y < TILE_SIZE; y++)
+    for (x = 0; x < TILE_SIZE; x++, i++) {
+        if (!voxels[i][3] && ctx->skip_dst_empty) continue;
+        if (!tile) {
+            // Can only happen from rounding errors of the box aabb.
+            vec3_set(p, pos[0] + x + 0.5, pos[1] + y + 0.5, pos[2] + z + 0.5);
+            c[3] = volume_op_get_alpha(ctx, p);
+        } else if (tile->alpha == -1) {
+            s[0] = (ctx->flip & 1) ? N - 1 - x : x;
+            s[1] = (ctx->flip & 2) ? N - 1 - y : y;
+            s[2] = (ctx->flip & 4) ? N - 1 - z : z;
+            c[3] = tile->alphas[s[0] + s[1] * N + s[2] * N * N];
+        }
+        if (!c[3] && ctx->skip_src_empty) continue;
+        combine(voxels[i], c, painter->mode, new_value);
+        if (vec4_equal(voxels[i], new_value)) continue;
+        memcpy(voxels[i], new_value, 4);
+        changed = true;
+    }
+    return changed;
+}
+
+/*
+ * Test the tile voxels centers against the shape, using their bounding
+ * ball.  Return 1 if they are all inside, -1 if they are all outside, and
+ * 0 if we don't know.
+ */
+static int volume_op_classify_tile(const volume_op_ctx_t *ctx,
+                                   const int pos[3])
+{
+    const painter_t *painter = ctx->painter;
+    int i;
+    float center[3], p[3], r = 0;
+
+    if (!painter->shape->classify) return 0;
+    vec3_set(center, pos[0] + TILE_SIZE / 2.0, pos[1] + TILE_SIZE / 2.0,
+                     pos[2] + TILE_SIZE / 2.0);
+    mat4_mul_vec3(ctx->mat, center, center);
+    for (i = 0; i < 8; i++) {
+        vec3_set(p, pos[0] + ((i & 1) ? TILE_SIZE - 0.5 : 0.5),
+                    pos[1] + ((i & 2) ? TILE_SIZE - 0.5 : 0.5),
+                    pos[2] + ((i & 4) ? TILE_SIZE - 0.5 : 0.5));
+        mat4_mul_vec3(ctx->mat, p, p);
+        r = max(r, vec3_dist(p, center));
+    }
+    return painter->shape->classify(center, r, ctx->size,
+                                    painter->smoothness);
+}
+
+/*
+ * Try to apply the volume_op to a whole tile at once, without going through
+ * all the voxels.  This is possible when the shape is known to be fully
+ * inside or fully outside the tile, and either the tile is uniform, or the
+ * result doesn't depend on the tile voxels.
+ *
+ * Returns false if the tile has to be processed voxel by voxel.
+ */
+static bool volume_op_tile_fast(volume_t *volume, const volume_op_ctx_t *ctx,
+                                const int pos[3])
+{
+    const painter_t *painter = ctx->painter;
+    int i, mode = painter->mode, inside;
+    float p[3];
+    uint8_t c[4], value[4], new_value[4];
+
+    if (!painter->shape->classify) return false;
+
+    // All the voxels centers must be inside the clipping box.
+    if (ctx->use_box) {
+        for (i = 0; i < 8; i++) {
+            vec3_set(p, pos[0] + ((i & 1) ? TILE_SIZE - 0.5 : 0.5),
+                        pos[1] + ((i & 2) ? TILE_SIZE - 0.5 : 0.5),
+                        pos[2] + ((i & 4) ? TILE_SIZE - 0.5 : 0.5));
+            if (!bbox_contains_vec(*painter->box, p)) return false;
+        }
+    }
+
+    inside = volume_op_classify_tile(ctx, pos);
+    if (inside == 0) return false;
+
+    memcpy(c, painter->color, 4);
+    if (inside == -1) c[3] = 0;
+    if (!c[3] && ctx->skip_src_empty) return true;
+
+    // Uniform tiles (including missing ones) stay uniform.
+    if (volume_is_tile_uniform(volume, NULL, pos, value)) {
+        if (!value[3] && ctx->skip_dst_empty) return true;
+        combine(value, c, mode, new_value);
+        if (!vec4_equal(value, new_value))
+            volume_fill_tile(volume, NULL, pos, new_value);
+        return true;
+    }
+
+    // Results that don't depend on the tile voxels.
+    if ((mode == MODE_OVER || mode == MODE_MAX) && c[3] == 255) {
+        volume_fill_tile(volume, NULL, pos, c);
+        return true;
+    }
+    if (    ((mode == MODE_SUB || mode == MODE_SUB_CLAMP) && c[3] == 255) ||
+            ((mode == MODE_INTERSECT || mode == MODE_INTERSECT_FILL) &&
+             c[3] == 0)) {
+        volume_clear_tile(volume, NULL, pos);
+        return true;
+    }
+    if (    ((mode == MODE_OVER || mode == MODE_PAINT) && c[3] == 0) ||
+            ((mode == MODE_MULT_ALPHA || mode == MODE_INTERSECT) &&
+             c[3] == 255)) {
+        return true;
+    }
+    return false;
+}
+
+// Number of tiles in the aabb of a box.
+static double box_get_aabb_nb_tiles(const float box[4][4])
+{
+    int i, aabb[2][3];
+    double ret = 1;
+    box_get_aabb(box, aabb);
+    for (i = 0; i < 3; i++)
+        ret *= ((aabb[1][i] - 1) >> 4) - (aabb[0][i] >> 4) + 1;
+    return ret;
+}
+
+/*
+ * Collect the tiles touched by a long box by walking along its longest
+ * axis, and only adding the tiles of the aabb of each slice of the box.
+ * For a thin box not aligned with the axes, like the laser tool ray, this
+ * gives a lot less tiles than its whole aabb.
+ */
+static int box_get_tiles_along(const volume_t *volume, const float box[4][4],
+                               bool skip_empty, int (**tiles)[3], int *size)
+{
+    int i, k = 0, nb = 0, n, aabb[2][3], p[3];
+    uint64_t id;
+    float len, t, dt, slice[4][4];
+    volume_accessor_t acc = volume_get_accessor(volume);
+
+    for (i = 1; i < 3; i++) {
+        if (vec3_norm(box[i]) > vec3_norm(box[k])) k = i;
+    }
+    len = vec3_norm(box[k]);
+    // Slices of half a tile, in the box unit coordinates.
+    dt = (N / 2.0) / len;
+    for (t = -1; t < 1; t += 2 * dt) {
+        mat4_copy(box, slice);
+        mat4_itranslate(slice, k == 0 ? t + dt : 0, k == 1 ? t + dt : 0,
+                               k == 2 ? t + dt : 0);
+        vec3_mul(box[k], dt, slice[k]);
+        box_get_aabb(slice, aabb);
+        for (p[2] = aabb[0][2] & ~(N - 1); p[2] < aabb[1][2]; p[2] += N)
+        for (p[1] = aabb[0][1] & ~(N - 1); p[1] < aabb[1][1]; p[1] += N)
+        for (p[0] = aabb[0][0] & ~(N - 1); p[0] < aabb[1][0]; p[0] += N) {
+            if (skip_empty) {
+                volume_get_tile_data(volume, &acc, p, &id);
+                if (!id) continue;
+            }
+            if (nb >= *size) {
+                *size = max(64, *size * 2);
+                *tiles = realloc(*tiles, *size * sizeof(**tiles));
+            }
+            memcpy((*tiles)[nb++], p, sizeof(p));
+        }
+    }
+
+    if (!nb) return 0;
+    // The slices overlap, so remove the duplicated tiles.
+    qsort(*tiles, nb, sizeof(**tiles), tile_pos_cmp);
+    for (i = 0, n = 0; i < nb; i++) {
+        if (n && tile_pos_cmp((*tiles)[n - 1], (*tiles)[i]) == 0) continue;
+        memcpy((*tiles)[n++], (*tiles)[i], sizeof(p));
+    }
+    return n;
+}
+
+static void volume_op_ctx_init(volume_op_ctx_t *ctx, const painter_t *painter,
+                               const float box[4][4])
+{
+    int i, mode = painter->mode;
+
+    *ctx = (volume_op_ctx_t){.painter = painter};
+    ctx->shape_func = painter->shape->func;
+    ctx->shape_func_n = painter->shape->func_n;
+    box_get_size(box, ctx->size);
+    mat4_copy(box, ctx->mat);
+    mat4_iscale(ctx->mat, 1 / ctx->size[0], 1 / ctx->size[1],
+                1 / ctx->size[2]);
+    mat4_invert(ctx->mat, ctx->mat);
+    ctx->use_box = painter->box && !box_is_null(*painter->box);
+    if (ctx->use_box) {
+        for (i = 0; i < 3; i++) {
+            ctx->box_min[i] = (*painter->box)[3][i] - (*painter->box)[i][i];
+            ctx->box_max[i] = (*painter->box)[3][i] + (*painter->box)[i][i];
+        }
+    }
+    ctx->skip_src_empty = mode == MODE_SUB ||
+                          mode == MODE_SUB_CLAMP ||
+                          mode == MODE_MULT_ALPHA;
+    ctx->skip_dst_empty = mode == MODE_SUB ||
+                          mode == MODE_SUB_CLAMP ||
+                          mode == MODE_MULT_ALPHA ||
+                          mode == MODE_INTERSECT ||
+                          mode == MODE_INTERSECT_FILL;
+}
+
+/*
+ * Cache of the results of volume_op_tile.  The result of a tile only
+ * depends on its voxels and on the position of the shape relative to it,
+ * so the same stamp applied at an other position hits on the tiles that
+ * match, like the empty ones.
+ */
+typedef struct {
+    uint64_t        id;         // Data id of the tile before the op.
+    float           box[4][4];  // Shape box, relative to the tile.
+    float           clip[4][4]; // Clipping box, relative to the tile.
+    const shape_t   *shape;
+    int             mode;
+    uint8_t         color[4];
+    float           smoothness;
+} op_tile_key_t;
+
+typedef struct {
+    tile_data_t     *data;      // NULL if the tile didn't change.
+} op_tile_result_t;
+
+static int op_tile_result_del(void *data_)
+{
+    op_tile_result_t *res = data_;
+    if (res->data) volume_tile_data_release(res->data);
+    free(res);
+    return 0;
+}
+
+static void op_tile_get_key(const volume_t *volume, const volume_op_ctx_t *ctx,
+                            const float box[4][4], const int pos[3],
+                            op_tile_key_t *key)
+{
+    const painter_t *painter = ctx->painter;
+    int i;
+
+    memset(key, 0, sizeof(*key));
+    volume_get_tile_data(volume, NULL, pos, &key->id);
+    mat4_copy(box, key->box);
+    if (ctx->use_box) mat4_copy(*painter->box, key->clip);
+    for (i = 0; i < 3; i++) {
+        key->box[3][i] -= pos[i];
+        if (ctx->use_box) key->clip[3][i] -= pos[i];
+    }
+    key->shape = painter->shape;
+    key->mode = painter->mode;
+    memcpy(key->color, painter->color, 4);
+    key->smoothness = painter->smoothness;
+}
+
+// Apply the operation of a single box, without symmetry.
+static void volume_op_pass(volume_t *volume, const volume_op_ctx_t *ctx,
+                           const float box[4][4],
+                           bool (*kernel)(void *user, const int pos[3],
+                                          uint8_t (*voxels)[4]))
+{
+    int i, vp[3];
+    volume_iterator_t iter;
+    int mode = ctx->painter->mode;
+    int (*tiles)[3] = NULL;
+    int n, nb_tiles = 0, tiles_size = 0;
+    int aabb[2][3];
+    bool along = false, use_cache;
+    uint64_t id;
+    static cache_t *cache = NULL;
+    op_tile_key_t *keys = NULL;
+    op_tile_result_t *res;
+
+    // for intersection start by deleting all the tiles that are not in
+    // the box and then iter all the rest.
+    if (mode == MODE_INTERSECT || mode == MODE_INTERSECT_FILL) {
+        iter = volume_get_iterator(volume, VOLUME_ITER_TILES);
+        while (volume_iter(&iter, vp)) {
+            volume_get_tile_aabb(vp, aabb);
+            if (box_intersect_aabb(box, aabb)) continue;
+            volume_clear_tile(volume, &iter, vp);
+        }
+        iter = volume_get_iterator(volume, VOLUME_ITER_TILES |
+                (ctx->skip_dst_empty ? VOLUME_ITER_SKIP_EMPTY : 0));
+    } else if (box_get_aabb_nb_tiles(box) > 4096) {
+        nb_tiles = box_get_tiles_along(volume, box, ctx->skip_dst_empty,
+                                       &tiles, &tiles_size);
+        along = true;
+    } else {
+        iter = volume_get_box_iterator(volume, box, VOLUME_ITER_TILES |
+                (ctx->skip_dst_empty ? VOLUME_ITER_SKIP_EMPTY : 0));
+    }
+
+    // Tiles that cannot be processed at once are run in parallel.
+    while (!along && volume_iter(&iter, vp)) {
+        if (nb_tiles >= tiles_size) {
+            tiles_size = max(64, tiles_size * 2);
+            tiles = realloc(tiles, tiles_size * sizeof(*tiles));
+        }
+        memcpy(tiles[nb_tiles++], vp, sizeof(vp));
+    }
+    for (i = 0, n = 0; i < nb_tiles; i++) {
+        if (volume_op_tile_fast(volume, ctx, tiles[i])) continue;
+        memcpy(tiles[n++], tiles[i], sizeof(tiles[i]));
+    }
+    nb_tiles = n;
+
+    // The cache is not thread safe, so the worker threads don't use it.
+    use_cache = kernel == volume_op_tile && !jobs_in_worker_thread();
+    if (use_cache) {
+        if (!cache) cache = cache_create_governed("volume_op");
+        keys = malloc(max(1, nb_tiles) * sizeof(*keys));
+        for (i = 0, n = 0; i < nb_tiles; i++) {
+            op_tile_get_key(volume, ctx, box, tiles[i], &keys[n]);
+            res = cache_get(cache, &keys[n], sizeof(keys[n]));
+            if (res) {
+                if (res->data) volume_set_tile_data(volume, tiles[i],
+                                                    res->data);
+                continue;
+            }
+            memcpy(tiles[n++], tiles[i], sizeof(tiles[i]));
+        }
+        nb_tiles = n;
+    }
+
+    volume_apply_tiles(volume, nb_tiles, (const int (*)[3])tiles,
+                       kernel, (void*)ctx);
+
+    // The tiles that are still missing have nothing to cache.
+    for (i = 0; use_cache && i < nb_tiles; i++) {
+        volume_get_tile_data(volume, NULL, tiles[i], &id);
+        if (!id) continue;
+        res = calloc(1, sizeof(*res));
+        if (id != keys[i].id)
+            res->data = volume_get_tile_data_ref(volume, tiles[i]);
+        cache_add(cache, &keys[i], sizeof(keys[i]), res,
+                  sizeof(*res) + (res->data ?
+                      volume_tile_data_get_mem(res->data) : 0),
+                  op_tile_result_del);
+    }
+    free(keys);
+    free(tiles);
+}
+
+// Mirror a box around the symmetry origin, along one axis.
+static void box_mirror(const float box[4][4], const float o[3], int axis,
+                       float out[4][4])
+{
+    mat4_set_identity(out);
+    mat4_itranslate(out, +o[0], +o[1], +o[2]);
+    if (axis == 0) mat4_iscale(out, -1,  1,  1);
+    if (axis == 1) mat4_iscale(out,  1, -1,  1);
+    if (axis == 2) mat4_iscale(out,  1,  1, -1);
+    mat4_itranslate(out, -o[0], -o[1], -o[2]);
+    mat4_imul(out, box);
+}
+
+static void sym_tile_compute(void *user, int i, int worker)
+{
+    sym_tiles_t *sym = user;
+    sym_tile_t *tile = &sym->tiles[i];
+    int x, y, z, j;
+    float p[3];
+
+    if (tile->alpha != -1) return;
+    tile->alphas = malloc(N * N * N);
+    for (j = 0, z = 0; z < N; z++)
+    for (y = 0; y < N; y++)
+    for (x = 0; x < N; x++, j++) {
+        vec3_set(p, tile->pos[0] + x + 0.5, tile->pos[1] + y + 0.5,
+                    tile->pos[2] + z + 0.5);
+        tile->alphas[j] = volume_op_get_alpha(sym->ctx, p);
+    }
+}
+
+// Same order of passes as the recursion in volume_op.
+static void volume_op_sym_passes(volume_t *volume, const volume_op_ctx_t *ctx,
+                                 const float box[4][4], int symmetry,
+                                 int flip)
+{
+    int i;
+    float box2[4][4];
+    volume_op_ctx_t ctx2;
+
+    for (i = 0; i < 3; i++) {
+        if (!(symmetry & (1 << i))) continue;
+        symmetry &= ~(1 << i);
+        box_mirror(box, ctx->painter->symmetry_origin, i, box2);
+        volume_op_sym_passes(volume, ctx, box2, symmetry, flip | (1 << i));
+    }
+    if (!flip) {
+        volume_op_pass(volume, ctx->sym->ctx, box, volume_op_tile);
+        return;
+    }
+    volume_op_ctx_init(&ctx2, ctx->painter, box);
+    ctx2.sym = ctx->sym;
+    ctx2.flip = flip;
+    volume_op_pass(volume, &ctx2, box, volume_op_tile_sym);
+}
+
+/*
+ * Apply an operation with symmetry without evaluating the shape again for
+ * each mirrored box: when the symmetry origin falls on the tiles grid, the
+ * voxels of a mirrored box map one to one to the voxels of the original
+ * box, so we compute the shape once, and each pass reads it from the
+ * mirrored voxels.  Returns false if we cannot do it, and the caller
+ * should use the recursion.
+ */
+static bool volume_op_sym(volume_t *volume, const painter_t *painter,
+                          const float box[4][4])
+{
+    int i, aabb[2][3], p[3], o;
+    volume_op_ctx_t ctx;
+    sym_tiles_t sym = {.ctx = &ctx};
+    double nb = 1;
+
+    // The clipping box is not symmetric, and the intersection modes clear
+    // the tiles outside of each box.
+    if (painter->box && !box_is_null(*painter->box)) return false;
+    if (painter->mode == MODE_INTERSECT ||
+        painter->mode == MODE_INTERSECT_FILL) return false;
+    for (i = 0; i < 3; i++) {
+        if (!(painter->symmetry & (1 << i))) continue;
+        o = (int)floorf(painter->symmetry_origin[i] * 2);
+        if (o != painter->symmetry_origin[i] * 2 || o % N) return false;
+        sym.ofs[i] = o;
+    }
+    box_get_aabb(box, aabb);
+    for (i = 0; i < 3; i++) {
+        aabb[0][i] &= ~(N - 1);
+        nb *= (aabb[1][i] - aabb[0][i] + N - 1) / N;
+    }
+    // Big boxes use the tiles along the box, see volume_op_pass.
+    if (nb > 4096 || nb <= 0) return false;
+
+    volume_op_ctx_init(&ctx, painter, box);
+    sym.tiles = calloc((int)nb, sizeof(*sym.tiles));
+    for (p[2] = aabb[0][2]; p[2] < aabb[1][2]; p[2] += N)
+    for (p[1] = aabb[0][1]; p[1] < aabb[1][1]; p[1] += N)
+    for (p[0] = aabb[0][0]; p[0] < aabb[1][0]; p[0] += N) {
+        memcpy(sym.tiles[sym.nb].pos, p, sizeof(p));
+        switch (volume_op_classify_tile(&ctx, p)) {
+        case 1: sym.tiles[sym.nb].alpha = painter->color[3]; break;
+        case -1: sym.tiles[sym.nb].alpha = 0; break;
+        default: sym.tiles[sym.nb].alpha = -1; break;
+        }
+        sym.nb++;
+    }
+    jobs_parallel_for(sym.nb, sym_tile_compute, &sym);
+    ctx.sym = &sym;
+
+    volume_op_sym_passes(volume, &ctx, box, painter->symmetry, 0);
+
+    for (i = 0; i < sym.nb; i++) free(sym.tiles[i].alphas);
+    free(sym.tiles);
+    return true;
+}
+
+void volume_op(volume_t *volume, const painter_t *painter, const float box[4][4])
+{
+    int i;
+    volume_op_ctx_t ctx;
+    painter_t painter2;
+    float box2[4][4];
+    TRACE_SCOPE("volume_op");
+
+    if (painter->symmetry && volume_op_sym(volume, painter, box))
+        return;
+
+    // Fallback: run the operation again for each mirrored box.
+    if (painter->symmetry) {
+        painter2 = *painter;
+        for (i = 0; i < 3; i++) {
+            if (!(painter->symmetry & (1 << i))) continue;
+            painter2.symmetry &= ~(1 << i);
+            box_mirror(box, painter->symmetry_origin, i, box2);
+            volume_op(volume, &painter2, box2);
+        }
+    }
+
+    volume_op_ctx_init(&ctx, painter, box);
+    volume_op_pass(volume, &ctx, box, volume_op_tile);
+}
+
+// XXX: remove this function!
+void volume_get_box(const volume_t *volume, bool exact, float box[4][4])
+{
+    int bbox[2][3];
+    volume_get_bbox(volume, bbox, exact);
+    bbox_from_aabb(box, bbox);
+}
+
+/*
+ * Merge two tiles that only contain two values each, like the selection
+ * mask tiles.  The result of each voxel only depends on its two bits, so we
+ * only have to combine the pairs of values, and the new occupancy mask is
+ * computed with bit operations.
+ *
+ * The empty voxels of the result are all set to zero, since their color is
+ * never visible.
+ *
+ * Return false if the tiles don't have this format, or if the result cannot
+ * be represented as a two values tile.
+ */
+static bool tile_merge_bits(volume_t *volume, const volume_t *other,
+                            const int pos[3], int mode,
+                            const uint8_t color[4])
+{
+    uint64_t m1[N * N * N / 64], m2[N * N * N / 64], m[N * N * N / 64];
+    uint64_t w1, w2, pairs[2][2] = {};
+    uint8_t v1[2][4], v2[2][4], v[4], values[2][4] = {};
+    bool found[2] = {}, table[2][2] = {};
+    int a, b, i, k;
+
+    if (!volume_get_tile_bits(volume, NULL, pos, m1, v1)) return false;
+    if (!volume_get_tile_bits(other, NULL, pos, m2, v2)) return false;
+
+    // Only the pairs of bits that actually appear matter.
+    for (i = 0; i < N * N * N / 64; i++) {
+        pairs[0][0] |= ~m1[i] & ~m2[i];
+        pairs[0][1] |= ~m1[i] & m2[i];
+        pairs[1][0] |= m1[i] & ~m2[i];
+        pairs[1][1] |= m1[i] & m2[i];
+    }
+    for (a = 0; a < 2; a++)
+    for (b = 0; b < 2; b++) {
+        if (!pairs[a][b]) continue;
+        memcpy(v, v2[b], 4);
+        if (color) color_mul(v, color, v);
+        combine(v1[a], v, mode, v);
+        if (!v[3]) memset(v, 0, 4);
+        k = v[3] ? 1 : 0;
+        if (found[k] && memcmp(values[k], v, 4)) return false;
+        memcpy(values[k], v, 4);
+        found[k] = true;
+        table[a][b] = k;
+    }
+    for (i = 0; i < N * N * N / 64; i++) {
+        w1 = m1[i];
+        w2 = m2[i];
+        m[i] = (table[0][0] ? ~w1 & ~w2 : 0) |
+               (table[0][1] ? ~w1 &  w2 : 0) |
+               (table[1][0] ?  w1 & ~w2 : 0) |
+               (table[1][1] ?  w1 &  w2 : 0);
+    }
+    volume_set_tile_bits(volume, NULL, pos, m, values);
+    return true;
+}
+
+/*
+ * Intersect a tile with a two values tile, like when we apply the selection
+ * mask to a layer.  The voxels outside the mask only get their alpha set
+ * to zero, and the fully selected tiles are left untouched.
+ */
+static bool tile_intersect_bits(volume_t *volume, const volume_t *other,
+                                const int pos[3], const uint8_t color[4])
+{
+    uint64_t mask[N * N * N / 64], all = ~0ULL, any = 0;
+    uint8_t values[2][4], (*voxels)[4];
+    tile_data_t *data;
+    int i, j;
+
+    if (color) return false;
+    if (!volume_get_tile_bits(other, NULL, pos, mask, values)) return false;
+    for (i = 0; i < N * N * N / 64; i++) {
+        all &= mask[i];
+        any |= mask[i];
+    }
+    // Partially transparent mask voxels need a full combine.
+    if (any && values[1][3] != 255) return false;
+    if (all == ~0ULL) return true;
+
+    voxels = jobs_get_scratch(N * N * N * 4);
+    volume_get_tile_voxels(volume, NULL, pos, voxels);
+    for (i = 0; i < N * N * N / 64; i++) {
+        if (mask[i] == ~0ULL) continue;
+        for (j = 0; j < 64; j++) {
+            if (!(mask[i] & (1ULL << j))) voxels[i * 64 + j][3] = 0;
+        }
+    }
+    data = volume_tile_data_new(voxels);
+    volume_set_tile_data(volume, pos, data);
+    volume_tile_data_release(data);
+    return true;
+}
+
+static void tile_merge(volume_t *volume, const volume_t *other, const int pos[3],
+                        int mode, const uint8_t color[4])
+{
+    uint64_t id1, id2;
+    tile_data_t *data;
+    uint8_t v1[4], v2[4], (*voxels)[4];
+    static cache_t *g_cache = NULL;
+    cache_t *cache;
+    cache_item_t *ref;
+
+    volume_get_tile_data(volume,  NULL, pos, &id1);
+    volume_get_tile_data(other, NULL, pos, &id2);
+
+    // XXX: cleanup this code!
+
+    if (    (mode == MODE_OVER ||
+             mode == MODE_MAX ||
+             mode == MODE_SUB ||
+             mode == MODE_SUB_CLAMP) && id2 == 0)
+    {
+        return;
+    }
+
+    if ((mode == MODE_OVER || mode == MODE_MAX) && id1 == 0 && !color) {
+        volume_copy_tile(other, pos, volume, pos);
+        return;
+    }
+
+    if ((mode == MODE_MULT_ALPHA) && id1 == 0) return;
+    if ((mode == MODE_MULT_ALPHA) && id2 == 0) {
+        // XXX: could just delete the tile.
+    }
+
+    // Merging two uniform tiles only requires a single combine.
+    if (    volume_is_tile_uniform(volume, NULL, pos, v1) &&
+            volume_is_tile_uniform(other, NULL, pos, v2)) {
+        if (color) color_mul(v2, color, v2);
+        combine(v1, v2, mode, v1);
+        volume_fill_tile(volume, NULL, pos, v1);
+        return;
+    }
+
+    if (tile_merge_bits(volume, other, pos, mode, color)) return;
+    if (mode == MODE_INTERSECT && id1 == 0) return;
+    if (mode == MODE_INTERSECT && tile_intersect_bits(volume, other, pos, color))
+        return;
+
+    TRACE_SCOPE("tile_merge");
+    // Check if the merge op has been cached.  The cache is concurrent, but
+    // only the main thread creates it.
+    cache = __atomic_load_n(&g_cache, __ATOMIC_ACQUIRE);
+    if (!cache && !jobs_in_worker_thread()) {
+        cache = cache_create_with_flags("tile_merge", 0,
+                                        CACHE_GOVERNED | CACHE_CONCURRENT);
+        __atomic_store_n(&g_cache, cache, __ATOMIC_RELEASE);
+    }
+    struct {
+        uint64_t id1;
+        uint64_t id2;
+        int      mode;
+        uint8_t  color[4];
+    } key = { id1, id2, mode };
+    if (color) memcpy(key.color, color, 4);
+    _Static_assert(sizeof(key) == 24, "");
+    data = cache ? cache_acquire(cache, &key, sizeof(key), &ref) : NULL;
+    if (data) {
+        volume_set_tile_data(volume, pos, data);
+        cache_release(cache, ref);
+        return;
+    }
+
+    voxels = jobs_get_scratch(2 * N * N * N * 4);
+    volume_get_tile_voxels(volume, NULL, pos, voxels);
+    volume_get_tile_voxels(other, NULL, pos, voxels + N * N * N);
+    if (color) color_mul_tile(N * N * N, voxels + N * N * N, color,
+                              voxels + N * N * N);
+    combine_tile(mode, N * N * N, voxels, voxels + N * N * N, voxels);
+    data = volume_tile_data_new(voxels);
+    // Set the tile before giving our reference to the cache, since an
+    // other thread could evict it right away.
+    volume_set_tile_data(volume, pos, data);
+    if (!cache) {
+        volume_tile_data_release(data);
+        return;
+    }
+    cache_add(cache, &key, sizeof(key), data,
+              volume_tile_data_get_mem(data), tile_data_del);
+}
+
+typedef struct {
+    const volume_t  *src;
+    int             axis;
+    int             aabb[2][3];
+    const int       *map;
+} remap_ctx_t;
+
+// Return the source coordinate along the axis of a coordinate, or INT_MIN
+// if it is outside the box.
+static int remap_coord(const remap_ctx_t *ctx, int x)
+{
+    if (x < ctx->aabb[0][ctx->axis] || x >= ctx->aabb[1][ctx->axis])
+        return INT_MIN;
+    return ctx->map[x - ctx->aabb[0][ctx->axis]];
+}
+
+static bool remap_tile_is_inside(const remap_ctx_t *ctx, const int pos[3])
+{
+    int i;
+    for (i = 0; i < 3; i++) {
+        if (pos[i] < ctx->aabb[0][i] || pos[i] + N > ctx->aabb[1][i])
+            return false;
+    }
+    return true;
+}
+
+// Test if all the source tiles of a tile are uniform with the same value.
+static bool remap_tile_sources_uniform(const remap_ctx_t *ctx,
+                                       const int pos[3], uint8_t out[4])
+{
+    int i, s, src_pos[3], last = INT_MIN;
+    uint8_t v[4];
+    bool first = true;
+
+    memset(out, 0, 4);
+    memcpy(src_pos, pos, sizeof(src_pos));
+    for (i = 0; i < N; i++) {
+        s = remap_coord(ctx, pos[ctx->axis] + i);
+        if (s == INT_MIN) continue;
+        src_pos[ctx->axis] = s & ~(N - 1);
+        if (src_pos[ctx->axis] == last) continue;
+        last = src_pos[ctx->axis];
+        if (!volume_is_tile_uniform(ctx->src, NULL, src_pos, v)) return false;
+        if (!first && memcmp(v, out, 4)) return false;
+        memcpy(out, v, 4);
+        first = false;
+    }
+    return true;
+}
+
+// Test if a tile comes from a single source tile without any change in
+// the voxels order.
+static bool remap_tile_is_aligned(const remap_ctx_t *ctx, const int pos[3],
+                                  int src_pos[3])
+{
+    int i, s0 = remap_coord(ctx, pos[ctx->axis]);
+    if (s0 % N) return false;
+    for (i = 1; i < N; i++) {
+        if (remap_coord(ctx, pos[ctx->axis] + i) != s0 + i) return false;
+    }
+    memcpy(src_pos, pos, sizeof(int) * 3);
+    src_pos[ctx->axis] = s0;
+    return true;
+}
+
+// Called in parallel for the tiles that need their voxels to be copied.
+static bool remap_tile(void *user, const int pos[3], uint8_t (*voxels)[4])
+{
+    const remap_ctx_t *ctx = user;
+    uint8_t (*src)[4];
+    int i, j, k, s, d[3], p[3], src_pos[3], axis = ctx->axis;
+    int a1 = (axis + 1) % 3, a2 = (axis + 2) % 3;
+    const int stride[3] = {1, N, N * N};
+
+    // Too big for the workers stack, see move_tile_int.
+    src = malloc(N * N * N * 4);
+    memcpy(src_pos, pos, sizeof(src_pos));
+    src_pos[axis] = INT_MIN;
+    for (i = 0; i < N; i++) {
+        s = remap_coord(ctx, pos[axis] + i);
+        if (s == INT_MIN) continue;
+        if ((s & ~(N - 1)) != src_pos[axis]) {
+            src_pos[axis] = s & ~(N - 1);
+            volume_get_tile_voxels(ctx->src, NULL, src_pos, src);
+        }
+        // Copy the plane of voxels perpendicular to the axis.
+        d[axis] = i;
+        for (j = 0; j < N; j++)
+        for (k = 0; k < N; k++) {
+            d[a1] = j;
+            d[a2] = k;
+            p[a1] = pos[a1] + j;
+            p[a2] = pos[a2] + k;
+            if (    p[a1] < ctx->aabb[0][a1] || p[a1] >= ctx->aabb[1][a1] ||
+                    p[a2] < ctx->aabb[0][a2] || p[a2] >= ctx->aabb[1][a2])
+                continue;
+            memcpy(voxels[d[0] + d[1] * N + d[2] * N * N],
+                   src[(s - src_pos[axis]) * stride[axis] +
+                       j * stride[a1] + k * stride[a2]], 4);
+        }
+    }
+    free(src);
+    return true;
+}
+
+void volume_remap_axis(volume_t *volume, int axis, const int aabb[2][3],
+                       const int *map)
+{
+    int i, pos[3], src_pos[3], start[3], nb = 0, size = 0;
+    int (*tiles)[3] = NULL;
+    uint8_t v[4];
+    const uint8_t zero[4] = {};
+    uint64_t id;
+    volume_t *src = volume_copy(volume);
+    remap_ctx_t ctx = {
+        .src = src,
+        .axis = axis,
+        .map = map,
+    };
+
+    memcpy(ctx.aabb, aabb, sizeof(ctx.aabb));
+    for (i = 0; i < 3; i++) start[i] = aabb[0][i] & ~(N - 1);
+
+    for (pos[2] = start[2]; pos[2] < aabb[1][2]; pos[2] += N)
+    for (pos[1] = start[1]; pos[1] < aabb[1][1]; pos[1] += N)
+    for (pos[0] = start[0]; pos[0] < aabb[1][0]; pos[0] += N) {
+        if (remap_tile_sources_uniform(&ctx, pos, v)) {
+            volume_get_tile_data(volume, NULL, pos, &id);
+            // Nothing to do for empty tiles that stay empty.
+            if (memcmp(v, zero, 4) == 0 && id == 0) continue;
+            if (remap_tile_is_inside(&ctx, pos)) {
+                if (memcmp(v, zero, 4) == 0)
+                    volume_clear_tile(volume, NULL, pos);
+                else
+                    volume_fill_tile(volume, NULL, pos, v);
+                continue;
+            }
+        }
+        if (    remap_tile_is_inside(&ctx, pos) &&
+                remap_tile_is_aligned(&ctx, pos, src_pos)) {
+            volume_copy_tile(src, src_pos, volume, pos);
+            continue;
+        }
+        if (nb >= size) {
+            size = max(64, size * 2);
+            tiles = realloc(tiles, size * sizeof(*tiles));
+        }
+        memcpy(tiles[nb++], pos, sizeof(pos));
+    }
+
+    volume_apply_tiles(volume, nb, (const int (*)[3])tiles, remap_tile, &ctx);
+    free(tiles);
+    volume_delete(src);
+}
+
+void volume_invert_mask(volume_t *mask, const volume_t *volume)
+{
+    volume_iterator_t iter;
+    int i, pos[3];
+    uint64_t m1[N * N * N / 64], m2[N * N * N / 64];
+    uint8_t values[2][4];
+    const uint8_t white[2][4] = {{0, 0, 0, 0}, {255, 255, 255, 255}};
+
+    iter = volume_get_union_iterator(mask, volume, VOLUME_ITER_TILES);
+    while (volume_iter(&iter, pos)) {
+        volume_get_tile_bits(volume, NULL, pos, m1, values);
+        volume_get_tile_bits(mask, NULL, pos, m2, values);
+        for (i = 0; i < N * N * N / 64; i++) m1[i] &= ~m2[i];
+        volume_set_tile_bits(mask, NULL, pos, m1, white);
+    }
+    volume_remove_empty_tiles(mask, true);
+}
+
+typedef struct {
+    const volume_t  *mask;
+    int             aabb[2][3];
+    const uint8_t   *color;
+    bool            cut;
+} extract_ctx_t;
+
+// Return 1 if all the voxels of a tile are selected, -1 if none is, and 0
+// otherwise.
+static int extract_classify_tile(const extract_ctx_t *ctx, const int pos[3])
+{
+    int i;
+    uint8_t v[4];
+
+    if (ctx->mask) {
+        if (!volume_is_tile_uniform(ctx->mask, NULL, pos, v)) return 0;
+        return v[3] == 255 ? 1 : v[3] == 0 ? -1 : 0;
+    }
+    for (i = 0; i < 3; i++) {
+        if (pos[i] >= ctx->aabb[1][i] || pos[i] + N <= ctx->aabb[0][i])
+            return -1;
+    }
+    for (i = 0; i < 3; i++) {
+        if (pos[i] < ctx->aabb[0][i] || pos[i] + N > ctx->aabb[1][i])
+            return 0;
+    }
+    return 1;
+}
+
+// Get the selected voxels of a tile as an occupancy mask.  Return false if
+// the selection mask has partially selected voxels.
+static bool extract_get_sel_bits(const extract_ctx_t *ctx, const int pos[3],
+                                 uint64_t bits[])
+{
+    int i, x, y, z;
+    uint8_t values[2][4];
+
+    if (ctx->mask) {
+        if (!volume_get_tile_bits(ctx->mask, NULL, pos, bits, values))
+            return false;
+        return values[1][3] == 255 || values[1][3] == 0;
+    }
+    memset(bits, 0, N * N * N / 8);
+    for (z = 0; z < N; z++)
+    for (y = 0; y < N; y++)
+    for (x = 0; x < N; x++) {
+        if (    pos[0] + x < ctx->aabb[0][0] || pos[0] + x >= ctx->aabb[1][0] ||
+                pos[1] + y < ctx->aabb[0][1] || pos[1] + y >= ctx->aabb[1][1] ||
+                pos[2] + z < ctx->aabb[0][2] || pos[2] + z >= ctx->aabb[1][2])
+            continue;
+        i = x + y * N + z * N * N;
+        bits[i / 64] |= 1ULL << (i % 64);
+    }
+    return true;
+}
+
+// Set a tile from an occupancy mask, removing it if the mask is empty.
+static void extract_set_tile_bits(volume_t *volume, const int pos[3],
+                                  const uint64_t bits[],
+                                  const uint8_t values[2][4])
+{
+    int i;
+    uint64_t any = 0;
+    for (i = 0; i < N * N * N / 64; i++) any |= bits[i];
+    if (any)
+        volume_set_tile_bits(volume, NULL, pos, bits, values);
+    else
+        volume_clear_tile(volume, NULL, pos);
+}
+
+// Called in parallel for the tiles that need to be processed voxel by voxel.
+static bool extract_tile(void *user, const int pos[3], uint8_t (*voxels)[4])
+{
+    const extract_ctx_t *ctx = user;
+    uint64_t bits[N * N * N / 64];
+    uint8_t (*sel)[4] = NULL;
+    bool use_bits;
+    int i, s, a;
+
+    use_bits = extract_get_sel_bits(ctx, pos, bits);
+    if (!use_bits) {
+        // Too big for the workers stack, see move_tile_int.
+        sel = malloc(N * N * N * 4);
+        volume_get_tile_voxels(ctx->mask, NULL, pos, sel);
+    }
+    for (i = 0; i < N * N * N; i++) {
+        if (use_bits)
+            s = (bits[i / 64] >> (i % 64)) & 1 ? 255 : 0;
+        else
+            s = sel[i][3];
+        a = ctx->cut ? max(0, voxels[i][3] - s) : min(voxels[i][3], s);
+        if (!a) {
+            memset(voxels[i], 0, 4);
+            continue;
+        }
+        voxels[i][3] = a;
+        if (ctx->color && !ctx->cut) memcpy(voxels[i], ctx->color, 3);
+    }
+    free(sel);
+    return true;
+}
+
+void volume_extract(volume_t *volume, const volume_t *mask,
+                    const int aabb[2][3], const uint8_t color[4],
+                    bool cut, volume_t *out)
+{
+    volume_iterator_t iter;
+    int i, j, nb = 0, nb_voxels = 0, size = 0, pos[3];
+    int (*tiles)[3] = NULL, *inside = NULL;
+    uint64_t bits[N * N * N / 64], sel[N * N * N / 64], m[N * N * N / 64];
+    uint64_t any_in, any_out;
+    uint8_t values[2][4], out_values[2][4];
+    bool two_values, sel_bits;
+    extract_ctx_t ctx = {
+        .mask = mask,
+        .color = color,
+    };
+
+    assert(mask || aabb);
+    if (!mask) memcpy(ctx.aabb, aabb, sizeof(ctx.aabb));
+    volume_clear(out);
+
+    // Collect the tiles with selected voxels first, since we are going to
+    // modify the volume.
+    iter = volume_get_iterator(volume, VOLUME_ITER_TILES);
+    while (volume_iter(&iter, pos)) {
+        j = extract_classify_tile(&ctx, pos);
+        if (j == -1) continue;
+        if (nb >= size) {
+            size = max(64, size * 2);
+            tiles = realloc(tiles, size * sizeof(*tiles));
+            inside = realloc(inside, size * sizeof(*inside));
+        }
+        memcpy(tiles[nb], pos, sizeof(pos));
+        inside[nb++] = j;
+    }
+
+    // The tiles whose voxels are all selected are moved by reference, and
+    // the tiles whose voxels and selection are occupancy masks are done
+    // with bit operations.  The other ones are kept for a voxel by voxel
+    // pass.
+    for (i = 0; i < nb; i++) {
+        if (inside[i] == 1 && !color) {
+            volume_copy_tile(volume, tiles[i], out, tiles[i]);
+            if (cut) volume_clear_tile(volume, NULL, tiles[i]);
+            continue;
+        }
+        two_values = volume_get_tile_bits(volume, NULL, tiles[i], bits,
+                                          values);
+        sel_bits = extract_get_sel_bits(&ctx, tiles[i], sel);
+        if (sel_bits) {
+            any_in = any_out = 0;
+            for (j = 0; j < N * N * N / 64; j++) {
+                any_in |= bits[j] & sel[j];
+                any_out |= bits[j] & ~sel[j];
+            }
+            if (!any_in) continue;
+            if (!any_out && !color) {
+                volume_copy_tile(volume, tiles[i], out, tiles[i]);
+                if (cut) volume_clear_tile(volume, NULL, tiles[i]);
+                continue;
+            }
+        }
+        if (two_values && sel_bits) {
+            memset(values[0], 0, 4);
+            memcpy(out_values, values, sizeof(values));
+            if (color) memcpy(out_values[1], color, 3);
+            for (j = 0; j < N * N * N / 64; j++) m[j] = bits[j] & sel[j];
+            extract_set_tile_bits(out, tiles[i], m, out_values);
+            if (!cut) continue;
+            for (j = 0; j < N * N * N / 64; j++) m[j] = bits[j] & ~sel[j];
+            extract_set_tile_bits(volume, tiles[i], m, values);
+            continue;
+        }
+        memcpy(tiles[nb_voxels++], tiles[i], sizeof(tiles[i]));
+    }
+
+    for (i = 0; i < nb_voxels; i++)
+        volume_copy_tile(volume, tiles[i], out, tiles[i]);
+    volume_apply_tiles(out, nb_voxels, (const int (*)[3])tiles,
+                       extract_tile, &ctx);
+    if (cut) {
+        ctx.cut = true;
+        volume_apply_tiles(volume, nb_voxels, (const int (*)[3])tiles,
+                           extract_tile, &ctx);
+    }
+    volume_remove_empty_tiles(out, true);
+    free(tiles);
+    free(inside);
+}
+
+void volume_merge(volume_t *volume, const volume_t *other, int mode,
+                const uint8_t color[4])
+{
+    volume_t *cached;
+    assert(volume && other);
+    static cache_t *cache = NULL;
+    volume_iterator_t iter;
+    int bpos[3];
+    uint64_t id1, id2;
+    bool use_cache;
+    TRACE_SCOPE("volume_merge");
+
+    // Simple case for replace.
+    if (mode == MODE_REPLACE) {
         volume_set(volume, other);
         return;
     }
 
-    // Check if the merge op has been cached.
-    if (!cache) cache = cache_create("volume_merge", 512);
+    // Check if the merge op has been cached.  The cache is not thread
+    // safe, so the worker threads don't use it.
+    use_cache = !jobs_in_worker_thread();
+    if (use_cache && !cache) cache = cache_create_governed("volume_merge");
     id1 = volume_get_key(volume);
     id2 = volume_get_key(other);
     struct {
@@ -492,7 +2388,7 @@ void volume_merge(volume_t *volume, const volume_t *other, int mode,
     } key = { id1, id2, mode };
     if (color) memcpy(key.color, color, 4);
     _Static_assert(sizeof(key) == 24, "");
-    cached = cache_get(cache, &key, sizeof(key));
+    cached = use_cache ? cache_get(cache, &key, sizeof(key)) : NULL;
     if (cached) {
         volume_set(volume, cached);
         return;
@@ -503,7 +2399,133 @@ void volume_merge(volume_t *volume, const volume_t *other, int mode,
         tile_merge(volume, other, bpos, mode, color);
     }
 
-    cache_add(cache, &key, sizeof(key), volume_copy(volume), 1, volume_del);
+    if (use_cache)
+        cache_add(cache, &key, sizeof(key), volume_copy(volume),
+                  volume_get_mem(volume), volume_del);
+}
+
+void volume_merge_aabb(volume_t *volume, const volume_t *base,
+                       const volume_t *other, const int aabb[2][3],
+                       int mode, const uint8_t color[4])
+{
+    int p[3];
+    uint64_t id1, id2;
+
+    for (p[2] = aabb[0][2] & ~(N - 1); p[2] < aabb[1][2]; p[2] += N)
+    for (p[1] = aabb[0][1] & ~(N - 1); p[1] < aabb[1][1]; p[1] += N)
+    for (p[0] = aabb[0][0] & ~(N - 1); p[0] < aabb[1][0]; p[0] += N) {
+        volume_get_tile_data(volume, NULL, p, &id1);
+        volume_get_tile_data(base, NULL, p, &id2);
+        if (id1 != id2) volume_copy_tile(base, p, volume, p);
+        tile_merge(volume, other, p, mode, color);
+    }
+}
+
+static int pos_cmp(const void *a_, const void *b_)
+{
+    const int *a = a_, *b = b_;
+    int i;
+    for (i = 0; i < 3; i++) {
+        if (a[i] != b[i]) return a[i] < b[i] ? -1 : 1;
+    }
+    return 0;
+}
+
+// Add to a list all the positions of the tiles that differ between two
+// volumes.
+static void add_changed_tiles(const volume_t *a, const volume_t *b,
+                              int *nb, int *size, int (**pos)[3])
+{
+    volume_iterator_t iter;
+    int p[3];
+    uint64_t id1, id2;
+
+    if (volume_get_key(a) == volume_get_key(b)) return;
+    iter = volume_get_union_iterator(a, b, VOLUME_ITER_TILES);
+    while (volume_iter(&iter, p)) {
+        volume_get_tile_data(a, NULL, p, &id1);
+        volume_get_tile_data(b, NULL, p, &id2);
+        if (id1 == id2) continue;
+        if (*nb >= *size) {
+            *size = max(*size * 2, 64);
+            *pos = realloc(*pos, *size * sizeof(**pos));
+        }
+        memcpy((*pos)[(*nb)++], p, sizeof(p));
+    }
+}
+
+typedef struct {
+    int nb;
+    int size;
+    int (*pos)[3];
+} pos_list_t;
+
+static void add_journal_tile(void *user, const int pos[3])
+{
+    pos_list_t *list = user;
+    if (list->nb >= list->size) {
+        list->size = max(list->size * 2, 64);
+        list->pos = realloc(list->pos, list->size * sizeof(*list->pos));
+    }
+    memcpy(list->pos[list->nb++], pos, sizeof(int[3]));
+}
+
+void volume_stack_update(volume_stack_t *stack, int nb,
+                         const volume_t **volumes)
+{
+    int i, j;
+    pos_list_t list = {};
+
+    if (!stack->volume) stack->volume = volume_new();
+
+    // Different stack: merge all the volumes again.
+    if (nb != stack->nb) {
+        for (i = 0; i < stack->nb; i++) volume_delete(stack->inputs[i]);
+        stack->nb = nb;
+        stack->inputs = realloc(stack->inputs, nb * sizeof(*stack->inputs));
+        stack->cursors = realloc(stack->cursors,
+                                 nb * sizeof(*stack->cursors));
+        volume_clear(stack->volume);
+        for (i = 0; i < nb; i++) {
+            volume_merge(stack->volume, volumes[i], MODE_OVER, NULL);
+            stack->inputs[i] = volume_copy(volumes[i]);
+            stack->cursors[i] = volume_journal_get_cursor(volumes[i]);
+        }
+        return;
+    }
+
+    // Only compare the whole volumes if their journal cannot tell.
+    for (i = 0; i < nb; i++) {
+        if (volume_journal_read(volumes[i], &stack->cursors[i],
+                                add_journal_tile, &list) >= 0)
+            continue;
+        add_changed_tiles(stack->inputs[i], volumes[i],
+                          &list.nb, &list.size, &list.pos);
+    }
+    if (list.nb == 0) goto end;
+
+    qsort(list.pos, list.nb, sizeof(*list.pos), pos_cmp);
+    for (i = 0; i < list.nb; i++) {
+        if (i && pos_cmp(list.pos[i], list.pos[i - 1]) == 0) continue;
+        volume_clear_tile(stack->volume, NULL, list.pos[i]);
+        for (j = 0; j < nb; j++)
+            tile_merge(stack->volume, volumes[j], list.pos[i], MODE_OVER,
+                       NULL);
+    }
+
+end:
+    for (i = 0; i < nb; i++) volume_set(stack->inputs[i], volumes[i]);
+    free(list.pos);
+}
+
+void volume_stack_release(volume_stack_t *stack)
+{
+    int i;
+    for (i = 0; i < stack->nb; i++) volume_delete(stack->inputs[i]);
+    free(stack->inputs);
+    free(stack->cursors);
+    volume_delete(stack->volume);
+    memset(stack, 0, sizeof(*stack));
 }
 
 void volume_crop(volume_t *volume, const float box[4][4])
@@ -516,24 +2538,54 @@ void volume_crop(volume_t *volume, const float box[4][4])
     volume_op(volume, &painter, box);
 }
 
-/* Function: volume_crc32
- * Compute the crc32 of the volume data as an array of xyz rgba values.
- *
- * This is only used in the tests, to make sure that we can still open
- * old file formats.
+typedef struct {
+    const volume_t  *volume;
+    int             (*pos)[3];
+    uint64_t        (*hashes)[2];
+    bool            *set;
+} crc_ctx_t;
+
+static void crc_job(void *user, int i, int worker)
+{
+    crc_ctx_t *ctx = user;
+    ctx->set[i] = volume_get_tile_hash(ctx->volume, NULL, ctx->pos[i],
+                                       ctx->hashes[i]);
+}
+
+/*
+ * The tiles hashes are memoized in the tiles data, so only the tiles that
+ * changed since the last call get hashed again, in parallel.  We then
+ * combine them in the tiles position order.
  */
 uint32_t volume_crc32(const volume_t *volume)
 {
     volume_iterator_t iter;
-    int pos[3];
-    uint8_t v[4];
+    int i, nb = 0, size = 0, pos[3];
     uint32_t ret = 0;
-    iter = volume_get_iterator(volume, VOLUME_ITER_VOXELS);
+    crc_ctx_t ctx = {.volume = volume};
+
+    // Iterating the tiles also unpacks them, so the jobs can read them.
+    iter = volume_get_iterator(volume, VOLUME_ITER_TILES);
     while (volume_iter(&iter, pos)) {
-        volume_get_at(volume, &iter, pos, v);
-        if (!v[3]) continue;
-        ret = XXH32(pos, sizeof(pos), ret);
-        ret = XXH32(v, sizeof(v), ret);
+        if (nb >= size) {
+            size = max(64, size * 2);
+            ctx.pos = realloc(ctx.pos, size * sizeof(*ctx.pos));
+        }
+        memcpy(ctx.pos[nb++], pos, sizeof(pos));
+    }
+    if (!nb) return 0;
+    qsort(ctx.pos, nb, sizeof(*ctx.pos), tile_pos_cmp);
+    ctx.hashes = malloc(nb * sizeof(*ctx.hashes));
+    ctx.set = malloc(nb * sizeof(*ctx.set));
+    jobs_parallel_for(nb, crc_job, &ctx);
+
+    for (i = 0; i < nb; i++) {
+        if (!ctx.set[i]) continue;
+        ret = XXH32(ctx.pos[i], sizeof(ctx.pos[i]), ret);
+        ret = XXH32(ctx.hashes[i], sizeof(ctx.hashes[i]), ret);
     }
+    free(ctx.pos);
+    free(ctx.hashes);
+    free(ctx.set);
     return ret;
 }
@@ -57,6 +57,25 @@ enum {
 };
 
 
+/*
+ * The picking buffer stores, on 32 bits, the voxel position and face of
+ * each pixel and the id of its tile:
+ *
+ *    x    :  TILE_BITS
+ *    y    :  TILE_BITS
+ *    z    :  TILE_BITS
+ *    pad  :  1 bit (highest bit of the tile id)
+ *    face :  3 bits
+ *    tile :  PICK_POS_SHIFT bits
+ *
+ * That is 17 bits of tile id with 16^3 tiles, and 14 bits with 32^3 tiles.
+ * The vertices pos_data only contain the PICK_POS_BYTES high bytes of the
+ * value, with the face at bit PICK_DATA_SHIFT.
+ */
+#define PICK_POS_SHIFT (32 - (3 * TILE_BITS + 4))
+#define PICK_POS_BYTES ((3 * TILE_BITS + 4 + 7) / 8)
+#define PICK_DATA_SHIFT (PICK_POS_SHIFT - 8 * (4 - PICK_POS_BYTES))
+
 // Structure used for the OpenGL array data of blocks.
 // XXX: we can probably make it smaller.
 typedef struct voxel_vertex
@@ -66,10 +85,11 @@ typedef struct voxel_vertex
     int8_t   tangent[3]                 __attribute__((aligned(4)));
     int8_t   gradient[3]                __attribute__((aligned(4)));
     uint8_t  color[4]                   __attribute__((aligned(4)));
-    uint16_t pos_data                   __attribute__((aligned(4)));
+    uint32_t pos_data                   __attribute__((aligned(4)));
     uint8_t  uv[2]                      __attribute__((aligned(4)));
     uint8_t  occlusion_uv[2]            __attribute__((aligned(4)));
     uint8_t  bump_uv[2]                 __attribute__((aligned(4)));
+    uint8_t  ao                         __attribute__((aligned(4)));
 } voxel_vertex_t;
 
 typedef struct volume_mesh
@@ -129,7 +149,19 @@ void volume_get_box(const volume_t *volume, bool exact, float box[4][4]);
 void volume_op(volume_t *volume, const painter_t *painter,
                const float box[4][4]);
 
-// XXX: to cleanup.
+/*
+ * Function: volume_extrude
+ * Sweep a cross-section of a volume along a plane normal.
+ *
+ * The voxels of the plane section that are inside the box are repeated
+ * along the normal to fill the box, and all the voxels outside the box
+ * are removed.
+ *
+ * Parameters:
+ *   volume - The volume.
+ *   plane  - The section plane.  Only axis aligned normals are supported.
+ *   box    - The bbox to fill.
+ */
 void volume_extrude(volume_t *volume,
                   const float plane[4][4],
                   const float box[4][4]);
@@ -148,7 +180,7 @@ void volume_extrude(volume_t *volume,
  *   w    - Width of the data.
  *   h    - Height of the data.
  *   d    - Depth of the data.
- *   iter - Optional iterator for optimized access.
+ *   iter - Not used anymore.
  */
 void volume_blit(volume_t *volume, const uint8_t *data,
                int x, int y, int z, int w, int h, int d,
@@ -167,6 +199,27 @@ int volume_select(const volume_t *volume,
                             volume_accessor_t *volume_accessor),
                 void *user, volume_t *selection);
 
+/*
+ * Function: volume_raycast
+ * Find the first visible voxel along a ray.
+ *
+ * The ray is traversed voxel by voxel (Amanatides-Woo DDA), with a single
+ * tile lookup each time it enters a new tile.  A voxel is visible if its
+ * alpha is at least 127, as in the rendering.
+ *
+ * Parameters:
+ *   volume - The volume.
+ *   origin - Origin of the ray.
+ *   dir    - Direction of the ray.
+ *   pos    - Output position of the hit voxel.
+ *   normal - Output normal of the hit face of the voxel.
+ *
+ * Returns:
+ *   true if the ray hits a voxel.
+ */
+bool volume_raycast(const volume_t *volume, const float origin[3],
+                    const float dir[3], int pos[3], int normal[3]);
+
 /*
  * Function: volume_merge
  * Merge a volume into an other using a given blending function.
@@ -181,6 +234,129 @@ int volume_select(const volume_t *volume,
 void volume_merge(volume_t *volume, const volume_t *other, int mode,
                 const uint8_t color[4]);
 
+/*
+ * Function: volume_remap_axis
+ * Move the voxels of a box along an axis.
+ *
+ * Each voxel inside the box gets the value of the voxel at the same
+ * position, except along the axis where it comes from the coordinate given
+ * by a map.  This can be used to mirror or to wrap the voxels.  The voxels
+ * are processed tile by tile: the tiles that only come from uniform tiles,
+ * or from a single tile at a tile aligned offset, are set without copying
+ * their voxels.
+ *
+ * Parameters:
+ *   volume - The volume.
+ *   axis   - The axis along which the voxels are moved (0, 1 or 2).
+ *   aabb   - The box, as its min (included) and max (excluded) corners.
+ *   map    - Source coordinate along the axis of each coordinate of the
+ *            box, starting at aabb[0][axis].  They should all be inside
+ *            the box.
+ */
+void volume_remap_axis(volume_t *volume, int axis, const int aabb[2][3],
+                       const int *map);
+
+/*
+ * Function: volume_invert_mask
+ * Invert a mask inside the non empty voxels of a volume.
+ *
+ * After the call the mask contains all the non empty voxels of the volume
+ * that were not in it, set to white.  The tiles are computed with bit
+ * operations on their occupancy masks.
+ *
+ * Parameters:
+ *   mask   - The mask volume to invert.
+ *   volume - The volume giving the voxels to consider.
+ */
+void volume_invert_mask(volume_t *mask, const volume_t *volume);
+
+/*
+ * Function: volume_extract
+ * Copy the selected voxels of a volume into an other one.
+ *
+ * The selection is either a mask volume, whose alpha gives how much each
+ * voxel is selected, or a box.  Only the tiles with selected voxels are
+ * processed: the fully selected ones are shared by reference, and the
+ * partially selected ones are done in parallel, or with bit operations
+ * when possible.
+ *
+ * Parameters:
+ *   volume - The source volume.
+ *   mask   - The selection mask, or NULL to use the box.
+ *   aabb   - The selection box, as its min (included) and max (excluded)
+ *            corners.  Only used if mask is NULL.
+ *   color  - If set, the extracted voxels get this RGB color.
+ *   cut    - If true, also remove the selected voxels from the source.
+ *   out    - The volume that receives the selected voxels.  Its previous
+ *            content is cleared.  Must be different from the source.
+ */
+void volume_extract(volume_t *volume, const volume_t *mask,
+                    const int aabb[2][3], const uint8_t color[4],
+                    bool cut, volume_t *out);
+
+/*
+ * Function: volume_merge_aabb
+ * Recompute the merge of two volumes inside a box.
+ *
+ * The tiles of the destination volume that intersect the box are set to the
+ * merge of the base and other volumes, the other tiles are left unchanged.
+ * This allows to update a merge incrementally when the changes of the
+ * merged volume are known.
+ *
+ * Parameters:
+ *   volume - The destination volume.
+ *   base   - The volume we merge into.
+ *   other  - The volume we merge.
+ *   aabb   - The box to update.
+ *   mode   - The blending function used.  One of the <MODE> enum values.
+ *   color  - A color to apply to the source volume before merging.  Can be
+ *            set to NULL.
+ */
+void volume_merge_aabb(volume_t *volume, const volume_t *base,
+                       const volume_t *other, const int aabb[2][3],
+                       int mode, const uint8_t color[4]);
+
+/*
+ * Type: volume_stack_t
+ * The merge of a stack of volumes, that can be updated incrementally.
+ *
+ * Attributes:
+ *   volume - The merged volume.
+ *   nb     - Number of volumes merged.
+ *   inputs - Copies of the merged volumes, used to find the changes.
+ *   cursors - Journal cursors of the merged volumes.
+ */
+typedef struct {
+    volume_t *volume;
+    int      nb;
+    volume_t **inputs;
+    volume_cursor_t *cursors;
+} volume_stack_t;
+
+/*
+ * Function: volume_stack_update
+ * Update the merge of a stack of volumes.
+ *
+ * If the stack has the same number of volumes as the last update, only the
+ * tiles that changed in any of the volumes get merged again.  Otherwise the
+ * whole merge is recomputed.  The changed tiles are taken from the volumes
+ * journals when possible, and otherwise found by comparing the volumes
+ * with their copies from the last update.
+ *
+ * Parameters:
+ *   stack   - The stack, zero initialized the first time.
+ *   nb      - Number of volumes.
+ *   volumes - The volumes, merged from first to last with MODE_OVER.
+ */
+void volume_stack_update(volume_stack_t *stack, int nb,
+                         const volume_t **volumes);
+
+/*
+ * Function: volume_stack_release
+ * Release all the memory used by a volume stack.
+ */
+void volume_stack_release(volume_stack_t *stack);
+
 /*
  * Function: volume_generate_vertices
  * Generate a vertice array for rendering a volume block.
@@ -201,6 +377,19 @@ int volume_generate_vertices(const volume_t *volume, const int block_pos[3],
                            int effects, voxel_vertex_t *out,
                            int *size, int *subdivide);
 
+/*
+ * Function: volume_generate_vertices_lod
+ * Same as volume_generate_vertices, but with the volume downsampled by a
+ * factor of 2^lod, for the rendering of the far tiles.
+ *
+ * The returned vertices positions are in units of 2^lod voxels.  The lod
+ * is ignored for the marching cube effect.
+ */
+int volume_generate_vertices_lod(const volume_t *volume,
+                                 const int block_pos[3], int lod,
+                                 int effects, voxel_vertex_t *out,
+                                 int *size, int *subdivide);
+
 /*
  * volume_generate_mesh
  * Compared to volume_generate_vertices, this generate a single mesh for
@@ -216,6 +405,26 @@ volume_mesh_t *volume_generate_mesh(
         const volume_t *volume, int effects, const palette_t *palette,
         float simplify);
 
+/*
+ * Function: volume_generate_tile_mesh
+ * Same as <volume_generate_mesh>, but for a single tile.
+ *
+ * The vertices positions are relative to the tile position, so that two
+ * tiles with the same voxels and neighbors get the same mesh.  This can be
+ * called from the jobs functions, but it uses <jobs_get_scratch>.
+ *
+ * Parameters:
+ *   volume   - The volume.
+ *   pos      - Position of the tile.
+ *   effects  - Render effects.
+ *   palette  - If set, use texture coordinates into the palette instead of
+ *              vertex colors.
+ *   simplify - 0 to 1.  0 for no simplification, 1 for most simplification.
+ */
+volume_mesh_t *volume_generate_tile_mesh(
+        const volume_t *volume, const int pos[3], int effects,
+        const palette_t *palette, float simplify);
+
 void volume_mesh_free(volume_mesh_t *mesh);
 
 
@@ -223,10 +432,13 @@ void volume_mesh_free(volume_mesh_t *mesh);
 void volume_crop(volume_t *volume, const float box[4][4]);
 
 /* Function: volume_crc32
- * Compute the crc32 of the volume data as an array of xyz rgba values.
+ * Compute a 32 bits hash of the visible voxels of a volume.
  *
- * This is only used in the tests, to make sure that we can still open
- * old file formats.
+ * The hash only depends on the voxels positions and values (the color of
+ * the voxels with a zero alpha is ignored), so it can be used to test if
+ * a model changed.  It is computed from the memoized hashes of the tiles,
+ * so it is fast to call again after small changes.  The result depends on
+ * the tiles size.
  */
 uint32_t volume_crc32(const volume_t *volume);
 
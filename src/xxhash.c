@@ -18,3 +18,100 @@
 
 #define XXH_NO_LONG_LONG
 #include "../ext_src/xxhash/xxhash.c"
+
+/*
+ * The 64 bits version of the hash.  The vendored xxhash.c only compiles it
+ * together with XXH3, that we don't have, so we implement it here, following
+ * the reference implementation.
+ */
+
+#include <stdint.h>
+#include <string.h>
+
+static const uint64_t P64_1 = 11400714785074694791ULL;
+static const uint64_t P64_2 = 14029467366897019727ULL;
+static const uint64_t P64_3 =  1609587929392839161ULL;
+static const uint64_t P64_4 =  9650029242287828579ULL;
+static const uint64_t P64_5 =  2870177450012600261ULL;
+
+static inline uint64_t rotl64(uint64_t x, int r)
+{
+    return (x << r) | (x >> (64 - r));
+}
+
+static inline uint64_t read64(const uint8_t *p)
+{
+    uint64_t v;
+    memcpy(&v, p, sizeof(v)); // Assume little endian.
+    return v;
+}
+
+static inline uint32_t read32(const uint8_t *p)
+{
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static inline uint64_t round64(uint64_t acc, uint64_t input)
+{
+    acc += input * P64_2;
+    acc = rotl64(acc, 31);
+    return acc * P64_1;
+}
+
+static inline uint64_t merge_round64(uint64_t acc, uint64_t val)
+{
+    acc ^= round64(0, val);
+    return acc * P64_1 + P64_4;
+}
+
+unsigned long long XXH64(const void *input, size_t len,
+                         unsigned long long seed)
+{
+    const uint8_t *p = input;
+    const uint8_t *end = p + len;
+    uint64_t h, v1, v2, v3, v4;
+
+    if (len >= 32) {
+        v1 = seed + P64_1 + P64_2;
+        v2 = seed + P64_2;
+        v3 = seed;
+        v4 = seed - P64_1;
+        for (; p + 32 <= end; p += 32) {
+            v1 = round64(v1, read64(p + 0));
+            v2 = round64(v2, read64(p + 8));
+            v3 = round64(v3, read64(p + 16));
+            v4 = round64(v4, read64(p + 24));
+        }
+        h = rotl64(v1, 1) + rotl64(v2, 7) + rotl64(v3, 12) + rotl64(v4, 18);
+        h = merge_round64(h, v1);
+        h = merge_round64(h, v2);
+        h = merge_round64(h, v3);
+        h = merge_round64(h, v4);
+    } else {
+        h = seed + P64_5;
+    }
+    h += len;
+
+    for (; p + 8 <= end; p += 8) {
+        h ^= round64(0, read64(p));
+        h = rotl64(h, 27) * P64_1 + P64_4;
+    }
+    if (p + 4 <= end) {
+        h ^= (uint64_t)read32(p) * P64_1;
+        h = rotl64(h, 23) * P64_2 + P64_3;
+        p += 4;
+    }
+    for (; p < end; p++) {
+        h ^= *p * P64_5;
+        h = rotl64(h, 11) * P64_1;
+    }
+
+    h ^= h >> 33;
+    h *= P64_2;
+    h ^= h >> 29;
+    h *= P64_3;
+    h ^= h >> 32;
+    return h;
+}